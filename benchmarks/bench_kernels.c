@@ -0,0 +1,434 @@
+/* Micro-benchmarks of the expensive kernels on synthetic particle distributions.
+ *
+ * Each rank makes its share of the particles, which the domain decomposition then
+ * redistributes. Every kernel is timed separately, and the min, mean and max of the
+ * per-rank wall time are written by rank 0 as JSON, for comparison between commits.
+ *
+ * Usage: bench_kernels [-n ncbrt] [-r repeats] [-m memory MB] [-o output.json]
+ */
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <gsl/gsl_rng.h>
+
+#include <libgadget/allvars.h>
+#include <libgadget/config.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/gravity.h>
+#include <libgadget/petapm.h>
+#include <libgadget/density.h>
+#include <libgadget/hydra.h>
+#include <libgadget/fof.h>
+#include <libgadget/timestep.h>
+#include <libgadget/walltime.h>
+#include <libgadget/utils.h>
+#include <libgadget/utils/mpsort.h>
+
+/* Number of NFW halos in the clustered distribution, and the fraction of particles in them*/
+#define BENCH_NHALO 32
+#define BENCH_HALO_FRACTION 0.8
+#define BENCH_NFW_CONCENTRATION 10.
+#define BENCH_MAX_RESULTS 64
+
+enum BenchDistribution {
+    BENCH_UNIFORM = 0,
+    /* NFW halos on a uniform background*/
+    BENCH_CLUSTERED,
+    /* A grid with each particle displaced randomly within its cell*/
+    BENCH_GLASS,
+    BENCH_NDIST,
+};
+
+static const char * DistributionNames[BENCH_NDIST] = {"uniform", "clustered", "glass"};
+
+struct BenchResult {
+    const char * distribution;
+    const char * kernel;
+    double min, mean, max;
+};
+
+static struct BenchResult Results[BENCH_MAX_RESULTS];
+static int NResults;
+
+/* Reduce the per-rank time of a kernel and record it*/
+static void
+bench_record(const char * distribution, const char * kernel, const double dt)
+{
+    struct BenchResult * res = &Results[NResults];
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Allreduce(&dt, &res->min, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(&dt, &res->max, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(&dt, &res->mean, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    res->mean /= NTask;
+    res->distribution = distribution;
+    res->kernel = kernel;
+    message(0, "%-10s %-22s min %10.4f mean %10.4f max %10.4f s\n", distribution, kernel, res->min, res->mean, res->max);
+    if(NResults < BENCH_MAX_RESULTS - 1)
+        NResults++;
+}
+
+/* Radius in units of the scale radius enclosing a fraction frac of the NFW mass out to the concentration*/
+static double
+nfw_radius(const double frac)
+{
+    const double c = BENCH_NFW_CONCENTRATION;
+    const double mtot = log(1 + c) - c / (1 + c);
+    double lo = 0, hi = c;
+    int it;
+    for(it = 0; it < 50; it++) {
+        const double x = 0.5 * (lo + hi);
+        if(log(1 + x) - x / (1 + x) < frac * mtot)
+            lo = x;
+        else
+            hi = x;
+    }
+    return 0.5 * (lo + hi);
+}
+
+static double
+bench_wrap(double x)
+{
+    while(x >= All.BoxSize) x -= All.BoxSize;
+    while(x < 0) x += All.BoxSize;
+    return x;
+}
+
+/* Make numpart gas particles on this rank, a 1/NTask share of ncbrt^3.*/
+static void
+bench_make_particles(enum BenchDistribution dist, const int ncbrt, const int numpart, gsl_rng * r)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int64_t first = ((int64_t) ncbrt * ncbrt * ncbrt) * ThisTask / NTask;
+    const double cell = All.BoxSize / ncbrt;
+
+    /* The halos are the same on every rank*/
+    double halopos[BENCH_NHALO][3];
+    gsl_rng * hr = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(hr, 1);
+    int h, i, k;
+    for(h = 0; h < BENCH_NHALO; h++)
+        for(k = 0; k < 3; k++)
+            halopos[h][k] = All.BoxSize * gsl_rng_uniform(hr);
+    gsl_rng_free(hr);
+    /* Virial radius such that the halos are each several hundred times denser than the mean*/
+    const double rvir = All.BoxSize * cbrt(BENCH_HALO_FRACTION / BENCH_NHALO / 200. * 3 / (4 * M_PI));
+
+    for(i = 0; i < numpart; i++) {
+        const int64_t g = first + i;
+        memset(&P[i], 0, sizeof(P[i]));
+        switch(dist) {
+            case BENCH_UNIFORM:
+                for(k = 0; k < 3; k++)
+                    P[i].Pos[k] = All.BoxSize * gsl_rng_uniform(r);
+                break;
+            case BENCH_CLUSTERED:
+                if(gsl_rng_uniform(r) < BENCH_HALO_FRACTION) {
+                    const int halo = gsl_rng_uniform_int(r, BENCH_NHALO);
+                    const double rad = rvir / BENCH_NFW_CONCENTRATION * nfw_radius(gsl_rng_uniform(r));
+                    const double mu = 2 * gsl_rng_uniform(r) - 1;
+                    const double phi = 2 * M_PI * gsl_rng_uniform(r);
+                    const double dir[3] = {sqrt(1 - mu * mu) * cos(phi), sqrt(1 - mu * mu) * sin(phi), mu};
+                    for(k = 0; k < 3; k++)
+                        P[i].Pos[k] = bench_wrap(halopos[halo][k] + rad * dir[k]);
+                }
+                else
+                    for(k = 0; k < 3; k++)
+                        P[i].Pos[k] = All.BoxSize * gsl_rng_uniform(r);
+                break;
+            default:
+            {
+                const int64_t idx[3] = {g / ncbrt / ncbrt, (g / ncbrt) % ncbrt, g % ncbrt};
+                for(k = 0; k < 3; k++)
+                    P[i].Pos[k] = bench_wrap(cell * (idx[k] + 0.5 + 0.4 * (gsl_rng_uniform(r) - 0.5)));
+            }
+        }
+        P[i].Type = 0;
+        P[i].PI = i;
+        P[i].ID = g + 1;
+        P[i].Mass = 1;
+        P[i].GravCost = 1;
+        P[i].Hsml = 2 * cell;
+        P[i].Key = PEANO(P[i].Pos, All.BoxSize);
+        for(k = 0; k < 3; k++)
+            P[i].Vel[k] = gsl_rng_uniform(r) - 0.5;
+        memset(&SphP[i], 0, sizeof(SphP[i]));
+        SphP[i].base.ID = P[i].ID;
+        SphP[i].Entropy = 1;
+        SphP[i].Density = 1;
+        SphP[i].EgyWtDensity = 1;
+    }
+    PartManager->NumPart = numpart;
+    SlotsManager->info[0].size = numpart;
+}
+
+static void
+mp_bench_radix_key(const void * data, void * radix, void * arg)
+{
+    *(peano_t *) radix = *(const peano_t *) data;
+}
+
+/* Time each kernel on one distribution*/
+static void
+bench_distribution(enum BenchDistribution dist, const int ncbrt, const int repeats, PetaPM * pm, gsl_rng * r)
+{
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int numpart = ((int64_t) ncbrt * ncbrt * ncbrt) / NTask;
+    const char * name = DistributionNames[dist];
+    bench_make_particles(dist, ncbrt, numpart, r);
+
+    double tstart;
+    int rep;
+
+#define BENCH_TIME(kernel, code) do { \
+        double dt = 0; \
+        for(rep = 0; rep < repeats; rep++) { \
+            MPI_Barrier(MPI_COMM_WORLD); \
+            tstart = MPI_Wtime(); \
+            code; \
+            dt += MPI_Wtime() - tstart; \
+        } \
+        bench_record(name, kernel, dt / repeats); \
+    } while(0)
+
+    /* Sort a copy of the keys, as the domain and the FOF catalogue do*/
+    {
+        peano_t * keys = mymalloc("BenchKeys", PartManager->NumPart * sizeof(peano_t));
+        BENCH_TIME("mpsort_mpi", {
+            int i;
+            for(i = 0; i < PartManager->NumPart; i++)
+                keys[i] = P[i].Key;
+            mpsort_mpi(keys, PartManager->NumPart, sizeof(peano_t), mp_bench_radix_key, sizeof(peano_t), NULL, MPI_COMM_WORLD);
+        });
+        myfree(keys);
+    }
+
+    DomainDecomp ddecomp = {0};
+    BENCH_TIME("domain_decompose_full", {
+        if(rep > 0)
+            domain_free(&ddecomp);
+        domain_decompose_full(&ddecomp);
+    });
+
+    /* The same with the toptree built from a gathered sample of keys instead of merging the local
+     * toptrees. The later kernels use the merged toptree, so are comparable between commits.*/
+    {
+        DomainParams dp = get_domain_par();
+        dp.DomainSampledTopTree = 8;
+        set_domain_par(dp);
+        BENCH_TIME("domain_sampled_toptree", {
+            domain_free(&ddecomp);
+            domain_decompose_full(&ddecomp);
+        });
+        dp.DomainSampledTopTree = 0;
+        set_domain_par(dp);
+        domain_free(&ddecomp);
+        domain_decompose_full(&ddecomp);
+    }
+
+    ForceTree Tree = {0};
+    BENCH_TIME("force_tree_rebuild", {
+        force_tree_rebuild(&Tree, &ddecomp, All.BoxSize, 0);
+    });
+
+    /* gravpm_force frees the tree to save memory*/
+    BENCH_TIME("petapm_force", {
+        gravpm_force(pm, &Tree);
+        force_tree_rebuild(&Tree, &ddecomp, All.BoxSize, 0);
+    });
+
+    ActiveParticles act = {0};
+    act.NumActiveParticle = PartManager->NumPart;
+    const double rho0 = All.CP.Omega0 * 3 * All.CP.Hubble * All.CP.Hubble / (8 * M_PI * All.G);
+    BENCH_TIME("grav_short_tree", {
+        grav_short_tree(&act, pm, &Tree, rho0, 0, All.FastParticleType);
+    });
+
+    slots_allocate_sph_scratch_data(0, SlotsManager->info[0].size, &SlotsManager->sph_scratch);
+    BENCH_TIME("density", {
+        density(&act, 1, All.DensityIndependentSphOn, &Tree);
+    });
+    BENCH_TIME("hydro_force", {
+        hydro_force(&act, &Tree);
+    });
+    slots_free_sph_scratch_data(SphP_scratch);
+
+    BENCH_TIME("fof_fof", {
+        FOFGroups fof = fof_fof(&Tree, All.BoxSize, 0, MPI_COMM_WORLD);
+        fof_finish(&fof);
+    });
+
+#undef BENCH_TIME
+    force_tree_free(&Tree);
+    domain_free(&ddecomp);
+}
+
+/* Set the parameters the kernels read: a low resolution cosmological box at z = 9.*/
+static void
+bench_setup(const int ncbrt)
+{
+    All.BoxSize = 25000.;
+    All.NumThreads = omp_get_max_threads();
+    All.FastParticleType = 2;
+    All.CP.CMBTemperature = 2.7255;
+    All.CP.HubbleParam = 0.7;
+    All.CP.Omega0 = 0.3;
+    All.CP.OmegaCDM = 0.25;
+    All.CP.OmegaBaryon = 0.05;
+    All.CP.OmegaLambda = 0.7;
+    All.CP.Hubble = HUBBLE * 3.085678e21 / 1e5;
+    All.G = 43.0071;
+    All.UnitLength_in_cm = CM_PER_MPC / 1000.;
+    All.Time = 0.1;
+    init_cosmology(&All.CP, All.Time);
+    All.cf.a = All.Time;
+    All.cf.a2inv = 1 / (All.Time * All.Time);
+    All.cf.a3inv = 1 / (All.Time * All.Time * All.Time);
+    All.cf.fac_egy = pow(All.Time, 3 * GAMMA_MINUS1);
+    All.cf.hubble = hubble_function(&All.CP, All.Time);
+    All.cf.hubble_a2 = All.Time * All.Time * All.cf.hubble;
+
+    All.DensityOn = 1;
+    All.HydroOn = 1;
+    All.DensityKernelType = DENSITY_KERNEL_CUBIC_SPLINE;
+    All.DensityResolutionEta = 1.;
+    All.DesNumNgb = 33;
+    All.MaxNumNgbDeviation = 2;
+    All.ArtBulkViscConst = 0.75;
+    All.DensityContrastLimit = 100;
+    All.HydroCostFactor = 1;
+    All.BlackHoleNgbFactor = 2;
+    All.BlackHoleMaxAccretionRadius = 99999.;
+    All.MinGasHsml = 0;
+    All.MinEgySpec = 0;
+    strncpy(All.OutputDir, ".", 2);
+
+    int i;
+    for(i = 0; i < 6; i++)
+        GravitySofteningTable[i] = All.BoxSize / ncbrt / 30.;
+    init_forcetree_params(All.FastParticleType, GravitySofteningTable);
+
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 4;
+    dp.TopNodeAllocFactor = 0.5;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+
+    struct gravshort_tree_params treeacc = {0};
+    treeacc.ErrTolForceAcc = 0.005;
+    treeacc.BHOpeningAngle = 0.175;
+    treeacc.TreeUseBH = 1;
+    treeacc.Rcut = 7;
+    treeacc.TreeNodeCopy = 1;
+    treeacc.TreeParticleCopy = 1;
+    set_gravshort_treepar(treeacc);
+
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 0, "");
+    param_declare_double(ps, "FOFHaloLinkingLength", OPTIONAL, 0.2, "");
+    param_declare_int(ps, "FOFHaloMinLength", OPTIONAL, 32, "");
+    param_declare_int(ps, "FOFIncremental", OPTIONAL, 0, "");
+    param_declare_double(ps, "FOFSubhaloLinkingFraction", OPTIONAL, 0, "");
+    param_declare_double(ps, "MinFoFMassForNewSeed", OPTIONAL, 2, "");
+    set_fof_params(ps);
+    parameter_set_free(ps);
+    fof_init(All.BoxSize / ncbrt);
+
+    walltime_init(&All.CT);
+}
+
+/* Write the results as JSON on rank 0*/
+static void
+bench_write_json(const char * fname, const int ncbrt, const int repeats)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    if(ThisTask != 0)
+        return;
+    FILE * fd = fopen(fname, "w");
+    if(!fd)
+        endrun(1, "Could not open %s\n", fname);
+    fprintf(fd, "{\n  \"version\": \"%s\",\n  \"ranks\": %d,\n  \"threads\": %d,\n  \"ncbrt\": %d,\n  \"repeats\": %d,\n  \"results\": [\n",
+            GADGET_VERSION, NTask, omp_get_max_threads(), ncbrt, repeats);
+    int i;
+    for(i = 0; i < NResults; i++)
+        fprintf(fd, "    {\"distribution\": \"%s\", \"kernel\": \"%s\", \"min\": %g, \"mean\": %g, \"max\": %g}%s\n",
+            Results[i].distribution, Results[i].kernel, Results[i].min, Results[i].mean, Results[i].max,
+            i < NResults - 1 ? "," : "");
+    fprintf(fd, "  ]\n}\n");
+    fclose(fd);
+    message(0, "Wrote %s\n", fname);
+}
+
+int main(int argc, char **argv)
+{
+    int thread_provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    int ncbrt = 64, repeats = 3;
+    double memory = 4096;
+    char * output = "bench.json";
+    int opt;
+    while((opt = getopt(argc, argv, "n:r:m:o:")) != -1) {
+        switch(opt) {
+            case 'n': ncbrt = atoi(optarg); break;
+            case 'r': repeats = atoi(optarg); break;
+            case 'm': memory = atof(optarg); break;
+            case 'o': output = optarg; break;
+            default:
+                message(0, "Usage: %s [-n ncbrt] [-r repeats] [-m memory MB per node] [-o output.json]\n", argv[0]);
+                MPI_Finalize();
+                return 1;
+        }
+    }
+
+    tamalloc_init();
+    mymalloc_init(memory, 0);
+    init_endrun(0);
+
+    bench_setup(ncbrt);
+
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    /* Room for the imbalance of the clustered distribution after the exchange*/
+    const int maxpart = 2 * ((int64_t) ncbrt * ncbrt * ncbrt) / NTask + 1024;
+    particle_alloc_memory(maxpart);
+    slots_init(0.01 * maxpart, SlotsManager);
+    slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+    int atleast[6] = {0};
+    atleast[0] = maxpart;
+    slots_reserve(1, atleast, SlotsManager);
+
+    petapm_module_init(All.NumThreads);
+    PetaPM pm = {0};
+    const double Asmth = 1.25;
+    gravpm_init_periodic(&pm, All.BoxSize, Asmth, ncbrt, All.G);
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, Asmth);
+
+    message(0, "Benchmarking %d^3 particles on %d ranks with %d threads\n", ncbrt, NTask, omp_get_max_threads());
+
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(r, 100 + ThisTask);
+    int dist;
+    for(dist = 0; dist < BENCH_NDIST; dist++)
+        bench_distribution(dist, ncbrt, repeats, &pm, r);
+    gsl_rng_free(r);
+
+    bench_write_json(output, ncbrt, repeats);
+
+    petapm_destroy(&pm);
+    MPI_Finalize();
+    return 0;
+}
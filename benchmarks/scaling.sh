@@ -0,0 +1,86 @@
+#! /bin/bash
+#
+# Weak or strong scaling runs of the dm-50-512 benchmark.
+#
+# For each rank count this generates ICs with MP-GenIC, runs a fixed
+# number of PM steps of MP-Gadget and then summarises cpu.txt and the
+# treewalk statistics of all the runs with tools/scaling-report.py.
+#
+# Weak scaling keeps NPART^3 particles per rank at fixed resolution;
+# strong scaling keeps NPART^3 particles in total.
+
+usage() {
+    echo "Usage: $0 [-m weak|strong] [-n NPART] [-r \"RANKS\"] [-t THREADS] [-p PMSTEPS] [-c CODEDIR] prefix"
+    exit 1
+}
+
+mode=weak
+npart=64
+ranks="1 8 64"
+threads=${OMP_NUM_THREADS:-1}
+pmsteps=4
+codedir=$(cd `dirname $0`/..; pwd)
+mpirun=${MPIRUN:-mpirun}
+
+while getopts "m:n:r:t:p:c:" opt; do
+    case $opt in
+        m) mode=$OPTARG;;
+        n) npart=$OPTARG;;
+        r) ranks=$OPTARG;;
+        t) threads=$OPTARG;;
+        p) pmsteps=$OPTARG;;
+        c) codedir=$OPTARG;;
+        *) usage;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ "x$1" == "x" ]; then
+    usage
+fi
+if [ "$mode" != "weak" ] && [ "$mode" != "strong" ]; then
+    usage
+fi
+
+prefix=$1
+suite=$codedir/benchmarks/dm-50-512
+runs=""
+
+for np in $ranks; do
+    if [ "$mode" == "weak" ]; then
+        ngrid=`awk "BEGIN {printf \"%d\", $npart * $np^(1/3.) + 0.5}"`
+    else
+        ngrid=$npart
+    fi
+    # Keep the mass resolution of the 50 Mpc/h, 512^3 suite
+    box=`awk "BEGIN {print 50.0 * $ngrid / 512}"`
+    nmesh=$((2 * ngrid))
+    dir=$prefix/$mode-$np
+    mkdir -p $dir
+
+    for i in paramfile.genic paramfile.gadget powerspectrum-wmap9.txt; do
+        sed -e "s;@PREFIX@;$dir;" \
+            -e "s;^Ngrid *=.*;Ngrid = $ngrid;" \
+            -e "s;^BoxSize *=.*;BoxSize = $box;" \
+            -e "s;^Nmesh *=.*;Nmesh = $nmesh;" \
+            $suite/$i > $dir/$i
+    done
+    cat >> $dir/paramfile.gadget <<PARAMS
+
+# Scaling run
+MaxPMSteps = $pmsteps
+TreeWalkStatsFile = treewalk.csv
+PARAMS
+
+    echo "Running $mode scaling with $np ranks, $threads threads, Ngrid = $ngrid"
+    rm -f $dir/cpu.txt $dir/treewalk.csv
+    (cd $dir;
+     OMP_NUM_THREADS=$threads $mpirun -np $np $codedir/genic/MP-GenIC paramfile.genic > genic.log 2>&1 &&
+     OMP_NUM_THREADS=$threads $mpirun -np $np $codedir/gadget/MP-Gadget paramfile.gadget > gadget.log 2>&1) || {
+        echo "Run in $dir failed"
+        exit 1
+    }
+    runs="$runs $dir"
+done
+
+python3 $codedir/tools/scaling-report.py --mode $mode --output $prefix/scaling-$mode $runs
@@ -0,0 +1,141 @@
+/* Make the initial conditions in memory with libgenic and hand them straight to the
+ * particle manager, so a simulation may start without writing and reading an IC file.*/
+#include <math.h>
+#include <string.h>
+#include <mpi.h>
+
+#include <bigfile-mpi.h>
+#include <libgenic/allvars.h>
+#include <libgenic/proto.h>
+#include <libgadget/allvars.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/petaio.h>
+#include <libgadget/utils.h>
+
+#include "genic.h"
+
+/* libgenic reads its parameters into the All structure of the simulation,
+ * so the two sets of parameters are swapped in and out while the ICs are made.*/
+static struct global_data_all_processes GenICAll;
+static struct global_data_all_processes GadgetAll;
+
+/* Particle totals and the fraction of the neutrino mass in particles, for the IC file header*/
+static int64_t GenICNTotal[6];
+static double GenICNuFrac;
+
+static void
+swap_to_genic(void)
+{
+    GadgetAll = All;
+    All = GenICAll;
+    /* Keep the timers running*/
+    All.CT = GadgetAll.CT;
+}
+
+static void
+swap_to_gadget(void)
+{
+    GenICAll = All;
+    All = GadgetAll;
+    All.CT = GenICAll.CT;
+}
+
+/* Check that a cosmological parameter of the simulation matches the ICs, or take it from the ICs if unset*/
+static void
+match_cosmology(const char * name, double * gadget, const double genic)
+{
+    if(*gadget < 0)
+        *gadget = genic;
+    else if(fabs(*gadget - genic) > 1e-6 * fabs(genic))
+        endrun(0, "%s = %g for the simulation but %g in %s\n", name, *gadget, genic, All.GenICParamFile);
+}
+
+static void
+genic_ic_header(struct ICHeader * header)
+{
+    /* The GenIC parameters are read on top of the simulation parameters*/
+    GadgetAll = All;
+    read_parameterfile(All.GenICParamFile);
+    init_cosmology(&All.CP, All.TimeIC);
+    init_powerspectrum(ThisTask, All.TimeIC, All.UnitLength_in_cm, &All.CP, &All2.PowerP);
+
+    GenICNuFrac = genic_particle_totals(GenICNTotal);
+    memcpy(header->NTotal, GenICNTotal, sizeof(GenICNTotal));
+    compute_mass(header->MassTable, GenICNTotal[1], GenICNTotal[0], GenICNTotal[2], GenICNuFrac);
+    header->BoxSize = All.BoxSize;
+    header->Time = All.TimeIC;
+    header->UnitVelocity_in_cm_per_s = All.UnitVelocity_in_cm_per_s;
+    header->UnitLength_in_cm = All.UnitLength_in_cm;
+    header->UnitMass_in_g = All.UnitMass_in_g;
+    header->UsePeculiarVelocity = All.IO.UsePeculiarVelocity;
+    swap_to_gadget();
+
+    match_cosmology("Omega0", &All.CP.Omega0, GenICAll.CP.Omega0);
+    match_cosmology("OmegaBaryon", &All.CP.OmegaBaryon, GenICAll.CP.OmegaBaryon);
+    match_cosmology("OmegaLambda", &All.CP.OmegaLambda, GenICAll.CP.OmegaLambda);
+    match_cosmology("HubbleParam", &All.CP.HubbleParam, GenICAll.CP.HubbleParam);
+}
+
+/* Copy a chunk of particles made by libgenic to their place in the particle table*/
+static void
+copy_particles(IDGenerator * idgen, const int ptype, const uint64_t FirstID, struct ic_part_data * ICP, const int start, const int NumPart, void * userdata)
+{
+    const int * offset = (const int *) userdata;
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++) {
+        struct particle_data * part = &P[offset[ptype] + start + i];
+        int k;
+        for(k = 0; k < 3; k++) {
+            part->Pos[k] = ICP[i].Pos[k];
+            part->Vel[k] = ICP[i].Vel[k];
+        }
+        part->ID = idgen_create_id_from_index(idgen, start + i) + FirstID;
+    }
+}
+
+static void
+genic_ic_particles(MPI_Comm Comm)
+{
+    int NLocal[6];
+    swap_to_genic();
+    genic_count_particles(NLocal);
+    swap_to_gadget();
+
+    petaio_alloc_particles(NLocal, Comm);
+
+    /* The particles are ordered by type*/
+    int offset[6] = {0};
+    int ptype;
+    for(ptype = 1; ptype < 6; ptype++)
+        offset[ptype] = offset[ptype - 1] + NLocal[ptype - 1];
+
+    const int WriteICs = All.GenICWriteICs;
+    swap_to_genic();
+    BigFile bf = {0};
+    if(WriteICs) {
+        char * fname = fastpm_strdup_printf("%s/%s", All.OutputDir, All.InitCondFile);
+        message(0, "Writing the initial conditions to %s\n", fname);
+        if(0 != big_file_mpi_create(&bf, fname, MPI_COMM_WORLD)) {
+            endrun(0, "%s\n", big_file_get_error_message());
+        }
+        myfree(fname);
+        saveheader(&bf, GenICNTotal[1], GenICNTotal[0], GenICNTotal[2], GenICNuFrac);
+        save_all_transfer_tables(&bf, ThisTask);
+    }
+
+    genic_make_particles(WriteICs ? &bf : NULL, copy_particles, offset);
+
+    if(WriteICs)
+        big_file_mpi_close(&bf, MPI_COMM_WORLD);
+    swap_to_gadget();
+}
+
+void
+init_genic_ics(void)
+{
+    if(strlen(All.GenICParamFile) == 0)
+        return;
+    message(0, "Initial conditions will be made in memory from %s\n", All.GenICParamFile);
+    petaio_set_ic_generator(genic_ic_header, genic_ic_particles);
+}
@@ -0,0 +1,8 @@
+#ifndef GADGET_GENIC_H
+#define GADGET_GENIC_H
+
+/* If GenICParamFile is set, make the initial conditions in memory with libgenic
+ * when the simulation starts from them, instead of reading InitCondFile.*/
+void init_genic_ics(void);
+
+#endif
@@ -19,6 +19,7 @@
 #include <libgadget/utils.h>
 
 #include "params.h"
+#include "genic.h"
 
 void gsl_handler (const char * reason, const char * file, int line, int gsl_errno)
 {
@@ -48,7 +49,9 @@ int main(int argc, char **argv)
     if(argc < 2)
     {
         message(0, "Parameters are missing.\n");
-        message(0, "Call with <ParameterFile> [<RestartFlag>] [<RestartSnapNum>]\n\n");
+        message(0, "Call with <ParameterFile> [<RestartFlag>] [<RestartSnapNum>]\n");
+        message(0, "or --ensemble <ListFile> [<RestartFlag>] [<RestartSnapNum>] to run the simulations\n"
+                   "of the parameter files in ListFile, one per line, at once on equal shares of the ranks.\n\n");
         message(0, "   RestartFlag    Action\n");
         message(0, "       1          Restart from last snapshot (LastSnapNum.txt) and continue simulation\n");
         message(0, "       2          Restart from specified snapshot (-1 for Initial Condition) and continue simulation\n");
@@ -75,6 +78,39 @@ int main(int argc, char **argv)
 
     tamalloc_init();
 
+    report_thread_affinity(MPIU_COMM_JOB);
+
+    /* In an ensemble, each simulation runs on its own ranks, from here on MPI_COMM_WORLD*/
+    if(!strcmp(argv[1], "--ensemble")) {
+        if(argc < 3)
+            endrun(0, "--ensemble needs a file listing the parameter files\n");
+        char * list = MPIU_file_get_content(argv[2], 0, MPIU_COMM_JOB);
+        if(!list)
+            endrun(0, "Could not read the ensemble list %s\n", argv[2]);
+        char * files[4096];
+        int nmember = 0;
+        char * saveptr;
+        char * line;
+        for(line = strtok_r(list, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+            line += strspn(line, " \t");
+            if(*line == '\0' || *line == '#')
+                continue;
+            if(nmember == sizeof(files) / sizeof(files[0]))
+                endrun(0, "Too many simulations in %s\n", argv[2]);
+            line[strcspn(line, " \t\r")] = '\0';
+            files[nmember++] = line;
+        }
+        const int member = MPIU_split_ensemble(nmember);
+        /* The parameter file of this member replaces the list in the arguments*/
+        argv[2] = strdup(files[member]);
+        argv++;
+        argc--;
+        ta_free(list);
+        MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+        MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+        message(0, "Simulation %d of %d in the ensemble runs %s on %d MPI Ranks.\n", member, nmember, argv[1], NTask);
+    }
+
     read_parameter_file(argv[1]);	/* ... read in parameters for this run */
 
     int RestartFlag, RestartSnapNum;
@@ -107,7 +143,8 @@ int main(int argc, char **argv)
     gsl_set_error_handler(gsl_handler);
 
     /*Initialize the memory manager*/
-    mymalloc_init(All.MaxMemSizePerNode);
+    mymalloc_init(All.MaxMemSizePerNode, All.HugePages);
+    hbmalloc_init(All.HBMMemSizePerNode);
 
     /* Make sure memory has finished initialising on all ranks before doing more.
      * This may improve stability */
@@ -115,6 +152,9 @@ int main(int argc, char **argv)
 
     init_endrun(All.ShowBacktrace);
 
+    /* Make the initial conditions in memory, if asked*/
+    init_genic_ics();
+
     begrun(RestartSnapNum);
 
     switch(RestartFlag) {
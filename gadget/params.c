@@ -14,6 +14,9 @@
 #include <libgadget/blackhole.h>
 #include <libgadget/fof.h>
 #include <libgadget/cooling_qso_lightup.h>
+#include <libgadget/lightcone.h>
+#include <libgadget/lyaskewers.h>
+#include <libgadget/sanitychecks.h>
 
 static int
 BlackHoleFeedbackMethodAction (ParameterSet * ps, char * name, void * data)
@@ -52,7 +55,7 @@ StarformationCriterionAction(ParameterSet * ps, char * name, void * data)
  */
 
 static int
-OutputListAction(ParameterSet * ps, char * name, void * data)
+parse_output_list(ParameterSet * ps, char * name, double * OutputListTimes, int * OutputListLength, int maxcount)
 {
     char * outputlist = param_get_string(ps, name);
     char * strtmp = fastpm_strdup(outputlist);
@@ -67,16 +70,15 @@ OutputListAction(ParameterSet * ps, char * name, void * data)
 /*     message(1, "Found %d times in output list.\n", count); */
 
     /*Allocate enough memory*/
-    All.OutputListLength = count;
-    int maxcount = sizeof(All.OutputListTimes) / sizeof(All.OutputListTimes[0]);
+    *OutputListLength = count;
     if(maxcount > (int) MAXSNAPSHOTS)
         maxcount = MAXSNAPSHOTS;
-    if(All.OutputListLength > maxcount) {
-        message(1, "Too many entries (%d) in the OutputList, can take no more than %d.\n", All.OutputListLength, maxcount);
+    if(*OutputListLength > maxcount) {
+        message(1, "Too many entries (%d) in the %s, can take no more than %d.\n", *OutputListLength, name, maxcount);
         return 1;
     }
     /*Now read in the values*/
-    for(count=0,token=strtok(outputlist,","); count < All.OutputListLength && token; count++, token=strtok(NULL,","))
+    for(count=0,token=strtok(outputlist,","); count < *OutputListLength && token; count++, token=strtok(NULL,","))
     {
         /* Skip a leading quote if one exists.
          * Extra characters are ignored by atof, so
@@ -89,13 +91,54 @@ OutputListAction(ParameterSet * ps, char * name, void * data)
         if(a < 0.0) {
             endrun(1, "Requesting a negative output scaling factor a = %g\n", a);
         }
-        All.OutputListTimes[count] = a;
-/*         message(1, "Output at: %g\n", All.OutputListTimes[count]); */
+        OutputListTimes[count] = a;
+/*         message(1, "Output at: %g\n", OutputListTimes[count]); */
     }
     myfree(strtmp);
     return 0;
 }
 
+static int
+OutputListAction(ParameterSet * ps, char * name, void * data)
+{
+    return parse_output_list(ps, name, All.OutputListTimes, &All.OutputListLength,
+            sizeof(All.OutputListTimes) / sizeof(All.OutputListTimes[0]));
+}
+
+static int
+LightOutputListAction(ParameterSet * ps, char * name, void * data)
+{
+    return parse_output_list(ps, name, All.LightOutputListTimes, &All.LightOutputListLength,
+            sizeof(All.LightOutputListTimes) / sizeof(All.LightOutputListTimes[0]));
+}
+
+static int
+LyaSkewerOutputListAction(ParameterSet * ps, char * name, void * data)
+{
+    return parse_output_list(ps, name, All.LyaSkewerOutputListTimes, &All.LyaSkewerOutputListLength,
+            sizeof(All.LyaSkewerOutputListTimes) / sizeof(All.LyaSkewerOutputListTimes[0]));
+}
+
+static int
+cmp_double(const void * a, const void * b)
+{
+    const double da = *(const double *) a;
+    const double db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+/* The density mesh is written at the first PM step after each entry, so the list must be sorted.*/
+static int
+DensityMeshOutputListAction(ParameterSet * ps, char * name, void * data)
+{
+    int ret = parse_output_list(ps, name, All.DensityMeshOutputListTimes, &All.DensityMeshOutputListLength,
+            sizeof(All.DensityMeshOutputListTimes) / sizeof(All.DensityMeshOutputListTimes[0]));
+    if(ret)
+        return ret;
+    qsort(All.DensityMeshOutputListTimes, All.DensityMeshOutputListLength, sizeof(double), cmp_double);
+    return 0;
+}
+
 static ParameterSet *
 create_gadget_parameter_set()
 {
@@ -103,6 +146,8 @@ create_gadget_parameter_set()
 
     param_declare_string(ps, "InitCondFile", REQUIRED, NULL, "Path to the Initial Condition File");
     param_declare_string(ps, "OutputDir",    REQUIRED, NULL, "Prefix to the output files");
+    param_declare_string(ps, "GenICParamFile", OPTIONAL, "", "If set, when starting from the initial conditions they are made in memory by GenIC from this parameter file, instead of read from InitCondFile.");
+    param_declare_int(ps, "GenICWriteICs", OPTIONAL, 0, "If 1, the initial conditions made from GenICParamFile are also written to the OutputDir and FileBase of that file.");
 
     static ParameterEnum DensityKernelTypeEnum [] = {
         {"cubic", DENSITY_KERNEL_CUBIC_SPLINE},
@@ -115,8 +160,34 @@ create_gadget_parameter_set()
     param_declare_string(ps, "FOFFileBase", OPTIONAL, "PIG", "Base name of the fof files, _%03d will be appended to the name.");
     param_declare_string(ps, "EnergyFile", OPTIONAL, "energy.txt", "File to output energy statistics.");
     param_declare_int(ps,    "OutputEnergyDebug", OPTIONAL, 0, "Should we output energy statistics to energy.txt");
+    param_declare_int(ps,    "OutputEnergyTemperature", OPTIONAL, 0, "Include the mean gas temperature in the energy statistics. This solves the ionization equilibrium for every gas particle, so is not cheap.");
     param_declare_string(ps, "CpuFile", OPTIONAL, "cpu.txt", "File to output cpu usage information");
+    param_declare_string(ps, "TraceFile", OPTIONAL, "", "If set, each rank writes an event trace of the timeline (walltime regions and treewalk phases) to TraceFile.<rank>.json in the Chrome trace format, which Perfetto can read.");
+    param_declare_int(ps, "PerfCounters", OPTIONAL, 0, "If 1, count cycles, instructions and last level cache misses in each timed region with perf_event_open, and add them to CpuFile. Needs a kernel perf_event_paranoid setting which allows it.");
+    param_declare_int(ps, "AggregateRankMessages", OPTIONAL, 0, "If 1, the messages which single ranks print during a step, such as a full export buffer, are buffered and printed by rank 0 at the end of the step, once for each kind of message with the number of ranks and times it happened. Useful on many ranks.");
     param_declare_string(ps, "OutputList", REQUIRED, NULL, "List of output scale factors.");
+    param_declare_string(ps, "LightOutputList", OPTIONAL, "", "List of scale factors for light output snapshots, which are for analysis only and cannot be used to restart.");
+    param_declare_string(ps, "LightOutputFileBase", OPTIONAL, "LIGHT", "Base name of the light output snapshots, _%03d will be appended to the name.");
+    param_declare_string(ps, "LightOutputBlocks", OPTIONAL, "Position,Velocity,Mass,ID", "Comma separated list of the blocks in the light output snapshots. Empty for all blocks.");
+    param_declare_string(ps, "LyaSkewerOutputList", OPTIONAL, "", "List of scale factors at which the Lyman-alpha optical depth along sightlines through the gas is written to LyaSkewers_%03d, instead of a full snapshot.");
+    param_declare_int(ps, "LyaSkewerNum", OPTIONAL, 100, "Number of Lyman-alpha sightlines along each axis, at random positions in the transverse plane.");
+    param_declare_int(ps, "LyaSkewerNpix", OPTIONAL, 1024, "Velocity pixels of each Lyman-alpha sightline. Each rank holds all sightlines while they are computed, 24 * LyaSkewerNum * LyaSkewerNpix bytes.");
+    param_declare_double(ps, "SanityCheckFraction", OPTIONAL, 0, "If non-zero, check this fraction of the particles every SanityCheckEvery steps: their drift time, finite positions and velocities, the ID of their slot, and the uniqueness of their IDs. A different fraction is checked each time, so all particles are checked over 1/SanityCheckFraction checks. The density mesh of the next PM step is also verified. 0 disables the checks, which always run in DEBUG builds.");
+    param_declare_int(ps, "SanityCheckEvery", OPTIONAL, 1, "Steps between the sampled sanity checks.");
+    param_declare_int(ps, "LyaSkewerSeed", OPTIONAL, 1, "Random seed of the Lyman-alpha sightline positions. The same seed gives the same sightlines at every output.");
+    param_declare_int(ps, "LightOutputSinglePrecision", OPTIONAL, 1, "Store double precision blocks of the light output snapshots, such as Position, in single precision.");
+    param_declare_string(ps, "DensityMeshOutputList", OPTIONAL, "", "List of scale factors at which the first PM step at or after each writes the overdensity on a coarse mesh to DensityMesh_%03d. The mesh is binned from the PM mass mesh, so needs no extra FFT.");
+    param_declare_int(ps, "DensityMeshNmesh", OPTIONAL, 64, "Cells per side of the coarse mesh written at DensityMeshOutputList. Must divide Nmesh.");
+    param_declare_int(ps, "InitHsmlMeshNmesh", OPTIONAL, 0, "Cells per side of the mesh on which the gas mass is painted to guess the smoothing lengths of the initial conditions, and of restarts without them, before the first density iteration. 0 uses half of Nmesh. Negative guesses from the tree nodes instead.");
+    param_declare_double(ps, "LightconeZmin", OPTIONAL, 0.1, "Dark matter particles crossing the past lightcone of an observer at the origin above this redshift are written to Lightcone. Requires compiling with LIGHTCONE.");
+    param_declare_double(ps, "LightconeZmax", OPTIONAL, 80.0, "Lightcone particles are written below this redshift.");
+    param_declare_double(ps, "LightconeReferenceRedshift", OPTIONAL, 2.0, "All lightcone crossings are written below this redshift; above it a fraction falling as the fourth power of the distance.");
+    param_declare_int(ps, "LightconeHealpixNside", OPTIONAL, 16, "Each flush of the lightcone is sorted by the HEALPix ring pixel at this Nside, stored in the Pixel block.");
+    param_declare_double(ps, "LightconeBufferMB", OPTIONAL, 64, "Crossing particles are buffered until all ranks hold this many MB, then appended to the lightcone in the background. Sync points always append.");
+    param_declare_int(ps, "LightconeParticles", OPTIONAL, 1, "If 1, write the dark matter particles crossing the lightcone to Lightcone. Set to 0 to make only the maps.");
+    param_declare_int(ps, "LightconeMapNside", OPTIONAL, 0, "If > 0, add the mass of all particles crossing the lightcone to HEALPix ring maps of this Nside, written to LightconeMaps. Every rank holds the whole maps, 96 * Nside^2 bytes each.");
+    param_declare_int(ps, "LightconeMapNshell", OPTIONAL, 10, "Number of lightcone map shells, even in comoving distance between LightconeZmax and LightconeZmin. Each shell ends on the first step past its inner edge.");
+    param_declare_int(ps, "LightconeMapGas", OPTIONAL, 0, "If 1, also make lightcone maps of the gas mass.");
 
     /*Cosmology parameters*/
     param_declare_double(ps, "Omega0", REQUIRED, 0.2814, "Total matter density at z=0");
@@ -135,23 +206,61 @@ create_gadget_parameter_set()
     param_declare_int(ps,    "OutputDebugFields", OPTIONAL, 0, "Save a large number of debug fields in snapshots.");
     param_declare_int(ps,    "ShowBacktrace", OPTIONAL, 1, "Print a backtrace on crash. Hangs on stampede.");
     param_declare_double(ps,    "MaxMemSizePerNode", OPTIONAL, 0.6, "Pre-allocate this much memory per computing node/ host, in MB. Defaults to 60\% of total available memory per node. Passing < 1 allocates a fraction of total available memory per node.");
+    static ParameterEnum HugePagesEnum [] = {
+        {"none", ALLOC_PAGES_NORMAL},
+        {"transparent", ALLOC_PAGES_TRANSPARENT},
+        {"2MB", ALLOC_PAGES_HUGE_2MB},
+        {"1GB", ALLOC_PAGES_HUGE_1GB},
+        {NULL, ALLOC_PAGES_NORMAL},
+    };
+    param_declare_double(ps,    "HBMMemSizePerNode", OPTIONAL, 0, "Reserve this much high-bandwidth memory (KNL MCDRAM or HBM) per node, in MB, for the tree nodes, the treewalk import buffers and the PM mesh. Blocks which do not fit go to the main allocator, as does everything if this is 0 or a node has no high-bandwidth memory. Requires compiling with USE_MEMKIND.");
+    param_declare_enum(ps,    "HugePages", HugePagesEnum, OPTIONAL, "none", "Back the memory from MaxMemSizePerNode with huge pages, to reduce TLB misses in the tree walks. transparent asks the kernel for transparent huge pages. 2MB and 1GB use the hugetlbfs pool, falling back to smaller huge pages, then transparent huge pages, if the pool is empty.");
     param_declare_double(ps, "AutoSnapshotTime", OPTIONAL, 0, "Seconds after which to automatically generate a snapshot if nothing is output.");
 
     param_declare_double(ps, "TimeMax", OPTIONAL, 1.0, "Scale factor to end run.");
     param_declare_double(ps, "TimeLimitCPU", REQUIRED, 0, "CPU time to run for in seconds. Code will stop if it notices that the time to end of the next PM step is longer than the remaining time.");
+    param_declare_int(ps, "BuddyCheckpointEvery", OPTIONAL, 0, "If > 0, every this many PM steps each rank sends a copy of its particles and slots to a buddy rank on another node, which keeps it in memory. The copy is the size of the particle data, so leave room for it outside the main arena. 0 disables the copies.");
+    param_declare_int(ps, "MaxPMSteps", OPTIONAL, 0, "Stop the run, without writing a snapshot, after this many PM steps. 0 means no limit. Used by the scaling benchmarks.");
 
     param_declare_int   (ps, "DomainOverDecompositionFactor", OPTIONAL, 4, "Create on average this number of sub domains on a MPI rank. Load balancer will then move these subdomains around to equalize the work per rank. Higher numbers improve the load balancing but make domain more expensive.");
+    param_declare_int   (ps, "DomainOverDecompositionMax", OPTIONAL, 0, "If larger than DomainOverDecompositionFactor, tune the number of sub domains per MPI rank between DomainOverDecompositionFactor and this after every full domain decomposition: more when the work is not balanced, fewer when it is, so the top tree is no larger than needed. 0 disables tuning.");
+    param_declare_double(ps, "DomainTargetImbalance", OPTIONAL, 0.1, "With DomainOverDecompositionMax, the number of sub domains per rank grows when the most loaded rank has more than (1 + this) times the mean work, and shrinks when it has less than (1 + this/4) times the mean work.");
     param_declare_double(ps, "RandomParticleOffset", OPTIONAL, 8., "Internally shift the particles within a periodic box by a random fraction of a PM grid cell each domain decomposition, ensuring that tree openings are decorrelated between timesteps. This shift is subtracted before particles are saved.");
 
     param_declare_int   (ps, "DomainUseGlobalSorting", OPTIONAL, 1, "Determining the initial refinement of chunks globally. Enabling this produces better domains at costs of slowing down the domain decomposition.");
+    param_declare_double(ps, "DomainRebalanceThreshold", OPTIONAL, 0, "If non-zero, on steps without a full domain decomposition, move TopLeaves between ranks neighbouring along the Peano curve when the most loaded rank has more than (1 + this) times the mean work. Zero disables incremental rebalancing.");
+    param_declare_int   (ps, "DomainRebalanceMaxLeaves", OPTIONAL, 2, "Largest number of TopLeaves moved across each domain boundary by an incremental rebalance.");
+    param_declare_int   (ps, "DomainSampledTopTree", OPTIONAL, 0, "If non-zero, build the domain toptree from this many sampled particle keys per TopLeaf, gathered to every rank, and then refine it with the exact costs. This avoids merging the toptrees of all ranks pairwise, which is slow at large rank counts. 0 merges the local toptrees.");
+    param_declare_int   (ps, "DomainCheckIDUniqueness", OPTIONAL, 0, "If non-zero, check that the particle IDs are unique after every full domain decomposition, by hashing the IDs to ranks with one exchange. A value N larger than 1 checks a different 1/N of the IDs each time, so every ID is checked over N decompositions. 0 disables the check.");
+    param_declare_int   (ps, "DomainMaintainSort", OPTIONAL, 1, "Sort the particles and their slots by Peano key after every domain exchange, not only after a full domain decomposition, so particles close in space are close in memory for the tree walks.");
+    param_declare_int   (ps, "DomainMeasuredCost", OPTIONAL, 0, "Balance the domains by the wall time measured for each particle in all tree walks (gravity, density, hydro, black holes) on its last active step, instead of the interaction counts in GravCost.");
     param_declare_double(ps, "ErrTolIntAccuracy", OPTIONAL, 0.02, "Controls the length of the short-range timestep. Smaller values are shorter timesteps.");
     param_declare_double(ps, "ErrTolForceAcc", OPTIONAL, 0.002, "Force accuracy required from tree. Controls tree opening criteria. Lower values are more accurate.");
     param_declare_double(ps, "BHOpeningAngle", OPTIONAL, 0.175, "Barnes-Hut opening angle. Alternative purely geometric tree opening angle. Lower values are more accurate.");
     param_declare_double(ps, "TreeRcut", OPTIONAL, 6, "Number of mesh cells at which we cease walking.");
+    param_declare_int(ps, "TreeParticleCopy", OPTIONAL, 1, "If 1, the short-range tree walk reads a compact copy of the particle positions, masses and softenings, which uses less memory bandwidth. Costs 32 bytes per particle during the walk.");
+    param_declare_int(ps, "TreeNodeCopy", OPTIONAL, 1, "If 1, the short-range tree walk reads a compact single precision copy of the tree nodes, 64 bytes per node, which fits more of the tree in cache. If 0 the walk reads the full tree nodes.");
+    param_declare_int(ps, "TreeQuadrupole", OPTIONAL, 0, "If 1, the short-range tree force includes the quadrupole moments of the tree nodes. The relative opening criterion is then one order higher, so ErrTolForceAcc may be larger for the same accuracy. Costs 24 bytes per node during the walk.");
+    param_declare_int(ps, "TreeGroupWalk", OPTIONAL, 0, "If 1, active particles in the same tree leaf walk the short-range gravity tree together, using an opening criterion conservative for the whole group.");
+    param_declare_int(ps, "TreeLeafRanges", OPTIONAL, 1, "If 1, store the particles of each tree leaf contiguously, so the neighbour and short-range gravity walks read a leaf as one range instead of following a linked list. Costs 4 bytes per particle and per tree node.");
+    param_declare_int(ps, "TreeMixedPrecision", OPTIONAL, 0, "If 1, the short-range gravity kernel computes each interaction in single precision from the offset to the target particle, and sums the forces in double precision. The vectorized loop then has twice as many lanes. This adds a relative force error of a few times 1e-6, far below the tree opening error.");
+    param_declare_int(ps, "TreeOffload", OPTIONAL, 0, "If 1, compute the short-range force from local particles on an accelerator with OpenMP target offload. Requires compiling with TREE_OFFLOAD. Not compatible with TreeQuadrupole.");
     param_declare_int(ps, "TreeUseBH", OPTIONAL, 2, "If 1, use Barnes-Hut opening angle rather than the standard Gadget acceleration based opening angle. If 2, use BH criterion for the first timestep only, before we have relative accelerations.");
     param_declare_double(ps, "Asmth", OPTIONAL, 1.5, "The scale of the short-range/long-range force split in units of FFT-mesh cells."
                                                       "Larger values suppresses grid anisotropy. ShortRangeForceWindowType = erfc supports any value. 'exact' only supports 1.5. ");
     param_declare_int(ps,    "Nmesh", OPTIONAL, -1, "Size of the PM grid on which to compute the long-range force.");
+    param_declare_int(ps,    "PMBatchTransforms", OPTIONAL, 0, "If 1, the PM potential and force components are transformed to real space with one batched FFT and exchanged in one message. Needs memory for four meshes at once.");
+    param_declare_int(ps,    "PMAssignmentOrder", OPTIONAL, 2, "Order of the mass assignment window used to paint the PM mesh and read out the forces: 2 is CIC, 3 is TSC and 4 is PCS. Higher orders suppress aliasing, so a coarser Nmesh gives the same force accuracy.");
+    param_declare_int(ps,    "PMInterlace", OPTIONAL, 0, "If 1, also paint and read out on a PM mesh shifted by half a cell and average the two, cancelling the leading aliasing terms. Doubles the FFTs and the mesh memory of the PM step.");
+    param_declare_int(ps,    "PMLayoutCache", OPTIONAL, 1, "If 1, keep the PM pencil layout between PM steps and reuse it while the mesh regions are unchanged and no mass has moved outside the cached pencils, skipping the pencil exchange.");
+    param_declare_int(ps,    "PMOverlapSph", OPTIONAL, 0, "If 1 and PMOverlapTree is set, post the PM density exchange before the density and hydro walks as well, so it overlaps them too. The mesh is then held during the SPH walks, so the peak memory is higher still.");
+    param_declare_int(ps,    "PMOverlapTree", OPTIONAL, 0, "If 1, paint the PM mesh and post the nonblocking exchange of the density before the short-range tree walk, and finish the PM force after it. The tree is kept during the PM step instead of being freed and rebuilt, so the peak memory is higher.");
+    param_declare_int(ps,    "PMZoomNmesh", OPTIONAL, 0, "If > 0, size of a second PM mesh covering the particles of type PMZoomType, padded by the tree cut of the main mesh. It adds the force between the two split scales, so the tree walk for particles in the region only reaches Asmth * TreeRcut cells of the zoom mesh. Not supported with TreeOffload.");
+    param_declare_int(ps,    "PMZoomType", OPTIONAL, 1, "Particle type whose extent defines the zoom PM region, usually the high resolution particles of a zoom simulation.");
+    param_declare_int(ps,    "PMRanks", OPTIONAL, 0, "If > 0, run the PM FFTs on this many ranks, spread evenly over all ranks. Every rank still paints and reads out its own particles, and the mesh cells are sent to the FFT ranks in the region exchange, so the FFT transposes involve only the FFT ranks. 0 uses all ranks.");
+    param_declare_int(ps,    "PMInPlace", OPTIONAL, 0, "If 1, run the PM FFTs in place, so that a PM step holds at most two mesh sized buffers instead of three. The size of the buffers is reported at startup. Not compatible with PMBatchTransforms.");
+    param_declare_int(ps,    "PMFusedReadout", OPTIONAL, 0, "If 1, read out the PM potential and the three force components in one pass over the particles, computing the assignment window of each particle once. Needs memory for four copies of the local PM mesh: if that is not free on every rank, the fields are read out one at a time. Batched transforms always read out this way.");
+    param_declare_int(ps,    "PMOffload", OPTIONAL, 0, "If 1, paint the PM mass and interpolate the PM forces to the particles on an accelerator with OpenMP target offload. The FFTs and transfer functions stay on the host. Requires compiling with PM_OFFLOAD.");
 
     static ParameterEnum ShortRangeForceWindowTypeEnum [] = {
         {"exact", SHORTRANGE_FORCE_WINDOW_TYPE_EXACT},
@@ -159,6 +268,7 @@ create_gadget_parameter_set()
         {NULL, SHORTRANGE_FORCE_WINDOW_TYPE_EXACT },
     };
     param_declare_enum(ps,    "ShortRangeForceWindowType", ShortRangeForceWindowTypeEnum, OPTIONAL, "exact", "type of shortrange window, exact or erfc (default is exact) ");
+    param_declare_int(ps,    "ShortRangePolyOrder", OPTIONAL, 0, "If > 0, the short-range gravity kernel evaluates the window with a Chebyshev series of this many terms, at most 32, instead of interpolating a table, so the vectorized loop does no gathers. 20 terms match the accuracy of the table, 2e-5, for the erfc window. The calibrated exact window is noisy and is only fit to about 4e-4. 0 uses the table.");
 
     param_declare_double(ps, "MinGasHsmlFractional", OPTIONAL, 0, "Minimal gas Hsml as a fraction of gravity softening.");
     param_declare_double(ps, "MaxGasVel", OPTIONAL, 3e5, "Maximal limit on the gas velocity in km/s. By default speed of light.");
@@ -167,6 +277,8 @@ create_gadget_parameter_set()
     param_declare_double(ps, "MaxSizeTimestep", OPTIONAL, 0.1, "Maximum size of the PM timestep (as delta-a).");
     param_declare_double(ps, "MinSizeTimestep", OPTIONAL, 0, "Minimum size of the PM timestep.");
     param_declare_int(ps, "ForceEqualTimesteps", OPTIONAL, 0, "Force all (tree) timesteps to be the same, and equal to the smallest required.");
+    param_declare_int(ps, "TimestepLimiterReport", OPTIONAL, 0, "Print how many particles in each timebin had their timestep set by each criterion: acceleration, Courant, BH accretion, BH neighbours, gas neighbours, the maximum or the minimum step.");
+    param_declare_int(ps, "NgbTimeBinLimit", OPTIONAL, 0, "If > 0, limit the timestep of gas particles to 2^NgbTimeBinLimit times the shortest timestep of their SPH neighbours, and wake up inactive gas particles next to particles on shorter steps. 2 is a typical value. Off by default.");
 
     /* MaxRMSDisplacementFac = 0.1 increases the power on large scales by a small constant factor of 1.0005. */
     param_declare_double(ps, "MaxRMSDisplacementFac", OPTIONAL, 0.2, "Controls the length of the PM timestep. Max RMS displacement per timestep in units of the mean particle separation.");
@@ -185,6 +297,16 @@ create_gadget_parameter_set()
 
     param_declare_int(ps, "EnableAggregatedIO", OPTIONAL, 0, "Use the Aggregated IO policy for small data set (Experimental).");
     param_declare_int(ps, "AggregatedIOThreshold", OPTIONAL, 1024 * 1024 * 256, "Max number of bytes on a writer before reverting to throttled IO.");
+    param_declare_int(ps, "AsyncSnapshot", OPTIONAL, 0, "Copy snapshots to staging memory outside the main arena and write them from a helper thread, overlapping the following timesteps.");
+    param_declare_string(ps, "LocalCheckpointDir", OPTIONAL, "", "If set, snapshots are written to this faster directory, such as a burst buffer, and then copied to OutputDir by a helper thread on each rank while the run continues. It must be visible to every rank. A snapshot is listed in Snapshots.txt once the copy is done, and restarts read the copy here if it is complete. AsyncSnapshot is not used for these snapshots.");
+    param_declare_int(ps, "IOAggregatorGroupSize", OPTIONAL, 0, "If > 1, each group of this many consecutive ranks ships its snapshot data to the first rank of the group, which alone does the file I/O. Set to the number of ranks per node for one I/O rank per node.");
+    param_declare_int(ps, "SnapshotCompressIntegers", OPTIONAL, 0, "Store integer snapshot blocks, such as ID, in the narrowest integer type holding all their values. Lossless.");
+    param_declare_double(ps, "SnapshotVelocityTolerance", OPTIONAL, 0, "If > 0, store the velocities of the FOF particle and light snapshot outputs as 16-bit integers with at most this absolute error, in the units of the Velocity block. Restart snapshots keep exact velocities. Blocks with too large a range are stored unchanged.");
+    param_declare_int(ps, "SnapshotReadAhead", OPTIONAL, 0, "When reading a snapshot or IC, read the next block in a helper thread while the current block is unpacked. Every rank reads at once, so this is only done when NumWriters is the number of ranks (the default), and uses memory for two blocks.");
+    param_declare_int(ps, "DeltaCheckpointEvery", OPTIONAL, 0, "If > 1, only every this many snapshots is written in full. The others are delta snapshots, which omit the blocks which do not change after a particle is created, such as the dark matter mass and the star formation times, for the particles in the last full snapshot. A restart from a delta snapshot reads these blocks from that full snapshot, which must be kept.");
+    param_declare_int(ps, "SnapshotWithDomain", OPTIONAL, 0, "Save the domain decomposition and the particles of each rank in snapshots. A restart from such a snapshot on the same number of ranks reads the particles of each rank directly and skips the initial domain decomposition and smoothing length setup.");
+    param_declare_int(ps, "SnapshotPeanoOrder", OPTIONAL, 0, "Write the particles of each rank sorted by Peano key, with a PeanoKeyIndex block for each type giving the rows of each coarse Peano cell. Readers may then load only the particles in a sub-volume or key range.");
+    param_declare_double(ps, "SnapshotOutputTolerance", OPTIONAL, 0, "If > 0, store float blocks which are not read on restart (eg, NeutralHydrogenFraction, StarFormationRate) as 16-bit integers with at most this absolute error.");
 
     /*Parameters of the cooling module*/
     param_declare_int(ps, "CoolingOn", REQUIRED, 0, "Enables cooling");
@@ -217,6 +339,8 @@ create_gadget_parameter_set()
     param_declare_int(ps, "DensityOn", OPTIONAL, 1, "Enables SPH density computation.");
     param_declare_int(ps, "DensityIndependentSphOn", REQUIRED, 1, "Enables density-independent (pressure-entropy) SPH.");
     param_declare_int(ps, "TreeGravOn", OPTIONAL, 1, "Enables tree gravity");
+    param_declare_int(ps, "TreeRefitOn", OPTIONAL, 0, "On timesteps which are not PM steps, keep the tree from the last step and recompute its moments if no particle has left its tree node, instead of rebuilding it.");
+    param_declare_double(ps, "TreeRefitSlack", OPTIONAL, 0.25, "When refitting the tree, enlarge each node by up to this fraction of its side length to cover the particles which drifted out of it, instead of rebuilding the tree and exchanging particles. Larger nodes are opened more often by the walks. Top level nodes are never enlarged.");
     param_declare_int(ps, "RadiationOn", OPTIONAL, 1, "Include radiation density in the background evolution.");
     param_declare_int(ps, "FastParticleType", OPTIONAL, 2, "Particles of this type will not decrease the timestep. Default neutrinos.");
 
@@ -224,7 +348,18 @@ create_gadget_parameter_set()
     param_declare_double(ps, "GravitySofteningGas", OPTIONAL, 1./30., "Softening for collisional particles (Gas); units of mean separation of DM; 0 to use Hsml of last step. ");
 
     param_declare_int(ps, "ImportBufferBoost", OPTIONAL, 2, "Memory factor to allow for there being more particles imported during treewlk than exported. Increase this if code crashes during treewalk with out of memory.");
+    param_declare_double(ps, "NgbCacheMB", OPTIONAL, 0, "Memory in MB for storing the neighbour candidates found in the density computation, so the hydro force can reuse them instead of walking the tree. The black hole feedback also reuses the candidates of the accretion. 0 disables the cache.");
+    param_declare_int(ps, "TreeWalkPipeline", OPTIONAL, 0, "If 1, treewalk exports are sent with non-blocking point-to-point messages and imported particles are evaluated as they arrive, rather than waiting on a global all-to-all.");
+    param_declare_int(ps, "TreeWalkSharedMemory", OPTIONAL, 0, "If 1, treewalk exports to and from ranks on the same node are copied through MPI-3 shared memory windows instead of being sent as messages. The export and import buffers are then allocated by MPI outside the main memory heap. Not used with TreeWalkPipeline.");
+    param_declare_int(ps, "TreeWalkExportFloatPos", OPTIONAL, 0, "If 1, the positions of exported treewalk queries are sent as float offsets from the top level node they are exported to, saving 12 bytes per export. The offsets are accurate to about 1e-7 of the size of the top level node, so this changes the results slightly.");
+    param_declare_double(ps, "TreeWalkHalo", OPTIONAL, 0, "If > 0, and then at least 1, before the density and hydro walks each task imports copies of the gas of other tasks within this factor times the smoothing lengths of its domain. Particles whose neighbours are all local or copies are then not exported. 1.2 leaves room for the smoothing lengths to grow in the density iterations. Needs free particle and SPH slots for the copies: if there are not enough, particles are exported as usual.");
+    param_declare_int(ps, "TreeWalkExportFirst", OPTIONAL, 0, "If 1, each thread evaluates the particles of top leaves next to the domain of another task before the rest, so that the exports are found, and with TreeWalkPipeline sent, while the interior particles are still being evaluated.");
+    param_declare_int(ps, "PMThreads", OPTIONAL, 0, "OpenMP threads for the FFTs and pencil exchanges of the PM step. 0 uses all threads. The transposes are bound by memory bandwidth, so fewer threads may be as fast.");
+    param_declare_int(ps, "SortThreads", OPTIONAL, 0, "OpenMP threads for the local sorts, such as in mpsort. 0 uses all threads.");
+    param_declare_int(ps, "IOThreads", OPTIONAL, 0, "OpenMP threads for packing and unpacking the snapshot buffers. 0 uses all threads.");
+    param_declare_string(ps, "TreeWalkStatsFile", OPTIONAL, "", "If set, append a line of statistics for every tree walk to this file in OutputDir: interactions and exports per particle, export rounds, and the min, mean and max wall time over the ranks.");
     param_declare_double(ps, "PartAllocFactor", OPTIONAL, 1.5, "Over-allocation factor of particles. The load can be imbalanced to allow for the work to be more balanced.");
+    param_declare_double(ps, "PartAllocGrow", OPTIONAL, 0, "If non-zero, after each domain exchange grow the particle table of a rank on which fewer than this fraction of the particles are free, so that twice this fraction is free. The table grows in place, so PartAllocFactor can be small, leaving more memory for the tree and buffers. 0 disables growth.");
     param_declare_double(ps, "TopNodeAllocFactor", OPTIONAL, 0.5, "Initial TopNode allocation as a fraction of maximum particle number.");
     param_declare_double(ps, "SlotsIncreaseFactor", OPTIONAL, 0.01, "Percentage factor to increase slot allocation by when requested.");
 
@@ -232,9 +367,12 @@ create_gadget_parameter_set()
     param_declare_double(ps, "MinGasTemp", OPTIONAL, 5, "Minimum gas temperature");
 
     param_declare_int(ps, "SnapshotWithFOF", REQUIRED, 0, "Enable Friends-of-Friends halo finder.");
-    param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 1, "Save particles in the FOF catalog.");
+    param_declare_int(ps, "FOFSaveParticles", OPTIONAL, 1, "Save particles in the FOF catalog. 1 sorts them globally by group. 2 writes them where they are, without the global sort, with a table of the runs of each group on each rank.");
     param_declare_double(ps, "FOFHaloLinkingLength", OPTIONAL, 0.2, "Linking length for Friends of Friends halos.");
     param_declare_int(ps, "FOFHaloMinLength", OPTIONAL, 32, "Minimum number of particles per FOF Halo.");
+    param_declare_double(ps, "FOFSubhaloLinkingFraction", OPTIONAL, 0, "If positive, find subhalos in each FOF group with a second FOF pass at this fraction of the halo linking length, and save them in the Subhalos blocks of the FOF catalogue.");
+    param_declare_int(ps, "FOFGridLinking", OPTIONAL, 0, "Find the FOF links between particles of the same rank on a grid of cells one linking length wide, instead of walking the tree, and start the search for the nearest dark matter particle of the other types from the grid. The tree walk is then left with the links across ranks. The groups are unchanged.");
+    param_declare_int(ps, "FOFIncremental", OPTIONAL, 1, "Seed the FOF links from the groups found by the last FOF call, so the walk can skip tree nodes already in the group. The groups are unchanged.");
     param_declare_double(ps, "MinFoFMassForNewSeed", OPTIONAL, 5e2, "Minimal Mass for seeding tracer particles ");
     param_declare_double(ps, "TimeBetweenSeedingSearch", OPTIONAL, 1e5, "Time Between Seeding Attempts: default to a a large value, meaning never.");
 
@@ -351,6 +489,9 @@ create_gadget_parameter_set()
     param_set_action(ps, "BlackHoleFeedbackMethod", BlackHoleFeedbackMethodAction, NULL);
     param_set_action(ps, "StarformationCriterion", StarformationCriterionAction, NULL);
     param_set_action(ps, "OutputList", OutputListAction, NULL);
+    param_set_action(ps, "LightOutputList", LightOutputListAction, NULL);
+    param_set_action(ps, "LyaSkewerOutputList", LyaSkewerOutputListAction, NULL);
+    param_set_action(ps, "DensityMeshOutputList", DensityMeshOutputListAction, NULL);
 
     return ps;
 }
@@ -384,11 +525,22 @@ void read_parameter_file(char *fname)
     /* Start reading the values */
         param_get_string2(ps, "InitCondFile", All.InitCondFile, sizeof(All.InitCondFile));
         param_get_string2(ps, "OutputDir", All.OutputDir, sizeof(All.OutputDir));
+        param_get_string2(ps, "GenICParamFile", All.GenICParamFile, sizeof(All.GenICParamFile));
+        All.GenICWriteICs = param_get_int(ps, "GenICWriteICs");
         param_get_string2(ps, "SnapshotFileBase", All.SnapshotFileBase, sizeof(All.SnapshotFileBase));
         param_get_string2(ps, "FOFFileBase", All.FOFFileBase, sizeof(All.FOFFileBase));
+        param_get_string2(ps, "LightOutputFileBase", All.LightOutputFileBase, sizeof(All.LightOutputFileBase));
+        param_get_string2(ps, "LightOutputBlocks", All.LightOutputBlocks, sizeof(All.LightOutputBlocks));
+        All.LightOutputSinglePrecision = param_get_int(ps, "LightOutputSinglePrecision");
+        All.DensityMeshNmesh = param_get_int(ps, "DensityMeshNmesh");
+        All.InitHsmlMeshNmesh = param_get_int(ps, "InitHsmlMeshNmesh");
         param_get_string2(ps, "EnergyFile", All.EnergyFile, sizeof(All.EnergyFile));
-        All.OutputEnergyDebug = param_get_int(ps, "EnergyFile");
+        All.OutputEnergyDebug = param_get_int(ps, "OutputEnergyDebug");
+        All.OutputEnergyTemperature = param_get_int(ps, "OutputEnergyTemperature");
         param_get_string2(ps, "CpuFile", All.CpuFile, sizeof(All.CpuFile));
+        param_get_string2(ps, "TraceFile", All.TraceFile, sizeof(All.TraceFile));
+        All.PerfCounters = param_get_int(ps, "PerfCounters");
+        All.AggregateRankMessages = param_get_int(ps, "AggregateRankMessages");
 
         All.DensityKernelType = param_get_enum(ps, "DensityKernelType");
         All.CP.CMBTemperature = param_get_double(ps, "CMBTemperature");
@@ -412,12 +564,26 @@ void read_parameter_file(char *fname)
             MaxMemSizePerNode *= get_physmem_bytes() / (1024. * 1024.);
         }
         All.MaxMemSizePerNode = MaxMemSizePerNode;
+        All.HugePages = param_get_enum(ps, "HugePages");
+        All.HBMMemSizePerNode = param_get_double(ps, "HBMMemSizePerNode");
 
         All.TimeMax = param_get_double(ps, "TimeMax");
         All.ErrTolIntAccuracy = param_get_double(ps, "ErrTolIntAccuracy");
         All.Asmth = param_get_double(ps, "Asmth");
         All.ShortRangeForceWindowType = param_get_enum(ps, "ShortRangeForceWindowType");
         All.Nmesh = param_get_int(ps, "Nmesh");
+        All.PMBatchTransforms = param_get_int(ps, "PMBatchTransforms");
+        All.PMAssignmentOrder = param_get_int(ps, "PMAssignmentOrder");
+        All.PMInterlace = param_get_int(ps, "PMInterlace");
+        All.PMLayoutCache = param_get_int(ps, "PMLayoutCache");
+        All.PMOverlapTree = param_get_int(ps, "PMOverlapTree");
+        All.PMOverlapSph = param_get_int(ps, "PMOverlapSph");
+        All.PMZoomNmesh = param_get_int(ps, "PMZoomNmesh");
+        All.PMZoomType = param_get_int(ps, "PMZoomType");
+        All.PMRanks = param_get_int(ps, "PMRanks");
+        All.PMInPlace = param_get_int(ps, "PMInPlace");
+        All.PMOffload = param_get_int(ps, "PMOffload");
+        All.PMFusedReadout = param_get_int(ps, "PMFusedReadout");
 
         All.MinGasHsmlFractional = param_get_double(ps, "MinGasHsmlFractional");
         All.MaxGasVel = param_get_double(ps, "MaxGasVel");
@@ -425,6 +591,8 @@ void read_parameter_file(char *fname)
 
         All.MinSizeTimestep = param_get_double(ps, "MinSizeTimestep");
         All.ForceEqualTimesteps = param_get_int(ps, "ForceEqualTimesteps");
+        All.TimestepLimiterReport = param_get_int(ps, "TimestepLimiterReport");
+        All.NgbTimeBinLimit = param_get_int(ps, "NgbTimeBinLimit");
         All.MaxRMSDisplacementFac = param_get_double(ps, "MaxRMSDisplacementFac");
         All.ArtBulkViscConst = param_get_double(ps, "ArtBulkViscConst");
         All.CourantFac = param_get_double(ps, "CourantFac");
@@ -442,14 +610,27 @@ void read_parameter_file(char *fname)
         All.IO.WritersPerFile = param_get_int(ps, "WritersPerFile");
         All.IO.AggregatedIOThreshold = param_get_int(ps, "AggregatedIOThreshold");
         All.IO.EnableAggregatedIO = param_get_int(ps, "EnableAggregatedIO");
+        All.IO.AsyncSnapshot = param_get_int(ps, "AsyncSnapshot");
+        param_get_string2(ps, "LocalCheckpointDir", All.IO.LocalCheckpointDir, sizeof(All.IO.LocalCheckpointDir));
+        All.IO.AggregatorGroupSize = param_get_int(ps, "IOAggregatorGroupSize");
+        All.IO.CompressIntegers = param_get_int(ps, "SnapshotCompressIntegers");
+        All.IO.VelocityTolerance = param_get_double(ps, "SnapshotVelocityTolerance");
+        All.IO.OutputTolerance = param_get_double(ps, "SnapshotOutputTolerance");
+        All.IO.SnapshotWithDomain = param_get_int(ps, "SnapshotWithDomain");
+        All.IO.DeltaCheckpointEvery = param_get_int(ps, "DeltaCheckpointEvery");
+        All.IO.PeanoOrder = param_get_int(ps, "SnapshotPeanoOrder");
+        All.IO.ReadAhead = param_get_int(ps, "SnapshotReadAhead");
 
         All.CoolingOn = param_get_int(ps, "CoolingOn");
         All.HydroOn = param_get_int(ps, "HydroOn");
         All.DensityOn = param_get_int(ps, "DensityOn");
         All.DensityIndependentSphOn= param_get_int(ps, "DensityIndependentSphOn");
         All.TreeGravOn = param_get_int(ps, "TreeGravOn");
+        All.TreeRefitOn = param_get_int(ps, "TreeRefitOn");
         All.FastParticleType = param_get_int(ps, "FastParticleType");
         All.TimeLimitCPU = param_get_double(ps, "TimeLimitCPU");
+        All.MaxPMSteps = param_get_int(ps, "MaxPMSteps");
+        All.BuddyCheckpointEvery = param_get_int(ps, "BuddyCheckpointEvery");
         All.AutoSnapshotTime = param_get_double(ps, "AutoSnapshotTime");
         All.TimeBetweenSeedingSearch = param_get_double(ps, "TimeBetweenSeedingSearch");
         All.RandomParticleOffset = param_get_double(ps, "RandomParticleOffset");
@@ -458,6 +639,7 @@ void read_parameter_file(char *fname)
         All.GravitySofteningGas = param_get_double(ps, "GravitySofteningGas");
 
         All.PartAllocFactor = param_get_double(ps, "PartAllocFactor");
+        All.PartAllocGrow = param_get_double(ps, "PartAllocGrow");
         All.SlotsIncreaseFactor = param_get_double(ps, "SlotsIncreaseFactor");
 
         All.SnapshotWithFOF = param_get_int(ps, "SnapshotWithFOF");
@@ -523,12 +705,17 @@ void read_parameter_file(char *fname)
     set_cooling_params(ps);
     set_qso_lightup_params(ps);
     set_treewalk_params(ps);
+    set_forcetree_params(ps);
     set_gravshort_tree_params(ps);
     set_domain_params(ps);
     set_sfr_params(ps);
     set_winds_params(ps);
     set_fof_params(ps);
     set_blackhole_params(ps);
+    set_lightcone_params(ps);
+    set_lya_skewer_params(ps);
+    set_sanity_check_params(ps);
+    set_thread_params(ps);
 
     parameter_set_free(ps);
 }
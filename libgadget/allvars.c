@@ -32,6 +32,8 @@ FILE 			/*!< file handle for info.txt log-file. */
 
 FILE *FdSfr;			/*!< file handle for sfr.txt log-file. */
 
+FILE *FdMemory;			/*!< file handle for memory.txt log-file. */
+
 FILE *FdBlackHoles;		/*!< file handle for blackholes.txt log-file. */
 
 /*! This structure contains data which is the SAME for all tasks (mostly code parameters read from the
@@ -43,6 +43,7 @@ extern FILE *FdEnergy,			/*!< file handle for energy.txt log-file. */
        *FdCPU;			/*!< file handle for cpu.txt log-file. */
 
 extern FILE *FdSfr;		/*!< file handle for sfr.txt log-file. */
+extern FILE *FdMemory;		/*!< file handle for memory.txt log-file. */
 
 extern FILE *FdBlackHoles;	/*!< file handle for blackholes.txt log-file. */
 
@@ -76,6 +77,16 @@ extern struct global_data_all_processes
         int MinNumWriters;        /* Min Number of concurrent writers, this caps number of writers */
         int EnableAggregatedIO;  /* Enable aggregated IO policy for small files.*/
         size_t AggregatedIOThreshold; /* bytes per writer above which to use non-aggregated IO (avoid OOM)*/
+        int AsyncSnapshot; /* Write snapshots from a helper thread while the run continues.*/
+        char LocalCheckpointDir[100]; /* If set, write snapshots here and copy them to OutputDir while the run continues.*/
+        int AggregatorGroupSize; /* Ranks per I/O aggregator rank; 0 or 1 means every rank does its own I/O.*/
+        int CompressIntegers; /* Store integer snapshot blocks in the narrowest type holding their values.*/
+        double VelocityTolerance; /* If > 0, quantize the velocities of output-only snapshots with at most this absolute error.*/
+        double OutputTolerance; /* If > 0, quantize output-only float blocks with at most this absolute error.*/
+        int ReadAhead; /* Read the next snapshot block in a helper thread while the current one is unpacked.*/
+        int SnapshotWithDomain; /* Save the domain in snapshots and restore it on restart, skipping the initial decomposition.*/
+        int DeltaCheckpointEvery; /* If > 1, write every this many snapshots in full and the others as deltas on the last full one.*/
+        int PeanoOrder; /* Write the particles of each rank in Peano order, with an index of the rows by Peano cell.*/
         /* Changes the comoving factors of the snapshot outputs. Set in the ICs.
          * If UsePeculiarVelocity = 1 then snapshots save to the velocity field the physical peculiar velocity, v = a dx/dt (where x is comoving distance).
          * If UsePeculiarVelocity = 0 then the velocity field is a * v = a^2 dx/dt in snapshots
@@ -87,6 +98,7 @@ extern struct global_data_all_processes
     double PartAllocFactor;	/*!< in order to maintain work-load balance, the particle load will usually
                               NOT be balanced.  Each processor allocates memory for PartAllocFactor times
                               the average number of particles to allow for that */
+    double PartAllocGrow; /* If non-zero, grow the particle table when fewer than this fraction of the particles are free*/
 
     double SlotsIncreaseFactor; /* !< What percentage to increase the slot allocation by when requested*/
     int OutputPotential;        /*!< Flag whether to include the potential in snapshots*/
@@ -141,6 +153,7 @@ extern struct global_data_all_processes
     int HydroOn;  /*  if hydro force is enabled */
     int DensityOn;  /*  if SPH density computation is enabled */
     int TreeGravOn;     /* tree gravity force is enabled*/
+    int TreeRefitOn;    /* keep the tree between short timesteps and refit it instead of rebuilding*/
     int DensityIndependentSphOn; /* Enables density independent (Pressure-entropy) SPH */
 
     int BlackHoleOn;  /* if black holes are enabled */
@@ -182,10 +195,24 @@ extern struct global_data_all_processes
     inttime_t Ti_Current;		/*!< current time on integer timeline */
 
     int Nmesh;
+    int PMBatchTransforms; /* Transform the PM potential and forces to real space in one batch*/
+    int PMAssignmentOrder; /* Order of the PM mass assignment window: 2 = CIC, 3 = TSC, 4 = PCS*/
+    int PMInterlace; /* Also assign to a PM mesh shifted by half a cell to reduce aliasing*/
+    int PMLayoutCache; /* Reuse the PM pencil layout between steps while the regions do not change*/
+    int PMOverlapTree; /* Run the short-range tree walk while the PM density is exchanged*/
+    int PMOverlapSph; /* Also run the SPH walks while the PM density is exchanged*/
+    int PMZoomNmesh; /* Size of the zoom PM mesh around the particles of type PMZoomType; 0 disables it*/
+    int PMZoomType; /* Particle type which defines the zoom region*/
+    int PMRanks; /* Number of ranks which run the PM FFTs; 0 for all ranks*/
+    int PMInPlace; /* Transform the PM meshes in place, holding two meshes at once instead of three*/
+    int PMOffload; /* Paint and read out the PM mesh on an OpenMP target device*/
+    int PMFusedReadout; /* Read out the PM potential and forces in one pass over the particles*/
 
     /* variables that keep track of cumulative CPU consumption */
 
     double TimeLimitCPU;
+    int MaxPMSteps; /* Stop cleanly after this many PM steps, if > 0. For benchmarks.*/
+    int BuddyCheckpointEvery; /* Copy the particles of each rank to a buddy rank every this many PM steps, if > 0.*/
     struct ClockTable CT;
 
     /*! The scale of the short-range/long-range force split in units of FFT-mesh cells */
@@ -198,6 +225,9 @@ extern struct global_data_all_processes
                                   timesteps is \f$ \Delta t = \sqrt{\frac{2 \eta eps}{a}} \f$ */
 
     int ForceEqualTimesteps; /*If true, all timesteps have the same timestep, the smallest allowed.*/
+    int TimestepLimiterReport; /*If true, print which criterion set the timesteps in each bin*/
+    int NgbTimeBinLimit; /*If > 0, a gas particle may be at most this many timebins above its SPH neighbours.
+                           Inactive gas next to a particle on a shorter step is woken up.*/
     double MinSizeTimestep,	/*!< minimum allowed timestep. Normally, the simulation terminates if the
                               timestep determined by the timestep criteria falls below this limit. */
            MaxSizeTimestep;		/*!< maximum allowed timestep */
@@ -211,6 +241,10 @@ extern struct global_data_all_processes
 
     double MaxGasVel; /* Limit on Gas velocity */
     double MaxMemSizePerNode;
+    /* Kind of pages backing the main allocator, an AllocHugePages*/
+    int HugePages;
+    /* High-bandwidth memory per node for the hot blocks, in MB*/
+    double HBMMemSizePerNode;
 
     double CourantFac;		/*!< SPH-Courant factor */
 
@@ -243,6 +277,17 @@ extern struct global_data_all_processes
          FOFFileBase[100],
          EnergyFile[100],
          CpuFile[100];
+    /* GenIC parameter file from which the initial conditions are made in memory,
+     * instead of read from InitCondFile. Empty to read InitCondFile.*/
+    char GenICParamFile[100];
+    /* If true, the initial conditions made in memory are also written to the file named in GenICParamFile*/
+    int GenICWriteICs;
+    /* Base name of the per-rank event trace files. Empty to disable the trace.*/
+    char TraceFile[100];
+    /* If true, record hardware performance counters for each walltime region*/
+    int PerfCounters;
+    /* If true, the warnings of single ranks are merged over the ranks and printed once a step*/
+    int AggregateRankMessages;
     char TreeCoolFile[100];
     char MetalCoolFile[100];
     char UVFluctuationFile[100];
@@ -251,10 +296,30 @@ extern struct global_data_all_processes
 
     /*Should we store the energy to EnergyFile on PM timesteps.*/
     int OutputEnergyDebug;
+    /* Should the energy statistics include the (expensive) mean gas temperature.*/
+    int OutputEnergyTemperature;
 
     double OutputListTimes[1024];
     int OutputListLength;
 
+    /* Light output snapshots: a subset of the blocks at reduced precision, for analysis*/
+    double LightOutputListTimes[1024];
+    int LightOutputListLength;
+
+    double LyaSkewerOutputListTimes[1024];
+    int LyaSkewerOutputListLength;
+    char LightOutputFileBase[100];
+    char LightOutputBlocks[256];
+    int LightOutputSinglePrecision;
+
+    /* Scale factors at which the PM step writes the mass in a coarse mesh*/
+    double DensityMeshOutputListTimes[1024];
+    int DensityMeshOutputListLength;
+    /* Cells per side of the coarse mesh: must divide Nmesh*/
+    int DensityMeshNmesh;
+    /* Cells per side of the gas density mesh for the initial smoothing lengths: 0 is half of Nmesh, < 0 uses the tree*/
+    int InitHsmlMeshNmesh;
+
     int SnapshotWithFOF; /*Flag that doing FOF for snapshot outputs is on*/
 
     int RandomSeed; /*Initial seed for the random number table*/
@@ -10,10 +10,12 @@
 #include "cooling.h"
 #include "densitykernel.h"
 #include "treewalk.h"
+#include "treewalk_ngbiter.h"
 #include "slotsmanager.h"
 #include "blackhole.h"
 #include "timestep.h"
 #include "hydra.h"
+#include "density.h"
 #include "sfr_eff.h"
 /*! \file blackhole.c
  *  \brief routines for gas accretion onto black holes, and black hole mergers
@@ -96,6 +98,9 @@ struct BHPriv {
      * in the feedback treewalk*/
     MyFloat * BH_FeedbackWeightSum;
 
+    /* Feedback energy for the gas, added to SphP_scratch->Injected_BH_Energy after the feedback treewalk*/
+    TreeWalkScatter InjectedEnergy;
+
     /* Particle SpinLocks*/
     struct SpinLocks * spin;
     /* Counters*/
@@ -146,6 +151,8 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
         TreeWalkNgbIterBHAccretion * iter,
         LocalTreeWalk * lv);
 
+TREEWALK_DEFINE_NGBITER_VISIT(blackhole_accretion_visit, blackhole_accretion_ngbiter, TreeWalkNgbIterBHAccretion)
+
 /* feedback routines */
 
 static void
@@ -166,10 +173,19 @@ blackhole_feedback_ngbiter(TreeWalkQueryBHFeedback * I,
         TreeWalkNgbIterBHFeedback * iter,
         LocalTreeWalk * lv);
 
+TREEWALK_DEFINE_NGBITER_VISIT(blackhole_feedback_visit, blackhole_feedback_ngbiter, TreeWalkNgbIterBHFeedback)
+
 static double
 decide_hsearch(double h);
 
 #define BHPOTVALUEINIT 1.0e29
+/* Each thread holds at most one lock at a time while marking or swallowing a particle,
+ * so a small table of locks striped over the particle index is enough.
+ * Neighbouring particles in a tree leaf get different locks.*/
+#define BH_NLOCKS 4096
+#define BH_LOCK(i) ((i) & (BH_NLOCKS - 1))
+/* Room in the neighbour cache for the candidates of each black hole*/
+#define BH_NGBCACHE_PER_BH 16384
 
 static double blackhole_soundspeed(double entropy, double rho) {
     /* rho is comoving !*/
@@ -198,7 +214,7 @@ blackhole(const ActiveParticles * act, ForceTree * tree)
     struct BHPriv priv[1];
 
     tw_accretion->ev_label = "BH_ACCRETION";
-    tw_accretion->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw_accretion->visit = blackhole_accretion_visit;
     tw_accretion->ngbiter_type_elsize = sizeof(TreeWalkNgbIterBHAccretion);
     tw_accretion->ngbiter = (TreeWalkNgbIterFunction) blackhole_accretion_ngbiter;
     tw_accretion->haswork = blackhole_accretion_haswork;
@@ -213,7 +229,7 @@ blackhole(const ActiveParticles * act, ForceTree * tree)
 
     TreeWalk tw_feedback[1] = {{0}};
     tw_feedback->ev_label = "BH_FEEDBACK";
-    tw_feedback->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw_feedback->visit = blackhole_feedback_visit;
     tw_feedback->ngbiter_type_elsize = sizeof(TreeWalkNgbIterBHFeedback);
     tw_feedback->ngbiter = (TreeWalkNgbIterFunction) blackhole_feedback_ngbiter;
     tw_feedback->haswork = blackhole_feedback_haswork;
@@ -225,17 +241,26 @@ blackhole(const ActiveParticles * act, ForceTree * tree)
     tw_feedback->tree = tree;
     tw_feedback->priv = priv;
 
+    /* The black holes do not move between the two walks, so the feedback
+     * can reuse the neighbour candidates of the accretion, if the cache is enabled.*/
+    tw_accretion->ngbcache = TREEWALK_NGBCACHE_FILL;
+    tw_feedback->ngbcache = TREEWALK_NGBCACHE_USE;
+
     MPIU_Barrier(MPI_COMM_WORLD);
     message(0, "Beginning black-hole accretion\n");
 
     priv->N_sph_swallowed = priv->N_BH_swallowed = 0;
 
     /* Let's determine which particles may be swallowed and calculate total feedback weights */
+    treewalk_ngbcache_alloc(tree, (int64_t) SlotsManager->info[5].size * BH_NGBCACHE_PER_BH);
+
     priv->SPH_SwallowID = mymalloc("SPH_SwallowID", SlotsManager->info[0].size * sizeof(MyIDType));
+    int NumActiveGas;
+    int * ActiveGas = get_active_particles_of_type(act, 0, &NumActiveGas);
     if(act->ActiveParticle) {
         #pragma omp parallel for
-        for(i = 0; i < act->NumActiveParticle; i ++) {
-            int p_i = act->ActiveParticle[i];
+        for(i = 0; i < NumActiveGas; i ++) {
+            int p_i = ActiveGas[i];
             if(P[p_i].Type == 0)
                 priv->SPH_SwallowID[P[p_i].PI] = -1;
         }
@@ -248,7 +273,7 @@ blackhole(const ActiveParticles * act, ForceTree * tree)
     }
 
     /* This allocates memory*/
-    priv[0].spin = init_spinlocks(PartManager->NumPart);
+    priv[0].spin = init_spinlocks(BH_NLOCKS);
 
     /* Computed in accretion, used in feedback*/
     priv->BH_FeedbackWeightSum = mymalloc("BH_FeedbackWeightSum", SlotsManager->info[5].size * sizeof(MyFloat));
@@ -259,7 +284,9 @@ blackhole(const ActiveParticles * act, ForceTree * tree)
     /* Local to this treewalk*/
     priv->BH_Entropy = mymalloc("BH_Entropy", SlotsManager->info[5].size * sizeof(MyFloat));
     priv->BH_SurroundingGasVel = (MyFloat (*) [3]) mymalloc("BH_SurroundVel", 3* SlotsManager->info[5].size * sizeof(priv->BH_SurroundingGasVel[0]));
-    treewalk_run(tw_accretion, act->ActiveParticle, act->NumActiveParticle);
+    int NumActiveBH;
+    int * ActiveBH = get_active_particles_of_type(act, 5, &NumActiveBH);
+    treewalk_run(tw_accretion, ActiveBH, NumActiveBH);
     myfree(priv->BH_SurroundingGasVel);
     myfree(priv->BH_Entropy);
     myfree(priv->MinPot);
@@ -275,7 +302,10 @@ blackhole(const ActiveParticles * act, ForceTree * tree)
     /* Local to this treewalk*/
     priv->BH_accreted_Mass = mymalloc("BH_accretedmass", SlotsManager->info[5].size * sizeof(MyFloat));
     priv->BH_accreted_BHMass = mymalloc("BH_accreted_BHMass", SlotsManager->info[5].size * sizeof(MyFloat));
-    treewalk_run(tw_feedback, act->ActiveParticle, act->NumActiveParticle);
+    treewalk_scatter_alloc(&priv->InjectedEnergy, SphP_scratch->Injected_BH_Energy, SlotsManager->info[0].size,
+            SlotsManager->info[0].size / omp_get_max_threads() + 1);
+    treewalk_run(tw_feedback, ActiveBH, NumActiveBH);
+    treewalk_scatter_merge_free(&priv->InjectedEnergy);
     myfree(priv->BH_accreted_BHMass);
     myfree(priv->BH_accreted_Mass);
 
@@ -283,6 +313,7 @@ blackhole(const ActiveParticles * act, ForceTree * tree)
 
     free_spinlocks(priv[0].spin);
     myfree(priv->SPH_SwallowID);
+    treewalk_ngbcache_free(tree);
 
     MPI_Reduce(&priv->N_sph_swallowed, &Ntot_gas_swallowed, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
     MPI_Reduce(&priv->N_BH_swallowed, &Ntot_BH_swallowed, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
@@ -463,7 +494,7 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
          * can be large, causing clumps of BHs to build up
          * at the same position without merging. */
 
-        lock_spinlock(other, spin);
+        lock_spinlock(BH_LOCK(other), spin);
         if(P[other].Swallowed) {
             /* Already marked, prefer to be swallowed by a bigger ID */
             if(BHP(other).SwallowID < I->ID) {
@@ -476,7 +507,7 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
                 BHP(other).SwallowID = I->ID;
             }
         }
-        unlock_spinlock(other, spin);
+        unlock_spinlock(BH_LOCK(other), spin);
     }
 
     if(P[other].Type == 0) {
@@ -488,6 +519,8 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
             /* FIXME: volume correction doesn't work on BH yet. */
             O->Rho += (mass_j * wk);
 
+            /* Normally already predicted by the density walk*/
+            density_ensure_predicted(other);
             O->SmoothedEntropy += (mass_j * wk * SphP_scratch->EntVarPred[P[other].PI]);
             O->GasVel[0] += (mass_j * wk * SphP_scratch->VelPred[3 * P[other].PI]);
             O->GasVel[1] += (mass_j * wk * SphP_scratch->VelPred[3 * P[other].PI+1]);
@@ -495,7 +528,7 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
 
             /* here we have a gas particle; check for swallowing */
 
-            lock_spinlock(other, spin);
+            lock_spinlock(BH_LOCK(other), spin);
             /* compute accretion probability */
             double p, w;
 
@@ -521,7 +554,7 @@ blackhole_accretion_ngbiter(TreeWalkQueryBHAccretion * I,
                     SPH_SwallowID[P[other].PI] = I->ID;
                 }
             }
-            unlock_spinlock(other, spin);
+            unlock_spinlock(BH_LOCK(other), spin);
         }
 
         if(r2 < iter->feedback_kernel.HH) {
@@ -593,7 +626,7 @@ blackhole_feedback_ngbiter(TreeWalkQueryBHFeedback * I,
     {
         if(BHP(other).SwallowID != I->ID) return;
 
-        lock_spinlock(other, spin);
+        lock_spinlock(BH_LOCK(other), spin);
 
         O->BH_CountProgs += BHP(other).CountProgs;
 
@@ -604,7 +637,7 @@ blackhole_feedback_ngbiter(TreeWalkQueryBHFeedback * I,
         P[other].Mass = 0;
         BHP(other).Mass = 0;
         BHP(other).Mdot = 0;
-        unlock_spinlock(other, spin);
+        unlock_spinlock(BH_LOCK(other), spin);
 
         #pragma omp atomic
         BH_GET_PRIV(lv->tw)->N_BH_swallowed++;
@@ -628,9 +661,7 @@ blackhole_feedback_ngbiter(TreeWalkQueryBHFeedback * I,
                 if(HAS(blackhole_params.BlackHoleFeedbackMethod, BH_FEEDBACK_SPLINE))
                     wk = density_kernel_wk(&iter->feedback_kernel, u);
 
-                lock_spinlock(other, spin);
-                SphP_scratch->Injected_BH_Energy[P[other].PI] += (I->FeedbackEnergy * mass_j * wk / I->FeedbackWeightSum);
-                unlock_spinlock(other, spin);
+                treewalk_scatter_add(&BH_GET_PRIV(lv->tw)->InjectedEnergy, P[other].PI, I->FeedbackEnergy * mass_j * wk / I->FeedbackWeightSum);
             }
         }
     }
@@ -642,7 +673,7 @@ blackhole_feedback_ngbiter(TreeWalkQueryBHFeedback * I,
 
         if(SPH_SwallowID[P[other].PI] != I->ID) return;
 
-        lock_spinlock(other, spin);
+        lock_spinlock(BH_LOCK(other), spin);
 
         /* We do not know how to notify the tree of mass changes. so
          * blindly enforce a mass conservation for now. */
@@ -650,7 +681,7 @@ blackhole_feedback_ngbiter(TreeWalkQueryBHFeedback * I,
         P[other].Mass = 0;
 
         slots_mark_garbage(other, PartManager, SlotsManager);
-        unlock_spinlock(other, spin);
+        unlock_spinlock(BH_LOCK(other), spin);
 
         #pragma omp atomic
         BH_GET_PRIV(lv->tw)->N_sph_swallowed++;
@@ -0,0 +1,226 @@
+#include <mpi.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "buddy.h"
+#include "utils.h"
+
+/* Largest message of a checkpoint, which keeps the counts below the int limit of MPI*/
+#ifndef BUDDY_CHUNK_BYTES
+#define BUDDY_CHUNK_BYTES (1L<<30)
+#endif
+
+#define BUDDY_TAG 102001
+
+/* The tables of a copy: the particles, then the slots of each type*/
+#define BUDDY_NPIECE 7
+
+struct buddy_header {
+    int64_t tag;
+    int64_t NumPart;
+    int64_t SlotSize[6];
+    int64_t SlotElSize[6];
+};
+
+/* The copy of the state of another rank held by this rank*/
+static struct {
+    int Held;
+    struct buddy_header header;
+    char * data;
+    Allocator Store[1];
+} Buddy;
+
+/* Ranks per node, or 1 if all ranks are on one node, so that buddies are on other nodes if possible*/
+static int
+buddy_stride(MPI_Comm Comm)
+{
+    int NTask, NodeSize;
+    MPI_Comm Node;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_split_type(Comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &Node);
+    MPI_Comm_size(Node, &NodeSize);
+    MPI_Comm_free(&Node);
+    MPI_Allreduce(MPI_IN_PLACE, &NodeSize, 1, MPI_INT, MPI_MAX, Comm);
+    if(NodeSize % NTask == 0)
+        return 1;
+    return NodeSize;
+}
+
+static void
+buddy_piece_bytes(const struct buddy_header * header, size_t * bytes)
+{
+    int ptype;
+    bytes[0] = header->NumPart * sizeof(struct particle_data);
+    for(ptype = 0; ptype < 6; ptype++)
+        bytes[1 + ptype] = header->SlotSize[ptype] * header->SlotElSize[ptype];
+}
+
+static int
+buddy_nchunks(const size_t * bytes)
+{
+    int i, n = 0;
+    for(i = 0; i < BUDDY_NPIECE; i++)
+        n += (bytes[i] + BUDDY_CHUNK_BYTES - 1) / BUDDY_CHUNK_BYTES;
+    return n;
+}
+
+/* Post the sends or receives of the pieces in chunks. The two sides split the pieces of the same header alike.*/
+static int
+buddy_post(char ** ptrs, const size_t * bytes, const int peer, const int recv, MPI_Comm Comm, MPI_Request * requests)
+{
+    int i, n = 0;
+    for(i = 0; i < BUDDY_NPIECE; i++) {
+        size_t off;
+        for(off = 0; off < bytes[i]; off += BUDDY_CHUNK_BYTES) {
+            const int len = bytes[i] - off < BUDDY_CHUNK_BYTES ? bytes[i] - off : BUDDY_CHUNK_BYTES;
+            if(recv)
+                MPI_Irecv(ptrs[i] + off, len, MPI_BYTE, peer, BUDDY_TAG, Comm, &requests[n++]);
+            else
+                MPI_Isend(ptrs[i] + off, len, MPI_BYTE, peer, BUDDY_TAG, Comm, &requests[n++]);
+        }
+    }
+    return n;
+}
+
+void
+buddy_checkpoint_save(const struct part_manager_type * pman, const struct slots_manager_type * sman, const int64_t tag, MPI_Comm Comm)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    MPI_Comm_size(Comm, &NTask);
+    const int stride = buddy_stride(Comm);
+    const int buddy = (ThisTask + stride) % NTask;
+    const int owner = (ThisTask - stride % NTask + NTask) % NTask;
+
+    struct buddy_header mine = {0};
+    mine.tag = tag;
+    mine.NumPart = pman->NumPart;
+    int ptype;
+    char * sendptrs[BUDDY_NPIECE];
+    sendptrs[0] = (char *) pman->Base;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!sman->info[ptype].enabled)
+            continue;
+        mine.SlotSize[ptype] = sman->info[ptype].size;
+        mine.SlotElSize[ptype] = sman->info[ptype].elsize;
+        sendptrs[1 + ptype] = sman->info[ptype].ptr;
+    }
+
+    /* Drop the last copy first, so two copies are never held at once*/
+    buddy_checkpoint_free();
+
+    MPI_Sendrecv(&mine, sizeof(mine), MPI_BYTE, buddy, BUDDY_TAG,
+            &Buddy.header, sizeof(Buddy.header), MPI_BYTE, owner, BUDDY_TAG, Comm, MPI_STATUS_IGNORE);
+
+    size_t sendbytes[BUDDY_NPIECE], recvbytes[BUDDY_NPIECE];
+    buddy_piece_bytes(&mine, sendbytes);
+    buddy_piece_bytes(&Buddy.header, recvbytes);
+
+    size_t total = 0;
+    int i;
+    for(i = 0; i < BUDDY_NPIECE; i++)
+        total += recvbytes[i];
+
+    if(0 != allocator_malloc_init(Buddy.Store, "BUDDY", 0, 0, NULL))
+        endrun(1, "Failed to initialise memory for the buddy checkpoint\n");
+    /* Never empty, so the copy always has an address*/
+    Buddy.data = allocator_alloc_bot(Buddy.Store, "BuddyCopy", total + 1);
+
+    char * recvptrs[BUDDY_NPIECE];
+    size_t off = 0;
+    for(i = 0; i < BUDDY_NPIECE; i++) {
+        recvptrs[i] = Buddy.data + off;
+        off += recvbytes[i];
+    }
+
+    MPI_Request * requests = mymalloc("BuddyRequests", sizeof(MPI_Request) * (buddy_nchunks(sendbytes) + buddy_nchunks(recvbytes) + 1));
+    int nreq = buddy_post(recvptrs, recvbytes, owner, 1, Comm, requests);
+    nreq += buddy_post(sendptrs, sendbytes, buddy, 0, Comm, requests + nreq);
+    MPI_Waitall(nreq, requests, MPI_STATUSES_IGNORE);
+    myfree(requests);
+    Buddy.Held = 1;
+
+    double bytes = total;
+    MPI_Allreduce(MPI_IN_PLACE, &bytes, 1, MPI_DOUBLE, MPI_SUM, Comm);
+    message(0, "Saved buddy checkpoint %ld: %g MB in total, ranks %d apart.\n", tag, bytes / (1024. * 1024.), stride);
+}
+
+int
+buddy_checkpoint_restore(struct part_manager_type * pman, struct slots_manager_type * sman, int64_t * tag, MPI_Comm Comm)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    MPI_Comm_size(Comm, &NTask);
+
+    int held = Buddy.Held;
+    MPI_Allreduce(MPI_IN_PLACE, &held, 1, MPI_INT, MPI_MIN, Comm);
+    if(!held)
+        return -1;
+
+    const int stride = buddy_stride(Comm);
+    const int buddy = (ThisTask + stride) % NTask;
+    const int owner = (ThisTask - stride % NTask + NTask) % NTask;
+
+    /* The copies go back the way they came*/
+    struct buddy_header mine;
+    MPI_Sendrecv(&Buddy.header, sizeof(Buddy.header), MPI_BYTE, owner, BUDDY_TAG,
+            &mine, sizeof(mine), MPI_BYTE, buddy, BUDDY_TAG, Comm, MPI_STATUS_IGNORE);
+
+    if(mine.NumPart > pman->MaxPart)
+        endrun(5, "Buddy checkpoint has %ld particles, but only %d fit\n", mine.NumPart, pman->MaxPart);
+
+    int ptype;
+    int atleast[6] = {0};
+    int grow = 0;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(mine.SlotSize[ptype] == 0)
+            continue;
+        if(!sman->info[ptype].enabled || sman->info[ptype].elsize != (size_t) mine.SlotElSize[ptype])
+            endrun(5, "Buddy checkpoint slots of type %d do not match the enabled slots\n", ptype);
+        atleast[ptype] = mine.SlotSize[ptype];
+        grow |= atleast[ptype] > sman->info[ptype].maxsize;
+    }
+    if(grow)
+        slots_reserve(1, atleast, sman);
+
+    size_t sendbytes[BUDDY_NPIECE], recvbytes[BUDDY_NPIECE];
+    buddy_piece_bytes(&Buddy.header, sendbytes);
+    buddy_piece_bytes(&mine, recvbytes);
+
+    char * sendptrs[BUDDY_NPIECE];
+    char * recvptrs[BUDDY_NPIECE];
+    size_t off = 0;
+    int i;
+    for(i = 0; i < BUDDY_NPIECE; i++) {
+        sendptrs[i] = Buddy.data + off;
+        off += sendbytes[i];
+    }
+    recvptrs[0] = (char *) pman->Base;
+    for(ptype = 0; ptype < 6; ptype++)
+        recvptrs[1 + ptype] = sman->info[ptype].ptr;
+
+    MPI_Request * requests = mymalloc("BuddyRequests", sizeof(MPI_Request) * (buddy_nchunks(sendbytes) + buddy_nchunks(recvbytes) + 1));
+    int nreq = buddy_post(recvptrs, recvbytes, buddy, 1, Comm, requests);
+    nreq += buddy_post(sendptrs, sendbytes, owner, 0, Comm, requests + nreq);
+    MPI_Waitall(nreq, requests, MPI_STATUSES_IGNORE);
+    myfree(requests);
+
+    pman->NumPart = mine.NumPart;
+    for(ptype = 0; ptype < 6; ptype++)
+        if(sman->info[ptype].enabled)
+            sman->info[ptype].size = mine.SlotSize[ptype];
+    *tag = mine.tag;
+
+    message(0, "Restored buddy checkpoint %ld.\n", mine.tag);
+    return 0;
+}
+
+void
+buddy_checkpoint_free(void)
+{
+    if(!Buddy.Held)
+        return;
+    allocator_free(Buddy.data);
+    allocator_destroy(Buddy.Store);
+    Buddy.Held = 0;
+}
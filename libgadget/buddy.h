@@ -0,0 +1,27 @@
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include <mpi.h>
+#include "partmanager.h"
+#include "slotsmanager.h"
+
+/* In-memory partner checkpoints. Each rank keeps a copy of the particles and slots of a
+ * buddy rank, chosen on another node where possible, so that the state of a lost rank can be
+ * restored by a memory copy from its buddy instead of a snapshot read.
+ * The copies are held outside the main arena, as they outlive the time step.*/
+
+/* Send a copy of the used part of the particle and slot tables of this rank to its buddy,
+ * keeping the copy received from the rank we are the buddy of in place of the last one.
+ * tag identifies the state, usually the integer time. Collective.*/
+void buddy_checkpoint_save(const struct part_manager_type * pman, const struct slots_manager_type * sman, const int64_t tag, MPI_Comm Comm);
+
+/* Replace the particles and slots of this rank with the copy held by its buddy, and set *tag to
+ * the tag it was saved with. The tables must already be allocated and the same slot types enabled;
+ * the slots are grown if they are short. Returns 0, or -1 with nothing changed if some rank holds
+ * no copy. Collective.*/
+int buddy_checkpoint_restore(struct part_manager_type * pman, struct slots_manager_type * sman, int64_t * tag, MPI_Comm Comm);
+
+/* Free the copy held by this rank.*/
+void buddy_checkpoint_free(void);
+
+#endif
@@ -6,11 +6,13 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "allvars.h"
 #include "petaio.h"
 #include "checkpoint.h"
 #include "fof.h"
+#include "hci.h"
 
 #include "utils.h"
 
@@ -21,11 +23,17 @@
  */
 
 static void
-write_snapshot(int num);
+write_snapshot(int num, const DomainDecomp * ddecomp);
+
+static void
+write_light_output(int num);
 
 void
-write_checkpoint(int WriteSnapshot, int WriteFOF, ForceTree * tree)
+write_checkpoint(int WriteSnapshot, int WriteFOF, int LightOutputNum, const DomainDecomp * ddecomp, ForceTree * tree)
 {
+    if(LightOutputNum >= 0)
+        write_light_output(LightOutputNum);
+
     if(!WriteSnapshot && !WriteFOF) return;
 
     int snapnum = All.SnapshotFileCount++;
@@ -33,7 +41,7 @@ write_checkpoint(int WriteSnapshot, int WriteFOF, ForceTree * tree)
     if(WriteSnapshot)
     {
         /* write snapshot of particles */
-        write_snapshot(snapnum);
+        write_snapshot(snapnum, ddecomp);
     }
 
     if(WriteFOF) {
@@ -60,26 +68,177 @@ dump_snapshot()
     destroy_io_blocks(&IOTable);
 }
 
+/* Number of delta snapshots written since the last full snapshot*/
+static int NDeltaSnapshots;
+
+/* Snapshot being written in the background, recorded in PendingSnapList once complete*/
+static int PendingSnapNum = -1;
+static double PendingSnapTime;
+static const char * PendingSnapList;
+/* When the pending snapshot was started, how long it has blocked the run and its size,
+ * reported to HCI once it is complete*/
+static double PendingSnapStart;
+static double PendingSnapBlocked;
+static double PendingSnapBytes;
+
+/* Uncompressed size of the particle blocks of a snapshot in bytes, summed over ranks*/
+static double
+snapshot_bytes(const struct IOTable * IOTable)
+{
+    int64_t NLocal[6] = {0};
+    int i;
+    for(i = 0; i < PartManager->NumPart; i++)
+        if(!P[i].IsGarbage)
+            NLocal[P[i].Type]++;
+    double bytes = 0;
+    for(i = 0; i < IOTable->used; i++) {
+        const IOTableEntry * ent = &IOTable->ent[i];
+        if(ent->ptype < 0 || ent->ptype >= 6)
+            continue;
+        /* The dtype is a byte order, a kind and then the size, eg, <f8*/
+        const int elsize = atoi(ent->dtype + strcspn(ent->dtype, "0123456789"));
+        bytes += (double) NLocal[ent->ptype] * ent->items * elsize;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &bytes, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    return bytes;
+}
+
+/* Snapshots.txt lists the restartable snapshots (see find_last_snapnum);
+ * light outputs go in LightOutputs.txt*/
 static void
-write_snapshot(int num)
+record_snapshot(const char * list, int num, double time)
 {
+    if(ThisTask == 0) {
+        char * buf = fastpm_strdup_printf("%s/%s", All.OutputDir, list);
+        FILE * fd = fopen(buf, "a");
+        fprintf(fd, "%03d %g\n", num, time);
+        fclose(fd);
+        myfree(buf);
+    }
+}
+
+void
+write_checkpoint_wait(void)
+{
+    if(PendingSnapNum < 0)
+        return;
+    walltime_measure("/Misc");
+    const double tstart = MPI_Wtime();
+    petaio_async_wait();
+    petaio_drain_wait();
+    walltime_measure("/Snapshot/Wait");
+    record_snapshot(PendingSnapList, PendingSnapNum, PendingSnapTime);
+    /* The whole write, not only the wait, is what a final checkpoint would cost*/
+    if(PendingSnapBytes > 0)
+        hci_record_checkpoint(HCI_DEFAULT_MANAGER, MPI_Wtime() - PendingSnapStart,
+                PendingSnapBlocked + MPI_Wtime() - tstart, PendingSnapBytes);
+    PendingSnapNum = -1;
+}
+
+static void
+write_snapshot(int num, const DomainDecomp * ddecomp)
+{
+    /* Only one snapshot may be in flight*/
+    write_checkpoint_wait();
+
     walltime_measure("/Misc");
+    const double tstart = MPI_Wtime();
     struct IOTable IOTable = {0};
     register_io_blocks(&IOTable);
     if(All.OutputDebugFields)
         register_debug_io_blocks(&IOTable);
-    petaio_save_snapshot(&IOTable, 1, "%s/%s_%03d", All.OutputDir, All.SnapshotFileBase, num);
+    const double bytes = snapshot_bytes(&IOTable);
+    /* Between full snapshots write deltas on the last one*/
+    int delta = 0;
+    if(All.IO.DeltaCheckpointEvery > 1 && NDeltaSnapshots + 1 < All.IO.DeltaCheckpointEvery)
+        delta = petaio_make_delta(&IOTable);
+    /* With a local checkpoint directory the snapshot is written there and copied to OutputDir in the background*/
+    const int local = All.IO.LocalCheckpointDir[0] != '\0';
+    const char * dir = local ? All.IO.LocalCheckpointDir : All.OutputDir;
+    if(local && ThisTask == 0) {
+        /* The local copy is incomplete until petaio_drain_start marks it again*/
+        char * marker = fastpm_strdup_printf("%s/%s_%03d.complete", dir, All.SnapshotFileBase, num);
+        unlink(marker);
+        myfree(marker);
+    }
+    if(All.IO.AsyncSnapshot && !local)
+        petaio_save_snapshot_async(&IOTable, 1, "%s/%s_%03d", dir, All.SnapshotFileBase, num);
+    else
+        petaio_save_snapshot(&IOTable, 1, "%s/%s_%03d", dir, All.SnapshotFileBase, num);
+
+    if(All.IO.SnapshotWithDomain)
+        petaio_save_domain(ddecomp, "%s/%s_%03d", dir, All.SnapshotFileBase, num);
 
     destroy_io_blocks(&IOTable);
+
+    if(delta)
+        NDeltaSnapshots++;
+    else {
+        petaio_set_delta_base(num);
+        NDeltaSnapshots = 0;
+    }
+
+    if(local) {
+        char * src = fastpm_strdup_printf("%s/%s_%03d", dir, All.SnapshotFileBase, num);
+        char * dst = fastpm_strdup_printf("%s/%s_%03d", All.OutputDir, All.SnapshotFileBase, num);
+        petaio_drain_start(src, dst);
+        myfree(dst);
+        myfree(src);
+    }
     walltime_measure("/Snapshot/Write");
 
-    if(ThisTask == 0) {
-        char * buf = fastpm_strdup_printf("%s/Snapshots.txt", All.OutputDir);
-        FILE * fd = fopen(buf, "a");
-        fprintf(fd, "%03d %g\n", num, All.Time);
-        fclose(fd);
-        myfree(buf);
+    if(All.IO.AsyncSnapshot || local) {
+        PendingSnapNum = num;
+        PendingSnapTime = All.Time;
+        PendingSnapList = "Snapshots.txt";
+        PendingSnapStart = tstart;
+        PendingSnapBlocked = MPI_Wtime() - tstart;
+        PendingSnapBytes = bytes;
+    }
+    else {
+        record_snapshot("Snapshots.txt", num, All.Time);
+        const double duration = MPI_Wtime() - tstart;
+        hci_record_checkpoint(HCI_DEFAULT_MANAGER, duration, duration, bytes);
+    }
+}
+
+/* Write a light output snapshot: only the blocks in LightOutputBlocks,
+ * with double precision blocks optionally stored in single precision.
+ * These cannot be used to restart, so they are not counted in Snapshots.txt.*/
+static void
+write_light_output(int num)
+{
+    write_checkpoint_wait();
+
+    walltime_measure("/Misc");
+    struct IOTable IOTable = {0};
+    register_io_blocks(&IOTable);
+    petaio_select_io_blocks(&IOTable, All.LightOutputBlocks);
+    if(All.LightOutputSinglePrecision) {
+        int i;
+        for(i = 0; i < IOTable.used; i++)
+            if(!strcmp(IOTable.ent[i].dtype, "f8"))
+                IOTable.ent[i].compress = IO_COMPRESS_FLOAT32;
+    }
+    /* Light snapshots are never used to restart*/
+    petaio_set_output_compression(&IOTable);
+    if(All.IO.AsyncSnapshot)
+        petaio_save_snapshot_async(&IOTable, 1, "%s/%s_%03d", All.OutputDir, All.LightOutputFileBase, num);
+    else
+        petaio_save_snapshot(&IOTable, 1, "%s/%s_%03d", All.OutputDir, All.LightOutputFileBase, num);
+
+    destroy_io_blocks(&IOTable);
+    walltime_measure("/Snapshot/WriteLight");
+
+    if(All.IO.AsyncSnapshot) {
+        PendingSnapNum = num;
+        PendingSnapTime = All.Time;
+        PendingSnapList = "LightOutputs.txt";
+        /* Light outputs are not checkpoints*/
+        PendingSnapBytes = 0;
     }
+    else
+        record_snapshot("LightOutputs.txt", num, All.Time);
 }
 
 int
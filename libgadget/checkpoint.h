@@ -3,7 +3,12 @@
 
 #include "forcetree.h"
 
-void write_checkpoint(int WriteSnapshot, int WriteFOF, ForceTree * tree);
+/* Write a snapshot and/or FOF catalogue, numbered by SnapshotFileCount,
+ * and a light output numbered LightOutputNum if it is not negative.
+ * ddecomp is saved in the snapshot if SnapshotWithDomain is set.*/
+void write_checkpoint(int WriteSnapshot, int WriteFOF, int LightOutputNum, const DomainDecomp * ddecomp, ForceTree * tree);
+/* Wait for a snapshot being written in the background (AsyncSnapshot) to complete. Collective.*/
+void write_checkpoint_wait(void);
 void dump_snapshot(void);
 int find_last_snapnum(void);
 
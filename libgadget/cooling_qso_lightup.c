@@ -34,6 +34,7 @@
 #include "slotsmanager.h"
 #include "partmanager.h"
 #include "treewalk.h"
+#include "treewalk_ngbiter.h"
 #include "allvars.h"
 #include "hydra.h"
 #include "drift.h"
@@ -42,6 +43,8 @@
 #include "utils/endrun.h"
 #include "utils/paramset.h"
 #include "utils/mymalloc.h"
+#include "utils/string.h"
+#include "utils/system.h"
 #include "cooling_qso_lightup.h"
 
 #define E0_HeII 54.4 /* HeII ionization potential in eV*/
@@ -130,93 +133,50 @@ Q_inst(double Emax, double alpha_q)
 static void
 load_heii_reion_hist(const char * reion_hist_file)
 {
-    int ThisTask;
-    FILE * fd = NULL;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-
     message(0, "HeII: Loading HeII reionization history from file: %s\n",reion_hist_file);
-    if(ThisTask == 0) {
-        fd = fopen(reion_hist_file, "r");
-        if(!fd)
-            endrun(456, "HeII: Could not open reionization history file at: '%s'\n", reion_hist_file);
-
-        /*Find size of file*/
-        Nreionhist = 0;
-        while(1)
-        {
-            char buffer[1024];
-            char * retval = fgets(buffer, 1024, fd);
-            /*Happens on end of file*/
-            if(!retval)
-                break;
-            retval = strtok(buffer, " \t\n");
-            /*Discard comments*/
-            if(!retval || retval[0] == '#')
-                continue;
-            Nreionhist++;
-        }
-        rewind(fd);
-        /* Discard first two lines*/
-        Nreionhist -=2;
-    }
+    /* Only rank 0 reads the file: every rank parses the broadcast copy.*/
+    char * content = MPIU_file_get_content(reion_hist_file, 0, MPI_COMM_WORLD);
+    if(!content)
+        endrun(0, "HeII: Could not open reionization history file at: '%s'\n", reion_hist_file);
 
-    MPI_Bcast(&Nreionhist, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    int nlines;
+    char ** lines = fastpm_strsplit_table(content, &nlines);
+    /* Discard first two lines*/
+    Nreionhist = nlines - 2;
 
     if(Nreionhist<= 2)
-        endrun(1, "HeII: Reionization history contains: %d entries, not enough.\n", Nreionhist);
+        endrun(0, "HeII: Reionization history contains: %d entries, not enough.\n", Nreionhist);
 
     /*Allocate memory for the reionization history table.*/
     He_zz = mymalloc("ReionizationTable", 3 * Nreionhist * sizeof(double));
     XHeIII = He_zz + Nreionhist;
     LMFP = He_zz + 2 * Nreionhist;
 
-    if(ThisTask == 0)
+    /* The first two lines are the QSO spectral index and the photon threshold energy*/
+    const double qso_spectral_index = atof(lines[0]);
+    const double photon_threshold_energy = atof(lines[1]);
+    int i;
+    for(i = 0; i < Nreionhist; i++)
     {
-        double qso_spectral_index = 0, photon_threshold_energy = 0;
-        int prei = 0;
-        int i = 0;
-        while(i < Nreionhist)
-        {
-            char buffer[1024];
-            char * line = fgets(buffer, 1024, fd);
-            /*Happens on end of file*/
-            if(!line)
-                break;
-            char * retval = strtok(line, " \t\n");
-            if(!retval || retval[0] == '#')
-                continue;
-            if(prei == 0)
-            {
-                qso_spectral_index = atof(retval);
-                prei++;
-                continue;
-            }
-            else if(prei == 1)
-            {
-                photon_threshold_energy = atof(retval);
-                prei++;
-                continue;
-            }
-            /* First column: redshift. Convert to scale factor so it is increasing.*/
-            He_zz[i] = 1./(1+atof(retval));
-            /* Second column: HeIII fraction.*/
-            retval = strtok(NULL, " \t");
-            if(!retval)
-                endrun(12, "HeII: Line %s of reionization table was incomplete!\n", line);
-            XHeIII[i] = atof(retval);
-            /* Third column: long mean free path photons.*/
-            retval = strtok(NULL, " \t");
-            if(!retval)
-                endrun(12, "HeII: Line %s of reionization table was incomplete!\n", line);
-            LMFP[i] = atof(retval);
-            i++;
-        }
-        fclose(fd);
-        qso_inst_heating = Q_inst(photon_threshold_energy, qso_spectral_index);
+        char * line = lines[i + 2];
+        char * saveptr;
+        char * retval = strtok_r(line, " \t", &saveptr);
+        /* First column: redshift. Convert to scale factor so it is increasing.*/
+        He_zz[i] = 1./(1+atof(retval));
+        /* Second column: HeIII fraction.*/
+        retval = strtok_r(NULL, " \t", &saveptr);
+        if(!retval)
+            endrun(0, "HeII: Line %d of reionization table was incomplete!\n", i);
+        XHeIII[i] = atof(retval);
+        /* Third column: long mean free path photons.*/
+        retval = strtok_r(NULL, " \t", &saveptr);
+        if(!retval)
+            endrun(0, "HeII: Line %d of reionization table was incomplete!\n", i);
+        LMFP[i] = atof(retval);
     }
-    /*Broadcast data to other processors*/
-    MPI_Bcast(He_zz, 3 * Nreionhist, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&qso_inst_heating, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    ta_free(lines);
+    ta_free(content);
+    qso_inst_heating = Q_inst(photon_threshold_energy, qso_spectral_index);
     /* Initialize the interpolators*/
     HeIII_intp = gsl_interp_alloc(gsl_interp_linear,Nreionhist);
     LMFP_intp = gsl_interp_alloc(gsl_interp_linear,Nreionhist);
@@ -396,8 +356,8 @@ ionize_single_particle(int other)
 }
 
 struct QSOPriv {
-    /* Particle SpinLocks*/
-    struct SpinLocks * spin;
+    /* Set to 1 by the first bubble to reach each particle, which then ionizes it.*/
+    int * Claimed;
     FOFGroups * fof;
     int64_t * N_ionized;
 };
@@ -430,15 +390,11 @@ ionize_ngbiter(TreeWalkQueryBase * I,
     if(P[other].Type != 0)
         return;
 
-    struct SpinLocks * spin = QSO_GET_PRIV(lv->tw)->spin;
-
-    lock_spinlock(other, spin);
-
-    int ionized = ionize_single_particle(other);
-
-    unlock_spinlock(other, spin);
+    /* Several bubbles may overlap: only the first to claim the particle touches it.*/
+    if(!atomic_compare_and_swap(&QSO_GET_PRIV(lv->tw)->Claimed[other], 0, 1))
+        return;
 
-    if(!ionized)
+    if(!ionize_single_particle(other))
         return;
 
     int tid = omp_get_thread_num();
@@ -446,6 +402,8 @@ ionize_ngbiter(TreeWalkQueryBase * I,
     QSO_GET_PRIV(lv->tw)->N_ionized[tid] ++;
 }
 
+TREEWALK_DEFINE_NGBITER_VISIT(ionize_visit, ionize_ngbiter, TreeWalkNgbIterBase)
+
 static void
 ionize_copy(int place, TreeWalkQueryBase * I, TreeWalk * tw)
 {
@@ -462,12 +420,13 @@ ionize_copy(int place, TreeWalkQueryBase * I, TreeWalk * tw)
     I->ID = fof->Group[place].base.MinID;
 }
 
-/* Find all particles within the radius of the HeIII bubble,
+/* Find all particles within the radius of the HeIII bubbles of the nqso local halos in qso,
  * flag each particle as ionized and add instantaneous heating.
- * Returns the number of particles ionized
+ * All the bubbles are done in one treewalk. Collective.
+ * Returns the number of particles ionized on this rank.
  */
 static int64_t
-ionize_all_part(int qso_ind, int * qso_cand, FOFGroups * fof, ForceTree * tree)
+ionize_all_part(int * qso, int nqso, FOFGroups * fof, ForceTree * tree)
 {
     /* This treewalk finds not yet ionized particles within the radius of the black hole, ionizes them and
      * adds an instantaneous heating to them. */
@@ -480,7 +439,7 @@ ionize_all_part(int qso_ind, int * qso_cand, FOFGroups * fof, ForceTree * tree)
 
     /* We set Hsml to a constant in ngbiter, so this
      * searches a constant distance from the halo.*/
-    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->visit = ionize_visit;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterBase);
     tw->ngbiter = ionize_ngbiter;
 
@@ -491,7 +450,8 @@ ionize_all_part(int qso_ind, int * qso_cand, FOFGroups * fof, ForceTree * tree)
     tw->result_type_elsize = sizeof(TreeWalkResultBase);
 
     struct QSOPriv priv[1];
-    priv[0].spin = init_spinlocks(PartManager->NumPart);
+    priv[0].Claimed = (int *) mymalloc("QSOClaimed", PartManager->NumPart * sizeof(int));
+    memset(priv[0].Claimed, 0, PartManager->NumPart * sizeof(int));
     priv[0].fof = fof;
     /* Ionization counters*/
     priv[0].N_ionized = ta_malloc("n_ionized", int64_t, omp_get_max_threads());
@@ -499,11 +459,7 @@ ionize_all_part(int qso_ind, int * qso_cand, FOFGroups * fof, ForceTree * tree)
 
     tw->priv = priv;
 
-    /* This runs only on one BH*/
-    if(qso_ind > 0)
-        treewalk_run(tw, &qso_cand[qso_ind], 1);
-    else
-        treewalk_run(tw, NULL, 0);
+    treewalk_run(tw, qso, nqso);
 
     int64_t N_ionized = 0;
     int i;
@@ -512,13 +468,13 @@ ionize_all_part(int qso_ind, int * qso_cand, FOFGroups * fof, ForceTree * tree)
 
     ta_free(priv[0].N_ionized);
 
-    free_spinlocks(priv[0].spin);
+    myfree(priv[0].Claimed);
 
     return N_ionized;
 }
 
-/* Sequentially turns on quasars.
- * Keeps adding new quasars until need_more_quasars() returns 0.
+/* Turns on quasars in batches, each ionized with a single treewalk.
+ * Keeps adding new quasars until the desired ionization fraction is reached.
  */
 static void
 turn_on_quasars(double redshift, FOFGroups * fof, ForceTree * tree)
@@ -557,38 +513,51 @@ turn_on_quasars(double redshift, FOFGroups * fof, ForceTree * tree)
     }
 
     int64_t ncand_before = count_QSO_halos(ncand, &ncand_tot, MPI_COMM_WORLD);
-    int iteration;
+    /* The local halos chosen for each batch of quasars*/
+    int * qso_batch = mymalloc("Quasar_batch", sizeof(int) * (ncand + 1));
+    int64_t nqso = 0;
 
-    for(iteration = 0; curionfrac < desired_ion_frac; iteration++){
-        /* Get a new quasar*/
-        int new_qso = choose_QSO_halo(ncand, &ncand_before, &ncand_tot, fof->TotNgroups+iteration);
-        if(new_qso >= ncand)
-            endrun(12, "HeII: QSO %d > no. candidates %d! Cannot happen\n", new_qso, ncand);
+    while(curionfrac < desired_ion_frac) {
         /* Make sure someone has a quasar*/
         if(ncand_tot == 0) {
             if(desired_ion_frac - curionfrac > 0.1)
                 message(0, "HeII: Ionization fraction %g less than desired ionization fraction of %g because not enough quasars\n", curionfrac, desired_ion_frac);
             break;
         }
-        /* Do the ionizations with a tree walk*/
-        int64_t n_ionized = ionize_all_part(new_qso, qso_cand, fof, tree);
+        /* Enough quasars to reach the desired fraction if the bubbles did not overlap:
+         * overlaps mean this usually undershoots, so we repeat until done.*/
+        int64_t nbatch = (desired_ion_frac - curionfrac) * n_gas_tot / DMAX(non_overlapping_bubble_number, 1) + 1;
+        if(nbatch > ncand_tot)
+            nbatch = ncand_tot;
+        int nlocal = 0;
+        int64_t b;
+        for(b = 0; b < nbatch; b++) {
+            /* Get a new quasar. This is the same sequence as choosing them one at a time.*/
+            int new_qso = choose_QSO_halo(ncand, &ncand_before, &ncand_tot, fof->TotNgroups + nqso + b);
+            if(new_qso >= ncand)
+                endrun(12, "HeII: QSO %d > no. candidates %d! Cannot happen\n", new_qso, ncand);
+            if(new_qso < 0)
+                continue;
+            qso_batch[nlocal++] = qso_cand[new_qso];
+            /* Remove this candidate from the list by moving the list down.*/
+            memmove(qso_cand + new_qso, qso_cand + new_qso + 1, (ncand - new_qso) * sizeof(int));
+            ncand--;
+        }
+        nqso += nbatch;
+        /* Do the ionizations of all the bubbles in one tree walk*/
+        int64_t n_ionized = ionize_all_part(qso_batch, nlocal, fof, tree);
         int64_t tot_qso_ionized = 0;
         /* Check that the ionization fraction changed*/
         MPI_Allreduce(&n_ionized, &tot_qso_ionized, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
         curionfrac += (double) tot_qso_ionized / (double) n_gas_tot;
         tot_n_ionized += tot_qso_ionized;
-        if(new_qso > 0)
-            message(1, "HeII: Quasar %d changed the HeIII ionization fraction to %g, ionizing %ld\n", qso_cand[new_qso], curionfrac, tot_qso_ionized);
+        message(0, "HeII: %ld quasars changed the HeIII ionization fraction to %g, ionizing %ld\n", nbatch, curionfrac, tot_qso_ionized);
         /* Break the loop if we do not ionize enough particles this round.
          * Try again next timestep when we will hopefully have new BHs.*/
-        if(tot_qso_ionized < 0.01 * non_overlapping_bubble_number && iteration > 10)
+        if(tot_qso_ionized < 0.01 * non_overlapping_bubble_number * nbatch && nqso > 10)
             break;
-        /* Remove this candidate from the list by moving the list down.*/
-        if( new_qso >= 0) {
-            memmove(qso_cand+new_qso, qso_cand+new_qso+1, ncand - new_qso+1);
-            ncand--;
-        }
     }
+    myfree(qso_batch);
     if(qso_cand) {
         myfree(qso_cand);
     }
@@ -63,6 +63,8 @@
 #include "utils/endrun.h"
 #include "utils/paramset.h"
 #include "utils/mymalloc.h"
+#include "utils/string.h"
+#include "utils/system.h"
 
 static struct cooling_params CoolingParams;
 
@@ -113,7 +115,10 @@ init_itp_type(double * xarr, struct itp_type * Gamma, int Nelem)
 static double
 load_tree_value(char ** saveptr)
 {
-    double data = atof(strtok_r(NULL, " \t", saveptr));
+    char * retval = strtok_r(NULL, " \t", saveptr);
+    if(!retval)
+        endrun(0, "Incomplete line in photon background (TREECOOL) file\n");
+    double data = atof(retval);
     if(data > 0)
         return log10(data);
     return -9000;
@@ -130,32 +135,15 @@ load_treecool(const char * TreeCoolFile)
 {
     if(!CoolingParams.PhotoIonizationOn)
         return;
-    FILE * fd = fopen(TreeCoolFile, "r");
-    if(!fd)
-        endrun(456, "Could not open photon background (TREECOOL) file at: '%s'\n", TreeCoolFile);
+    /* Only rank 0 reads the file: every rank parses the broadcast copy.*/
+    char * content = MPIU_file_get_content(TreeCoolFile, 0, MPI_COMM_WORLD);
+    if(!content)
+        endrun(0, "Could not open photon background (TREECOOL) file at: '%s'\n", TreeCoolFile);
 
-    /*Find size of file*/
-    NTreeCool = 0;
-    do
-    {
-        char buffer[1024];
-        char * retval = fgets(buffer, 1024, fd);
-        /*Happens on end of file*/
-        if(!retval)
-            break;
-        retval = strtok(buffer, " \t");
-        /*Discard comments*/
-        if(!retval || retval[0] == '#')
-            continue;
-        NTreeCool++;
-    }
-    while(1);
-    rewind(fd);
-
-    MPI_Bcast(&(NTreeCool), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    char ** lines = fastpm_strsplit_table(content, &NTreeCool);
 
     if(NTreeCool<= 2)
-        endrun(1, "Photon background contains: %d entries, not enough.\n", NTreeCool);
+        endrun(0, "Photon background contains: %d entries, not enough.\n", NTreeCool);
 
     /*Allocate memory for the photon background table.*/
     Gamma_log1z = mymalloc("TreeCoolTable", 7 * NTreeCool * sizeof(double));
@@ -166,38 +154,23 @@ load_treecool(const char * TreeCoolFile)
     Eps_HeI.ydata = Gamma_log1z + 5 * NTreeCool;
     Eps_HeII.ydata = Gamma_log1z + 6 * NTreeCool;
 
-    int ThisTask;
-    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0)
+    int i;
+    for(i = 0; i < NTreeCool; i++)
     {
-        int i = 0;
-        while(i < NTreeCool)
-        {
-            char buffer[1024];
-            char * saveptr;
-            char * line = fgets(buffer, 1024, fd);
-            /*Happens on end of file*/
-            if(!line)
-                break;
-            char * retval = strtok_r(line, " \t", &saveptr);
-            if(!retval || retval[0] == '#')
-                continue;
-            Gamma_log1z[i] = atof(retval);
-            /*Get the rest*/
-            Gamma_HI.ydata[i]   = load_tree_value(&saveptr);
-            Gamma_HeI.ydata[i]  = load_tree_value(&saveptr);
-            Gamma_HeII.ydata[i] = load_tree_value(&saveptr);
-            Eps_HI.ydata[i]     = load_tree_value(&saveptr)+ CoolingParams.HydrogenHeatAmp;
-            Eps_HeI.ydata[i]    = load_tree_value(&saveptr);
-            Eps_HeII.ydata[i]   = load_tree_value(&saveptr);
-            i++;
-        }
-
-        fclose(fd);
+        char * saveptr;
+        char * retval = strtok_r(lines[i], " \t", &saveptr);
+        Gamma_log1z[i] = atof(retval);
+        /*Get the rest*/
+        Gamma_HI.ydata[i]   = load_tree_value(&saveptr);
+        Gamma_HeI.ydata[i]  = load_tree_value(&saveptr);
+        Gamma_HeII.ydata[i] = load_tree_value(&saveptr);
+        Eps_HI.ydata[i]     = load_tree_value(&saveptr)+ CoolingParams.HydrogenHeatAmp;
+        Eps_HeI.ydata[i]    = load_tree_value(&saveptr);
+        Eps_HeII.ydata[i]   = load_tree_value(&saveptr);
     }
+    ta_free(lines);
+    ta_free(content);
 
-    /*Broadcast data to other processors*/
-    MPI_Bcast(Gamma_log1z, 7 * NTreeCool, MPI_DOUBLE, 0, MPI_COMM_WORLD);
     /*Initialize the UVB redshift interpolation: reticulate the splines*/
     init_itp_type(Gamma_log1z, &Gamma_HI, NTreeCool);
     init_itp_type(Gamma_log1z, &Gamma_HeI, NTreeCool);
@@ -683,6 +656,75 @@ get_equilib_ne(double density, double ienergy, double helium, double * logt, con
     return scipy_optimize_fixed_point(ne_init, nh, ienergy, helium, logt, uvbg);
 }
 
+/* Table of the equilibrium electron abundance, ne/nh, against log nh and log ienergy,
+ * for a single UVB and helium fraction. It is only used for the starting point of the rate network solver,
+ * so interpolation errors do not change the converged answer. The table is keyed on internal energy
+ * rather than temperature because the temperature itself depends on ne.*/
+#define NETAB_NH 40
+#define NETAB_U 80
+#define NETAB_LOGNHMIN log(1e-10)
+#define NETAB_LOGNHMAX log(1e2)
+/* Internal energies corresponding to the range of the recombination tables at mu = 1*/
+#define NETAB_LOGUMIN (RECOMBTMIN + log(BOLTZMANN / (GAMMA_MINUS1 * PROTONMASS)))
+#define NETAB_LOGUMAX (RECOMBTMAX + log(BOLTZMANN / (GAMMA_MINUS1 * PROTONMASS)))
+
+static struct {
+    int Valid;
+    double helium;
+    struct UVBG uvbg;
+    double nebynh[NETAB_NH][NETAB_U];
+} NeTable;
+
+/*Build the equilibrium electron abundance table for this UVB.*/
+void
+set_equilib_ne_table(const struct UVBG * uvbg, double helium)
+{
+    /* No UVB means no cooling: nothing will use the table*/
+    if(!CoolingParams.PhotoIonizationOn)
+        return;
+    if(NeTable.Valid && NeTable.helium == helium && memcmp(&NeTable.uvbg, uvbg, sizeof(struct UVBG)) == 0)
+        return;
+    NeTable.Valid = 0;
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < NETAB_NH; i++) {
+        const double nh = exp(NETAB_LOGNHMIN + (NETAB_LOGNHMAX - NETAB_LOGNHMIN) * i / (NETAB_NH - 1));
+        int j;
+        for(j = 0; j < NETAB_U; j++) {
+            const double ienergy = exp(NETAB_LOGUMIN + (NETAB_LOGUMAX - NETAB_LOGUMIN) * j / (NETAB_U - 1));
+            double logt;
+            /* Start from full ionization, as get_equilib_ne does, to avoid the ne = 0 solution.*/
+            NeTable.nebynh[i][j] = scipy_optimize_fixed_point(1.0, nh, ienergy, helium, &logt, uvbg) / nh;
+        }
+    }
+    NeTable.helium = helium;
+    NeTable.uvbg = *uvbg;
+    NeTable.Valid = 1;
+}
+
+/* True if the electron abundance table was built for this UVB and helium fraction*/
+static int
+equilib_ne_table_valid(const struct UVBG * uvbg, double helium)
+{
+    return NeTable.Valid && NeTable.helium == helium && memcmp(&NeTable.uvbg, uvbg, sizeof(struct UVBG)) == 0;
+}
+
+/* Bilinear interpolation of the electron abundance table. Returns -1 outside the table.
+ * Branch-free apart from the range check, so loops over it vectorize.*/
+#pragma omp declare simd
+static double
+equilib_ne_table_guess(double nh, double ienergy)
+{
+    const double x = (log(nh) - NETAB_LOGNHMIN) / (NETAB_LOGNHMAX - NETAB_LOGNHMIN) * (NETAB_NH - 1);
+    const double y = (log(ienergy) - NETAB_LOGUMIN) / (NETAB_LOGUMAX - NETAB_LOGUMIN) * (NETAB_U - 1);
+    if(!(x >= 0 && y >= 0 && x < NETAB_NH - 1 && y < NETAB_U - 1))
+        return -1;
+    const int ix = x, iy = y;
+    const double fx = x - ix, fy = y - iy;
+    return (1 - fx) * ((1 - fy) * NeTable.nebynh[ix][iy] + fy * NeTable.nebynh[ix][iy+1])
+            + fx * ((1 - fy) * NeTable.nebynh[ix+1][iy] + fy * NeTable.nebynh[ix+1][iy+1]);
+}
+
 /*Same as above, but get electrons per proton.*/
 double
 get_ne_by_nh(double density, double ienergy, double helium, const struct UVBG * uvbg, double ne_init)
@@ -1020,6 +1062,9 @@ init_cooling_rates(const char * TreeCoolFile, const char * MetalCoolFile, Cosmol
     InitMetalCooling(MetalCoolFile);
 }
 
+static double
+heatingcooling_rate_at_ne(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double ne, double logt, double *ne_equilib);
+
 /*Get the total change in internal energy per unit time in erg/s/g for a given temperature (internal energy) and density.
   density is total gas density in protons/cm^3
   Internal energy is in ergs/g.
@@ -1031,8 +1076,46 @@ init_cooling_rates(const char * TreeCoolFile, const char * MetalCoolFile, Cosmol
 double
 get_heatingcooling_rate(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double *ne_equilib)
 {
+    double ne_init = *ne_equilib;
+    /* The tabulated abundance is a better starting point than the last one,
+     * which in DoCooling is often at a very different internal energy.*/
+    if(equilib_ne_table_valid(uvbg, helium)) {
+        double guess = equilib_ne_table_guess(density * (1 - helium), ienergy);
+        if(guess > 0)
+            ne_init = guess;
+    }
     double logt;
-    double ne = get_equilib_ne(density, ienergy, helium, &logt, uvbg, *ne_equilib);
+    double ne = get_equilib_ne(density, ienergy, helium, &logt, uvbg, ne_init);
+    return heatingcooling_rate_at_ne(density, ienergy, helium, redshift, metallicity, uvbg, ne, logt, ne_equilib);
+}
+
+/* Batched version of get_heatingcooling_rate for n particles sharing a UVB.
+ * The table lookups for the starting electron abundance are vectorized;
+ * the rate network is then converged exactly for each particle. */
+void
+get_heatingcooling_rate_batch(const int n, const double * density, const double * ienergy, const double * helium, double redshift, const double * metallicity, const struct UVBG * uvbg, double * ne_equilib, double * LambdaNet)
+{
+    int i;
+    if(NeTable.Valid && memcmp(&NeTable.uvbg, uvbg, sizeof(struct UVBG)) == 0) {
+        const double tabhelium = NeTable.helium;
+        #pragma omp simd
+        for(i = 0; i < n; i++) {
+            double guess = equilib_ne_table_guess(density[i] * (1 - helium[i]), ienergy[i]);
+            if(helium[i] == tabhelium && guess > 0)
+                ne_equilib[i] = guess;
+        }
+    }
+    for(i = 0; i < n; i++) {
+        double logt;
+        double ne = get_equilib_ne(density[i], ienergy[i], helium[i], &logt, uvbg, ne_equilib[i]);
+        LambdaNet[i] = heatingcooling_rate_at_ne(density[i], ienergy[i], helium[i], redshift, metallicity[i], uvbg, ne, logt, &ne_equilib[i]);
+    }
+}
+
+/* The net heating rate given the equilibrium electron density ne (in cgs) and log temperature.*/
+static double
+heatingcooling_rate_at_ne(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double ne, double logt, double *ne_equilib)
+{
     double nh = density * (1 - helium);
     double nebynh = ne/nh;
     /*Faster than running the exp.*/
@@ -91,6 +91,16 @@ double get_ne_by_nh(double density, double ienergy, double helium, const struct
  */
 double get_heatingcooling_rate(double density, double ienergy, double helium, double redshift, double metallicity, const struct UVBG * uvbg, double * ne_equilib);
 
+/* Batched get_heatingcooling_rate for n particles which share a UVB.
+ * density, ienergy, helium and metallicity are arrays of length n.
+ * ne_equilib is the initial guess on input and the equilibrium electron abundance on output.
+ * LambdaNet is set to the net heating rate of each particle.*/
+void get_heatingcooling_rate_batch(const int n, const double * density, const double * ienergy, const double * helium, double redshift, const double * metallicity, const struct UVBG * uvbg, double * ne_equilib, double * LambdaNet);
+
+/* Tabulate the equilibrium electron abundance for this UVB and helium fraction.
+ * The rate network starts from the table for particles with the same UVB. Call outside of parallel regions.*/
+void set_equilib_ne_table(const struct UVBG * uvbg, double helium);
+
 /*Get the neutral hydrogen fraction at a given temperature and density.
 density is gas density in protons/cm^3
 Internal energy is in J/kg == 10^-10 ergs/g.
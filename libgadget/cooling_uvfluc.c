@@ -13,12 +13,19 @@
 #include "utils/mymalloc.h"
 #include "utils/interp.h"
 #include "utils/endrun.h"
+#include "utils/system.h"
 
 static struct {
     int enabled;
     Interp interp;
     double * Table;
+    /* Table, ZreionMin and ZreionMax are read only and shared by the ranks of a node*/
+    MPI_Win TableWin, ZreionWin;
     ptrdiff_t Nside;
+    /* Smallest and largest reionization redshift on the corners of each mesh cell,
+     * so only particles in cells reionizing this step need the interpolation.*/
+    float * ZreionMin;
+    float * ZreionMax;
 } UVF;
 
 /*Global UVbackground stored to avoid extra interpolations.*/
@@ -29,54 +36,64 @@ static double GlobalUVRed = -1;
 void
 set_global_uvbg(double redshift)
 {
+    /* Already computed for this redshift*/
+    if(redshift == GlobalUVRed)
+        return;
     GlobalUVBG = get_global_UVBG(redshift);
     GlobalUVRed = redshift;
+    set_equilib_ne_table(&GlobalUVBG, 1 - HYDROGEN_MASSFRAC);
 }
 
 /* Read a big array from filename/dataset into an array, allocating memory in buffer.
- * which is returned. Nread argument is set equal to number of elements read.*/
+ * which is returned. Nread argument is set equal to number of elements read.
+ * If win is not NULL the array is a read only table with one copy per node, in the
+ * shared window win. Otherwise it is allocated with mymalloc on each rank.*/
 static double *
-read_big_array(const char * filename, char * dataset, int * Nread)
+read_big_array(const char * filename, char * dataset, int * Nread, MPI_Win * win)
 {
     int N;
-    void * buffer=NULL;
+    double * buffer=NULL;
     int ThisTask;
     MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
 
+    BigFile bf[1];
+    BigBlock bb[1];
     if(ThisTask == 0) {
-        BigFile bf[1];
-        BigBlockPtr ptr;
-        BigBlock bb[1];
-        BigArray array[1];
-        size_t dims[2];
         big_file_open(bf, filename);
         if(0 != big_file_open_block(bf, bb, dataset)) {
             endrun(1, "Cannot open %s %s: %s\n", filename, dataset, big_file_get_error_message());
         }
+        N = bb->size * bb->nmemb;
+    }
 
-        N = bb->size;
-
-        buffer = mymalloc("cooling_data", N * dtype_itemsize(bb->dtype) * bb->nmemb);
+    MPI_Bcast(&N, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(win)
+        buffer = MPIU_alloc_node_shared(N * sizeof(double), win);
+    else
+        buffer = mymalloc("cooling_data", N * sizeof(double));
 
-        dims[0] = N;
+    if(ThisTask == 0) {
+        BigBlockPtr ptr;
+        BigArray array[1];
+        size_t dims[2];
+        dims[0] = bb->size;
         dims[1] = bb->nmemb;
 
-        big_array_init(array, buffer, bb->dtype, 2, dims, NULL);
+        /* Converted to double on read*/
+        big_array_init(array, buffer, "f8", 2, dims, NULL);
         if(0 != big_block_seek(bb, &ptr, 0))
             endrun(1, "Failed to seek block %s %s: %s\n", filename, dataset, big_file_get_error_message());
 
         if(0 != big_block_read(bb, &ptr, array))
             endrun(1, "Failed to read %s %s: %s", filename, dataset, big_file_get_error_message());
-        /* steal the buffer */
         big_block_close(bb);
         big_file_close(bf);
     }
 
-    MPI_Bcast(&N, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    if(ThisTask != 0)
-        buffer = mymalloc("cooling_data",N * sizeof(double));
-
-    MPI_Bcast(buffer, N, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    if(win)
+        MPIU_Bcast_node_shared(buffer, N * sizeof(double), *win);
+    else
+        MPI_Bcast(buffer, N, MPI_DOUBLE, 0, MPI_COMM_WORLD);
 
     *Nread = N;
     return buffer;
@@ -93,7 +110,7 @@ read_big_array(const char * filename, char * dataset, int * Nread)
  * the reionization redshift as function of space, on a grid give by
  * XYZ_Bins.
  *
- * Notice that this table is broadcast to all MPI ranks, thus it can't be
+ * Notice that there is a copy of this table on every node, thus it can't be
  * too big. (400x400x400 is around 400 MBytes)
  *
  * */
@@ -135,7 +152,7 @@ init_uvf_table(const char * UVFluctuationFile, const double BoxSize, const doubl
     UVF.enabled = 1;
 
     int size;
-    UVF.Table = read_big_array(UVFluctuationFile, "Zreion_Table", &size);
+    UVF.Table = read_big_array(UVFluctuationFile, "Zreion_Table", &size, &UVF.TableWin);
 
     if(UVF.Nside * UVF.Nside * UVF.Nside != size)
         endrun(0, "Corrupt UV Fluctuation table: Nside = %ld, but table is %ld != %ld^3\n", UVF.Nside, size, UVF.Nside);
@@ -149,6 +166,57 @@ init_uvf_table(const char * UVFluctuationFile, const double BoxSize, const doubl
     if(UVF.Table[0] < 0.01 || UVF.Table[0] > 100.0) {
         endrun(0, "UV Fluctuation out of range: %g\n", UVF.Table[0]);
     }
+
+    /* The trilinear interpolant lies between the smallest and largest corner values.
+     * Round outwards so the float bounds stay conservative.*/
+    const ptrdiff_t N = UVF.Nside;
+    UVF.ZreionMin = MPIU_alloc_node_shared(2 * N * N * N * sizeof(float), &UVF.ZreionWin);
+    UVF.ZreionMax = UVF.ZreionMin + N * N * N;
+    /* The leader of each node computes the bounds for the node*/
+    const ptrdiff_t ncell = MPIU_node_leader() ? N * N * N : 0;
+    ptrdiff_t i;
+    #pragma omp parallel for
+    for(i = 0; i < ncell; i++) {
+        const ptrdiff_t x = i / (N * N), y = (i / N) % N, z = i % N;
+        double zmin = UVF.Table[i], zmax = UVF.Table[i];
+        int c;
+        for(c = 1; c < 8; c++) {
+            const ptrdiff_t x1 = (x + ((c & 1) ? 1 : 0)) % N;
+            const ptrdiff_t y1 = (y + ((c & 2) ? 1 : 0)) % N;
+            const ptrdiff_t z1 = (z + ((c & 4) ? 1 : 0)) % N;
+            const double zz = UVF.Table[(x1 * N + y1) * N + z1];
+            if(zz < zmin)
+                zmin = zz;
+            if(zz > zmax)
+                zmax = zz;
+        }
+        UVF.ZreionMin[i] = nextafterf((float) zmin, -INFINITY);
+        UVF.ZreionMax[i] = nextafterf((float) zmax, INFINITY);
+    }
+    MPIU_Bcast_node_shared(UVF.ZreionMin, 0, UVF.ZreionWin);
+}
+
+/* True if the UV fluctuation table says the point at Pos is reionized by this redshift.
+ * Uses the per-cell bounds and only interpolates in cells which are partly reionized.*/
+static int
+uvf_is_reionized(double * Pos, double redshift)
+{
+    const ptrdiff_t N = UVF.Nside;
+    ptrdiff_t xi[3];
+    int d;
+    for(d = 0; d < 3; d++) {
+        /* Same cell as interp_eval_periodic*/
+        xi[d] = floor((Pos[d] - UVF.interp.Min[d]) / UVF.interp.Step[d]);
+        xi[d] %= N;
+        if(xi[d] < 0)
+            xi[d] += N;
+    }
+    const ptrdiff_t cell = (xi[0] * N + xi[1]) * N + xi[2];
+    if(UVF.ZreionMin[cell] >= redshift)
+        return 1;
+    if(UVF.ZreionMax[cell] < redshift)
+        return 0;
+    return interp_eval_periodic(&UVF.interp, Pos, UVF.Table) >= redshift;
 }
 
 /*
@@ -170,8 +238,7 @@ struct UVBG get_local_UVBG(double redshift, double * Pos)
 
     uvbg.self_shield_dens = GlobalUVBG.self_shield_dens;
 
-    double zreion = interp_eval_periodic(&UVF.interp, Pos, UVF.Table);
-    if(zreion < redshift) {
+    if(!uvf_is_reionized(Pos, redshift)) {
         return uvbg;
     }
 
@@ -193,6 +260,7 @@ struct {
     double * Temperature_bins;
 
     double * Lmet_table; /* metal cooling @ one solar metalicity*/
+    MPI_Win TableWin; /* Lmet_table is shared by the ranks of a node*/
 
     Interp interp;
 } MetalCool;
@@ -217,17 +285,17 @@ InitMetalCooling(const char * MetalCoolFile)
 
     int size;
     //This is never used if MetalCoolFile == ""
-    double * tabbedmet = read_big_array(MetalCoolFile, "MetallicityInSolar_bins", &size);
+    double * tabbedmet = read_big_array(MetalCoolFile, "MetallicityInSolar_bins", &size, NULL);
 
     if(size != 1 || tabbedmet[0] != 0.0) {
         endrun(123, "MetalCool file %s is wrongly tabulated\n", MetalCoolFile);
     }
     myfree(tabbedmet);
 
-    MetalCool.Redshift_bins = read_big_array(MetalCoolFile, "Redshift_bins", &MetalCool.NRedshift_bins);
-    MetalCool.HydrogenNumberDensity_bins = read_big_array(MetalCoolFile, "HydrogenNumberDensity_bins", &MetalCool.NHydrogenNumberDensity_bins);
-    MetalCool.Temperature_bins = read_big_array(MetalCoolFile, "Temperature_bins", &MetalCool.NTemperature_bins);
-    MetalCool.Lmet_table = read_big_array(MetalCoolFile, "NetCoolingRate", &size);
+    MetalCool.Redshift_bins = read_big_array(MetalCoolFile, "Redshift_bins", &MetalCool.NRedshift_bins, NULL);
+    MetalCool.HydrogenNumberDensity_bins = read_big_array(MetalCoolFile, "HydrogenNumberDensity_bins", &MetalCool.NHydrogenNumberDensity_bins, NULL);
+    MetalCool.Temperature_bins = read_big_array(MetalCoolFile, "Temperature_bins", &MetalCool.NTemperature_bins, NULL);
+    MetalCool.Lmet_table = read_big_array(MetalCoolFile, "NetCoolingRate", &size, &MetalCool.TableWin);
 
     int dims[] = {MetalCool.NRedshift_bins, MetalCool.NHydrogenNumberDensity_bins, MetalCool.NTemperature_bins};
 
@@ -38,6 +38,9 @@ void init_cosmology(Cosmology * CP, const double TimeBegin)
     if(CP->MNu[0] + CP->MNu[1] + CP->MNu[2] > 0) {
         CP->OmegaCDM -= get_omega_nu(&CP->ONu, 1);
     }
+    /* The growth table is built later by init_growth_table*/
+    CP->GrowthTableN = 0;
+    CP->GrowthTable = NULL;
 }
 
 /*Hubble function at scale factor a, in dimensions of CP.Hubble*/
@@ -65,8 +68,42 @@ double hubble_function(const Cosmology * CP, double a)
 
 static double growth(Cosmology * CP, double a, double *dDda);
 
+/*!< Number of entries in the growth table*/
+#define GROWTH_TABLE_LENGTH 1024
+
+/* Interpolate ln D and f = d ln D / d ln a at a from the table with a cubic Hermite spline,
+ * whose slopes at the nodes are the tabulated f. Returns 0 if a is outside the table.*/
+static int
+growth_table_eval(const Cosmology * CP, const double a, double * lnD, double * f)
+{
+    if(CP->GrowthTableN == 0)
+        return 0;
+    const double x = (log(a) - CP->GrowthLogAMin) / CP->GrowthDLogA;
+    /* Allow for roundoff in the log at the ends of the table*/
+    if(!(x >= -1e-8) || x > CP->GrowthTableN - 1 + 1e-8)
+        return 0;
+    int i = x;
+    if(i < 0)
+        i = 0;
+    if(i > CP->GrowthTableN - 2)
+        i = CP->GrowthTableN - 2;
+    const double t = x - i;
+    const double h = CP->GrowthDLogA;
+    const double * y = CP->GrowthTable;
+    const double * dy = CP->GrowthTable + CP->GrowthTableN;
+    const double t2 = t * t, t3 = t2 * t;
+    *lnD = (2 * t3 - 3 * t2 + 1) * y[i] + (t3 - 2 * t2 + t) * h * dy[i]
+         + (-2 * t3 + 3 * t2) * y[i+1] + (t3 - t2) * h * dy[i+1];
+    if(f)
+        *f = (6 * t2 - 6 * t) / h * (y[i] - y[i+1]) + (3 * t2 - 4 * t + 1) * dy[i] + (3 * t2 - 2 * t) * dy[i+1];
+    return 1;
+}
+
 double GrowthFactor(Cosmology * CP, double astart, double aend)
 {
+    double lnD0, lnD1;
+    if(growth_table_eval(CP, astart, &lnD0, NULL) && growth_table_eval(CP, aend, &lnD1, NULL))
+        return exp(lnD0 - lnD1);
     return growth(CP, astart, NULL) / growth(CP, aend, NULL);
 }
 
@@ -94,23 +131,33 @@ int growth_ode(double a, const double yy[], double dyda[], void * params)
  * Define F = a^3 H dD/da
  * and we have: dF/da = 1.5 a H D
  */
+/* Start the integration of the growth equation at curtime.
+ * Initial velocity chosen so that D = Omegar + 3/2 Omega_m a,
+ * the solution for a matter/radiation universe.
+ * Note the normalisation of D is arbitrary
+ * and never seen outside this file.*/
+static gsl_odeiv2_driver *
+growth_start(Cosmology * CP, gsl_odeiv2_system * FF, const double curtime, double yinit[2])
+{
+  FF->function = &growth_ode;
+  FF->jacobian = NULL;
+  FF->params = CP;
+  FF->dimension = 2;
+  gsl_odeiv2_driver * drive = gsl_odeiv2_driver_alloc_standard_new(FF,gsl_odeiv2_step_rkf45, 1e-5, 1e-8,1e-8,1,1);
+  yinit[0] = 1.5 * (CP->OmegaCDM + CP->OmegaBaryon)/(curtime*curtime);
+  yinit[1] = pow(curtime,3)*hubble_function(CP, curtime)/CP->Hubble * 1.5 * (CP->OmegaCDM + CP->OmegaBaryon)/(curtime*curtime*curtime);
+  if(CP->RadiationOn)
+      yinit[0] += CP->OmegaG/pow(curtime, 4)+get_omega_nu(&CP->ONu, curtime);
+  return drive;
+}
+
 double growth(Cosmology * CP, double a, double * dDda)
 {
   gsl_odeiv2_system FF;
-  FF.function = &growth_ode;
-  FF.jacobian = NULL;
-  FF.params = CP;
-  FF.dimension = 2;
-  gsl_odeiv2_driver * drive = gsl_odeiv2_driver_alloc_standard_new(&FF,gsl_odeiv2_step_rkf45, 1e-5, 1e-8,1e-8,1,1);
    /* We start early to avoid lambda.*/
   double curtime = 1e-5;
-  /* Initial velocity chosen so that D = Omegar + 3/2 Omega_m a,
-   * the solution for a matter/radiation universe.*
-   * Note the normalisation of D is arbitrary
-   * and never seen outside this function.*/
-  double yinit[2] = {1.5 * (CP->OmegaCDM + CP->OmegaBaryon)/(curtime*curtime), pow(curtime,3)*hubble_function(CP, curtime)/CP->Hubble * 1.5 * (CP->OmegaCDM + CP->OmegaBaryon)/(curtime*curtime*curtime)};
-  if(CP->RadiationOn)
-      yinit[0] += CP->OmegaG/pow(curtime, 4)+get_omega_nu(&CP->ONu, curtime);
+  double yinit[2];
+  gsl_odeiv2_driver * drive = growth_start(CP, &FF, curtime, yinit);
 
   int stat = gsl_odeiv2_driver_apply(drive, &curtime,a, yinit);
   if (stat != GSL_SUCCESS) {
@@ -124,12 +171,45 @@ double growth(Cosmology * CP, double a, double * dDda)
   return yinit[0];
 }
 
+void
+init_growth_table(Cosmology * CP, double amin, double amax)
+{
+  if(amax <= amin)
+      endrun(1, "Error: Invalid growth table range: (%g->%g)\n", amin, amax);
+  if(!CP->GrowthTable)
+      CP->GrowthTable = mymalloc("GrowthTable", 2 * sizeof(double) * GROWTH_TABLE_LENGTH);
+  CP->GrowthTableN = 0;
+  CP->GrowthLogAMin = log(amin);
+  CP->GrowthDLogA = (log(amax) - CP->GrowthLogAMin) / (GROWTH_TABLE_LENGTH - 1);
+
+  gsl_odeiv2_system FF;
+  double curtime = 1e-5;
+  double yy[2];
+  gsl_odeiv2_driver * drive = growth_start(CP, &FF, curtime, yy);
+  int i;
+  /* The driver continues from the last node, so the whole table is one integration*/
+  for(i = 0; i < GROWTH_TABLE_LENGTH; i++) {
+      const double a = exp(CP->GrowthLogAMin + i * CP->GrowthDLogA);
+      int stat = gsl_odeiv2_driver_apply(drive, &curtime, a, yy);
+      if (stat != GSL_SUCCESS)
+          endrun(1,"gsl_odeiv in growth table: %d. Result at %g is %g %g\n",stat, curtime, yy[0], yy[1]);
+      const double dDda = yy[1]/pow(a,3)/(hubble_function(CP, a)/CP->Hubble);
+      CP->GrowthTable[i] = log(yy[0]);
+      CP->GrowthTable[GROWTH_TABLE_LENGTH + i] = a / yy[0] * dDda;
+  }
+  gsl_odeiv2_driver_free(drive);
+  CP->GrowthTableN = GROWTH_TABLE_LENGTH;
+}
+
 /*
  * This is the Zeldovich approximation prefactor,
  * f1 = d ln D1 / dlna = a / D (dD/da)
  */
 double F_Omega(Cosmology * CP, double a)
 {
+    double lnD, f;
+    if(growth_table_eval(CP, a, &lnD, &f))
+        return f;
     double dD1da=0;
     double D1 = growth(CP, a, &dD1da);
     return a / D1 * dD1da;
@@ -21,6 +21,12 @@ typedef struct {
     int RadiationOn; /* flags whether to include the radiation density in the background */
     _omega_nu ONu;   /*Structure for storing massive neutrino densities*/
     double MNu[3]; /*Neutrino masses in eV*/
+    /* Table of ln D and d ln D / d ln a on a uniform grid in ln a, filled by init_growth_table.
+     * GrowthTableN is zero if there is no table.*/
+    int GrowthTableN;
+    double GrowthLogAMin;
+    double GrowthDLogA;
+    double * GrowthTable;
 } Cosmology;
 
 typedef struct {
@@ -47,4 +53,9 @@ double F_Omega(Cosmology * CP, double a);
 
 /*Initialise the derived parts of the cosmology*/
 void init_cosmology(Cosmology *CP, double TimeBegin);
+
+/* Tabulate the growth factor between amin and amax with one integration of the growth equation.
+ * GrowthFactor and F_Omega then interpolate the table for scale factors inside this range,
+ * and only integrate outside it.*/
+void init_growth_table(Cosmology * CP, double amin, double amax);
 #endif
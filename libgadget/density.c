@@ -9,13 +9,18 @@
 #include "cooling.h"
 #include "densitykernel.h"
 #include "treewalk.h"
+#include "treewalk_ngbiter.h"
 #include "timefac.h"
 #include "slotsmanager.h"
+#include "density.h"
 #include "timestep.h"
 #include "winds.h"
 #include "utils.h"
 
 #define MAXITER 400
+/* In the later iterations a particle is searched out to this factor times its Hsml,
+ * limited by the upper bound, so the candidates can be reused if Hsml grows.*/
+#define DENSITY_SEARCH_FAC 1.26
 
 /* The evolved entropy at drift time: evolved dlog a.
  * Used to predict pressure and entropy for SPH */
@@ -51,12 +56,34 @@ SPH_VelPred(int i, MyFloat * VelPred)
     }
 }
 
+void
+density_predict_particle(int i)
+{
+    int * state = &SphP_scratch->PredState[P[i].PI];
+    if(atomic_compare_and_swap(state, SPH_PRED_NONE, SPH_PRED_BUSY)) {
+        SphP_scratch->EntVarPred[P[i].PI] = SPH_EntVarPred(i);
+        SPH_VelPred(i, SphP_scratch->VelPred + 3 * P[i].PI);
+        __atomic_store_n(state, SPH_PRED_DONE, __ATOMIC_RELEASE);
+        return;
+    }
+    while(__atomic_load_n(state, __ATOMIC_ACQUIRE) != SPH_PRED_DONE)
+        continue;
+}
+
+/* Number of neighbours inside the kernel which are evaluated together*/
+#define DENSITY_NGB_BATCH 32
+
 /*! Structure for communication during the density computation. Holds data that is sent to other processors.
 */
 typedef struct {
     TreeWalkNgbIterBase base;
     DensityKernel kernel;
     double kernel_volume;
+    /* Neighbours inside the kernel, waiting for density_ngbiter_flush*/
+    int nbatch;
+    int other[DENSITY_NGB_BATCH];
+    double r[DENSITY_NGB_BATCH];
+    double dist[DENSITY_NGB_BATCH][3];
 } TreeWalkNgbIterDensity;
 
 typedef struct
@@ -113,6 +140,8 @@ density_ngbiter(
         TreeWalkNgbIterDensity * iter,
         LocalTreeWalk * lv);
 
+TREEWALK_DEFINE_NGBITER_VISIT(density_visit, density_ngbiter, TreeWalkNgbIterDensity)
+
 static int density_haswork(int n, TreeWalk * tw);
 static void density_postprocess(int i, TreeWalk * tw);
 static void density_check_neighbours(int i, TreeWalk * tw);
@@ -129,6 +158,12 @@ static void density_copy(int place, TreeWalkQueryDensity * I, TreeWalk * tw);
  */
 
 
+double
+density_search_factor(void)
+{
+    return DENSITY_SEARCH_FAC;
+}
+
 /*! This function computes the local density for each active SPH particle, the
  * number of neighbours in the current smoothing radius, and the divergence
  * and rotation of the velocity field.  The pressure is updated as well.  If a
@@ -151,7 +186,7 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, ForceTre
     struct DensityPriv priv[1];
 
     tw->ev_label = "DENSITY";
-    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->visit = density_visit;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterDensity);
     tw->ngbiter = (TreeWalkNgbIterFunction) density_ngbiter;
     tw->haswork = density_haswork;
@@ -162,6 +197,12 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, ForceTre
     tw->result_type_elsize = sizeof(TreeWalkResultDensity);
     tw->priv = priv;
     tw->tree = tree;
+    /* The first iteration stores the candidates of every particle.
+     * Later iterations reuse them where Hsml is still inside the search radius,
+     * as do later calls on the same tree, such as the entropy iteration at startup.*/
+    tw->ngbcache = TREEWALK_NGBCACHE_FILL | TREEWALK_NGBCACHE_USE;
+    /* Particles whose neighbours are all in the halo are not exported*/
+    tw->halo = 1;
 
     int i;
     int64_t ntot = 0;
@@ -191,11 +232,13 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, ForceTre
         P[i].NumNgb = 0;
         DENSITY_GET_PRIV(tw)->Left[i] = 0;
         DENSITY_GET_PRIV(tw)->Right[i] = tree->BoxSize;
-        if(P[i].Type == 0) {
-            SphP_scratch->EntVarPred[P[i].PI] = SPH_EntVarPred(i);
-            SPH_VelPred(i, SphP_scratch->VelPred + 3 * P[i].PI);
-        }
     }
+    /* The predicted entropy and velocity are computed on first use, for the
+     * active particles in density_copy and for the neighbours in density_ngbiter_flush.
+     * The ghosts of the halo are predicted from their imported data in the same way.
+     * Hydro and black holes then reuse them. Forget any from an earlier call,
+     * as the entropy may have changed since.*/
+    memset(SphP_scratch->PredState, 0, (SlotsManager->info[0].size + treewalk_halo_nghost(tree)) * sizeof(int));
 
     /* allocate buffers to arrange communication */
 
@@ -205,10 +248,11 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, ForceTre
     DENSITY_GET_PRIV(tw)->NPLeft = ta_malloc("NPLeft", size_t, NumThreads);
     DENSITY_GET_PRIV(tw)->NPRedo = ta_malloc("NPRedo", int *, NumThreads);
     int alloc_high = 0;
-    int * ReDoQueue = act->ActiveParticle;
-    int size = SlotsManager->info[0].size + SlotsManager->info[5].size;
-    if(size > act->NumActiveParticle)
-        size = act->NumActiveParticle;
+    int size;
+    int * ReDoQueue = get_active_particles_of_type(act, ACTIVE_GAS_AND_BH, &size);
+    /* Without the typed lists, the gas and black holes are at most this many particles.*/
+    if(!act->ActiveByType && size > SlotsManager->info[0].size + SlotsManager->info[5].size)
+        size = SlotsManager->info[0].size + SlotsManager->info[5].size;
 
     /* we will repeat the whole thing for those particles where we didn't find enough neighbours */
     do {
@@ -295,7 +339,8 @@ density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, ForceTre
     timewait = tw->timewait1 + tw->timewait2;
     timecomm = tw->timecommsumm1 + tw->timecommsumm2;
 
-    walltime_add("/SPH/Density/Compute", timecomp);
+    walltime_add("/SPH/Density/Compute", timecomp - (tw->timeidle1 + tw->timeidle2));
+    walltime_add("/SPH/Density/ThreadIdle", tw->timeidle1 + tw->timeidle2);
     walltime_add("/SPH/Density/Wait", timewait);
     walltime_add("/SPH/Density/Comm", timecomm);
     walltime_add("/SPH/Density/Misc", timeall - (timecomp + timewait + timecomm));
@@ -317,6 +362,7 @@ density_copy(int place, TreeWalkQueryDensity * I, TreeWalk * tw)
     }
     else
     {
+        density_ensure_predicted(place);
         I->Vel[0] = SphP_scratch->VelPred[3 * P[place].PI];
         I->Vel[1] = SphP_scratch->VelPred[3 * P[place].PI + 1];
         I->Vel[2] = SphP_scratch->VelPred[3 * P[place].PI + 2];
@@ -374,67 +420,59 @@ density_reduce(int place, TreeWalkResultDensity * remote, enum TreeWalkReduceMod
  *
  */
 
+/* Evaluate the kernel for the queued neighbours together, then add their contributions.*/
 static void
-density_ngbiter(
+density_ngbiter_flush(
         TreeWalkQueryDensity * I,
         TreeWalkResultDensity * O,
         TreeWalkNgbIterDensity * iter,
         LocalTreeWalk * lv)
 {
-    if(iter->base.other == -1) {
-        const double h = I->Hsml;
-        density_kernel_init(&iter->kernel, h, All.DensityKernelType);
-        iter->kernel_volume = density_kernel_volume(&iter->kernel);
-
-        iter->base.Hsml = h;
-        iter->base.mask = 1; /* gas only */
-        iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
+    const int n = iter->nbatch;
+    /* Nothing queued. This also lets the compiler see the batch arrays are written before use*/
+    if(n <= 0)
+        return;
+    double u[DENSITY_NGB_BATCH], wk[DENSITY_NGB_BATCH], dwk[DENSITY_NGB_BATCH];
+    int k;
+    for(k = 0; k < n; k++)
+        u[k] = iter->r[k] * iter->kernel.Hinv;
+    iter->nbatch = 0;
+
+    density_kernel_wk_many(&iter->kernel, u, wk, n);
+
+    /* For the BH only Ngb is used. BH density is
+     * computed during accretion.*/
+    if(I->Type == 5) {
+        for(k = 0; k < n; k++)
+            O->Ngb += wk[k] * iter->kernel_volume;
         return;
-    }
-    const int other = iter->base.other;
-    const double r = iter->base.r;
-    const double r2 = iter->base.r2;
-    const double * dist = iter->base.dist;
-
-    if(All.WindOn) {
-        if(winds_is_particle_decoupled(other))
-            if(!(I->Type == 0 && I->DelayTime > 0))	/* if I'm not wind, then ignore the wind particle */
-                return;
-    }
-
-    if(P[other].Mass == 0) {
-        endrun(12, "Encountered zero mass particle during density;"
-                  " We haven't implemented tracer particles and this shall not happen\n");
     }
 
-    /* some performance measures*/
-    O->Ninteractions ++;
+    density_kernel_dwk_many(&iter->kernel, u, dwk, n);
 
-    if(r2 < iter->kernel.HH)
+    for(k = 0; k < n; k++)
     {
-        const double u = r * iter->kernel.Hinv;
-        const double wk = density_kernel_wk(&iter->kernel, u);
-        O->Ngb += wk * iter->kernel_volume;
+        const int other = iter->other[k];
+        const double r = iter->r[k];
+        const double * dist = iter->dist[k];
 
-        /* For the BH only Ngb is used. BH density is
-         * computed during accretion.*/
-        if(I->Type == 5)
-            return;
+        /* Also for black holes, which use the predicted values of the same neighbours*/
+        density_ensure_predicted(other);
 
-        const double dwk = density_kernel_dwk(&iter->kernel, u);
+        O->Ngb += wk[k] * iter->kernel_volume;
 
         const double mass_j = P[other].Mass;
 
-        O->Rho += (mass_j * wk);
+        O->Rho += (mass_j * wk[k]);
 
         /* Hinv is here because O->DhsmlDensity is drho / dH.
          * nothing to worry here */
-        double density_dW = density_kernel_dW(&iter->kernel, u, wk, dwk);
+        double density_dW = density_kernel_dW(&iter->kernel, u[k], wk[k], dwk[k]);
         O->DhsmlDensity += mass_j * density_dW;
 
         if(DENSITY_GET_PRIV(lv->tw)->DoEgyDensity) {
             const double EntPred = SphP_scratch->EntVarPred[P[other].PI];
-            O->EgyRho += mass_j * EntPred * wk;
+            O->EgyRho += mass_j * EntPred * wk[k];
             O->DhsmlEgyDensity += mass_j * EntPred * density_dW;
         }
 
@@ -444,14 +482,14 @@ density_ngbiter(
             {
                 int d;
                 for (d = 0; d < 3; d ++) {
-                    O->GradRho[d] += mass_j * dwk * dist[d] / r;
+                    O->GradRho[d] += mass_j * dwk[k] * dist[d] / r;
                 }
             }
         }
 
         if(r > 0)
         {
-            double fac = mass_j * dwk / r;
+            double fac = mass_j * dwk[k] / r;
             double dv[3];
             double rot[3];
             int d;
@@ -468,6 +506,67 @@ density_ngbiter(
     }
 }
 
+static void
+density_ngbiter(
+        TreeWalkQueryDensity * I,
+        TreeWalkResultDensity * O,
+        TreeWalkNgbIterDensity * iter,
+        LocalTreeWalk * lv)
+{
+    if(iter->base.other == -1) {
+        const double h = I->Hsml;
+        density_kernel_init(&iter->kernel, h, All.DensityKernelType);
+        iter->kernel_volume = density_kernel_volume(&iter->kernel);
+
+        iter->base.Hsml = h;
+        /* A particle being redone without complete stored candidates is searched
+         * to a larger radius, so the next iteration can use them.*/
+        if(lv->mode == 0 && DENSITY_GET_PRIV(lv->tw)->NIteration > 0 && lv->tw->tree->NgbCache &&
+            treewalk_ngbcache_radius(lv->tw->tree, lv->target) < h) {
+            const double right = DENSITY_GET_PRIV(lv->tw)->Right[lv->target];
+            iter->base.Hsml = DMAX(h, DMIN(right, DENSITY_SEARCH_FAC * h));
+        }
+        iter->base.mask = 1; /* gas only */
+        iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
+        iter->base.finish = 1;
+        iter->nbatch = 0;
+        return;
+    }
+    /* All neighbours have been seen*/
+    if(iter->base.other == -2) {
+        density_ngbiter_flush(I, O, iter, lv);
+        return;
+    }
+    const int other = iter->base.other;
+    const double r2 = iter->base.r2;
+
+    if(All.WindOn) {
+        if(winds_is_particle_decoupled(other))
+            if(!(I->Type == 0 && I->DelayTime > 0))	/* if I'm not wind, then ignore the wind particle */
+                return;
+    }
+
+    if(P[other].Mass == 0) {
+        endrun(12, "Encountered zero mass particle during density;"
+                  " We haven't implemented tracer particles and this shall not happen\n");
+    }
+
+    /* some performance measures*/
+    O->Ninteractions ++;
+
+    if(r2 < iter->kernel.HH)
+    {
+        const int k = iter->nbatch++;
+        iter->other[k] = other;
+        iter->r[k] = iter->base.r;
+        int d;
+        for(d = 0; d < 3; d ++)
+            iter->dist[k][d] = iter->base.dist[d];
+        if(iter->nbatch == DENSITY_NGB_BATCH)
+            density_ngbiter_flush(I, O, iter, lv);
+    }
+}
+
 static int
 density_haswork(int n, TreeWalk * tw)
 {
@@ -519,6 +618,24 @@ density_postprocess(int i, TreeWalk * tw)
         density_check_neighbours(i, tw);
 }
 
+/* Factor by which to multiply Hsml for a Newton step in log h towards desnumngb,
+ * from d ln Ngb / d ln h = NUMDIMS / DhsmlDensityFactor.
+ * Returns 0 if the derivative is not known.*/
+static double
+density_newton_factor(int i, double desnumngb, TreeWalk * tw)
+{
+    if(P[i].Type != 0 || P[i].NumNgb <= 0)
+        return 0;
+    MyFloat DensFac;
+    if(DENSITY_GET_PRIV(tw)->DoEgyDensity)
+        DensFac = DENSITY_GET_PRIV(tw)->DhsmlDensityFactor[P[i].PI];
+    else
+        DensFac = SPHP(i).DhsmlEgyDensityFactor;
+    if(!(DensFac > 0))
+        return 0;
+    return pow(desnumngb / P[i].NumNgb, DensFac / NUMDIMS);
+}
+
 void density_check_neighbours (int i, TreeWalk * tw)
 {
     /* now check whether we had enough neighbours */
@@ -553,9 +670,15 @@ void density_check_neighbours (int i, TreeWalk * tw)
                 Right[i] = P[i].Hsml;
         }
 
-        /* Next step is geometric mean of previous. */
-        if(Right[i] < 0.99 * tw->tree->BoxSize && Left[i] > 0)
-            P[i].Hsml = pow(0.5 * (pow(Left[i], 3) + pow(Right[i], 3)), 1.0 / 3);
+        const double fac = density_newton_factor(i, desnumngb, tw);
+        if(Right[i] < 0.99 * tw->tree->BoxSize && Left[i] > 0) {
+            /* Take the Newton step if it stays inside the bounds. Otherwise bisect the volume. */
+            const double hsml = P[i].Hsml * fac;
+            if(fac > 0 && hsml > Left[i] && hsml < Right[i])
+                P[i].Hsml = hsml;
+            else
+                P[i].Hsml = pow(0.5 * (pow(Left[i], 3) + pow(Right[i], 3)), 1.0 / 3);
+        }
         else
         {
             if(Right[i] > 0.99 * tw->tree->BoxSize && Left[i] == 0)
@@ -564,41 +687,16 @@ void density_check_neighbours (int i, TreeWalk * tw)
             /* If this is the first step we can be faster by increasing or decreasing current Hsml by a constant factor*/
             if(Right[i] > 0.99 * tw->tree->BoxSize && Left[i] > 0)
             {
-                if(P[i].Type == 0 && fabs(P[i].NumNgb - desnumngb) < 0.5 * desnumngb)
-                {
-                    MyFloat DensFac;
-                    if(DENSITY_GET_PRIV(tw)->DoEgyDensity)
-                        DensFac = DENSITY_GET_PRIV(tw)->DhsmlDensityFactor[P[i].PI];
-                    else
-                        DensFac = SPHP(i).DhsmlEgyDensityFactor;
-                    double fac = 1 - (P[i].NumNgb - desnumngb) / (NUMDIMS * P[i].NumNgb) * DensFac;
-
-                    if(fac < 1.26)
-                        P[i].Hsml *= fac;
-                    else
-                        P[i].Hsml *= 1.26;
-                }
+                if(fac > 0 && fac < 1.26 && fabs(P[i].NumNgb - desnumngb) < 0.5 * desnumngb)
+                    P[i].Hsml *= fac;
                 else
                     P[i].Hsml *= 1.26;
             }
 
             if(Right[i] < 0.99*tw->tree->BoxSize && Left[i] == 0)
             {
-                if(P[i].Type == 0 && fabs(P[i].NumNgb - desnumngb) < 0.5 * desnumngb)
-                {
-                    MyFloat DensFac;
-                    if(DENSITY_GET_PRIV(tw)->DoEgyDensity)
-                        DensFac = DENSITY_GET_PRIV(tw)->DhsmlDensityFactor[P[i].PI];
-                    else
-                        DensFac = SPHP(i).DhsmlEgyDensityFactor;
-
-                    double fac = 1 - (P[i].NumNgb - desnumngb) / (NUMDIMS * P[i].NumNgb) * DensFac;
-
-                    if(fac > 1 / 1.26)
-                        P[i].Hsml *= fac;
-                    else
-                        P[i].Hsml /= 1.26;
-                }
+                if(fac > 1 / 1.26 && fabs(P[i].NumNgb - desnumngb) < 0.5 * desnumngb)
+                    P[i].Hsml *= fac;
                 else
                     P[i].Hsml /= 1.26;
             }
@@ -3,6 +3,8 @@
 
 #include "forcetree.h"
 #include "timestep.h"
+#include "partmanager.h"
+#include "slotsmanager.h"
 
 /* This routine computes the particle densities. If update_hsml is true
  * it runs multiple times, changing the smoothing length until
@@ -12,4 +14,21 @@
  * pressure-entropy SPH. */
 void density(const ActiveParticles * act, int update_hsml, int DoEgyDensity, ForceTree * tree);
 
+/* The smoothing lengths found by the density iteration are rarely more than
+ * this factor larger than the drifted ones.*/
+double density_search_factor(void);
+
+/* Compute the predicted entropy and velocity of gas particle i into the scratch data.
+ * If another thread is already doing so, wait for it.*/
+void density_predict_particle(int i);
+
+/* Make sure SphP_scratch->EntVarPred and VelPred of gas particle i are set. The prediction
+ * uses the accelerations of the last step, so do this before the gravity of this step.*/
+static inline void
+density_ensure_predicted(int i)
+{
+    if(__atomic_load_n(&SphP_scratch->PredState[P[i].PI], __ATOMIC_ACQUIRE) != SPH_PRED_DONE)
+        density_predict_particle(i);
+}
+
 #endif
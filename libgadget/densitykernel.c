@@ -21,72 +21,60 @@
  * the function density_kernel_wk and _dwk takes u to maintain compatibility
  * with volker's gadget.
  */
+/* The kernels are written without branches, so the same code serves
+ * the scalar functions and the vectorized density_kernel_wk_many loops.*/
+static inline double cube(const double x) { return x * x * x; }
+static inline double pow4(const double x) { return (x * x) * (x * x); }
+static inline double pow5(const double x) { return pow4(x) * x; }
+
+#pragma omp declare simd
+static inline double wk_cs_q(const double q) {
+    const double a = fmax(2 - q, 0), b = fmax(1 - q, 0);
+    return 0.25 * cube(a) - cube(b);
+}
+#pragma omp declare simd
+static inline double dwk_cs_q(const double q) {
+    const double a = fmax(2 - q, 0), b = fmax(1 - q, 0);
+    return - 0.25 * 3 * a * a + 3 * b * b;
+}
+#pragma omp declare simd
+static inline double wk_qus_q(const double q) {
+    const double a = fmax(2.5 - q, 0), b = fmax(1.5 - q, 0), c = fmax(0.5 - q, 0);
+    return pow4(a) - 5 * pow4(b) + 10 * pow4(c);
+}
+#pragma omp declare simd
+static inline double dwk_qus_q(const double q) {
+    const double a = fmax(2.5 - q, 0), b = fmax(1.5 - q, 0), c = fmax(0.5 - q, 0);
+    return -4 * cube(a) + 20 * cube(b) - 40 * cube(c);
+}
+#pragma omp declare simd
+static inline double wk_qs_q(const double q) {
+    const double a = fmax(3 - q, 0), b = fmax(2 - q, 0), c = fmax(1 - q, 0);
+    return pow5(a) - 6 * pow5(b) + 15 * pow5(c);
+}
+#pragma omp declare simd
+static inline double dwk_qs_q(const double q) {
+    const double a = fmax(3 - q, 0), b = fmax(2 - q, 0), c = fmax(1 - q, 0);
+    return -5 * pow4(a) + 30 * pow4(b) - 75 * pow4(c);
+}
+
 double wk_cs(DensityKernel * kernel, double q) {
-    if(q < 1.0) {
-        return 0.25 * pow(2 - q, 3) - pow(1 - q, 3);
-    }
-    if(q < 2.0) {
-        return 0.25 * pow(2 - q, 3);
-    }
-    return 0.0;
+    return wk_cs_q(q);
 }
 double dwk_cs(DensityKernel * kernel, double q) {
-    if(q < 1.0) {
-        return - 0.25 * 3 * pow(2 - q, 2) + 3 * pow(1 - q, 2);
-    }
-    if(q < 2.0) {
-        return -0.25 * 3 * pow(2 - q, 2);
-    }
-    return 0.0;
+    return dwk_cs_q(q);
 }
 static double wk_qus(DensityKernel * kernel, double q) {
-    if(q < 0.5) {
-        return pow(2.5 - q, 4) - 5 * pow(1.5 - q, 4) + 10 * pow(0.5 - q, 4);
-    }
-    if(q < 1.5) {
-        return pow(2.5 - q, 4) - 5 * pow(1.5 - q, 4);
-    }
-    if(q < 2.5) {
-        return pow(2.5 - q, 4);
-    }
-    return 0.0;
+    return wk_qus_q(q);
 }
 static double dwk_qus(DensityKernel * kernel, double q) {
-    if(q < 0.5) {
-        return -4 * pow(2.5 - q, 3) + 20 * pow(1.5 - q, 3) - 40 * pow(0.5 - q, 3);
-    }
-    if(q < 1.5) {
-        return -4 * pow(2.5 - q, 3) + 20 * pow(1.5 - q, 3);
-    }
-    if(q < 2.5) {
-        return -4 * pow(2.5 - q, 3);
-    }
-    return 0.0;
+    return dwk_qus_q(q);
 }
 static double wk_qs(DensityKernel * kernel, double q) {
-    if(q < 1.0) {
-        return pow(3 - q, 5) - 6 * pow(2 - q, 5) + 15 * pow(1 - q, 5);
-    }
-    if(q < 2.0) {
-        return pow(3 - q, 5)- 6 * pow(2 - q, 5);
-    }
-    if(q < 3.0) {
-        return pow(3 - q, 5);
-    }
-    return 0.0;
+    return wk_qs_q(q);
 }
 static double dwk_qs(DensityKernel * kernel, double q) {
-    if(q < 1.0) {
-        return -5 * pow(3 - q, 4) + 30 * pow(2 - q, 4)
-             - 75 * pow (1 - q, 4);
-    }
-    if(q < 2.0) {
-        return -5 * pow(3 - q, 4) + 30 * pow(2 - q, 4);
-    }
-    if(q < 3.0) {
-        return -5 * pow(3 - q, 4);
-    }
-    return 0.0;
+    return dwk_qs_q(q);
 }
 
 static struct {
@@ -120,6 +108,49 @@ density_kernel_wk(DensityKernel * kernel, double u)
         KERNELS[kernel->type].wk(kernel, u * support);
 }
 
+/* One loop for each kernel, so that the kernel is inlined and the loop vectorizes.*/
+#define KERNEL_MANY(func, norm) \
+    do { \
+        int i; \
+        _Pragma("omp simd") \
+        for(i = 0; i < n; i++) \
+            out[i] = (norm) * func(u[i] * support); \
+    } while(0)
+
+void
+density_kernel_wk_many(DensityKernel * kernel, const double * u, double * out, const int n)
+{
+    const double support = kernel->support;
+    switch(kernel->type) {
+        case 0:
+            KERNEL_MANY(wk_cs_q, kernel->Wknorm);
+            break;
+        case 1:
+            KERNEL_MANY(wk_qs_q, kernel->Wknorm);
+            break;
+        case 2:
+            KERNEL_MANY(wk_qus_q, kernel->Wknorm);
+            break;
+    }
+}
+
+void
+density_kernel_dwk_many(DensityKernel * kernel, const double * u, double * out, const int n)
+{
+    const double support = kernel->support;
+    switch(kernel->type) {
+        case 0:
+            KERNEL_MANY(dwk_cs_q, kernel->dWknorm);
+            break;
+        case 1:
+            KERNEL_MANY(dwk_qs_q, kernel->dWknorm);
+            break;
+        case 2:
+            KERNEL_MANY(dwk_qus_q, kernel->dWknorm);
+            break;
+    }
+}
+
 double
 density_kernel_desnumngb(DensityKernel * kernel, double eta)
 {
@@ -43,6 +43,13 @@ density_kernel_dwk(DensityKernel * kernel, double u);
 double
 density_kernel_volume(DensityKernel * kernel);
 
+/* Evaluate density_kernel_wk (density_kernel_dwk) at n values of u, storing the results in out.
+ * The loop is specialised for each kernel type so that it vectorizes.*/
+void
+density_kernel_wk_many(DensityKernel * kernel, const double * u, double * out, const int n);
+void
+density_kernel_dwk_many(DensityKernel * kernel, const double * u, double * out, const int n);
+
 static inline double
 density_kernel_dW(DensityKernel * kernel, double u, double wk, double dwk)
 {
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <math.h>
 #include <stdint.h>
+#include <limits.h>
 #include <omp.h>
 
 #include "utils.h"
@@ -41,6 +42,15 @@
  */
 
 static DomainParams domain_params;
+
+/* The policy of the last successful decomposition and the number of TopNodes it made.
+ * The next decomposition starts from this policy and allocates at least this many TopNodes,
+ * so failed attempts are not repeated. Saved with the domain in snapshots, so a restart does too.*/
+static int LastSuccessfulPolicy = 0;
+static int LastNTopNodes = 0;
+/* Tuned number of TopLeaves per task, see domain_tune_overdecomposition.
+ * 0 until the first decomposition, which uses DomainOverDecompositionFactor.*/
+static int OverDecomposition = 0;
 /**
  * Policy for domain decomposition.
  *
@@ -74,12 +84,58 @@ struct local_particle_data
     int64_t Cost;
 };
 
+/* A particle sampled for the sampled toptree, standing for Count particles of total Cost.
+ * Key must be the first member, for mp_order_by_key.*/
+struct sample_particle_data
+{
+    peano_t Key;
+    int64_t Count;
+    int64_t Cost;
+};
+
 /*This is a helper for the tests*/
 void set_domain_par(DomainParams dp)
 {
     domain_params = dp;
 }
 
+DomainParams get_domain_par(void)
+{
+    return domain_params;
+}
+
+int
+domain_measured_cost(void)
+{
+    return domain_params.DomainMeasuredCost;
+}
+
+void
+domain_get_policy_hint(int * Policy, int * NTopNodes)
+{
+    *Policy = LastSuccessfulPolicy;
+    *NTopNodes = LastNTopNodes;
+}
+
+void
+domain_set_policy_hint(const int Policy, const int NTopNodes)
+{
+    LastSuccessfulPolicy = Policy;
+    LastNTopNodes = NTopNodes;
+}
+
+int
+domain_get_overdecomposition(void)
+{
+    return OverDecomposition;
+}
+
+void
+domain_set_overdecomposition(const int NewOverDecomposition)
+{
+    OverDecomposition = NewOverDecomposition;
+}
+
 /*Set the parameters of the domain module*/
 void set_domain_params(ParameterSet * ps)
 {
@@ -87,8 +143,16 @@ void set_domain_params(ParameterSet * ps)
     MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
     if(ThisTask == 0) {
         domain_params.DomainOverDecompositionFactor = param_get_int(ps, "DomainOverDecompositionFactor");
+        domain_params.DomainOverDecompositionMax = param_get_int(ps, "DomainOverDecompositionMax");
+        domain_params.DomainTargetImbalance = param_get_double(ps, "DomainTargetImbalance");
         domain_params.TopNodeAllocFactor = param_get_double(ps, "TopNodeAllocFactor");
         domain_params.DomainUseGlobalSorting = param_get_int(ps, "DomainUseGlobalSorting");
+        domain_params.DomainMeasuredCost = param_get_int(ps, "DomainMeasuredCost");
+        domain_params.DomainRebalanceThreshold = param_get_double(ps, "DomainRebalanceThreshold");
+        domain_params.DomainRebalanceMaxLeaves = param_get_int(ps, "DomainRebalanceMaxLeaves");
+        domain_params.DomainMaintainSort = param_get_int(ps, "DomainMaintainSort");
+        domain_params.DomainSampledTopTree = param_get_int(ps, "DomainSampledTopTree");
+        domain_params.DomainCheckIDUniqueness = param_get_int(ps, "DomainCheckIDUniqueness");
         domain_params.SetAsideFactor = 1.;
         if((param_get_int(ps, "StarformationOn") && param_get_double(ps, "QuickLymanAlphaProbability") == 0.)
             || param_get_int(ps, "BlackHoleOn"))
@@ -97,28 +161,34 @@ void set_domain_params(ParameterSet * ps)
     MPI_Bcast(&domain_params, sizeof(DomainParams), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
 
-static int
-order_by_key(const void *a, const void *b);
 static void
 mp_order_by_key(const void * data, void * radix, void * arg);
 
-static void
-domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int NsegmentPerTask);
+static int
+domain_assign_balanced(DomainDecomp * ddecomp, const int64_t * cost, const int64_t * count, const int64_t * slotmem, const int64_t MaxSlotMem, double * imbalance);
 
 static int domain_allocate(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy);
 
+static void domain_set_task_order(int * TaskOrder, MPI_Comm DomainComm);
+
 static int
-domain_check_memory_bound(const DomainDecomp * ddecomp, const int print_details, int64_t *TopLeafWork, int64_t *TopLeafCount);
+domain_check_memory_bound(const DomainDecomp * ddecomp, const int print_details, int64_t *TopLeafWork, int64_t *TopLeafCount, int64_t *TopLeafSlotMem, const int64_t MaxSlotMem);
+
+static int64_t
+domain_slot_memory_bound(const int64_t * TopLeafCount, const int64_t * TopLeafSlotMem, const int NTopLeaves, const int NTask);
 
 static int domain_attempt_decompose(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy, const int MaxTopNodes);
 
-static void
+static double
 domain_balance(DomainDecomp * ddecomp);
 
+static void
+domain_tune_overdecomposition(const double imbalance);
+
 static int domain_determine_global_toptree(DomainDecompositionPolicy * policy, struct local_topnode_data * topTree, int * topTreeSize, const int MaxTopNodes, MPI_Comm DomainComm);
 
 static void
-domain_compute_costs(const DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopLeafCount);
+domain_compute_costs(const DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopLeafCount, int64_t *TopLeafSlotMem);
 
 static void
 domain_toptree_merge(struct local_topnode_data *treeA, struct local_topnode_data *treeB, int noA, int noB, int * treeASize, const int MaxTopNodes);
@@ -131,11 +201,18 @@ static int domain_check_for_local_refine_subsample(
 static int
 domain_global_refine(struct local_topnode_data * topTree, int * topTreeSize, const int MaxTopNodes, int64_t countlimit, int64_t costlimit);
 
+static int
+domain_sampled_toptree(DomainDecompositionPolicy * policy, struct local_topnode_data * topTree, int * topTreeSize, const int MaxTopNodes, MPI_Comm DomainComm);
+
 static void
 domain_create_topleaves(DomainDecomp * ddecomp, int no, int * next);
 
 static int domain_layoutfunc(int n, const void * userdata);
 
+static void domain_set_walktime_scale(MPI_Comm DomainComm);
+
+static void domain_rebalance(DomainDecomp * ddecomp);
+
 static int
 domain_policies_init(DomainDecompositionPolicy policies[],
         const int NincreaseAlloc,
@@ -152,18 +229,25 @@ void domain_decompose_full(DomainDecomp * ddecomp)
     static DomainDecompositionPolicy policies[16];
     static int Npolicies = 0;
 
-    /* start from last successful policy to avoid retries */
-    static int LastSuccessfulPolicy = 0;
-
     if (Npolicies == 0) {
         const int NincreaseAlloc = 16;
         Npolicies = domain_policies_init(policies, NincreaseAlloc, 8);
     }
 
+    /* start from last successful policy to avoid retries */
+    if(LastSuccessfulPolicy < 0 || LastSuccessfulPolicy >= Npolicies)
+        LastSuccessfulPolicy = 0;
+
+    if(OverDecomposition <= 0)
+        OverDecomposition = domain_params.DomainOverDecompositionFactor;
+
     walltime_measure("/Misc");
 
     message(0, "domain decomposition... (presently allocated=%g MB)\n", mymalloc_usedbytes() / (1024.0 * 1024.0));
 
+    /* The domain communicator is set in domain_allocate*/
+    domain_set_walktime_scale(MPI_COMM_WORLD);
+
     int decompose_failed = 1;
     int i;
     for(i = LastSuccessfulPolicy; i < Npolicies; i ++)
@@ -173,6 +257,11 @@ void domain_decompose_full(DomainDecomp * ddecomp)
 #ifdef DEBUG
         domain_test_id_uniqueness(PartManager);
 #endif
+        /* Desired number of TopLeaves should scale like the total number of processors*/
+        int NTask;
+        MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+        policies[i].NTopLeaves = OverDecomposition * NTask;
+
         int MaxTopNodes = domain_allocate(ddecomp, &policies[i]);
 
         message(0, "Attempting new domain decomposition policy: TopNodeAllocFactor=%g, UseglobalSort=%d, SubSampleDistance=%d UsePreSort=%d\n",
@@ -183,6 +272,7 @@ void domain_decompose_full(DomainDecomp * ddecomp)
 
         if(!decompose_failed) {
             LastSuccessfulPolicy = i;
+            LastNTopNodes = ddecomp->NTopNodes;
             break;
         }
     }
@@ -191,10 +281,12 @@ void domain_decompose_full(DomainDecomp * ddecomp)
         endrun(0, "No suitable domain decomposition policy worked for this particle distribution\n");
     }
 
-    domain_balance(ddecomp);
+    const double imbalance = domain_balance(ddecomp);
 
     walltime_measure("/Domain/Decompose/Balance");
 
+    domain_tune_overdecomposition(imbalance);
+
     /* copy the used nodes from temp to the true. */
     struct topleaf_data * OldTopLeaves = ddecomp->TopLeaves;
     struct topnode_data * OldTopNodes = ddecomp->TopNodes;
@@ -210,13 +302,19 @@ void domain_decompose_full(DomainDecomp * ddecomp)
     myfree(OldTopLeaves);
     myfree(OldTopNodes);
 
-    if(domain_exchange(domain_layoutfunc, ddecomp, 0, PartManager, SlotsManager, ddecomp->DomainComm))
+    if(domain_exchange(domain_layoutfunc, ddecomp, 0, 0, PartManager, SlotsManager, ddecomp->DomainComm))
         endrun(1929,"Could not exchange particles\n");
 
     /*Do a garbage collection so that the slots are ordered
      *the same as the particles, garbage is at the end and all particles are in peano order.*/
     slots_gc_sorted(PartManager, SlotsManager);
 
+    if(domain_params.DomainCheckIDUniqueness > 0) {
+        if(domain_check_id_uniqueness(PartManager, domain_params.DomainCheckIDUniqueness, ddecomp->DomainComm))
+            endrun(12, "Particle IDs are not unique after the domain decomposition\n");
+        walltime_measure("/Domain/CheckID");
+    }
+
     /*Ensure collective*/
     MPIU_Barrier(ddecomp->DomainComm);
     message(0, "Domain decomposition done.\n");
@@ -234,13 +332,27 @@ void domain_maintain(DomainDecomp * ddecomp)
 
     walltime_measure("/Misc");
 
+    if(domain_params.DomainRebalanceThreshold > 0) {
+        domain_set_walktime_scale(ddecomp->DomainComm);
+        domain_rebalance(ddecomp);
+        walltime_measure("/Domain/Rebalance");
+    }
+
     /* Try a domain exchange.
      * If we have no memory for the particles,
      * bail and do a full domain*/
-    if(0 != domain_exchange(domain_layoutfunc, ddecomp, 0, PartManager, SlotsManager, ddecomp->DomainComm)) {
+    if(0 != domain_exchange(domain_layoutfunc, ddecomp, 0, 0, PartManager, SlotsManager, ddecomp->DomainComm)) {
         domain_decompose_full(ddecomp);
         return;
     }
+
+    /* The exchange appends the new particles and the drift changes the keys,
+     * so restore the Peano order of the particles and slots, so that the tree
+     * nodes cover contiguous ranges of particles.*/
+    if(domain_params.DomainMaintainSort) {
+        slots_gc_sorted(PartManager, SlotsManager);
+        walltime_measure("/Domain/PeanoSort");
+    }
 }
 
 /* this function generates several domain decomposition policies for attempting
@@ -261,7 +373,7 @@ domain_policies_init(DomainDecompositionPolicy policies[],
         policies[i].GlobalSortComm = MPI_COMM_WORLD;
         policies[i].PreSort = 0;
         policies[i].SubSampleDistance = 16;
-        /* Desired number of TopLeaves should scale like the total number of processors*/
+        /* Set from the tuned OverDecomposition before each attempt*/
         policies[i].NTopLeaves = domain_params.DomainOverDecompositionFactor * NTask;
     }
 
@@ -285,6 +397,10 @@ domain_allocate(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy)
     size_t bytes, all_bytes = 0;
 
     int MaxTopNodes = (int) (policy->TopNodeAllocFactor * PartManager->MaxPart + 1);
+    /* The particles have moved since the last decomposition, so allow its tree to grow a little,
+     * as much as between policies.*/
+    if(MaxTopNodes < 1.3 * LastNTopNodes)
+        MaxTopNodes = 1.3 * LastNTopNodes;
 
     /* Build the domain over the global all-processors communicator.
      * We use a symbol in case we want to do fancy things in the future.*/
@@ -298,6 +414,11 @@ domain_allocate(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy)
 
     all_bytes += bytes;
 
+    ddecomp->TaskOrder = mymalloc2("TaskOrder", bytes = NTask * sizeof(ddecomp->TaskOrder[0]));
+    domain_set_task_order(ddecomp->TaskOrder, ddecomp->DomainComm);
+
+    all_bytes += bytes;
+
     ddecomp->TopNodes = mymalloc("TopNodes",
         bytes = (MaxTopNodes * (sizeof(ddecomp->TopNodes[0]))));
 
@@ -315,25 +436,161 @@ domain_allocate(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy)
     return MaxTopNodes;
 }
 
+static int
+order_by_int_pair(const void * c1, const void * c2)
+{
+    const int * p1 = (const int *) c1;
+    const int * p2 = (const int *) c2;
+    if(p1[0] != p2[0]) return p1[0] < p2[0] ? -1 : 1;
+    if(p1[1] != p2[1]) return p1[1] < p2[1] ? -1 : 1;
+    return 0;
+}
+
+/* Find the order in which tasks are placed along the Peano curve.
+ * Tasks are grouped by the shared memory node they run on, and ordered by rank within a node,
+ * so that consecutive domains, which exchange most of the tree walk exports, are on the same node.
+ * When ranks are placed on nodes in blocks this is the identity.*/
+static void
+domain_set_task_order(int * TaskOrder, MPI_Comm DomainComm)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(DomainComm, &NTask);
+    MPI_Comm_rank(DomainComm, &ThisTask);
+
+    /* The node is labelled by its lowest rank*/
+    MPI_Comm NodeComm;
+    MPI_Comm_split_type(DomainComm, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &NodeComm);
+    int NodeLeader = ThisTask;
+    MPI_Bcast(&NodeLeader, 1, MPI_INT, 0, NodeComm);
+    MPI_Comm_free(&NodeComm);
+
+    int mine[2] = {NodeLeader, ThisTask};
+    int * pairs = ta_malloc("NodeRanks", int, 2 * NTask);
+    MPI_Allgather(mine, 2, MPI_INT, pairs, 2, MPI_INT, DomainComm);
+    qsort(pairs, NTask, 2 * sizeof(int), order_by_int_pair);
+    int i, nnodes = 0;
+    for(i = 0; i < NTask; i++) {
+        TaskOrder[i] = pairs[2 * i + 1];
+        if(pairs[2 * i] == pairs[2 * i + 1])
+            nnodes++;
+    }
+    ta_free(pairs);
+    message(0, "Placing domains on %d nodes.\n", nnodes);
+}
+
+/* Set up a domain decomposition saved earlier, for example in a snapshot.
+ * LeafTask is the rank of each TopLeaf; the TopLeaves of each rank are consecutive
+ * and in the order TaskOrder, as made by domain_assign_balanced.*/
+void
+domain_restore(DomainDecomp * ddecomp, const struct topnode_data * TopNodes, const int NTopNodes,
+        const int * LeafTask, const int NTopLeaves, const int * TaskOrder)
+{
+    domain_free(ddecomp);
+
+    ddecomp->DomainComm = MPI_COMM_WORLD;
+    int NTask;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+
+    /* Same order as domain_allocate, so domain_free releases them*/
+    ddecomp->Tasks = (struct task_data *) mymalloc2("Tasks", (NTask + 1) * sizeof(ddecomp->Tasks[0]));
+    ddecomp->TaskOrder = (int *) mymalloc2("TaskOrder", NTask * sizeof(ddecomp->TaskOrder[0]));
+    ddecomp->TopNodes  = (struct topnode_data *) mymalloc2("TopNodes", sizeof(ddecomp->TopNodes[0]) * NTopNodes);
+    ddecomp->TopLeaves = (struct topleaf_data *) mymalloc2("TopLeaves", sizeof(ddecomp->TopLeaves[0]) * (NTopLeaves + 1));
+    ddecomp->NTopNodes = NTopNodes;
+    ddecomp->NTopLeaves = NTopLeaves;
+    ddecomp->domain_allocated_flag = 1;
+
+    memcpy(ddecomp->TaskOrder, TaskOrder, NTask * sizeof(ddecomp->TaskOrder[0]));
+    memcpy(ddecomp->TopNodes, TopNodes, NTopNodes * sizeof(ddecomp->TopNodes[0]));
+
+    int i, ta;
+    for(i = 0; i < NTopLeaves; i ++)
+        ddecomp->TopLeaves[i].Task = LeafTask[i];
+    /* The topnode of each leaf was overwritten by the tree, so find it again*/
+    for(i = 0; i < NTopNodes; i ++)
+        if(ddecomp->TopNodes[i].Daughter < 0)
+            ddecomp->TopLeaves[ddecomp->TopNodes[i].Leaf].topnode = i;
+    ddecomp->TopLeaves[NTopLeaves].Task = NTask;
+    ddecomp->TopLeaves[NTopLeaves].topnode = -1;
+
+    for(ta = 0; ta <= NTask; ta ++)
+        ddecomp->Tasks[ta].StartLeaf = ddecomp->Tasks[ta].EndLeaf = -1;
+    for(i = 0; i < NTopLeaves; i ++) {
+        struct task_data * t = &ddecomp->Tasks[LeafTask[i]];
+        if(t->StartLeaf < 0)
+            t->StartLeaf = i;
+        t->EndLeaf = i + 1;
+    }
+    /* Tasks without leaves sit between their neighbours along the curve*/
+    int last = 0;
+    for(ta = 0; ta < NTask; ta ++) {
+        struct task_data * t = &ddecomp->Tasks[ddecomp->TaskOrder[ta]];
+        if(t->StartLeaf < 0)
+            t->StartLeaf = t->EndLeaf = last;
+        last = t->EndLeaf;
+    }
+    /* The tail item */
+    ddecomp->Tasks[NTask].StartLeaf = NTopLeaves;
+    ddecomp->Tasks[NTask].EndLeaf = NTopLeaves;
+
+    message(0, "Restored a domain decomposition with %d TopLeaves.\n", NTopLeaves);
+}
+
 void domain_free(DomainDecomp * ddecomp)
 {
     if(ddecomp->domain_allocated_flag)
     {
         myfree(ddecomp->TopLeaves);
         myfree(ddecomp->TopNodes);
+        myfree(ddecomp->TaskOrder);
         myfree(ddecomp->Tasks);
         ddecomp->domain_allocated_flag = 0;
     }
 }
 
+/* Converts the measured WalkTime to the units of GravCost, so that
+ * the same integer rounding applies. Zero if measured costs are not used.*/
+static double domain_walktime_scale;
+
+/* Set domain_walktime_scale so that the global sums of WalkTime and GravCost agree.
+ * Falls back to GravCost when no tree walk has been timed yet.*/
+static void
+domain_set_walktime_scale(MPI_Comm DomainComm)
+{
+    domain_walktime_scale = 0;
+    if(!domain_params.DomainMeasuredCost)
+        return;
+    double sum[2] = {0, 0};
+    int i;
+    #pragma omp parallel for reduction(+: sum[:2])
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage)
+            continue;
+        sum[0] += P[i].GravCost;
+        sum[1] += P[i].WalkTime;
+    }
+    double maxwalk = sum[1], meanwalk = sum[1];
+    MPI_Allreduce(MPI_IN_PLACE, sum, 2, MPI_DOUBLE, MPI_SUM, DomainComm);
+    MPI_Allreduce(MPI_IN_PLACE, &maxwalk, 1, MPI_DOUBLE, MPI_MAX, DomainComm);
+    int NTask;
+    MPI_Comm_size(DomainComm, &NTask);
+    meanwalk = sum[1] / NTask;
+    if(sum[1] > 0)
+        domain_walktime_scale = sum[0] / sum[1];
+    message(0, "Measured tree walk time per rank: max = %g s mean = %g s.\n", maxwalk, meanwalk);
+}
+
 static int64_t
 domain_particle_costfactor(int i)
 {
-    /* We round off GravCost to integer*/
+    double cost = P[i].GravCost;
+    if(domain_walktime_scale > 0)
+        cost = P[i].WalkTime * domain_walktime_scale;
+    /* We round off the cost to integer*/
     if(P[i].TimeBin)
-        return (1 + P[i].GravCost) * (TIMEBASE / (1 << P[i].TimeBin));
+        return (1 + cost) * (TIMEBASE / (1 << P[i].TimeBin));
     else
-        return (1 + P[i].GravCost); /* assuming on the full step */
+        return (1 + cost); /* assuming on the full step */
 }
 
 /*! This function carries out the actual domain decomposition for all
@@ -402,104 +659,337 @@ domain_attempt_decompose(DomainDecomp * ddecomp, DomainDecompositionPolicy * pol
 }
 
 /**
- * attempt to assign segments to tasks such that the load or work is balanced.
+ * Assign segments to tasks such that the work is balanced, within the memory bounds
+ * on the number of particles and on the slot memory of each task.
+ * Returns the largest work of a task over the mean.
  *
  * */
-static void
+static double
 domain_balance(DomainDecomp * ddecomp)
 {
+    int NTask;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+
     /*!< a table that gives the total "work" due to the particles stored by each processor */
     int64_t * TopLeafWork = (int64_t *) mymalloc("TopLeafWork",  ddecomp->NTopLeaves * sizeof(TopLeafWork[0]));
     /*!< a table that gives the total number of particles held by each processor */
     int64_t * TopLeafCount = (int64_t *) mymalloc("TopLeafCount",  ddecomp->NTopLeaves * sizeof(TopLeafCount[0]));
+    /*!< a table that gives the bytes of slot memory held by each processor */
+    int64_t * TopLeafSlotMem = (int64_t *) mymalloc("TopLeafSlotMem",  ddecomp->NTopLeaves * sizeof(TopLeafSlotMem[0]));
 
-    domain_compute_costs(ddecomp, TopLeafWork, TopLeafCount);
+    domain_compute_costs(ddecomp, TopLeafWork, TopLeafCount, TopLeafSlotMem);
 
     walltime_measure("/Domain/Decompose/Sumcost");
 
-    /* first try work balance */
-    domain_assign_balanced(ddecomp, TopLeafWork, 1);
+    int64_t MaxSlotMem = domain_slot_memory_bound(TopLeafCount, TopLeafSlotMem, ddecomp->NTopLeaves, NTask);
+
+    double imbalance = 1;
+    if(domain_assign_balanced(ddecomp, TopLeafWork, TopLeafCount, TopLeafSlotMem, MaxSlotMem, &imbalance)) {
+        /* The slot memory bound is soft: the slots can grow into the free memory.*/
+        message(0, "Note: no domain decomposition keeps the slot memory below %g MB. Ignoring the slot memory.\n", MaxSlotMem / (1024.0 * 1024.0));
+        MaxSlotMem = 0;
+        if(domain_assign_balanced(ddecomp, TopLeafWork, TopLeafCount, TopLeafSlotMem, MaxSlotMem, &imbalance))
+            endrun(0, "No domain decomposition that stays within memory bounds is possible.\n");
+    }
 
     walltime_measure("/Domain/Decompose/assignbalance");
 
-    int status = domain_check_memory_bound(ddecomp, 0, TopLeafWork, TopLeafCount);
+    if(domain_check_memory_bound(ddecomp, 0, TopLeafWork, TopLeafCount, TopLeafSlotMem, MaxSlotMem)) {
+        domain_check_memory_bound(ddecomp, 1, TopLeafWork, TopLeafCount, TopLeafSlotMem, MaxSlotMem);
+        endrun(0, "Assertion failed: the domain decomposition does not stay within the memory bounds.\n");
+    }
     walltime_measure("/Domain/Decompose/memorybound");
 
-    if(status != 0)		/* the optimum balanced solution violates memory constraint, let's try something different */
-    {
-        message(0, "Note: the domain decomposition is suboptimum because the ceiling for memory-imbalance is reached\n");
+    myfree(TopLeafSlotMem);
+    myfree(TopLeafCount);
+    myfree(TopLeafWork);
+    return imbalance;
+}
 
-        domain_assign_balanced(ddecomp, TopLeafCount, 1);
+/* Tune the number of TopLeaves per task for the next full decomposition, between
+ * DomainOverDecompositionFactor and DomainOverDecompositionMax. More TopLeaves balance
+ * the work better, but make a larger top tree, which is slower to build and to walk.
+ * So double them while the work is imbalanced and halve them while it is well balanced.
+ * If doubling did not remove a quarter of the excess work, the leaves are too coarse
+ * for another reason (one expensive leaf, or the memory bounds), so go back and hold
+ * the smaller number for a few decompositions.*/
+static void
+domain_tune_overdecomposition(const double imbalance)
+{
+    static int PrevOverDecomposition = 0;
+    static double PrevImbalance = 0;
+    static int Hold = 0;
 
-        walltime_measure("/Domain/Decompose/assignbalance");
+    const int Min = domain_params.DomainOverDecompositionFactor;
+    const int Max = domain_params.DomainOverDecompositionMax;
+    if(Max <= Min)
+        return;
 
-        int status = domain_check_memory_bound(ddecomp, 1, TopLeafWork, TopLeafCount);
-        walltime_measure("/Domain/Decompose/memorybound");
+    const double target = domain_params.DomainTargetImbalance;
+    const int old = OverDecomposition;
+    const char * reason = NULL;
 
-        if(status != 0)
-        {
-            endrun(0, "No domain decomposition that stays within memory bounds is possible.\n");
+    if(Hold > 0)
+        Hold--;
+
+    if(PrevOverDecomposition > 0 && PrevOverDecomposition < old && imbalance - 1 > 0.75 * (PrevImbalance - 1)) {
+        OverDecomposition = PrevOverDecomposition;
+        Hold = 8;
+        reason = "more TopLeaves did not improve the balance";
+    }
+    else if(imbalance > 1 + target && old < Max && Hold == 0) {
+        OverDecomposition = DMIN(2 * old, Max);
+        reason = "work is imbalanced";
+    }
+    else if(imbalance < 1 + target / 4 && old > Min) {
+        OverDecomposition = DMAX(old / 2, Min);
+        reason = "work is balanced";
+    }
+
+    PrevOverDecomposition = old;
+    PrevImbalance = imbalance;
+
+    if(OverDecomposition == old)
+        return;
+
+    /* The top tree grows or shrinks with the number of TopLeaves: scale the allocation hint
+     * so the next decomposition does not need to retry with a larger one.*/
+    LastNTopNodes = (int64_t) LastNTopNodes * OverDecomposition / old;
+    message(0, "Domain over-decomposition: %d -> %d TopLeaves per task, as %s (largest work %g of the mean).\n",
+            old, OverDecomposition, reason, imbalance);
+}
+
+/* Find the leaf boundary b, so that the cost of the leaves before b
+ * is closest to target. cumcost[i] is the cost of leaves 0 to i - 1.*/
+static int
+domain_find_boundary(const int64_t * cumcost, const int NTopLeaves, const double target)
+{
+    int left = 0, right = NTopLeaves;
+    while(left < right) {
+        int mid = (left + right) / 2;
+        if(cumcost[mid] < target)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    if(left > 0 && target - cumcost[left - 1] < cumcost[left] - target)
+        left--;
+    return left;
+}
+
+/* Move each boundary between neighbouring tasks by at most DomainRebalanceMaxLeaves towards
+ * the boundary that balances the work, and store the new first leaf of the task at each
+ * position along the curve (see TaskOrder) in start.
+ * Returns the number of TopLeaves which change task, or 0 if the largest work is not reduced.*/
+static int
+domain_rebalance_boundaries(const DomainDecomp * ddecomp, const int64_t * cumcost, const int NTask, int * start)
+{
+    const int NTopLeaves = ddecomp->NTopLeaves;
+    const double mean = 1.0 * cumcost[NTopLeaves] / NTask;
+    const int MaxMove = domain_params.DomainRebalanceMaxLeaves;
+
+    int64_t maxwork = 0;
+    int ta;
+    for(ta = 0; ta < NTask; ta++) {
+        const int64_t work = cumcost[ddecomp->Tasks[ta].EndLeaf] - cumcost[ddecomp->Tasks[ta].StartLeaf];
+        if(work > maxwork)
+            maxwork = work;
+    }
+
+    if(maxwork <= (1 + domain_params.DomainRebalanceThreshold) * mean)
+        return 0;
+
+    start[0] = 0;
+    start[NTask] = NTopLeaves;
+    for(ta = 1; ta < NTask; ta++) {
+        const int old = ddecomp->Tasks[ddecomp->TaskOrder[ta]].StartLeaf;
+        int b = domain_find_boundary(cumcost, NTopLeaves, mean * ta);
+        if(b > old + MaxMove)
+            b = old + MaxMove;
+        if(b < old - MaxMove)
+            b = old - MaxMove;
+        start[ta] = b;
+    }
+    /* Every task keeps at least one leaf */
+    for(ta = 1; ta < NTask; ta++)
+        if(start[ta] <= start[ta-1])
+            start[ta] = start[ta-1] + 1;
+    for(ta = NTask - 1; ta > 0; ta--)
+        if(start[ta] >= start[ta+1])
+            start[ta] = start[ta+1] - 1;
+
+    int64_t newmaxwork = 0;
+    int nmoved = 0;
+    for(ta = 0; ta < NTask; ta++) {
+        const int64_t work = cumcost[start[ta+1]] - cumcost[start[ta]];
+        if(work > newmaxwork)
+            newmaxwork = work;
+        if(ta > 0)
+            nmoved += abs(start[ta] - ddecomp->Tasks[ddecomp->TaskOrder[ta]].StartLeaf);
+    }
+
+    if(newmaxwork >= maxwork)
+        return 0;
+
+    message(0, "Incremental rebalance: largest work %g -> %g of the mean.\n", maxwork / mean, newmaxwork / mean);
+    return nmoved;
+}
+
+/**
+ * Incremental load balancing between full domain decompositions.
+ * The TopTree is kept and the boundaries between ranks neighbouring along the Peano curve
+ * are moved by a few TopLeaves, see domain_rebalance_boundaries.
+ * The particles in the moved TopLeaves are then sent by the domain_exchange in domain_maintain.
+ * The old assignment is kept if the new one does not fit in memory.
+ * */
+static void
+domain_rebalance(DomainDecomp * ddecomp)
+{
+    int NTask;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+
+    const int NTopLeaves = ddecomp->NTopLeaves;
+    if(NTopLeaves < NTask)
+        return;
+
+    /* Moving boundaries only keeps the domains contiguous if the TopLeaves
+     * of consecutive tasks are in key order. This is true after
+     * domain_assign_balanced, but may not be for a restored decomposition.*/
+    int i, ta;
+    for(i = 1; i < NTopLeaves; i++)
+        if(ddecomp->TopNodes[ddecomp->TopLeaves[i].topnode].StartKey < ddecomp->TopNodes[ddecomp->TopLeaves[i-1].topnode].StartKey)
+            return;
+
+    int64_t * TopLeafWork = (int64_t *) mymalloc("TopLeafWork",  NTopLeaves * sizeof(TopLeafWork[0]));
+    int64_t * TopLeafCount = (int64_t *) mymalloc("TopLeafCount",  NTopLeaves * sizeof(TopLeafCount[0]));
+    int64_t * TopLeafSlotMem = (int64_t *) mymalloc("TopLeafSlotMem",  NTopLeaves * sizeof(TopLeafSlotMem[0]));
+    /* Cost of all leaves before a leaf */
+    int64_t * cumcost = (int64_t *) mymalloc("CumCost", (NTopLeaves + 1) * sizeof(cumcost[0]));
+    /* New first leaf of each task, plus a tail item*/
+    int * start = (int *) mymalloc("NewStartLeaf", (NTask + 1) * sizeof(start[0]));
+    /* Old assignment, to restore if the new one does not fit in memory*/
+    struct task_data * OldTasks = (struct task_data *) mymalloc("OldTasks", NTask * sizeof(OldTasks[0]));
+
+    domain_compute_costs(ddecomp, TopLeafWork, TopLeafCount, TopLeafSlotMem);
+    const int64_t MaxSlotMem = domain_slot_memory_bound(TopLeafCount, TopLeafSlotMem, NTopLeaves, NTask);
+
+    cumcost[0] = 0;
+    for(i = 0; i < NTopLeaves; i++)
+        cumcost[i+1] = cumcost[i] + TopLeafWork[i];
+
+    const int nmoved = domain_rebalance_boundaries(ddecomp, cumcost, NTask, start);
+
+    if(nmoved > 0) {
+        memcpy(OldTasks, ddecomp->Tasks, NTask * sizeof(OldTasks[0]));
+        for(ta = 0; ta < NTask; ta++) {
+            ddecomp->Tasks[ddecomp->TaskOrder[ta]].StartLeaf = start[ta];
+            ddecomp->Tasks[ddecomp->TaskOrder[ta]].EndLeaf = start[ta+1];
+        }
+
+        if(domain_check_memory_bound(ddecomp, 0, TopLeafWork, TopLeafCount, TopLeafSlotMem, MaxSlotMem)) {
+            message(0, "Incremental rebalance would exceed the memory bound. Keeping the old domains.\n");
+            memcpy(ddecomp->Tasks, OldTasks, NTask * sizeof(OldTasks[0]));
+        }
+        else {
+            for(ta = 0; ta < NTask; ta++)
+                for(i = start[ta]; i < start[ta+1]; i++)
+                    ddecomp->TopLeaves[i].Task = ddecomp->TaskOrder[ta];
+            message(0, "Incremental rebalance moved %d TopLeaves between neighbouring tasks.\n", nmoved);
         }
     }
 
+    myfree(OldTasks);
+    myfree(start);
+    myfree(cumcost);
+    myfree(TopLeafSlotMem);
     myfree(TopLeafCount);
     myfree(TopLeafWork);
 }
 
+/* Largest slot memory of a task: the mean slot memory, with the same headroom
+ * as the particle table has over the mean particle load.
+ * Returns 0, for no bound, if there are no slots.*/
+static int64_t
+domain_slot_memory_bound(const int64_t * TopLeafCount, const int64_t * TopLeafSlotMem, const int NTopLeaves, const int NTask)
+{
+    int64_t count = 0, slotmem = 0;
+    int i;
+    for(i = 0; i < NTopLeaves; i++) {
+        count += TopLeafCount[i];
+        slotmem += TopLeafSlotMem[i];
+    }
+    if(count == 0 || slotmem == 0)
+        return 0;
+    const double headroom = PartManager->MaxPart * domain_params.SetAsideFactor / (1.0 * count / NTask);
+    return headroom * slotmem / NTask;
+}
+
+/* Returns 1 if a task has more particles than fit in the particle table,
+ * or, if MaxSlotMem > 0, more slot memory than MaxSlotMem.*/
 static int
-domain_check_memory_bound(const DomainDecomp * ddecomp, const int print_details, int64_t *TopLeafWork, int64_t *TopLeafCount)
+domain_check_memory_bound(const DomainDecomp * ddecomp, const int print_details, int64_t *TopLeafWork, int64_t *TopLeafCount, int64_t *TopLeafSlotMem, const int64_t MaxSlotMem)
 {
     int ta, i;
-    int load, max_load;
-    int64_t sumload;
+    int64_t load, max_load, sumload;
     int64_t work, max_work, sumwork;
+    int64_t slotmem, max_slotmem, sumslotmem;
     int NTask;
     MPI_Comm_size(ddecomp->DomainComm, &NTask);
 
     /*Only used if print_details is true*/
     int64_t *list_load = NULL;
     int64_t *list_work = NULL;
+    int64_t *list_slotmem = NULL;
     if(print_details) {
-        list_load = ta_malloc("list_load",int64_t, 2*NTask);
+        list_load = ta_malloc("list_load",int64_t, 3*NTask);
         list_work = list_load + NTask;
+        list_slotmem = list_load + 2 * NTask;
     }
 
-    max_work = max_load = sumload = sumwork = 0;
+    max_work = max_load = max_slotmem = sumload = sumwork = sumslotmem = 0;
 
     for(ta = 0; ta < NTask; ta++)
     {
         load = 0;
         work = 0;
+        slotmem = 0;
 
         for(i = ddecomp->Tasks[ta].StartLeaf; i < ddecomp->Tasks[ta].EndLeaf; i ++)
         {
             load += TopLeafCount[i];
             work += TopLeafWork[i];
+            slotmem += TopLeafSlotMem[i];
         }
 
         if(print_details) {
             list_load[ta] = load;
             list_work[ta] = work;
+            list_slotmem[ta] = slotmem;
         }
 
         sumwork += work;
         sumload += load;
+        sumslotmem += slotmem;
 
         if(load > max_load)
             max_load = load;
         if(work > max_work)
             max_work = work;
+        if(slotmem > max_slotmem)
+            max_slotmem = slotmem;
     }
 
-    message(0, "Largest load: work=%g particle=%g\n",
-            max_work / ((double)sumwork / NTask), max_load / (((double) sumload) / NTask));
+    message(0, "Largest load: work=%g particle=%g slot memory=%g\n",
+            max_work / ((double)sumwork / NTask), max_load / (((double) sumload) / NTask),
+            sumslotmem > 0 ? max_slotmem / (((double) sumslotmem) / NTask) : 0);
 
     if(print_details) {
         message(0, "Balance breakdown:\n");
         for(i = 0; i < NTask; i++)
         {
-            message(0, "Task: [%3d]  work=%8.4f  particle load=%8.4f\n", i,
-               list_work[i] / ((double) sumwork / NTask), list_load[i] / (((double) sumload) / NTask));
+            message(0, "Task: [%3d]  work=%8.4f  particle load=%8.4f  slot memory=%8.4f\n", i,
+               list_work[i] / ((double) sumwork / NTask), list_load[i] / (((double) sumload) / NTask),
+               sumslotmem > 0 ? list_slotmem[i] / (((double) sumslotmem) / NTask) : 0);
         }
         ta_free(list_load);
     }
@@ -507,12 +997,18 @@ domain_check_memory_bound(const DomainDecomp * ddecomp, const int print_details,
     /*Leave a small number of particles for star formation */
     if(max_load > PartManager->MaxPart * domain_params.SetAsideFactor)
     {
-        message(0, "desired memory imbalance=%g  (limit=%g, needed=%d)\n",
+        message(0, "desired memory imbalance=%g  (limit=%g, needed=%ld)\n",
                     (max_load * ((double) sumload ) / NTask ) / PartManager->MaxPart, domain_params.SetAsideFactor * PartManager->MaxPart, max_load);
 
         return 1;
     }
 
+    if(MaxSlotMem > 0 && max_slotmem > MaxSlotMem)
+    {
+        message(0, "desired slot memory=%g MB (limit=%g MB)\n", max_slotmem / (1024.0 * 1024.0), MaxSlotMem / (1024.0 * 1024.0));
+        return 1;
+    }
+
     return 0;
 }
 
@@ -522,51 +1018,88 @@ struct topleaf_extdata {
     peano_t Key;
     int Task;        /** The task that receives the node */
     int topnode;     /** The node */
-    int64_t cost;    /** cost value, can be either number of calculations or number of particles. */
+    int64_t cost;    /** cost value, the number of calculations. */
+    int64_t count;   /** number of particles */
+    int64_t slotmem; /** bytes of slot memory of the particles */
 };
 
 static int
-topleaf_ext_order_by_task_and_key(const void * c1, const void * c2)
+topleaf_ext_order_by_key(const void * c1, const void * c2)
 {
     const struct topleaf_extdata * p1 = (const struct topleaf_extdata *) c1;
     const struct topleaf_extdata * p2 = (const struct topleaf_extdata *) c2;
-    if(p1->Task < p2->Task) return -1;
-    if(p1->Task > p2->Task) return 1;
     if(p1->Key < p2->Key) return -1;
     if(p1->Key > p2->Key) return 1;
     return 0;
 }
 
-static int
-topleaf_ext_order_by_key(const void * c1, const void * c2)
+/* Split the TopLeaves, in key order, into NTask contiguous segments.
+ * A segment is closed before its cost would exceed MaxCost, its number of particles
+ * MaxCount or its slot memory MaxSlotMem. If fill is true the segments are filled up
+ * to these bounds: this needs the fewest segments, so it finds any assignment which exists.
+ * Otherwise a segment is also closed when its cost is closest to the mean cost of the remaining
+ * leaves over the remaining tasks, which gives a more even assignment, but may fail.
+ * Every segment has at least one leaf. start[ta] is the first leaf of segment ta.
+ * Returns the largest cost of a segment, or -1 if the bounds cannot be met.*/
+static int64_t
+domain_assign_segments(const struct topleaf_extdata * TopLeafExt, const int NTopLeaves, const int NTask, const int64_t totalcost,
+        const int64_t MaxCost, const int64_t MaxCount, const int64_t MaxSlotMem, const int fill, int * start)
 {
-    const struct topleaf_extdata * p1 = (const struct topleaf_extdata *) c1;
-    const struct topleaf_extdata * p2 = (const struct topleaf_extdata *) c2;
-    if(p1->Key < p2->Key) return -1;
-    if(p1->Key > p2->Key) return 1;
-    return 0;
+    int64_t costleft = totalcost;
+    int64_t maxcost = 0;
+    int curleaf = 0;
+    int ta;
+    for(ta = 0; ta < NTask; ta++) {
+        start[ta] = curleaf;
+        const double mean = 1.0 * costleft / (NTask - ta);
+        /* Leave at least one leaf for each of the remaining tasks. The last task takes all.*/
+        const int lastleaf = (ta == NTask - 1) ? NTopLeaves : NTopLeaves - (NTask - 1 - ta);
+        int64_t cost = 0, count = 0, slotmem = 0;
+        for(; curleaf < lastleaf; curleaf++) {
+            const struct topleaf_extdata * leaf = &TopLeafExt[curleaf];
+            const int first = (curleaf == start[ta]);
+            if(cost + leaf->cost > MaxCost || count + leaf->count > MaxCount || slotmem + leaf->slotmem > MaxSlotMem) {
+                /* A task must take its first leaf, and the last task all that are left*/
+                if(first || ta == NTask - 1)
+                    return -1;
+                break;
+            }
+            /* append the leaf if the cost stays closer to the mean */
+            if(!fill && !first && ta < NTask - 1 && cost + 0.5 * leaf->cost > mean)
+                break;
+            cost += leaf->cost;
+            count += leaf->count;
+            slotmem += leaf->slotmem;
+        }
+        costleft -= cost;
+        if(cost > maxcost)
+            maxcost = cost;
+    }
+    start[NTask] = NTopLeaves;
+    return maxcost;
 }
 
-
 /**
- * This function assigns TopLeaves to Segments, trying to ensure uniform cost
- * by assigning TopLeaves (contiguously) until a Segment has a desired size.
- * Then each Segment is assigned to a Task in a round-robin fashion starting from the largest Segment
- * until all Segments are assigned.
- * At the moment the Segment/Task distinction is not used: we call this with NSegmentPerTask = 1, because
- * we are able to create Segments of roughly equal cost from the TopLeaves.
+ * This function assigns TopLeaves to Tasks, in contiguous Segments along the Peano curve.
+ * The largest cost of a Task is minimised under the memory bounds: the number of particles
+ * of each Task is below the particle table size (times SetAsideFactor) and, if MaxSlotMem > 0,
+ * the slot memory of each Task is below MaxSlotMem. The memory is thus balanced together
+ * with the work, rather than checked afterwards.
+ * We bisect for the smallest bound on the cost for which domain_assign_segments can meet
+ * all the bounds.
  *
  * This creates the index in Tasks[Task].StartLeaf and Tasks[Task].EndLeaf
- * cost is the cost per TopLeaves
+ * cost, count and slotmem are per TopLeaf.
+ * Sets imbalance to the largest cost of a Task over the mean.
+ * Returns 1 if no assignment meets the memory bounds.
  *
  * */
-static void
-domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int NsegmentPerTask)
+static int
+domain_assign_balanced(DomainDecomp * ddecomp, const int64_t * cost, const int64_t * count, const int64_t * slotmem, const int64_t MaxSlotMem, double * imbalance)
 {
     int NTask;
     MPI_Comm_size(ddecomp->DomainComm, &NTask);
 
-    int Nsegment = NTask * NsegmentPerTask;
     /* we work with TopLeafExt then replace TopLeaves*/
 
     struct topleaf_extdata * TopLeafExt;
@@ -574,6 +1107,9 @@ domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int Nsegmen
     /* A Segment is a subset of the TopLeaf nodes */
 
     TopLeafExt = (struct topleaf_extdata *) mymalloc("TopLeafExt", ddecomp->NTopLeaves * sizeof(TopLeafExt[0]));
+    /* First leaf of each segment, for the best assignment and the current trial */
+    int * start = (int *) mymalloc("SegmentStart", 2 * (NTask + 1) * sizeof(start[0]));
+    int * trystart = start + NTask + 1;
 
     /* copy the data over */
     int i;
@@ -582,6 +1118,8 @@ domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int Nsegmen
         TopLeafExt[i].Key = ddecomp->TopNodes[ddecomp->TopLeaves[i].topnode].StartKey;
         TopLeafExt[i].Task = -1;
         TopLeafExt[i].cost = cost[i];
+        TopLeafExt[i].count = count[i];
+        TopLeafExt[i].slotmem = slotmem[i];
     }
 
     /* make sure TopLeaves are sorted by Key for locality of segments -
@@ -589,141 +1127,94 @@ domain_assign_balanced(DomainDecomp * ddecomp, int64_t * cost, const int Nsegmen
      * is called it is already true */
     qsort_openmp(TopLeafExt, ddecomp->NTopLeaves, sizeof(TopLeafExt[0]), topleaf_ext_order_by_key);
 
-    int64_t totalcost = 0;
-    #pragma omp parallel for reduction(+ : totalcost)
+    int64_t totalcost = 0, maxleafcost = 0;
     for(i = 0; i < ddecomp->NTopLeaves; i ++) {
         totalcost += TopLeafExt[i].cost;
+        if(TopLeafExt[i].cost > maxleafcost)
+            maxleafcost = TopLeafExt[i].cost;
     }
-    int64_t totalcostLeft = totalcost;
 
-    /* start the assignment; We try to create segments that are of the
-     * mean_expected cost, then assign them to Tasks in a round-robin fashion.
-     * The default is that there is one segment per task, which makes the assignment trivial.
-     */
+    const int64_t MaxCount = PartManager->MaxPart * domain_params.SetAsideFactor;
+    const int64_t MaxSlot = MaxSlotMem > 0 ? MaxSlotMem : INT64_MAX;
 
-    double mean_expected = 1.0 * totalcost / Nsegment;
-    double mean_task = 1.0 * totalcost /NTask;
-    int curleaf = 0;
-    int curseg = 0;
-    int curtask = 0; /* between 0 and NTask - 1*/
-    int nrounds = 0; /*Number of times we looped*/
-    int64_t curload = 0; /* cumulative load for the current segment */
-    int64_t curtaskload = 0; /* cumulative load for current task */
-    int64_t maxleafcost = 0;
-
-    message(0, "Expected segment cost %g\n", mean_expected);
-    /* we maintain that after the loop curleaf is the number of leaves scanned,
-     * curseg is number of segments created.
-     * */
-    while(nrounds < ddecomp->NTopLeaves) {
-        int append = 0;
-        int advance = 0;
-        if(curleaf == ddecomp->NTopLeaves) {
-            /* to maintain the invariance */
-            advance = 1;
-        } else if(ddecomp->NTopLeaves - curleaf == Nsegment - curseg) {
-            /* just enough for one segment per leaf; this line ensures
-             * at least Nsegment segments are created. */
-            append = 1;
-            advance = 1;
-        } else {
-            /* append a leaf to the segment if there is room left.
-             * Calculate room left based on a rolling average of the total so far..*/
-            int64_t totalassigned = (totalcost - totalcostLeft) + curload;
-            if((mean_expected * (curseg +1) - totalassigned > 0.5 * TopLeafExt[curleaf].cost)
-            || curload == 0 /* but at least add one leaf */
-                ) {
-                append = 1;
-            } else {
-                /* will be too big of a segment, cut it */
-                advance = 1;
-            }
-        }
-        if(append) {
-            /* assign the leaf to the task */
-            curload += TopLeafExt[curleaf].cost;
-            TopLeafExt[curleaf].Task = curtask;
-            curleaf ++;
-        }
+    const int NTopLeaves = ddecomp->NTopLeaves;
+    /* First the memory bounds alone */
+    const int64_t fillcost = domain_assign_segments(TopLeafExt, NTopLeaves, NTask, totalcost, INT64_MAX, MaxCount, MaxSlot, 1, start);
+    if(fillcost < 0) {
+        myfree(start);
+        myfree(TopLeafExt);
+        return 1;
+    }
 
-        if(advance) {
-            /*Add this segment to the current task*/
-            curtaskload += curload;
-            /* If we have allocated enough segments to fill this processor,
-             * or if we have one segment per task left, proceed to the next task.
-             * We do not use round robin so that neighbouring (by key)
-             * topTree are on the same processor.*/
-            if((mean_task - curtaskload < 0.5 * mean_expected) || (Nsegment - curseg <= NTask - curtask)
-               ){
-                curtaskload = 0;
-                curtask ++;
-            }
-            /* move on to the next segment.*/
-            totalcostLeft -= curload;
-            curload = 0;
-            curseg ++;
-
-            /* finished a round for all tasks */
-            if(curtask == NTask) {
-                /*Back to task zero*/
-                curtask = 0;
-                /* Need a new mean_expected value: we want to
-                 * divide the remaining segments evenly between the processors.*/
-                mean_expected = 1.0 * totalcostLeft / Nsegment;
-                mean_task = 1.0 * totalcostLeft / NTask;
-                nrounds++;
-            }
-            if(curleaf == ddecomp->NTopLeaves)
-                break;
-            if(TopLeafExt[curleaf].cost > maxleafcost)
-                maxleafcost = TopLeafExt[curleaf].cost;
+    /* Bisect for the smallest bound on the cost. No assignment can do better than lo.*/
+    int64_t lo = DMAX(maxleafcost, totalcost / NTask) - 1;
+    int64_t hi = fillcost;
+    int ntry = 0;
+    while(hi - lo > 1 && hi - lo > 1e-4 * hi) {
+        const int64_t mid = lo + (hi - lo) / 2;
+        const int64_t trycost = domain_assign_segments(TopLeafExt, NTopLeaves, NTask, totalcost, mid, MaxCount, MaxSlot, 1, trystart);
+        if(trycost >= 0) {
+            hi = trycost;
+            memcpy(start, trystart, (NTask + 1) * sizeof(start[0]));
         }
-        //message(0, "curleaf = %d advance = %d append = %d, curload = %d cost=%ld left=%ld\n", curleaf, advance, append, curload, TopLeafExt[curleaf].cost, totalcostLeft);
+        else
+            lo = mid;
+        ntry++;
     }
 
-    /*In most 'normal' cases nrounds == 1 here*/
-    message(0, "Created %d segments in %d rounds. Max leaf cost: %g\n", curseg, nrounds, (1.0*maxleafcost)/(totalcost) * Nsegment);
+    /* Filling leaves the last tasks with little work. Use the more even assignment if it fits.*/
+    const int64_t evencost = domain_assign_segments(TopLeafExt, NTopLeaves, NTask, totalcost, hi, MaxCount, MaxSlot, 0, trystart);
+    if(evencost >= 0)
+        memcpy(start, trystart, (NTask + 1) * sizeof(start[0]));
 
-    if(curseg < Nsegment) {
-        endrun(0, "Not enough segments were created (%d instead of %d). This should not happen.\n", curseg, Nsegment);
-    }
+    *imbalance = totalcost > 0 ? (1.0 * (evencost >= 0 ? evencost : hi)) / totalcost * NTask : 1;
 
-    if(totalcostLeft != 0) {
-        endrun(0, "Assertion failed. Total cost is not fully assigned to all ranks\n");
-    }
+    message(0, "Assigned segments in %d tries. Max segment cost: %g. Max leaf cost: %g. Even assignment: %d\n",
+            ntry, (1.0 * hi) / totalcost * NTask, (1.0*maxleafcost)/(totalcost) * NTask, evencost >= 0);
+
+    int ta;
+    for(ta = 0; ta < NTask; ta++)
+        for(i = start[ta]; i < start[ta+1]; i++)
+            TopLeafExt[i].Task = ta;
 
-    /* lets rearrange the TopLeafExt by task, such that we can build the Tasks table */
-    qsort_openmp(TopLeafExt, ddecomp->NTopLeaves, sizeof(TopLeafExt[0]), topleaf_ext_order_by_task_and_key);
+    myfree(start);
+
+    /* The TopLeafExt are in order of task, so we can build the Tasks table.
+     * Here Task is still the position along the curve, which is converted to a rank with TaskOrder.*/
     for(i = 0; i < ddecomp->NTopLeaves; i ++) {
         ddecomp->TopNodes[TopLeafExt[i].topnode].Leaf = i;
-        ddecomp->TopLeaves[i].Task = TopLeafExt[i].Task;
+        ddecomp->TopLeaves[i].Task = ddecomp->TaskOrder[TopLeafExt[i].Task];
         ddecomp->TopLeaves[i].topnode = TopLeafExt[i].topnode;
     }
 
-    myfree(TopLeafExt);
     /* here we reduce the number of code branches by adding an item to the end. */
     ddecomp->TopLeaves[ddecomp->NTopLeaves].Task = NTask;
     ddecomp->TopLeaves[ddecomp->NTopLeaves].topnode = -1;
 
-    int ta = 0;
-    ddecomp->Tasks[ta].StartLeaf = 0;
+    int pos = 0;
+    ddecomp->Tasks[ddecomp->TaskOrder[pos]].StartLeaf = 0;
     for(i = 0; i <= ddecomp->NTopLeaves; i ++) {
-
-        if(ddecomp->TopLeaves[i].Task == ta) continue;
-
-        ddecomp->Tasks[ta].EndLeaf = i;
-        ta ++;
-        while(ta < ddecomp->TopLeaves[i].Task) {
-            ddecomp->Tasks[ta].EndLeaf = i;
-            ddecomp->Tasks[ta].StartLeaf = i;
-            ta ++;
+        const int leafpos = (i < ddecomp->NTopLeaves) ? TopLeafExt[i].Task : NTask;
+        if(leafpos == pos) continue;
+
+        ddecomp->Tasks[ddecomp->TaskOrder[pos]].EndLeaf = i;
+        pos ++;
+        while(pos < leafpos) {
+            ddecomp->Tasks[ddecomp->TaskOrder[pos]].EndLeaf = i;
+            ddecomp->Tasks[ddecomp->TaskOrder[pos]].StartLeaf = i;
+            pos ++;
         }
-        /* the last item will set Tasks[NTask], but we allocated memory for it already */
-        ddecomp->Tasks[ta].StartLeaf = i;
+        if(pos < NTask)
+            ddecomp->Tasks[ddecomp->TaskOrder[pos]].StartLeaf = i;
     }
-    if(ta != NTask) {
+    myfree(TopLeafExt);
+    if(pos != NTask) {
         endrun(0, "Assertion failed: not all tasks are assigned. This indicates a bug.\n");
     }
+    /* The tail item */
+    ddecomp->Tasks[NTask].StartLeaf = ddecomp->NTopLeaves;
+    ddecomp->Tasks[NTask].EndLeaf = ddecomp->NTopLeaves;
+    return 0;
 }
 
 /*! This function determines which particles that are currently stored
@@ -963,7 +1454,7 @@ domain_check_for_local_refine_subsample(
      * be omitted in most cases. Usually the particles in memory won't be very far off
      * from a peano order. */
     if(policy->PreSort)
-        qsort_openmp(LP, PartManager->NumPart, sizeof(struct local_particle_data), order_by_key);
+        radix_sort_openmp(LP, PartManager->NumPart, sizeof(struct local_particle_data), mp_order_by_key, 8, NULL);
 
     /* now subsample */
     for(i = 0; i < Nsample; i ++)
@@ -975,7 +1466,7 @@ domain_check_for_local_refine_subsample(
     if(policy->UseGlobalSort) {
         mpsort_mpi(LP, Nsample, sizeof(struct local_particle_data), mp_order_by_key, 8, NULL, policy->GlobalSortComm);
     } else {
-        qsort_openmp(LP, Nsample, sizeof(struct local_particle_data), order_by_key);
+        radix_sort_openmp(LP, Nsample, sizeof(struct local_particle_data), mp_order_by_key, 8, NULL);
     }
 
     walltime_measure("/Domain/DetermineTopTree/Sort");
@@ -1175,6 +1666,9 @@ int domain_determine_global_toptree(DomainDecompositionPolicy * policy,
 {
     walltime_measure("/Domain/DetermineTopTree/Misc");
 
+    if(domain_params.DomainSampledTopTree > 0)
+        return domain_sampled_toptree(policy, topTree, topTreeSize, MaxTopNodes, DomainComm);
+
     /*
      * Build local refinement with a subsample of particles
      * 1/16 is used because each local topTree node takes about 32 bytes.
@@ -1246,6 +1740,171 @@ int domain_determine_global_toptree(DomainDecompositionPolicy * policy,
     return 0;
 }
 
+/* Refine the node no of the sampled toptree until each leaf holds a sampled Count and Cost below
+ * the limits, or a single sample. The samples in the node are sample[start, end), sorted by key.*/
+static int
+domain_sampled_toptree_refine(struct local_topnode_data * topTree, int * topTreeSize, const int MaxTopNodes,
+        const struct sample_particle_data * sample, int64_t start, int64_t end, const int no,
+        const int64_t countlimit, const int64_t costlimit)
+{
+    int64_t i;
+    for(i = start; i < end; i++) {
+        topTree[no].Count += sample[i].Count;
+        topTree[no].Cost += sample[i].Cost;
+    }
+    if(end - start <= 1 || topTree[no].Shift < 3)
+        return 0;
+    if(topTree[no].Count < countlimit && topTree[no].Cost < costlimit)
+        return 0;
+
+    if(domain_toptree_split(topTree, topTreeSize, MaxTopNodes, no))
+        return 1;
+
+    int j;
+    for(j = 0; j < 8; j++) {
+        const int sub = topTree[no].Daughter + j;
+        const peano_t EndKey = topTree[sub].StartKey + (((peano_t) 1) << topTree[sub].Shift);
+        int64_t subend = start;
+        while(subend < end && sample[subend].Key < EndKey)
+            subend++;
+        if(domain_sampled_toptree_refine(topTree, topTreeSize, MaxTopNodes, sample, start, subend, sub, countlimit, costlimit))
+            return 1;
+        start = subend;
+    }
+    return 0;
+}
+
+/* Build the toptree from a fixed size sample of keys from every rank, instead of merging
+ * the local toptrees of all ranks level by level. The sample is gathered to all ranks,
+ * which all build the same tree from it. The Count and Cost of the leaves are then
+ * summed exactly over all particles, and the leaves still above the limits are refined
+ * once more. This has a fixed communication depth, so at large rank counts it is faster than
+ * domain_nonrecursively_combine_topTree, at the price of a less accurate first refinement.*/
+static int
+domain_sampled_toptree(DomainDecompositionPolicy * policy, struct local_topnode_data * topTree, int * topTreeSize, const int MaxTopNodes, MPI_Comm DomainComm)
+{
+    int NTask, i;
+    MPI_Comm_size(DomainComm, &NTask);
+
+    /* Exact totals set the limits, as for the merged toptree*/
+    int64_t LocalTot[2] = {0}, Tot[2];
+    #pragma omp parallel for reduction(+: LocalTot[:2])
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage)
+            continue;
+        LocalTot[0] += 1;
+        LocalTot[1] += domain_particle_costfactor(i);
+    }
+    MPI_Allreduce(LocalTot, Tot, 2, MPI_INT64, MPI_SUM, DomainComm);
+    const int64_t countlimit = Tot[0] / policy->NTopLeaves;
+    const int64_t costlimit = Tot[1] / policy->NTopLeaves;
+
+    /* Every rank contributes the same number of samples, evenly spaced through its particles,
+     * each standing for the particles up to the next.*/
+    int NumSample = domain_params.DomainSampledTopTree * policy->NTopLeaves / NTask;
+    if(NumSample < 1)
+        NumSample = 1;
+    if(NumSample > PartManager->NumPart)
+        NumSample = PartManager->NumPart;
+    const double stride = NumSample > 0 ? ((double) PartManager->NumPart) / NumSample : 0;
+
+    int * SampleCounts = ta_malloc("SampleCounts", int, 2 * NTask);
+    int * SampleOffsets = SampleCounts + NTask;
+    MPI_Allgather(&NumSample, 1, MPI_INT, SampleCounts, 1, MPI_INT, DomainComm);
+    int64_t TotSample = 0;
+    for(i = 0; i < NTask; i++) {
+        SampleOffsets[i] = TotSample;
+        TotSample += SampleCounts[i];
+    }
+    if(TotSample >= INT_MAX / (int) sizeof(struct sample_particle_data))
+        endrun(5, "Too many samples for the sampled toptree: %ld\n", TotSample);
+
+    /* Gathered in place: our own samples go at our own offset*/
+    int ThisTask;
+    MPI_Comm_rank(DomainComm, &ThisTask);
+    struct sample_particle_data * sample = mymalloc("TopTreeSample", TotSample * sizeof(sample[0]));
+    struct sample_particle_data * mysample = sample + SampleOffsets[ThisTask];
+
+    #pragma omp parallel for
+    for(i = 0; i < NumSample; i++) {
+        const int64_t first = i * stride;
+        const int64_t last = (i + 1) * stride;
+        int64_t j;
+        mysample[i].Key = P[first].Key;
+        mysample[i].Count = 0;
+        mysample[i].Cost = 0;
+        for(j = first; j < last && j < PartManager->NumPart; j++) {
+            if(P[j].IsGarbage)
+                continue;
+            mysample[i].Count += 1;
+            mysample[i].Cost += domain_particle_costfactor(j);
+        }
+    }
+
+    MPI_Datatype MPI_TYPE_SAMPLE;
+    MPI_Type_contiguous(sizeof(struct sample_particle_data), MPI_BYTE, &MPI_TYPE_SAMPLE);
+    MPI_Type_commit(&MPI_TYPE_SAMPLE);
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, sample, SampleCounts, SampleOffsets, MPI_TYPE_SAMPLE, DomainComm);
+    MPI_Type_free(&MPI_TYPE_SAMPLE);
+
+    radix_sort_openmp(sample, TotSample, sizeof(struct sample_particle_data), mp_order_by_key, 8, NULL);
+
+    walltime_measure("/Domain/DetermineTopTree/Sample");
+
+    /* Every rank builds the same tree from the same sample*/
+    *topTreeSize = 1;
+    topTree[0].Daughter = -1;
+    topTree[0].Parent = -1;
+    topTree[0].Shift = BITS_PER_DIMENSION * 3;
+    topTree[0].StartKey = 0;
+    topTree[0].Count = 0;
+    topTree[0].Cost = 0;
+
+    int failed = domain_sampled_toptree_refine(topTree, topTreeSize, MaxTopNodes, sample, 0, TotSample, 0, countlimit, costlimit);
+    myfree(sample);
+    ta_free(SampleCounts);
+
+    if(failed) {
+        message(0, "Sampled TopTree ran out of Topnodes.\n");
+        return 1;
+    }
+
+    /* Now the exact Count and Cost of every node*/
+    for(i = 0; i < *topTreeSize; i++) {
+        topTree[i].Count = 0;
+        topTree[i].Cost = 0;
+    }
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage)
+            continue;
+        domain_toptree_insert(topTree, P[i].Key, domain_particle_costfactor(i));
+    }
+    int64_t * NodeCost = mymalloc("NodeCost", 2 * (*topTreeSize) * sizeof(int64_t));
+    for(i = 0; i < *topTreeSize; i++) {
+        NodeCost[2 * i] = topTree[i].Count;
+        NodeCost[2 * i + 1] = topTree[i].Cost;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, NodeCost, 2 * (*topTreeSize), MPI_INT64, MPI_SUM, DomainComm);
+    for(i = 0; i < *topTreeSize; i++) {
+        topTree[i].Count = NodeCost[2 * i];
+        topTree[i].Cost = NodeCost[2 * i + 1];
+    }
+    myfree(NodeCost);
+
+    walltime_measure("/Domain/DetermineTopTree/SampleCost");
+
+    /* The second round splits the leaves which are still too expensive*/
+    if(domain_global_refine(topTree, topTreeSize, MaxTopNodes, countlimit, costlimit)) {
+        message(0, "Global refine failed: toptreeSize = %d, MaxTopNodes = %d\n", *topTreeSize, MaxTopNodes);
+        return 1;
+    }
+
+    walltime_measure("/Domain/DetermineTopTree/Addnodes");
+
+    message(0, "Sampled topTree from %ld keys, size = %d per segment = %g.\n", TotSample, *topTreeSize, 1.0 * (*topTreeSize) / (policy->NTopLeaves));
+    return 0;
+}
+
 static int
 domain_global_refine(
     struct local_topnode_data * topTree, int * topTreeSize, const int MaxTopNodes,
@@ -1303,23 +1962,32 @@ domain_global_refine(
 
 
 static void
-domain_compute_costs(const DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopLeafCount)
+domain_compute_costs(const DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopLeafCount, int64_t *TopLeafSlotMem)
 {
     int i;
     int NumThreads = omp_get_max_threads();
-    int64_t * local_TopLeafWork = (int64_t *) mymalloc("local_TopLeafWork", NumThreads * ddecomp->NTopLeaves * sizeof(local_TopLeafWork[0]));
-    int64_t * local_TopLeafCount = (int64_t *) mymalloc("local_TopLeafCount", NumThreads * ddecomp->NTopLeaves * sizeof(local_TopLeafCount[0]));
+    const int NTopLeaves = ddecomp->NTopLeaves;
+    /* Work, count and slot memory of each leaf, for each thread */
+    int64_t * local_TopLeafWork = (int64_t *) mymalloc("local_TopLeafWork", 3 * NumThreads * NTopLeaves * sizeof(local_TopLeafWork[0]));
+    int64_t * local_TopLeafCount = local_TopLeafWork + NumThreads * NTopLeaves;
+    int64_t * local_TopLeafSlotMem = local_TopLeafWork + 2 * NumThreads * NTopLeaves;
+
+    memset(local_TopLeafWork, 0, 3 * NumThreads * NTopLeaves * sizeof(local_TopLeafWork[0]));
 
-    memset(local_TopLeafWork, 0, NumThreads * ddecomp->NTopLeaves * sizeof(local_TopLeafWork[0]));
-    memset(local_TopLeafCount, 0, NumThreads * ddecomp->NTopLeaves * sizeof(local_TopLeafCount[0]));
+    /* Bytes of slot memory for a particle of each type */
+    int64_t slotsize[6];
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++)
+        slotsize[ptype] = SlotsManager->info[ptype].enabled ? SlotsManager->info[ptype].elsize : 0;
 
 #pragma omp parallel
     {
         int tid = omp_get_thread_num();
         int n;
 
-        int64_t * mylocal_TopLeafWork = local_TopLeafWork + tid * ddecomp->NTopLeaves;
-        int64_t * mylocal_TopLeafCount = local_TopLeafCount + tid * ddecomp->NTopLeaves;
+        int64_t * mylocal_TopLeafWork = local_TopLeafWork + tid * NTopLeaves;
+        int64_t * mylocal_TopLeafCount = local_TopLeafCount + tid * NTopLeaves;
+        int64_t * mylocal_TopLeafSlotMem = local_TopLeafSlotMem + tid * NTopLeaves;
 
         #pragma omp for
         for(n = 0; n < PartManager->NumPart; n++)
@@ -1333,22 +2001,25 @@ domain_compute_costs(const DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t
             mylocal_TopLeafWork[no] += domain_particle_costfactor(n);
 
             mylocal_TopLeafCount[no] += 1;
+
+            mylocal_TopLeafSlotMem[no] += slotsize[P[n].Type];
         }
     }
 
 #pragma omp parallel for
-    for(i = 0; i < ddecomp->NTopLeaves; i++)
+    for(i = 0; i < NTopLeaves; i++)
     {
         int tid;
         for(tid = 1; tid < NumThreads; tid++) {
-            local_TopLeafWork[i] += local_TopLeafWork[i + tid * ddecomp->NTopLeaves];
-            local_TopLeafCount[i] += local_TopLeafCount[i + tid * ddecomp->NTopLeaves];
+            local_TopLeafWork[i] += local_TopLeafWork[i + tid * NTopLeaves];
+            local_TopLeafCount[i] += local_TopLeafCount[i + tid * NTopLeaves];
+            local_TopLeafSlotMem[i] += local_TopLeafSlotMem[i + tid * NTopLeaves];
         }
     }
 
-    MPI_Allreduce(local_TopLeafWork, TopLeafWork, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
-    MPI_Allreduce(local_TopLeafCount, TopLeafCount, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
-    myfree(local_TopLeafCount);
+    MPI_Allreduce(local_TopLeafWork, TopLeafWork, NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
+    MPI_Allreduce(local_TopLeafCount, TopLeafCount, NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
+    MPI_Allreduce(local_TopLeafSlotMem, TopLeafSlotMem, NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
     myfree(local_TopLeafWork);
 }
 
@@ -1473,20 +2144,6 @@ domain_toptree_merge(struct local_topnode_data *treeA,
     }
 }
 
-static int
-order_by_key(const void *a, const void *b)
-{
-    const struct local_particle_data * pa  = (const struct local_particle_data *) a;
-    const struct local_particle_data * pb  = (const struct local_particle_data *) b;
-    if(pa->Key < pb->Key)
-        return -1;
-
-    if(pa->Key > pb->Key)
-        return +1;
-
-    return 0;
-}
-
 static void
 mp_order_by_key(const void * data, void * radix, void * arg)
 {
@@ -38,6 +38,9 @@ typedef struct DomainDecomp {
     int NTopNodes;
     int NTopLeaves;
     struct task_data * Tasks;
+    /* Tasks in the order they are placed along the Peano curve.
+     * Ranks on the same node are consecutive, so neighbouring domains share a node.*/
+    int * TaskOrder;
     /* MPI Communicator over which to build the Domain.
      * Currently this is always MPI_COMM_WORLD.*/
     MPI_Comm DomainComm;
@@ -50,18 +53,54 @@ typedef struct DomainParams
      * no more than 1/(DODF * NTask) fraction of the work.
      * The load balancer will assign these TopLeaves so that each MPI rank has a similar amount of work.*/
     int DomainOverDecompositionFactor;
+    /* If larger than DomainOverDecompositionFactor, the number of TopLeaves per processor is tuned
+     * between DomainOverDecompositionFactor and this after each full decomposition.*/
+    int DomainOverDecompositionMax;
+    /* Tuning grows the number of TopLeaves when the largest work is above (1 + this) times the mean,
+     * and shrinks it when the largest work is below (1 + this/4) times the mean.*/
+    double DomainTargetImbalance;
     /** Use a global sort for the first few domain policies to try.*/
     int DomainUseGlobalSorting;
     /** Initial number of Top level tree nodes as a fraction of particles */
     double TopNodeAllocFactor;
     /** Fraction of local particle slots to leave free for, eg, star formation*/
     double SetAsideFactor;
+    /** Use the measured tree walk time of each particle, P[i].WalkTime, as its cost instead of GravCost.*/
+    int DomainMeasuredCost;
+    /** If non-zero, domain_maintain moves TopLeaves between neighbouring ranks when the
+     * work on the most loaded rank exceeds (1 + DomainRebalanceThreshold) times the mean.*/
+    double DomainRebalanceThreshold;
+    /** Largest number of TopLeaves moved across each domain boundary by the incremental rebalance.*/
+    int DomainRebalanceMaxLeaves;
+    /** Sort the particles by Peano key after every domain_maintain, not just after a full decomposition.*/
+    int DomainMaintainSort;
+    /** If non-zero, build the toptree from this many sampled keys per TopLeaf, gathered to every rank,
+     * instead of merging the local toptrees of all ranks. Fewer communication rounds at large rank counts.*/
+    int DomainSampledTopTree;
+    /** If non-zero, check that the particle IDs are unique after each full decomposition.
+     * Values above 1 check one in this many classes of IDs each time.*/
+    int DomainCheckIDUniqueness;
 } DomainParams;
 
 /*Set the parameters of the domain module*/
 void set_domain_params(ParameterSet * ps);
 /* Test helper*/
 void set_domain_par(DomainParams dp);
+DomainParams get_domain_par(void);
+
+/* True if the domains are balanced by the measured tree walk time, P[i].WalkTime, which is then
+ * measured in the tree walks (DomainMeasuredCost).*/
+int domain_measured_cost(void);
+
+/* The policy of the last successful domain decomposition and the number of TopNodes it made, which
+ * the next decomposition starts from. Saved in snapshots with the domain, so restarts keep it.*/
+void domain_get_policy_hint(int * Policy, int * NTopNodes);
+void domain_set_policy_hint(const int Policy, const int NTopNodes);
+
+/* The current number of TopLeaves per processor, which is tuned if DomainOverDecompositionMax is set.
+ * Also saved in snapshots. Setting it to 0 restarts from DomainOverDecompositionFactor.*/
+int domain_get_overdecomposition(void);
+void domain_set_overdecomposition(const int OverDecomposition);
 
 /* Do a full domain decomposition, which splits the particles into even clumps*/
 void domain_decompose_full(DomainDecomp * ddecomp);
@@ -78,6 +117,11 @@ domain_get_topleaf(const peano_t key, const DomainDecomp * ddecomp) {
     return no;
 };
 
+/* Set up a domain from saved TopNodes, the rank of each TopLeaf and the TaskOrder,
+ * instead of decomposing. Particles are not exchanged.*/
+void domain_restore(DomainDecomp * ddecomp, const struct topnode_data * TopNodes, const int NTopNodes,
+        const int * LeafTask, const int NTopLeaves, const int * TaskOrder);
+
 void domain_free(DomainDecomp * ddecomp);
 
 #endif
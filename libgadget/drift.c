@@ -11,11 +11,16 @@
 #include "slotsmanager.h"
 #include "partmanager.h"
 #include "utils.h"
+#include "lightcone.h"
 
 #define MAXHSML 30000.0
 
 static void
-real_drift_particle(int i, inttime_t ti1, const double ddrift, const double random_shift[3]);
+real_drift_particle(int i, inttime_t ti1, const double ddrift, const double random_shift[3], const int update_key);
+static void
+drift_particle_position(int i, inttime_t ti1, const double ddrift, const double random_shift[3], const int update_key);
+static void
+drift_sph_predict(int i, const double ddrift);
 
 /* Updates a single particle to the current drift time*/
 void drift_particle(int i, inttime_t ti1, struct SpinLocks * spin) {
@@ -26,7 +31,7 @@ void drift_particle(int i, inttime_t ti1, struct SpinLocks * spin) {
     inttime_t ti0 = P[i].Ti_drift;
     if(ti0 != ti1) {
         const double ddrift = get_drift_factor(ti0, ti1);
-        real_drift_particle(i, ti1, ddrift, random_shift);
+        real_drift_particle(i, ti1, ddrift, random_shift, 1);
 #pragma omp flush
     }
     unlock_spinlock(i, spin);
@@ -39,8 +44,19 @@ void drift_particle(int i, inttime_t ti1, struct SpinLocks * spin) {
  * signifying no change in the coordinate frame. On PM steps a random offset is generated, and the routine
  * receives a shift vector removing the previous random shift and adding a new one.
  * This function also updates the velocity and updates the density according to an adiabatic factor.
+ * If update_key is 0 the peano key is not recomputed, and is stale until drift_update_keys.
  */
-static void real_drift_particle(int i, inttime_t ti1, const double ddrift, const double random_shift[3])
+static void real_drift_particle(int i, inttime_t ti1, const double ddrift, const double random_shift[3], const int update_key)
+{
+    if(!P[i].IsGarbage && P[i].Type == 0)
+        drift_sph_predict(i, ddrift);
+    drift_particle_position(i, ti1, ddrift, random_shift, update_key);
+}
+
+/* The part of the drift common to all particle types: moves the particle, wraps it and sets Ti_drift.
+ * This does not touch the gas slots, so drift_all_particles streams through P alone.*/
+static void
+drift_particle_position(int i, inttime_t ti1, const double ddrift, const double random_shift[3], const int update_key)
 {
     int j;
     if(P[i].IsGarbage) {
@@ -86,7 +102,7 @@ static void real_drift_particle(int i, inttime_t ti1, const double ddrift, const
     }
 
 #ifdef LIGHTCONE
-    lightcone_cross(i, oldpos);
+    lightcone_cross(i, oldpos, random_shift);
 #endif
 
     for(j = 0; j < 3; j ++) {
@@ -94,45 +110,47 @@ static void real_drift_particle(int i, inttime_t ti1, const double ddrift, const
         while(P[i].Pos[j] <= 0) P[i].Pos[j] += All.BoxSize;
     }
     /* avoid recomputing them during layout and force tree build.*/
-    P[i].Key = PEANO(P[i].Pos, All.BoxSize);
+    if(update_key)
+        P[i].Key = PEANO(P[i].Pos, All.BoxSize);
 
-    if(P[i].Type == 0)
-    {
-        /* This accounts for adiabatic density changes,
-         * and is a good predictor for most of the gas.*/
-        double densdriftfac = exp(-SPHP(i).DivVel * ddrift);
-        SPHP(i).Density *= densdriftfac;
-        if(All.DensityIndependentSphOn)
-            SPHP(i).EgyWtDensity *= densdriftfac;
-
-        //      P[i].Hsml *= exp(0.333333333333 * SPHP(i).DivVel * ddrift);
-        //---This was added
-        double fac = exp(0.333333333333 * SPHP(i).DivVel * ddrift);
-        if(fac > 1.25)
-            fac = 1.25;
-        P[i].Hsml *= fac;
-        if(P[i].Hsml > MAXHSML)
-        {
-            message(1, "warning: we reached Hsml=%g for ID=%lu\n", P[i].Hsml, P[i].ID);
-            P[i].Hsml = MAXHSML;
-        }
-        //---This was added
+    P[i].Ti_drift = ti1;
+}
 
-        if(P[i].Hsml < All.MinGasHsml)
-            P[i].Hsml = All.MinGasHsml;
+/* Predict the density and smoothing length of a gas particle over a drift by ddrift.
+ * This accounts for adiabatic density changes, and is a good predictor for most of the gas.*/
+static void
+drift_sph_predict(int i, const double ddrift)
+{
+    double densdriftfac = exp(-SPHP(i).DivVel * ddrift);
+    SPHP(i).Density *= densdriftfac;
+    if(All.DensityIndependentSphOn)
+        SPHP(i).EgyWtDensity *= densdriftfac;
+
+    //      P[i].Hsml *= exp(0.333333333333 * SPHP(i).DivVel * ddrift);
+    //---This was added
+    double fac = exp(0.333333333333 * SPHP(i).DivVel * ddrift);
+    if(fac > 1.25)
+        fac = 1.25;
+    P[i].Hsml *= fac;
+    if(P[i].Hsml > MAXHSML)
+    {
+        message(1, "warning: we reached Hsml=%g for ID=%lu\n", P[i].Hsml, P[i].ID);
+        P[i].Hsml = MAXHSML;
     }
+    //---This was added
 
-    P[i].Ti_drift = ti1;
+    if(P[i].Hsml < All.MinGasHsml)
+        P[i].Hsml = All.MinGasHsml;
 }
 
 /* Update all particles to the current time, shifting them by a random vector.*/
-void drift_all_particles(inttime_t ti1, const double random_shift[3])
+void drift_all_particles(inttime_t ti1, const double random_shift[3], const int update_keys)
 {
     int i;
     walltime_measure("/Misc");
 
     const inttime_t ti0 = P[0].Ti_drift;
-    const double ddrift = get_exact_drift_factor(&All.CP, ti0, ti1);
+    const double ddrift = get_drift_factor(ti0, ti1);
 
 #pragma omp parallel for
     for(i = 0; i < PartManager->NumPart; i++) {
@@ -142,8 +160,32 @@ void drift_all_particles(inttime_t ti1, const double random_shift[3])
 #endif
         if(P[i].Swallowed)
             continue;
-        real_drift_particle(i, ti1, ddrift, random_shift);
+        drift_particle_position(i, ti1, ddrift, random_shift, 0);
+    }
+
+    /* The keys are computed in bulk once all particles have moved. Swallowed particles do not move,
+     * so their keys do not change.*/
+    if(update_keys)
+        peano_hilbert_keys(P[0].Pos, sizeof(P[0]), &P[0].Key, sizeof(P[0]), PartManager->NumPart, All.BoxSize);
+
+    /* The gas predictions are a separate pass, so the loop above does not
+     * branch on type or chase P[i].PI. slots_gc_sorted keeps the gas slots
+     * in particle order, so this pass reads SphP in sequence.*/
+#pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].Type != 0 || P[i].IsGarbage || P[i].Swallowed)
+            continue;
+        drift_sph_predict(i, ddrift);
     }
 
     walltime_measure("/Drift/All");
 }
+
+/* Recompute the peano keys of all particles, after a drift that did not.
+ * The keys of garbage and swallowed particles are recomputed too: this is harmless,
+ * as they have not moved, and keeps the loop free of branches.*/
+void drift_update_keys(void)
+{
+    peano_hilbert_keys(P[0].Pos, sizeof(P[0]), &P[0].Key, sizeof(P[0]), PartManager->NumPart, All.BoxSize);
+    walltime_measure("/Drift/Keys");
+}
@@ -1,7 +1,12 @@
 #ifndef __DRIFT_H
 #define __DRIFT_H
 
-/* Updates all particles to the current drift time*/
-void drift_all_particles(inttime_t ti1, const double random_shift[3]);
+/* Updates all particles to the current drift time.
+ * If update_keys is 0 the peano keys are stale: call drift_update_keys
+ * before the next domain exchange or tree build.*/
+void drift_all_particles(inttime_t ti1, const double random_shift[3], const int update_keys);
+
+/* Recompute the peano keys of all particles from their positions*/
+void drift_update_keys(void);
 
 #endif
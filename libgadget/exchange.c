@@ -1,6 +1,7 @@
 #include <mpi.h>
 #include <omp.h>
 #include <string.h>
+#include <stddef.h>
 #include "exchange.h"
 #include "slotsmanager.h"
 #include "partmanager.h"
@@ -16,6 +17,10 @@ typedef struct {
 } ExchangePlanEntry;
 
 static MPI_Datatype MPI_TYPE_PLAN_ENTRY = 0;
+/* A particle without the fields the receiver does not need: PI, which is set on arrival,
+ * and the union of transients, which is recomputed before it is next read.
+ * The extent is that of a particle, so it is sent from and received into a particle array.*/
+static MPI_Datatype MPI_TYPE_PARTICLE_NOTRANSIENT = 0;
 
 /*Small bitfield struct to cache the layout function and particle data*/
 typedef struct {
@@ -47,8 +52,10 @@ typedef struct {
  * exchange particles according to layoutfunc.
  * layoutfunc gives the target task of particle p.
 */
-static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
-static void domain_build_plan(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman);
+static int domain_exchange_once(ExchangePlan * plan, int do_gc, int transients, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
+static int domain_exchange_fits(const ExchangePlan * plan, const struct part_manager_type * pman, const struct slots_manager_type * sman, MPI_Comm Comm);
+static int domain_exchange_stream(ExchangePlan * plan, int do_gc, int transients, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
+static void domain_build_plan(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman, MPI_Comm Comm);
 static int domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pman, const struct slots_manager_type * sman);
 static void domain_build_exchange_list(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman, MPI_Comm Comm);
 
@@ -72,8 +79,10 @@ _transpose_plan_entries(ExchangePlanEntry * entries, int * count, int ptype, int
     }
 }
 
-/*Plan and execute a domain exchange, also performing a garbage collection if requested*/
-int domain_exchange(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm) {
+/*Plan and execute a domain exchange, also performing a garbage collection if requested.
+ * If transients is 0, the transient union (NumNgb, RegionInd, GrNr) is not sent and is zero
+ * for the received particles. This is safe for the domain exchanges, but not when sorting FOF groups.*/
+int domain_exchange(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, int do_gc, int transients, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm) {
     int64_t sumtogo;
     int failure = 0;
 
@@ -82,6 +91,16 @@ int domain_exchange(ExchangeLayoutFunc layoutfunc, const void * layout_userdata,
         MPI_Type_contiguous(sizeof(ExchangePlanEntry), MPI_BYTE, &MPI_TYPE_PLAN_ENTRY);
         MPI_Type_commit(&MPI_TYPE_PLAN_ENTRY);
     }
+    if (MPI_TYPE_PARTICLE_NOTRANSIENT == 0) {
+        int blocklens[2] = {offsetof(struct particle_data, PI),
+            offsetof(struct particle_data, GrNr) - offsetof(struct particle_data, FOFHint)};
+        MPI_Aint displs[2] = {0, offsetof(struct particle_data, FOFHint)};
+        MPI_Datatype packed;
+        MPI_Type_create_hindexed(2, blocklens, displs, MPI_BYTE, &packed);
+        MPI_Type_create_resized(packed, 0, sizeof(struct particle_data), &MPI_TYPE_PARTICLE_NOTRANSIENT);
+        MPI_Type_free(&packed);
+        MPI_Type_commit(&MPI_TYPE_PARTICLE_NOTRANSIENT);
+    }
 
     /*Structure for building a list of particles that will be exchanged*/
     ExchangePlan plan;
@@ -113,12 +132,32 @@ int domain_exchange(ExchangeLayoutFunc layoutfunc, const void * layout_userdata,
         }
 
         /* determine for each rank how many particles have to be shifted to other ranks */
-        plan.last = domain_find_iter_space(&plan, pman, sman);
-        domain_build_plan(layoutfunc, layout_userdata, &plan, pman);
+        plan.last = plan.nexchange;
+        domain_build_plan(layoutfunc, layout_userdata, &plan, pman, Comm);
         walltime_measure("/Domain/exchange/togo");
 
         sumup_large_ints(1, &plan.toGoSum.base, &sumtogo);
 
+        /* If the particles we receive fit after the ones we have, stream the whole
+         * exchange through fixed size buffers, with no garbage collection until the end.*/
+        if(domain_exchange_fits(&plan, pman, sman, Comm)) {
+            message(0, "iter=%d streaming exchange of %013ld particles\n", iter, sumtogo);
+            failure = domain_exchange_stream(&plan, do_gc, transients, pman, sman, Comm);
+            myfree(plan.layouts);
+            myfree(plan.ExchangeList);
+            break;
+        }
+
+        /* Otherwise exchange as many particles as there is free memory for,
+         * and collect the garbage before the next batch.*/
+        const int last = domain_find_iter_space(&plan, pman, sman);
+        if(MPIU_Any(last < plan.nexchange, Comm)) {
+            myfree(plan.layouts);
+            plan.last = last;
+            domain_build_plan(layoutfunc, layout_userdata, &plan, pman, Comm);
+            sumup_large_ints(1, &plan.toGoSum.base, &sumtogo);
+        }
+
         message(0, "iter=%d exchange of %013ld particles\n", iter, sumtogo);
 
         /* Do a GC if we are asked to or if this isn't the last iteration.
@@ -126,8 +165,9 @@ int domain_exchange(ExchangeLayoutFunc layoutfunc, const void * layout_userdata,
          * and a gc will also be done if we have no space for particles.*/
         int really_do_gc = do_gc || (plan.last < plan.nexchange);
 
-        failure = domain_exchange_once(&plan, really_do_gc, pman, sman, Comm);
+        failure = domain_exchange_once(&plan, really_do_gc, transients, pman, sman, Comm);
 
+        myfree(plan.layouts);
         myfree(plan.ExchangeList);
 
         if(failure)
@@ -163,7 +203,55 @@ shall_we_compact_slots(int * compact, ExchangePlan * plan, const struct slots_ma
     MPI_Allreduce(lcompact, compact, 6, MPI_INT, MPI_LOR, Comm);
 }
 
-static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm)
+/* Set the slot index of the particles received at the end of the particle table and check them
+ * against the slots received at the end of the slot arrays. NumPart and the slot sizes are not yet updated.*/
+static void
+domain_exchange_unpack(ExchangePlan * plan, int transients, struct part_manager_type * pman, struct slots_manager_type * sman)
+{
+    int ptype;
+    int src;
+    /* Each source has its own range of particles and slots*/
+    #pragma omp parallel for schedule(dynamic) private(ptype)
+    for(src = 0; src < plan->NTask; src++) {
+        /* unpack each source rank */
+        int newPI[6];
+        int i;
+        for(ptype = 0; ptype < 6; ptype ++) {
+            newPI[ptype] = sman->info[ptype].size + plan->toGetOffset[src].slots[ptype];
+        }
+
+        for(i = pman->NumPart + plan->toGetOffset[src].base;
+            i < pman->NumPart + plan->toGetOffset[src].base + plan->toGet[src].base;
+            i++) {
+
+            int ptype = pman->Base[i].Type;
+
+            /* Not sent: the union overlaps whatever was in this memory before*/
+            if(!transients)
+                pman->Base[i].GrNr = 0;
+
+            pman->Base[i].PI = newPI[ptype];
+
+            newPI[ptype]++;
+
+            if(!sman->info[ptype].enabled) continue;
+
+            int PI = pman->Base[i].PI;
+            if(BASESLOT_PI(PI, ptype, sman)->ID != pman->Base[i].ID) {
+                endrun(1, "Exchange: P[%d].ID = %ld (type %d) != SLOT ID = %ld. garbage: %d ReverseLink: %d\n",i,pman->Base[i].ID, pman->Base[i].Type, BASESLOT_PI(PI, ptype, sman)->ID, pman->Base[i].IsGarbage, BASESLOT_PI(PI, ptype, sman)->ReverseLink);
+            }
+        }
+        for(ptype = 0; ptype < 6; ptype ++) {
+            if(newPI[ptype] !=
+                sman->info[ptype].size + plan->toGetOffset[src].slots[ptype]
+              + plan->toGet[src].slots[ptype]) {
+                endrun(1, "N_slots mismatched\n");
+            }
+        }
+    }
+}
+
+static int domain_exchange_once(ExchangePlan * plan, int do_gc, int transients, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm)
 {
     int n, ptype;
     struct particle_data *partBuf;
@@ -188,29 +276,32 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
     ExchangePlanEntry * toGoPtr = ta_malloc("toGoPtr", ExchangePlanEntry, plan->NTask);
     memset(toGoPtr, 0, sizeof(toGoPtr[0]) * plan->NTask);
 
+    /* Position of each particle in partBuf and of its slot in slotBuf.
+     * Finding them is a cheap serial pass, so that the copies can be threaded.*/
+    int * bufpos = (int *) mymalloc2("bufpos", 2 * plan->last * sizeof(int));
     for(n = 0; n < plan->last; n++)
     {
-        const int i = plan->ExchangeList[n];
-        /* preparing for export */
         const int target = plan->layouts[n].target;
+        const int type = plan->layouts[n].ptype;
+        bufpos[2 * n] = plan->toGoOffset[target].base + toGoPtr[target].base++;
+        bufpos[2 * n + 1] = plan->toGoOffset[target].slots[type] + toGoPtr[target].slots[type]++;
+    }
 
-        int type = plan->layouts[n].ptype;
-
-        /* watch out thread unsafe */
-        int bufPI = toGoPtr[target].slots[type];
-        toGoPtr[target].slots[type] ++;
-        size_t elsize = sman->info[type].elsize;
+    #pragma omp parallel for
+    for(n = 0; n < plan->last; n++)
+    {
+        const int i = plan->ExchangeList[n];
+        const int type = plan->layouts[n].ptype;
+        const size_t elsize = sman->info[type].elsize;
         if(sman->info[type].enabled)
-            memcpy(slotBuf[type] + (bufPI + plan->toGoOffset[target].slots[type]) * elsize,
+            memcpy(slotBuf[type] + bufpos[2 * n + 1] * elsize,
                 (char*) sman->info[type].ptr + pman->Base[i].PI * elsize, elsize);
-        /* now copy the base P; after PI has been updated */
-        partBuf[plan->toGoOffset[target].base + toGoPtr[target].base] = pman->Base[i];
-        toGoPtr[target].base ++;
+        partBuf[bufpos[2 * n]] = pman->Base[i];
         /* mark the particle for removal. Both secondary and base slots will be marked. */
         slots_mark_garbage(i, pman, sman);
     }
 
-    myfree(plan->layouts);
+    myfree(bufpos);
     ta_free(toGoPtr);
     walltime_measure("/Domain/exchange/makebuf");
 
@@ -251,9 +342,10 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
     _transpose_plan_entries(plan->toGet, recvcounts, -1, plan->NTask);
     _transpose_plan_entries(plan->toGetOffset, recvdispls, -1, plan->NTask);
 
+    MPI_Datatype parttype = transients ? MPI_TYPE_PARTICLE : MPI_TYPE_PARTICLE_NOTRANSIENT;
     /* recv at the end */
-    MPI_Alltoallv_sparse(partBuf, sendcounts, senddispls, MPI_TYPE_PARTICLE,
-                 pman->Base + pman->NumPart, recvcounts, recvdispls, MPI_TYPE_PARTICLE,
+    MPI_Alltoallv_sparse(partBuf, sendcounts, senddispls, parttype,
+                 pman->Base + pman->NumPart, recvcounts, recvdispls, parttype,
                  Comm);
 
     for(ptype = 0; ptype < 6; ptype ++) {
@@ -275,41 +367,7 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
                      Comm);
     }
 
-    int src;
-    for(src = 0; src < plan->NTask; src++) {
-        /* unpack each source rank */
-        int newPI[6];
-        int i;
-        for(ptype = 0; ptype < 6; ptype ++) {
-            newPI[ptype] = sman->info[ptype].size + plan->toGetOffset[src].slots[ptype];
-        }
-
-        for(i = pman->NumPart + plan->toGetOffset[src].base;
-            i < pman->NumPart + plan->toGetOffset[src].base + plan->toGet[src].base;
-            i++) {
-
-            int ptype = pman->Base[i].Type;
-
-
-            pman->Base[i].PI = newPI[ptype];
-
-            newPI[ptype]++;
-
-            if(!sman->info[ptype].enabled) continue;
-
-            int PI = pman->Base[i].PI;
-            if(BASESLOT_PI(PI, ptype, sman)->ID != pman->Base[i].ID) {
-                endrun(1, "Exchange: P[%d].ID = %ld (type %d) != SLOT ID = %ld. garbage: %d ReverseLink: %d\n",i,pman->Base[i].ID, pman->Base[i].Type, BASESLOT_PI(PI, ptype, sman)->ID, pman->Base[i].IsGarbage, BASESLOT_PI(PI, ptype, sman)->ReverseLink);
-            }
-        }
-        for(ptype = 0; ptype < 6; ptype ++) {
-            if(newPI[ptype] !=
-                sman->info[ptype].size + plan->toGetOffset[src].slots[ptype]
-              + plan->toGet[src].slots[ptype]) {
-                endrun(1, "N_slots mismatched\n");
-            }
-        }
-    }
+    domain_exchange_unpack(plan, transients, pman, sman);
 
     walltime_measure("/Domain/exchange/alltoall");
 
@@ -339,6 +397,323 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
     return 0;
 }
 
+/* Largest send buffer of the streaming exchange, in bytes. There are two,
+ * so that one is packed while the other is being sent.*/
+#ifndef EXCHANGE_CHUNK_BYTES
+#define EXCHANGE_CHUNK_BYTES (64L * 1024L * 1024L)
+#endif
+
+/* Tag of the particle messages. The slots of type ptype use EXCHANGE_TAG + 1 + ptype.*/
+#define EXCHANGE_TAG 101950
+
+/* The messages from one task, of particles or of the slots of one type. They arrive in order,
+ * and go one after the other to the place the plan gives them at the end of the particle or slot array.*/
+typedef struct {
+    char * ptr;
+    int remaining;
+    int source;
+    int tag;
+    MPI_Datatype type;
+    size_t elsize;
+} ExchangeRecvStream;
+
+typedef struct {
+    ExchangeRecvStream * streams;
+    int nstream;
+    /* Number of streams still receiving*/
+    int nactive;
+    /* The receives of the streams, followed by the sends being waited for*/
+    MPI_Request * requests;
+    MPI_Status * statuses;
+    int * indices;
+    MPI_Comm Comm;
+} ExchangeRecv;
+
+/* A send buffer of the streaming exchange and the sends from it which are in flight*/
+typedef struct {
+    struct particle_data * part;
+    char * slots[6];
+    MPI_Request * requests;
+    int nrequests;
+} ExchangeSendBuf;
+
+/* Bytes of send buffer per particle in a chunk: the particle, a slot of every type, the position
+ * of its slot and the sends, at worst one for the particle and one for its slot.*/
+static size_t
+exchange_stream_package(const struct slots_manager_type * sman)
+{
+    size_t package = sizeof(struct particle_data) + sizeof(int) + 2 * sizeof(MPI_Request);
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!sman->info[ptype].enabled) continue;
+        package += sman->info[ptype].elsize;
+    }
+    return package;
+}
+
+/* Memory for the receive streams from NTask tasks*/
+static size_t
+exchange_stream_recv_bytes(const int NTask)
+{
+    return 7L * NTask * (sizeof(ExchangeRecvStream) + sizeof(MPI_Request) + sizeof(MPI_Status) + sizeof(int));
+}
+
+/* Whether the particles and slots this task receives fit after the ones it has,
+ * leaving memory for the streaming exchange. Collective.*/
+static int
+domain_exchange_fits(const ExchangePlan * plan, const struct part_manager_type * pman, const struct slots_manager_type * sman, MPI_Comm Comm)
+{
+    int fits = pman->NumPart + plan->toGetSum.base <= pman->MaxPart;
+
+    /* The slots grow as in slots_reserve*/
+    int add = sman->increase;
+    if (add < 128) add = 128;
+    size_t needed = 0;
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!sman->info[ptype].enabled) continue;
+        const int64_t want = (int64_t) sman->info[ptype].size + plan->toGetSum.slots[ptype];
+        if(sman->info[ptype].maxsize <= want + add / 2)
+            needed += (want + add - sman->info[ptype].maxsize) * sman->info[ptype].elsize;
+    }
+    /* The send order, the receive streams, one particle in each send buffer and the block headers*/
+    needed += plan->last * sizeof(int) + exchange_stream_recv_bytes(plan->NTask)
+        + 2 * exchange_stream_package(sman) + 4096 * 40;
+    fits = fits && needed < mymalloc_freebytes();
+
+    return !MPIU_Any(!fits, Comm);
+}
+
+/* Start receiving count elements from source into ptr*/
+static void
+exchange_recv_add(ExchangeRecv * recv, char * ptr, int count, int source, int tag, MPI_Datatype type, size_t elsize)
+{
+    ExchangeRecvStream * s = &recv->streams[recv->nstream];
+    s->ptr = ptr;
+    s->remaining = count;
+    s->source = source;
+    s->tag = tag;
+    s->type = type;
+    s->elsize = elsize;
+    MPI_Irecv(s->ptr, s->remaining, s->type, s->source, s->tag, recv->Comm, &recv->requests[recv->nstream]);
+    recv->nstream++;
+    recv->nactive++;
+}
+
+/* Wait until the sends from sb are done or, if sb is NULL, until every stream has received all its data.
+ * A stream receives its next message as soon as the last one arrives, so that every task is
+ * receiving while it waits for its own sends to complete.*/
+static void
+exchange_stream_progress(ExchangeRecv * recv, ExchangeSendBuf * sb)
+{
+    const int nsend = sb ? sb->nrequests : 0;
+    if(nsend > 0)
+        memcpy(recv->requests + recv->nstream, sb->requests, nsend * sizeof(MPI_Request));
+    int sending = nsend;
+
+    while(sb ? sending > 0 : recv->nactive > 0) {
+        int k, outcount;
+        MPI_Waitsome(recv->nstream + nsend, recv->requests, &outcount, recv->indices, recv->statuses);
+        for(k = 0; k < outcount; k++) {
+            const int j = recv->indices[k];
+            if(j >= recv->nstream) {
+                sending--;
+                continue;
+            }
+            ExchangeRecvStream * s = &recv->streams[j];
+            int count;
+            MPI_Get_count(&recv->statuses[k], s->type, &count);
+            s->ptr += count * s->elsize;
+            s->remaining -= count;
+            if(s->remaining > 0)
+                MPI_Irecv(s->ptr, s->remaining, s->type, s->source, s->tag, recv->Comm, &recv->requests[j]);
+            else
+                recv->nactive--;
+        }
+    }
+    if(sb)
+        sb->nrequests = 0;
+}
+
+/* Exchange all the particles of the plan, which domain_exchange_fits says fit after the particles we have.
+ * The exported particles are packed in chunks, in order of target, into two fixed size buffers
+ * which take turns: one is packed while the sends from the other are in flight. The particles
+ * and slots are received directly at the end of the particle and slot arrays, where the
+ * plan places them, so there is no garbage collection until the end.*/
+static int
+domain_exchange_stream(ExchangePlan * plan, int do_gc, int transients, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm)
+{
+    int ThisTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    int n, ptype, b, src;
+
+    /* Reserve the slots first: this may move them, and the receives go straight into them.*/
+    int newSlots[6] = {0};
+    for(ptype = 0; ptype < 6; ptype ++) {
+        if(!sman->info[ptype].enabled) continue;
+        newSlots[ptype] = sman->info[ptype].size + plan->toGetSum.slots[ptype];
+    }
+    slots_reserve(1, newSlots, sman);
+
+    /* Order the exports by target, starting after this task, so that the tasks do not all send to the same one first*/
+    int * order = (int *) mymalloc2("exchangeorder", plan->last * sizeof(int));
+    int * targetpos = ta_malloc("targetpos", int, plan->NTask);
+    int pos = 0;
+    for(n = 1; n <= plan->NTask; n++) {
+        const int target = (ThisTask + n) % plan->NTask;
+        targetpos[target] = pos;
+        pos += plan->toGo[target].base;
+    }
+    for(n = 0; n < plan->last; n++)
+        order[targetpos[plan->layouts[n].target]++] = n;
+    ta_free(targetpos);
+
+    int nstream = 0;
+    for(src = 0; src < plan->NTask; src++) {
+        nstream += plan->toGet[src].base > 0;
+        for(ptype = 0; ptype < 6; ptype++)
+            nstream += sman->info[ptype].enabled && plan->toGet[src].slots[ptype] > 0;
+    }
+
+    /* Particles per chunk: a fixed size, unless there is not enough free memory for two buffers*/
+    const size_t package = exchange_stream_package(sman);
+    const size_t recvbytes = exchange_stream_recv_bytes(plan->NTask) + 4096 * 32;
+    const size_t freebytes = mymalloc_freebytes();
+    int64_t chunk = EXCHANGE_CHUNK_BYTES / package;
+    if(freebytes < recvbytes + 2 * package * chunk)
+        chunk = freebytes > recvbytes + 2 * package ? (freebytes - recvbytes) / (2 * package) : 1;
+    if(chunk > plan->last)
+        chunk = plan->last;
+    if(chunk < 1)
+        chunk = 1;
+    /* A message for the particles and one for each slot type, for each target in the chunk*/
+    const int maxsend = 7 * (chunk < plan->NTask ? chunk : plan->NTask);
+
+    ExchangeSendBuf buf[2];
+    for(b = 0; b < 2; b++) {
+        buf[b].part = (struct particle_data *) mymalloc2("ExchangePartBuf", chunk * sizeof(struct particle_data));
+        for(ptype = 0; ptype < 6; ptype++) {
+            buf[b].slots[ptype] = NULL;
+            if(!sman->info[ptype].enabled) continue;
+            const int64_t nslots = chunk < plan->toGoSum.slots[ptype] ? chunk : plan->toGoSum.slots[ptype];
+            buf[b].slots[ptype] = (char *) mymalloc2("ExchangeSlotBuf", nslots * sman->info[ptype].elsize);
+        }
+        buf[b].requests = (MPI_Request *) mymalloc2("ExchangeSendReq", maxsend * sizeof(MPI_Request));
+        buf[b].nrequests = 0;
+    }
+    int * slotpos = (int *) mymalloc2("ExchangeSlotPos", chunk * sizeof(int));
+
+    ExchangeRecv recv[1];
+    recv->nstream = 0;
+    recv->nactive = 0;
+    recv->Comm = Comm;
+    recv->streams = (ExchangeRecvStream *) mymalloc2("ExchangeStreams", nstream * sizeof(ExchangeRecvStream));
+    recv->requests = (MPI_Request *) mymalloc2("ExchangeRequests", (nstream + maxsend) * sizeof(MPI_Request));
+    recv->statuses = (MPI_Status *) mymalloc2("ExchangeStatuses", (nstream + maxsend) * sizeof(MPI_Status));
+    recv->indices = (int *) mymalloc2("ExchangeIndices", (nstream + maxsend) * sizeof(int));
+
+    MPI_Datatype parttype = transients ? MPI_TYPE_PARTICLE : MPI_TYPE_PARTICLE_NOTRANSIENT;
+    for(src = 0; src < plan->NTask; src++) {
+        if(plan->toGet[src].base > 0)
+            exchange_recv_add(recv, (char *) (pman->Base + pman->NumPart + plan->toGetOffset[src].base),
+                    plan->toGet[src].base, src, EXCHANGE_TAG, parttype, sizeof(struct particle_data));
+        for(ptype = 0; ptype < 6; ptype++) {
+            if(!sman->info[ptype].enabled || plan->toGet[src].slots[ptype] == 0) continue;
+            const size_t elsize = sman->info[ptype].elsize;
+            exchange_recv_add(recv, sman->info[ptype].ptr + (sman->info[ptype].size + plan->toGetOffset[src].slots[ptype]) * elsize,
+                    plan->toGet[src].slots[ptype], src, EXCHANGE_TAG + 1 + ptype, MPI_TYPE_SLOT[ptype], elsize);
+        }
+    }
+    walltime_measure("/Domain/exchange/init");
+
+    int64_t start;
+    int ichunk;
+    for(start = 0, ichunk = 0; start < plan->last; start += chunk, ichunk++) {
+        ExchangeSendBuf * sb = &buf[ichunk % 2];
+        const int end = start + chunk < plan->last ? start + chunk : plan->last;
+        /* The buffer is free once the sends of two chunks ago are done*/
+        exchange_stream_progress(recv, sb);
+
+        int count[6] = {0};
+        for(n = start; n < end; n++)
+            slotpos[n - start] = count[plan->layouts[order[n]].ptype]++;
+
+        #pragma omp parallel for
+        for(n = start; n < end; n++) {
+            const int i = plan->ExchangeList[order[n]];
+            const int type = plan->layouts[order[n]].ptype;
+            const size_t elsize = sman->info[type].elsize;
+            if(sman->info[type].enabled)
+                memcpy(sb->slots[type] + slotpos[n - start] * elsize,
+                    (char*) sman->info[type].ptr + pman->Base[i].PI * elsize, elsize);
+            sb->part[n - start] = pman->Base[i];
+            /* mark the particle for removal. Both secondary and base slots will be marked. */
+            slots_mark_garbage(i, pman, sman);
+        }
+
+        /* One message to each target for the particles, and one for each type of slot*/
+        memset(count, 0, sizeof(count));
+        for(n = start; n < end; ) {
+            const int target = plan->layouts[order[n]].target;
+            int first[6];
+            memcpy(first, count, sizeof(count));
+            int m;
+            for(m = n; m < end && plan->layouts[order[m]].target == target; m++)
+                count[plan->layouts[order[m]].ptype]++;
+            MPI_Isend(sb->part + (n - start), m - n, parttype, target, EXCHANGE_TAG, Comm, &sb->requests[sb->nrequests++]);
+            for(ptype = 0; ptype < 6; ptype++) {
+                if(!sman->info[ptype].enabled || count[ptype] == first[ptype]) continue;
+                MPI_Isend(sb->slots[ptype] + first[ptype] * sman->info[ptype].elsize, count[ptype] - first[ptype],
+                        MPI_TYPE_SLOT[ptype], target, EXCHANGE_TAG + 1 + ptype, Comm, &sb->requests[sb->nrequests++]);
+            }
+            n = m;
+        }
+    }
+    for(b = 0; b < 2; b++)
+        exchange_stream_progress(recv, &buf[b]);
+    exchange_stream_progress(recv, NULL);
+
+    myfree(recv->indices);
+    myfree(recv->statuses);
+    myfree(recv->requests);
+    myfree(recv->streams);
+    myfree(slotpos);
+    for(b = 1; b >= 0; b--) {
+        myfree(buf[b].requests);
+        for(ptype = 5; ptype >= 0; ptype--) {
+            if(!sman->info[ptype].enabled) continue;
+            myfree(buf[b].slots[ptype]);
+        }
+        myfree(buf[b].part);
+    }
+    myfree(order);
+    walltime_measure("/Domain/exchange/stream");
+
+    domain_exchange_unpack(plan, transients, pman, sman);
+
+    pman->NumPart += plan->toGetSum.base;
+    for(ptype = 0; ptype < 6; ptype++) {
+        if(!sman->info[ptype].enabled) continue;
+        sman->info[ptype].size = newSlots[ptype];
+    }
+    walltime_measure("/Domain/exchange/finalize");
+
+    /* The exported particles are garbage now*/
+    if(MPIU_Any(do_gc, Comm)) {
+        int compact[6] = {0};
+        shall_we_compact_slots(compact, plan, sman, Comm);
+        slots_gc(compact, pman, sman);
+        walltime_measure("/Domain/exchange/garbage");
+    }
+
+#ifdef DEBUG
+    domain_test_id_uniqueness(pman);
+    slots_check_id_consistency(pman, sman);
+#endif
+
+    return 0;
+}
+
 /* This function builds the list of particles to be exchanged.
  * All particles are processed every time, space is not considered.
  * The exchange list needs to be rebuilt every time gc is run. */
@@ -437,13 +812,14 @@ domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pma
 
 /*This function populates the toGo and toGet arrays*/
 static void
-domain_build_plan(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman)
+domain_build_plan(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman, MPI_Comm Comm)
 {
     int ptype, n;
 
     memset(plan->toGo, 0, sizeof(plan->toGo[0]) * plan->NTask);
 
-    plan->layouts = mymalloc("layoutcache",sizeof(ExchangePartCache) * plan->last);
+    /* Above the slots, which the exchange may need to grow*/
+    plan->layouts = mymalloc2("layoutcache",sizeof(ExchangePartCache) * plan->last);
 
     #pragma omp parallel for
     for(n = 0; n < plan->last; n++)
@@ -463,7 +839,8 @@ domain_build_plan(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, E
         plan->toGo[plan->layouts[n].target].slots[plan->layouts[n].ptype]++;
     }
 
-    MPI_Alltoall(plan->toGo, 1, MPI_TYPE_PLAN_ENTRY, plan->toGet, 1, MPI_TYPE_PLAN_ENTRY, MPI_COMM_WORLD);
+    /* Particles mostly move to neighbouring domains, so only send the non-zero counts*/
+    MPI_Alltoall_sparse(plan->toGo, plan->toGet, MPI_TYPE_PLAN_ENTRY, Comm);
 
     memset(&plan->toGoOffset[0], 0, sizeof(plan->toGoOffset[0]));
     memset(&plan->toGetOffset[0], 0, sizeof(plan->toGetOffset[0]));
@@ -571,3 +948,96 @@ domain_test_id_uniqueness(struct part_manager_type * pman)
     myfree(ids);
 }
 
+/* Mix the bits of an ID, so that neighbouring IDs go to different tasks. The splitmix64 finaliser.*/
+static inline uint64_t
+id_hash(MyIDType id)
+{
+    uint64_t h = id;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static int
+order_by_id(const void * a, const void * b)
+{
+    const MyIDType ida = *(const MyIDType *) a;
+    const MyIDType idb = *(const MyIDType *) b;
+    return (ida > idb) - (ida < idb);
+}
+
+int64_t
+domain_check_id_uniqueness(struct part_manager_type * pman, int sample, MPI_Comm Comm)
+{
+    /* The class checked this time: calls are collective, so it is the same on every task*/
+    static int phase = 0;
+    int NTask, ThisTask;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+    int i;
+
+    if(sample < 1)
+        sample = 1;
+    const uint64_t hashclass = phase++ % sample;
+
+    /* The low bits of the hash give the task, the high bits the class*/
+    int * sendcount = ta_malloc("sendcount", int, 4 * NTask);
+    int * senddispl = sendcount + NTask;
+    int * recvcount = sendcount + 2 * NTask;
+    int * recvdispl = sendcount + 3 * NTask;
+    memset(sendcount, 0, NTask * sizeof(int));
+    for(i = 0; i < pman->NumPart; i++) {
+        if(pman->Base[i].IsGarbage)
+            continue;
+        const uint64_t h = id_hash(pman->Base[i].ID);
+        if((h >> 32) % sample != hashclass)
+            continue;
+        sendcount[(h & 0xffffffffu) % NTask]++;
+    }
+    MPI_Alltoall(sendcount, 1, MPI_INT, recvcount, 1, MPI_INT, Comm);
+    int nsend = 0, nrecv = 0;
+    for(i = 0; i < NTask; i++) {
+        senddispl[i] = nsend;
+        recvdispl[i] = nrecv;
+        nsend += sendcount[i];
+        nrecv += recvcount[i];
+    }
+
+    MyIDType * recvids = (MyIDType *) mymalloc("recvids", nrecv * sizeof(MyIDType));
+    MyIDType * sendids = (MyIDType *) mymalloc("sendids", nsend * sizeof(MyIDType));
+    /* Fill the send buffer with senddispl, which then points to the end of each block*/
+    for(i = 0; i < pman->NumPart; i++) {
+        if(pman->Base[i].IsGarbage)
+            continue;
+        const uint64_t h = id_hash(pman->Base[i].ID);
+        if((h >> 32) % sample != hashclass)
+            continue;
+        sendids[senddispl[(h & 0xffffffffu) % NTask]++] = pman->Base[i].ID;
+    }
+    for(i = 0; i < NTask; i++)
+        senddispl[i] -= sendcount[i];
+
+    MPI_Datatype MPI_TYPE_ID;
+    MPI_Type_contiguous(sizeof(MyIDType), MPI_BYTE, &MPI_TYPE_ID);
+    MPI_Type_commit(&MPI_TYPE_ID);
+    MPI_Alltoallv_smart(sendids, sendcount, senddispl, MPI_TYPE_ID,
+            recvids, recvcount, recvdispl, MPI_TYPE_ID, Comm);
+    MPI_Type_free(&MPI_TYPE_ID);
+    myfree(sendids);
+
+    /* Every copy of an ID is now on the same task*/
+    qsort_openmp(recvids, nrecv, sizeof(MyIDType), order_by_id);
+    int64_t nduplicate = 0;
+    for(i = 1; i < nrecv; i++) {
+        if(recvids[i] != recvids[i - 1])
+            continue;
+        if(nduplicate == 0)
+            message(1, "non-unique ID=%013ld found on task=%d\n", recvids[i], ThisTask);
+        nduplicate++;
+    }
+    myfree(recvids);
+    ta_free(sendcount);
+
+    MPI_Allreduce(MPI_IN_PLACE, &nduplicate, 1, MPI_INT64, MPI_SUM, Comm);
+    return nduplicate;
+}
@@ -6,7 +6,13 @@
 
 typedef int (*ExchangeLayoutFunc) (int p, const void * userdata);
 
-int domain_exchange(ExchangeLayoutFunc, const void * layout_userdata, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
+int domain_exchange(ExchangeLayoutFunc, const void * layout_userdata, int do_gc, int transients, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
 void domain_test_id_uniqueness(struct part_manager_type * pman);
 
+/* Check that the particle IDs are unique with a hash of the IDs and one exchange, which is much cheaper
+ * than the sort of domain_test_id_uniqueness. If sample > 1, only the IDs in one of sample classes
+ * of the hash are checked, a different class each call, so all IDs are checked every sample calls.
+ * Collective. Returns the total number of duplicate IDs.*/
+int64_t domain_check_id_uniqueness(struct part_manager_type * pman, int sample, MPI_Comm Comm);
+
 #endif
@@ -19,6 +19,7 @@
 
 #include "forcetree.h"
 #include "treewalk.h"
+#include "treewalk_ngbiter.h"
 #include "slotsmanager.h"
 #include "partmanager.h"
 #include "densitykernel.h"
@@ -44,6 +45,12 @@ struct FOFParams
     double FOFHaloLinkingLength;
     double FOFHaloComovingLinkingLength; /* in code units */
     int FOFHaloMinLength;
+    /* Seed the links from the groups of the last call*/
+    int FOFIncremental;
+    /* Find the local links with a grid of linking length cells instead of the tree*/
+    int FOFGridLinking;
+    /* Linking length of the subhalos as a fraction of the halo linking length. 0 disables them.*/
+    double FOFSubhaloLinkingFraction;
 } fof_params;
 
 /*Set the parameters of the BH module*/
@@ -55,6 +62,9 @@ void set_fof_params(ParameterSet * ps)
         fof_params.FOFSaveParticles = param_get_int(ps, "FOFSaveParticles");
         fof_params.FOFHaloLinkingLength = param_get_double(ps, "FOFHaloLinkingLength");
         fof_params.FOFHaloMinLength = param_get_int(ps, "FOFHaloMinLength");
+        fof_params.FOFIncremental = param_get_int(ps, "FOFIncremental");
+        fof_params.FOFGridLinking = param_get_int(ps, "FOFGridLinking");
+        fof_params.FOFSubhaloLinkingFraction = param_get_double(ps, "FOFSubhaloLinkingFraction");
         fof_params.MinFoFMassForNewSeed = param_get_double(ps, "MinFoFMassForNewSeed");
     }
     MPI_Bcast(&fof_params, sizeof(struct FOFParams), MPI_BYTE, 0, MPI_COMM_WORLD);
@@ -94,12 +104,17 @@ static void fof_reduce_groups(
     void * groups,
     int nmemb,
     size_t elsize,
+    size_t commsize,
     void (*reduce_group)(void * gdst, void * gsrc), MPI_Comm Comm);
 
 static void fof_finish_group_properties(FOFGroups * fof, double BoxSize);
 
 static int fof_compile_base(struct BaseGroup * base, int NgroupsExt, MPI_Comm Comm);
-static void fof_compile_catalogue(FOFGroups * fof, const int NgroupsExt, double BoxSize, int BlackHoleInfo, MPI_Comm Comm);
+static void fof_compile_catalogue(FOFGroups * fof, const int NgroupsExt, double BoxSize, int BlackHoleInfo, const int64_t * Parent, MPI_Comm Comm);
+
+/* Size of the leading part of struct Group which holds the seeding fields.
+ * Only this part is computed and exchanged by fof_fof_seeding.*/
+#define FOF_SEED_GROUP_SIZE offsetof(struct Group, Vel)
 
 static struct Group *
 fof_alloc_group(const struct BaseGroup * base, const int NgroupsExt);
@@ -107,6 +122,7 @@ fof_alloc_group(const struct BaseGroup * base, const int NgroupsExt);
 static void fof_assign_grnr(struct BaseGroup * base, const int NgroupsExt, MPI_Comm Comm);
 
 void fof_label_primary(ForceTree * tree, MPI_Comm Comm);
+static void fof_label_primary_length(ForceTree * tree, const double LinkingLength, const int StoreHint, MPI_Comm Comm);
 extern void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Comm);
 
 typedef struct {
@@ -125,6 +141,8 @@ typedef struct {
 
 typedef struct {
     TreeWalkNgbIterBase base;
+    /* Exports of the thread before the walk of this particle, to tell whether it was exported*/
+    int64_t Nexported;
 } TreeWalkNgbIterFOF;
 
 static struct fof_particle_list
@@ -143,8 +161,80 @@ static MPI_Datatype MPI_TYPE_GROUP;
  *
  **/
 
-FOFGroups
-fof_fof(ForceTree * tree, double BoxSize, int BlackHoleInfo, MPI_Comm Comm)
+/* Turn the labels in HaloLabel into a catalogue of the groups above the minimum length,
+ * setting P[i].GrNr. Parent is NULL or the GrNr of the FOF group of each particle, see fof_find_subhalos.*/
+static void
+fof_build_catalogue(FOFGroups * fof, double BoxSize, int BlackHoleInfo, const int64_t * Parent, MPI_Comm Comm)
+{
+    int i;
+    /* sort HaloLabel according to MinID, because we need that for compiling catalogues */
+    qsort_openmp(HaloLabel, PartManager->NumPart, sizeof(struct fof_particle_list), fof_compare_HaloLabel_MinID);
+
+    int NgroupsExt = 0;
+
+    for(i = 0; i < PartManager->NumPart; i ++) {
+        if(i == 0 || HaloLabel[i].MinID != HaloLabel[i - 1].MinID) NgroupsExt ++;
+    }
+
+    /* The first round is to eliminate groups that are too short. */
+    /* We create the smaller 'BaseGroup' data set for this. */
+    struct BaseGroup * base = (struct BaseGroup *) mymalloc("BaseGroup", sizeof(struct BaseGroup) * NgroupsExt);
+
+    NgroupsExt = fof_compile_base(base, NgroupsExt, Comm);
+
+    MPIU_Barrier(Comm);
+    message(0, "Compiled local group data and catalogue.\n");
+
+    walltime_measure("/FOF/Compile");
+
+    fof_assign_grnr(base, NgroupsExt, Comm);
+
+    fof->Group = fof_alloc_group(base, NgroupsExt);
+
+    myfree(base);
+
+    fof_compile_catalogue(fof, NgroupsExt, BoxSize, BlackHoleInfo, Parent, Comm);
+}
+
+/* Find the subhalos of the FOF groups with a second FOF pass at a shorter linking length.
+ * Any two particles linked at the shorter length are also linked in the halo, so each
+ * subhalo lies inside one FOF group, whose GrNr is stored in ParentGrNr.
+ * The pass runs on the same tree and labels, and P[i].GrNr is left as the FOF group.*/
+static void
+fof_find_subhalos(FOFGroups * fof, ForceTree * tree, double BoxSize, int BlackHoleInfo, MPI_Comm Comm)
+{
+    int i;
+    const double LinkingLength = fof_params.FOFSubhaloLinkingFraction * fof_params.FOFHaloComovingLinkingLength;
+    message(0, "Finding subhalos with comoving linking length: %g\n", LinkingLength);
+
+    int64_t * Parent = (int64_t *) mymalloc("ParentGrNr", PartManager->NumPart * sizeof(int64_t));
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        Parent[i] = P[i].GrNr;
+        HaloLabel[i].Pindex = i;
+    }
+
+    fof_label_primary_length(tree, LinkingLength, 0, Comm);
+    fof_label_secondary(tree);
+    walltime_measure("/FOF/Subhalo/Label");
+
+    FOFGroups sub = {0};
+    fof_build_catalogue(&sub, BoxSize, BlackHoleInfo, Parent, Comm);
+    fof->Subhalo = sub.Group;
+    fof->Nsubhalos = sub.Ngroups;
+    fof->TotNsubhalos = sub.TotNgroups;
+
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+        P[i].GrNr = Parent[i];
+    myfree(Parent);
+
+    message(0, "Found %ld subhalos.\n", fof->TotNsubhalos);
+    walltime_measure("/FOF/Subhalo/Prop");
+}
+
+static FOFGroups
+fof_fof_mode(ForceTree * tree, double BoxSize, int BlackHoleInfo, int SeedingOnly, MPI_Comm Comm)
 {
     int i;
 
@@ -176,38 +266,13 @@ fof_fof(ForceTree * tree, double BoxSize, int BlackHoleInfo, MPI_Comm Comm)
 
     walltime_measure("/FOF/Secondary");
 
-    /* sort HaloLabel according to MinID, because we need that for compiling catalogues */
-    qsort_openmp(HaloLabel, PartManager->NumPart, sizeof(struct fof_particle_list), fof_compare_HaloLabel_MinID);
-
-    int NgroupsExt = 0;
-
-    for(i = 0; i < PartManager->NumPart; i ++) {
-        if(i == 0 || HaloLabel[i].MinID != HaloLabel[i - 1].MinID) NgroupsExt ++;
-    }
-
-    /* The first round is to eliminate groups that are too short. */
-    /* We create the smaller 'BaseGroup' data set for this. */
-    struct BaseGroup * base = (struct BaseGroup *) mymalloc("BaseGroup", sizeof(struct BaseGroup) * NgroupsExt);
-
-    NgroupsExt = fof_compile_base(base, NgroupsExt, Comm);
-
-    MPIU_Barrier(Comm);
-    message(0, "Compiled local group data and catalogue.\n");
-
-    walltime_measure("/FOF/Compile");
-
-    fof_assign_grnr(base, NgroupsExt, Comm);
-
     /*Initialise the Group object from the BaseGroup*/
-    FOFGroups fof;
+    FOFGroups fof = {0};
     MPI_Type_contiguous(sizeof(fof.Group[0]), MPI_BYTE, &MPI_TYPE_GROUP);
     MPI_Type_commit(&MPI_TYPE_GROUP);
 
-    fof.Group = fof_alloc_group(base, NgroupsExt);
-
-    myfree(base);
-
-    fof_compile_catalogue(&fof, NgroupsExt, BoxSize, BlackHoleInfo, Comm);
+    fof.SeedingOnly = SeedingOnly;
+    fof_build_catalogue(&fof, BoxSize, BlackHoleInfo, NULL, Comm);
 
     MPIU_Barrier(Comm);
     message(0, "Finished FoF. Group properties are now allocated.. (presently allocated=%g MB)\n",
@@ -215,14 +280,31 @@ fof_fof(ForceTree * tree, double BoxSize, int BlackHoleInfo, MPI_Comm Comm)
 
     walltime_measure("/FOF/Prop");
 
+    if(!SeedingOnly && fof_params.FOFSubhaloLinkingFraction > 0)
+        fof_find_subhalos(&fof, tree, BoxSize, BlackHoleInfo, Comm);
+
     myfree(HaloLabel);
 
     return fof;
 }
 
+FOFGroups
+fof_fof(ForceTree * tree, double BoxSize, int BlackHoleInfo, MPI_Comm Comm)
+{
+    return fof_fof_mode(tree, BoxSize, BlackHoleInfo, 0, Comm);
+}
+
+FOFGroups
+fof_fof_seeding(ForceTree * tree, double BoxSize, int BlackHoleInfo, MPI_Comm Comm)
+{
+    return fof_fof_mode(tree, BoxSize, BlackHoleInfo, 1, Comm);
+}
+
 void
 fof_finish(FOFGroups * fof)
 {
+    if(fof->Subhalo)
+        myfree(fof->Subhalo);
     myfree(fof->Group);
 
     message(0, "Finished computing FoF groups.  (presently allocated=%g MB)\n",
@@ -235,102 +317,48 @@ fof_finish(FOFGroups * fof)
 
 struct FOFPrimaryPriv {
     int * Head;
-    struct SpinLocks * spin;
     char * PrimaryActive;
     MyIDType * OldMinID;
+    /* Set in the first round for particles with neighbours on other ranks.
+     * Only these need to walk again when the label of their group changes.*/
+    char * Boundary;
+    /* Root of each particle after seeding, and for each local node the seed root
+     * shared by all its linked particles, or -1. NULL unless FOFIncremental.*/
+    int * Seed;
+    int * NodeSeed;
+    int firstnode;
+    double LinkingLength;
 };
 #define FOF_PRIMARY_GET_PRIV(tw) ((struct FOFPrimaryPriv *) (tw->priv))
 
-/* This function walks the particle tree starting at particle i until it reaches
- * a particle which has Head[i] = i, the root node (particles are initialised in
- * this state, so this is equivalent to finding a particle which has yet to be merged).
- * Each particle is locked along the way, and unlocked once it is clear that it is not a root.
- * Once it reaches a root, it returns that particle number with the lock still held.
- * There are two other arguments:
- *
- * stop: When this particle is reached, return -1. We use this to find an already merged tree.
- *
- * locked: This particle is already locked (setting locked = -1 means no other locks are taken).
- *         When we try to lock a particle locked by another thread, the code checks whether
- *         it can safely take a second lock. If it cannot, it returns -2, with the expectation
- *         that the first lock is released before a retry.
- *
- * Returns:
- *      root particle if found
- *      -1 if stop particle reached
- *      -2 if locking might have deadlocked.
- */
+/* The particles form a lock-free union-find forest: Head[i] = i marks a root,
+ * otherwise Head[i] points towards the root. Head only ever changes by compare-and-swap.
+ * While the label of a root is lowered by a ghost (see fof_lower_label)
+ * the root is claimed by storing -1 - root in its Head, so a negative Head is also a root.*/
+
+/* Find the root of particle i, with path splitting: each particle on the path is pointed
+ * at its grandparent. A failed swap only means another thread already shortened the path.*/
 static int
-HEADl(int stop, int i, int locked, int * Head, struct SpinLocks * spin)
+fof_find(int i, int * Head)
 {
-    int r, next;
-    if (i == stop) {
-        return -1;
-    }
-//    printf("locking %d by %d in HEADl stop = %d\n", i, omp_get_thread_num(), stop);
-    /* Try to lock the particle. Wait on the lock if it is less than the already locked particle,
-     * or if such a particle does not exist. We could use atomic to avoid the lock, but this
-     * makes the locking code less clear, and doesn't lead to much of a speedup: the splay
-     * means that the tree is shallow.*/
-    if(locked < 0 || i < locked) {
-        lock_spinlock(i, spin);
-    }
-    else{
-        if(try_lock_spinlock(i, spin)) {
-            /*This means some other thread already has the lock.
-             *To avoid deadlocks we need to back off, unlock both particles and then retry.*/
-            return -2;
-        }
-    }
-//    printf("locked %d by %d in HEADl, next = %d\n", i, omp_get_thread_num(), FOF_PRIMARY_GET_PRIV(tw)->Head[i]);
-    /* atomic read because we may change
-     * this in update_root without the lock: not necessary on x86_64, but avoids tears elsewhere*/
-    #pragma omp atomic read
-    next = Head[i];
-
-    if(next == i) {
-        /* return locked */
-        return i;
+    while(1) {
+        int next, nnext;
+        #pragma omp atomic read
+        next = Head[i];
+        if(next == i || next < 0)
+            return i;
+        #pragma omp atomic read
+        nnext = Head[next];
+        if(nnext != next && nnext >= 0)
+            atomic_compare_and_swap(&Head[i], next, nnext);
+        i = next;
     }
-    /* this is not the root, keep going, but unlock first, since even if the root is modified by
-     * another thread, what we get here is on the path, */
-    unlock_spinlock(i, spin);
-//    printf("unlocking %d by %d in HEADl\n", i, omp_get_thread_num());
-    r = HEADl(stop, next, locked, Head, spin);
-    return r;
-}
-
-/* Rewrite a tree so that all values in it point directly to the true root.
- * This means that the trees are O(1) deep and speeds up future accesses. */
-static void
-update_root(int i, const int r, int * Head)
-{
-    int t = i;
-    do {
-        i = t;
-        #pragma omp atomic capture
-        {
-            t = Head[i];
-            Head[i]= r;
-        }
-    } while(t != i);
 }
 
 static int
 HEAD(int i, TreeWalk * tw)
 {
-    /* accelerate with a splay: see https://arxiv.org/abs/1607.03224 */
-    int r;
-    r = i;
-    while(FOF_PRIMARY_GET_PRIV(tw)->Head[r] != r) {
-        r = FOF_PRIMARY_GET_PRIV(tw)->Head[r];
-    }
-    while(FOF_PRIMARY_GET_PRIV(tw)->Head[i] != i) {
-        int t = FOF_PRIMARY_GET_PRIV(tw)->Head[i];
-        FOF_PRIMARY_GET_PRIV(tw)->Head[i]= r;
-        i = t;
-    }
-    return r;
+    return fof_find(i, FOF_PRIMARY_GET_PRIV(tw)->Head);
 }
 
 static void fof_primary_copy(int place, TreeWalkQueryFOF * I, TreeWalk * tw) {
@@ -349,7 +377,355 @@ fof_primary_ngbiter(TreeWalkQueryFOF * I,
         TreeWalkNgbIterFOF * iter,
         LocalTreeWalk * lv);
 
+TREEWALK_DEFINE_NGBITER_VISIT(fof_primary_visit, fof_primary_ngbiter, TreeWalkNgbIterFOF)
+
+static void fofp_merge(int target, int other, int * Head);
+
+/* Hash of a group label, kept in P[i].FOFHint for the next call*/
+static inline unsigned int
+fof_label_hint(const MyIDType MinID)
+{
+    return (unsigned int) (MinID ^ (MinID >> 32));
+}
+
+struct FOFSeedItem {
+    unsigned int hint;
+    int index;
+};
+
+static int
+fof_compare_seed(const void * a, const void * b)
+{
+    const struct FOFSeedItem * sa = a, * sb = b;
+    if(sa->hint != sb->hint)
+        return sa->hint < sb->hint ? -1 : 1;
+    return (sa->index > sb->index) - (sa->index < sb->index);
+}
+
+/* Seed the forest from the groups of the last call. The local members of each old group
+ * are sorted by index, which follows the tree, and each is linked to the next if they are
+ * still within the linking length. Every seeded link is a real link, so the groups do not
+ * depend on the hints: a stale hint only means fewer seeds. Returns the number of links.*/
+static int64_t
+fof_seed_links(int * Head, const double LinkingLength, const double BoxSize)
+{
+    struct FOFSeedItem * items = (struct FOFSeedItem *) mymalloc2("FOFSeedItems", PartManager->NumPart * sizeof(struct FOFSeedItem));
+    int i, n = 0;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(!((1 << P[i].Type) & FOF_PRIMARY_LINK_TYPES))
+            continue;
+        items[n].hint = P[i].FOFHint;
+        items[n].index = i;
+        n++;
+    }
+    qsort_openmp(items, n, sizeof(struct FOFSeedItem), fof_compare_seed);
+
+    const double b2 = LinkingLength * LinkingLength;
+    int64_t nlinks = 0;
+    #pragma omp parallel for reduction(+: nlinks)
+    for(i = 0; i < n - 1; i++) {
+        if(items[i].hint != items[i+1].hint)
+            continue;
+        const int p1 = items[i].index, p2 = items[i+1].index;
+        double r2 = 0;
+        int d;
+        for(d = 0; d < 3; d++) {
+            const double dx = NEAREST(P[p1].Pos[d] - P[p2].Pos[d], BoxSize);
+            r2 += dx * dx;
+        }
+        if(r2 > b2)
+            continue;
+        fofp_merge(p1, p2, Head);
+        nlinks++;
+    }
+    myfree(items);
+    return nlinks;
+}
+
+/* Label each local node with the seed root shared by all the linked particles inside it,
+ * -1 if there are several and -2 if there are none. Each particle carries its root up the tree
+ * until it meets a node which already has it; a node which sees two roots passes -1 up instead.*/
+static void
+fof_seed_node_labels(const ForceTree * tree, const int * Seed, int * NodeSeed)
+{
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < tree->numnodes; i++)
+        NodeSeed[i] = -2;
+
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(!((1 << P[i].Type) & FOF_PRIMARY_LINK_TYPES))
+            continue;
+        int label = Seed[i];
+        int no = force_get_father(i, tree);
+        while(no >= tree->firstnode && no < tree->firstnode + tree->numnodes) {
+            int * nl = &NodeSeed[no - tree->firstnode];
+            int old;
+            #pragma omp atomic read
+            old = *nl;
+            if(old == -1 || old == label)
+                break;
+            const int new = (old == -2) ? label : -1;
+            if(!atomic_compare_and_swap(nl, old, new))
+                continue;
+            label = new;
+            no = force_get_father(no, tree);
+        }
+    }
+}
+
+/* A grid of cubic cells at least LinkingLength wide over the box, of which only the cells
+ * with local primary particles are stored, in a hash table. The particles are sorted by cell,
+ * so the particles of a cell are consecutive and the neighbour candidates of a particle are
+ * those of the 27 cells around it. Used for the local links, which the tree walk then skips.*/
+struct FOFGridCell {
+    int64_t key;
+    int start;
+    int count;
+};
+
+struct FOFGrid {
+    int ncell;
+    double cellsize;
+    /* Primary particles sorted by cell*/
+    int * order;
+    int npart;
+    struct FOFGridCell * table;
+    int64_t tablemask;
+};
+
+struct FOFGridItem {
+    int64_t key;
+    int index;
+};
+
+static int
+fof_compare_grid_item(const void * a, const void * b)
+{
+    const struct FOFGridItem * ga = a, * gb = b;
+    if(ga->key != gb->key)
+        return ga->key < gb->key ? -1 : 1;
+    return (ga->index > gb->index) - (ga->index < gb->index);
+}
+
+static inline int
+fof_grid_coord(const struct FOFGrid * grid, const double x)
+{
+    int c = floor(x / grid->cellsize);
+    c %= grid->ncell;
+    if(c < 0)
+        c += grid->ncell;
+    return c;
+}
+
+static inline int64_t
+fof_grid_key(const struct FOFGrid * grid, const int c[3])
+{
+    return ((int64_t) c[0] * grid->ncell + c[1]) * grid->ncell + c[2];
+}
+
+static inline uint64_t
+fof_grid_hash(const int64_t key)
+{
+    return (uint64_t) key * 0x9E3779B97F4A7C15ULL;
+}
+
+/* Find the cell of key: returns the number of particles in it and their first position in order*/
+static int
+fof_grid_find(const struct FOFGrid * grid, const int64_t key, int * start)
+{
+    int64_t h = (fof_grid_hash(key) >> 20) & grid->tablemask;
+    while(grid->table[h].key >= 0) {
+        if(grid->table[h].key == key) {
+            *start = grid->table[h].start;
+            return grid->table[h].count;
+        }
+        h = (h + 1) & grid->tablemask;
+    }
+    return 0;
+}
+
+/* Build the grid of the primary particles. Returns 0 if the box is less than three cells wide,
+ * when the 27 neighbour cells would not be distinct and the tree is used instead.*/
+static int
+fof_grid_build(struct FOFGrid * grid, const double LinkingLength, const double BoxSize)
+{
+    int64_t ncell = BoxSize / LinkingLength;
+    if(ncell > (1 << 20))
+        ncell = 1 << 20;
+    if(ncell < 3)
+        return 0;
+    grid->ncell = ncell;
+    grid->cellsize = BoxSize / ncell;
+
+    struct FOFGridItem * items = (struct FOFGridItem *) mymalloc2("FOFGridItems", PartManager->NumPart * sizeof(struct FOFGridItem));
+    int i, n = 0;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage || !((1 << P[i].Type) & FOF_PRIMARY_LINK_TYPES))
+            continue;
+        int c[3], d;
+        for(d = 0; d < 3; d++)
+            c[d] = fof_grid_coord(grid, P[i].Pos[d]);
+        items[n].key = fof_grid_key(grid, c);
+        items[n].index = i;
+        n++;
+    }
+    /* Ties are broken by index, which follows the tree, so the particles of a cell stay in Peano order*/
+    qsort_openmp(items, n, sizeof(struct FOFGridItem), fof_compare_grid_item);
+
+    grid->order = (int *) mymalloc("FOFGridOrder", n * sizeof(int) + 1);
+    grid->npart = n;
+    int ncells = 0;
+    for(i = 0; i < n; i++) {
+        grid->order[i] = items[i].index;
+        ncells += (i == 0 || items[i].key != items[i-1].key);
+    }
+    int64_t tablesize = 1;
+    while(tablesize < 2 * (int64_t) ncells)
+        tablesize *= 2;
+
+    grid->table = (struct FOFGridCell *) mymalloc("FOFGridTable", tablesize * sizeof(struct FOFGridCell));
+    grid->tablemask = tablesize - 1;
+    #pragma omp parallel for
+    for(i = 0; i < tablesize; i++)
+        grid->table[i].key = -1;
+    for(i = 0; i < n; i++) {
+        if(i > 0 && items[i].key == items[i-1].key)
+            continue;
+        int64_t h = (fof_grid_hash(items[i].key) >> 20) & grid->tablemask;
+        while(grid->table[h].key >= 0)
+            h = (h + 1) & grid->tablemask;
+        grid->table[h].key = items[i].key;
+        grid->table[h].start = i;
+        int j;
+        for(j = i; j < n && items[j].key == items[i].key; j++)
+            continue;
+        grid->table[h].count = j - i;
+    }
+    myfree(items);
+    return 1;
+}
+
+static void
+fof_grid_free(struct FOFGrid * grid)
+{
+    myfree(grid->table);
+    myfree(grid->order);
+}
+
+/* Link each pair of primary particles in the grid closer than LinkingLength. Each pair of cells
+ * is visited once, from the cell with the smaller key. Returns the number of links.*/
+static int64_t
+fof_grid_link(const struct FOFGrid * grid, int * Head, const double LinkingLength, const double BoxSize)
+{
+    const double b2 = LinkingLength * LinkingLength;
+    int64_t nlinks = 0;
+    int s;
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+: nlinks)
+    for(s = 0; s < grid->npart; s++) {
+        const int i = grid->order[s];
+        int c[3], d;
+        for(d = 0; d < 3; d++)
+            c[d] = fof_grid_coord(grid, P[i].Pos[d]);
+        const int64_t key = fof_grid_key(grid, c);
+        int dx, dy, dz;
+        for(dx = -1; dx <= 1; dx++)
+        for(dy = -1; dy <= 1; dy++)
+        for(dz = -1; dz <= 1; dz++) {
+            const int nc[3] = {(c[0] + dx + grid->ncell) % grid->ncell,
+                (c[1] + dy + grid->ncell) % grid->ncell, (c[2] + dz + grid->ncell) % grid->ncell};
+            const int64_t nkey = fof_grid_key(grid, nc);
+            if(nkey < key)
+                continue;
+            int start;
+            const int count = fof_grid_find(grid, nkey, &start);
+            /* In its own cell the particle links to those after it*/
+            const int first = nkey == key ? s + 1 : start;
+            int t;
+            for(t = first; t < start + count; t++) {
+                const int j = grid->order[t];
+                double r2 = 0;
+                for(d = 0; d < 3; d++) {
+                    const double dist = NEAREST(P[i].Pos[d] - P[j].Pos[d], BoxSize);
+                    r2 += dist * dist;
+                }
+                if(r2 > b2)
+                    continue;
+                fofp_merge(i, j, Head);
+                nlinks++;
+            }
+        }
+    }
+    return nlinks;
+}
+
+/* Find the nearest primary particle in the grid to pos, no further than maxdist.
+ * The shells of cells around the cell of pos are searched outwards until no unsearched cell
+ * can be closer than the nearest particle found. Returns the particle, or -1, and its distance in *dist.*/
+static int
+fof_grid_nearest(const struct FOFGrid * grid, const double pos[3], const double maxdist, const double BoxSize, double * dist)
+{
+    int c[3], d;
+    for(d = 0; d < 3; d++)
+        c[d] = fof_grid_coord(grid, pos[d]);
+    int kmax = ceil(maxdist / grid->cellsize);
+    /* Beyond this the shells wrap around the box*/
+    if(kmax > (grid->ncell - 1) / 2)
+        kmax = (grid->ncell - 1) / 2;
+    double best2 = maxdist * maxdist;
+    int nearest = -1;
+    int k;
+    for(k = 0; k <= kmax; k++) {
+        int dx, dy, dz;
+        for(dx = -k; dx <= k; dx++)
+        for(dy = -k; dy <= k; dy++)
+        for(dz = -k; dz <= k; dz++) {
+            /* Only the cells of shell k*/
+            if(abs(dx) != k && abs(dy) != k && abs(dz) != k)
+                continue;
+            const int nc[3] = {((c[0] + dx) % grid->ncell + grid->ncell) % grid->ncell,
+                ((c[1] + dy) % grid->ncell + grid->ncell) % grid->ncell, ((c[2] + dz) % grid->ncell + grid->ncell) % grid->ncell};
+            int start;
+            const int count = fof_grid_find(grid, fof_grid_key(grid, nc), &start);
+            int t;
+            for(t = start; t < start + count; t++) {
+                const int j = grid->order[t];
+                double r2 = 0;
+                for(d = 0; d < 3; d++) {
+                    const double dist = NEAREST(pos[d] - P[j].Pos[d], BoxSize);
+                    r2 += dist * dist;
+                }
+                if(r2 < best2) {
+                    best2 = r2;
+                    nearest = j;
+                }
+            }
+        }
+        /* Every particle outside shell k is further than k cells from pos*/
+        if(nearest >= 0 && best2 <= (k * grid->cellsize) * (k * grid->cellsize))
+            break;
+    }
+    *dist = sqrt(best2);
+    return nearest;
+}
+
+static int
+fof_primary_ngbskip(const int no, LocalTreeWalk * lv)
+{
+    struct FOFPrimaryPriv * priv = FOF_PRIMARY_GET_PRIV(lv->tw);
+    return priv->NodeSeed[no - priv->firstnode] == priv->Seed[lv->target];
+}
+
 void fof_label_primary(ForceTree * tree, MPI_Comm Comm)
+{
+    fof_label_primary_length(tree, fof_params.FOFHaloComovingLinkingLength, 1, Comm);
+}
+
+/* Link the primary particles closer than LinkingLength. If StoreHint, the labels
+ * are remembered in P[i].FOFHint to seed the next call.*/
+static void
+fof_label_primary_length(ForceTree * tree, const double LinkingLength, const int StoreHint, MPI_Comm Comm)
 {
     int i;
     int64_t link_across;
@@ -362,7 +738,7 @@ void fof_label_primary(ForceTree * tree, MPI_Comm Comm)
 
     TreeWalk tw[1] = {{0}};
     tw->ev_label = "FOF_FIND_GROUPS";
-    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->visit = fof_primary_visit;
     tw->ngbiter = (TreeWalkNgbIterFunction) fof_primary_ngbiter;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterFOF);
 
@@ -375,10 +751,12 @@ void fof_label_primary(ForceTree * tree, MPI_Comm Comm)
     tw->tree = tree;
     struct FOFPrimaryPriv priv[1];
     tw->priv = priv;
+    priv->LinkingLength = LinkingLength;
 
     FOF_PRIMARY_GET_PRIV(tw)->Head = (int*) mymalloc("FOF_Links", PartManager->NumPart * sizeof(int));
     FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive = (char*) mymalloc("FOFActive", PartManager->NumPart * sizeof(char));
     FOF_PRIMARY_GET_PRIV(tw)->OldMinID = (MyIDType *) mymalloc("FOFActive", PartManager->NumPart * sizeof(MyIDType));
+    FOF_PRIMARY_GET_PRIV(tw)->Boundary = (char *) mymalloc("FOFBoundary", PartManager->NumPart * sizeof(char));
 
     /* allocate buffers to arrange communication */
 
@@ -389,12 +767,55 @@ void fof_label_primary(ForceTree * tree, MPI_Comm Comm)
         FOF_PRIMARY_GET_PRIV(tw)->Head[i] = i;
         FOF_PRIMARY_GET_PRIV(tw)->OldMinID[i]= P[i].ID;
         FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = 1;
+        FOF_PRIMARY_GET_PRIV(tw)->Boundary[i] = 0;
 
         HaloLabel[i].MinID = P[i].ID;
         HaloLabel[i].MinIDTask = ThisTask;
     }
 
-    priv[0].spin = init_spinlocks(PartManager->NumPart);
+    FOF_PRIMARY_GET_PRIV(tw)->Seed = NULL;
+    FOF_PRIMARY_GET_PRIV(tw)->NodeSeed = NULL;
+    int64_t nseed = 0;
+    if(fof_params.FOFIncremental)
+        nseed = fof_seed_links(FOF_PRIMARY_GET_PRIV(tw)->Head, LinkingLength, tree->BoxSize);
+
+    /* Make all the local links on the grid: then the tree walk skips every node of the target's group,
+     * and is left with the links across ranks.*/
+    int GridLinked = 0;
+    if(fof_params.FOFGridLinking) {
+        struct FOFGrid grid[1];
+        GridLinked = fof_grid_build(grid, LinkingLength, tree->BoxSize);
+        if(GridLinked) {
+            int64_t ngrid = fof_grid_link(grid, FOF_PRIMARY_GET_PRIV(tw)->Head, LinkingLength, tree->BoxSize);
+            fof_grid_free(grid);
+            MPI_Allreduce(MPI_IN_PLACE, &ngrid, 1, MPI_INT64, MPI_SUM, Comm);
+            message(0, "Linked %ld local pairs on a grid of %d^3 cells\n", ngrid, grid->ncell);
+        }
+        else
+            message(0, "Box is less than 3 linking lengths wide, linking with the tree\n");
+    }
+
+    if(fof_params.FOFIncremental || GridLinked) {
+        /* The tree walk skips nodes whose particles are all in the seeded set of the target:
+         * links to them add nothing new.*/
+        FOF_PRIMARY_GET_PRIV(tw)->Seed = (int *) mymalloc("FOFSeed", PartManager->NumPart * sizeof(int));
+        FOF_PRIMARY_GET_PRIV(tw)->NodeSeed = (int *) mymalloc("FOFNodeSeed", tree->numnodes * sizeof(int));
+        FOF_PRIMARY_GET_PRIV(tw)->firstnode = tree->firstnode;
+        #pragma omp parallel for
+        for(i = 0; i < PartManager->NumPart; i++)
+            FOF_PRIMARY_GET_PRIV(tw)->Seed[i] = fof_find(i, FOF_PRIMARY_GET_PRIV(tw)->Head);
+        fof_seed_node_labels(tree, FOF_PRIMARY_GET_PRIV(tw)->Seed, FOF_PRIMARY_GET_PRIV(tw)->NodeSeed);
+        tw->ngbskip = fof_primary_ngbskip;
+    }
+    if(fof_params.FOFIncremental) {
+        MPI_Allreduce(MPI_IN_PLACE, &nseed, 1, MPI_INT64, MPI_SUM, Comm);
+        message(0, "Seeded %ld links from the last FOF groups\n", nseed);
+    }
+
+    /* The first round links all local pairs and sends every particle near another rank
+     * to it. After that only the labels of groups with members near other ranks change,
+     * so only those members walk again: the later rounds only exchange labels across the boundaries.*/
+    int round = 0;
     do
     {
         t0 = second();
@@ -406,81 +827,97 @@ void fof_label_primary(ForceTree * tree, MPI_Comm Comm)
         /* let's check out which particles have changed their MinID,
          * mark them for next round. */
         link_across = 0;
-#pragma omp parallel for reduction(+: link_across)
+        int64_t nboundary = 0;
+#pragma omp parallel for reduction(+: link_across, nboundary)
         for(i = 0; i < PartManager->NumPart; i++) {
             MyIDType newMinID = HaloLabel[HEAD(i, tw)].MinID;
             if(newMinID != FOF_PRIMARY_GET_PRIV(tw)->OldMinID[i]) {
-                FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = 1;
+                FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = FOF_PRIMARY_GET_PRIV(tw)->Boundary[i];
                 link_across ++;
             } else {
                 FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i] = 0;
             }
+            nboundary += FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive[i];
             FOF_PRIMARY_GET_PRIV(tw)->OldMinID[i] = newMinID;
         }
         MPI_Allreduce(&link_across, &link_across_tot, 1, MPI_INT64, MPI_SUM, Comm);
-        message(0, "Linked %ld particles %g seconds\n", link_across_tot, t1 - t0);
+        MPI_Allreduce(MPI_IN_PLACE, &nboundary, 1, MPI_INT64, MPI_SUM, Comm);
+        message(0, "Round %d linked %ld particles %g seconds, %ld boundary particles walk again\n", round, link_across_tot, t1 - t0, nboundary);
+        round++;
     }
     while(link_across_tot > 0);
 
-    free_spinlocks(priv[0].spin);
+    if(FOF_PRIMARY_GET_PRIV(tw)->Seed) {
+        myfree(FOF_PRIMARY_GET_PRIV(tw)->NodeSeed);
+        myfree(FOF_PRIMARY_GET_PRIV(tw)->Seed);
+    }
 
     /* Update MinID of all linked (primary-linked) particles */
     for(i = 0; i < PartManager->NumPart; i++)
     {
         HaloLabel[i].MinID = HaloLabel[HEAD(i, tw)].MinID;
         HaloLabel[i].MinIDTask = HaloLabel[HEAD(i, tw)].MinIDTask;
+        /* Remember the group for seeding the next call */
+        if(StoreHint)
+            P[i].FOFHint = fof_label_hint(HaloLabel[i].MinID);
     }
 
     message(0, "Local groups found.\n");
 
+    myfree(FOF_PRIMARY_GET_PRIV(tw)->Boundary);
     myfree(FOF_PRIMARY_GET_PRIV(tw)->OldMinID);
     myfree(FOF_PRIMARY_GET_PRIV(tw)->PrimaryActive);
     myfree(FOF_PRIMARY_GET_PRIV(tw)->Head);
 }
 
-static void
-fofp_merge(int target, int other, TreeWalk * tw)
+/* Root h1 sorts before root h2: the smaller label, with ties broken by the particle index.
+ * Labels only change in the ghost walk, so this order is fixed while the local walk merges.*/
+static int
+fof_root_less(int h1, int h2)
 {
-    /* this will lock h1 */
-    int * Head = FOF_PRIMARY_GET_PRIV(tw)->Head;
-    struct SpinLocks * spin = FOF_PRIMARY_GET_PRIV(tw)->spin;
-    int h1, h2;
-
-    do {
-        h1 = HEADl(-1, target, -1, Head, spin);
-        /* stop looking if we find h1 along the path (because it is already owned by us) */
-        h2 = HEADl(h1, other, h1, Head, spin);
-        /* We had a lock already taken on h2 by another thread.
-         * We need to unlock h1 and retry to avoid deadlock loops.*/
-        if(h2 == -2)
-            unlock_spinlock(h1, spin);
-    } while(h2 == -2);
-
-    if(h2 >=0)
-    {
-        /* h2 as a sub-tree of h1 */
-        Head[h2] = h1;
+    if(HaloLabel[h1].MinID != HaloLabel[h2].MinID)
+        return HaloLabel[h1].MinID < HaloLabel[h2].MinID;
+    return h1 < h2;
+}
 
-        /* update MinID of h1 */
-        if(HaloLabel[h1].MinID > HaloLabel[h2].MinID)
-        {
-            HaloLabel[h1].MinID = HaloLabel[h2].MinID;
-            HaloLabel[h1].MinIDTask = HaloLabel[h2].MinIDTask;
+/* Join the trees of target and other. The root that sorts later is linked under the other one,
+ * so the root always carries the smallest label of its tree and no label needs to be written.
+ * If the swap fails another thread has linked the root first, and we retry from the new roots.*/
+static void
+fofp_merge(int target, int other, int * Head)
+{
+    while(1) {
+        int h1 = fof_find(target, Head);
+        int h2 = fof_find(other, Head);
+        if(h1 == h2)
+            return;
+        if(fof_root_less(h2, h1)) {
+            int t = h1;
+            h1 = h2;
+            h2 = t;
         }
-        //printf("unlocking %d by %d in merge\n", h2, omp_get_thread_num());
-        unlock_spinlock(h2, spin);
+        /* h2 as a sub-tree of h1 */
+        if(atomic_compare_and_swap(&Head[h2], h2, h1))
+            return;
     }
+}
 
-    /* h1 must be the root of other and target both:
-     * do the splay to speed up future accesses.
-     * We do not need to have h2 locked, because h2 is
-     * now just another child of h1: these do not change the root,
-     * they make the tree shallow.*/
-    update_root(target, h1, Head);
-    update_root(other, h1, Head);
-
-    //printf("unlocking %d by %d in merge\n", h1, omp_get_thread_num());
-    unlock_spinlock(h1, spin);
+/* Lower the label of the group of particle i to that of a ghost. There are no merges
+ * in the ghost walk, so the root is fixed: claim it so that MinID and MinIDTask change together.*/
+static void
+fof_lower_label(int i, const MyIDType MinID, const int MinIDTask, int * Head)
+{
+    const int r = fof_find(i, Head);
+    if(HaloLabel[r].MinID <= MinID)
+        return;
+    while(!atomic_compare_and_swap(&Head[r], r, -1 - r))
+        continue;
+    if(HaloLabel[r].MinID > MinID)
+    {
+        HaloLabel[r].MinID = MinID;
+        HaloLabel[r].MinIDTask = MinIDTask;
+    }
+    __atomic_store_n(&Head[r], r, __ATOMIC_RELEASE);
 }
 
 static void
@@ -491,9 +928,17 @@ fof_primary_ngbiter(TreeWalkQueryFOF * I,
 {
     TreeWalk * tw = lv->tw;
     if(iter->base.other == -1) {
-        iter->base.Hsml = fof_params.FOFHaloComovingLinkingLength;
+        iter->base.Hsml = FOF_PRIMARY_GET_PRIV(tw)->LinkingLength;
         iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
         iter->base.mask = FOF_PRIMARY_LINK_TYPES;
+        /* Call again at the end to see whether the particle was exported*/
+        iter->Nexported = lv->Nexported;
+        iter->base.finish = lv->mode == 0;
+        return;
+    }
+    if(iter->base.other == -2) {
+        if(lv->Nexported > iter->Nexported)
+            FOF_PRIMARY_GET_PRIV(tw)->Boundary[lv->target] = 1;
         return;
     }
     int other = iter->base.other;
@@ -501,21 +946,11 @@ fof_primary_ngbiter(TreeWalkQueryFOF * I,
     if(lv->mode == 0) {
         /* Local FOF */
         if(lv->target <= other) {
-            // printf("locked merge %d %d by %d\n", lv->target, other, omp_get_thread_num());
-            fofp_merge(lv->target, other, tw);
+            fofp_merge(lv->target, other, FOF_PRIMARY_GET_PRIV(tw)->Head);
         }
     } else /* mode is 1, target is a ghost */
     {
-            struct SpinLocks * spin = FOF_PRIMARY_GET_PRIV(tw)->spin;
-//        printf("locking %d by %d in ngbiter\n", other, omp_get_thread_num());
-        lock_spinlock(other, spin);
-        if(HaloLabel[HEAD(other, tw)].MinID > I->MinID)
-        {
-            HaloLabel[HEAD(other, tw)].MinID = I->MinID;
-            HaloLabel[HEAD(other, tw)].MinIDTask = I->MinIDTask;
-        }
-//        printf("unlocking %d by %d in ngbiter\n", other, omp_get_thread_num());
-        unlock_spinlock(other, spin);
+        fof_lower_label(other, I->MinID, I->MinIDTask, FOF_PRIMARY_GET_PRIV(tw)->Head);
     }
 }
 
@@ -526,7 +961,8 @@ static void fof_reduce_base_group(void * pdst, void * psrc) {
     /* preserve the dst FirstPos so all other base group gets the same FirstPos */
 }
 
-static void fof_reduce_group(void * pdst, void * psrc) {
+/* Reduce the seeding fields only, which are all an image carries in fof_fof_seeding*/
+static void fof_reduce_seed_group(void * pdst, void * psrc) {
     struct Group * gdst = pdst;
     struct Group * gsrc = psrc;
     int j;
@@ -539,9 +975,6 @@ static void fof_reduce_group(void * pdst, void * psrc) {
         gdst->MassType[j] += gsrc->MassType[j];
     }
 
-    gdst->Sfr += gsrc->Sfr;
-    gdst->BH_Mdot += gsrc->BH_Mdot;
-    gdst->BH_Mass += gsrc->BH_Mass;
     if(gsrc->MaxDens > gdst->MaxDens)
     {
         gdst->MaxDens = gsrc->MaxDens;
@@ -549,10 +982,25 @@ static void fof_reduce_group(void * pdst, void * psrc) {
         gdst->seed_task = gsrc->seed_task;
     }
 
+    for(j = 0; j < 3; j++)
+        gdst->CM[j] += gsrc->CM[j];
+}
+
+static void fof_reduce_group(void * pdst, void * psrc) {
+    struct Group * gdst = pdst;
+    struct Group * gsrc = psrc;
+
+    fof_reduce_seed_group(pdst, psrc);
+
+    gdst->Sfr += gsrc->Sfr;
+    gdst->BH_Mdot += gsrc->BH_Mdot;
+    gdst->BH_Mass += gsrc->BH_Mass;
+    if(gsrc->ParentGrNr > gdst->ParentGrNr)
+        gdst->ParentGrNr = gsrc->ParentGrNr;
+
     int d1, d2;
     for(d1 = 0; d1 < 3; d1++)
     {
-        gdst->CM[d1] += gsrc->CM[d1];
         gdst->Vel[d1] += gsrc->Vel[d1];
         gdst->Jmom[d1] += gsrc->Jmom[d1];
         for(d2 = 0; d2 < 3; d2 ++) {
@@ -562,7 +1010,7 @@ static void fof_reduce_group(void * pdst, void * psrc) {
 
 }
 
-static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, int ThisTask, int BlackHoleOn) {
+static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, int ThisTask, int BlackHoleOn, int SeedingOnly) {
 
     /* My local number of particles contributing to the full catalogue. */
     const int index = i;
@@ -571,6 +1019,7 @@ static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, in
         memset(gdst, 0, sizeof(gdst[0]));
         gdst->base = base;
         gdst->seed_index = gdst->seed_task = -1;
+        gdst->ParentGrNr = -1;
     }
 
     gdst->Length ++;
@@ -579,10 +1028,10 @@ static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, in
     gdst->MassType[P[index].Type] += P[index].Mass;
 
 
-    if(P[index].Type == 0) {
+    if(!SeedingOnly && P[index].Type == 0) {
         gdst->Sfr += SPHP(index).Sfr;
     }
-    if(BlackHoleOn && P[index].Type == 5)
+    if(!SeedingOnly && BlackHoleOn && P[index].Type == 5)
     {
         gdst->BH_Mdot += BHP(index).Mdot;
         gdst->BH_Mass += BHP(index).Mass;
@@ -613,12 +1062,15 @@ static void add_particle_to_group(struct Group * gdst, int i, double BoxSize, in
         rel[d1] = fof_periodic(P[index].Pos[d1] - first, BoxSize) ;
         xyz[d1] = rel[d1] + first;
         vel[d1] = P[index].Vel[d1];
+        gdst->CM[d1] += P[index].Mass * xyz[d1];
     }
 
+    if(SeedingOnly)
+        return;
+
     crossproduct(rel, vel, jmom);
 
     for(d1 = 0; d1 < 3; d1++) {
-        gdst->CM[d1] += P[index].Mass * xyz[d1];
         gdst->Vel[d1] += P[index].Mass * vel[d1];
         gdst->Jmom[d1] += P[index].Mass * jmom[d1];
 
@@ -644,15 +1096,20 @@ fof_finish_group_properties(struct FOFGroups * fof, double BoxSize)
         struct Group * gdst = &fof->Group[i];
         for(d1 = 0; d1 < 3; d1++)
         {
-            gdst->Vel[d1] /= gdst->Mass;
-            vcm[d1] = gdst->Vel[d1];
             cm[d1] = gdst->CM[d1] / gdst->Mass;
 
             rel[d1] = fof_periodic(cm[d1] - gdst->base.FirstPos[d1], BoxSize);
 
             cm[d1] = fof_periodic_wrap(cm[d1], BoxSize);
             gdst->CM[d1] = cm[d1];
+        }
+        if(fof->SeedingOnly)
+            continue;
 
+        for(d1 = 0; d1 < 3; d1++)
+        {
+            gdst->Vel[d1] /= gdst->Mass;
+            vcm[d1] = gdst->Vel[d1];
         }
         crossproduct(rel, vcm, jcm);
 
@@ -721,7 +1178,7 @@ fof_compile_base(struct BaseGroup * base, int NgroupsExt, MPI_Comm Comm)
     }
 
     /* update global attributes */
-    fof_reduce_groups(base, NgroupsExt, sizeof(base[0]), fof_reduce_base_group, Comm);
+    fof_reduce_groups(base, NgroupsExt, sizeof(base[0]), sizeof(base[0]), fof_reduce_base_group, Comm);
 
     /* eliminate all groups that are too small */
     for(i = 0; i < NgroupsExt; i++)
@@ -755,7 +1212,7 @@ fof_alloc_group(const struct BaseGroup * base, const int NgroupsExt)
 }
 
 static void
-fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, double BoxSize, int BlackHoleInfo, MPI_Comm Comm)
+fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, double BoxSize, int BlackHoleInfo, const int64_t * Parent, MPI_Comm Comm)
 {
     int i, start, ThisTask;
 
@@ -773,12 +1230,17 @@ fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, double BoxSi
             if(HaloLabel[start].MinID != fof->Group[i].base.MinID) {
                 break;
             }
-            add_particle_to_group(&fof->Group[i], HaloLabel[start].Pindex, BoxSize, ThisTask, BlackHoleInfo);
+            add_particle_to_group(&fof->Group[i], HaloLabel[start].Pindex, BoxSize, ThisTask, BlackHoleInfo, fof->SeedingOnly);
+            if(Parent && Parent[HaloLabel[start].Pindex] > fof->Group[i].ParentGrNr)
+                fof->Group[i].ParentGrNr = Parent[HaloLabel[start].Pindex];
         }
     }
 
     /* collect global properties */
-    fof_reduce_groups(fof->Group, NgroupsExt, sizeof(fof->Group[0]), fof_reduce_group, Comm);
+    if(fof->SeedingOnly)
+        fof_reduce_groups(fof->Group, NgroupsExt, sizeof(fof->Group[0]), FOF_SEED_GROUP_SIZE, fof_reduce_seed_group, Comm);
+    else
+        fof_reduce_groups(fof->Group, NgroupsExt, sizeof(fof->Group[0]), sizeof(fof->Group[0]), fof_reduce_group, Comm);
 
     /* count Groups and number of particles hosted by me */
     fof->Ngroups = 0;
@@ -827,10 +1289,30 @@ fof_compile_catalogue(struct FOFGroups * fof, const int NgroupsExt, double BoxSi
 }
 
 
+/* The rank which reduces the partials of a group. This is a hash of MinID rather than MinIDTask:
+ * the MinID of the largest groups often sit on a few ranks, which would then
+ * receive a partial from every rank their groups touch and hold up everyone else.*/
+static int
+fof_reduce_task(const MyIDType MinID, const int NTask)
+{
+    const uint64_t h = MinID * 0x9E3779B97F4A7C15ull;
+    return (h >> 32) % NTask;
+}
+
+static int _fof_compare_Group_ReduceTask_NTask;
+static int fof_compare_Group_ReduceTask(const void *a, const void *b)
+{
+    const int t1 = fof_reduce_task(((struct BaseGroup *) a)->MinID, _fof_compare_Group_ReduceTask_NTask);
+    const int t2 = fof_reduce_task(((struct BaseGroup *) b)->MinID, _fof_compare_Group_ReduceTask_NTask);
+    return (t1 > t2) - (t1 < t2);
+}
+
+/* Only the first commsize bytes of each group of elsize bytes are exchanged and reduced.*/
 static void fof_reduce_groups(
     void * groups,
     int nmemb,
     size_t elsize,
+    size_t commsize,
     void (*reduce_group)(void * gdst, void * gsrc), MPI_Comm Comm)
 {
 
@@ -838,45 +1320,37 @@ static void fof_reduce_groups(
     MPI_Comm_size(Comm, &NTask);
     MPI_Comm_rank(Comm, &ThisTask);
     /* slangs:
-     *   prime: groups hosted by ThisTask
-     *   ghosts: groups that spans into ThisTask but not hosted by ThisTask;
-     *           part of the local catalogue
-     *   images: ghosts that are sent from another rank.
-     *           images are reduced to prime, then the prime attributes
-     *           are copied to images, and sent back to the ghosts.
+     *   partials: the local attributes of each group with particles on ThisTask.
+     *   reducer: the rank given by fof_reduce_task, which gets the partials of a group from all ranks.
+     *   images: partials sent to ThisTask as the reducer. The images of each group
+     *           are reduced into one, copied back to all of them and returned.
      *
-     *   in the begining, prime and ghosts contains local group attributes.
-     *   in the end, prime and ghosts all contain full group attributes.
+     *   in the end, all partials contain full group attributes.
      **/
     int * Send_count = ta_malloc("Send_count", int, NTask);
     int * Recv_count = ta_malloc("Recv_count", int, NTask);
 
-    void * images = NULL;
-    void * ghosts = NULL;
-    int i;
-    int start;
+    int i, j;
+    double tcomm = 0;
+    const double tstart = second();
 
-    MPI_Datatype dtype;
+    MPI_Datatype dtype, dtype_part;
 
-    MPI_Type_contiguous(elsize, MPI_BYTE, &dtype);
+    MPI_Type_contiguous(commsize, MPI_BYTE, &dtype_part);
+    MPI_Type_create_resized(dtype_part, 0, elsize, &dtype);
+    MPI_Type_free(&dtype_part);
     MPI_Type_commit(&dtype);
 
-    /*Set global data for the comparison*/
-    _fof_compare_Group_MinIDTask_ThisTask = ThisTask;
-    /* local groups will be moved to the beginning, we skip them with offset */
-    qsort_openmp(groups, nmemb, elsize, fof_compare_Group_MinIDTask);
-    /* count how many we have of each task */
+    _fof_compare_Group_ReduceTask_NTask = NTask;
+    qsort_openmp(groups, nmemb, elsize, fof_compare_Group_ReduceTask);
     memset(Send_count, 0, sizeof(int) * NTask);
 
     for(i = 0; i < nmemb; i++) {
         struct BaseGroup * gi = (struct BaseGroup *) (((char*) groups) + i * elsize);
-        Send_count[gi->MinIDTask]++;
+        Send_count[fof_reduce_task(gi->MinID, NTask)]++;
     }
 
-    /* Skip local groups */
-    int Nmine = Send_count[ThisTask];
-    Send_count[ThisTask] = 0;
-
+    double t0 = second();
     MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
 
     int nimport = 0;
@@ -884,60 +1358,33 @@ static void fof_reduce_groups(
         nimport += Recv_count[i];
     }
 
-    images = mymalloc("images", nimport * elsize);
-    ghosts = ((char*) groups) + elsize * Nmine;
+    char * images = mymalloc("images", nimport * elsize);
 
-    MPI_Alltoallv_smart(ghosts, Send_count, NULL, dtype,
+    MPI_Alltoallv_smart(groups, Send_count, NULL, dtype,
                         images, Recv_count, NULL, dtype, Comm);
+    tcomm += timediff(t0, second());
 
     for(i = 0; i < nimport; i++) {
-        struct BaseGroup * gi = (struct BaseGroup*) ((char*) images + i * elsize);
+        struct BaseGroup * gi = (struct BaseGroup*) (images + i * elsize);
         gi->OriginalIndex = i;
     }
 
-    /* sort the groups according to MinID */
-    qsort_openmp(groups, Nmine, elsize, fof_compare_Group_MinID);
     qsort_openmp(images, nimport, elsize, fof_compare_Group_MinID);
 
-    /* merge the imported ones with the local ones */
-    start = 0;
-    for(i = 0; i < Nmine; i++) {
-        for(;start < nimport; start++) {
-            struct BaseGroup * prime = (struct BaseGroup*) ((char*) groups + i * elsize);
-            struct BaseGroup * image = (struct BaseGroup*) ((char*) images + start  * elsize);
-            if(image->MinID >= prime->MinID) {
+    /* reduce the images of each group into the first, then copy it to the others */
+    for(i = 0; i < nimport; i = j) {
+        struct BaseGroup * first = (struct BaseGroup*) (images + i * elsize);
+        for(j = i + 1; j < nimport; j++) {
+            struct BaseGroup * image = (struct BaseGroup*) (images + j * elsize);
+            if(image->MinID != first->MinID)
                 break;
-            }
+            reduce_group(first, image);
         }
-        for(;start < nimport; start++) {
-            struct BaseGroup * prime = (struct BaseGroup*) ((char*) groups + i * elsize);
-            struct BaseGroup * image = (struct BaseGroup*) ((char*) images + start * elsize);
-            if(image->MinID != prime->MinID) {
-                break;
-            }
-            reduce_group(prime, image);
-        }
-    }
-
-    /* update the images, such that they can be send back to the ghosts */
-    start = 0;
-    for(i = 0; i < Nmine; i++)
-    {
-        for(;start < nimport; start++) {
-            struct BaseGroup * prime = (struct BaseGroup*) ((char*) groups + i * elsize);
-            struct BaseGroup * image = (struct BaseGroup*) ((char*) images + start * elsize);
-            if(image->MinID >= prime->MinID) {
-                break;
-            }
-        }
-        for(;start < nimport; start++) {
-            struct BaseGroup * prime = (struct BaseGroup*) ((char*) groups + i * elsize);
-            struct BaseGroup * image = (struct BaseGroup*) ((char*) images + start * elsize);
-            if(image->MinID != prime->MinID) {
-                break;
-            }
+        int k;
+        for(k = i + 1; k < j; k++) {
+            struct BaseGroup * image = (struct BaseGroup*) (images + k * elsize);
             int save = image->OriginalIndex;
-            memcpy(image, prime, elsize);
+            memcpy(image, first, elsize);
             image->OriginalIndex = save;
         }
     }
@@ -945,36 +1392,51 @@ static void fof_reduce_groups(
     /* reset the ordering of imported list, such that it can be properly returned */
     qsort_openmp(images, nimport, elsize, fof_compare_Group_OriginalIndex);
 
-    for(i = 0; i < nimport; i++) {
-        struct BaseGroup * gi = (struct BaseGroup*) ((char*) images + i * elsize);
-        if(gi->MinIDTask != ThisTask) {
-            abort();
-        }
-    }
-    void * ghosts2 = mymalloc("TMP", nmemb * elsize);
+    char * groups2 = mymalloc("TMP", nmemb * elsize);
 
+    t0 = second();
     MPI_Alltoallv_smart(images, Recv_count, NULL, dtype,
-                        ghosts2, Send_count, NULL, dtype,
+                        groups2, Send_count, NULL, dtype,
                         Comm);
-    for(i = 0; i < nmemb - Nmine; i ++) {
-        struct BaseGroup * g1 = (struct BaseGroup*) ((char*) ghosts + i * elsize);
-        struct BaseGroup * g2 = (struct BaseGroup*) ((char*) ghosts2 + i* elsize);
+    tcomm += timediff(t0, second());
+
+    for(i = 0; i < nmemb; i ++) {
+        struct BaseGroup * g1 = (struct BaseGroup*) ((char*) groups + i * elsize);
+        struct BaseGroup * g2 = (struct BaseGroup*) (groups2 + i * elsize);
         if(g1->MinID != g2->MinID) {
             endrun(2, "g1 minID %lu, g2 minID %lu\n", g1->MinID, g2->MinID);
         }
         if(g1->MinIDTask != g2->MinIDTask) {
             endrun(2, "g1 minIDTask %d, g2 minIDTask %d\n", g1->MinIDTask, g2->MinIDTask);
         }
+        memcpy(g1, g2, commsize);
     }
-    memcpy(ghosts, ghosts2, elsize * (nmemb - Nmine));
-    myfree(ghosts2);
+    myfree(groups2);
 
     myfree(images);
 
     MPI_Type_free(&dtype);
 
-    /* At this point, each Group entry has the reduced attribute of the full group */
-    /* And the local groups (MinIDTask == ThisTask) are placed at the begining of the list*/
+    /* The callers expect the groups hosted by ThisTask (MinIDTask == ThisTask)
+     * at the beginning of the list, sorted by MinID*/
+    _fof_compare_Group_MinIDTask_ThisTask = ThisTask;
+    qsort_openmp(groups, nmemb, elsize, fof_compare_Group_MinIDTask);
+    int Nmine = 0;
+    for(i = 0; i < nmemb; i++) {
+        struct BaseGroup * gi = (struct BaseGroup *) (((char*) groups) + i * elsize);
+        if(gi->MinIDTask == ThisTask)
+            Nmine++;
+    }
+    qsort_openmp(groups, Nmine, elsize, fof_compare_Group_MinID);
+
+    /* The waits in the exchanges show the imbalance of the reduction between ranks*/
+    walltime_add("/FOF/Reduce/Comm", tcomm);
+    walltime_add("/FOF/Reduce/Compute", timediff(tstart, second()) - tcomm);
+    int64_t nimp[2] = {nimport, nimport};
+    MPI_Allreduce(MPI_IN_PLACE, &nimp[0], 1, MPI_INT64, MPI_MAX, Comm);
+    MPI_Allreduce(MPI_IN_PLACE, &nimp[1], 1, MPI_INT64, MPI_SUM, Comm);
+    message(0, "Reduced group partials: at most %ld on a rank, mean %g.\n", nimp[0], (double) nimp[1] / NTask);
+
     ta_free(Recv_count);
     ta_free(Send_count);
 }
@@ -1051,6 +1513,8 @@ static void fof_assign_grnr(struct BaseGroup * base, const int NgroupsExt, MPI_C
 void
 fof_save_groups(FOFGroups * fof, int num, MPI_Comm Comm)
 {
+    if(fof->SeedingOnly)
+        endrun(1, "Cannot save a catalogue from fof_fof_seeding: the group properties were not computed.\n");
     message(0, "start global sorting of group catalogues\n");
 
     fof_save_particles(fof, num, fof_params.FOFSaveParticles, Comm);
@@ -1089,6 +1553,8 @@ fof_secondary_ngbiter(TreeWalkQueryFOF * I,
         TreeWalkNgbIterFOF * iter,
         LocalTreeWalk * lv);
 
+TREEWALK_DEFINE_NGBITER_VISIT(fof_secondary_visit, fof_secondary_ngbiter, TreeWalkNgbIterFOF)
+
 static void
 fof_secondary_postprocess(int p, TreeWalk * tw)
 {
@@ -1116,13 +1582,26 @@ fof_secondary_postprocess(int p, TreeWalk * tw)
         }
     }
 }
+/* Distance to the nearest DM particle found for particle n by the last call, or 0*/
+static float
+fof_secondary_last_distance(int n)
+{
+    if(!SlotsManager->info[P[n].Type].enabled)
+        return 0;
+    const float d = BASESLOT_PI(P[n].PI, P[n].Type, SlotsManager)->FOFDMDist;
+    /* Also rejects NaN in a slot which was never set*/
+    if(!(d > 0))
+        return 0;
+    return d;
+}
+
 static void fof_label_secondary(ForceTree * tree)
 {
     int n, iter;
 
     TreeWalk tw[1] = {{0}};
     tw->ev_label = "FOF_FIND_NEAREST";
-    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->visit = fof_secondary_visit;
     tw->ngbiter = (TreeWalkNgbIterFunction) fof_secondary_ngbiter;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterFOF);
     tw->haswork = fof_secondary_haswork;
@@ -1148,7 +1627,13 @@ static void fof_label_secondary(ForceTree * tree)
         if(fof_secondary_haswork(n, tw))
         {
             FOF_SECONDARY_GET_PRIV(tw)->distance[n] = LARGE;
-            if(P[n].Type == 0) {
+            const float lastdist = fof_secondary_last_distance(n);
+            if(lastdist > 0 && lastdist < 4 * fof_params.FOFHaloComovingLinkingLength) {
+                /* Start just outside the nearest DM particle of the last call: usually it is still there,
+                 * and if not the radius doubles as usual.*/
+                FOF_SECONDARY_GET_PRIV(tw)->hsml[n] = 1.1 * lastdist;
+            }
+            else if(P[n].Type == 0) {
                 /* use gas sml as a hint (faster convergence than 0.1 fof_params.FOFHaloComovingLinkingLength at high-z */
                 FOF_SECONDARY_GET_PRIV(tw)->hsml[n] = 0.5 * P[n].Hsml;
             } else {
@@ -1157,6 +1642,22 @@ static void fof_label_secondary(ForceTree * tree)
         }
     }
 
+    /* Start from the nearest local primary on the grid: the tree walk then only needs to check
+     * that no particle of another rank is closer, and converges in one iteration.*/
+    struct FOFGrid grid[1];
+    if(fof_params.FOFGridLinking && fof_grid_build(grid, fof_params.FOFHaloComovingLinkingLength, tree->BoxSize)) {
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for(n = 0; n < PartManager->NumPart; n++)
+        {
+            if(!fof_secondary_haswork(n, tw))
+                continue;
+            double dist;
+            if(fof_grid_nearest(grid, P[n].Pos, 4 * fof_params.FOFHaloComovingLinkingLength, tree->BoxSize, &dist) >= 0)
+                FOF_SECONDARY_GET_PRIV(tw)->hsml[n] = DMAX(1.001 * dist, 1e-3 * fof_params.FOFHaloComovingLinkingLength);
+        }
+        fof_grid_free(grid);
+    }
+
     iter = 0;
     int64_t counttot, ntot;
 
@@ -1188,6 +1689,14 @@ static void fof_label_secondary(ForceTree * tree)
     }
     while(ntot > 0);
 
+    /* Keep the distances as the first search radius of the next call */
+    #pragma omp parallel for
+    for(n = 0; n < PartManager->NumPart; n++)
+    {
+        if(fof_secondary_haswork(n, tw) && SlotsManager->info[P[n].Type].enabled)
+            BASESLOT_PI(P[n].PI, P[n].Type, SlotsManager)->FOFDMDist = FOF_SECONDARY_GET_PRIV(tw)->distance[n];
+    }
+
     myfree(FOF_SECONDARY_GET_PRIV(tw)->hsml);
     myfree(FOF_SECONDARY_GET_PRIV(tw)->distance);
 }
@@ -26,6 +26,12 @@ struct Group
     double MassType[6];
     double Mass;
     double CM[3];
+    /* Density of the densest gas particle outside the wind, where a black hole is seeded*/
+    double MaxDens;
+    int seed_index;
+    int seed_task;
+
+    /* The fields below are not computed by fof_fof_seeding*/
     double Vel[3];
 
     double Imom[3][3]; /* sum M r_j r_k */
@@ -35,10 +41,8 @@ struct Group
     /*These are used for storing black hole properties*/
     double BH_Mass;
     double BH_Mdot;
-    double MaxDens;
-
-    int seed_index;
-    int seed_task;
+    /* For a subhalo, the GrNr of the FOF group containing it. -1 for FOF groups.*/
+    int ParentGrNr;
 };
 
 /* Structure to hold all allocated FOF groups*/
@@ -49,11 +53,21 @@ typedef struct FOFGroups
      * so can be 32-bit*/
     int Ngroups;
     int64_t TotNgroups;
+    /* True if only the seeding fields of Group were computed*/
+    int SeedingOnly;
+    /* Subhalos found with FOFSubhaloLinkingFraction, or NULL*/
+    struct Group * Subhalo;
+    int Nsubhalos;
+    int64_t TotNsubhalos;
 } FOFGroups;
 
 /*Computes the Group structure, saved as a global array below*/
 FOFGroups fof_fof(ForceTree * tree, double BoxSize, int BlackHoleInfo, MPI_Comm Comm);
 
+/* As fof_fof, but only computes the group fields used for black hole seeding and quasar lightup:
+ * the lengths, masses, centre of mass and the seed particle. The catalogue cannot be saved.*/
+FOFGroups fof_fof_seeding(ForceTree * tree, double BoxSize, int BlackHoleInfo, MPI_Comm Comm);
+
 /*Frees the Group structure*/
 void fof_finish(FOFGroups * fof);
 
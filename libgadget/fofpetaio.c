@@ -18,10 +18,12 @@
 #include "fof.h"
 
 static void fof_register_io_blocks(struct IOTable * IOTable);
-static void fof_write_header(BigFile * bf, int64_t TotNgroups, MPI_Comm Comm);
-static void build_buffer_fof(FOFGroups * fof, BigArray * array, IOTableEntry * ent);
+static void fof_register_subhalo_io_blocks(struct IOTable * IOTable);
+static void fof_write_header(BigFile * bf, int64_t TotNgroups, int64_t TotNsubhalos, int SortedByGroup, MPI_Comm Comm);
+static void build_buffer_fof(struct Group * groups, int ngroups, BigArray * array, IOTableEntry * ent);
 
 static void fof_distribute_particles(struct part_manager_type * halo_pman, struct slots_manager_type * halo_sman, MPI_Comm Comm);
+static void fof_save_particles_streaming(BigFile * bf, MPI_Comm Comm);
 
 static void fof_radix_Group_GrNr(const void * a, void * radix, void * arg);
 static void fof_radix_Group_GrNr(const void * a, void * radix, void * arg) {
@@ -49,7 +51,7 @@ void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Co
     myfree(fname);
 
     MPIU_Barrier(Comm);
-    fof_write_header(&bf, fof->TotNgroups, Comm);
+    fof_write_header(&bf, fof->TotNgroups, fof->TotNsubhalos, SaveParticles != 2, Comm);
 
     for(i = 0; i < FOFIOTable.used; i ++) {
         /* only process the particle blocks */
@@ -58,7 +60,23 @@ void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Co
         BigArray array = {0};
         if(ptype == PTYPE_FOF_GROUP) {
             sprintf(blockname, "FOFGroups/%s", FOFIOTable.ent[i].name);
-            build_buffer_fof(fof, &array, &FOFIOTable.ent[i]);
+            build_buffer_fof(fof->Group, fof->Ngroups, &array, &FOFIOTable.ent[i]);
+            message(0, "Writing Block %s\n", blockname);
+
+            petaio_save_block(&bf, blockname, &array, 1);
+            petaio_destroy_buffer(&array);
+        }
+    }
+    if(fof->Subhalo) {
+        /* The subhalos have the same properties, and the GroupID of their FOF group*/
+        mpsort_mpi(fof->Subhalo, fof->Nsubhalos, sizeof(struct Group),
+                fof_radix_Group_GrNr, 8, NULL, Comm);
+        fof_register_subhalo_io_blocks(&FOFIOTable);
+        for(i = 0; i < FOFIOTable.used; i ++) {
+            char blockname[128];
+            BigArray array = {0};
+            sprintf(blockname, "Subhalos/%s", FOFIOTable.ent[i].name);
+            build_buffer_fof(fof->Subhalo, fof->Nsubhalos, &array, &FOFIOTable.ent[i]);
             message(0, "Writing Block %s\n", blockname);
 
             petaio_save_block(&bf, blockname, &array, 1);
@@ -68,9 +86,13 @@ void fof_save_particles(FOFGroups * fof, int num, int SaveParticles, MPI_Comm Co
     destroy_io_blocks(&FOFIOTable);
     walltime_measure("/FOF/IO/WriteFOF");
 
-    if(SaveParticles) {
+    if(SaveParticles == 2) {
+        fof_save_particles_streaming(&bf, Comm);
+    }
+    else if(SaveParticles) {
         struct IOTable IOTable = {0};
         register_io_blocks(&IOTable);
+        petaio_set_output_compression(&IOTable);
         struct part_manager_type halo_pman;
         struct slots_manager_type halo_sman;
         fof_distribute_particles(&halo_pman, &halo_sman, Comm);
@@ -280,7 +302,7 @@ static void fof_distribute_particles(struct part_manager_type * halo_pman, struc
 #endif
 
     /* sort SPH and Others independently */
-    if(domain_exchange(fof_sorted_layout, targettask, 1, halo_pman, halo_sman, Comm))
+    if(domain_exchange(fof_sorted_layout, targettask, 1, 1, halo_pman, halo_sman, Comm))
         endrun(1930,"Could not exchange particles\n");
 
     myfree(targettask);
@@ -297,21 +319,116 @@ static void fof_distribute_particles(struct part_manager_type * halo_pman, struc
     message(0, "GrNrMax after exchange is %d\n", GrNrMaxGlobal);
 }
 
-static void build_buffer_fof(FOFGroups * fof, BigArray * array, IOTableEntry * ent) {
+static int fof_select_grouped(int i, const struct particle_data * Parts) {
+    return Parts[i].GrNr >= 0;
+}
+
+static int fof_cmp_selection_grnr(const void * a, const void * b) {
+    const int64_t g1 = P[*(const int *) a].GrNr;
+    const int64_t g2 = P[*(const int *) b].GrNr;
+    return (g1 > g2) - (g1 < g2);
+}
+
+/* Write the particles in groups where they are, without fof_distribute_particles.
+ * Each rank writes its own members sorted by type and GrNr, so a group is split
+ * into at most one run per rank. The block %d/GroupRuns has a row for each run:
+ * GrNr, the offset of the run in the particle blocks of the type and its length.
+ * Readers gather the runs of a group from this table.*/
+static void fof_save_particles_streaming(BigFile * bf, MPI_Comm Comm)
+{
+    int i;
+    struct IOTable IOTable = {0};
+    register_io_blocks(&IOTable);
+    petaio_set_output_compression(&IOTable);
+
+    int * selection = mymalloc("Selection", sizeof(int) * PartManager->NumPart);
+
+    int ptype_offset[6]={0};
+    int ptype_count[6]={0};
+    petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, fof_select_grouped);
+
+    int64_t nruns[6] = {0};
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++) {
+        int * sel = selection + ptype_offset[ptype];
+        qsort_openmp(sel, ptype_count[ptype], sizeof(int), fof_cmp_selection_grnr);
+        for(i = 0; i < ptype_count[ptype]; i++)
+            if(i == 0 || P[sel[i]].GrNr != P[sel[i-1]].GrNr)
+                nruns[ptype]++;
+    }
+    walltime_measure("/FOF/IO/argind");
 
-    int64_t npartLocal = fof->Ngroups;
+    int ThisTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    for(ptype = 0; ptype < 6; ptype++) {
+        /* Offset of the particles of this rank in the blocks of the type*/
+        int64_t start = ptype_count[ptype];
+        MPI_Exscan(MPI_IN_PLACE, &start, 1, MPI_INT64, MPI_SUM, Comm);
+        if(ThisTask == 0)
+            start = 0;
+        int64_t ntot = nruns[ptype];
+        MPI_Allreduce(MPI_IN_PLACE, &ntot, 1, MPI_INT64, MPI_SUM, Comm);
+        if(ntot == 0)
+            continue;
+
+        int64_t * runs = mymalloc("GroupRuns", 3 * sizeof(int64_t) * (nruns[ptype] + 1));
+        const int * sel = selection + ptype_offset[ptype];
+        int64_t n = -1;
+        for(i = 0; i < ptype_count[ptype]; i++) {
+            if(i == 0 || P[sel[i]].GrNr != P[sel[i-1]].GrNr) {
+                n++;
+                runs[3 * n] = P[sel[i]].GrNr;
+                runs[3 * n + 1] = start + i;
+                runs[3 * n + 2] = 0;
+            }
+            runs[3 * n + 2]++;
+        }
+        char blockname[128];
+        sprintf(blockname, "%d/GroupRuns", ptype);
+        BigArray array = {0};
+        size_t dims[2] = {nruns[ptype], 3};
+        ptrdiff_t strides[2] = {3 * sizeof(int64_t), sizeof(int64_t)};
+        big_array_init(&array, runs, "i8", 2, dims, strides);
+        message(0, "Writing Block %s\n", blockname);
+        petaio_save_block(bf, blockname, &array, 1);
+        myfree(runs);
+    }
+
+    for(i = 0; i < IOTable.used; i ++) {
+        /* only process the particle blocks */
+        char blockname[128];
+        ptype = IOTable.ent[i].ptype;
+        BigArray array = {0};
+        if(ptype < 6 && ptype >= 0) {
+            sprintf(blockname, "%d/%s", ptype, IOTable.ent[i].name);
+            petaio_build_buffer(&array, &IOTable.ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
+
+            message(0, "Writing Block %s\n", blockname);
+
+            petaio_save_block(bf, blockname, &array, 1);
+            petaio_destroy_buffer(&array);
+        }
+    }
+    myfree(selection);
+    walltime_measure("/FOF/IO/WriteParticles");
+    destroy_io_blocks(&IOTable);
+}
+
+static void build_buffer_fof(struct Group * groups, int ngroups, BigArray * array, IOTableEntry * ent) {
+
+    int64_t npartLocal = ngroups;
 
     petaio_alloc_buffer(array, ent, npartLocal);
     /* fill the buffer */
     char * p = array->data;
     int i;
-    for(i = 0; i < fof->Ngroups; i ++) {
-        ent->getter(i, p, fof->Group, NULL);
+    for(i = 0; i < ngroups; i ++) {
+        ent->getter(i, p, groups, NULL);
         p += array->strides[0];
     }
 }
 
-static void fof_write_header(BigFile * bf, int64_t TotNgroups, MPI_Comm Comm) {
+static void fof_write_header(BigFile * bf, int64_t TotNgroups, int64_t TotNsubhalos, int SortedByGroup, MPI_Comm Comm) {
     BigBlock bh;
     if(0 != big_file_mpi_create_block(bf, &bh, "Header", NULL, 0, 0, 0, Comm)) {
         endrun(0, "Failed to create header\n");
@@ -339,6 +456,9 @@ static void fof_write_header(BigFile * bf, int64_t TotNgroups, MPI_Comm Comm) {
     }
     big_block_set_attr(&bh, "NumPartInGroupTotal", npartTotal, "u8", 6);
     big_block_set_attr(&bh, "NumFOFGroupsTotal", &TotNgroups, "u8", 1);
+    big_block_set_attr(&bh, "NumSubhalosTotal", &TotNsubhalos, "u8", 1);
+    /* If zero the particles are in rank order, and the GroupRuns blocks locate each group*/
+    big_block_set_attr(&bh, "ParticlesSortedByGroup", &SortedByGroup, "i4", 1);
     big_block_set_attr(&bh, "RSDFactor", &RSD, "f8", 1);
     big_block_set_attr(&bh, "MassTable", All.MassTable, "f8", 6);
     big_block_set_attr(&bh, "Time", &All.Time, "f8", 1);
@@ -383,6 +503,7 @@ SIMPLE_PROPERTY_FOF(LengthByType, LenType[0], uint32_t , 6)
 SIMPLE_PROPERTY_FOF(StarFormationRate, Sfr, float, 1)
 SIMPLE_PROPERTY_FOF(BlackholeMass, BH_Mass, float, 1)
 SIMPLE_PROPERTY_FOF(BlackholeAccretionRate, BH_Mdot, float, 1)
+SIMPLE_GETTER(GTParentGroupID, ParentGrNr, int32_t, 1, struct Group)
 
 static void fof_register_io_blocks(struct IOTable * IOTable) {
     IOTable->used = 0;
@@ -408,3 +529,8 @@ static void fof_register_io_blocks(struct IOTable * IOTable) {
         IO_REG(BlackholeAccretionRate, "f4", 1, PTYPE_FOF_GROUP, IOTable);
     }
 }
+
+/* Extra blocks of the subhalo catalogue, on top of those of fof_register_io_blocks*/
+static void fof_register_subhalo_io_blocks(struct IOTable * IOTable) {
+    IO_REG_WRONLY(ParentGroupID, "i4", 1, PTYPE_FOF_GROUP, IOTable);
+}
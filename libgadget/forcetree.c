@@ -37,6 +37,10 @@ static struct forcetree_params
     double TreeAllocFactor;
     /*!< flags the particle species which will be excluded from the tree if the HybridNuGrav parameter is set.*/
     int FastParticleType;
+    /* If 1, store the particles of each leaf contiguously in ForceTree.LeafParticles*/
+    int TreeLeafRanges;
+    /* A refitted node may grow by this fraction of its side length to cover particles which drifted out of it*/
+    double TreeRefitSlack;
 } ForceTreeParams;
 
 void
@@ -44,6 +48,20 @@ init_forcetree_params(const int FastParticleType, const double * GravitySoftenin
 {
     ForceTreeParams.TreeAllocFactor = 0.7;
     ForceTreeParams.FastParticleType = FastParticleType;
+    ForceTreeParams.TreeRefitSlack = 0;
+}
+
+void
+set_forcetree_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        ForceTreeParams.TreeLeafRanges = param_get_int(ps, "TreeLeafRanges");
+        ForceTreeParams.TreeRefitSlack = param_get_double(ps, "TreeRefitSlack");
+    }
+    MPI_Bcast(&ForceTreeParams.TreeLeafRanges, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&ForceTreeParams.TreeRefitSlack, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
 }
 
 static ForceTree
@@ -71,19 +89,27 @@ force_exchange_pseudodata(ForceTree * tree, const DomainDecomp * ddecomp);
 static void
 force_insert_pseudo_particles(const ForceTree * tree, const DomainDecomp * ddecomp);
 
+static void
+force_tree_build_leaf_ranges(ForceTree * tree);
+
 static int
-force_tree_eh_slots_fork(EIBase * event, void * userdata)
+force_tree_eh_slots_fork(EIBase * event, int nevent, void * userdata)
 {
-    /* after a fork, we will attach the new particle to the force tree. */
+    /* after a fork, we will attach the new particles to the force tree. */
     EISlotsFork * ev = (EISlotsFork*) event;
-    int parent = ev->parent;
-    int child = ev->child;
-    int no;
     ForceTree * tree = (ForceTree * ) userdata;
-    no = tree->Nextnode[parent];
-    tree->Nextnode[parent] = child;
-    tree->Nextnode[child] = no;
-    tree->Father[child] = tree->Father[parent];
+    int i;
+    for(i = 0; i < nevent; i++) {
+        const int parent = ev[i].parent;
+        const int child = ev[i].child;
+        const int no = tree->Nextnode[parent];
+        tree->Nextnode[parent] = child;
+        tree->Nextnode[child] = no;
+        tree->Father[child] = tree->Father[parent];
+    }
+    tree->NumParticles += nevent;
+    /* The new particles are not in the leaf ranges: walk the Nextnode list until they are rebuilt*/
+    tree->leafranges_flag = 0;
 
     return 0;
 }
@@ -107,7 +133,7 @@ force_tree_rebuild(ForceTree * tree, DomainDecomp * ddecomp, const double BoxSiz
 
     *tree = force_tree_build(PartManager->NumPart, ddecomp, BoxSize, HybridNuGrav);
 
-    event_listen(&EventSlotsFork, force_tree_eh_slots_fork, tree);
+    event_listen_batch(&EventSlotsFork, force_tree_eh_slots_fork, tree);
 
     MPIU_Barrier(MPI_COMM_WORLD);
     message(0, "Tree construction done.\n");
@@ -160,6 +186,15 @@ ForceTree force_tree_build(int npart, DomainDecomp * ddecomp, const double BoxSi
     }
     walltime_measure("/Tree/Build/Nodes");
 
+    /* Count the particles in the tree, so force_tree_refit can tell when some are removed*/
+    int i, nintree = 0;
+    #pragma omp parallel for reduction(+: nintree)
+    for(i = 0; i < npart; i++)
+        if(!P[i].IsGarbage && !P[i].Swallowed)
+            nintree++;
+    tree.NumParticles = nintree;
+    tree.HybridNuGrav = HybridNuGrav;
+
     /* insert the pseudo particles that represent the mass distribution of other ddecomps */
     force_insert_pseudo_particles(&tree, ddecomp);
 
@@ -177,6 +212,8 @@ ForceTree force_tree_build(int npart, DomainDecomp * ddecomp, const double BoxSi
     tree.numnodes = Numnodestree;
     tree.Nodes = tree.Nodes_base - tree.firstnode;
 
+    force_tree_build_leaf_ranges(&tree);
+
     return tree;
 }
 
@@ -207,8 +244,8 @@ static inline int inside_node(const struct NODE * node, const int p_i)
     return inside;
 }
 
-/*Initialise an internal node at nfreep. The parent is assumed to be locked, and
- * we have assured that nothing else will change nfreep while we are here.*/
+/*Initialise an internal node at nfreep. The parent is assumed to be owned by
+ * the calling thread, so nothing else will change nfreep while we are here.*/
 static void init_internal_node(struct NODE *nfreep, struct NODE *parent, int subnode)
 {
     int j;
@@ -256,7 +293,7 @@ int get_freenode(int * nnext, struct NodeCache *nc)
 }
 
 /* Add a particle to a node in a known empty location.
- * Parent is assumed to be locked.*/
+ * The node is owned by the calling thread.*/
 static int
 modify_internal_node(int parent, int subnode, int p_toplace, const ForceTree tb)
 {
@@ -265,9 +302,8 @@ modify_internal_node(int parent, int subnode, int p_toplace, const ForceTree tb)
     return 0;
 }
 
-
 /* Create a new layer of nodes beneath the current node, and place the particle.
- * Must have node lock.*/
+ * The node must be owned by the calling thread.*/
 static int
 create_new_node_layer(int firstparent, int p_toplace,
         const ForceTree tb, int *nnext, struct NodeCache *nc)
@@ -335,23 +371,139 @@ create_new_node_layer(int firstparent, int p_toplace,
          * Iterate, creating a new layer beneath.*/
         else {
             /* The current child is going to have new nodes created beneath it,
-             * so mark it a Node-containing node. It cannot be accessed until
-             * we mark the top-level parent, so no need for atomics.*/
+             * so mark it a Node-containing node.*/
             tb.Nodes[child].f.ChildType = NODE_NODE_TYPE;
             tb.Nodes[child].u.s.noccupied = (1<<16);
             parent = child;
         }
     } while(1);
 
-    /* A new node is created. Mark the (original) parent as an internal node with node children.
-     * This goes last so that we don't access the child before it is constructed.*/
+    /* A new node is created. Mark the (original) parent as an internal node with node children.*/
     tb.Nodes[firstparent].f.ChildType = NODE_NODE_TYPE;
-    #pragma omp atomic write
     tb.Nodes[firstparent].u.s.noccupied = (1<<16);
     return 0;
 }
 
+/* Deepest level below a top-level leaf used to divide the tree build between threads.*/
+#define TREEBUILD_MAX_DEPTH 4
+
+/* Insert the n particles in list into the subtree beneath node, which is owned by the calling thread.
+ * Returns 1 if we ran out of nodes.*/
+static int
+force_tree_insert_particles(const int node, const int * list, const int n, const ForceTree tb, int * nnext, struct NodeCache * nc)
+{
+    /* Stores the last-seen node.
+     * Since most particles are close to each other, this should save a number of tree walks.*/
+    int this_acc = node;
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        const int p_i = list[i];
+        int this = inside_node(&tb.Nodes[this_acc], p_i) ? this_acc : node;
+
+        /*Walk the subtree until we get something that isn't an internal node.*/
+        while(tb.Nodes[this].u.s.noccupied >= (1 << 16)) {
+            const int child = tb.Nodes[this].u.s.suns[get_subnode(&tb.Nodes[this], p_i)];
+            if(child > tb.lastnode || child < tb.firstnode)
+                endrun(1,"Corruption in tree build: N[%d] child %d > lastnode (%d)\n",this, child, tb.lastnode);
+            this = child;
+        }
+        this_acc = this;
+
+        const int nocc = tb.Nodes[this].u.s.noccupied++;
+        if(nocc < NMAXCHILD)
+            modify_internal_node(this, nocc, p_i, tb);
+        /* In this case we need to create a new layer of nodes beneath this one*/
+        else if(create_new_node_layer(this, p_i, tb, nnext, nc))
+            return 1;
+    }
+    return 0;
+}
+
+/* Find the cell containing a particle at a given depth beneath a node.
+ * The cell centers are computed exactly as in init_internal_node, so the cell
+ * is the node the particle will be placed beneath.
+ * Returns the subnode at each level, packed three bits per level with the top level first.*/
+static int
+treebuild_get_cell(const struct NODE * node, const int p_i, const int depth)
+{
+    MyFloat center[3];
+    MyFloat len = node->len;
+    int cell = 0;
+    int d, j;
+    for(j = 0; j < 3; j++)
+        center[j] = node->center[j];
+    for(d = 0; d < depth; d++) {
+        const int subnode = (P[p_i].Pos[0] > center[0]) +
+            ((P[p_i].Pos[1] > center[1]) << 1) +
+            ((P[p_i].Pos[2] > center[2]) << 2);
+        cell = (cell << 3) + subnode;
+        const MyFloat lenhalf = 0.25 * len;
+        for(j = 0; j < 3; j++) {
+            const int sign = (subnode & (1 << j)) ? 1 : -1;
+            center[j] = center[j] + sign*lenhalf;
+        }
+        len = 0.5 * len;
+    }
+    return cell;
+}
+
+/* A range of particles to be inserted beneath a node by one thread*/
+struct TreeBuildItem
+{
+    int node;
+    int start;
+    int n;
+};
+
+/* Create the nodes beneath a top-level leaf down to the cells used to divide the work,
+ * splitting only nodes with more than NMAXCHILD particles, as the insertion would.
+ * Each cell has ncells buckets of particles, starting at bucket.
+ * A work item is added for every node which is not split further.*/
+static void
+treebuild_create_cell_nodes(const int node, const int bucket, const int ncells, const int * bucketstart,
+        const ForceTree tb, int * nnext, struct TreeBuildItem * items, int * nitems)
+{
+    const int start = bucketstart[bucket];
+    const int n = bucketstart[bucket + ncells] - start;
+    if(n == 0)
+        return;
+    if(ncells == 1 || n <= NMAXCHILD) {
+        items[*nitems].node = node;
+        items[*nitems].start = start;
+        items[*nitems].n = n;
+        (*nitems)++;
+        return;
+    }
+    if(*nnext + 8 >= tb.lastnode) {
+        *nnext = tb.lastnode;
+        return;
+    }
+    struct NODE * nprnt = &tb.Nodes[node];
+    int i;
+    for(i = 0; i < 8; i++) {
+        nprnt->u.s.suns[i] = (*nnext)++;
+        struct NODE *nfreep = &tb.Nodes[nprnt->u.s.suns[i]];
+        init_internal_node(nfreep, nprnt, i);
+        nfreep->father = node;
+    }
+    for(i = 8; i < NMAXCHILD; i++)
+        nprnt->u.s.suns[i] = -1;
+    nprnt->f.ChildType = NODE_NODE_TYPE;
+    nprnt->u.s.noccupied = (1<<16);
+
+    for(i = 0; i < 8; i++)
+        treebuild_create_cell_nodes(nprnt->u.s.suns[i], bucket + i * (ncells / 8), ncells / 8, bucketstart, tb, nnext, items, nitems);
+}
+
 /*! Does initial creation of the nodes for the gravitational oct-tree.
+ *
+ * The particles are first sorted by cell: each local top-level leaf is
+ * divided into 8^depth cells, with depth chosen so there are several cells
+ * per thread. As the leaves are contiguous ranges of Peano key, this is a sort by key
+ * at a resolution a little finer than the domain. The nodes above the cells are created
+ * serially, and then the particles in each cell are inserted by a single thread.
+ * The cells do not overlap, so no locks are needed.
  **/
 int force_tree_create_nodes(const ForceTree tb, const int npart, DomainDecomp * ddecomp, const double BoxSize)
 {
@@ -380,6 +532,92 @@ int force_tree_create_nodes(const ForceTree tb, const int npart, DomainDecomp *
         force_create_node_for_topnode(tb.firstnode, 0, tb.Nodes, ddecomp, 1, 0, 0, 0, &nnext, tb.lastnode);
     }
 
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const int NThread = omp_get_max_threads();
+
+    /* Number the top-level leaves on this processor*/
+    int * localleaf = ta_malloc("LocalLeaf", int, ddecomp->NTopLeaves);
+    int NLocalLeaves = 0;
+    for(i = 0; i < ddecomp->NTopLeaves; i++) {
+        localleaf[i] = -1;
+        if(ddecomp->TopLeaves[i].Task == ThisTask)
+            localleaf[i] = NLocalLeaves++;
+    }
+
+    /* Enough cells that the threads can balance the work*/
+    int depth = 0;
+    while(depth < TREEBUILD_MAX_DEPTH && NLocalLeaves * (1 << (3 * depth)) < 16 * NThread)
+        depth++;
+    const int ncells = 1 << (3 * depth);
+    /* The last bucket holds the particles not in the tree.*/
+    const int nbucket = NLocalLeaves * ncells + 1;
+
+    int * list = mymalloc2("TreeBuildList", sizeof(int) * (npart + 1));
+    int * bucket = mymalloc2("TreeBuildBucket", sizeof(int) * (npart + 1));
+    /* Start of each thread's part in each bucket*/
+    int * offset = ta_malloc("BucketOffset", int, nbucket * NThread);
+    memset(offset, 0, nbucket * NThread * sizeof(int));
+    int * bucketstart = ta_malloc("BucketStart", int, nbucket + 1);
+    int BadLeaf = -1;
+
+#pragma omp parallel num_threads(NThread)
+    {
+        const int tid = omp_get_thread_num();
+        const int nthr = omp_get_num_threads();
+        const int start = ((int64_t) tid) * npart / nthr;
+        const int end = ((int64_t) tid + 1) * npart / nthr;
+        int * myoffset = offset + tid * nbucket;
+        int j;
+        for(j = start; j < end; j++) {
+            bucket[j] = nbucket - 1;
+            /* Do not add garbage/swallowed particles to the tree*/
+            if(P[j].IsGarbage || P[j].Swallowed)
+                continue;
+            const int topleaf = domain_get_topleaf(P[j].Key, ddecomp);
+            if(localleaf[topleaf] < 0) {
+                #pragma omp atomic write
+                BadLeaf = j;
+                continue;
+            }
+            const struct NODE * leafnode = &tb.Nodes[ddecomp->TopLeaves[topleaf].treenode];
+            bucket[j] = localleaf[topleaf] * ncells + treebuild_get_cell(leafnode, j, depth);
+        }
+        for(j = start; j < end; j++)
+            myoffset[bucket[j]]++;
+#pragma omp barrier
+        /* Turn the counts into offsets, ordered by bucket and then by thread*/
+#pragma omp single
+        {
+            int total = 0;
+            int b, t;
+            for(b = 0; b < nbucket; b++) {
+                bucketstart[b] = total;
+                for(t = 0; t < nthr; t++) {
+                    const int count = offset[t * nbucket + b];
+                    offset[t * nbucket + b] = total;
+                    total += count;
+                }
+            }
+            bucketstart[nbucket] = total;
+        }
+        for(j = start; j < end; j++)
+            list[myoffset[bucket[j]]++] = j;
+    }
+
+    if(BadLeaf >= 0)
+        endrun(5, "Particle %d at %g %g %g is in topleaf %d on task %d\n", BadLeaf, P[BadLeaf].Pos[0], P[BadLeaf].Pos[1], P[BadLeaf].Pos[2],
+               domain_get_topleaf(P[BadLeaf].Key, ddecomp), ddecomp->TopLeaves[domain_get_topleaf(P[BadLeaf].Key, ddecomp)].Task);
+
+    /* Create the nodes above the cells*/
+    struct TreeBuildItem * items = ta_malloc("TreeBuildItems", struct TreeBuildItem, nbucket);
+    int nitems = 0;
+    for(i = 0; i < ddecomp->NTopLeaves; i++) {
+        if(localleaf[i] < 0)
+            continue;
+        treebuild_create_cell_nodes(ddecomp->TopLeaves[i].treenode, localleaf[i] * ncells, ncells, bucketstart, tb, &nnext, items, &nitems);
+    }
+
     /* This implements a small thread-local free Node cache.
      * The cache ensures that Nodes from the same (or close) particles
      * are created close to each other on the Node list and thus
@@ -389,110 +627,23 @@ int force_tree_create_nodes(const ForceTree tb, const int npart, DomainDecomp *
     struct NodeCache nc;
     nc.nnext_thread = nnext;
     nc.nrem_thread = 0;
-    /* Stores the last-seen node on this thread.
-     * Since most particles are close to each other, this should save a number of tree walks.*/
-    int this_acc = tb.firstnode;
-    /*Initialise some spinlocks off*/
-    struct SpinLocks * spin = init_spinlocks(tb.lastnode - tb.firstnode);
 
     /* now we insert all particles */
-    #pragma omp parallel for firstprivate(nc, this_acc)
-    for(i = 0; i < npart; i++)
+    #pragma omp parallel for schedule(dynamic) firstprivate(nc)
+    for(i = 0; i < nitems; i++)
     {
         /*Can't break from openmp for*/
         if(nc.nnext_thread >= tb.lastnode-1)
             continue;
-
-        /* Do not add garbage/swallowed particles to the tree*/
-        if(P[i].IsGarbage || P[i].Swallowed)
-            continue;
-
-        /*First find the Node for the TopLeaf */
-        int this;
-        if(inside_node(&tb.Nodes[this_acc], i)) {
-            this = this_acc;
-        } else {
-            const int topleaf = domain_get_topleaf(P[i].Key, ddecomp);
-            this = ddecomp->TopLeaves[topleaf].treenode;
-        }
-        int child;
-        int nocc;
-
-        /*Walk the main tree until we get something that isn't an internal node.*/
-        do
-        {
-            /*No lock needed: if we have an internal node here it will be stable*/
-            #pragma omp atomic read
-            nocc = tb.Nodes[this].u.s.noccupied;
-
-            /* This node still has space for a particle (or needs conversion)*/
-            if(nocc < (1 << 16))
-                break;
-
-            /* This node has child subnodes: find them.*/
-            int subnode = get_subnode(&tb.Nodes[this], i);
-            /*No lock needed: if we have an internal node here it will be stable*/
-            child = tb.Nodes[this].u.s.suns[subnode];
-
-            if(child > tb.lastnode || child < tb.firstnode)
-                endrun(1,"Corruption in tree build: N[%d].[%d] = %d > lastnode (%d)\n",this, subnode, child, tb.lastnode);
-            this = child;
-        }
-        while(child >= tb.firstnode);
-
-        /*Now lock this node.*/
-        lock_spinlock(this-tb.firstnode, spin);
-        /* We have a guaranteed spot.*/
-        nocc = atomic_fetch_and_add(&tb.Nodes[this].u.s.noccupied, 1);
-
-        /* Check whether there is now a new layer of nodes and if so walk down until there isn't.*/
-        if(nocc >= (1<<16)) {
-            /* This node has child subnodes: find them.*/
-            int subnode = get_subnode(&tb.Nodes[this], i);
-            child = tb.Nodes[this].u.s.suns[subnode];
-            while(child >= tb.firstnode)
-            {
-                /*Move the lock to the child*/
-                lock_spinlock(child-tb.firstnode, spin);
-                unlock_spinlock(this-tb.firstnode, spin);
-                this = child;
-
-                /*No lock needed: if we have an internal node here it will be stable*/
-                #pragma omp atomic read
-                nocc = tb.Nodes[this].u.s.noccupied;
-                /* This node still has space for a particle (or needs conversion)*/
-                if(nocc < (1 << 16))
-                    break;
-
-                /* This node has child subnodes: find them.*/
-                subnode = get_subnode(&tb.Nodes[this], i);
-                /*No lock needed: if we have an internal node here it will be stable*/
-                child = tb.Nodes[this].u.s.suns[subnode];
-            }
-            /* Get the free spot under the lock.*/
-            nocc = atomic_fetch_and_add(&tb.Nodes[this].u.s.noccupied, 1);
-        }
-
-        /*Update last-used cache*/
-        this_acc = this;
-
-        /* Now we have something that isn't an internal node, and we have a lock on it,
-         * so we know it won't change. We can place the particle! */
-        if(nocc < NMAXCHILD)
-            modify_internal_node(this, nocc, i, tb);
-        /* In this case we need to create a new layer of nodes beneath this one*/
-        else if(nocc < 1<<16)
-            create_new_node_layer(this, i, tb, &nnext, &nc);
-        else
-            endrun(2, "Tried to convert already converted node %d with nocc = %d\n", this, nocc);
-
-        /* Add an explicit flush because we are not using openmp's critical sections */
-        #pragma omp flush
-
-        /*Unlock the parent*/
-        unlock_spinlock(this - tb.firstnode, spin);
+        force_tree_insert_particles(items[i].node, list + items[i].start, items[i].n, tb, &nnext, &nc);
     }
-    free_spinlocks(spin);
+
+    ta_free(items);
+    ta_free(bucketstart);
+    ta_free(offset);
+    myfree(bucket);
+    myfree(list);
+    ta_free(localleaf);
 
     return nnext - tb.firstnode;
 }
@@ -567,6 +718,7 @@ force_zero_union(struct NODE * node)
     node->u.d.MaxSoftening = -1;
     node->f.DependsOnLocalMass = 0;
     node->f.MixedSofteningsInNode = 0;
+    node->f.TypeMask = 0;
 }
 
 /*! this function inserts pseudo-particles which will represent the mass
@@ -663,12 +815,15 @@ force_get_prev_node(int no, const ForceTree * tree)
     }
 }
 
-/* Sets the node softening on a node.
+/* Sets the node softening on a node, from a particle or child node with softenings between MinSoftening and MaxSoftening.
  *
  * */
 static void
-force_adjust_node_softening(struct NODE * pnode, double MaxSoftening, int mixed)
+force_adjust_node_softening(struct NODE * pnode, double MaxSoftening, double MinSoftening, int mixed)
 {
+    /* Empty children have no softening*/
+    if(MaxSoftening > 0 && (pnode->u.d.MaxSoftening <= 0 || MinSoftening < pnode->u.d.MinSoftening))
+        pnode->u.d.MinSoftening = MinSoftening;
 
     if(pnode->u.d.MaxSoftening > 0) {
         /* already set? mark MixedSoftenings */
@@ -698,7 +853,7 @@ add_particle_moment_to_node(struct NODE * pnode, int i)
             pnode->u.d.hmax = P[i].Hsml;
     }
 
-    force_adjust_node_softening(pnode, FORCE_SOFTENING(i), 0);
+    force_adjust_node_softening(pnode, FORCE_SOFTENING(i), FORCE_SOFTENING(i), 0);
 }
 
 /*Get the sibling of a node, using the suns array. Only to be used in the tree build, before update_node_recursive is called.*/
@@ -755,6 +910,8 @@ force_update_particle_node(int no, int sib, const ForceTree * tree, const int Hy
     /*Now we do the moments*/
     for(j = 0; j < noccupied; j++) {
         const int p = suns[j];
+        /* Non-gravitating particles are still in the node, so always set their type*/
+        tree->Nodes[no].f.TypeMask |= force_type_mask(P[p].Type);
         /*Hybrid particle neutrinos do not gravitate at early times.
             * So do not add their masses to the node*/
         if(!HybridNuGrav || P[p].Type != ForceTreeParams.FastParticleType)
@@ -876,8 +1033,9 @@ force_update_node_recursive(int no, int sib, int level, const ForceTree * tree,
         tree->Nodes[no].u.d.s[2] += (tree->Nodes[p].u.d.mass * tree->Nodes[p].u.d.s[2]);
         if(tree->Nodes[p].u.d.hmax > tree->Nodes[no].u.d.hmax)
             tree->Nodes[no].u.d.hmax = tree->Nodes[p].u.d.hmax;
+        tree->Nodes[no].f.TypeMask |= tree->Nodes[p].f.TypeMask;
 
-        force_adjust_node_softening(&tree->Nodes[no], tree->Nodes[p].u.d.MaxSoftening, tree->Nodes[p].f.MixedSofteningsInNode);
+        force_adjust_node_softening(&tree->Nodes[no], tree->Nodes[p].u.d.MaxSoftening, tree->Nodes[p].u.d.MinSoftening, tree->Nodes[p].f.MixedSofteningsInNode);
     }
 
     /*Set the center of mass moments*/
@@ -938,6 +1096,276 @@ force_update_node_parallel(const ForceTree * tree, const int HybridNuGrav)
     return tail;
 }
 
+/* This function zeros the moments of a node for force_tree_refit,
+ * leaving the nextnode and sibling pointers (and DependsOnLocalMass) intact.*/
+static void
+force_refit_zero_moments(struct NODE * node)
+{
+    memset(&(node->u.d.s),0,3*sizeof(MyFloat));
+    node->u.d.mass = 0;
+    node->u.d.hmax = 0;
+    node->u.d.MaxSoftening = -1;
+    node->f.MixedSofteningsInNode = 0;
+    node->f.TypeMask = 0;
+}
+
+/* Relative roundoff in the extent computed by force_refit_node_recursive:
+ * a node whose contents did not move may still need a length a few ulp larger than it was built with.*/
+#define REFIT_LEN_ROUNDOFF 1e-6
+
+/* Set the side length of a refitted node to cover its contents, which may have drifted out of it.
+ * buildlen is the side length the node was built with. The node may grow by at most TreeRefitSlack,
+ * and top level nodes may not grow at all, as other ranks hold copies of them: otherwise set *failed.
+ * Growth below REFIT_LEN_ROUNDOFF is roundoff and keeps the built length.*/
+static void
+force_refit_node_len(struct NODE * node, const double buildlen, const double needed, int * failed)
+{
+    const int grew = needed > buildlen * (1 + REFIT_LEN_ROUNDOFF);
+    node->len = grew ? needed : buildlen;
+    if(needed > buildlen * (1 + ForceTreeParams.TreeRefitSlack + REFIT_LEN_ROUNDOFF) || (node->f.TopLevel && grew)) {
+        #pragma omp atomic write
+        *failed = 1;
+    }
+}
+
+/* Recompute the moments of a node and all its subnodes, following the
+ * nextnode and sibling lists instead of the (now overwritten) suns array.
+ * Computes the same moments as force_update_node_recursive,
+ * and spawns openmp tasks in the same way.
+ * Nodes are enlarged to cover particles that drifted out of them, see force_refit_node_len.
+ * buildlen is the side length the node was built with, half that of its parent.*/
+static void
+force_refit_node_recursive(int no, int level, const double buildlen, const ForceTree * tree, const int HybridNuGrav, int * failed)
+{
+    struct NODE * node = &tree->Nodes[no];
+    const int sib = node->u.d.sibling;
+    int j, p;
+
+    force_refit_zero_moments(node);
+
+    /* Pseudo particle moments are set by the exchange*/
+    if(node->f.ChildType == PSEUDO_NODE_TYPE)
+        return;
+
+    if(node->f.ChildType == PARTICLE_NODE_TYPE) {
+        double maxdist = 0;
+        /* The particles of a node are the start of its nextnode list*/
+        for(p = node->u.d.nextnode; p >= 0 && node_is_particle(p, tree); p = tree->Nextnode[p]) {
+            node->f.TypeMask |= force_type_mask(P[p].Type);
+            if(!HybridNuGrav || P[p].Type != ForceTreeParams.FastParticleType)
+                add_particle_moment_to_node(node, p);
+            for(j = 0; j < 3; j++)
+                maxdist = DMAX(maxdist, fabs(P[p].Pos[j] - node->center[j]));
+        }
+        force_refit_node_len(node, buildlen, 2 * maxdist, failed);
+        const double mass = node->u.d.mass;
+        /* Be careful about empty nodes*/
+        if(mass > 0) {
+            for(j = 0; j < 3; j++)
+                node->u.d.s[j] /= mass;
+        }
+        else {
+            for(j = 0; j < 3; j++)
+                node->u.d.s[j] = node->center[j];
+        }
+        return;
+    }
+
+    /* The children of a node are its nextnode and then the chain of siblings,
+     * ending at the sibling of this node. Count the node children for thread balancing.*/
+    int childcnt = 0;
+    for(p = node->u.d.nextnode; p != sib; p = tree->Nodes[p].u.d.sibling)
+        if(tree->Nodes[p].f.ChildType == NODE_NODE_TYPE)
+            childcnt++;
+
+    for(p = node->u.d.nextnode; p != sib; p = tree->Nodes[p].u.d.sibling)
+    {
+        if(tree->Nodes[p].f.ChildType == NODE_NODE_TYPE && childcnt > 1 && level < 256) {
+            #pragma omp task shared(level, childcnt, tree, failed) firstprivate(p)
+            force_refit_node_recursive(p, level*childcnt, buildlen / 2, tree, HybridNuGrav, failed);
+        }
+        else
+            force_refit_node_recursive(p, level, buildlen / 2, tree, HybridNuGrav, failed);
+    }
+
+    /*Make sure all child nodes are done*/
+    #pragma omp taskwait
+
+    double needed = 0;
+    for(p = node->u.d.nextnode; p != sib; p = tree->Nodes[p].u.d.sibling)
+    {
+        /* Cover the children, which may have been enlarged*/
+        for(j = 0; j < 3; j++)
+            needed = DMAX(needed, 2 * fabs(tree->Nodes[p].center[j] - node->center[j]) + tree->Nodes[p].len);
+        node->u.d.mass += (tree->Nodes[p].u.d.mass);
+        node->u.d.s[0] += (tree->Nodes[p].u.d.mass * tree->Nodes[p].u.d.s[0]);
+        node->u.d.s[1] += (tree->Nodes[p].u.d.mass * tree->Nodes[p].u.d.s[1]);
+        node->u.d.s[2] += (tree->Nodes[p].u.d.mass * tree->Nodes[p].u.d.s[2]);
+        if(tree->Nodes[p].u.d.hmax > node->u.d.hmax)
+            node->u.d.hmax = tree->Nodes[p].u.d.hmax;
+        node->f.TypeMask |= tree->Nodes[p].f.TypeMask;
+
+        force_adjust_node_softening(node, tree->Nodes[p].u.d.MaxSoftening, tree->Nodes[p].u.d.MinSoftening, tree->Nodes[p].f.MixedSofteningsInNode);
+    }
+
+    const double mass = node->u.d.mass;
+    if(mass > 0) {
+        node->u.d.s[0] /= mass;
+        node->u.d.s[1] /= mass;
+        node->u.d.s[2] /= mass;
+    }
+    force_refit_node_len(node, buildlen, needed, failed);
+}
+
+/* Store the particles of each leaf contiguously, in the order of the Nextnode list,
+ * so that the tree walks can loop over a leaf instead of following Nextnode.
+ * If the hybrid neutrinos do not gravitate they go at the end of each leaf,
+ * so the gravity walks can stop before them.
+ * The ranges are not used if a leaf has more particles than fit in NODE.f.NumParticles,
+ * which may happen once forked particles have been attached.*/
+/* A hybrid neutrino which does not gravitate in this tree*/
+static inline int
+force_is_tracer(const int p, const ForceTree * tree)
+{
+    return tree->HybridNuGrav && P[p].Type == ForceTreeParams.FastParticleType;
+}
+
+static void
+force_tree_build_leaf_ranges(ForceTree * tree)
+{
+    tree->leafranges_flag = 0;
+    if(!tree->LeafParticles)
+        return;
+
+    const int endnode = tree->firstnode + tree->numnodes;
+    int i, toomany = 0;
+    /* Count the particles of each leaf*/
+    #pragma omp parallel for reduction(+: toomany)
+    for(i = tree->firstnode; i < endnode; i++)
+    {
+        struct NODE * node = &tree->Nodes[i];
+        int p, n = 0, ngrav = 0;
+        if(node->f.ChildType == PARTICLE_NODE_TYPE)
+            for(p = node->u.d.nextnode; p >= 0 && node_is_particle(p, tree); p = tree->Nextnode[p]) {
+                n++;
+                if(!force_is_tracer(p, tree))
+                    ngrav++;
+            }
+        if(n > LEAFRANGE_MAX) {
+            toomany++;
+            n = ngrav = 0;
+        }
+        node->f.NumParticles = n;
+        node->f.NumGravParticles = ngrav;
+    }
+    if(toomany > 0) {
+        message(1, "%d leaves have too many particles for leaf ranges.\n", toomany);
+        return;
+    }
+
+    /* The particles take the first positions, so the start of each leaf can be stored at its node number*/
+    int start = 0;
+    for(i = tree->firstnode; i < endnode; i++) {
+        tree->LeafParticles[i] = start;
+        start += tree->Nodes[i].f.NumParticles;
+    }
+
+    #pragma omp parallel for
+    for(i = tree->firstnode; i < endnode; i++)
+    {
+        const struct NODE * node = &tree->Nodes[i];
+        int p, k = tree->LeafParticles[i];
+        int kt = k + node->f.NumGravParticles;
+        if(node->f.NumParticles == 0)
+            continue;
+        for(p = node->u.d.nextnode; p >= 0 && node_is_particle(p, tree); p = tree->Nextnode[p]) {
+            if(force_is_tracer(p, tree))
+                tree->LeafParticles[kt++] = p;
+            else
+                tree->LeafParticles[k++] = p;
+        }
+    }
+    tree->leafranges_flag = 1;
+}
+
+/* Check whether the node structure of a tree is still valid for the current particles:
+ * every particle must still be inside the node it was attached to, enlarged by TreeRefitSlack,
+ * and no particles may have been removed. New particles are attached by force_tree_eh_slots_fork.
+ * Enlarged nodes are checked exactly by force_refit_node_len: this is a quick test.*/
+static int
+force_tree_refit_valid(const ForceTree * tree, const DomainDecomp * ddecomp, const int HybridNuGrav)
+{
+    if(!force_tree_allocated(tree))
+        return 0;
+    if(tree->HybridNuGrav != HybridNuGrav)
+        return 0;
+    if(tree->TopLeaves != ddecomp->TopLeaves || tree->NTopLeaves != ddecomp->NTopLeaves)
+        return 0;
+
+    const double slackfac = 1 + ForceTreeParams.TreeRefitSlack;
+    int i, nintree = 0, nmoved = 0;
+    #pragma omp parallel for reduction(+: nintree, nmoved)
+    for(i = 0; i < PartManager->NumPart; i++)
+    {
+        if(P[i].IsGarbage || P[i].Swallowed)
+            continue;
+        nintree++;
+        const int father = tree->Father[i];
+        if(father < tree->firstnode || father >= tree->firstnode + tree->numnodes) {
+            nmoved++;
+            continue;
+        }
+        const struct NODE * node = &tree->Nodes[father];
+        int j;
+        for(j = 0; j < 3; j++)
+            if(fabs(2*(P[i].Pos[j] - node->center[j])) > node->len * slackfac)
+                break;
+        if(j < 3)
+            nmoved++;
+    }
+    return nmoved == 0 && nintree == tree->NumParticles;
+}
+
+int
+force_tree_refit(ForceTree * tree, DomainDecomp * ddecomp, const int HybridNuGrav)
+{
+    walltime_measure("/Misc");
+
+    const int valid = force_tree_refit_valid(tree, ddecomp, HybridNuGrav);
+
+    if(MPIU_Any(!valid, MPI_COMM_WORLD)) {
+        message(0, "Particles have left their tree nodes or been removed: tree must be rebuilt.\n");
+        walltime_measure("/Tree/Refit");
+        return 0;
+    }
+
+    /* now recompute the multipole moments recursively.
+     * The root is a top level node, so is never enlarged and has its built size.*/
+    int failed = 0;
+#pragma omp parallel
+#pragma omp single nowait
+    force_refit_node_recursive(tree->firstnode, 1, tree->Nodes[tree->firstnode].len, tree, HybridNuGrav, &failed);
+
+    if(MPIU_Any(failed, MPI_COMM_WORLD)) {
+        message(0, "Particles have drifted too far out of their tree nodes: tree must be rebuilt.\n");
+        walltime_measure("/Tree/Refit");
+        return 0;
+    }
+
+    /* Exchange the pseudo-data*/
+    force_exchange_pseudodata(tree, ddecomp);
+
+    force_treeupdate_pseudos(PartManager->MaxPart, tree);
+
+    /* Forked particles are now in the moments, so put them in the leaf ranges too*/
+    if(!tree->leafranges_flag)
+        force_tree_build_leaf_ranges(tree);
+
+    message(0, "Tree refit done.\n");
+    walltime_measure("/Tree/Refit");
+    return 1;
+}
+
 /*! This function communicates the values of the multipole moments of the
  *  top-level tree-nodes of the ddecomp grid.  This data can then be used to
  *  update the pseudo-particles on each CPU accordingly.
@@ -954,8 +1382,10 @@ void force_exchange_pseudodata(ForceTree * tree, const DomainDecomp * ddecomp)
         MyFloat hmax;
         struct {
             unsigned int MixedSofteningsInNode :1;
+            unsigned int TypeMask :6;
         };
         MyFloat MaxSoftening;
+        MyFloat MinSoftening;
     }
     *TopLeafMoments;
 
@@ -977,7 +1407,9 @@ void force_exchange_pseudodata(ForceTree * tree, const DomainDecomp * ddecomp)
         TopLeafMoments[i].mass = tree->Nodes[no].u.d.mass;
         TopLeafMoments[i].hmax = tree->Nodes[no].u.d.hmax;
         TopLeafMoments[i].MaxSoftening = tree->Nodes[no].u.d.MaxSoftening;
+        TopLeafMoments[i].MinSoftening = tree->Nodes[no].u.d.MinSoftening;
         TopLeafMoments[i].MixedSofteningsInNode = tree->Nodes[no].f.MixedSofteningsInNode;
+        TopLeafMoments[i].TypeMask = tree->Nodes[no].f.TypeMask;
 
         /*Set the local base nodes dependence on local mass*/
         while(no >= 0)
@@ -1022,7 +1454,9 @@ void force_exchange_pseudodata(ForceTree * tree, const DomainDecomp * ddecomp)
             tree->Nodes[no].u.d.mass = TopLeafMoments[i].mass;
             tree->Nodes[no].u.d.hmax = TopLeafMoments[i].hmax;
             tree->Nodes[no].u.d.MaxSoftening = TopLeafMoments[i].MaxSoftening;
+            tree->Nodes[no].u.d.MinSoftening = TopLeafMoments[i].MinSoftening;
             tree->Nodes[no].f.MixedSofteningsInNode = TopLeafMoments[i].MixedSofteningsInNode;
+            tree->Nodes[no].f.TypeMask = TopLeafMoments[i].TypeMask;
          }
     }
     myfree(TopLeafMoments);
@@ -1044,13 +1478,14 @@ void force_treeupdate_pseudos(int no, const ForceTree * tree)
     s[2] = 0;
     hmax = 0;
 
-    tree->Nodes[no].u.d.MaxSoftening = -1;
-    tree->Nodes[no].f.MixedSofteningsInNode = 0;
-
-    /* This happens if we have a trivial domain with only one entry*/
+    /* This happens if we have a trivial domain with only one entry.
+     * The node is then a top leaf and keeps the moments of its particles.*/
     if(!tree->Nodes[no].f.InternalTopLevel)
         return;
 
+    tree->Nodes[no].u.d.MaxSoftening = -1;
+    tree->Nodes[no].f.MixedSofteningsInNode = 0;
+    tree->Nodes[no].f.TypeMask = 0;
     p = tree->Nodes[no].u.d.nextnode;
 
     /* since we are dealing with top-level nodes, we know that there are 8 consecutive daughter nodes */
@@ -1075,8 +1510,9 @@ void force_treeupdate_pseudos(int no, const ForceTree * tree)
 
         if(tree->Nodes[p].u.d.hmax > hmax)
             hmax = tree->Nodes[p].u.d.hmax;
+        tree->Nodes[no].f.TypeMask |= tree->Nodes[p].f.TypeMask;
 
-        force_adjust_node_softening(&tree->Nodes[no], tree->Nodes[p].u.d.MaxSoftening, tree->Nodes[p].f.MixedSofteningsInNode);
+        force_adjust_node_softening(&tree->Nodes[no], tree->Nodes[p].u.d.MaxSoftening, tree->Nodes[p].u.d.MinSoftening, tree->Nodes[p].f.MixedSofteningsInNode);
 
         p = tree->Nodes[p].u.d.sibling;
     }
@@ -1107,12 +1543,13 @@ void force_treeupdate_pseudos(int no, const ForceTree * tree)
  *  hydro-force computation.  Since the Hsml-values are potentially changed
  *  in the SPH-density computation, force_update_hmax() should be carried
  *  out just before the hydrodynamical SPH forces are computed, i.e. after
- *  density().
+ *  density(). hmax only grows here, so only the top leaves whose hmax grew
+ *  are sent to the other tasks.
  */
 void force_update_hmax(int * activeset, int size, ForceTree * tree, DomainDecomp * ddecomp)
 {
     int NTask, ThisTask, recvTask;
-    int i, ta;
+    int i;
     int *recvcounts, *recvoffset;
 
     walltime_measure("/Misc");
@@ -1120,6 +1557,11 @@ void force_update_hmax(int * activeset, int size, ForceTree * tree, DomainDecomp
     MPI_Comm_size(MPI_COMM_WORLD, &NTask);
     MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
 
+    /* The hmax of our top leaves before the update, to find which grew*/
+    double * OldLeafhmax = (double *) mymalloc("OldLeafhmax", (ddecomp->Tasks[ThisTask].EndLeaf - ddecomp->Tasks[ThisTask].StartLeaf) * sizeof(double));
+    for(i = ddecomp->Tasks[ThisTask].StartLeaf; i < ddecomp->Tasks[ThisTask].EndLeaf; i ++)
+        OldLeafhmax[i - ddecomp->Tasks[ThisTask].StartLeaf] = tree->Nodes[ddecomp->TopLeaves[i].treenode].u.d.hmax;
+
     for(i = 0; i < size; i++)
     {
         const int p_i = activeset ? activeset[i] : i;
@@ -1138,48 +1580,61 @@ void force_update_hmax(int * activeset, int size, ForceTree * tree, DomainDecomp
         }
     }
 
-    double * TopLeafhmax = (double *) mymalloc("TopLeafMoments", ddecomp->NTopLeaves * sizeof(double));
-    memset(&TopLeafhmax[0], 0, sizeof(double) * ddecomp->NTopLeaves);
-
-    for(i = ddecomp->Tasks[ThisTask].StartLeaf; i < ddecomp->Tasks[ThisTask].EndLeaf; i ++) {
-        int no = ddecomp->TopLeaves[i].treenode;
-        TopLeafhmax[i] = tree->Nodes[no].u.d.hmax;
+    /* Only the top leaves whose hmax grew are sent to the other tasks*/
+    struct topleaf_hmax {
+        int leaf;
+        double hmax;
+    };
+    const int StartLeaf = ddecomp->Tasks[ThisTask].StartLeaf;
+    const int NLocalLeaves = ddecomp->Tasks[ThisTask].EndLeaf - StartLeaf;
+    struct topleaf_hmax * Changed = (struct topleaf_hmax *) mymalloc("ChangedLeafhmax", NLocalLeaves * sizeof(struct topleaf_hmax));
+    int nchanged = 0;
+    for(i = 0; i < NLocalLeaves; i ++) {
+        const int no = ddecomp->TopLeaves[StartLeaf + i].treenode;
+        if(tree->Nodes[no].u.d.hmax > OldLeafhmax[i]) {
+            Changed[nchanged].leaf = StartLeaf + i;
+            Changed[nchanged].hmax = tree->Nodes[no].u.d.hmax;
+            nchanged++;
+        }
     }
 
-    /* share the hmax-data of the dirty nodes accross CPUs */
     recvcounts = (int *) mymalloc("recvcounts", sizeof(int) * NTask);
     recvoffset = (int *) mymalloc("recvoffset", sizeof(int) * NTask);
 
+    MPI_Allgather(&nchanged, 1, MPI_INT, recvcounts, 1, MPI_INT, MPI_COMM_WORLD);
+    int nrecv = 0;
     for(recvTask = 0; recvTask < NTask; recvTask++)
     {
-        recvoffset[recvTask] = ddecomp->Tasks[recvTask].StartLeaf;
-        recvcounts[recvTask] = ddecomp->Tasks[recvTask].EndLeaf - ddecomp->Tasks[recvTask].StartLeaf;
+        recvoffset[recvTask] = nrecv * sizeof(struct topleaf_hmax);
+        nrecv += recvcounts[recvTask];
+        recvcounts[recvTask] *= sizeof(struct topleaf_hmax);
     }
 
-    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL,
-            &TopLeafhmax[0], recvcounts, recvoffset,
-            MPI_DOUBLE, MPI_COMM_WORLD);
-
-    myfree(recvoffset);
-    myfree(recvcounts);
+    struct topleaf_hmax * TopLeafhmax = (struct topleaf_hmax *) mymalloc("TopLeafhmax", nrecv * sizeof(struct topleaf_hmax));
+    MPI_Allgatherv(Changed, nchanged * sizeof(struct topleaf_hmax), MPI_BYTE,
+            TopLeafhmax, recvcounts, recvoffset,
+            MPI_BYTE, MPI_COMM_WORLD);
 
-    for(ta = 0; ta < NTask; ta++) {
-        if(ta == ThisTask)
+    for(i = 0; i < nrecv; i++) {
+        if(ddecomp->TopLeaves[TopLeafhmax[i].leaf].Task == ThisTask)
             continue; /* bypass ThisTask since it is already up to date */
-        for(i = ddecomp->Tasks[ta].StartLeaf; i < ddecomp->Tasks[ta].EndLeaf; i ++) {
-            int no = ddecomp->TopLeaves[i].treenode;
-            tree->Nodes[no].u.d.hmax = TopLeafhmax[i];
-
-            while(no >= 0)
-            {
-                if(TopLeafhmax[i] <= tree->Nodes[no].u.d.hmax)
-                    break;
-                tree->Nodes[no].u.d.hmax = TopLeafhmax[i];
-                no = tree->Nodes[no].father;
-            }
-         }
+        int no = ddecomp->TopLeaves[TopLeafhmax[i].leaf].treenode;
+        /* The hmax of the leaf is set, and its fathers grown to it*/
+        tree->Nodes[no].u.d.hmax = TopLeafhmax[i].hmax;
+        no = tree->Nodes[no].father;
+        while(no >= 0)
+        {
+            if(TopLeafhmax[i].hmax <= tree->Nodes[no].u.d.hmax)
+                break;
+            tree->Nodes[no].u.d.hmax = TopLeafhmax[i].hmax;
+            no = tree->Nodes[no].father;
+        }
     }
     myfree(TopLeafhmax);
+    myfree(recvoffset);
+    myfree(recvcounts);
+    myfree(Changed);
+    myfree(OldLeafhmax);
 
     tree->hmax_computed_flag = 1;
     walltime_measure("/Tree/HmaxUpdate");
@@ -1198,16 +1653,26 @@ ForceTree force_treeallocate(int maxnodes, int maxpart, DomainDecomp * ddecomp)
 
     message(0, "Allocating memory for %d tree-nodes (MaxPart=%d).\n", maxnodes, maxpart);
     tb.Nnextnode = maxpart + ddecomp->NTopNodes;
-    tb.Nextnode = (int *) mymalloc("Nextnode", bytes = tb.Nnextnode * sizeof(int));
+    tb.Nextnode = (int *) hbmalloc("Nextnode", bytes = tb.Nnextnode * sizeof(int));
     tb.Father = (int *) mymalloc("Father", bytes = (maxpart) * sizeof(int));
     allbytes += bytes;
-    tb.Nodes_base = (struct NODE *) mymalloc("Nodes_base", bytes = (maxnodes + 1) * sizeof(struct NODE));
+    tb.LeafParticles = NULL;
+    tb.leafranges_flag = 0;
+    if(ForceTreeParams.TreeLeafRanges) {
+        tb.LeafParticles = (int *) mymalloc("LeafParticles", bytes = (maxpart + maxnodes) * sizeof(int));
+        allbytes += bytes;
+    }
+    tb.Nodes_base = (struct NODE *) hbmalloc("Nodes_base", bytes = (maxnodes + 1) * sizeof(struct NODE));
     allbytes += bytes;
     tb.firstnode = maxpart;
     tb.lastnode = maxpart + maxnodes;
     tb.numnodes = maxnodes;
     tb.Nodes = tb.Nodes_base - maxpart;
     tb.tree_allocated_flag = 1;
+    tb.GravNodes = NULL;
+    tb.Quad = NULL;
+    tb.NgbCache = NULL;
+    tb.Halo = NULL;
     tb.NTopLeaves = ddecomp->NTopLeaves;
     tb.TopLeaves = ddecomp->TopLeaves;
 
@@ -1218,16 +1683,173 @@ ForceTree force_treeallocate(int maxnodes, int maxpart, DomainDecomp * ddecomp)
     return tb;
 }
 
+void
+force_tree_gravcopy_build(ForceTree * tree)
+{
+    struct node_gravcopy * GravNodes_base = (struct node_gravcopy *) mymalloc("GravNodes", tree->numnodes * sizeof(struct node_gravcopy));
+    tree->GravNodes = GravNodes_base - tree->firstnode;
+    int i;
+    #pragma omp parallel for
+    for(i = tree->firstnode; i < tree->firstnode + tree->numnodes; i++)
+        force_node_gravcopy(&tree->GravNodes[i], &tree->Nodes[i]);
+}
+
+void
+force_tree_gravcopy_free(ForceTree * tree)
+{
+    myfree(tree->GravNodes + tree->firstnode);
+    tree->GravNodes = NULL;
+}
+
+/* Add the second moments of a child node, shifted to the center of mass of node, to S*/
+static void
+force_quadrupole_add_child(double * S, const struct NODE * node, const int child, const ForceTree * tree)
+{
+    const struct NODE * cnode = &tree->Nodes[child];
+    const float * cS = tree->Quad[child].S;
+    double d[3];
+    int j;
+    for(j = 0; j < 3; j++)
+        d[j] = cnode->u.d.s[j] - node->u.d.s[j];
+    const double mass = cnode->u.d.mass;
+    S[0] += cS[0] + mass * d[0] * d[0];
+    S[1] += cS[1] + mass * d[1] * d[1];
+    S[2] += cS[2] + mass * d[2] * d[2];
+    S[3] += cS[3] + mass * d[0] * d[1];
+    S[4] += cS[4] + mass * d[0] * d[2];
+    S[5] += cS[5] + mass * d[1] * d[2];
+}
+
+/* Compute the second moments of a node below the top-level tree and of all its subnodes,
+ * walking the nextnode and sibling lists as in force_refit_node_recursive.*/
+static void
+force_quadrupole_recursive(int no, int level, const ForceTree * tree)
+{
+    const struct NODE * node = &tree->Nodes[no];
+    double S[6] = {0};
+    int j, p;
+
+    if(node->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(p = node->u.d.nextnode; p >= 0 && node_is_particle(p, tree); p = tree->Nextnode[p]) {
+            if(tree->HybridNuGrav && P[p].Type == ForceTreeParams.FastParticleType)
+                continue;
+            double d[3];
+            for(j = 0; j < 3; j++)
+                d[j] = P[p].Pos[j] - node->u.d.s[j];
+            S[0] += P[p].Mass * d[0] * d[0];
+            S[1] += P[p].Mass * d[1] * d[1];
+            S[2] += P[p].Mass * d[2] * d[2];
+            S[3] += P[p].Mass * d[0] * d[1];
+            S[4] += P[p].Mass * d[0] * d[2];
+            S[5] += P[p].Mass * d[1] * d[2];
+        }
+    }
+    else if(node->f.ChildType == NODE_NODE_TYPE) {
+        const int sib = node->u.d.sibling;
+        int childcnt = 0;
+        for(p = node->u.d.nextnode; p != sib; p = tree->Nodes[p].u.d.sibling)
+            if(tree->Nodes[p].f.ChildType == NODE_NODE_TYPE)
+                childcnt++;
+
+        for(p = node->u.d.nextnode; p != sib; p = tree->Nodes[p].u.d.sibling)
+        {
+            if(tree->Nodes[p].f.ChildType == NODE_NODE_TYPE && childcnt > 1 && level < 256) {
+                #pragma omp task shared(level, childcnt, tree) firstprivate(p)
+                force_quadrupole_recursive(p, level*childcnt, tree);
+            }
+            else
+                force_quadrupole_recursive(p, level, tree);
+        }
+        /*Make sure all child nodes are done*/
+        #pragma omp taskwait
+
+        for(p = node->u.d.nextnode; p != sib; p = tree->Nodes[p].u.d.sibling)
+            force_quadrupole_add_child(S, node, p, tree);
+    }
+
+    for(j = 0; j < 6; j++)
+        tree->Quad[no].S[j] = S[j];
+}
+
+/* Compute the second moments of the internal top-level nodes, once those of the top leaves are known.
+ * Top-level nodes have 8 children, as in force_treeupdate_pseudos.*/
+static void
+force_quadrupole_toplevel(int no, const ForceTree * tree)
+{
+    const struct NODE * node = &tree->Nodes[no];
+    double S[6] = {0};
+    int j, p;
+
+    if(!node->f.InternalTopLevel)
+        return;
+
+    for(j = 0, p = node->u.d.nextnode; j < 8; j++, p = tree->Nodes[p].u.d.sibling)
+    {
+        force_quadrupole_toplevel(p, tree);
+        force_quadrupole_add_child(S, node, p, tree);
+    }
+    for(j = 0; j < 6; j++)
+        tree->Quad[no].S[j] = S[j];
+}
+
+void
+force_tree_quadrupole_build(ForceTree * tree)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    struct node_quadrupole * Quad_base = (struct node_quadrupole *) mymalloc("Quadrupole", tree->numnodes * sizeof(struct node_quadrupole));
+    tree->Quad = Quad_base - tree->firstnode;
+
+    int i;
+    /* First the local top leaves and everything beneath them*/
+#pragma omp parallel
+#pragma omp single nowait
+    for(i = 0; i < tree->NTopLeaves; i++) {
+        if(tree->TopLeaves[i].Task != ThisTask)
+            continue;
+        #pragma omp task firstprivate(i)
+        force_quadrupole_recursive(tree->TopLeaves[i].treenode, 1, tree);
+    }
+
+    /* Now share the moments of the top leaves, so the pseudo particles have them*/
+    struct node_quadrupole * TopLeafQuad = (struct node_quadrupole *) mymalloc("TopLeafQuad", tree->NTopLeaves * sizeof(struct node_quadrupole));
+    memset(TopLeafQuad, 0, tree->NTopLeaves * sizeof(struct node_quadrupole));
+    for(i = 0; i < tree->NTopLeaves; i++)
+        if(tree->TopLeaves[i].Task == ThisTask)
+            TopLeafQuad[i] = tree->Quad[tree->TopLeaves[i].treenode];
+
+    MPI_Allreduce(MPI_IN_PLACE, TopLeafQuad, 6 * tree->NTopLeaves, MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+
+    for(i = 0; i < tree->NTopLeaves; i++)
+        if(tree->TopLeaves[i].Task != ThisTask)
+            tree->Quad[tree->TopLeaves[i].treenode] = TopLeafQuad[i];
+    myfree(TopLeafQuad);
+
+    force_quadrupole_toplevel(tree->firstnode, tree);
+}
+
+void
+force_tree_quadrupole_free(ForceTree * tree)
+{
+    myfree(tree->Quad + tree->firstnode);
+    tree->Quad = NULL;
+}
+
 /*! This function frees the memory allocated for the tree, i.e. it frees
  *  the space allocated by the function force_treeallocate().
  */
 void force_tree_free(ForceTree * tree)
 {
-    event_unlisten(&EventSlotsFork, force_tree_eh_slots_fork, tree);
+    event_unlisten_batch(&EventSlotsFork, force_tree_eh_slots_fork, tree);
 
     if(!force_tree_allocated(tree))
         return;
     myfree(tree->Nodes_base);
+    if(tree->LeafParticles)
+        myfree(tree->LeafParticles);
+    tree->LeafParticles = NULL;
+    tree->leafranges_flag = 0;
     myfree(tree->Father);
     myfree(tree->Nextnode);
     tree->tree_allocated_flag = 0;
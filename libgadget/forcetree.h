@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include "domain.h"
+#include "utils/paramset.h"
 /*
  * Variables for Tree
  * ------------------
@@ -10,6 +11,8 @@
 
 /* Total allowed number of particle children for a node*/
 #define NMAXCHILD 11
+/* Largest number of particles in a leaf range, set by the width of NODE.f.NumParticles*/
+#define LEAFRANGE_MAX 15
 
 /* Defines for the type of node, classified by type of children.*/
 #define PARTICLE_NODE_TYPE 0
@@ -29,6 +32,10 @@ struct NODE
         unsigned int MixedSofteningsInNode:1;  /* Softening is mixed, need to open the node */
         unsigned int ChildType :2; /* Specify the type of children this node has: particles, other nodes, or pseudo-particles.
                                     * (should be an enum, but not standard in C).*/
+        unsigned int NumParticles :4; /* Number of particles in a leaf, set with ForceTree.LeafParticles.*/
+        unsigned int TypeMask :6; /* Bit 1 << type is set if the node may contain particles of that type, see force_type_mask.*/
+        unsigned int NumGravParticles :4; /* Number of gravitating particles at the start of the leaf range.
+                                           * With ForceTree.HybridNuGrav the tracer neutrinos are stored after them.*/
     } f;
     union
     {
@@ -50,12 +57,45 @@ struct NODE
             MyFloat MaxSoftening;  /* Stores the largest softening in the node. The short-range
                                  * gravitational force solver will check this and use it
                                  * open the node if a particle is closer.*/
+            MyFloat MinSoftening;  /* The smallest softening in the node. Set if MaxSoftening > 0.*/
         }
         d;
     }
     u;
 };
 
+/* Compact copy of the node data read by the short-range gravity walk.
+ * This is 64 bytes, one cache line, against 104 bytes for struct NODE,
+ * and omits the build-time data, hmax and the father pointer.
+ * The center of mass stays in double precision; the geometry, mass and softening are in float.*/
+struct node_gravcopy
+{
+    double s[3];        /* center of mass of node */
+    float center[3];    /* geometrical center of node */
+    float len;          /* sidelength of treenode */
+    float mass;         /* mass of node */
+    float MaxSoftening; /* largest softening in the node */
+    float MinSoftening; /* smallest softening in the node */
+    int sibling;
+    int nextnode;
+    struct {
+        unsigned int TopLevel :1;
+        unsigned int MixedSofteningsInNode:1;
+        unsigned int InternalTopLevel :1;
+        unsigned int DependsOnLocalMass :1;
+        unsigned int ChildType :2;
+        unsigned int NumParticles :4;
+        unsigned int NumGravParticles :4;
+    } f;
+};
+
+/* Second moments of the node mass distribution about the center of mass,
+ * sum m dx_i dx_j, in the order xx, yy, zz, xy, xz, yz. Used for quadrupole gravity.*/
+struct node_quadrupole
+{
+    float S[6];
+};
+
 /*Structure containing the Node pointer, and various Tree metadata.*/
 /*The node index is an integer with unusual properties:
  * no = 0..ForceTree.firstnode  corresponds to a particle.
@@ -90,15 +130,41 @@ typedef struct ForceTree {
     int * Nextnode;
     /*Allocated length of the Nextnode array*/
     int Nnextnode;
+    /* Particles of each leaf, stored contiguously in the order of the Nextnode list.
+     * For a leaf node no, LeafParticles[no] is the position of its first particle and
+     * Nodes[no].f.NumParticles the number of particles. NULL unless TreeLeafRanges is set.
+     * Use via force_get_leaf_particles, which returns NULL once particles have been added by a fork.*/
+    int * LeafParticles;
+    /* Is 1 if LeafParticles matches the Nextnode list*/
+    int leafranges_flag;
     /*!< gives parent node in tree for every particle */
     int *Father;
     /*!< Store the size of the box used to build the tree, for periodic walking.*/
     double BoxSize;
+    /* Compact copy of the Nodes for the gravity walk, shifted like Nodes. NULL unless
+     * force_tree_gravcopy_build has been called.*/
+    struct node_gravcopy * GravNodes;
+    /* Second mass moments of each node, shifted like Nodes. NULL unless
+     * force_tree_quadrupole_build has been called.*/
+    struct node_quadrupole * Quad;
+    /* Neighbour candidates kept from the density walk for the hydro walk. NULL unless
+     * treewalk_ngbcache_alloc has been called.*/
+    struct NgbCache * NgbCache;
+    /* Ghost copies of the gas of other tasks near this domain. NULL unless
+     * treewalk_halo_build has been called.*/
+    struct NgbHalo * Halo;
+    /* Number of particles attached to the tree. Used to check the tree is still valid in force_tree_refit.*/
+    int NumParticles;
+    /* Value of HybridNuGrav the moments were computed with*/
+    int HybridNuGrav;
 } ForceTree;
 
 /*Initialize the internal parameters of the forcetree module*/
 void init_forcetree_params(const int FastParticleType, const double * GravitySofteningTable);
 
+/*Set the parameters of the forcetree module*/
+void set_forcetree_params(ParameterSet * ps);
+
 int force_tree_allocated(const ForceTree * tt);
 
 /* This function propagates changed SPH smoothing lengths up the tree*/
@@ -109,6 +175,22 @@ void force_update_hmax(int * activeset, int size, ForceTree * tt, DomainDecomp *
 */
 void force_tree_rebuild(ForceTree * tree, DomainDecomp * ddecomp, const double BoxSize, const int HybridNuGrav);
 
+/* Recompute the moments of an existing tree after the particles have drifted, keeping the node structure.
+ * This is much cheaper than a rebuild, but is only valid if the domain has not changed since the tree was built.
+ * Returns 1 if the tree was updated. Returns 0 and leaves the tree unchanged if any particle
+ * has left its node or been added or removed, in which case the tree needs to be rebuilt.
+ * Collective: the return value is the same on all ranks.*/
+int force_tree_refit(ForceTree * tree, DomainDecomp * ddecomp, const int HybridNuGrav);
+
+/* Build (allocating) and free the compact node copy in tree->GravNodes*/
+void force_tree_gravcopy_build(ForceTree * tree);
+void force_tree_gravcopy_free(ForceTree * tree);
+
+/* Compute (allocating) and free the second mass moments in tree->Quad, including those of the pseudo particles.
+ * Build is collective.*/
+void force_tree_quadrupole_build(ForceTree * tree);
+void force_tree_quadrupole_free(ForceTree * tree);
+
 /*Free the memory associated with the tree*/
 void   force_tree_free(ForceTree * tt);
 void   dump_particles(void);
@@ -131,6 +213,56 @@ node_is_node(int no, const ForceTree * tree)
     return (no >= tree->firstnode) && (no < tree->lastnode);
 }
 
+static inline void
+force_node_gravcopy(struct node_gravcopy * copy, const struct NODE * node)
+{
+    int j;
+    for(j = 0; j < 3; j++) {
+        copy->s[j] = node->u.d.s[j];
+        copy->center[j] = node->center[j];
+    }
+    copy->len = node->len;
+    copy->mass = node->u.d.mass;
+    copy->MaxSoftening = node->u.d.MaxSoftening;
+    copy->MinSoftening = node->u.d.MinSoftening;
+    copy->sibling = node->u.d.sibling;
+    copy->nextnode = node->u.d.nextnode;
+    copy->f.TopLevel = node->f.TopLevel;
+    copy->f.MixedSofteningsInNode = node->f.MixedSofteningsInNode;
+    copy->f.InternalTopLevel = node->f.InternalTopLevel;
+    copy->f.DependsOnLocalMass = node->f.DependsOnLocalMass;
+    copy->f.ChildType = node->f.ChildType;
+    copy->f.NumParticles = node->f.NumParticles;
+    copy->f.NumGravParticles = node->f.NumGravParticles;
+}
+
+/* Bits of the types a particle may have while the tree is in use, for NODE.f.TypeMask.
+ * Stars and black holes are only made from gas, so gas also sets their bits
+ * and the mask stays valid when a gas particle is converted or forked.*/
+static inline unsigned int
+force_type_mask(const int type)
+{
+    if(type == 0)
+        return 1 + 16 + 32;
+    return 1u << type;
+}
+
+/* Get the contiguous list of leaf particles, or NULL if it is not available.
+ * The particles of leaf no are then leaf[leaf[no]] ... leaf[leaf[no] + Nodes[no].f.NumParticles - 1],
+ * of which the first Nodes[no].f.NumGravParticles gravitate.*/
+static inline const int *
+force_get_leaf_particles(const ForceTree * tree)
+{
+    return tree->leafranges_flag ? tree->LeafParticles : NULL;
+}
+
+/* Read a field of internal node no in the short-range gravity walk: from the compact copy in
+ * tree->GravNodes if copy is set, otherwise straight from tree->Nodes, with no conversion.
+ * copy should be a constant, so that each walk is compiled for one layout.
+ * GRAVNODE reads the fields stored directly in struct NODE, GRAVNODE_D those in NODE.u.d.*/
+#define GRAVNODE(tree, copy, no, field) ((copy) ? (tree)->GravNodes[no].field : (tree)->Nodes[no].field)
+#define GRAVNODE_D(tree, copy, no, field) ((copy) ? (tree)->GravNodes[no].field : (tree)->Nodes[no].u.d.field)
+
 int
 force_get_prev_node(int no, const ForceTree * tb);
 
@@ -13,11 +13,27 @@
  *
  * Generated with split = 1.25; check with the assertion above!
  * */
+#ifdef TREE_OFFLOAD
+/* The tables and grav_short_range_batch are also needed on the device*/
+#pragma omp declare target
+#endif
 #include "shortrange-kernel.c"
 #define NTAB (sizeof(shortrange_force_kernels) / sizeof(shortrange_force_kernels[0]))
 
 /*! variables for short-range lookup table */
 static float shortrange_table[NTAB], shortrange_table_potential[NTAB], shortrange_table_tidal[NTAB];
+/* Chebyshev coefficients of the force and potential windows, in t = 2 r / r_max - 1,
+ * with r_max the end of the table. Used by grav_short_range_batch if ShortRangePolyOrder > 0.*/
+static double shortrange_poly[GRAV_SHORTRANGE_POLY_MAX], shortrange_poly_potential[GRAV_SHORTRANGE_POLY_MAX];
+static int ShortRangePolyOrder;
+/* If true, grav_short_range_batch computes in single precision*/
+static int ShortRangeMixedPrecision;
+#ifdef TREE_OFFLOAD
+#pragma omp end declare target
+#endif
+/* Force split scale in mesh cells, for the analytic window derivatives.*/
+static double ShortRangeAsmth;
+static enum ShortRangeForceWindowType ShortRangeWindowType;
 
 void
 gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowType, const double Asmth)
@@ -28,6 +44,9 @@ gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowTy
         }
     }
 
+    ShortRangeAsmth = Asmth;
+    ShortRangeWindowType = ShortRangeForceWindowType;
+
     int i;
     for(i = 0; i < NTAB; i++)
     {
@@ -48,6 +67,102 @@ gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowTy
         /* we don't have a table for that and don't use it anyways. */
         shortrange_table_tidal[i] = 4.0 * u * u * u / sqrt(M_PI) * exp(-u * u);
     }
+#ifdef TREE_OFFLOAD
+    #pragma omp target update to(shortrange_table, shortrange_table_potential)
+#endif
+    /* Refit the polynomial for the new window*/
+    if(ShortRangePolyOrder > 0)
+        gravshort_fill_poly(ShortRangePolyOrder);
+}
+
+/* Force and potential windows at x mesh cells: analytic for erfc, and a linear
+ * interpolation of the double precision table for the calibrated window.*/
+static void
+gravshort_window(const double x, double * fac, double * pot)
+{
+    if(ShortRangeWindowType == SHORTRANGE_FORCE_WINDOW_TYPE_ERFC) {
+        const double u = x * 0.5 / ShortRangeAsmth;
+        *fac = erfc(u) + 2.0 * u / sqrt(M_PI) * exp(-u * u);
+        *pot = erfc(u);
+        return;
+    }
+    const double i = x / shortrange_force_kernels[1][0];
+    int tabindex = floor(i);
+    if(tabindex > (int) NTAB - 2)
+        tabindex = NTAB - 2;
+    const double f = i - tabindex;
+    *fac = (1 - f) * shortrange_force_kernels[tabindex][2] + f * shortrange_force_kernels[tabindex + 1][2];
+    *pot = (1 - f) * shortrange_force_kernels[tabindex][1] + f * shortrange_force_kernels[tabindex + 1][1];
+}
+
+void
+gravshort_fill_poly(const int order)
+{
+    if(order < 0 || order > GRAV_SHORTRANGE_POLY_MAX)
+        endrun(0, "ShortRangePolyOrder = %d should be between 0 and %d\n", order, GRAV_SHORTRANGE_POLY_MAX);
+    ShortRangePolyOrder = order;
+    if(order == 0)
+        return;
+
+    /* Interpolate at the Chebyshev nodes, which is close to the minimax polynomial of this order.*/
+    const double rmax = shortrange_force_kernels[NTAB - 1][0];
+    double wf[GRAV_SHORTRANGE_POLY_MAX], wp[GRAV_SHORTRANGE_POLY_MAX];
+    int j, k;
+    for(j = 0; j < order; j++)
+        gravshort_window(0.5 * rmax * (1 + cos(M_PI * (j + 0.5) / order)), &wf[j], &wp[j]);
+
+    for(k = 0; k < GRAV_SHORTRANGE_POLY_MAX; k++)
+        shortrange_poly[k] = shortrange_poly_potential[k] = 0;
+
+    for(k = 0; k < order; k++) {
+        double cf = 0, cp = 0;
+        for(j = 0; j < order; j++) {
+            const double T = cos(M_PI * k * (j + 0.5) / order);
+            cf += wf[j] * T;
+            cp += wp[j] * T;
+        }
+        /* The first coefficient has half weight*/
+        const double norm = (k == 0 ? 1. : 2.) / order;
+        shortrange_poly[k] = cf * norm;
+        shortrange_poly_potential[k] = cp * norm;
+    }
+#ifdef TREE_OFFLOAD
+    #pragma omp target update to(shortrange_poly, shortrange_poly_potential, ShortRangePolyOrder)
+#endif
+}
+
+void
+gravshort_set_mixed_precision(const int mixed)
+{
+    ShortRangeMixedPrecision = mixed;
+#ifdef TREE_OFFLOAD
+    #pragma omp target update to(ShortRangeMixedPrecision)
+#endif
+}
+
+/* The softened force of a unit mass at distance r, with the kernel of grav_short_range_batch and no window.*/
+static double
+grav_softened_force(const double r, const double h)
+{
+    if(r >= h)
+        return 1 / (r * r);
+    const double h_inv = 1.0 / h;
+    const double u = r * h_inv;
+    double fac;
+    if(u < 0.5)
+        fac = h_inv * h_inv * h_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
+    else
+        fac = h_inv * h_inv * h_inv * (21.333333333333 - 48.0 * u +
+                38.4 * u * u - 10.666666666667 * u * u * u - 0.066666666667 / (u * u * u));
+    return fac * r;
+}
+
+/* The softened force decreases with the softening length, so the largest error from using
+ * maxsoft for all of the mass is the difference from the force with minsoft.*/
+int
+grav_softening_error_ok(const double r, const double minsoft, const double maxsoft, const double mass, const double aold)
+{
+    return mass * (grav_softened_force(r, minsoft) - grav_softened_force(r, maxsoft)) < aold;
 }
 
 /* multiply force factor (*fac) and potential (*pot) by the shortrange force window function*/
@@ -68,3 +183,234 @@ grav_apply_short_range_window(double r, double * fac, double * pot, const double
     }
 }
 
+#ifdef TREE_OFFLOAD
+#pragma omp declare target
+#endif
+/* The loop of grav_short_range_batch. nterms is a constant in each call, so the compiler
+ * makes a copy of the loop for the table (nterms = 0) and for each length of the polynomial,
+ * with the Clenshaw recurrence unrolled so that the loop over the interactions vectorizes.*/
+static inline __attribute__((always_inline)) int
+grav_short_range_batch_loop(const struct GravInteractionList * list, const double cellsize, double acc[3], double * pot, const int nterms)
+{
+    const double tabfac = 1. / (cellsize * shortrange_force_kernels[1][0]);
+    const double polyfac = 2. / (cellsize * shortrange_force_kernels[NTAB - 1][0]);
+    double ax = 0, ay = 0, az = 0, pp = 0;
+    int ninter = 0;
+    int j;
+    /* Branches are written as selects so that all lanes do the same work.
+     * The safe_* values keep the unselected branches finite at r = 0.*/
+    #pragma omp simd reduction(+: ax, ay, az, pp, ninter)
+    for(j = 0; j < list->n; j++) {
+        const double r2 = list->dx[j] * list->dx[j] + list->dy[j] * list->dy[j] + list->dz[j] * list->dz[j];
+        const double r = sqrt(r2);
+        const double h = list->h[j];
+        const double mass = list->mass[j];
+
+        /* Newtonian*/
+        const double safe_r = (r >= h) ? r : h;
+        const double facnewt = mass / (safe_r * safe_r * safe_r);
+        const double potnewt = -mass / safe_r;
+
+        /* Softened*/
+        const double h_inv = 1.0 / h;
+        const double h3_inv = h_inv * h_inv * h_inv;
+        const double u = r * h_inv;
+        const double safe_u = (u >= 0.5) ? u : 0.5;
+        const double facin = h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
+        const double wpin = -2.8 + u * u * (5.333333333333 + u * u * (6.4 * u - 9.6));
+        const double facout = h3_inv * (21.333333333333 - 48.0 * safe_u +
+                38.4 * safe_u * safe_u - 10.666666666667 * safe_u * safe_u * safe_u - 0.066666666667 / (safe_u * safe_u * safe_u));
+        const double wpout = -3.2 + 0.066666666667 / safe_u + safe_u * safe_u * (10.666666666667 +
+                safe_u * (-16.0 + safe_u * (9.6 - 2.133333333333 * safe_u)));
+        const double facsoft = mass * ((u < 0.5) ? facin : facout);
+        const double potsoft = mass * h_inv * ((u < 0.5) ? wpin : wpout);
+
+        double fac = (r >= h) ? facnewt : facsoft;
+        double facpot = (r >= h) ? potnewt : potsoft;
+
+        /* Short-range window, as in grav_apply_short_range_window*/
+        const double i = r * tabfac;
+        int tabindex = (int) i;
+        const int inside = tabindex < (int) NTAB - 1;
+        if(nterms > 0) {
+            /* Clenshaw recurrence for both windows. Outside the table t > 1, but the sum stays finite.*/
+            const double t = r * polyfac - 1;
+            double bf1 = 0, bf2 = 0, bp1 = 0, bp2 = 0;
+            int k;
+            for(k = nterms - 1; k >= 1; k--) {
+                const double bf = 2 * t * bf1 - bf2 + shortrange_poly[k];
+                const double bp = 2 * t * bp1 - bp2 + shortrange_poly_potential[k];
+                bf2 = bf1;
+                bf1 = bf;
+                bp2 = bp1;
+                bp1 = bp;
+            }
+            fac *= t * bf1 - bf2 + shortrange_poly[0];
+            facpot *= t * bp1 - bp2 + shortrange_poly_potential[0];
+        }
+        else {
+            if(!inside)
+                tabindex = 0;
+            fac *= (tabindex + 1 - i) * shortrange_table[tabindex] + (i - tabindex) * shortrange_table[tabindex + 1];
+            facpot *= (tabindex + 1 - i) * shortrange_table_potential[tabindex] + (i - tabindex) * shortrange_table_potential[tabindex];
+        }
+
+        ax += inside ? list->dx[j] * fac : 0;
+        ay += inside ? list->dy[j] * fac : 0;
+        az += inside ? list->dz[j] * fac : 0;
+        pp += inside ? facpot : 0;
+        ninter += inside;
+    }
+    acc[0] += ax;
+    acc[1] += ay;
+    acc[2] += az;
+    *pot += pp;
+    return ninter;
+}
+
+/* grav_short_range_batch_loop in single precision, for TreeMixedPrecision. The offsets are
+ * relative to the target and inside the tree cut, so single precision loses only the round off of
+ * a float, while the vector lanes are twice as many. Each interaction is added to double accumulators.*/
+static inline __attribute__((always_inline)) int
+grav_short_range_batch_loop_float(const struct GravInteractionList * list, const double cellsize, double acc[3], double * pot, const int nterms)
+{
+    const float tabfac = 1. / (cellsize * shortrange_force_kernels[1][0]);
+    const float polyfac = 2. / (cellsize * shortrange_force_kernels[NTAB - 1][0]);
+    double ax = 0, ay = 0, az = 0, pp = 0;
+    int ninter = 0;
+    int j;
+    #pragma omp simd reduction(+: ax, ay, az, pp, ninter)
+    for(j = 0; j < list->n; j++) {
+        const float dx = list->dx[j];
+        const float dy = list->dy[j];
+        const float dz = list->dz[j];
+        const float r = sqrtf(dx * dx + dy * dy + dz * dz);
+        const float h = list->h[j];
+        const float mass = list->mass[j];
+
+        /* Newtonian*/
+        const float safe_r = (r >= h) ? r : h;
+        const float facnewt = mass / (safe_r * safe_r * safe_r);
+        const float potnewt = -mass / safe_r;
+
+        /* Softened*/
+        const float h_inv = 1.0f / h;
+        const float h3_inv = h_inv * h_inv * h_inv;
+        const float u = r * h_inv;
+        const float safe_u = (u >= 0.5f) ? u : 0.5f;
+        const float facin = h3_inv * (10.666666666667f + u * u * (32.0f * u - 38.4f));
+        const float wpin = -2.8f + u * u * (5.333333333333f + u * u * (6.4f * u - 9.6f));
+        const float facout = h3_inv * (21.333333333333f - 48.0f * safe_u +
+                38.4f * safe_u * safe_u - 10.666666666667f * safe_u * safe_u * safe_u - 0.066666666667f / (safe_u * safe_u * safe_u));
+        const float wpout = -3.2f + 0.066666666667f / safe_u + safe_u * safe_u * (10.666666666667f +
+                safe_u * (-16.0f + safe_u * (9.6f - 2.133333333333f * safe_u)));
+        const float facsoft = mass * ((u < 0.5f) ? facin : facout);
+        const float potsoft = mass * h_inv * ((u < 0.5f) ? wpin : wpout);
+
+        float fac = (r >= h) ? facnewt : facsoft;
+        float facpot = (r >= h) ? potnewt : potsoft;
+
+        /* Short-range window*/
+        const float i = r * tabfac;
+        int tabindex = (int) i;
+        const int inside = tabindex < (int) NTAB - 1;
+        if(nterms > 0) {
+            const float t = r * polyfac - 1;
+            float bf1 = 0, bf2 = 0, bp1 = 0, bp2 = 0;
+            int k;
+            for(k = nterms - 1; k >= 1; k--) {
+                const float bf = 2 * t * bf1 - bf2 + (float) shortrange_poly[k];
+                const float bp = 2 * t * bp1 - bp2 + (float) shortrange_poly_potential[k];
+                bf2 = bf1;
+                bf1 = bf;
+                bp2 = bp1;
+                bp1 = bp;
+            }
+            fac *= t * bf1 - bf2 + (float) shortrange_poly[0];
+            facpot *= t * bp1 - bp2 + (float) shortrange_poly_potential[0];
+        }
+        else {
+            if(!inside)
+                tabindex = 0;
+            fac *= (tabindex + 1 - i) * shortrange_table[tabindex] + (i - tabindex) * shortrange_table[tabindex + 1];
+            facpot *= (tabindex + 1 - i) * shortrange_table_potential[tabindex] + (i - tabindex) * shortrange_table_potential[tabindex];
+        }
+
+        ax += inside ? dx * fac : 0;
+        ay += inside ? dy * fac : 0;
+        az += inside ? dz * fac : 0;
+        pp += inside ? facpot : 0;
+        ninter += inside;
+    }
+    acc[0] += ax;
+    acc[1] += ay;
+    acc[2] += az;
+    *pot += pp;
+    return ninter;
+}
+
+int
+grav_short_range_batch(const struct GravInteractionList * list, const double cellsize, double acc[3], double * pot)
+{
+    if(ShortRangeMixedPrecision) {
+        /* Fewer lengths here, to limit the copies of the loop*/
+        if(ShortRangePolyOrder > 16)
+            return grav_short_range_batch_loop_float(list, cellsize, acc, pot, 32);
+        if(ShortRangePolyOrder > 0)
+            return grav_short_range_batch_loop_float(list, cellsize, acc, pot, 16);
+        return grav_short_range_batch_loop_float(list, cellsize, acc, pot, 0);
+    }
+    /* The coefficients above ShortRangePolyOrder are zero, so round up the number of terms*/
+    if(ShortRangePolyOrder > 24)
+        return grav_short_range_batch_loop(list, cellsize, acc, pot, 32);
+    if(ShortRangePolyOrder > 16)
+        return grav_short_range_batch_loop(list, cellsize, acc, pot, 24);
+    if(ShortRangePolyOrder > 8)
+        return grav_short_range_batch_loop(list, cellsize, acc, pot, 16);
+    if(ShortRangePolyOrder > 0)
+        return grav_short_range_batch_loop(list, cellsize, acc, pot, 8);
+    return grav_short_range_batch_loop(list, cellsize, acc, pot, 0);
+}
+#ifdef TREE_OFFLOAD
+#pragma omp end declare target
+#endif
+
+
+/* The acceleration from a node with second mass moments S, at offset x from the target, is to second order
+ *   a_i = M f x_i + 1/2 [ B x_i (x.S.x) + A (tr(S) x_i + 2 (S.x)_i) ],
+ * for a point mass force a = m f(r) x, with A = f'/r and B = A'/r. Here f = w(r)/r^3 and w is the
+ * short-range window. The derivatives of w are those of the erfc window, which the exact window
+ * closely follows, so the table is not needed.*/
+void
+grav_short_range_quadrupole(const double dx[3], const double h, const float * S, const double cellsize, double acc[3])
+{
+    const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+    const double r = sqrt(r2);
+    /* Softened and out of range interactions use only the monopole*/
+    if(r < h || r / cellsize / shortrange_force_kernels[1][0] >= NTAB - 1)
+        return;
+
+    /* u = r / (2 r_s), as in gravshort_fill_ntab*/
+    const double rs2 = 2 * ShortRangeAsmth * cellsize;
+    const double u = r / rs2;
+    const double e = 2. / sqrt(M_PI) * exp(-u * u);
+    const double w = erfc(u) + u * e;
+    const double dw = -2 * u * u * e / rs2;
+    const double d2w = -4 * u * (1 - u * u) * e / (rs2 * rs2);
+
+    const double rinv = 1 / r;
+    const double r4inv = rinv * rinv * rinv * rinv;
+    const double A = (dw - 3 * w * rinv) * r4inv;
+    const double B = (d2w - 7 * dw * rinv + 15 * w * rinv * rinv) * r4inv * rinv;
+
+    double Sx[3];
+    Sx[0] = S[0] * dx[0] + S[3] * dx[1] + S[4] * dx[2];
+    Sx[1] = S[3] * dx[0] + S[1] * dx[1] + S[5] * dx[2];
+    Sx[2] = S[4] * dx[0] + S[5] * dx[1] + S[2] * dx[2];
+    const double xSx = dx[0] * Sx[0] + dx[1] * Sx[1] + dx[2] * Sx[2];
+    const double trS = S[0] + S[1] + S[2];
+
+    int d;
+    for(d = 0; d < 3; d++)
+        acc[d] += 0.5 * (B * xSx * dx[d] + A * (trS * dx[d] + 2 * Sx[d]));
+}
@@ -14,6 +14,22 @@ struct gravshort_tree_params
     /*! RCUT gives the maximum distance (in units of the scale used for the force split) out to which short-range
      * forces are evaluated in the short-range tree walk.*/
     double Rcut;
+    /* If true, the leaf loop of the tree walk reads a compact copy of the particle positions, masses and softenings.*/
+    int TreeParticleCopy;
+    /* If true, the tree walk reads a compact 64 byte copy of the tree nodes.*/
+    int TreeNodeCopy;
+    /* If true, add quadrupole moments of the nodes to the short-range force, and use an opening criterion for the next order.*/
+    int TreeQuadrupole;
+    /* If true, active particles sharing a tree leaf walk the tree together with a shared interaction list.
+     * grav_short_pair then also gathers the neighbours of the group once, and sums over them in tiles.*/
+    int TreeGroupWalk;
+    /* If true, walk the local part of the tree on an OpenMP target device. Needs TREE_OFFLOAD.*/
+    int TreeOffload;
+    /* If > 0, grav_short_range_batch evaluates the short-range window as a Chebyshev series
+     * with this many terms instead of interpolating the table.*/
+    int ShortRangePolyOrder;
+    /* If true, grav_short_range_batch computes the interactions in single precision, with double precision sums.*/
+    int TreeMixedPrecision;
 };
 
 enum ShortRangeForceWindowType {
@@ -24,28 +40,97 @@ enum ShortRangeForceWindowType {
 /* Fill the short-range gravity table*/
 void gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowType, const double Asmth);
 
+/* Maximum number of terms of the polynomial short-range window*/
+#define GRAV_SHORTRANGE_POLY_MAX 32
+
+/* Fit a Chebyshev series with order terms to the window set by gravshort_fill_ntab, and use it
+ * in grav_short_range_batch. The series is refit when the table is refilled. order = 0 uses the table.*/
+void gravshort_fill_poly(const int order);
+
+/* If mixed is true, grav_short_range_batch computes in single precision. Set from TreeMixedPrecision.*/
+void gravshort_set_mixed_precision(const int mixed);
+
 /*Defined in gravpm.c*/
 void gravpm_init_periodic(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G);
 
 /* Apply the short-range window function, which includes the smoothing kernel.*/
 int grav_apply_short_range_window(double r, double * fac, double * pot, const double cellsize);
 
+/* Returns true if a mass at distance r, with pairwise softenings between minsoft and maxsoft,
+ * may use maxsoft for all of the mass: the force changes by less than aold, as in the relative opening criterion.*/
+int grav_softening_error_ok(const double r, const double minsoft, const double maxsoft, const double mass, const double aold);
+
+/* Maximum length of an interaction list passed to grav_short_range_batch.*/
+#define GRAV_BATCH_SIZE 64
+
+/* A list of interactions with a single target, stored as arrays so the kernel vectorizes.*/
+struct GravInteractionList
+{
+    int n;
+    double dx[GRAV_BATCH_SIZE];
+    double dy[GRAV_BATCH_SIZE];
+    double dz[GRAV_BATCH_SIZE];
+    double mass[GRAV_BATCH_SIZE];
+    double h[GRAV_BATCH_SIZE];
+};
+
+/* Evaluate the softened short-range force from every source in the list,
+ * with the same kernel as grav_apply_short_range_window.
+ * Accumulates into acc and pot, and returns the number of sources inside the window.*/
+#ifdef TREE_OFFLOAD
+#pragma omp declare target
+#endif
+int grav_short_range_batch(const struct GravInteractionList * list, const double cellsize, double acc[3], double * pot);
+#ifdef TREE_OFFLOAD
+#pragma omp end declare target
+#endif
+
+/* Add the quadrupole correction to the short-range acceleration from a node.
+ * dx is the offset of the node center of mass from the target, h the softening
+ * and S the second mass moments (see struct node_quadrupole). The potential is not corrected.*/
+void grav_short_range_quadrupole(const double dx[3], const double h, const float * S, const double cellsize, double acc[3]);
+
 /* Set up the module*/
 void set_gravshort_tree_params(ParameterSet * ps);
 /* Helpers for the tests*/
 void set_gravshort_treepar(struct gravshort_tree_params tree_params);
 struct gravshort_tree_params get_gravshort_treepar(void);
 
+/* The high resolution region of the zoom PM mesh, set up by gravpm_zoom_update_region.
+ * The zoom mesh adds the force between the split scales of the fine and the coarse mesh,
+ * so short-range forces on particles inside the inner cube are split at the fine scale.*/
+struct PMZoomRegion {
+    int Enabled;
+    /* Centre and half side of the cube containing the zoom particles*/
+    double Center[3];
+    double HalfSide;
+    /* Low corner and side of the zoom mesh: the cube plus the tree cut of the coarse mesh on each side*/
+    double Corner[3];
+    double MeshSize;
+    /* Size of a cell of the zoom mesh*/
+    double cellsize;
+};
+
+const struct PMZoomRegion * gravpm_zoom_region(void);
+/* Place the zoom mesh around the particles of type PMZoomType. Collective; call on PM steps before the tree walk.*/
+void gravpm_zoom_update_region(PetaPM * pm);
+
 /*Note: tree is rebuilt during this function*/
 void gravpm_force(PetaPM * pm, ForceTree * tree);
+/* gravpm_force in two halves, so that the short-range tree walk can overlap the exchange of the density*/
+void gravpm_force_start(PetaPM * pm, ForceTree * tree, int freetree);
+void gravpm_force_finish(PetaPM * pm);
+/* Paint the gas mass on a mesh of Nmesh cells per side and interpolate it back, storing the
+ * gas density at each gas particle in density, indexed like P. The tree gives the mesh regions and is kept.*/
+void gravpm_gas_density(ForceTree * tree, int Nmesh, double * density);
 
 void grav_short_pair(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, double Rcut, double rho0, int NeutrinoTracer, int FastParticleType);
 void grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, double rho0, int NeutrinoTracer, int FastParticleType);
 
 /*Read the power spectrum, without changing the input value.*/
-void measure_power_spectrum(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value);
+void measure_power_spectrum(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex *value);
 
 /* Compute the power spectrum of the Fourier transformed grid in value.*/
-void powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3], pfft_complex * const value, const double invwindow, double Nmesh);
+void powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3], PetaPMComplex * const value, const double invwindow, double Nmesh);
 
 #endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <bigfile-mpi.h>
 
 #include "utils.h"
 
@@ -11,6 +12,7 @@
 #include "petapm.h"
 #include "domain.h"
 #include "gravity.h"
+#include "petaio.h"
 
 #include "cosmology.h"
 #include "neutrinos_lra.h"
@@ -19,15 +21,16 @@ static int pm_mark_region_for_node(int startno, int rid, const ForceTree * tt);
 static void convert_node_to_region(PetaPM * pm, PetaPMRegion * r, struct NODE * Nodes);
 
 static int hybrid_nu_gravpm_is_active(int i);
-static void potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
+static void potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
 static void compute_neutrino_power(PetaPM * pm);
-static void force_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void force_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void force_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void readout_potential(PetaPM * pm, int i, double * mesh, double weight);
-static void readout_force_x(PetaPM * pm, int i, double * mesh, double weight);
-static void readout_force_y(PetaPM * pm, int i, double * mesh, double weight);
-static void readout_force_z(PetaPM * pm, int i, double * mesh, double weight);
+static void save_density_mesh(PetaPM * pm, PetaPMReal * real);
+static void force_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void force_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void force_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void readout_potential(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_force_x(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_force_y(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_force_z(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
 static PetaPMFunctions functions [] =
 {
     {"Potential", NULL, readout_potential},
@@ -37,13 +40,55 @@ static PetaPMFunctions functions [] =
     {NULL, NULL, NULL},
 };
 
-static PetaPMGlobalFunctions global_functions = {NULL, NULL, potential_transfer};
+static PetaPMGlobalFunctions global_functions = {
+    .global_transfer = potential_transfer,
+};
 
 static PetaPMRegion * _prepare(PetaPM * pm, void * userdata, int * Nregions);
 
+static void gravpm_zoom_force(PetaPM * pm);
+
+/* Output of gravpm_gas_density, filled by readout_gas_density*/
+static double * GasDensity;
+
+/* The zoom mesh: a second PM mesh with a finer cell, covering the particles of type PMZoomType.*/
+static PetaPM PMZoom[1];
+static int PMZoomInit;
+static struct PMZoomRegion ZoomRegion;
+/* Cell size of the coarse mesh, for the band transfer of the zoom mesh*/
+static double ZoomCoarseCellSize;
+
+/* Next entry of DensityMeshOutputList to write, -1 until the first PM step.
+ * DensityMeshNum is the entry written by the current PM step.*/
+static int DensityMeshNext = -1;
+static int DensityMeshNum;
+
 void
 gravpm_init_periodic(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G) {
-    petapm_init(pm, BoxSize, Asmth, Nmesh, G, MPI_COMM_WORLD);
+    petapm_init_subset(pm, BoxSize, Asmth, Nmesh, G, MPI_COMM_WORLD, All.PMRanks);
+    /* The potential and the three force components*/
+    if(All.PMBatchTransforms)
+        petapm_init_batch(pm, 4);
+    if(All.PMInPlace)
+        petapm_init_inplace(pm);
+    petapm_init_window(pm, All.PMAssignmentOrder, All.PMInterlace);
+    if(All.PMLayoutCache)
+        petapm_init_layout_cache(pm);
+    if(All.PMOffload)
+        petapm_init_offload(pm);
+    if(All.PMFusedReadout)
+        petapm_init_fused_readout(pm);
+
+    /* The zoom mesh is placed and sized on each PM step by gravpm_zoom_update_region*/
+    if(All.PMZoomNmesh > 0 && !PMZoomInit) {
+        if(get_gravshort_treepar().TreeOffload)
+            endrun(0, "PMZoomNmesh is not supported with TreeOffload.\n");
+        petapm_init_subset(PMZoom, BoxSize, Asmth, All.PMZoomNmesh, G, MPI_COMM_WORLD, All.PMRanks);
+        petapm_init_window(PMZoom, All.PMAssignmentOrder, All.PMInterlace);
+        if(All.PMOffload)
+            petapm_init_offload(PMZoom);
+        PMZoomInit = 1;
+    }
 
     /*Initialise the kspace neutrino code if it is enabled.
      * Mpc units are used to match power spectrum code.*/
@@ -58,6 +103,22 @@ gravpm_init_periodic(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, doubl
  * and saves the total matter power spectrum.*/
 void
 gravpm_force(PetaPM * pm, ForceTree * tree) {
+    gravpm_force_start(pm, tree, 1);
+    gravpm_force_finish(pm);
+}
+
+/* State of a PM force calculation between gravpm_force_start and gravpm_force_finish*/
+static PetaPMParticleStruct PMPstruct;
+static PetaPMRegion * PMRegions;
+/* Free the tree in _prepare to save memory during the PM step*/
+static int PMFreeTree;
+
+/* Paints the mesh and posts the exchange of the density to the FFT layout.
+ * Work that does not change the particles or GravPM, such as the short-range
+ * tree walk, can run before gravpm_force_finish while the exchange progresses.
+ * If freetree is false the tree is kept, at the cost of holding it and the mesh together.*/
+void
+gravpm_force_start(PetaPM * pm, ForceTree * tree, int freetree) {
     PetaPMParticleStruct pstruct = {
         P,
         sizeof(P[0]),
@@ -68,11 +129,35 @@ gravpm_force(PetaPM * pm, ForceTree * tree) {
         NULL,
         PartManager->NumPart,
     };
+    PMPstruct = pstruct;
 
     if(All.HybridNeutrinosOn && particle_nu_fraction(&All.CP.ONu.hybnu, All.Time, 0) == 0.)
-        pstruct.active = &hybrid_nu_gravpm_is_active;
+        PMPstruct.active = &hybrid_nu_gravpm_is_active;
 
+    /* Write the coarse density mesh if this is the first PM step at or after an entry of the list.
+     * All the entries before the first PM step of this run have been written already.*/
+    if(DensityMeshNext < 0) {
+        DensityMeshNext = 0;
+        while(DensityMeshNext < All.DensityMeshOutputListLength && All.DensityMeshOutputListTimes[DensityMeshNext] < All.Time)
+            DensityMeshNext++;
+    }
+    global_functions.global_density = NULL;
+    while(DensityMeshNext < All.DensityMeshOutputListLength && All.DensityMeshOutputListTimes[DensityMeshNext] <= All.Time) {
+        DensityMeshNum = DensityMeshNext++;
+        global_functions.global_density = save_density_mesh;
+    }
+
+    PMFreeTree = freetree;
+    PMRegions = petapm_force_init(pm, _prepare, &PMPstruct, tree);
+    petapm_force_r2c_start(pm);
+}
+
+/* Completes the PM force started by gravpm_force_start*/
+void
+gravpm_force_finish(PetaPM * pm) {
     int i;
+    /* The tree walk uses the PM acceleration of the last step to open nodes,
+     * so it may only be cleared here.*/
     #pragma omp parallel for
     for(i = 0; i < PartManager->NumPart; i++)
     {
@@ -84,7 +169,12 @@ gravpm_force(PetaPM * pm, ForceTree * tree) {
      * Therefore the force transfer functions are based on the potential,
      * not the density.
      * */
-    petapm_force(pm, _prepare, &global_functions, functions, &pstruct, tree);
+    PetaPMComplex * rho_k = petapm_force_r2c(pm, &global_functions);
+    petapm_force_c2r(pm, rho_k, PMRegions, functions);
+    myfree(rho_k);
+    myfree(PMRegions);
+    petapm_force_finish(pm);
+
     powerspectrum_sum(pm->ps);
     /*Now save the power spectrum*/
     if(ThisTask == 0) {
@@ -95,7 +185,66 @@ gravpm_force(PetaPM * pm, ForceTree * tree) {
     }
     /*We are done with the power spectrum, free it*/
     powerspectrum_free(pm->ps);
+    walltime_measure("/PMgrav/Power");
     walltime_measure("/LongRange");
+
+    gravpm_zoom_force(pm);
+}
+
+static int
+gas_gravpm_is_active(int i)
+{
+    return P[i].Type == 0;
+}
+
+/* The painted mesh is the mass per cell. The FFTs are not normalized, so c2r(r2c(x)) = Nmesh^3 x.*/
+static void
+gas_density_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value)
+{
+    const double fac = 1. / pow(pm->Nmesh * pm->CellSize, 3);
+    value[0][0] *= fac;
+    value[0][1] *= fac;
+}
+
+static void
+readout_gas_density(PetaPM * pm, int i, PetaPMReal * mesh, double weight)
+{
+    if(P[i].Type == 0)
+        GasDensity[i] += weight * mesh[0];
+}
+
+void
+gravpm_gas_density(ForceTree * tree, int Nmesh, double * density)
+{
+    PetaPM pm[1];
+    memset(pm, 0, sizeof(pm[0]));
+    petapm_init(pm, All.BoxSize, All.Asmth, Nmesh, All.G, MPI_COMM_WORLD);
+
+    PetaPMParticleStruct pstruct = {
+        P,
+        sizeof(P[0]),
+        (char*) &P[0].Pos[0]  - (char*) P,
+        (char*) &P[0].Mass  - (char*) P,
+        (char*) &P[0].RegionInd - (char*) P,
+        /* Only the gas is painted*/
+        gas_gravpm_is_active,
+        PartManager->NumPart,
+    };
+    PetaPMFunctions density_functions[] = {
+        {"GasDensity", NULL, readout_gas_density},
+        {NULL, NULL, NULL},
+    };
+    PetaPMGlobalFunctions density_global_functions = {.global_transfer = gas_density_transfer};
+
+    memset(density, 0, sizeof(double) * PartManager->NumPart);
+    GasDensity = density;
+    PMFreeTree = 0;
+    petapm_force(pm, _prepare, &density_global_functions, density_functions, &pstruct, tree);
+    GasDensity = NULL;
+    /* _prepare allocates a power spectrum for the gravity mesh*/
+    powerspectrum_free(pm->ps);
+    petapm_destroy(pm);
+    walltime_measure("/Init/HsmlMesh");
 }
 
 static PetaPMRegion * _prepare(PetaPM * pm, void * userdata, int * Nregions) {
@@ -179,10 +328,12 @@ static PetaPMRegion * _prepare(PetaPM * pm, void * userdata, int * Nregions) {
         convert_node_to_region(pm, &regions[r], tree->Nodes);
     }
     /*This is done to conserve memory during the PM step*/
-    if(force_tree_allocated(tree)) force_tree_free(tree);
+    if(PMFreeTree && force_tree_allocated(tree)) force_tree_free(tree);
 
     /*Allocate memory for a power spectrum*/
     powerspectrum_alloc(pm->ps, pm->Nmesh, All.NumThreads, All.MassiveNuLinRespOn, pm->BoxSize*All.UnitLength_in_cm);
+    /* The log bins run from the fundamental mode to the corner of the mesh*/
+    pm->ps->LogK2BinFac = 0.5 * (pm->ps->size - 1) / log(sqrt(3) * pm->Nmesh / 2.0);
 
     walltime_measure("/PMgrav/Regions");
     return regions;
@@ -271,6 +422,25 @@ static double sinc_unnormed(double x) {
     }
 }
 
+/* the deconvolution kernel of the assignment window is
+ *
+ * sinc_unnormed(k_x L / 2 Nmesh) ** order
+ *
+ * k_x = kpos * 2pi / L
+ *
+ * with order 2 for CIC, 3 for TSC and 4 for PCS.
+ * */
+static double window_deconvolution(PetaPM * pm, const int kpos[3]) {
+    double f = 1.0;
+    int k;
+    for(k = 0; k < 3; k ++) {
+        double tmp = (kpos[k] * M_PI) / pm->Nmesh;
+        tmp = sinc_unnormed(tmp);
+        f /= pow(tmp, pm->AssignmentOrder);
+    }
+    return f;
+}
+
 /* Update the model prediction of LinResp neutrino power spectrum.
  * This should happen after the CFT is computed,
  * and after powerspectrum_add_mode() has been called,
@@ -297,10 +467,150 @@ static void compute_neutrino_power(PetaPM * pm) {
     powerspectrum_zero(ps);
 }
 
+/* The mass of the fine cells of one rank inside a coarse cell of the density mesh*/
+struct CoarseCell {
+    int64_t index;
+    double mass;
+};
+
+/* Bin the CIC mass mesh into DensityMeshNmesh^3 coarse cells and save the overdensity
+ * to DensityMesh_%03d. The coarse cells are written in x, y, z order and rank r writes
+ * cells Ncells * r / NTask to Ncells * (r + 1) / NTask - 1, so the partial sums
+ * of each rank are sent to the ranks writing their cells.*/
+static void
+save_density_mesh(PetaPM * pm, PetaPMReal * real)
+{
+    const int Nc = All.DensityMeshNmesh;
+    if(Nc <= 0 || pm->Nmesh % Nc != 0)
+        endrun(1, "DensityMeshNmesh = %d does not divide the PM mesh size %d\n", Nc, pm->Nmesh);
+    const int f = pm->Nmesh / Nc;
+    const int64_t Ncells = (int64_t) Nc * Nc * Nc;
+    const PetaPMRegion * region = &pm->real_space_region;
+
+    int NTask, ThisTask;
+    MPI_Comm_size(pm->comm, &NTask);
+    MPI_Comm_rank(pm->comm, &ThisTask);
+
+    const int64_t firstcell = Ncells * ThisTask / NTask;
+    const int64_t nown = Ncells * (ThisTask + 1) / NTask - firstcell;
+    double * coarse = mymalloc("DensityMesh", sizeof(double) * nown);
+    memset(coarse, 0, sizeof(double) * nown);
+
+    /* Coarse cells overlapping the fine cells of this rank*/
+    int cstart[3], csize[3];
+    int k;
+    for(k = 0; k < 3; k++) {
+        cstart[k] = region->offset[k] / f;
+        csize[k] = 0;
+        if(region->size[k] > 0)
+            csize[k] = (region->offset[k] + region->size[k] - 1) / f - cstart[k] + 1;
+    }
+    const int64_t nlocal = (int64_t) csize[0] * csize[1] * csize[2];
+    struct CoarseCell * local = mymalloc("DensityMeshLocal", sizeof(struct CoarseCell) * nlocal);
+
+    double mass = 0;
+    int64_t i;
+    #pragma omp parallel for reduction(+: mass)
+    for(i = 0; i < nlocal; i++) {
+        int c[3], lo[3], hi[3];
+        int d;
+        c[2] = i % csize[2];
+        c[1] = (i / csize[2]) % csize[1];
+        c[0] = i / csize[2] / csize[1];
+        for(d = 0; d < 3; d++) {
+            c[d] += cstart[d];
+            lo[d] = c[d] * f - region->offset[d];
+            hi[d] = lo[d] + f;
+            if(lo[d] < 0) lo[d] = 0;
+            if(hi[d] > region->size[d]) hi[d] = region->size[d];
+        }
+        double m = 0;
+        int x, y, z;
+        for(x = lo[0]; x < hi[0]; x++)
+            for(y = lo[1]; y < hi[1]; y++)
+                for(z = lo[2]; z < hi[2]; z++)
+                    m += real[x * region->strides[0] + y * region->strides[1] + z * region->strides[2]];
+        local[i].index = ((int64_t) c[0] * Nc + c[1]) * Nc + c[2];
+        local[i].mass = m;
+        mass += m;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &mass, 1, MPI_DOUBLE, MPI_SUM, pm->comm);
+
+    /* The local cells are sorted by index, so the cells for each rank are contiguous.*/
+    int * sendcounts = ta_malloc("sendcounts", int, 4 * NTask);
+    int * senddispls = sendcounts + NTask;
+    int * recvcounts = sendcounts + 2 * NTask;
+    int * recvdispls = sendcounts + 3 * NTask;
+    memset(sendcounts, 0, sizeof(int) * NTask);
+    int task = 0;
+    for(i = 0; i < nlocal; i++) {
+        while(local[i].index >= Ncells * (task + 1) / NTask)
+            task++;
+        sendcounts[task]++;
+    }
+    MPI_Alltoall(sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT, pm->comm);
+    int nrecv = 0;
+    for(task = 0; task < NTask; task++) {
+        senddispls[task] = task > 0 ? senddispls[task - 1] + sendcounts[task - 1] : 0;
+        recvdispls[task] = nrecv;
+        nrecv += recvcounts[task];
+    }
+    MPI_Datatype MPI_TYPE_COARSE;
+    MPI_Type_contiguous(sizeof(struct CoarseCell), MPI_BYTE, &MPI_TYPE_COARSE);
+    MPI_Type_commit(&MPI_TYPE_COARSE);
+    struct CoarseCell * recv = mymalloc("DensityMeshRecv", sizeof(struct CoarseCell) * nrecv);
+    MPI_Alltoallv(local, sendcounts, senddispls, MPI_TYPE_COARSE,
+                  recv, recvcounts, recvdispls, MPI_TYPE_COARSE, pm->comm);
+    MPI_Type_free(&MPI_TYPE_COARSE);
+
+    for(i = 0; i < nrecv; i++)
+        coarse[recv[i].index - firstcell] += recv[i].mass;
+    myfree(recv);
+    ta_free(sendcounts);
+    myfree(local);
+
+    /* Store the overdensity in single precision, in place: entry i is read before it is overwritten.*/
+    const double meanmass = mass / Ncells;
+    float * delta = (float *) coarse;
+    for(i = 0; i < nown; i++)
+        delta[i] = coarse[i] / meanmass - 1;
+
+    char * fname = fastpm_strdup_printf("%s/DensityMesh_%03d", All.OutputDir, DensityMeshNum);
+    message(0, "Saving the %d^3 density mesh at a = %g to %s\n", Nc, All.Time, fname);
+    BigFile bf = {0};
+    if(0 != big_file_mpi_create(&bf, fname, pm->comm)) {
+        endrun(0, "Failed to create density mesh at %s:%s\n", fname, big_file_get_error_message());
+    }
+    BigBlock bh;
+    if(0 != big_file_mpi_create_block(&bf, &bh, "Header", NULL, 0, 0, 0, pm->comm)) {
+        endrun(0, "Failed to create header at %s:%s\n", fname, big_file_get_error_message());
+    }
+    if((0 != big_block_set_attr(&bh, "Time", &All.Time, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "BoxSize", &pm->BoxSize, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Nmesh", &Nc, "i4", 1)) ||
+       (0 != big_block_set_attr(&bh, "MeanCellMass", &meanmass, "f8", 1))) {
+        endrun(0, "Failed to write header attributes %s\n", big_file_get_error_message());
+    }
+    big_block_mpi_close(&bh, pm->comm);
+
+    BigArray array = {0};
+    size_t dims[2] = {nown, 1};
+    ptrdiff_t strides[2] = {sizeof(float), sizeof(float)};
+    big_array_init(&array, delta, "f4", 2, dims, strides);
+    petaio_save_block(&bf, "Delta", &array, 1);
+
+    if(0 != big_file_mpi_close(&bf, pm->comm)) {
+        endrun(0, "Failed to close density mesh at %s:%s\n", fname, big_file_get_error_message());
+    }
+    myfree(fname);
+    myfree(coarse);
+    walltime_measure("/PMgrav/DensityMesh");
+}
+
 /* Compute the power spectrum of the fourier transformed grid in value.
  * Store it in the PowerSpectrum structure */
 void
-powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3], pfft_complex * const value, const double invwindow, double Nmesh)
+powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3], PetaPMComplex * const value, const double invwindow, double Nmesh)
 {
     if(k2 == 0) {
         /* Save zero mode corresponding to the mean as the normalisation factor.*/
@@ -311,11 +621,10 @@ powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3
      * Some modes with k_z = 0 or N/2 have weight 1, the rest have weight 2.
      * This is because of the symmetry of the real fft. */
     if(k2 > 0) {
-        /*How many bins per unit (log) interval in k?*/
-        const double binsperunit=(PowerSpectrum->size-1)/log(sqrt(3) * Nmesh/2.0);
-        int kint=floor(binsperunit*log(k2)/2.);
+        /* k2 >= 1, so the truncation is the floor. The bin factor is precomputed in _prepare.*/
+        const int kint = PowerSpectrum->LogK2BinFac * log((double) k2);
         int w;
-        const double keff = sqrt(kpos[0]*kpos[0]+kpos[1]*kpos[1]+kpos[2]*kpos[2]);
+        const double keff = sqrt((double) k2);
         const double m = (value[0][0] * value[0][0] + value[0][1] * value[0][1]);
         /*Make sure we do not overflow (although this should never happen)*/
         if(kint >= PowerSpectrum->size)
@@ -334,26 +643,13 @@ powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3
 
 /*Just read the power spectrum, without changing the input value.*/
 void
-measure_power_spectrum(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value) {
-    double f = 1.0;
-    /* the CIC deconvolution kernel is
-     *
-     * sinc_unnormed(k_x L / 2 Nmesh) ** 2
-     *
-     * k_x = kpos * 2pi / L
-     *
-     * */
-    int k;
-    for(k = 0; k < 3; k ++) {
-        double tmp = (kpos[k] * M_PI) / pm->Nmesh;
-        tmp = sinc_unnormed(tmp);
-        f *= 1. / (tmp * tmp);
-    }
+measure_power_spectrum(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex *value) {
+    double f = window_deconvolution(pm, kpos);
     powerspectrum_add_mode(pm->ps, k2, kpos, value, f, pm->Nmesh);
 }
 
 static void
-potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value)
+potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex *value)
 {
     const double asmth2 = pow((2 * M_PI) * pm->Asmth / pm->Nmesh,2);
     double f = 1.0;
@@ -364,21 +660,9 @@ potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value)
     const double pot_factor = - pm->G / (M_PI * pm->BoxSize);	/* to get potential */
 
 
-    /* the CIC deconvolution kernel is
-     *
-     * sinc_unnormed(k_x L / 2 Nmesh) ** 2
-     *
-     * k_x = kpos * 2pi / L
-     *
-     * */
-    int k;
-    for(k = 0; k < 3; k ++) {
-        double tmp = (kpos[k] * M_PI) / pm->Nmesh;
-        tmp = sinc_unnormed(tmp);
-        f *= 1. / (tmp * tmp);
-    }
+    f = window_deconvolution(pm, kpos);
     /*
-     * first decovolution is CIC in par->mesh
+     * first decovolution is the assignment window in par->mesh
      * second decovolution is correcting readout
      * I don't understand the second yet!
      * */
@@ -445,7 +729,7 @@ static int hybrid_nu_gravpm_is_active(int i) {
         return 1;
 }
 
-static void force_transfer(PetaPM * pm, int k, pfft_complex * value) {
+static void force_transfer(PetaPM * pm, int k, PetaPMComplex * value) {
     double tmp0;
     double tmp1;
     /*
@@ -459,24 +743,303 @@ static void force_transfer(PetaPM * pm, int k, pfft_complex * value) {
     value[0][0] = tmp0;
     value[0][1] = tmp1;
 }
-static void force_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void force_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     force_transfer(pm, kpos[0], value);
 }
-static void force_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void force_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     force_transfer(pm, kpos[1], value);
 }
-static void force_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void force_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     force_transfer(pm, kpos[2], value);
 }
-static void readout_potential(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_potential(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     P[i].Potential += weight * mesh[0];
 }
-static void readout_force_x(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_force_x(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     P[i].GravPM[0] += weight * mesh[0];
 }
-static void readout_force_y(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_force_y(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     P[i].GravPM[1] += weight * mesh[0];
 }
-static void readout_force_z(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_force_z(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     P[i].GravPM[2] += weight * mesh[0];
 }
+
+/********************
+ * The zoom mesh.
+ *
+ * The coarse mesh gives the force on scales larger than its split scale,
+ * Asmth coarse cells. The zoom mesh covers the region around the particles of type
+ * PMZoomType and adds the force between its own split scale and the coarse one, so that
+ * inside the region the tree only needs the force within Asmth zoom cells.
+ * The band kernel falls off beyond the tree cut of the coarse mesh, so the zoom mesh is
+ * periodic and padded by that cut on each side of the region: particles in the inner cube
+ * do not see the periodic images.
+ *********************/
+
+const struct PMZoomRegion *
+gravpm_zoom_region(void)
+{
+    return &ZoomRegion;
+}
+
+static int
+zoom_particle(int i)
+{
+    return P[i].Type == All.PMZoomType && !P[i].IsGarbage && !P[i].Swallowed;
+}
+
+/* Map x into [0, BoxSize)*/
+static double
+zoom_wrap(double x, const double BoxSize)
+{
+    return x - floor(x / BoxSize) * BoxSize;
+}
+
+static void
+zoom_set_flags(void)
+{
+    const double BoxSize = All.BoxSize;
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int k, inside = ZoomRegion.Enabled;
+        for(k = 0; inside && k < 3; k++)
+            if(fabs(NEAREST(P[i].Pos[k] - ZoomRegion.Center[k], BoxSize)) > ZoomRegion.HalfSide)
+                inside = 0;
+        P[i].InZoom = inside;
+    }
+}
+
+void
+gravpm_zoom_update_region(PetaPM * pm)
+{
+    ZoomRegion.Enabled = 0;
+    if(!PMZoomInit)
+        return;
+
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const double BoxSize = pm->BoxSize;
+
+    /* The extent is measured from the position of one zoom particle,
+     * so that a region crossing the box edge is not split in two.*/
+    int i, k;
+    int first = -1;
+    for(i = 0; i < PartManager->NumPart; i++)
+        if(zoom_particle(i)) {
+            first = i;
+            break;
+        }
+    int reftask = first >= 0 ? ThisTask : NTask;
+    MPI_Allreduce(MPI_IN_PLACE, &reftask, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if(reftask == NTask) {
+        message(0, "No particles of type %d: not using the zoom PM mesh.\n", All.PMZoomType);
+        zoom_set_flags();
+        return;
+    }
+    double ref[3] = {0};
+    if(ThisTask == reftask)
+        for(k = 0; k < 3; k++)
+            ref[k] = P[first].Pos[k];
+    MPI_Bcast(ref, 3, MPI_DOUBLE, reftask, MPI_COMM_WORLD);
+
+    double lo[3], hi[3];
+    for(k = 0; k < 3; k++) {
+        double l = 0, h = 0;
+        #pragma omp parallel for reduction(min: l) reduction(max: h)
+        for(i = 0; i < PartManager->NumPart; i++) {
+            if(!zoom_particle(i))
+                continue;
+            const double d = NEAREST(P[i].Pos[k] - ref[k], BoxSize);
+            if(d < l) l = d;
+            if(d > h) h = d;
+        }
+        lo[k] = l;
+        hi[k] = h;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, lo, 3, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, hi, 3, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+    double HalfSide = 0;
+    for(k = 0; k < 3; k++) {
+        ZoomRegion.Center[k] = zoom_wrap(ref[k] + (lo[k] + hi[k]) / 2, BoxSize);
+        HalfSide = DMAX(HalfSide, (hi[k] - lo[k]) / 2);
+    }
+    const double margin = get_gravshort_treepar().Rcut * pm->Asmth * pm->CellSize;
+    ZoomRegion.HalfSide = HalfSide;
+    ZoomRegion.MeshSize = 2 * (HalfSide + margin);
+    ZoomRegion.cellsize = ZoomRegion.MeshSize / PMZoom->Nmesh;
+    for(k = 0; k < 3; k++)
+        ZoomRegion.Corner[k] = ZoomRegion.Center[k] - ZoomRegion.MeshSize / 2;
+
+    if(ZoomRegion.cellsize >= pm->CellSize) {
+        message(0, "Zoom region of side %g needs PMZoomNmesh > %g for a finer mesh: not using the zoom PM mesh.\n",
+                2 * HalfSide, ZoomRegion.MeshSize / pm->CellSize);
+        zoom_set_flags();
+        return;
+    }
+    ZoomRegion.Enabled = 1;
+    ZoomCoarseCellSize = pm->CellSize;
+    petapm_set_boxsize(PMZoom, ZoomRegion.MeshSize);
+    zoom_set_flags();
+    message(0, "Zoom PM mesh of side %g centred at %g %g %g: cell size %g, coarse cell size %g\n",
+            ZoomRegion.MeshSize, ZoomRegion.Center[0], ZoomRegion.Center[1], ZoomRegion.Center[2],
+            ZoomRegion.cellsize, pm->CellSize);
+}
+
+/* A particle inside the zoom mesh, with its position relative to the low corner*/
+struct ZoomPart {
+    double Pos[3];
+    float Mass;
+    int RegionInd;
+    /* Index in P*/
+    int Index;
+};
+
+static struct ZoomPart * ZoomParts;
+static int NumZoomParts;
+
+/* One region per rank, covering the local particles inside the zoom mesh*/
+static PetaPMRegion *
+_prepare_zoom(PetaPM * pm, void * userdata, int * Nregions)
+{
+    PetaPMRegion * regions = mymalloc2("ZoomRegions", sizeof(PetaPMRegion));
+    *Nregions = NumZoomParts > 0;
+    if(NumZoomParts == 0)
+        return regions;
+
+    double lo[3], hi[3];
+    int i, k;
+    for(k = 0; k < 3; k++)
+        lo[k] = hi[k] = ZoomParts[0].Pos[k];
+    for(i = 0; i < NumZoomParts; i++) {
+        for(k = 0; k < 3; k++) {
+            lo[k] = DMIN(lo[k], ZoomParts[i].Pos[k]);
+            hi[k] = DMAX(hi[k], ZoomParts[i].Pos[k]);
+        }
+        ZoomParts[i].RegionInd = 0;
+    }
+    regions[0].len = 0;
+    for(k = 0; k < 3; k++) {
+        regions[0].offset[k] = floor(lo[k] / pm->CellSize);
+        int end = (int) ceil(hi[k] / pm->CellSize) + 1;
+        regions[0].size[k] = end - regions[0].offset[k] + 1;
+        regions[0].center[k] = (lo[k] + hi[k]) / 2;
+        regions[0].len = DMAX(regions[0].len, hi[k] - lo[k]);
+    }
+    petapm_region_init_strides(&regions[0]);
+    regions[0].numpart = NumZoomParts;
+    regions[0].no = 0;
+
+    walltime_measure("/PMgrav/Regions");
+    return regions;
+}
+
+/* The potential of the band between the split scales of the zoom and the coarse mesh*/
+static void
+zoom_potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value)
+{
+    if(k2 == 0) {
+        /* The mean is in the coarse mesh*/
+        value[0][0] = 0.0;
+        value[0][1] = 0.0;
+        return;
+    }
+    const double asmth2 = pow((2 * M_PI) * pm->Asmth / pm->Nmesh, 2);
+    const double asmth2_coarse = pow((2 * M_PI) * pm->Asmth * ZoomCoarseCellSize / pm->BoxSize, 2);
+    const double smth = (exp(-k2 * asmth2) - exp(-k2 * asmth2_coarse)) / k2;
+    const double pot_factor = - pm->G / (M_PI * pm->BoxSize);
+    const double f = window_deconvolution(pm, kpos);
+    const double fac = pot_factor * smth * f * f;
+    value[0][0] *= fac;
+    value[0][1] *= fac;
+}
+
+/* Only particles inside the inner cube use the fine split scale in the tree*/
+static struct particle_data *
+zoom_readout_target(int i)
+{
+    struct particle_data * part = &P[ZoomParts[i].Index];
+    return part->InZoom ? part : NULL;
+}
+
+static void zoom_readout_potential(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    struct particle_data * part = zoom_readout_target(i);
+    if(part)
+        part->Potential += weight * mesh[0];
+}
+static void zoom_readout_force_x(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    struct particle_data * part = zoom_readout_target(i);
+    if(part)
+        part->GravPM[0] += weight * mesh[0];
+}
+static void zoom_readout_force_y(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    struct particle_data * part = zoom_readout_target(i);
+    if(part)
+        part->GravPM[1] += weight * mesh[0];
+}
+static void zoom_readout_force_z(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    struct particle_data * part = zoom_readout_target(i);
+    if(part)
+        part->GravPM[2] += weight * mesh[0];
+}
+
+static PetaPMFunctions zoom_functions [] =
+{
+    {"ZoomPotential", NULL, zoom_readout_potential},
+    {"ZoomForceX", force_x_transfer, zoom_readout_force_x},
+    {"ZoomForceY", force_y_transfer, zoom_readout_force_y},
+    {"ZoomForceZ", force_z_transfer, zoom_readout_force_z},
+    {NULL, NULL, NULL},
+};
+
+static PetaPMGlobalFunctions zoom_global_functions = {
+    .global_transfer = zoom_potential_transfer,
+};
+
+/* Add the force of the zoom mesh to GravPM of the particles in the zoom region.
+ * Called after the coarse mesh force, with the same particles.*/
+static void
+gravpm_zoom_force(PetaPM * pm)
+{
+    if(!ZoomRegion.Enabled)
+        return;
+
+    const double BoxSize = pm->BoxSize;
+    const double half = ZoomRegion.MeshSize / 2;
+    ZoomParts = mymalloc("ZoomParts", sizeof(struct ZoomPart) * PartManager->NumPart);
+    NumZoomParts = 0;
+    int i, k;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage || (P[i].Swallowed && P[i].Type == 5))
+            continue;
+        struct ZoomPart * zp = &ZoomParts[NumZoomParts];
+        for(k = 0; k < 3; k++) {
+            zp->Pos[k] = NEAREST(P[i].Pos[k] - ZoomRegion.Center[k], BoxSize) + half;
+            if(zp->Pos[k] < 0 || zp->Pos[k] >= ZoomRegion.MeshSize)
+                break;
+        }
+        if(k < 3)
+            continue;
+        /* Tracers are read out but do not gravitate*/
+        zp->Mass = (PMPstruct.active && !PMPstruct.active(i)) ? 0 : P[i].Mass;
+        zp->Index = i;
+        NumZoomParts++;
+    }
+
+    PetaPMParticleStruct pstruct = {
+        ZoomParts,
+        sizeof(ZoomParts[0]),
+        (char*) &ZoomParts[0].Pos[0]  - (char*) ZoomParts,
+        (char*) &ZoomParts[0].Mass  - (char*) ZoomParts,
+        (char*) &ZoomParts[0].RegionInd - (char*) ZoomParts,
+        NULL,
+        NumZoomParts,
+    };
+    petapm_force(PMZoom, _prepare_zoom, &zoom_global_functions, zoom_functions, &pstruct, NULL);
+    myfree(ZoomParts);
+    ZoomParts = NULL;
+    walltime_measure("/PMgrav/Zoom");
+}
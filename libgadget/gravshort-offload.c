@@ -0,0 +1,245 @@
+/*! \file gravshort-offload.c
+ *  \brief short-range gravity from the local mass on an accelerator
+ *
+ *  When TreeOffload is set, grav_short_tree copies the compact tree nodes,
+ *  the particle positions and one query per active particle to an OpenMP
+ *  target device, and walks the part of the tree containing local mass there.
+ *  The TreeWalk on the host then uses force_treeev_shortrange_remote,
+ *  which skips the local mass and exports particles to other processors as usual,
+ *  and the device result is added in grav_short_postprocess.
+ *
+ *  Build with -DTREE_OFFLOAD and a compiler configured for offloading
+ *  (for example gcc -fopenmp -foffload=nvptx-none). Without a device
+ *  the target region runs on the host.
+ */
+#include <mpi.h>
+#include <math.h>
+
+#include "utils.h"
+
+#include "forcetree.h"
+#include "timestep.h"
+#include "gravshort.h"
+
+#ifdef TREE_OFFLOAD
+
+/* Data for one active particle, sent to the device*/
+struct GravOffloadQuery
+{
+    double Pos[3];
+    double Soft;
+    /* ErrTolForceAcc times the old acceleration*/
+    double aold;
+};
+
+/* Tree-opening constants, passed to the device by value*/
+struct GravOffloadParams
+{
+    double BoxSize;
+    double cellsize;
+    double Rcut;
+    int TreeUseBH;
+    double BHOpeningAngle;
+    int firstnode;
+};
+
+#pragma omp declare target
+/* Walk the local part of the tree for one particle. The opening criterion
+ * is that of force_treeev_shortrange, but the walk starts at the root and
+ * opens every top-level node containing local mass. Nodes containing only
+ * mass on other processors are skipped, so pseudo particles are never reached.
+ * Nodes is indexed by node number and Nextnode by particle number.*/
+static int
+grav_offload_walk(const struct GravOffloadQuery * query, const struct node_gravcopy * Nodes, const int * Nextnode,
+        const struct particle_gravcopy * parts, const struct GravOffloadParams par, double acc[3], double * pot)
+{
+    int ninteractions = 0;
+    struct GravInteractionList list[1];
+    list->n = 0;
+    const double BoxSize = par.BoxSize;
+    const double rcut2 = par.Rcut * par.Rcut;
+    const double BH2 = par.BHOpeningAngle * par.BHOpeningAngle;
+
+    int no = par.firstnode;
+    while(no >= 0)
+    {
+        double mass, h;
+        double dx, dy, dz;
+        if(no < par.firstnode)
+        {
+            dx = NEAREST(parts[no].Pos[0] - query->Pos[0], BoxSize);
+            dy = NEAREST(parts[no].Pos[1] - query->Pos[1], BoxSize);
+            dz = NEAREST(parts[no].Pos[2] - query->Pos[2], BoxSize);
+            mass = parts[no].Mass;
+            h = query->Soft;
+            if(h < parts[no].Soft)
+                h = parts[no].Soft;
+            no = Nextnode[no];
+        }
+        else
+        {
+            const struct node_gravcopy * nop = &Nodes[no];
+            /* The host walks the mass on other processors*/
+            if(nop->f.TopLevel && !nop->f.DependsOnLocalMass)
+            {
+                no = nop->sibling;
+                continue;
+            }
+
+            dx = NEAREST(nop->s[0] - query->Pos[0], BoxSize);
+            dy = NEAREST(nop->s[1] - query->Pos[1], BoxSize);
+            dz = NEAREST(nop->s[2] - query->Pos[2], BoxSize);
+            const double r2 = dx * dx + dy * dy + dz * dz;
+
+            if(r2 > rcut2)
+            {
+                const double eff_dist = par.Rcut + 0.5 * nop->len;
+                if(fabs(NEAREST(nop->center[0] - query->Pos[0], BoxSize)) > eff_dist ||
+                    fabs(NEAREST(nop->center[1] - query->Pos[1], BoxSize)) > eff_dist ||
+                    fabs(NEAREST(nop->center[2] - query->Pos[2], BoxSize)) > eff_dist)
+                {
+                    no = nop->sibling;
+                    continue;
+                }
+            }
+
+            /* Internal top-level nodes also contain remote mass, so always open them.*/
+            if(nop->f.InternalTopLevel)
+            {
+                no = nop->nextnode;
+                continue;
+            }
+
+            mass = nop->mass;
+            if((par.TreeUseBH > 0 && nop->len * nop->len > r2 * BH2) ||
+               (par.TreeUseBH == 0 && mass * nop->len * nop->len > r2 * r2 * query->aold))
+            {
+                no = nop->nextnode;
+                continue;
+            }
+            /* check in addition whether we lie inside the cell */
+            if(fabs(NEAREST(nop->center[0] - query->Pos[0], BoxSize)) < 0.60 * nop->len &&
+               fabs(NEAREST(nop->center[1] - query->Pos[1], BoxSize)) < 0.60 * nop->len &&
+               fabs(NEAREST(nop->center[2] - query->Pos[2], BoxSize)) < 0.60 * nop->len)
+            {
+                no = nop->nextnode;
+                continue;
+            }
+
+            h = query->Soft;
+            if(h < nop->MaxSoftening)
+            {
+                h = nop->MaxSoftening;
+                if(r2 < h * h && nop->f.MixedSofteningsInNode)
+                {
+                    no = nop->nextnode;
+                    continue;
+                }
+            }
+            no = nop->sibling;
+        }
+
+        list->dx[list->n] = dx;
+        list->dy[list->n] = dy;
+        list->dz[list->n] = dz;
+        list->mass[list->n] = mass;
+        list->h[list->n] = h;
+        list->n++;
+        if(list->n == GRAV_BATCH_SIZE) {
+            ninteractions += grav_short_range_batch(list, par.cellsize, acc, pot);
+            list->n = 0;
+        }
+    }
+    ninteractions += grav_short_range_batch(list, par.cellsize, acc, pot);
+    return ninteractions;
+}
+#pragma omp end declare target
+
+void
+grav_short_offload_local(const ActiveParticles * act, ForceTree * tree, const struct GravShortPriv * priv)
+{
+    if(tree->Quad)
+        endrun(5, "TreeOffload does not support TreeQuadrupole.\n");
+
+    const int NumPart = PartManager->NumPart;
+    const int nact = act->NumActiveParticle;
+    const int numnodes = tree->numnodes;
+
+    struct GravOffloadParams par;
+    par.BoxSize = tree->BoxSize;
+    par.cellsize = priv->cellsize;
+    par.Rcut = priv->Rcut;
+    par.TreeUseBH = priv->TreeUseBH;
+    par.BHOpeningAngle = priv->BHOpeningAngle;
+    par.firstnode = tree->firstnode;
+
+    const int buildnodes = tree->GravNodes == NULL;
+    if(buildnodes)
+        force_tree_gravcopy_build(tree);
+
+    /* Tracer neutrinos are given zero mass so the device does not need the particle types.*/
+    struct particle_gravcopy * parts = (struct particle_gravcopy *) mymalloc("OffloadParts", NumPart * sizeof(struct particle_gravcopy));
+    struct GravOffloadQuery * query = (struct GravOffloadQuery *) mymalloc("OffloadQuery", nact * sizeof(struct GravOffloadQuery));
+    struct GravShortLocalResult * res = (struct GravShortLocalResult *) mymalloc("OffloadResult", nact * sizeof(struct GravShortLocalResult));
+
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++) {
+        int k;
+        for(k = 0; k < 3; k++)
+            parts[i].Pos[k] = P[i].Pos[k];
+        parts[i].Mass = P[i].Mass;
+        if(priv->NeutrinoTracer && P[i].Type == priv->FastParticleType)
+            parts[i].Mass = 0;
+        parts[i].Soft = FORCE_SOFTENING(i);
+    }
+
+    #pragma omp parallel for
+    for(i = 0; i < nact; i++) {
+        const int p_i = act->ActiveParticle ? act->ActiveParticle[i] : i;
+        double aold = 0;
+        int k;
+        for(k = 0; k < 3; k++) {
+            query[i].Pos[k] = P[p_i].Pos[k];
+            const double ax = P[p_i].GravAccel[k] + P[p_i].GravPM[k];
+            aold += ax * ax;
+        }
+        query[i].Soft = FORCE_SOFTENING(p_i);
+        query[i].aold = priv->ErrTolForceAcc * sqrt(aold) / priv->G;
+    }
+
+    /* Offset the node pointer so the device indexes nodes by node number, as the host does.*/
+    const struct node_gravcopy * nodes = tree->GravNodes + tree->firstnode;
+    const int * nextnode = tree->Nextnode;
+
+    #pragma omp target teams distribute parallel for map(to: nodes[0:numnodes], nextnode[0:NumPart], parts[0:NumPart], query[0:nact]) map(from: res[0:nact])
+    for(i = 0; i < nact; i++) {
+        int k;
+        for(k = 0; k < 3; k++)
+            res[i].acc[k] = 0;
+        res[i].pot = 0;
+        res[i].ninteractions = grav_offload_walk(&query[i], nodes - par.firstnode, nextnode, parts, par, res[i].acc, &res[i].pot);
+    }
+
+    #pragma omp parallel for
+    for(i = 0; i < nact; i++) {
+        const int p_i = act->ActiveParticle ? act->ActiveParticle[i] : i;
+        priv->LocalResult[p_i] = res[i];
+    }
+
+    myfree(res);
+    myfree(query);
+    myfree(parts);
+    if(buildnodes)
+        force_tree_gravcopy_free(tree);
+}
+
+#else
+
+void
+grav_short_offload_local(const ActiveParticles * act, ForceTree * tree, const struct GravShortPriv * priv)
+{
+    endrun(5, "TreeOffload requires compiling with -DTREE_OFFLOAD.\n");
+}
+
+#endif
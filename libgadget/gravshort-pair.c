@@ -11,6 +11,7 @@
 #include "cooling.h"
 #include "densitykernel.h"
 #include "treewalk.h"
+#include "treewalk_ngbiter.h"
 #include "gravshort.h"
 #include "walltime.h"
 
@@ -21,6 +22,14 @@ grav_short_pair_ngbiter(
         TreeWalkNgbIterGravShort * iter,
         LocalTreeWalk * lv);
 
+TREEWALK_DEFINE_NGBITER_VISIT(grav_short_pair_visit, grav_short_pair_ngbiter, TreeWalkNgbIterGravShort)
+
+static int
+grav_short_pair_group(TreeWalkQueryGravShort ** input,
+        TreeWalkResultGravShort ** output,
+        const int ngroup,
+        LocalTreeWalk * lv);
+
 void
 grav_short_pair(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, double Rcut, double rho0, int NeutrinoTracer, int FastParticleType)
 {
@@ -33,13 +42,18 @@ grav_short_pair(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, doub
     priv.NeutrinoTracer = NeutrinoTracer;
     priv.G = pm->G;
     priv.cbrtrho0 = pow(rho0, 1.0 / 3);
+    priv.LocalResult = NULL;
+    priv.Zoom = 0;
 
     message(0, "Starting pair-wise short range gravity...\n");
 
     tw->ev_label = "GRAV_SHORT";
-    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->visit = grav_short_pair_visit;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterGravShort);
     tw->ngbiter = (TreeWalkNgbIterFunction) grav_short_pair_ngbiter;
+    /* Particles sharing a tree leaf gather their neighbours once and sum over them in tiles*/
+    if(get_gravshort_treepar().TreeGroupWalk)
+        tw->visit_group = (TreeWalkGroupVisitFunction) grav_short_pair_group;
 
     tw->haswork = NULL;
     tw->fill = (TreeWalkFillQueryFunction) grav_short_copy;
@@ -129,3 +143,183 @@ grav_short_pair_ngbiter(
         O->Ninteractions ++;
     }
 }
+
+/* A tile of sources for grav_short_pair_group, in the tree (Peano) order.*/
+struct GravPairTile
+{
+    int n;
+    double x[GRAV_BATCH_SIZE];
+    double y[GRAV_BATCH_SIZE];
+    double z[GRAV_BATCH_SIZE];
+    double mass[GRAV_BATCH_SIZE];
+    double h[GRAV_BATCH_SIZE];
+};
+
+/* Sum the tile for each member of the group, keeping only the sources inside rcut
+ * as the neighbour search of the single particle walk does, and empty the tile.*/
+static int
+grav_pair_tile_flush(struct GravPairTile * tile, TreeWalkQueryGravShort ** input, double (*acc)[3], double * pot,
+        int * ninteractions, const int ngroup, const double BoxSize, const double cellsize, const double rcut2)
+{
+    struct GravInteractionList list[1];
+    double dx[GRAV_BATCH_SIZE], dy[GRAV_BATCH_SIZE], dz[GRAV_BATCH_SIZE], r2[GRAV_BATCH_SIZE];
+    int m, j, ntot = 0;
+    for(m = 0; m < ngroup; m++) {
+        const double * pos = input[m]->base.Pos;
+        #pragma omp simd
+        for(j = 0; j < tile->n; j++) {
+            dx[j] = NEAREST(tile->x[j] - pos[0], BoxSize);
+            dy[j] = NEAREST(tile->y[j] - pos[1], BoxSize);
+            dz[j] = NEAREST(tile->z[j] - pos[2], BoxSize);
+            r2[j] = dx[j] * dx[j] + dy[j] * dy[j] + dz[j] * dz[j];
+        }
+        list->n = 0;
+        for(j = 0; j < tile->n; j++) {
+            list->dx[list->n] = dx[j];
+            list->dy[list->n] = dy[j];
+            list->dz[list->n] = dz[j];
+            list->mass[list->n] = tile->mass[j];
+            list->h[list->n] = DMAX(input[m]->Soft, tile->h[j]);
+            list->n += (r2[j] <= rcut2);
+        }
+        const int ninter = grav_short_range_batch(list, cellsize, acc[m], &pot[m]);
+        ninteractions[m] += ninter;
+        ntot += ninter;
+    }
+    tile->n = 0;
+    return ntot;
+}
+
+/* Add source p to the tile. Returns 1 if the tile is full.*/
+static int
+grav_pair_tile_add(struct GravPairTile * tile, const int p, const struct GravShortPriv * priv)
+{
+    if(P[p].IsGarbage)
+        return 0;
+    if(P[p].Mass == 0) {
+        endrun(12, "Encountered zero mass particle during density;"
+                  " We haven't implemented tracer particles and this shall not happen\n");
+    }
+    /* Don't include neutrino tracers*/
+    if(priv->NeutrinoTracer && P[p].Type == priv->FastParticleType)
+        return 0;
+    const struct particle_gravcopy * gravcopy = PartManager->GravCopy;
+    if(gravcopy) {
+        tile->x[tile->n] = gravcopy[p].Pos[0];
+        tile->y[tile->n] = gravcopy[p].Pos[1];
+        tile->z[tile->n] = gravcopy[p].Pos[2];
+        tile->h[tile->n] = gravcopy[p].Soft;
+    } else {
+        tile->x[tile->n] = P[p].Pos[0];
+        tile->y[tile->n] = P[p].Pos[1];
+        tile->z[tile->n] = P[p].Pos[2];
+        tile->h[tile->n] = FORCE_SOFTENING(p);
+    }
+    tile->mass[tile->n] = P[p].Mass;
+    tile->n++;
+    return tile->n == GRAV_BATCH_SIZE;
+}
+
+/*! Direct summation for a group of primary particles sharing a tree leaf.
+ *  The tree is only used as a cell list: every node within rcut of the bounding sphere
+ *  of the group is opened, and the particles found are gathered once into tiles
+ *  of GRAV_BATCH_SIZE. Each member then sums over a tile with grav_short_range_batch,
+ *  instead of calling the ngbiter for every pair.
+ */
+static int
+grav_short_pair_group(TreeWalkQueryGravShort ** input,
+        TreeWalkResultGravShort ** output,
+        const int ngroup,
+        LocalTreeWalk * lv)
+{
+    const ForceTree * tree = lv->tw->tree;
+    const double BoxSize = tree->BoxSize;
+    const struct GravShortPriv * priv = GRAV_GET_PRIV(lv->tw);
+    const double cellsize = priv->cellsize;
+    const double rcut = priv->Rcut;
+
+    /* Bounding sphere of the group*/
+    double gmin[3] = {0}, gmax[3] = {0};
+    double gcenter[3], grad2 = 0;
+    int m, d;
+    for(m = 1; m < ngroup; m++) {
+        for(d = 0; d < 3; d++) {
+            const double off = NEAREST(input[m]->base.Pos[d] - input[0]->base.Pos[d], BoxSize);
+            gmin[d] = DMIN(gmin[d], off);
+            gmax[d] = DMAX(gmax[d], off);
+        }
+    }
+    for(d = 0; d < 3; d++) {
+        gcenter[d] = input[0]->base.Pos[d] + 0.5 * (gmin[d] + gmax[d]);
+        grad2 += 0.25 * (gmax[d] - gmin[d]) * (gmax[d] - gmin[d]);
+    }
+    const double grad = sqrt(grad2);
+
+    double acc[TREEWALK_GROUP_MAX][3] = {{0}};
+    double pot[TREEWALK_GROUP_MAX] = {0};
+    int ninteractions[TREEWALK_GROUP_MAX] = {0};
+    int ntot = 0;
+    struct GravPairTile tile[1];
+    tile->n = 0;
+
+    const int * leaf = force_get_leaf_particles(tree);
+    int lpos = 0, lend = 0;
+
+    /* Primary walks always start from the root node*/
+    int no = tree->Nodes[input[0]->base.NodeList[0]].u.d.nextnode;
+
+    while(no >= 0 || lpos < lend)
+    {
+        int full;
+        if(lpos < lend) {
+            full = grav_pair_tile_add(tile, leaf[lpos++], priv);
+        }
+        else if(node_is_particle(no, tree)) {
+            const int p = no;
+            no = force_get_next_node(no, tree);
+            full = grav_pair_tile_add(tile, p, priv);
+        }
+        else if(node_is_pseudo_particle(no, tree)) {
+            for(m = 0; m < ngroup; m++) {
+                lv->target = lv->targets[m];
+                if(-1 == treewalk_export_particle(lv, no))
+                    return -1;
+            }
+            no = force_get_next_node(no, tree);
+            continue;
+        }
+        else {
+            const struct NODE * current = &tree->Nodes[no];
+            /* Skip the node if nothing in it gravitates or it is out of range of every member*/
+            const double dist = rcut + grad + 0.5 * current->len;
+            if(current->u.d.mass == 0 ||
+                fabs(NEAREST(current->center[0] - gcenter[0], BoxSize)) > dist ||
+                fabs(NEAREST(current->center[1] - gcenter[1], BoxSize)) > dist ||
+                    fabs(NEAREST(current->center[2] - gcenter[2], BoxSize)) > dist)
+            {
+                no = current->u.d.sibling;
+                continue;
+            }
+            if(leaf && current->f.ChildType == PARTICLE_NODE_TYPE) {
+                lpos = leaf[no];
+                lend = lpos + current->f.NumGravParticles;
+                no = current->u.d.sibling;
+            }
+            else
+                no = current->u.d.nextnode;
+            continue;
+        }
+        if(full)
+            ntot += grav_pair_tile_flush(tile, input, acc, pot, ninteractions, ngroup, BoxSize, cellsize, rcut * rcut);
+    }
+    ntot += grav_pair_tile_flush(tile, input, acc, pot, ninteractions, ngroup, BoxSize, cellsize, rcut * rcut);
+
+    for(m = 0; m < ngroup; m++) {
+        for(d = 0; d < 3; d++)
+            output[m]->Acc[d] = acc[m][d];
+        output[m]->Potential = pot[m];
+        output[m]->Ninteractions = ninteractions[m];
+    }
+    lv->Ninteractions += ntot;
+    return ntot;
+}
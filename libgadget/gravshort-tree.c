@@ -32,6 +32,7 @@ static struct gravshort_tree_params TreeParams;
 void set_gravshort_treepar(struct gravshort_tree_params tree_params)
 {
     TreeParams = tree_params;
+    gravshort_set_mixed_precision(TreeParams.TreeMixedPrecision);
 }
 
 struct gravshort_tree_params get_gravshort_treepar(void)
@@ -51,8 +52,24 @@ set_gravshort_tree_params(ParameterSet * ps)
         TreeParams.BHOpeningAngle = param_get_double(ps, "BHOpeningAngle");
         TreeParams.TreeUseBH= param_get_int(ps, "TreeUseBH");
         TreeParams.Rcut = param_get_double(ps, "TreeRcut");
+        TreeParams.TreeParticleCopy = param_get_int(ps, "TreeParticleCopy");
+        TreeParams.TreeNodeCopy = param_get_int(ps, "TreeNodeCopy");
+        TreeParams.TreeQuadrupole = param_get_int(ps, "TreeQuadrupole");
+        TreeParams.TreeGroupWalk = param_get_int(ps, "TreeGroupWalk");
+        TreeParams.TreeOffload = param_get_int(ps, "TreeOffload");
+        TreeParams.ShortRangePolyOrder = param_get_int(ps, "ShortRangePolyOrder");
+        TreeParams.TreeMixedPrecision = param_get_int(ps, "TreeMixedPrecision");
+        if(TreeParams.ShortRangePolyOrder < 0 || TreeParams.ShortRangePolyOrder > GRAV_SHORTRANGE_POLY_MAX)
+            endrun(0, "ShortRangePolyOrder = %d should be between 0 and %d.\n", TreeParams.ShortRangePolyOrder, GRAV_SHORTRANGE_POLY_MAX);
+#ifndef TREE_OFFLOAD
+        if(TreeParams.TreeOffload)
+            endrun(0, "TreeOffload = 1 requires compiling with -DTREE_OFFLOAD.\n");
+#endif
+        if(TreeParams.TreeOffload && TreeParams.TreeQuadrupole)
+            endrun(0, "TreeOffload does not support TreeQuadrupole.\n");
     }
     MPI_Bcast(&TreeParams, sizeof(struct gravshort_tree_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+    gravshort_set_mixed_precision(TreeParams.TreeMixedPrecision);
 }
 
 /* According to upstream P-GADGET3
@@ -66,6 +83,12 @@ force_treeev_shortrange(TreeWalkQueryGravShort * input,
         TreeWalkResultGravShort * output,
         LocalTreeWalk * lv);
 
+int
+force_treeev_shortrange_group(TreeWalkQueryGravShort ** input,
+        TreeWalkResultGravShort ** output,
+        const int ngroup,
+        LocalTreeWalk * lv);
+
 
 /*! This function computes the gravitational forces for all active particles.
  *  If needed, a new tree is constructed, otherwise the dynamically updated
@@ -91,9 +114,20 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, doub
     priv.NeutrinoTracer = NeutrinoTracer;
     priv.G = pm->G;
     priv.cbrtrho0 = pow(rho0, 1.0 / 3);
+    priv.LocalResult = NULL;
+
+    const struct PMZoomRegion * zoom = gravpm_zoom_region();
+    priv.Zoom = zoom->Enabled;
+    if(priv.Zoom) {
+        priv.ZoomCellsize = zoom->cellsize;
+        priv.ZoomRcut = TreeParams.Rcut * pm->Asmth * priv.ZoomCellsize;
+    }
 
     tw->ev_label = "FORCETREE_SHORTRANGE";
     tw->visit = (TreeWalkVisitFunction) force_treeev_shortrange;
+    /* The group walk shares one split scale between the members of a group*/
+    if(TreeParams.TreeGroupWalk && !TreeParams.TreeOffload && !priv.Zoom)
+        tw->visit_group = (TreeWalkGroupVisitFunction) force_treeev_shortrange_group;
     /* gravity applies to all particles. Including Tracer particles to enhance numerical stability. */
     tw->haswork = NULL;
     tw->reduce = (TreeWalkReduceResultFunction) grav_short_reduce;
@@ -107,14 +141,40 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, doub
 
     walltime_measure("/Misc");
 
+    if(TreeParams.TreeQuadrupole) {
+        force_tree_quadrupole_build(tree);
+        walltime_measure("/Tree/Quadrupole");
+    }
+    if(TreeParams.TreeNodeCopy)
+        force_tree_gravcopy_build(tree);
+    if(TreeParams.TreeParticleCopy)
+        particle_gravcopy_build();
+
     /* allocate buffers to arrange communication */
     MPIU_Barrier(MPI_COMM_WORLD);
     message(0, "Begin tree force.  (presently allocated=%g MB)\n", mymalloc_usedbytes() / (1024.0 * 1024.0));
 
     walltime_measure("/Misc");
 
+    /* The local mass is done on the device, the TreeWalk only does the mass on other processors.*/
+    if(TreeParams.TreeOffload) {
+        priv.LocalResult = (struct GravShortLocalResult *) mymalloc("OffloadLocalResult", PartManager->NumPart * sizeof(struct GravShortLocalResult));
+        grav_short_offload_local(act, tree, &priv);
+        tw->visit = (TreeWalkVisitFunction) force_treeev_shortrange_remote;
+        walltime_measure("/Tree/Offload");
+    }
+
     treewalk_run(tw, act->ActiveParticle, act->NumActiveParticle);
 
+    if(priv.LocalResult)
+        myfree(priv.LocalResult);
+    if(TreeParams.TreeParticleCopy)
+        particle_gravcopy_free();
+    if(TreeParams.TreeNodeCopy)
+        force_tree_gravcopy_free(tree);
+    if(TreeParams.TreeQuadrupole)
+        force_tree_quadrupole_free(tree);
+
     /* now add things for comoving integration */
 
     MPIU_Barrier(MPI_COMM_WORLD);
@@ -128,8 +188,9 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, doub
     timewait = tw->timewait1 + tw->timewait2;
     timecomm= tw->timecommsumm1 + tw->timecommsumm2;
 
-    walltime_add("/Tree/Walk1", tw->timecomp1);
-    walltime_add("/Tree/Walk2", tw->timecomp2);
+    walltime_add("/Tree/Walk1", tw->timecomp1 - tw->timeidle1);
+    walltime_add("/Tree/Walk2", tw->timecomp2 - tw->timeidle2);
+    walltime_add("/Tree/ThreadIdle", tw->timeidle1 + tw->timeidle2);
     walltime_add("/Tree/PostProcess", tw->timecomp3);
     walltime_add("/Tree/Send", tw->timecommsumm1);
     walltime_add("/Tree/Recv", tw->timecommsumm2);
@@ -156,24 +217,44 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, doub
  *  memory-access penalty (which reduces cache performance) incurred by the
  *  table.
  */
-int force_treeev_shortrange(TreeWalkQueryGravShort * input,
+/* Open node no. With leaf ranges the particles of a leaf are queued in
+ * leaf[*lpos] ... leaf[*lend - 1] and the walk continues from the sibling once they are done.*/
+static inline __attribute__((always_inline)) int
+grav_open_node(const ForceTree * tree, const int copy, const int no, const int * leaf, int * lpos, int * lend)
+{
+    if(leaf && GRAVNODE(tree, copy, no, f.ChildType) == PARTICLE_NODE_TYPE) {
+        *lpos = leaf[no];
+        /* Tracer neutrinos are at the end of the leaf, and skipped*/
+        *lend = *lpos + GRAVNODE(tree, copy, no, f.NumGravParticles);
+        return GRAVNODE_D(tree, copy, no, sibling);
+    }
+    return GRAVNODE_D(tree, copy, no, nextnode);
+}
+
+/* The walk of force_treeev_shortrange, reading the nodes from tree->GravNodes if copy is set.*/
+static inline __attribute__((always_inline)) int
+force_treeev_shortrange_walk(TreeWalkQueryGravShort * input,
         TreeWalkResultGravShort * output,
-        LocalTreeWalk * lv)
+        LocalTreeWalk * lv, const int copy)
 {
     /*Counters*/
     int ninteractions = 0;
 
     /*Added to the particle struct at the end*/
-    MyDouble pot = 0;
-    MyDouble acc_x = 0;
-    MyDouble acc_y = 0;
-    MyDouble acc_z = 0;
+    double pot = 0;
+    double acc[3] = {0};
+    struct GravInteractionList list[1];
+    list->n = 0;
     const ForceTree * tree = lv->tw->tree;
     const double BoxSize = tree->BoxSize;
 
     /*Tree-opening constants*/
-    const double cellsize = GRAV_GET_PRIV(lv->tw)->cellsize;
-    const double rcut = GRAV_GET_PRIV(lv->tw)->Rcut;
+    double cellsize = GRAV_GET_PRIV(lv->tw)->cellsize;
+    double rcut = GRAV_GET_PRIV(lv->tw)->Rcut;
+    if(GRAV_GET_PRIV(lv->tw)->Zoom && input->InZoom) {
+        cellsize = GRAV_GET_PRIV(lv->tw)->ZoomCellsize;
+        rcut = GRAV_GET_PRIV(lv->tw)->ZoomRcut;
+    }
     const double rcut2 = rcut * rcut;
     const double aold = GRAV_GET_PRIV(lv->tw)->ErrTolForceAcc * input->OldAcc;
 
@@ -182,45 +263,59 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
     const double pos_y = input->base.Pos[1];
     const double pos_z = input->base.Pos[2];
 
+    const struct particle_gravcopy * gravcopy = PartManager->GravCopy;
+    const struct node_quadrupole * quad = tree->Quad;
+    /* Particles of an opened leaf still to be walked, from the leaf ranges*/
+    const int * leaf = force_get_leaf_particles(tree);
+    int lpos = 0, lend = 0;
+
     /*Start the tree walk*/
     int no = input->base.NodeList[0];
     int listindex = 1;
     no = tree->Nodes[no].u.d.nextnode;	/* open it */
 
-    while(no >= 0)
+    while(no >= 0 || lpos < lend)
     {
-        while(no >= 0)
+        while(no >= 0 || lpos < lend)
         {
-            double mass, r2, h;
+            double mass, h;
             double dx, dy, dz;
-            if(node_is_particle(no, tree))
+            if(lpos < lend || node_is_particle(no, tree))
             {
+                int p = no;
+                if(lpos < lend)
+                    p = leaf[lpos++];
+                else
+                    no = force_get_next_node(no, tree);
+
                 /*Hybrid particle neutrinos do not gravitate at early times*/
 
                 if(GRAV_GET_PRIV(lv->tw)->NeutrinoTracer &&
-                    P[no].Type == GRAV_GET_PRIV(lv->tw)->FastParticleType)
-                {
-                    no = force_get_next_node(no, tree);
+                    P[p].Type == GRAV_GET_PRIV(lv->tw)->FastParticleType)
                     continue;
-                }
-
-                dx = NEAREST(P[no].Pos[0] - pos_x, BoxSize);
-                dy = NEAREST(P[no].Pos[1] - pos_y, BoxSize);
-                dz = NEAREST(P[no].Pos[2] - pos_z, BoxSize);
 
-                r2 = dx * dx + dy * dy + dz * dz;
-
-                mass = P[no].Mass;
+                double otherh;
+                if(gravcopy) {
+                    dx = NEAREST(gravcopy[p].Pos[0] - pos_x, BoxSize);
+                    dy = NEAREST(gravcopy[p].Pos[1] - pos_y, BoxSize);
+                    dz = NEAREST(gravcopy[p].Pos[2] - pos_z, BoxSize);
+                    mass = gravcopy[p].Mass;
+                    otherh = gravcopy[p].Soft;
+                }
+                else {
+                    dx = NEAREST(P[p].Pos[0] - pos_x, BoxSize);
+                    dy = NEAREST(P[p].Pos[1] - pos_y, BoxSize);
+                    dz = NEAREST(P[p].Pos[2] - pos_z, BoxSize);
+                    mass = P[p].Mass;
+                    otherh = FORCE_SOFTENING(p);
+                }
 
                 h = input->Soft;
-                const double otherh = FORCE_SOFTENING(no);
                 if(h < otherh)
                     h = otherh;
-                no = force_get_next_node(no, tree);
             }
             else			/* we have an  internal node */
             {
-                struct NODE *nop;
                 if(node_is_pseudo_particle(no, tree))	/* pseudo particle */
                 {
                     if(lv->mode == 0)
@@ -232,118 +327,104 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
                     continue;
                 }
 
-                nop = &tree->Nodes[no];
-
                 if(lv->mode == 1)
                 {
-                    if(nop->f.TopLevel)	/* we reached a top-level node again, which means that we are done with the branch */
+                    if(GRAVNODE(tree, copy, no, f.TopLevel))	/* we reached a top-level node again, which means that we are done with the branch */
                     {
                         no = -1;
                         continue;
                     }
                 }
 
-                dx = NEAREST(nop->u.d.s[0] - pos_x, BoxSize);
-                dy = NEAREST(nop->u.d.s[1] - pos_y, BoxSize);
-                dz = NEAREST(nop->u.d.s[2] - pos_z, BoxSize);
+                /* Nothing in the node gravitates, for example it holds only tracer neutrinos*/
+                if(GRAVNODE_D(tree, copy, no, mass) == 0) {
+                    no = GRAVNODE_D(tree, copy, no, sibling);
+                    continue;
+                }
 
-                r2 = dx * dx + dy * dy + dz * dz;
+                dx = NEAREST(GRAVNODE_D(tree, copy, no, s[0]) - pos_x, BoxSize);
+                dy = NEAREST(GRAVNODE_D(tree, copy, no, s[1]) - pos_y, BoxSize);
+                dz = NEAREST(GRAVNODE_D(tree, copy, no, s[2]) - pos_z, BoxSize);
+                const double len = GRAVNODE(tree, copy, no, len);
+
+                const double r2 = dx * dx + dy * dy + dz * dz;
 
                 /*This checks the distance from the node center of mass*/
                 if(r2 > rcut2)
                 {
                     /* check whether we can stop walking along this branch */
-                    const double eff_dist = rcut + 0.5 * nop->len;
+                    const double eff_dist = rcut + 0.5 * len;
 
                     /*This checks whether we are also outside this region of the oct-tree*/
-                    if(fabs(NEAREST(nop->center[0] - pos_x, BoxSize)) > eff_dist ||
-                        fabs(NEAREST(nop->center[1] - pos_y, BoxSize)) > eff_dist ||
-                            fabs(NEAREST(nop->center[2] - pos_z, BoxSize)) > eff_dist
+                    if(fabs(NEAREST(GRAVNODE(tree, copy, no, center[0]) - pos_x, BoxSize)) > eff_dist ||
+                        fabs(NEAREST(GRAVNODE(tree, copy, no, center[1]) - pos_y, BoxSize)) > eff_dist ||
+                            fabs(NEAREST(GRAVNODE(tree, copy, no, center[2]) - pos_z, BoxSize)) > eff_dist
                       )
                     {
-                        no = nop->u.d.sibling;
+                        no = GRAVNODE_D(tree, copy, no, sibling);
                         continue;
                     }
                 }
 
-                mass = nop->u.d.mass;
-                /*Check Barnes-Hut opening angle or relative opening criterion*/
-                if(((GRAV_GET_PRIV(lv->tw)->TreeUseBH > 0 && nop->len * nop->len > r2 * GRAV_GET_PRIV(lv->tw)->BHOpeningAngle * GRAV_GET_PRIV(lv->tw)->BHOpeningAngle)) ||
-                     (GRAV_GET_PRIV(lv->tw)->TreeUseBH == 0 && (mass * nop->len * nop->len > r2 * r2 * aold)))
+                mass = GRAVNODE_D(tree, copy, no, mass);
+                /*Check Barnes-Hut opening angle or relative opening criterion.
+                 * With quadrupoles the error is one order higher in len / r.*/
+                if(((GRAV_GET_PRIV(lv->tw)->TreeUseBH > 0 && len * len > r2 * GRAV_GET_PRIV(lv->tw)->BHOpeningAngle * GRAV_GET_PRIV(lv->tw)->BHOpeningAngle)) ||
+                     (GRAV_GET_PRIV(lv->tw)->TreeUseBH == 0 && !quad && (mass * len * len > r2 * r2 * aold)) ||
+                     (GRAV_GET_PRIV(lv->tw)->TreeUseBH == 0 && quad && (mass * len * len * len > r2 * r2 * sqrt(r2) * aold)))
                 {
                     /* open cell */
-                    no = nop->u.d.nextnode;
+                    no = grav_open_node(tree, copy, no, leaf, &lpos, &lend);
                     continue;
                 }
                 /* check in addition whether we lie inside the cell */
-                if(fabs(NEAREST(nop->center[0] - pos_x, BoxSize)) < 0.60 * nop->len)
+                if(fabs(NEAREST(GRAVNODE(tree, copy, no, center[0]) - pos_x, BoxSize)) < 0.60 * len)
                 {
-                    if(fabs(NEAREST(nop->center[1] - pos_y, BoxSize)) < 0.60 * nop->len)
+                    if(fabs(NEAREST(GRAVNODE(tree, copy, no, center[1]) - pos_y, BoxSize)) < 0.60 * len)
                     {
-                        if(fabs(NEAREST(nop->center[2] - pos_z, BoxSize)) < 0.60 * nop->len)
+                        if(fabs(NEAREST(GRAVNODE(tree, copy, no, center[2]) - pos_z, BoxSize)) < 0.60 * len)
                         {
-                            no = nop->u.d.nextnode;
+                            no = grav_open_node(tree, copy, no, leaf, &lpos, &lend);
                             continue;
                         }
                     }
                 }
 
                 h = input->Soft;
-                const double otherh = nop->u.d.MaxSoftening;
+                const double otherh = GRAVNODE_D(tree, copy, no, MaxSoftening);
                 if(h < otherh)
                 {
                     h = otherh;
                     if(r2 < h * h)
                     {
-                        if(nop->f.MixedSofteningsInNode)
+                        /* Open a node with mixed softenings unless the softening makes little difference*/
+                        if(GRAVNODE(tree, copy, no, f.MixedSofteningsInNode) &&
+                            !grav_softening_error_ok(sqrt(r2), DMAX(input->Soft, GRAVNODE_D(tree, copy, no, MinSoftening)), h, mass, aold))
                         {
-                            no = nop->u.d.nextnode;
+                            no = grav_open_node(tree, copy, no, leaf, &lpos, &lend);
 
                             continue;
                         }
                     }
                 }
-                no = nop->u.d.sibling;	/* ok, node can be used */
-
-            }
-
-            double facpot, fac;
-
-            const double r = sqrt(r2);
-
-            if(r >= h)
-            {
-                fac = mass / (r2 * r);
-                facpot = -mass / r;
-            }
-            else
-            {
-                double wp;
-                const double h_inv = 1.0 / h;
-                const double h3_inv = h_inv * h_inv * h_inv;
-                const double u = r * h_inv;
-                if(u < 0.5) {
-                    fac = mass * h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
-                    wp = -2.8 + u * u * (5.333333333333 + u * u * (6.4 * u - 9.6));
-                }
-                else {
-                    fac =
-                        mass * h3_inv * (21.333333333333 - 48.0 * u +
-                                38.4 * u * u - 10.666666666667 * u * u * u - 0.066666666667 / (u * u * u));
-                    wp =
-                        -3.2 + 0.066666666667 / u + u * u * (10.666666666667 +
-                                u * (-16.0 + u * (9.6 - 2.133333333333 * u)));
+                if(quad) {
+                    const double nodedx[3] = {dx, dy, dz};
+                    grav_short_range_quadrupole(nodedx, h, quad[no].S, cellsize, acc);
                 }
+                no = GRAVNODE_D(tree, copy, no, sibling);	/* ok, node can be used */
 
-                facpot = mass * h_inv * wp;
             }
 
-            if(0 == grav_apply_short_range_window(r, &fac, &facpot, cellsize)) {
-                acc_x += (dx * fac);
-                acc_y += (dy * fac);
-                acc_z += (dz * fac);
-                pot += facpot;
-                ninteractions++;
+            /* Queue the interaction; the list is evaluated in one vectorized batch when full.*/
+            list->dx[list->n] = dx;
+            list->dy[list->n] = dy;
+            list->dz[list->n] = dz;
+            list->mass[list->n] = mass;
+            list->h[list->n] = h;
+            list->n++;
+            if(list->n == GRAV_BATCH_SIZE) {
+                ninteractions += grav_short_range_batch(list, cellsize, acc, &pot);
+                list->n = 0;
             }
         }
 
@@ -358,9 +439,11 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
         }
     }
 
-    output->Acc[0] = acc_x;
-    output->Acc[1] = acc_y;
-    output->Acc[2] = acc_z;
+    ninteractions += grav_short_range_batch(list, cellsize, acc, &pot);
+
+    output->Acc[0] = acc[0];
+    output->Acc[1] = acc[1];
+    output->Acc[2] = acc[2];
     output->Ninteractions = ninteractions;
     output->Potential = pot;
 
@@ -372,4 +455,347 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
     return ninteractions;
 }
 
+int force_treeev_shortrange(TreeWalkQueryGravShort * input,
+        TreeWalkResultGravShort * output,
+        LocalTreeWalk * lv)
+{
+    if(lv->tw->tree->GravNodes)
+        return force_treeev_shortrange_walk(input, output, lv, 1);
+    return force_treeev_shortrange_walk(input, output, lv, 0);
+}
+
+
+/* Walk the top-level tree for the force from mass on other processors only.
+ * Nodes containing local mass are always opened and local top leaves skipped,
+ * as their mass is in GravShortPriv.LocalResult. Exported particles
+ * are evaluated with the usual walk.*/
+int
+force_treeev_shortrange_remote(TreeWalkQueryGravShort * input,
+        TreeWalkResultGravShort * output,
+        LocalTreeWalk * lv)
+{
+    if(lv->mode == 1)
+        return force_treeev_shortrange(input, output, lv);
+
+    int ninteractions = 0;
+    double pot = 0;
+    double acc[3] = {0};
+    struct GravInteractionList list[1];
+    list->n = 0;
+    const ForceTree * tree = lv->tw->tree;
+    const double BoxSize = tree->BoxSize;
+    const struct GravShortPriv * priv = GRAV_GET_PRIV(lv->tw);
+
+    const int inzoom = priv->Zoom && input->InZoom;
+    const double cellsize = inzoom ? priv->ZoomCellsize : priv->cellsize;
+    const double rcut = inzoom ? priv->ZoomRcut : priv->Rcut;
+    const double aold = priv->ErrTolForceAcc * input->OldAcc;
+
+    int no = input->base.NodeList[0];
+    while(no >= 0)
+    {
+        if(node_is_pseudo_particle(no, tree)) {
+            if(-1 == treewalk_export_particle(lv, no))
+                return -1;
+            no = force_get_next_node(no, tree);
+            continue;
+        }
+        const struct NODE * nop = &tree->Nodes[no];
+        if(nop->f.DependsOnLocalMass && !nop->f.InternalTopLevel) {
+            no = nop->u.d.sibling;
+            continue;
+        }
+
+        const double dx = NEAREST(nop->u.d.s[0] - input->base.Pos[0], BoxSize);
+        const double dy = NEAREST(nop->u.d.s[1] - input->base.Pos[1], BoxSize);
+        const double dz = NEAREST(nop->u.d.s[2] - input->base.Pos[2], BoxSize);
+        const double r2 = dx * dx + dy * dy + dz * dz;
+        const double eff_dist = rcut + 0.5 * nop->len;
+        double cdist[3];
+        int d;
+        for(d = 0; d < 3; d++)
+            cdist[d] = fabs(NEAREST(nop->center[d] - input->base.Pos[d], BoxSize));
+
+        if(r2 > rcut * rcut && (cdist[0] > eff_dist || cdist[1] > eff_dist || cdist[2] > eff_dist)) {
+            no = nop->u.d.sibling;
+            continue;
+        }
+
+        const double mass = nop->u.d.mass;
+        double h = DMAX(input->Soft, nop->u.d.MaxSoftening);
+        if(nop->f.DependsOnLocalMass ||
+            (priv->TreeUseBH > 0 && nop->len * nop->len > r2 * priv->BHOpeningAngle * priv->BHOpeningAngle) ||
+            (priv->TreeUseBH == 0 && mass * nop->len * nop->len > r2 * r2 * aold) ||
+            (cdist[0] < 0.60 * nop->len && cdist[1] < 0.60 * nop->len && cdist[2] < 0.60 * nop->len) ||
+            (nop->f.MixedSofteningsInNode && r2 < h * h &&
+             !grav_softening_error_ok(sqrt(r2), DMAX(input->Soft, nop->u.d.MinSoftening), h, mass, aold)))
+        {
+            /* open cell */
+            no = nop->u.d.nextnode;
+            continue;
+        }
+
+        list->dx[list->n] = dx;
+        list->dy[list->n] = dy;
+        list->dz[list->n] = dz;
+        list->mass[list->n] = mass;
+        list->h[list->n] = h;
+        list->n++;
+        if(list->n == GRAV_BATCH_SIZE) {
+            ninteractions += grav_short_range_batch(list, cellsize, acc, &pot);
+            list->n = 0;
+        }
+        no = nop->u.d.sibling;
+    }
+    ninteractions += grav_short_range_batch(list, cellsize, acc, &pot);
+
+    output->Acc[0] = acc[0];
+    output->Acc[1] = acc[1];
+    output->Acc[2] = acc[2];
+    output->Ninteractions = ninteractions;
+    output->Potential = pot;
+
+    lv->Ninteractions += ninteractions;
+    return ninteractions;
+}
+
+
+/* Number of pseudo particles a group walk collects before exporting its members to them.*/
+#define GRAV_GROUP_EXPORT_NODES 32
 
+/* Sources accepted by a group walk. Every member of the group interacts with all of them.*/
+struct GravGroupSources
+{
+    int n;
+    double pos[GRAV_BATCH_SIZE][3];
+    double mass[GRAV_BATCH_SIZE];
+    double h[GRAV_BATCH_SIZE];
+    /* Second mass moments of node sources, NULL for particles*/
+    const float * S[GRAV_BATCH_SIZE];
+};
+
+/* Evaluate the shared sources for each group member and empty the list.*/
+static int
+grav_group_flush(struct GravGroupSources * src, TreeWalkQueryGravShort ** input, double (*acc)[3], double * pot,
+        int * ninteractions, const int ngroup, const double BoxSize, const double cellsize)
+{
+    int m, j, ntot = 0;
+    struct GravInteractionList list[1];
+    for(m = 0; m < ngroup; m++) {
+        const double soft = input[m]->Soft;
+        for(j = 0; j < src->n; j++) {
+            list->dx[j] = NEAREST(src->pos[j][0] - input[m]->base.Pos[0], BoxSize);
+            list->dy[j] = NEAREST(src->pos[j][1] - input[m]->base.Pos[1], BoxSize);
+            list->dz[j] = NEAREST(src->pos[j][2] - input[m]->base.Pos[2], BoxSize);
+            list->mass[j] = src->mass[j];
+            list->h[j] = DMAX(soft, src->h[j]);
+        }
+        list->n = src->n;
+        const int ninter = grav_short_range_batch(list, cellsize, acc[m], &pot[m]);
+        for(j = 0; j < src->n; j++) {
+            if(!src->S[j])
+                continue;
+            const double dx[3] = {list->dx[j], list->dy[j], list->dz[j]};
+            grav_short_range_quadrupole(dx, list->h[j], src->S[j], cellsize, acc[m]);
+        }
+        ninteractions[m] += ninter;
+        ntot += ninter;
+    }
+    src->n = 0;
+    return ntot;
+}
+
+static int
+grav_group_add_source(struct GravGroupSources * src, const double * pos, const double mass, const double h, const float * S)
+{
+    src->pos[src->n][0] = pos[0];
+    src->pos[src->n][1] = pos[1];
+    src->pos[src->n][2] = pos[2];
+    src->mass[src->n] = mass;
+    src->h[src->n] = h;
+    src->S[src->n] = S;
+    src->n++;
+    return src->n == GRAV_BATCH_SIZE;
+}
+
+/*! Walk the tree once for a group of nearby primary particles.
+ *  The group is bounded by a sphere, and a node is used without opening only if every
+ *  particle in the sphere would have used it, so the force is at least as accurate as
+ *  the individual walks. The accepted nodes and particles form a shared interaction
+ *  list which each member then evaluates with its own position and softening.
+ */
+static inline __attribute__((always_inline)) int
+force_treeev_shortrange_group_walk(TreeWalkQueryGravShort ** input,
+        TreeWalkResultGravShort ** output,
+        const int ngroup,
+        LocalTreeWalk * lv, const int copy)
+{
+    const ForceTree * tree = lv->tw->tree;
+    const double BoxSize = tree->BoxSize;
+    const struct GravShortPriv * priv = GRAV_GET_PRIV(lv->tw);
+
+    /*Tree-opening constants*/
+    const double cellsize = priv->cellsize;
+    const double rcut = priv->Rcut;
+    const double BHOpeningAngle2 = priv->BHOpeningAngle * priv->BHOpeningAngle;
+
+    /* Bounding sphere of the group, the smallest softening and the smallest old acceleration */
+    double gmin[3], gmax[3];
+    double gcenter[3], grad2 = 0;
+    double aold = priv->ErrTolForceAcc * input[0]->OldAcc;
+    double minsoft = input[0]->Soft;
+    int m, d;
+    for(d = 0; d < 3; d++)
+        gmin[d] = gmax[d] = 0;
+    for(m = 1; m < ngroup; m++) {
+        for(d = 0; d < 3; d++) {
+            const double off = NEAREST(input[m]->base.Pos[d] - input[0]->base.Pos[d], BoxSize);
+            gmin[d] = DMIN(gmin[d], off);
+            gmax[d] = DMAX(gmax[d], off);
+        }
+        aold = DMIN(aold, priv->ErrTolForceAcc * input[m]->OldAcc);
+        minsoft = DMIN(minsoft, input[m]->Soft);
+    }
+    for(d = 0; d < 3; d++) {
+        gcenter[d] = input[0]->base.Pos[d] + 0.5 * (gmin[d] + gmax[d]);
+        grad2 += 0.25 * (gmax[d] - gmin[d]) * (gmax[d] - gmin[d]);
+    }
+    const double grad = sqrt(grad2);
+
+    double acc[TREEWALK_GROUP_MAX][3] = {{0}};
+    double pot[TREEWALK_GROUP_MAX] = {0};
+    int ninteractions[TREEWALK_GROUP_MAX] = {0};
+    int ntot = 0;
+    struct GravGroupSources src[1];
+    src->n = 0;
+
+    const struct particle_gravcopy * gravcopy = PartManager->GravCopy;
+    const struct node_quadrupole * quad = tree->Quad;
+    const int * leaf = force_get_leaf_particles(tree);
+    int lpos = 0, lend = 0;
+    /* Pseudo particles waiting to be exported for the whole group*/
+    int pseudo[GRAV_GROUP_EXPORT_NODES];
+    int npseudo = 0;
+
+    /* Primary walks always start from the root node*/
+    int no = tree->Nodes[input[0]->base.NodeList[0]].u.d.nextnode;	/* open it */
+
+    while(no >= 0 || lpos < lend)
+    {
+        int full;
+        if(lpos < lend || node_is_particle(no, tree))
+        {
+            int p = no;
+            if(lpos < lend)
+                p = leaf[lpos++];
+            else
+                no = force_get_next_node(no, tree);
+            /*Hybrid particle neutrinos do not gravitate at early times*/
+            if(priv->NeutrinoTracer && P[p].Type == priv->FastParticleType)
+                continue;
+            if(gravcopy)
+                full = grav_group_add_source(src, gravcopy[p].Pos, gravcopy[p].Mass, gravcopy[p].Soft, NULL);
+            else
+                full = grav_group_add_source(src, P[p].Pos, P[p].Mass, FORCE_SOFTENING(p), NULL);
+        }
+        else if(node_is_pseudo_particle(no, tree))
+        {
+            /* Members may not all need the export, but evaluating it remotely is harmless.
+             * The nodes are collected so that each member is exported to them in one go,
+             * and nodes on the same task share one export of the member.*/
+            pseudo[npseudo++] = no;
+            if(npseudo == GRAV_GROUP_EXPORT_NODES) {
+                if(-1 == treewalk_export_group(lv, ngroup, pseudo, npseudo))
+                    return -1;
+                npseudo = 0;
+            }
+            no = force_get_next_node(no, tree);
+            continue;
+        }
+        else
+        {
+            /* Nothing in the node gravitates, for example it holds only tracer neutrinos*/
+            if(GRAVNODE_D(tree, copy, no, mass) == 0) {
+                no = GRAVNODE_D(tree, copy, no, sibling);
+                continue;
+            }
+            double r2 = 0;
+            double spos[3];
+            for(d = 0; d < 3; d++) {
+                spos[d] = GRAVNODE_D(tree, copy, no, s[d]);
+                const double dx = NEAREST(spos[d] - gcenter[d], BoxSize);
+                r2 += dx * dx;
+            }
+            const double len = GRAVNODE(tree, copy, no, len);
+            /* Distance from the node center of mass to the nearest point of the group*/
+            const double rmin = DMAX(sqrt(r2) - grad, 0);
+            const double rmin2 = rmin * rmin;
+
+            /* Skip the branch only if all members are outside the cut and outside this region of the oct-tree*/
+            if(rmin > rcut)
+            {
+                const double eff_dist = rcut + 0.5 * len + grad;
+                if(fabs(NEAREST(GRAVNODE(tree, copy, no, center[0]) - gcenter[0], BoxSize)) > eff_dist ||
+                    fabs(NEAREST(GRAVNODE(tree, copy, no, center[1]) - gcenter[1], BoxSize)) > eff_dist ||
+                        fabs(NEAREST(GRAVNODE(tree, copy, no, center[2]) - gcenter[2], BoxSize)) > eff_dist)
+                {
+                    no = GRAVNODE_D(tree, copy, no, sibling);
+                    continue;
+                }
+            }
+
+            const double mass = GRAVNODE_D(tree, copy, no, mass);
+            /*Check Barnes-Hut opening angle or relative opening criterion for the nearest member*/
+            if(((priv->TreeUseBH > 0 && len * len > rmin2 * BHOpeningAngle2)) ||
+                 (priv->TreeUseBH == 0 && !quad && (mass * len * len > rmin2 * rmin2 * aold)) ||
+                 (priv->TreeUseBH == 0 && quad && (mass * len * len * len > rmin2 * rmin2 * rmin * aold)))
+            {
+                no = grav_open_node(tree, copy, no, leaf, &lpos, &lend);
+                continue;
+            }
+            /* Open the cell if any member may lie inside it*/
+            const double inside = 0.60 * len + grad;
+            if(fabs(NEAREST(GRAVNODE(tree, copy, no, center[0]) - gcenter[0], BoxSize)) < inside &&
+                fabs(NEAREST(GRAVNODE(tree, copy, no, center[1]) - gcenter[1], BoxSize)) < inside &&
+                    fabs(NEAREST(GRAVNODE(tree, copy, no, center[2]) - gcenter[2], BoxSize)) < inside)
+            {
+                no = grav_open_node(tree, copy, no, leaf, &lpos, &lend);
+                continue;
+            }
+
+            /* Open the cell if it would be opened for the member with the smallest softening*/
+            const double h = GRAVNODE_D(tree, copy, no, MaxSoftening);
+            if(minsoft < h && rmin2 < h * h && GRAVNODE(tree, copy, no, f.MixedSofteningsInNode))
+            {
+                no = grav_open_node(tree, copy, no, leaf, &lpos, &lend);
+                continue;
+            }
+            full = grav_group_add_source(src, spos, mass, GRAVNODE_D(tree, copy, no, MaxSoftening), quad ? quad[no].S : NULL);
+            no = GRAVNODE_D(tree, copy, no, sibling);	/* ok, node can be used */
+        }
+        if(full)
+            ntot += grav_group_flush(src, input, acc, pot, ninteractions, ngroup, BoxSize, cellsize);
+    }
+    ntot += grav_group_flush(src, input, acc, pot, ninteractions, ngroup, BoxSize, cellsize);
+    if(npseudo > 0 && -1 == treewalk_export_group(lv, ngroup, pseudo, npseudo))
+        return -1;
+
+    for(m = 0; m < ngroup; m++) {
+        for(d = 0; d < 3; d++)
+            output[m]->Acc[d] = acc[m][d];
+        output[m]->Potential = pot[m];
+        output[m]->Ninteractions = ninteractions[m];
+    }
+    lv->Ninteractions += ntot;
+    return ntot;
+}
+
+int force_treeev_shortrange_group(TreeWalkQueryGravShort ** input,
+        TreeWalkResultGravShort ** output,
+        const int ngroup,
+        LocalTreeWalk * lv)
+{
+    if(lv->tw->tree->GravNodes)
+        return force_treeev_shortrange_group_walk(input, output, ngroup, lv, 1);
+    return force_treeev_shortrange_group_walk(input, output, ngroup, lv, 0);
+}
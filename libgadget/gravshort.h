@@ -16,6 +16,8 @@ typedef struct
     /*Used for adaptive gravitational softening*/
     MyFloat Soft;
     MyFloat OldAcc;
+    /* True if the particle was inside the zoom PM region on the last PM step*/
+    int InZoom;
 } TreeWalkQueryGravShort;
 
 typedef struct {
@@ -25,6 +27,14 @@ typedef struct {
     int Ninteractions;
 } TreeWalkResultGravShort;
 
+/* Force on a particle from the mass on this processor, when it is computed outside the tree walk*/
+struct GravShortLocalResult
+{
+    double acc[3];
+    double pot;
+    int ninteractions;
+};
+
 struct GravShortPriv {
     /* Size of a PM cell, in internal units. Box / Nmesh */
     double cellsize;
@@ -52,14 +62,40 @@ struct GravShortPriv {
      * Note: should account for
      * massive neutrinos, but doesn't. */
     double cbrtrho0;
+    /* If true, targets with InZoom set get the band between the two meshes from the
+     * zoom PM mesh, so use ZoomCellsize and ZoomRcut for the short-range force.*/
+    int Zoom;
+    double ZoomCellsize;
+    double ZoomRcut;
+    /* If not NULL, the force from the local mass, indexed by particle.
+     * The tree walk then uses force_treeev_shortrange_remote for the rest.*/
+    struct GravShortLocalResult * LocalResult;
 };
 
 #define GRAV_GET_PRIV(tw) ((struct GravShortPriv *) ((tw)->priv))
 
-static void
+/* Walk only the part of the tree with mass on other processors. Defined in gravshort-tree.c*/
+int
+force_treeev_shortrange_remote(TreeWalkQueryGravShort * input,
+        TreeWalkResultGravShort * output,
+        LocalTreeWalk * lv);
+
+/* Compute the force from the local mass on the active particles into priv->LocalResult,
+ * walking the tree on an OpenMP target device. Defined in gravshort-offload.c*/
+void grav_short_offload_local(const ActiveParticles * act, ForceTree * tree, const struct GravShortPriv * priv);
+
+static inline void
 grav_short_postprocess(int i, TreeWalk * tw)
 {
     double G = GRAV_GET_PRIV(tw)->G;
+    const struct GravShortLocalResult * local = GRAV_GET_PRIV(tw)->LocalResult;
+    if(local) {
+        int d;
+        for(d = 0; d < 3; d++)
+            P[i].GravAccel[d] += local[i].acc[d];
+        P[i].Potential += local[i].pot;
+        P[i].GravCost += local[i].ninteractions;
+    }
     P[i].GravAccel[0] *= G;
     P[i].GravAccel[1] *= G;
     P[i].GravAccel[2] *= G;
@@ -72,11 +108,12 @@ grav_short_postprocess(int i, TreeWalk * tw)
     P[i].Potential *= G;
 }
 
-static void
+static inline void
 grav_short_copy(int place, TreeWalkQueryGravShort * input, TreeWalk * tw)
 {
     input->Type = P[place].Type;
     input->Soft = FORCE_SOFTENING(place);
+    input->InZoom = P[place].InZoom;
     /*Compute old acceleration before we over-write things*/
     double aold=0;
     int i;
@@ -88,7 +125,7 @@ grav_short_copy(int place, TreeWalkQueryGravShort * input, TreeWalk * tw)
     input->OldAcc = sqrt(aold)/GRAV_GET_PRIV(tw)->G;
 
 }
-static void
+static inline void
 grav_short_reduce(int place, TreeWalkResultGravShort * result, enum TreeWalkReduceMode mode, TreeWalk * tw)
 {
     int k;
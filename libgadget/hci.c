@@ -7,6 +7,9 @@
 #include "utils.h"
 #include "hci.h"
 
+/* Factor by which the forecast step and checkpoint durations are inflated to allow for noise*/
+#define HCI_FORECAST_SAFETY 1.2
+
 HCIManager HCI_DEFAULT_MANAGER[1] = {
     {.OVERRIDE_NOW = 0},
 };
@@ -35,6 +38,11 @@ hci_init(HCIManager * manager, char * prefix, double WallClockTimeLimit, double
     manager->WallClockTimeLimit = WallClockTimeLimit;
     manager->AutoCheckPointTime = AutoCheckPointTime;
     manager->LongestTimeBetweenQueries = 0;
+    manager->TimeLastCheckPoint = 0;
+    manager->NStepHistory = 0;
+    manager->CheckPointBlocked = 0;
+    manager->CheckPointTime[0] = manager->CheckPointTime[1] = 0;
+    manager->CheckPointSize[0] = manager->CheckPointSize[1] = 0;
 }
 
 void
@@ -42,6 +50,13 @@ hci_action_init(HCIAction * action)
 {
     action->type = HCI_NO_ACTION;
     action->write_snapshot = 0;
+    action->reconfigure = NULL;
+}
+
+void
+hci_set_auto_checkpoint_time(HCIManager * manager, double AutoCheckPointTime)
+{
+    manager->AutoCheckPointTime = AutoCheckPointTime;
 }
 
 /* override the result of hci_now; for unit testing -- we can't rely on MPI_Wtime there!
@@ -69,6 +84,83 @@ void hci_update_query_timer(HCIManager * manager)
         manager->LongestTimeBetweenQueries = g;
 
     manager->timer_query_begin = e;
+
+    /* The step history excludes the checkpoints, which are forecast separately*/
+    double step = g - manager->CheckPointBlocked;
+    if(step < 0)
+        step = 0;
+    manager->CheckPointBlocked = 0;
+    if(manager->NStepHistory == HCI_STEP_HISTORY) {
+        memmove(manager->StepHistory, manager->StepHistory + 1, (HCI_STEP_HISTORY - 1) * sizeof(double));
+        manager->NStepHistory--;
+    }
+    manager->StepHistory[manager->NStepHistory++] = step;
+}
+
+void
+hci_record_checkpoint(HCIManager * manager, double duration, double blocked, double size)
+{
+    /* must be consistent between all ranks. */
+    double rec[3] = {duration, blocked, size};
+    MPI_Bcast(rec, 3, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    manager->CheckPointTime[1] = manager->CheckPointTime[0];
+    manager->CheckPointSize[1] = manager->CheckPointSize[0];
+    manager->CheckPointTime[0] = rec[0];
+    manager->CheckPointSize[0] = rec[2];
+    manager->CheckPointBlocked += rec[1];
+}
+
+/* Forecast the duration of the next PM step: the recent mean,
+ * or the last step extrapolated along the recent linear trend if that is longer.*/
+static double
+hci_forecast_step(HCIManager * manager)
+{
+    const int n = manager->NStepHistory;
+    if(n == 0)
+        return 0;
+    double mean = 0, slope = 0, var = 0;
+    int i;
+    for(i = 0; i < n; i++)
+        mean += manager->StepHistory[i];
+    mean /= n;
+    for(i = 0; i < n; i++) {
+        slope += (i - (n - 1) / 2.) * (manager->StepHistory[i] - mean);
+        var += (i - (n - 1) / 2.) * (i - (n - 1) / 2.);
+    }
+    if(var > 0)
+        slope /= var;
+    const double trend = manager->StepHistory[n - 1] + slope;
+    return trend > mean ? trend : mean;
+}
+
+/* Forecast the duration of the next checkpoint from the speed of the last one,
+ * and its size from the growth between the last two. Negative if there is no checkpoint to go by.*/
+static double
+hci_forecast_checkpoint(HCIManager * manager)
+{
+    if(manager->CheckPointTime[0] <= 0)
+        return -1;
+    if(manager->CheckPointSize[0] <= 0)
+        return manager->CheckPointTime[0];
+    double growth = 1;
+    if(manager->CheckPointSize[1] > 0 && manager->CheckPointSize[0] > manager->CheckPointSize[1])
+        growth = manager->CheckPointSize[0] / manager->CheckPointSize[1];
+    return manager->CheckPointTime[0] * growth;
+}
+
+/* Would the run be past the wallclock limit if it went on to the query after one at time now,
+ * and then wrote a checkpoint? */
+static int
+hci_will_timeout(HCIManager * manager, double now)
+{
+    const double ckpt = hci_forecast_checkpoint(manager);
+    /* Without a measured checkpoint, the factor 0.9 is a safety tolerance
+     * for the checkpoint and for possible inconsistency between measured time and the true wallclock.*/
+    if(ckpt < 0)
+        return now + manager->LongestTimeBetweenQueries >= manager->WallClockTimeLimit * 0.9;
+
+    /* Otherwise the forecasts are inflated a little for noise*/
+    return now + HCI_FORECAST_SAFETY * (hci_forecast_step(manager) + ckpt) >= manager->WallClockTimeLimit;
 }
 
 /*
@@ -117,14 +209,11 @@ hci_query_timeout(HCIManager * manager, char ** request)
      * collective */
     double now = hci_get_elapsed_time(manager);
     /*
-     * factor 0.9 is a safety tolerance
-     * for possible inconsistency between measured time and the true wallclock
-     *
-     * If there likely isn't time for a new query, then we shall timeout as well.
+     * If there likely isn't time for a new query and a checkpoint, then we shall timeout.
      * */
 
     *request = NULL;
-    if (now + manager->LongestTimeBetweenQueries < manager->WallClockTimeLimit * 0.9) {
+    if (!hci_will_timeout(manager, now)) {
         return 0;
     }
 
@@ -139,12 +228,18 @@ hci_query_auto_checkpoint(HCIManager * manager, char ** request)
      * collective */
     if(manager->AutoCheckPointTime <= 0) return 0;
 
-    /* How long since the last checkpoint? */
+    /* Checkpoint at the query nearest the scheduled time, rather than the first one after it. */
     double now = hci_get_elapsed_time(manager);
-    if(now - manager->TimeLastCheckPoint >= manager->AutoCheckPointTime) {
-        return 1;
+    const double step = hci_forecast_step(manager);
+    if(now + step / 2 < manager->TimeLastCheckPoint + manager->AutoCheckPointTime) {
+        return 0;
     }
-    return 0;
+    /* If the run will time out with a checkpoint at the next query, this one would be wasted. */
+    if(hci_will_timeout(manager, now + step)) {
+        message(0, "HCI: Skipping auto checkpoint, as the run will time out at the next PM step.\n");
+        return 0;
+    }
+    return 1;
 }
 
 /*
@@ -171,16 +266,12 @@ hci_query(HCIManager * manager, HCIAction * action)
         return 1;
     }
 
+    /* The reconfigure file holds the parameters to change, which the caller applies.
+     * It may come with any of the other requests.*/
     if(hci_query_filesystem(manager, "reconfigure", &request))
     {
-        /* FIXME: This is not implemented
-         * it shall reread the configuration file and update the parameters of
-         * the module listed in the request.
-         * see the comment about update_IO_params
-         * */
-        message(0, "HCI: updating io parameters, this is not supported yet.\n");
-        myfree(request);
-        return 0;
+        message(0, "HCI: reconfiguring parameters at this PM step.\n");
+        action->reconfigure = request;
     }
 
     if(hci_query_filesystem(manager, "checkpoint", &request))
@@ -190,7 +281,7 @@ hci_query(HCIManager * manager, HCIAction * action)
         /* will write checkpoint in this PM timestep */
         action->write_snapshot = 1;
         myfree(request);
-        manager->TimeLastCheckPoint = hci_now(manager);
+        manager->TimeLastCheckPoint = hci_get_elapsed_time(manager);
         return 0;
     }
 
@@ -223,47 +314,11 @@ hci_query(HCIManager * manager, HCIAction * action)
         action->type = HCI_AUTO_CHECKPOINT;
         /* Write when the PM timestep completes*/
         action->write_snapshot = 1;
-        manager->TimeLastCheckPoint = hci_now(manager);
+        manager->TimeLastCheckPoint = hci_get_elapsed_time(manager);
         return 0;
     }
 
-    message(0, "HCI: Nothing happened. \n");
+    if(!action->reconfigure)
+        message(0, "HCI: Nothing happened. \n");
     return 0;
 }
-
-/*
- * FIXME: rewrite update_IO_params with
- * the parser infrastructure. It probably shall occur
- * after we decentralize the initialization of the parser
- * to different modules.
- * */
-
-#if 0
-static void
-update_IO_params(const char * ioctlfname)
-{
-    if(ThisTask == 0) {
-        FILE * fd = fopen(ioctlfname, "r");
-         /* there is an ioctl file, parse it and update
-          * All.NumPartPerFile
-          * All.NumWriters
-          */
-        size_t n = 0;
-        char * line = NULL;
-        while(-1 != getline(&line, &n, fd)) {
-            sscanf(line, "BytesPerFile %lu", &All.IO.BytesPerFile);
-            sscanf(line, "NumWriters %d", &All.IO.NumWriters);
-        }
-        myfree(line);
-        fclose(fd);
-    }
-
-    MPI_Bcast(&All.IO, sizeof(All.IO), MPI_BYTE, 0, MPI_COMM_WORLD);
-    message(0, "New IO parameter recieved from %s:"
-               "NumPartPerfile %d"
-               "NumWriters %d\n",
-            ioctlfname,
-            All.IO.BytesPerFile,
-            All.IO.NumWriters);
-}
-#endif
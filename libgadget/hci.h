@@ -1,3 +1,6 @@
+/* Number of recent PM steps used to forecast the duration of the next*/
+#define HCI_STEP_HISTORY 8
+
 typedef struct HCIManager {
     /* private: */
     char * prefix;
@@ -8,6 +11,16 @@ typedef struct HCIManager {
     double timer_query_begin;
     double timer_begin;
 
+    /* Durations of the recent PM steps, oldest first, excluding checkpoint writing*/
+    double StepHistory[HCI_STEP_HISTORY];
+    int NStepHistory;
+    /* Time the run was blocked writing checkpoints since the last query*/
+    double CheckPointBlocked;
+    /* Duration and size of the last two checkpoints, most recent first.
+     * A zero duration means no checkpoint has been measured.*/
+    double CheckPointTime[2];
+    double CheckPointSize[2];
+
     /* for debugging: */
     int OVERRIDE_NOW;
     double _now;
@@ -27,6 +40,9 @@ typedef struct HCIAction
 {
     enum HCIActionType type;
     int write_snapshot;
+    /* Parameters to change, in parameter file format, from a reconfigure request, or NULL.
+     * The caller applies them and frees them with myfree.*/
+    char * reconfigure;
 } HCIAction;
 
 extern HCIManager HCI_DEFAULT_MANAGER[];
@@ -42,3 +58,13 @@ hci_query(HCIManager * manager, HCIAction * action);
 
 void
 hci_override_now(HCIManager * manager, double now);
+
+/* Record that a checkpoint of size bytes took duration seconds to write, of which the run
+ * was blocked for blocked seconds. Used to forecast the time the next checkpoint will take,
+ * so that the run stops as late as possible before the wallclock limit. Collective.*/
+void
+hci_record_checkpoint(HCIManager * manager, double duration, double blocked, double size);
+
+/* Change the time between automatic checkpoints, eg, on a reconfigure request*/
+void
+hci_set_auto_checkpoint_time(HCIManager * manager, double AutoCheckPointTime);
@@ -9,8 +9,10 @@
 #include "allvars.h"
 #include "slotsmanager.h"
 #include "treewalk.h"
+#include "treewalk_ngbiter.h"
 #include "densitykernel.h"
 #include "hydra.h"
+#include "density.h"
 #include "winds.h"
 #include "utils.h"
 
@@ -42,7 +44,19 @@ PressurePred(int PI)
 }
 
 struct HydraPriv {
-    double * PressurePred;
+    /* Quantities of each gas slot which enter the force when it is a neighbour,
+     * computed once before the walk. NgbPOverRho2 < 0 if the slot was not
+     * predicted then: see hydro_ngb_get.*/
+    MyFloat * NgbPOverRho2;
+    MyFloat * NgbSoundspeed;
+    /* Balsara switch: fraction of the velocity gradient which is compressive*/
+    MyFloat * NgbBalsara;
+    /* Coefficient of the grad-h term: p_over_rho2 * DhsmlEgyDensityFactor * density ratio*/
+    MyFloat * NgbGradh;
+    /* Twice the dloga of each timebin, for the viscosity limiter*/
+    double dloga_bin[TIMEBINS + 1];
+    /* Kernel with H = 1. The kernel of a neighbour is this one scaled by its Hsml.*/
+    DensityKernel kernel_unit;
     /* Time-dependent constant factors, brought out here because
      * they need an expensive pow().*/
     double fac_mu;
@@ -51,6 +65,33 @@ struct HydraPriv {
 
 #define HYDRA_GET_PRIV(tw) ((struct HydraPriv*) ((tw)->priv))
 
+/* The quantities of gas particle i which hydro_ngbiter_flush needs when it is a neighbour.
+ * The predicted entropy of i must be set.*/
+static inline void
+hydro_ngb_compute(const int i, const struct HydraPriv * priv, MyFloat * p_over_rho2, MyFloat * soundspeed, MyFloat * balsara, MyFloat * gradh)
+{
+    const double eomdensity = SPH_EOMDensity(i);
+    const double pressure = PressurePred(P[i].PI);
+    *p_over_rho2 = pressure / (eomdensity * eomdensity);
+    *soundspeed = sqrt(GAMMA * pressure / eomdensity);
+    /* Note this uses the CurlVel of an inactive particle, which may not be
+     * at the present drift time*/
+    *balsara = fabs(SPHP(i).DivVel) / (fabs(SPHP(i).DivVel) +
+            SPHP(i).CurlVel + 0.0001 * (*soundspeed) / priv->fac_mu / P[i].Hsml);
+    /* grad-h corrections: enabled if DensityIndependentSphOn = 0, or DensityConstrastLimit >= 0 */
+    double ratio = 1;
+    if(All.DensityIndependentSphOn) {
+        ratio = 0;
+        if(All.DensityContrastLimit >= 0) {
+            ratio = SPHP(i).EgyWtDensity / SPHP(i).Density;
+            /* apply the limit if it is enabled > 0*/
+            if(All.DensityContrastLimit > 0)
+                ratio = DMIN(ratio, All.DensityContrastLimit);
+        }
+    }
+    *gradh = (*p_over_rho2) * SPHP(i).DhsmlEgyDensityFactor * ratio;
+}
+
 typedef struct {
     TreeWalkQueryBase base;
     /* These are only used for DensityIndependentSphOn*/
@@ -74,14 +115,26 @@ typedef struct {
     MyFloat DtEntropy;
     MyFloat MaxSignalVel;
     int Ninteractions;
+    int MinNgbTimeBin;
 } TreeWalkResultHydro;
 
+/* Number of neighbours inside either kernel which are evaluated together*/
+#define HYDRO_NGB_BATCH 32
+
 typedef struct {
     TreeWalkNgbIterBase base;
     double p_over_rho2_i;
     double soundspeed_i;
+    /* Coefficient of the grad-h term of the target*/
+    double gradh_i;
 
     DensityKernel kernel_i;
+    /* Neighbours waiting for hydro_ngbiter_flush*/
+    int nbatch;
+    int other[HYDRO_NGB_BATCH];
+    double r[HYDRO_NGB_BATCH];
+    double r2[HYDRO_NGB_BATCH];
+    double dist[HYDRO_NGB_BATCH][3];
 } TreeWalkNgbIterHydro;
 
 static int
@@ -98,6 +151,8 @@ hydro_ngbiter(
     LocalTreeWalk * lv
    );
 
+TREEWALK_DEFINE_NGBITER_VISIT(hydro_visit, hydro_ngbiter, TreeWalkNgbIterHydro)
+
 static void
 hydro_copy(int place, TreeWalkQueryHydro * input, TreeWalk * tw);
 
@@ -118,7 +173,7 @@ void hydro_force(const ActiveParticles * act, ForceTree * tree)
     struct HydraPriv priv[1];
 
     tw->ev_label = "HYDRO";
-    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->visit = hydro_visit;
     tw->ngbiter = (TreeWalkNgbIterFunction) hydro_ngbiter;
     tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterHydro);
     tw->haswork = hydro_haswork;
@@ -128,15 +183,13 @@ void hydro_force(const ActiveParticles * act, ForceTree * tree)
     tw->query_type_elsize = sizeof(TreeWalkQueryHydro);
     tw->result_type_elsize = sizeof(TreeWalkResultHydro);
     tw->tree = tree;
+    /* Local particles reuse the neighbour candidates of the density walk if possible*/
+    tw->ngbcache = TREEWALK_NGBCACHE_USE;
+    /* The ghosts have the densities of the density walk if the halo was rebuilt after it.
+     * The wake up flag cannot be set on a ghost, so the timebin limiter walks without the halo.*/
+    tw->halo = !All.NgbTimeBinLimit;
     tw->priv = priv;
 
-    /* Cache the pressure for speed*/
-    HYDRA_GET_PRIV(tw)->PressurePred = (double *) mymalloc("PressurePred", SlotsManager->info[0].size * sizeof(double));
-
-    #pragma omp parallel for
-    for(i = 0; i < SlotsManager->info[0].size; i++)
-        HYDRA_GET_PRIV(tw)->PressurePred[i] = PressurePred(i);
-
     double timeall = 0, timenetwork = 0;
     double timecomp, timecomm, timewait;
 
@@ -145,10 +198,44 @@ void hydro_force(const ActiveParticles * act, ForceTree * tree)
     /* Initialize some time factors*/
     HYDRA_GET_PRIV(tw)->fac_mu = pow(All.cf.a, 3 * (GAMMA - 1) / 2) / All.cf.a;
     HYDRA_GET_PRIV(tw)->fac_vsic_fix = All.cf.hubble * pow(All.cf.a, 3 * GAMMA_MINUS1);
+    density_kernel_init(&HYDRA_GET_PRIV(tw)->kernel_unit, 1, All.DensityKernelType);
+    for(i = 0; i <= TIMEBINS; i++)
+        HYDRA_GET_PRIV(tw)->dloga_bin[i] = 2 * get_dloga_for_bin(i);
+
+    /* Precompute the neighbour quantities, including for the ghosts of the halo.
+     * Only particles predicted by the density walk are done here: the rest
+     * are computed when a symmetric search finds them.*/
+    const int NumNgbData = SlotsManager->info[0].size + treewalk_halo_nghost(tree);
+    HYDRA_GET_PRIV(tw)->NgbPOverRho2 = (MyFloat *) mymalloc("NgbPOverRho2", NumNgbData * sizeof(MyFloat));
+    HYDRA_GET_PRIV(tw)->NgbSoundspeed = (MyFloat *) mymalloc("NgbSoundspeed", NumNgbData * sizeof(MyFloat));
+    HYDRA_GET_PRIV(tw)->NgbBalsara = (MyFloat *) mymalloc("NgbBalsara", NumNgbData * sizeof(MyFloat));
+    HYDRA_GET_PRIV(tw)->NgbGradh = (MyFloat *) mymalloc("NgbGradh", NumNgbData * sizeof(MyFloat));
+
+    #pragma omp parallel for
+    for(i = 0; i < NumNgbData; i++)
+        HYDRA_GET_PRIV(tw)->NgbPOverRho2[i] = -1;
+
+    const int NumNgbPart = PartManager->NumPart + treewalk_halo_nghost(tree);
+    #pragma omp parallel for
+    for(i = 0; i < NumNgbPart; i++) {
+        if(P[i].Type != 0 || P[i].IsGarbage)
+            continue;
+        const int PI = P[i].PI;
+        if(SphP_scratch->PredState[PI] != SPH_PRED_DONE)
+            continue;
+        hydro_ngb_compute(i, HYDRA_GET_PRIV(tw), &HYDRA_GET_PRIV(tw)->NgbPOverRho2[PI], &HYDRA_GET_PRIV(tw)->NgbSoundspeed[PI],
+                &HYDRA_GET_PRIV(tw)->NgbBalsara[PI], &HYDRA_GET_PRIV(tw)->NgbGradh[PI]);
+    }
+    walltime_measure("/SPH/Hydro/Init");
 
-    treewalk_run(tw, act->ActiveParticle, act->NumActiveParticle);
+    int NumActiveGas;
+    int * ActiveGas = get_active_particles_of_type(act, 0, &NumActiveGas);
+    treewalk_run(tw, ActiveGas, NumActiveGas);
 
-    myfree(HYDRA_GET_PRIV(tw)->PressurePred);
+    myfree(HYDRA_GET_PRIV(tw)->NgbGradh);
+    myfree(HYDRA_GET_PRIV(tw)->NgbBalsara);
+    myfree(HYDRA_GET_PRIV(tw)->NgbSoundspeed);
+    myfree(HYDRA_GET_PRIV(tw)->NgbPOverRho2);
     /* collect some timing information */
 
     timeall += walltime_measure(WALLTIME_IGNORE);
@@ -157,7 +244,8 @@ void hydro_force(const ActiveParticles * act, ForceTree * tree)
     timewait = tw->timewait1 + tw->timewait2;
     timecomm = tw->timecommsumm1 + tw->timecommsumm2;
 
-    walltime_add("/SPH/Hydro/Compute", timecomp);
+    walltime_add("/SPH/Hydro/Compute", timecomp - (tw->timeidle1 + tw->timeidle2));
+    walltime_add("/SPH/Hydro/ThreadIdle", tw->timeidle1 + tw->timeidle2);
     walltime_add("/SPH/Hydro/Wait", timewait);
     walltime_add("/SPH/Hydro/Comm", timecomm);
     walltime_add("/SPH/Hydro/Misc", timeall - (timecomp + timewait + timecomm + timenetwork));
@@ -167,6 +255,7 @@ static void
 hydro_copy(int place, TreeWalkQueryHydro * input, TreeWalk * tw)
 {
     double soundspeed_i;
+    density_ensure_predicted(place);
     /*Compute predicted velocity*/
     input->Vel[0] = SphP_scratch->VelPred[3 * P[place].PI];
     input->Vel[1] = SphP_scratch->VelPred[3 * P[place].PI + 1];
@@ -182,7 +271,7 @@ hydro_copy(int place, TreeWalkQueryHydro * input, TreeWalk * tw)
 
     input->SPH_DhsmlDensityFactor = SPHP(place).DhsmlEgyDensityFactor;
 
-    input->Pressure = HYDRA_GET_PRIV(tw)->PressurePred[P[place].PI];
+    input->Pressure = PressurePred(P[place].PI);
     input->TimeBin = P[place].TimeBin;
     /* calculation of F1 */
     soundspeed_i = sqrt(GAMMA * input->Pressure / SPH_EOMDensity(place));
@@ -208,143 +297,135 @@ hydro_reduce(int place, TreeWalkResultHydro * result, enum TreeWalkReduceMode mo
     if(mode == TREEWALK_PRIMARY || SPHP(place).MaxSignalVel < result->MaxSignalVel)
         SPHP(place).MaxSignalVel = result->MaxSignalVel;
 
+    if(mode == TREEWALK_PRIMARY || SPHP(place).MinNgbTimeBin > result->MinNgbTimeBin)
+        SPHP(place).MinNgbTimeBin = result->MinNgbTimeBin;
+
 }
 
-/*! This function is the 'core' of the SPH force computation. A target
- *  particle is specified which may either be local, or reside in the
- *  communication buffer.
- */
+/* Evaluate the kernels for the queued neighbours together, then add their forces.*/
 static void
-hydro_ngbiter(
+hydro_ngbiter_flush(
     TreeWalkQueryHydro * I,
     TreeWalkResultHydro * O,
     TreeWalkNgbIterHydro * iter,
     LocalTreeWalk * lv
    )
 {
-    if(iter->base.other == -1) {
-        iter->base.Hsml = I->Hsml;
-        iter->base.mask = 1;
-        iter->base.symmetric = NGB_TREEFIND_SYMMETRIC;
-
-        if(All.DensityIndependentSphOn)
-            iter->soundspeed_i = sqrt(GAMMA * I->Pressure / I->EgyRho);
-        else
-            iter->soundspeed_i = sqrt(GAMMA * I->Pressure / I->Density);
-
-        /* initialize variables before SPH loop is started */
-
-        O->Acc[0] = O->Acc[1] = O->Acc[2] = O->DtEntropy = 0;
-        density_kernel_init(&iter->kernel_i, I->Hsml, All.DensityKernelType);
-
-        if(All.DensityIndependentSphOn)
-            iter->p_over_rho2_i = I->Pressure / (I->EgyRho * I->EgyRho);
-        else
-            iter->p_over_rho2_i = I->Pressure / (I->Density * I->Density);
-
-        O->MaxSignalVel = iter->soundspeed_i;
+    const int n = iter->nbatch;
+    /* Nothing queued. This also lets the compiler see the batch arrays are written before use*/
+    if(n <= 0)
         return;
+    double u_i[HYDRO_NGB_BATCH], u_j[HYDRO_NGB_BATCH], norm_j[HYDRO_NGB_BATCH];
+    double dwk_i_all[HYDRO_NGB_BATCH], dwk_j_all[HYDRO_NGB_BATCH];
+    int k;
+    for(k = 0; k < n; k++) {
+        const double hinv_j = 1. / P[iter->other[k]].Hsml;
+        u_i[k] = iter->r[k] * iter->kernel_i.Hinv;
+        u_j[k] = iter->r[k] * hinv_j;
+        /* dWknorm scales as H^-(NUMDIMS+1)*/
+        norm_j[k] = hinv_j;
+        int d;
+        for(d = 0; d < NUMDIMS; d++)
+            norm_j[k] *= hinv_j;
     }
-
-    int other = iter->base.other;
-    double r2 = iter->base.r2;
-    double * dist = iter->base.dist;
-    double r = iter->base.r;
-
-    if(P[other].Mass == 0) {
-        endrun(12, "Encountered zero mass particle during hydro;"
-                  " We haven't implemented tracer particles and this shall not happen\n");
+    iter->nbatch = 0;
+
+    density_kernel_dwk_many(&iter->kernel_i, u_i, dwk_i_all, n);
+    density_kernel_dwk_many(&HYDRA_GET_PRIV(lv->tw)->kernel_unit, u_j, dwk_j_all, n);
+    for(k = 0; k < n; k++)
+        dwk_j_all[k] *= norm_j[k];
+
+    /* Gather the neighbour data, so the force loop below is arithmetic only*/
+    const struct HydraPriv * priv = HYDRA_GET_PRIV(lv->tw);
+    MyFloat p_over_rho2_j[HYDRO_NGB_BATCH], soundspeed_j[HYDRO_NGB_BATCH], balsara_j[HYDRO_NGB_BATCH], gradh_j[HYDRO_NGB_BATCH];
+    double vel_j[HYDRO_NGB_BATCH][3], mass_j[HYDRO_NGB_BATCH], density_j[HYDRO_NGB_BATCH];
+    double ent_j[HYDRO_NGB_BATCH], dloga[HYDRO_NGB_BATCH];
+    int decoupled[HYDRO_NGB_BATCH];
+    for(k = 0; k < n; k++)
+    {
+        const int other = iter->other[k];
+        const int PI = P[other].PI;
+        if(priv->NgbPOverRho2[PI] >= 0) {
+            p_over_rho2_j[k] = priv->NgbPOverRho2[PI];
+            soundspeed_j[k] = priv->NgbSoundspeed[PI];
+            balsara_j[k] = priv->NgbBalsara[PI];
+            gradh_j[k] = priv->NgbGradh[PI];
+        }
+        else {
+            density_ensure_predicted(other);
+            hydro_ngb_compute(other, priv, &p_over_rho2_j[k], &soundspeed_j[k], &balsara_j[k], &gradh_j[k]);
+        }
+        int d;
+        for(d = 0; d < 3; d++)
+            vel_j[k][d] = SphP_scratch->VelPred[3 * PI + d];
+        mass_j[k] = P[other].Mass;
+        density_j[k] = SphP[PI].Density;
+        ent_j[k] = SphP_scratch->EntVarPred[PI];
+        dloga[k] = priv->dloga_bin[IMAX(I->TimeBin, P[other].TimeBin)];
+        /* No force by wind particles */
+        decoupled[k] = All.WindOn && winds_is_particle_decoupled(other);
     }
 
-    DensityKernel kernel_j;
-
-    density_kernel_init(&kernel_j, P[other].Hsml, All.DensityKernelType);
-
-    if(r2 > 0 && (r2 < iter->kernel_i.HH || r2 < kernel_j.HH))
+    for(k = 0; k < n; k++)
     {
-        double Pressure_j = HYDRA_GET_PRIV(lv->tw)->PressurePred[P[other].PI];
-        double p_over_rho2_j = Pressure_j / (SPH_EOMDensity(other) * SPH_EOMDensity(other));
-        double soundspeed_j = sqrt(GAMMA * Pressure_j / SPH_EOMDensity(other));
+        const double r = iter->r[k];
+        const double rsq = iter->r2[k];
+        const double * dist = iter->dist[k];
 
         double dv[3];
         int d;
         for(d = 0; d < 3; d++) {
-            dv[d] = I->Vel[d] - SphP_scratch->VelPred[3 * P[other].PI + d];
+            dv[d] = I->Vel[d] - vel_j[k][d];
         }
 
         double vdotr = dotproduct(dist, dv);
-        double vdotr2 = vdotr + All.cf.hubble_a2 * r2;
+        double vdotr2 = vdotr + All.cf.hubble_a2 * rsq;
 
-        double dwk_i = density_kernel_dwk(&iter->kernel_i, r * iter->kernel_i.Hinv);
-        double dwk_j = density_kernel_dwk(&kernel_j, r * kernel_j.Hinv);
+        const double dwk_i = dwk_i_all[k];
+        const double dwk_j = dwk_j_all[k];
 
         double visc = 0;
 
         if(vdotr2 < 0)	/* ... artificial viscosity visc is 0 by default*/
         {
             /*See Gadget-2 paper: eq. 13*/
-            const double mu_ij = HYDRA_GET_PRIV(lv->tw)->fac_mu * vdotr2 / r;	/* note: this is negative! */
-            const double rho_ij = 0.5 * (I->Density + SPHP(other).Density);
-            double vsig = iter->soundspeed_i + soundspeed_j;
+            const double mu_ij = priv->fac_mu * vdotr2 / r;	/* note: this is negative! */
+            const double rho_ij = 0.5 * (I->Density + density_j[k]);
+            double vsig = iter->soundspeed_i + soundspeed_j[k];
 
             vsig -= 3 * mu_ij;
 
             if(vsig > O->MaxSignalVel)
                 O->MaxSignalVel = vsig;
 
-            /* Note this uses the CurlVel of an inactive particle, which may not be
-             * at the present drift time*/
-            const double f2 = fabs(SPHP(other).DivVel) / (fabs(SPHP(other).DivVel) +
-                    SPHP(other).CurlVel + 0.0001 * soundspeed_j / HYDRA_GET_PRIV(lv->tw)->fac_mu / P[other].Hsml);
-
             /*Gadget-2 paper, eq. 14*/
-            visc = 0.25 * All.ArtBulkViscConst * vsig * (-mu_ij) / rho_ij * (I->F1 + f2);
+            visc = 0.25 * All.ArtBulkViscConst * vsig * (-mu_ij) / rho_ij * (I->F1 + balsara_j[k]);
             /* .... end artificial viscosity evaluation */
             /* now make sure that viscous acceleration is not too large */
 
             /*XXX: why is this dloga ?*/
-            double dloga = 2 * get_dloga_for_bin(IMAX(I->TimeBin, P[other].TimeBin));
-            if(dloga > 0 && (dwk_i + dwk_j) < 0)
+            if(dloga[k] > 0 && (dwk_i + dwk_j) < 0)
             {
-                if((I->Mass + P[other].Mass) > 0) {
-                    visc = DMIN(visc, 0.5 * HYDRA_GET_PRIV(lv->tw)->fac_vsic_fix * vdotr2 /
-                            (0.5 * (I->Mass + P[other].Mass) * (dwk_i + dwk_j) * r * dloga));
+                if((I->Mass + mass_j[k]) > 0) {
+                    visc = DMIN(visc, 0.5 * priv->fac_vsic_fix * vdotr2 /
+                            (0.5 * (I->Mass + mass_j[k]) * (dwk_i + dwk_j) * r * dloga[k]));
                 }
             }
         }
-        double hfc_visc = 0.5 * P[other].Mass * visc * (dwk_i + dwk_j) / r;
+        double hfc_visc = 0.5 * mass_j[k] * visc * (dwk_i + dwk_j) / r;
         double hfc = hfc_visc;
-        double r1 = 1, r2 = 1;
 
         if(All.DensityIndependentSphOn) {
-            /*This enables the grad-h corrections*/
-            r1 = 0, r2 = 0;
             /* leading-order term */
-            double EntOther = SphP_scratch->EntVarPred[P[other].PI];
-
-            hfc += P[other].Mass *
-                (dwk_i*iter->p_over_rho2_i*EntOther/I->EntVarPred +
-                dwk_j*p_over_rho2_j*I->EntVarPred/EntOther) / r;
-
-            /* enable grad-h corrections only if contrastlimit is non negative */
-            if(All.DensityContrastLimit >= 0) {
-                r1 = I->EgyRho / I->Density;
-                r2 = SPHP(other).EgyWtDensity / SPHP(other).Density;
-                if(All.DensityContrastLimit > 0) {
-                    /* apply the limit if it is enabled > 0*/
-                    r1 = DMIN(r1, All.DensityContrastLimit);
-                    r2 = DMIN(r2, All.DensityContrastLimit);
-                }
-            }
+            hfc += mass_j[k] *
+                (dwk_i*iter->p_over_rho2_i*ent_j[k]/I->EntVarPred +
+                dwk_j*p_over_rho2_j[k]*I->EntVarPred/ent_j[k]) / r;
         }
 
-        /* grad-h corrections: enabled if DensityIndependentSphOn = 0, or DensityConstrastLimit >= 0 */
-        /* Formulation derived from the Lagrangian */
-        hfc += P[other].Mass * (iter->p_over_rho2_i*I->SPH_DhsmlDensityFactor * dwk_i * r1
-                 + p_over_rho2_j*SPHP(other).DhsmlEgyDensityFactor * dwk_j * r2) / r;
+        /* grad-h corrections. Formulation derived from the Lagrangian */
+        hfc += mass_j[k] * (iter->gradh_i * dwk_i + gradh_j[k] * dwk_j) / r;
 
-        /* No force by wind particles */
-        if(All.WindOn && winds_is_particle_decoupled(other)) {
+        if(decoupled[k]) {
             hfc = hfc_visc = 0;
         }
 
@@ -354,6 +435,97 @@ hydro_ngbiter(
         O->DtEntropy += (0.5 * hfc_visc * vdotr2);
 
     }
+}
+
+/*! This function is the 'core' of the SPH force computation. A target
+ *  particle is specified which may either be local, or reside in the
+ *  communication buffer. Neighbours inside either kernel are queued
+ *  and evaluated in batches by hydro_ngbiter_flush.
+ */
+static void
+hydro_ngbiter(
+    TreeWalkQueryHydro * I,
+    TreeWalkResultHydro * O,
+    TreeWalkNgbIterHydro * iter,
+    LocalTreeWalk * lv
+   )
+{
+    if(iter->base.other == -1) {
+        iter->base.Hsml = I->Hsml;
+        iter->base.mask = 1;
+        iter->base.symmetric = NGB_TREEFIND_SYMMETRIC;
+
+        if(All.DensityIndependentSphOn)
+            iter->soundspeed_i = sqrt(GAMMA * I->Pressure / I->EgyRho);
+        else
+            iter->soundspeed_i = sqrt(GAMMA * I->Pressure / I->Density);
+
+        /* initialize variables before SPH loop is started */
+
+        O->Acc[0] = O->Acc[1] = O->Acc[2] = O->DtEntropy = 0;
+        density_kernel_init(&iter->kernel_i, I->Hsml, All.DensityKernelType);
+
+        if(All.DensityIndependentSphOn)
+            iter->p_over_rho2_i = I->Pressure / (I->EgyRho * I->EgyRho);
+        else
+            iter->p_over_rho2_i = I->Pressure / (I->Density * I->Density);
+
+        /* grad-h corrections, as in hydro_ngb_compute*/
+        double ratio = 1;
+        if(All.DensityIndependentSphOn) {
+            ratio = 0;
+            if(All.DensityContrastLimit >= 0) {
+                ratio = I->EgyRho / I->Density;
+                if(All.DensityContrastLimit > 0)
+                    ratio = DMIN(ratio, All.DensityContrastLimit);
+            }
+        }
+        iter->gradh_i = iter->p_over_rho2_i * I->SPH_DhsmlDensityFactor * ratio;
+
+        O->MaxSignalVel = iter->soundspeed_i;
+        O->MinNgbTimeBin = TIMEBINS;
+        iter->base.finish = 1;
+        iter->nbatch = 0;
+        return;
+    }
+
+    /* All neighbours have been seen*/
+    if(iter->base.other == -2) {
+        hydro_ngbiter_flush(I, O, iter, lv);
+        return;
+    }
+
+    int other = iter->base.other;
+    double r2 = iter->base.r2;
+
+    if(P[other].Mass == 0) {
+        endrun(12, "Encountered zero mass particle during hydro;"
+                  " We haven't implemented tracer particles and this shall not happen\n");
+    }
+
+    const double hsml_j = P[other].Hsml;
+
+    if(r2 > 0 && (r2 < iter->kernel_i.HH || r2 < hsml_j * hsml_j))
+    {
+        if(All.NgbTimeBinLimit > 0) {
+            if(P[other].TimeBin < O->MinNgbTimeBin)
+                O->MinNgbTimeBin = P[other].TimeBin;
+            /* A neighbour on a much longer step is woken up. This uses the current timebin of
+             * the particle, so a neighbour is woken on the step after the particle's bin drops.
+             * other is always local here: the hydro walk does not use the halo with the limiter.*/
+            if(P[other].TimeBin > I->TimeBin + All.NgbTimeBinLimit && !SPHP(other).WakeUp)
+                __atomic_store_n(&SPHP(other).WakeUp, 1, __ATOMIC_RELAXED);
+        }
+        const int k = iter->nbatch++;
+        iter->other[k] = other;
+        iter->r[k] = iter->base.r;
+        iter->r2[k] = r2;
+        int d;
+        for(d = 0; d < 3; d ++)
+            iter->dist[k][d] = iter->base.dist[d];
+        if(iter->nbatch == HYDRO_NGB_BATCH)
+            hydro_ngbiter_flush(I, O, iter, lv);
+    }
     O->Ninteractions++;
 }
 
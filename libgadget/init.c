@@ -10,6 +10,7 @@
 #include "cooling.h"
 #include "forcetree.h"
 #include "density.h"
+#include "treewalk.h"
 
 #include "timefac.h"
 #include "petaio.h"
@@ -22,6 +23,7 @@
 #include "timestep.h"
 #include "timebinmgr.h"
 #include "cosmology.h"
+#include "gravity.h"
 
 /*! \file init.c
  *  \brief code for initialisation of a simulation from initial conditions
@@ -31,14 +33,16 @@ static void check_omega(void);
 static void check_positions(void);
 
 static void
-setup_smoothinglengths(int RestartSnapNum, DomainDecomp * ddecomp);
+setup_smoothinglengths(int RestartSnapNum, int DomainRestored, DomainDecomp * ddecomp);
+static void
+mesh_guess_smoothinglengths(ForceTree * Tree, const int all);
 
 /*! This function reads the initial conditions, and allocates storage for the
  *  tree(s). Various variables of the particle data are initialised and An
  *  intial domain decomposition is performed. If SPH particles are present,
  *  the initial SPH smoothing lengths are determined.
  */
-void init(int RestartSnapNum, DomainDecomp * ddecomp)
+int init(int RestartSnapNum, DomainDecomp * ddecomp)
 {
     int i, j;
 
@@ -65,11 +69,14 @@ void init(int RestartSnapNum, DomainDecomp * ddecomp)
     set_global_time(exp(loga_from_ti(All.Ti_Current)));
 
     init_drift_table(&All.CP, All.TimeInit, All.TimeMax);
+    /* The power spectrum output needs the growth factor to a = 1*/
+    init_growth_table(&All.CP, DMIN(All.TimeIC, All.TimeInit), DMAX(All.TimeMax, 1.0));
 
     /*Read the snapshot*/
     petaio_read_snapshot(RestartSnapNum, MPI_COMM_WORLD);
 
-    domain_test_id_uniqueness(PartManager);
+    if(domain_check_id_uniqueness(PartManager, 1, MPI_COMM_WORLD))
+        endrun(12, "Particle IDs in the snapshot are not unique\n");
 
     check_omega();
 
@@ -89,6 +96,7 @@ void init(int RestartSnapNum, DomainDecomp * ddecomp)
     for(i = 0; i < PartManager->NumPart; i++)	/* initialize sph_properties */
     {
         P[i].GravCost = 1;
+        P[i].WalkTime = 0;
         P[i].Ti_drift = P[i].Ti_kick = All.Ti_Current;
 
         if(All.BlackHoleOn && RestartSnapNum == -1 && P[i].Type == 5 )
@@ -126,9 +134,16 @@ void init(int RestartSnapNum, DomainDecomp * ddecomp)
 
     walltime_measure("/Init");
 
-    domain_decompose_full(ddecomp);	/* do initial domain decomposition (gives equal numbers of particles) */
+    /* If the snapshot has its domain, each rank has read the particles it had,
+     * so only those which drifted out of their domain before the snapshot move.*/
+    const int DomainRestored = petaio_read_domain(RestartSnapNum, ddecomp, MPI_COMM_WORLD);
+    if(DomainRestored)
+        domain_maintain(ddecomp);
+    else
+        domain_decompose_full(ddecomp);	/* do initial domain decomposition (gives equal numbers of particles) */
 
-    setup_smoothinglengths(RestartSnapNum, ddecomp);
+    setup_smoothinglengths(RestartSnapNum, DomainRestored, ddecomp);
+    return DomainRestored;
 }
 
 
@@ -230,8 +245,37 @@ setup_density_indep_entropy(const ActiveParticles * act, ForceTree * Tree, doubl
  *  of the smoothing length is provided to the function density(), which will
  *  then iterate if needed to find the right smoothing length.
  */
+/* Set the smoothing lengths of the gas particles, or only of those without one if all is false,
+ * to enclose DesNumNgb neighbours at the gas density of a coarse CIC mesh. This is much closer
+ * to the converged value than the tree node guess, so density() needs fewer iterations.*/
 static void
-setup_smoothinglengths(int RestartSnapNum, DomainDecomp * ddecomp)
+mesh_guess_smoothinglengths(ForceTree * Tree, const int all)
+{
+    int i;
+    const int Nmesh = All.InitHsmlMeshNmesh > 0 ? All.InitHsmlMeshNmesh : DMAX(All.Nmesh / 2, 8);
+    double * density = (double *) mymalloc("HsmlMeshDensity", PartManager->NumPart * sizeof(double));
+    gravpm_gas_density(Tree, Nmesh, density);
+
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+    {
+        if(P[i].Type != 0)
+            continue;
+        if(!all && P[i].Hsml > 0 && isfinite(P[i].Hsml))
+            continue;
+        double hsml = All.MeanSeparation[0];
+        if(density[i] > 0)
+            hsml = pow(3.0 / (4 * M_PI) * All.DesNumNgb * P[i].Mass / density[i], 1.0 / 3);
+        /* recover from a poor initial guess, such as an isolated particle in an empty cell */
+        if(!(hsml <= 500.0 * All.MeanSeparation[0]))
+            hsml = All.MeanSeparation[0];
+        P[i].Hsml = hsml;
+    }
+    myfree(density);
+}
+
+static void
+setup_smoothinglengths(int RestartSnapNum, int DomainRestored, DomainDecomp * ddecomp)
 {
     int i;
     const double a3 = All.Time * All.Time * All.Time;
@@ -245,10 +289,16 @@ setup_smoothinglengths(int RestartSnapNum, DomainDecomp * ddecomp)
         return;
 
     ForceTree Tree = {0};
-    force_tree_rebuild(&Tree, ddecomp, All.BoxSize, 0);
 
-    if(RestartSnapNum == -1)
+    if(RestartSnapNum == -1 && All.InitHsmlMeshNmesh >= 0)
+    {
+        force_tree_rebuild(&Tree, ddecomp, All.BoxSize, 0);
+        mesh_guess_smoothinglengths(&Tree, 1);
+    }
+    else if(RestartSnapNum == -1)
     {
+        force_tree_rebuild(&Tree, ddecomp, All.BoxSize, 0);
+
         /* quick hack to adjust for the baryon fraction
          * only this fraction of mass is of that type.
          * this won't work for non-dm non baryon;
@@ -312,10 +362,37 @@ setup_smoothinglengths(int RestartSnapNum, DomainDecomp * ddecomp)
         MPI_Allreduce(MPI_IN_PLACE, &bad, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
         if(bad > 0 && ThisTask == 0)
             message(0, "Detected bad densities in %d particles on disc\n",bad);
+        /* Keep the smoothing lengths and densities from the snapshot.
+         * All particles are active on the first step, which recomputes them anyway.*/
+        if(DomainRestored)
+            return;
+        force_tree_rebuild(&Tree, ddecomp, All.BoxSize, 0);
+
+        /* Guess the smoothing lengths which are missing from the snapshot*/
+        int64_t nohsml = 0;
+        #pragma omp parallel for reduction(+: nohsml)
+        for(i = 0; i < PartManager->NumPart; i++)
+            if(P[i].Type == 0 && !(P[i].Hsml > 0 && isfinite(P[i].Hsml)))
+                nohsml++;
+        MPI_Allreduce(MPI_IN_PLACE, &nohsml, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        if(nohsml > 0) {
+            message(0, "Guessing the smoothing lengths of %ld gas particles without them\n", nohsml);
+            if(All.InitHsmlMeshNmesh >= 0)
+                mesh_guess_smoothinglengths(&Tree, 0);
+            else {
+                #pragma omp parallel for
+                for(i = 0; i < PartManager->NumPart; i++)
+                    if(P[i].Type == 0 && !(P[i].Hsml > 0 && isfinite(P[i].Hsml)))
+                        P[i].Hsml = All.MeanSeparation[0];
+            }
+        }
     }
 
     /*Allocate the extra SPH data for transient SPH particle properties.*/
     slots_allocate_sph_scratch_data(0, SlotsManager->info[0].size, &SlotsManager->sph_scratch);
+    /* The particles do not move during the setup, so the density walks after
+     * the first reuse its neighbour candidates instead of walking the tree again.*/
+    treewalk_ngbcache_alloc(&Tree, 0);
 
         /*At the first time step all particles should be active*/
     ActiveParticles act = {0};
@@ -351,6 +428,7 @@ setup_smoothinglengths(int RestartSnapNum, DomainDecomp * ddecomp)
                 SphP[i].Entropy = GAMMA_MINUS1 * u_init / pow(SphP[i].Density / a3 , GAMMA_MINUS1);
         }
     }
+    treewalk_ngbcache_free(&Tree);
     slots_free_sph_scratch_data(SphP_scratch);
     force_tree_free(&Tree);
 }
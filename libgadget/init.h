@@ -3,7 +3,9 @@
 
 #include "domain.h"
 
-/* Loads a snapshot, finds smoothing lengths and does the initial domain decomposition*/
-void init(int snapnum, DomainDecomp * ddecomp);
+/* Loads a snapshot, finds smoothing lengths and does the initial domain decomposition.
+ * Returns 1 if the domain was restored from the snapshot instead (SnapshotWithDomain),
+ * in which case the smoothing lengths are those from the snapshot.*/
+int init(int snapnum, DomainDecomp * ddecomp);
 
 #endif
@@ -3,17 +3,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <omp.h>
+#include <pthread.h>
+#include <bigfile-mpi.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_integration.h>
-/*For mkdir*/
-#include <sys/stat.h>
-#include <sys/types.h>
 
 #include "utils.h"
+#include "utils/mpsort.h"
 
 #include "allvars.h"
 #include "partmanager.h"
 #include "cosmology.h"
+#include "petaio.h"
+#include "lightcone.h"
 
 #define NENTRY 4096
 static double tab_loga[NENTRY];
@@ -21,14 +24,27 @@ static double dloga;
 static double tab_Dc[NENTRY];
 /*
  * light cone on the fly:
- * 
+ *
  * assuming the origin is at (0, 0, 0)
  *
  * */
 
-/* 
+static struct lightcone_params
+{
+    double Zmin; /* Particles are written between these redshifts*/
+    double Zmax;
+    double ReferenceRedshift; /* write all particles below this redshift; write a fraction above this. */
+    int HealpixNside; /* Each particle is tagged with its HEALPix ring pixel at this resolution*/
+    double BufferMB; /* Particles are appended to the file once the buffers of all ranks hold this much*/
+    int WriteParticles; /* Write the crossing dark matter particles to Lightcone*/
+    int MapNside; /* If > 0, add the mass of all crossings to HEALPix maps at this resolution*/
+    int MapNshell; /* Number of map shells, even in comoving distance between Zmax and Zmin*/
+    int MapGas; /* Also make maps of the gas mass*/
+} LightconeParams;
+
+/*
  * replicas to consider, function of redshift;
- * 
+ *
  * */
 static int Nreplica;
 static int BoxBoost = 20;
@@ -38,13 +54,111 @@ static double HorizonDistance;
 static double HorizonDistancePrev;
 static double HorizonDistance2Prev;
 static double HorizonDistanceRef;
-static double zmin = 0.1;
-static double zmax = 80.0;
-static double ReferenceRedshift = 2.0; /* write all particles below this redshift; write a fraction above this. */
+static double TimePrev;
+static double TimeCurrent;
 static double SampleFraction; /* current fraction of particle gets written */
-static FILE * fd_lightcone;
+
+/* Maximum particle velocity as a fraction of the speed of light, used to pad the shell*/
+#define LC_MAX_VELOCITY 0.05
+/* Cells per side of the grid used to cull the replicas for each particle*/
+#define LC_NCELL 16
+#define LC_NCELL3 (LC_NCELL * LC_NCELL * LC_NCELL)
+/* The replicas meeting the shell in cell c are CellReplica[CellStart[c]] to CellReplica[CellStart[c+1]-1]*/
+static int * CellStart;
+static int * CellReplica;
+
+/* A particle crossing the lightcone*/
+struct LightconeParticle {
+    double Pos[3];
+    /* Peculiar velocity*/
+    float Vel[3];
+    /* Scale factor at which the particle crossed*/
+    float Aemit;
+    /* Fraction of the crossing particles written at Aemit*/
+    float SampleFraction;
+    MyIDType ID;
+    int64_t Pixel;
+};
+
+/* Crossings found by one drift thread since the last flush.
+ * Padded so the counters of different threads are on different cache lines.*/
+struct LightconeThreadBuffer {
+    struct LightconeParticle * Part;
+    size_t N;
+    size_t Max;
+    char pad[40];
+};
+
+#define LC_NBLOCK 6
+static const char * LCBlockName[LC_NBLOCK] = {"Position", "Velocity", "Aemit", "SampleFraction", "ID", "Pixel"};
+static const char * LCBlockType[LC_NBLOCK] = {"f8", "f4", "f4", "f4", "u8", "i8"};
+static const int LCBlockNmemb[LC_NBLOCK] = {3, 3, 1, 1, 1, 1};
+
+/* State of the lightcone file. The blocks stay open for the whole run and grow by
+ * new files on each flush. Only the helper thread touches the blocks between
+ * lightcone_flush and the join in lightcone_wait; it makes no MPI calls.*/
+static struct {
+    char fname[4096];
+    BigFile bf;
+    BigBlock bb[LC_NBLOCK];
+    BigBlockPtr ptr[LC_NBLOCK];
+    BigArray array[LC_NBLOCK];
+    int Pending;
+    pthread_t Thread;
+    /* Index of the block that failed to write, or -1*/
+    int Failed;
+    char ErrorMessage[512];
+    int NThread;
+    struct LightconeThreadBuffer * Buffers;
+    /* The buffers grow during the drift and the columns are written in the background,
+     * so they live outside the main arena, which must stay LIFO*/
+    Allocator Stage[1];
+} LCOut;
+
+/* HEALPix maps of the mass crossing the lightcone in the current shell. Every rank holds
+ * whole maps; they are summed over the ranks and written when the shell is complete.*/
+static struct {
+    char fname[4096];
+    BigFile bf;
+    int64_t Npix;
+    double * Mass;
+    double * GasMass;
+    /* Comoving distance of the outer edge of the first shell, and the width of a shell*/
+    double Dmax;
+    double Width;
+    /* Shell being accumulated, and the scale factor and distance at which it started*/
+    int Shell;
+    int Started;
+    double Astart;
+    double Dstart;
+} LCMap;
 
 static double lightcone_get_horizon(double a);
+static void lightcone_map_init(double timeBegin);
+
+void
+set_lightcone_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        LightconeParams.Zmin = param_get_double(ps, "LightconeZmin");
+        LightconeParams.Zmax = param_get_double(ps, "LightconeZmax");
+        LightconeParams.ReferenceRedshift = param_get_double(ps, "LightconeReferenceRedshift");
+        LightconeParams.HealpixNside = param_get_int(ps, "LightconeHealpixNside");
+        LightconeParams.BufferMB = param_get_double(ps, "LightconeBufferMB");
+        LightconeParams.WriteParticles = param_get_int(ps, "LightconeParticles");
+        LightconeParams.MapNside = param_get_int(ps, "LightconeMapNside");
+        LightconeParams.MapNshell = param_get_int(ps, "LightconeMapNshell");
+        LightconeParams.MapGas = param_get_int(ps, "LightconeMapGas");
+        if(LightconeParams.MapNside > 0 && LightconeParams.MapNshell < 1)
+            endrun(0, "LightconeMapNshell = %d must be positive.\n", LightconeParams.MapNshell);
+        if(LightconeParams.HealpixNside < 1)
+            endrun(0, "LightconeHealpixNside = %d must be positive.\n", LightconeParams.HealpixNside);
+    }
+    MPI_Bcast(&LightconeParams, sizeof(struct lightcone_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
 /*
 M, L = self.M, self.L
   logx = numpy.linspace(log10amin, 0, Np)
@@ -57,12 +171,12 @@ static double kernel(double loga, void * params) {
     double a = exp(loga);
       Cosmology * CP = (Cosmology *) params;
     return 1 / hubble_function(CP, a) * All.CP.Hubble / a;
-} 
+}
 
 static void lightcone_init_entry(Cosmology * CP, int i) {
     tab_loga[i] = - dloga * (NENTRY - i - 1);
 
-    gsl_integration_workspace * w = gsl_integration_workspace_alloc (1000); 
+    gsl_integration_workspace * w = gsl_integration_workspace_alloc (1000);
 
     double result, error;
 
@@ -70,7 +184,7 @@ static void lightcone_init_entry(Cosmology * CP, int i) {
     F.function = &kernel;
     F.params = CP;
     gsl_integration_qags (&F, tab_loga[i], 0, 0, 1e-7, 1000,
-            w, &result, &error); 
+            w, &result, &error);
 
     /* result is in DH, hubble distance */
     /* convert to cm / h */
@@ -85,28 +199,74 @@ static void lightcone_init_entry(Cosmology * CP, int i) {
 //    printf("a = %g z = %g Dc = %g\n", a, z, result);
 }
 
-void lightcone_init(Cosmology * CP, double timeBegin)
+void lightcone_init(Cosmology * CP, double timeBegin, int RestartSnapNum)
 {
     int i;
     dloga = (0.0 - log(timeBegin)) / (NENTRY - 1);
     for(i = 0; i < NENTRY; i ++) {
         lightcone_init_entry(CP, i);
     };
-    char buf[1024];
-    int chunk = 100;
-    sprintf(buf, "%s/lightcone/", All.OutputDir);
-    mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/", All.OutputDir, (int)(ThisTask / chunk));
-    mkdir(buf, 02755);
-    sprintf(buf, "%s/lightcone/%03d/lightcone-%05d.raw", All.OutputDir, (int)(ThisTask / chunk), ThisTask);
+    HorizonDistanceRef = lightcone_get_horizon(1 / (1 + LightconeParams.ReferenceRedshift));
+    message(0, "lightcone reference redshift = %g distance = %g\n",
+            LightconeParams.ReferenceRedshift, HorizonDistanceRef);
+
+    /* The shell starts where the run starts: there is no crossing before the first drift.*/
+    TimePrev = TimeCurrent = timeBegin;
+    HorizonDistancePrev = HorizonDistance = lightcone_get_horizon(timeBegin);
+    HorizonDistance2Prev = HorizonDistance2 = HorizonDistance * HorizonDistance;
 
-    fd_lightcone = fopen(buf, "a+");
-    if(fd_lightcone == NULL) {
-        endrun(1, "failed to open %s\n", buf);
+    if(0 != allocator_malloc_init(LCOut.Stage, "LIGHTCONE", 0, 0, NULL))
+        endrun(1, "Failed to initialise the lightcone buffers\n");
+
+    LCOut.NThread = omp_get_max_threads();
+    LCOut.Buffers = allocator_alloc_bot(LCOut.Stage, "LightconeThreads", sizeof(struct LightconeThreadBuffer) * LCOut.NThread);
+    for(i = 0; i < LCOut.NThread; i ++) {
+        LCOut.Buffers[i].N = 0;
+        LCOut.Buffers[i].Max = 1024;
+        LCOut.Buffers[i].Part = allocator_alloc_bot(LCOut.Stage, "LightconeBuffer", sizeof(struct LightconeParticle) * LCOut.Buffers[i].Max);
+    }
+
+    /* A restarted run has its own file, starting at TimeBegin of its Header,
+     * so a snapshot restart never appends to the rows of an earlier run.*/
+    if(RestartSnapNum != -1) {
+        snprintf(LCOut.fname, sizeof(LCOut.fname), "%s/Lightcone-R%03d", All.OutputDir, RestartSnapNum);
+        snprintf(LCMap.fname, sizeof(LCMap.fname), "%s/LightconeMaps-R%03d", All.OutputDir, RestartSnapNum);
+    }
+    else {
+        snprintf(LCOut.fname, sizeof(LCOut.fname), "%s/Lightcone", All.OutputDir);
+        snprintf(LCMap.fname, sizeof(LCMap.fname), "%s/LightconeMaps", All.OutputDir);
+    }
+
+    if(LightconeParams.MapNside > 0)
+        lightcone_map_init(timeBegin);
+    LCOut.Failed = -1;
+    if(!LightconeParams.WriteParticles)
+        return;
+
+    message(0, "Writing the lightcone to %s\n", LCOut.fname);
+    if(0 != big_file_mpi_create(&LCOut.bf, LCOut.fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create lightcone at %s:%s\n", LCOut.fname, big_file_get_error_message());
+    }
+    BigBlock bh;
+    if(0 != big_file_mpi_create_block(&LCOut.bf, &bh, "Header", NULL, 0, 0, 0, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create header at %s:%s\n", LCOut.fname, big_file_get_error_message());
+    }
+    if((0 != big_block_set_attr(&bh, "TimeBegin", &timeBegin, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "BoxSize", &All.BoxSize, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Zmin", &LightconeParams.Zmin, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Zmax", &LightconeParams.Zmax, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "ReferenceRedshift", &LightconeParams.ReferenceRedshift, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "HealpixNside", &LightconeParams.HealpixNside, "i4", 1))) {
+        endrun(0, "Failed to write lightcone header attributes %s\n", big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_close(&bh, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close lightcone header %s\n", big_file_get_error_message());
+    }
+    for(i = 0; i < LC_NBLOCK; i ++) {
+        if(0 != big_file_mpi_create_block(&LCOut.bf, &LCOut.bb[i], LCBlockName[i], LCBlockType[i], LCBlockNmemb[i], 0, 0, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to create lightcone block %s:%s\n", LCBlockName[i], big_file_get_error_message());
+        }
     }
-    HorizonDistanceRef = lightcone_get_horizon(1 / (1 + ReferenceRedshift));
-    printf("lightcone reference redshift = %g distance = %g\n",
-            ReferenceRedshift, HorizonDistanceRef);
 }
 
 /* returns the horizon distance */
@@ -126,98 +286,351 @@ static double lightcone_get_horizon(double a) {
     return tab_Dc[bin] * u2 + tab_Dc[bin + 1] * u1;
 }
 
-/* fill in the table of box offsets for current time */
+/* Squared distances from the origin to the nearest and farthest points of the box lo - hi*/
+static void
+box_distance2(const double lo[3], const double hi[3], double * dmin2, double * dmax2)
+{
+    int k;
+    *dmin2 = *dmax2 = 0;
+    for(k = 0; k < 3; k ++) {
+        const double alo = fabs(lo[k]), ahi = fabs(hi[k]);
+        if(lo[k] > 0 || hi[k] < 0)
+            *dmin2 += alo < ahi ? alo * alo : ahi * ahi;
+        *dmax2 += alo > ahi ? alo * alo : ahi * ahi;
+    }
+}
+
+/* fill in the table of box offsets which may hold particles crossing the shell
+ * between HorizonDistance and HorizonDistancePrev, and for each cell of the box
+ * the list of those replicas in which the cell meets the shell.*/
 static void update_replicas(double a) {
-    int Nmax = BoxBoost * BoxBoost * BoxBoost;
-    int i;
+    /* Particles move at most this far in or out of the shell during a step:
+     * the shell moves at the speed of light, the particles slower than LC_MAX_VELOCITY * c.
+     * The internal coordinate offset may also put them slightly outside the box.*/
+    const double pad = LC_MAX_VELOCITY * (HorizonDistancePrev - HorizonDistance)
+                     + All.RandomParticleOffset * All.BoxSize / All.Nmesh;
+    /* Replicas beyond the outer edge of the shell cannot hold a crossing*/
+    int rmax = (HorizonDistancePrev + pad) / All.BoxSize + 1;
+    if(rmax > BoxBoost)
+        rmax = BoxBoost;
     int rx, ry, rz;
-    rx = ry = rz = 0;
+    int k;
     Nreplica = 0;
 
-    for(i = 0; i < Nmax; i ++) {
-        double dx = All.BoxSize * rx;
-        double dy = All.BoxSize * ry;
-        double dz = All.BoxSize * rz;
-        double d1, d2;
-        d1 = dx * dx + dy * dy + dz * dz;
-        dx += All.BoxSize;
-        dy += All.BoxSize;
-        dz += All.BoxSize;
-        d2 = dx * dx + dy * dy + dz * dz;
-        if(d1 <= HorizonDistance2 && d2 >= HorizonDistance2) {
-            Reps[Nreplica][0] = rx * All.BoxSize;
-            Reps[Nreplica][1] = ry * All.BoxSize;
-            Reps[Nreplica][2] = rz * All.BoxSize;
-            Nreplica ++;
-            if(Nreplica > 1000) {
+    for(rx = 0; rx < rmax; rx ++)
+    for(ry = 0; ry < rmax; ry ++)
+    for(rz = 0; rz < rmax; rz ++) {
+        const double r[3] = {rx * All.BoxSize, ry * All.BoxSize, rz * All.BoxSize};
+        double lo[3], hi[3], d1, d2;
+        for(k = 0; k < 3; k ++) {
+            lo[k] = r[k] - pad;
+            hi[k] = r[k] + All.BoxSize + pad;
+        }
+        box_distance2(lo, hi, &d1, &d2);
+        if(d1 <= HorizonDistance2Prev && d2 >= HorizonDistance2) {
+            if(Nreplica >= (int) (sizeof(Reps) / sizeof(Reps[0]))) {
                 endrun(951234, "too many replica");
             }
+            for(k = 0; k < 3; k ++)
+                Reps[Nreplica][k] = r[k];
+            Nreplica ++;
         }
-        rz ++;
-        if(rz == BoxBoost) {
-            rz = 0;
-            ry ++;
-        }
-        if(ry == BoxBoost) {
-            ry = 0;
-            rx ++;
+    }
+
+    /* Most cells of a replica lie wholly inside or outside the shell, so per cell
+     * only a few replicas need testing. The tree is not built during the drift,
+     * so this uses a fixed grid of cells.*/
+    if(CellReplica) {
+        allocator_free(CellReplica);
+        allocator_free(CellStart);
+    }
+    const double cellsize = All.BoxSize / LC_NCELL;
+    CellStart = allocator_alloc_top(LCOut.Stage, "LightconeCellStart", sizeof(int) * (LC_NCELL3 + 1));
+    int pass, c, i;
+    int nentry = 0;
+    /* The first pass counts the replicas of each cell, the second stores them*/
+    for(pass = 0; pass < 2; pass ++) {
+        if(pass == 1)
+            CellReplica = allocator_alloc_top(LCOut.Stage, "LightconeCellReplica", sizeof(int) * (nentry + 1));
+        nentry = 0;
+        for(c = 0; c < LC_NCELL3; c ++) {
+            const int cell[3] = {c / (LC_NCELL * LC_NCELL), (c / LC_NCELL) % LC_NCELL, c % LC_NCELL};
+            CellStart[c] = nentry;
+            for(i = 0; i < Nreplica; i ++) {
+                double lo[3], hi[3], d1, d2;
+                for(k = 0; k < 3; k ++) {
+                    lo[k] = Reps[i][k] + cell[k] * cellsize - pad;
+                    hi[k] = Reps[i][k] + (cell[k] + 1) * cellsize + pad;
+                }
+                box_distance2(lo, hi, &d1, &d2);
+                if(d1 > HorizonDistance2Prev || d2 < HorizonDistance2)
+                    continue;
+                if(pass == 1)
+                    CellReplica[nentry] = i;
+                nentry ++;
+            }
         }
+        CellStart[LC_NCELL3] = nentry;
+    }
+    message(0, "Lightcone shell meets %d replicas, %g per cell\n", Nreplica, nentry / (double) LC_NCELL3);
+}
+
+/* The cell holding the unshifted position pos*/
+static int
+lightcone_cell(const double pos[3])
+{
+    int k, c = 0;
+    for(k = 0; k < 3; k ++) {
+        int ck = pos[k] / All.BoxSize * LC_NCELL;
+        if(ck < 0)
+            ck = 0;
+        if(ck >= LC_NCELL)
+            ck = LC_NCELL - 1;
+        c = c * LC_NCELL + ck;
     }
+    return c;
 }
+
 void lightcone_set_time(double a) {
     double z = 1 / a - 1;
-    if(z > zmin && z < zmax) {
-        HorizonDistancePrev = HorizonDistance;
-        HorizonDistance2Prev = HorizonDistance2;
-        HorizonDistance = lightcone_get_horizon(a);
-        HorizonDistance2 = HorizonDistance * HorizonDistance;
+    /* The shell always moves, so the crossing interval is right when entering the redshift range*/
+    TimePrev = TimeCurrent;
+    TimeCurrent = a;
+    HorizonDistancePrev = HorizonDistance;
+    HorizonDistance2Prev = HorizonDistance2;
+    HorizonDistance = lightcone_get_horizon(a);
+    HorizonDistance2 = HorizonDistance * HorizonDistance;
+    if(z > LightconeParams.Zmin && z < LightconeParams.Zmax) {
         update_replicas(a);
-        fflush(fd_lightcone);
-        if (z < ReferenceRedshift) {
+        if (z < LightconeParams.ReferenceRedshift) {
             SampleFraction = 1.0;
         } else {
             /* write a smaller fraction of the points at high redshift
              */
             /* This is the angular resolution rule */
             SampleFraction = HorizonDistanceRef / HorizonDistance;
-            SampleFraction *= SampleFraction; 
-            SampleFraction *= SampleFraction; 
+            SampleFraction *= SampleFraction;
+            SampleFraction *= SampleFraction;
             /* This is the luminosity resolution rule */
 #if 0
             SampleFraction = HorizonDistanceRef / HorizonDistance;
             SampleFraction *= (1 + ReferenceRedshift) / (1 + z);
-            SampleFraction *= SampleFraction; 
+            SampleFraction *= SampleFraction;
 
 #endif
         }
-        if(ThisTask == 0) {
-            printf("RefRedeshit=%g, SampleFraction=%g HorizonDistance=%g\n", 
-                    ReferenceRedshift, SampleFraction, HorizonDistance);
-        }
+        message(0, "RefRedshift=%g, SampleFraction=%g HorizonDistance=%g\n",
+                LightconeParams.ReferenceRedshift, SampleFraction, HorizonDistance);
     } else {
         SampleFraction = 0;
     }
 }
 
-/* check crossing of the horizon, write the particle */
-void lightcone_cross(int p, double oldpos[3]) {
+/* HEALPix ring scheme pixel of the direction vec, following ang2pix_ring of the HEALPix library.*/
+static int64_t
+lightcone_vec2pix_ring(const int64_t nside, const double vec[3])
+{
+    const double r = sqrt(vec[0] * vec[0] + vec[1] * vec[1] + vec[2] * vec[2]);
+    const double z = r > 0 ? vec[2] / r : 1;
+    const double za = fabs(z);
+    /* in [0,4) */
+    double tt = atan2(vec[1], vec[0]) / M_PI_2;
+    if(tt < 0)
+        tt += 4;
+    if(tt >= 4)
+        tt -= 4;
+
+    if(za <= 2./3) {
+        /* Equatorial region*/
+        const double temp1 = nside * (0.5 + tt);
+        const double temp2 = nside * z * 0.75;
+        const int64_t jp = temp1 - temp2;
+        const int64_t jm = temp1 + temp2;
+        const int64_t ir = nside + 1 + jp - jm;
+        const int64_t kshift = 1 - (ir & 1);
+        int64_t ip = (jp + jm - nside + kshift + 1) / 2;
+        ip = ((ip % (4 * nside)) + 4 * nside) % (4 * nside);
+        return 2 * nside * (nside - 1) + (ir - 1) * 4 * nside + ip;
+    }
+    /* Polar caps*/
+    const double tp = tt - (int) tt;
+    const double tmp = nside * sqrt(3 * (1 - za));
+    const int64_t jp = tp * tmp;
+    const int64_t jm = (1.0 - tp) * tmp;
+    const int64_t ir = jp + jm + 1;
+    int64_t ip = tt * ir;
+    ip = ((ip % (4 * ir)) + 4 * ir) % (4 * ir);
+    if(z > 0)
+        return 2 * ir * (ir - 1) + ip;
+    return 12 * nside * nside - 2 * ir * (ir + 1) + ip;
+}
+
+/* Allocate the maps and create the map file. The shells are even in comoving distance
+ * between LightconeZmax and LightconeZmin.*/
+static void
+lightcone_map_init(double timeBegin)
+{
+    const int64_t nside = LightconeParams.MapNside;
+    LCMap.Npix = 12 * nside * nside;
+    LCMap.Mass = allocator_alloc_bot(LCOut.Stage, "LightconeMapMass", sizeof(double) * LCMap.Npix);
+    memset(LCMap.Mass, 0, sizeof(double) * LCMap.Npix);
+    if(LightconeParams.MapGas) {
+        LCMap.GasMass = allocator_alloc_bot(LCOut.Stage, "LightconeMapGas", sizeof(double) * LCMap.Npix);
+        memset(LCMap.GasMass, 0, sizeof(double) * LCMap.Npix);
+    }
+    LCMap.Dmax = lightcone_get_horizon(1 / (1 + LightconeParams.Zmax));
+    const double Dmin = lightcone_get_horizon(1 / (1 + LightconeParams.Zmin));
+    LCMap.Width = (LCMap.Dmax - Dmin) / LightconeParams.MapNshell;
+    LCMap.Started = 0;
+    message(0, "Lightcone maps of Nside %d in %d shells of %g between distances %g and %g, %g MB\n",
+            LightconeParams.MapNside, LightconeParams.MapNshell, LCMap.Width, Dmin, LCMap.Dmax,
+            (1 + !!LCMap.GasMass) * LCMap.Npix * sizeof(double) / (1024. * 1024.));
+
+    if(0 != big_file_mpi_create(&LCMap.bf, LCMap.fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create lightcone maps at %s:%s\n", LCMap.fname, big_file_get_error_message());
+    }
+    BigBlock bh;
+    if(0 != big_file_mpi_create_block(&LCMap.bf, &bh, "Header", NULL, 0, 0, 0, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create header at %s:%s\n", LCMap.fname, big_file_get_error_message());
+    }
+    if((0 != big_block_set_attr(&bh, "TimeBegin", &timeBegin, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "BoxSize", &All.BoxSize, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "HealpixNside", &LightconeParams.MapNside, "i4", 1)) ||
+       (0 != big_block_set_attr(&bh, "Nshell", &LightconeParams.MapNshell, "i4", 1))) {
+        endrun(0, "Failed to write lightcone map header attributes %s\n", big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_close(&bh, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close lightcone map header %s\n", big_file_get_error_message());
+    }
+}
+
+/* Add the mass of particle p, crossing at pos, to the maps. Called concurrently by the drift threads.*/
+static void
+lightcone_map_add(int p, const double pos[3])
+{
+    const int64_t pix = lightcone_vec2pix_ring(LightconeParams.MapNside, pos);
+    const double mass = P[p].Mass;
+    #pragma omp atomic update
+    LCMap.Mass[pix] += mass;
+    if(LCMap.GasMass && P[p].Type == 0) {
+        #pragma omp atomic update
+        LCMap.GasMass[pix] += mass;
+    }
+}
+
+/* Sum a map over the ranks and write it as block name, in single precision.
+ * Each rank writes a contiguous part of the pixels. Clears the map. Collective.*/
+static void
+lightcone_map_save(double * map, const char * name)
+{
+    int ThisTask, NTask, r;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    int * counts = ta_malloc("LightconeMapCounts", int, NTask);
+    for(r = 0; r < NTask; r ++)
+        counts[r] = ((r + 1) * LCMap.Npix) / NTask - (r * LCMap.Npix) / NTask;
+    const int nlocal = counts[ThisTask];
+    MPI_Reduce_scatter(MPI_IN_PLACE, map, counts, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    ta_free(counts);
+
+    /* In place: entry i is read before it is overwritten*/
+    float * fmap = (float *) map;
+    int i;
+    for(i = 0; i < nlocal; i ++)
+        fmap[i] = map[i];
+
+    BigArray array = {0};
+    size_t dims[2] = {nlocal, 1};
+    ptrdiff_t strides[2] = {sizeof(float), sizeof(float)};
+    big_array_init(&array, fmap, "f4", 2, dims, strides);
+    petaio_save_block(&LCMap.bf, (char *) name, &array, 0);
+    memset(map, 0, sizeof(double) * LCMap.Npix);
+}
+
+/* Write the maps of the current shell, with the scale factors and distances it covers. Collective.*/
+static void
+lightcone_map_write(void)
+{
+    char * blockname = fastpm_strdup_printf("Shell_%03d/Header", LCMap.Shell);
+    BigBlock bh;
+    if(0 != big_file_mpi_create_block(&LCMap.bf, &bh, blockname, NULL, 0, 0, 0, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create block %s:%s\n", blockname, big_file_get_error_message());
+    }
+    if((0 != big_block_set_attr(&bh, "Amin", &LCMap.Astart, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Amax", &TimeCurrent, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Dmax", &LCMap.Dstart, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Dmin", &HorizonDistance, "f8", 1))) {
+        endrun(0, "Failed to write lightcone map attributes %s\n", big_file_get_error_message());
+    }
+    if(0 != big_block_mpi_close(&bh, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close block %s:%s\n", blockname, big_file_get_error_message());
+    }
+    myfree(blockname);
+
+    blockname = fastpm_strdup_printf("Shell_%03d/Mass", LCMap.Shell);
+    lightcone_map_save(LCMap.Mass, blockname);
+    myfree(blockname);
+    if(LCMap.GasMass) {
+        blockname = fastpm_strdup_printf("Shell_%03d/GasMass", LCMap.Shell);
+        lightcone_map_save(LCMap.GasMass, blockname);
+        myfree(blockname);
+    }
+    message(0, "Wrote lightcone map shell %d, a = %g - %g, to %s\n", LCMap.Shell, LCMap.Astart, TimeCurrent, LCMap.fname);
+}
+
+/* Called after each drift: write the current shell once the lightcone has passed its inner edge.
+ * The shells end on step boundaries, so their edges are those of the steps, as recorded in the file.*/
+static void
+lightcone_map_update(void)
+{
+    if(!LCMap.Mass)
+        return;
+    if(!LCMap.Started) {
+        /* The crossings of this drift were the first in range*/
+        if(SampleFraction <= 0)
+            return;
+        LCMap.Started = 1;
+        LCMap.Astart = TimePrev;
+        LCMap.Dstart = HorizonDistancePrev;
+        LCMap.Shell = (LCMap.Dmax - HorizonDistancePrev) / LCMap.Width;
+        if(LCMap.Shell < 0)
+            LCMap.Shell = 0;
+    }
+    if(HorizonDistance > LCMap.Dmax - (LCMap.Shell + 1) * LCMap.Width)
+        return;
+    lightcone_map_write();
+    /* A step may cross several shell edges: the next shell is the one the lightcone is in*/
+    LCMap.Shell = (LCMap.Dmax - HorizonDistance) / LCMap.Width;
+    LCMap.Astart = TimeCurrent;
+    LCMap.Dstart = HorizonDistance;
+    if(LCMap.Shell >= LightconeParams.MapNshell)
+        LCMap.Started = 0;
+}
+
+/* check crossing of the horizon, buffer the particle */
+void lightcone_cross(int p, const double oldpos[3], const double random_shift[3]) {
     if(SampleFraction <= 0.0) return;
     int i;
     int k;
-    /* DM only */
-    if(P[p].Type != 1) return;
+    /* Only dark matter is written, but the maps have all the mass*/
+    const int write = LightconeParams.WriteParticles && P[p].Type == 1;
+    if(!write && !LCMap.Mass) return;
 
-    for(i = 0; i < Nreplica; i++) {
-        double r = get_random_number(P[p].ID + i);
-        if(r > SampleFraction) continue;
+    /* Remove the internal coordinate offset, which changes on PM steps*/
+    double unshifted[3];
+    for(k = 0; k < 3; k ++)
+        unshifted[k] = oldpos[k] - (All.CurrentParticleOffset[k] - random_shift[k]);
+    const int cell = lightcone_cell(unshifted);
 
+    int j;
+    for(j = CellStart[cell]; j < CellStart[cell + 1]; j++) {
+        i = CellReplica[j];
         double pnew[3];
         double pold[3];
-        double p3[4];
         double dnew = 0, dold = 0;
         for(k = 0; k < 3; k ++) {
-            pnew[k] = P[p].Pos[k] + Reps[i][k];
-            pold[k] = oldpos[k] + Reps[i][k];
+            pnew[k] = P[p].Pos[k] - All.CurrentParticleOffset[k] + Reps[i][k];
+            pold[k] = unshifted[k] + Reps[i][k];
             dnew += pnew[k] * pnew[k];
             dold += pold[k] * pold[k];
         }
@@ -238,13 +651,206 @@ void lightcone_cross(int p, double oldpos[3]) {
                  * this partilce is moving along the horizon! */
                 u1 = u2 = 0.5;
             }
-        
+
+            if(LCMap.Mass) {
+                double pos[3];
+                for(k = 0; k < 3; k ++)
+                    pos[k] = pold[k] * u2 + pnew[k] * u1;
+                lightcone_map_add(p, pos);
+            }
+            if(!write || get_random_number(P[p].ID + i) > SampleFraction)
+                continue;
+
+            /* Each thread only appends to its own buffer, so the drift needs no locking*/
+            struct LightconeThreadBuffer * buf = &LCOut.Buffers[omp_get_thread_num()];
+            if(buf->N == buf->Max) {
+                buf->Max *= 2;
+                buf->Part = allocator_realloc(LCOut.Stage, buf->Part, sizeof(struct LightconeParticle) * buf->Max);
+            }
+            struct LightconeParticle * lp = &buf->Part[buf->N++];
+
             /* write particle position */
             for(k = 0; k < 3; k ++) {
-                p3[k] = pold[k] * u2 + pnew[k] * u1;
+                lp->Pos[k] = pold[k] * u2 + pnew[k] * u1;
+                lp->Vel[k] = P[p].Vel[k] / TimeCurrent;
             }
-            p3[3] = SampleFraction;
-            fwrite(p3, sizeof(double), 4, fd_lightcone);
+            lp->Aemit = TimePrev * u2 + TimeCurrent * u1;
+            lp->SampleFraction = SampleFraction;
+            lp->ID = P[p].ID;
+            lp->Pixel = lightcone_vec2pix_ring(LightconeParams.HealpixNside, lp->Pos);
+        }
+    }
+}
+
+/* Order the lightcone particles by HEALPix pixel, then ID*/
+static void
+lightcone_radix_pixel(const void * a, void * radix, void * arg)
+{
+    uint64_t * u = (uint64_t *) radix;
+    const struct LightconeParticle * lp = (const struct LightconeParticle *) a;
+    u[0] = lp->ID;
+    u[1] = lp->Pixel;
+}
+
+static void *
+lightcone_writer(void * unused)
+{
+    int i;
+    for(i = 0; i < LC_NBLOCK; i ++) {
+        if(LCOut.array[i].dims[0] == 0)
+            continue;
+        if(0 != big_block_write(&LCOut.bb[i], &LCOut.ptr[i], &LCOut.array[i])) {
+            LCOut.Failed = i;
+            strncpy(LCOut.ErrorMessage, big_file_get_error_message(), sizeof(LCOut.ErrorMessage) - 1);
+            break;
         }
     }
+    return NULL;
+}
+
+/* Wait for the last flush, then make it durable by writing the block headers. Collective.*/
+static void
+lightcone_wait(void)
+{
+    if(!LCOut.Pending)
+        return;
+
+    if(LCOut.Pending == 1)
+        pthread_join(LCOut.Thread, NULL);
+    LCOut.Pending = 0;
+
+    if(LCOut.Failed >= 0) {
+        endrun(1, "Failed to write lightcone block %s of %s: %s\n", LCBlockName[LCOut.Failed],
+                LCOut.fname, LCOut.ErrorMessage);
+    }
+    int i;
+    for(i = 0; i < LC_NBLOCK; i ++) {
+        if(0 != big_block_mpi_flush(&LCOut.bb[i], MPI_COMM_WORLD)) {
+            endrun(0, "Failed to flush lightcone block %s:%s\n", LCBlockName[i], big_file_get_error_message());
+        }
+    }
+    for(i = LC_NBLOCK - 1; i >= 0; i --)
+        allocator_free(LCOut.array[i].data);
+}
+
+void
+lightcone_flush(int force)
+{
+    lightcone_map_update();
+    if(!LightconeParams.WriteParticles)
+        return;
+
+    int t, i;
+    int64_t nlocal = 0;
+    for(t = 0; t < LCOut.NThread; t ++)
+        nlocal += LCOut.Buffers[t].N;
+
+    int64_t ntot = nlocal;
+    MPI_Allreduce(MPI_IN_PLACE, &ntot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(ntot == 0)
+        return;
+    if(!force && ntot * sizeof(struct LightconeParticle) < LightconeParams.BufferMB * 1024 * 1024)
+        return;
+
+    /* Only one flush is written at a time*/
+    lightcone_wait();
+
+    /* Gather the thread buffers, and sort them so each flush is ordered by sky pixel*/
+    struct LightconeParticle * part = allocator_alloc_top(LCOut.Stage, "LightconeFlush", sizeof(struct LightconeParticle) * nlocal);
+    int64_t n = 0;
+    for(t = 0; t < LCOut.NThread; t ++) {
+        memcpy(part + n, LCOut.Buffers[t].Part, sizeof(struct LightconeParticle) * LCOut.Buffers[t].N);
+        n += LCOut.Buffers[t].N;
+        LCOut.Buffers[t].N = 0;
+    }
+    mpsort_mpi(part, nlocal, sizeof(struct LightconeParticle), lightcone_radix_pixel, 16, NULL, MPI_COMM_WORLD);
+
+    char * data[LC_NBLOCK];
+    for(i = 0; i < LC_NBLOCK; i ++)
+        data[i] = allocator_alloc_bot(LCOut.Stage, LCBlockName[i], nlocal * LCBlockNmemb[i] * big_file_dtype_itemsize(LCBlockType[i]));
+
+    int64_t j;
+    #pragma omp parallel for
+    for(j = 0; j < nlocal; j ++) {
+        int k;
+        for(k = 0; k < 3; k ++) {
+            ((double *) data[0])[3 * j + k] = part[j].Pos[k];
+            ((float *) data[1])[3 * j + k] = part[j].Vel[k];
+        }
+        ((float *) data[2])[j] = part[j].Aemit;
+        ((float *) data[3])[j] = part[j].SampleFraction;
+        ((uint64_t *) data[4])[j] = part[j].ID;
+        ((int64_t *) data[5])[j] = part[j].Pixel;
+    }
+    allocator_free(part);
+
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    int64_t offset = 0;
+    MPI_Exscan(&nlocal, &offset, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(ThisTask == 0)
+        offset = 0;
+
+    for(i = 0; i < LC_NBLOCK; i ++) {
+        const size_t oldsize = LCOut.bb[i].size;
+        const size_t rowbytes = LCBlockNmemb[i] * big_file_dtype_itemsize(LCBlockType[i]);
+        const int NumFiles = (ntot * rowbytes + All.IO.BytesPerFile - 1) / All.IO.BytesPerFile;
+        /* Appending adds new physical files to the block*/
+        if(0 != big_block_mpi_grow_simple(&LCOut.bb[i], NumFiles, ntot, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to grow lightcone block %s:%s\n", LCBlockName[i], big_file_get_error_message());
+        }
+        if(0 != big_block_seek(&LCOut.bb[i], &LCOut.ptr[i], oldsize + offset)) {
+            endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+        }
+        size_t dims[2] = {nlocal, LCBlockNmemb[i]};
+        big_array_init(&LCOut.array[i], data[i], LCBlockType[i], 2, dims, NULL);
+    }
+    message(0, "Appending %ld lightcone particles up to a = %g to %s\n", ntot, TimeCurrent, LCOut.fname);
+
+    LCOut.Pending = 1;
+    if(0 != pthread_create(&LCOut.Thread, NULL, lightcone_writer, NULL)) {
+        message(1, "Could not start the lightcone writer thread; writing now.\n");
+        lightcone_writer(NULL);
+        LCOut.Pending = 2;
+    }
+    walltime_measure("/Lightcone");
+}
+
+void
+lightcone_close(void)
+{
+    lightcone_flush(1);
+    lightcone_wait();
+
+    int i;
+    if(LCMap.Mass) {
+        /* The last shell is written as far as the run got*/
+        if(LCMap.Started)
+            lightcone_map_write();
+        if(0 != big_file_mpi_close(&LCMap.bf, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to close lightcone maps at %s:%s\n", LCMap.fname, big_file_get_error_message());
+        }
+    }
+    if(LightconeParams.WriteParticles) {
+        for(i = 0; i < LC_NBLOCK; i ++) {
+            if(0 != big_block_mpi_close(&LCOut.bb[i], MPI_COMM_WORLD)) {
+                endrun(0, "Failed to close lightcone block %s:%s\n", LCBlockName[i], big_file_get_error_message());
+            }
+        }
+        if(0 != big_file_mpi_close(&LCOut.bf, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to close lightcone at %s:%s\n", LCOut.fname, big_file_get_error_message());
+        }
+    }
+    if(CellReplica) {
+        allocator_free(CellReplica);
+        allocator_free(CellStart);
+    }
+    if(LCMap.GasMass)
+        allocator_free(LCMap.GasMass);
+    if(LCMap.Mass)
+        allocator_free(LCMap.Mass);
+    for(i = LCOut.NThread - 1; i >= 0; i --)
+        allocator_free(LCOut.Buffers[i].Part);
+    allocator_free(LCOut.Buffers);
+    allocator_destroy(LCOut.Stage);
 }
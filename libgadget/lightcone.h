@@ -0,0 +1,28 @@
+#ifndef _LIGHTCONE_H
+#define _LIGHTCONE_H
+
+#include "cosmology.h"
+#include "utils/paramset.h"
+
+void set_lightcone_params(ParameterSet * ps);
+
+/* Build the distance table and create the lightcone file.
+ * A run restarted from a snapshot writes to a new file, Lightcone-R%03d.*/
+void lightcone_init(Cosmology * CP, double timeBegin, int RestartSnapNum);
+
+/* Move the lightcone shell to scale factor a. Called once per step, before the drift.*/
+void lightcone_set_time(double a);
+
+/* Check whether particle p crossed the shell while drifting from oldpos, and buffer it if so.
+ * random_shift is the change in the internal coordinate offset during the drift.
+ * Called concurrently by the drift threads, each of which has its own buffer.*/
+void lightcone_cross(int p, const double oldpos[3], const double random_shift[3]);
+
+/* Append the buffered particles to the lightcone file in the background.
+ * Collective. Nothing is written unless force is set or the buffers exceed LightconeBufferMB.*/
+void lightcone_flush(int force);
+
+/* Write the remaining particles and close the lightcone file. Collective.*/
+void lightcone_close(void);
+
+#endif
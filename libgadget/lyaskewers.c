@@ -0,0 +1,340 @@
+/*! \file lyaskewers.c
+ *  \brief Lyman-alpha optical depth along sightlines through the gas, computed in situ.
+ *
+ *  The sightlines are parallel to the axes, at random transverse positions which
+ *  depend only on LyaSkewerSeed, so every output samples the same lines.
+ *  Each gas particle adds the neutral hydrogen it has along each line it crosses:
+ *  the kernel is sampled along the chord, and each sample is spread over the
+ *  velocity pixels with the thermal profile of the particle, at its Hubble
+ *  velocity plus the peculiar velocity along the line.
+ *  The particles are visited locally, so no tree walk or particle exchange is needed;
+ *  the skewers are then summed over the ranks and each rank writes a part of them.
+ */
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <bigfile-mpi.h>
+#include <gsl/gsl_rng.h>
+
+#include "utils.h"
+
+#include "allvars.h"
+#include "partmanager.h"
+#include "slotsmanager.h"
+#include "densitykernel.h"
+#include "hydra.h"
+#include "physconst.h"
+#include "cooling.h"
+#include "sfr_eff.h"
+#include "petaio.h"
+#include "walltime.h"
+#include "lyaskewers.h"
+
+/* Samples of the kernel along the chord of a particle through a sightline*/
+#define LYA_CHORD_SAMPLES 16
+/* The thermal profile is cut at this many Doppler widths*/
+#define LYA_PROFILE_WIDTH 5
+
+static struct lya_skewer_params
+{
+    int NumSkewers; /* Sightlines along each axis*/
+    int Npix; /* Velocity pixels per sightline*/
+    int Seed; /* Seed of the sightline positions*/
+} LyaParams;
+
+void
+set_lya_skewer_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        LyaParams.NumSkewers = param_get_int(ps, "LyaSkewerNum");
+        LyaParams.Npix = param_get_int(ps, "LyaSkewerNpix");
+        LyaParams.Seed = param_get_int(ps, "LyaSkewerSeed");
+        if(LyaParams.NumSkewers < 1 || LyaParams.Npix < 1)
+            endrun(0, "LyaSkewerNum = %d and LyaSkewerNpix = %d must be positive.\n", LyaParams.NumSkewers, LyaParams.Npix);
+    }
+    MPI_Bcast(&LyaParams, sizeof(struct lya_skewer_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+/* The sightlines along one axis, binned on a grid of Ngrid^2 cells of the transverse plane*/
+struct LyaSkewerGrid {
+    int Ngrid;
+    double CellSize;
+    /* The sightlines in cell c are Skewer[CellStart[c]] to Skewer[CellStart[c+1]-1]*/
+    int * CellStart;
+    int * Skewer;
+};
+
+/* Position of each sightline in the transverse plane of its axis. Sightline s is
+ * along axis s / NumSkewers, and its coordinates are along (axis + 1) % 3 and (axis + 2) % 3.*/
+static void
+lya_skewer_positions(double (*pos)[2], const int nskewers, const double BoxSize)
+{
+    gsl_rng * rng = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(rng, LyaParams.Seed);
+    int s;
+    for(s = 0; s < nskewers; s++) {
+        pos[s][0] = gsl_rng_uniform(rng) * BoxSize;
+        pos[s][1] = gsl_rng_uniform(rng) * BoxSize;
+    }
+    gsl_rng_free(rng);
+}
+
+static void
+lya_skewer_grid_build(struct LyaSkewerGrid * grid, double (*pos)[2], const int first, const int n, const double BoxSize)
+{
+    grid->Ngrid = sqrt(n) + 1;
+    grid->CellSize = BoxSize / grid->Ngrid;
+    const int ncell = grid->Ngrid * grid->Ngrid;
+    grid->CellStart = (int *) mymalloc("LyaCellStart", (ncell + 1) * sizeof(int));
+    grid->Skewer = (int *) mymalloc("LyaSkewer", n * sizeof(int));
+    int * cell = ta_malloc("LyaCell", int, n);
+    memset(grid->CellStart, 0, (ncell + 1) * sizeof(int));
+    int s, c;
+    for(s = 0; s < n; s++) {
+        int i0 = pos[first + s][0] / grid->CellSize;
+        int i1 = pos[first + s][1] / grid->CellSize;
+        if(i0 >= grid->Ngrid) i0 = grid->Ngrid - 1;
+        if(i1 >= grid->Ngrid) i1 = grid->Ngrid - 1;
+        cell[s] = i0 * grid->Ngrid + i1;
+        grid->CellStart[cell[s] + 1]++;
+    }
+    for(c = 0; c < ncell; c++)
+        grid->CellStart[c + 1] += grid->CellStart[c];
+    int * fill = ta_malloc("LyaFill", int, ncell);
+    memcpy(fill, grid->CellStart, ncell * sizeof(int));
+    for(s = 0; s < n; s++)
+        grid->Skewer[fill[cell[s]]++] = first + s;
+    ta_free(fill);
+    ta_free(cell);
+}
+
+static void
+lya_skewer_grid_free(struct LyaSkewerGrid * grid)
+{
+    myfree(grid->Skewer);
+    myfree(grid->CellStart);
+}
+
+/* Physical properties of a gas particle needed for the absorption*/
+struct LyaGas {
+    /* Neutral hydrogen per unit kernel weight and unit physical length, in cm^-2 per internal length unit*/
+    double nHI_norm;
+    /* Doppler width in internal velocity units*/
+    double b;
+};
+
+static struct LyaGas
+lya_gas_properties(const int i, const double redshift)
+{
+    struct LyaGas gas;
+    const double a = All.Time;
+    const double h = All.CP.HubbleParam;
+    const double nh0 = get_neutral_fraction_sfreff(redshift, &P[i], &SPHP(i));
+
+    /* Temperature from the internal energy, in cgs as get_temp needs*/
+    const double egyspec = SPHP(i).Entropy / GAMMA_MINUS1 * pow(SPH_EOMDensity(i) * All.cf.a3inv, GAMMA_MINUS1);
+    const double dens_cgs = SPHP(i).Density * All.cf.a3inv * All.UnitDensity_in_cgs * h * h / PROTONMASS;
+    const double egy_cgs = egyspec * All.UnitVelocity_in_cm_per_s * All.UnitVelocity_in_cm_per_s;
+    struct UVBG uvbg = get_local_UVBG(redshift, P[i].Pos);
+    double ne = SPHP(i).Ne;
+    const double temp = get_temp(dens_cgs, egy_cgs, 1 - HYDROGEN_MASSFRAC, &uvbg, &ne);
+    gas.b = sqrt(2 * BOLTZMANN * temp / PROTONMASS) / All.UnitVelocity_in_cm_per_s;
+
+    /* Mass times the kernel is a comoving density. Convert it to a physical number density
+     * of neutral hydrogen, times a physical path length in cm per comoving internal length.*/
+    const double dens_to_n = All.cf.a3inv * All.UnitDensity_in_cgs * h * h / PROTONMASS;
+    const double len_to_cm = a * All.UnitLength_in_cm / h;
+    gas.nHI_norm = P[i].Mass * HYDROGEN_MASSFRAC * nh0 * dens_to_n * len_to_cm;
+    return gas;
+}
+
+/* Add the absorption of gas particle i to the sightline tau along axis ax,
+ * at transverse distance dist, in velocity pixels of width dv.*/
+static void
+lya_add_particle(double * tau, const int i, const struct LyaGas * gas, const int ax, const double dist,
+        DensityKernel * kernel, const double vfac, const double dv)
+{
+    const int Npix = LyaParams.Npix;
+    const double hsml = P[i].Hsml;
+    const double halfchord = sqrt(hsml * hsml - dist * dist);
+    const double dx = 2 * halfchord / LYA_CHORD_SAMPLES;
+    /* The peculiar velocity along the line; internal velocities are a^2 dx/dt*/
+    const double vpec = P[i].Vel[ax] / All.Time;
+    /* sigma_alpha c = pi e^2 f lambda / (m_e c), in cm^3/s*/
+    const double sigma_c = M_PI * ELECTRONCHARGE * ELECTRONCHARGE / (ELECTRONMASS * LIGHTCGS) * OSCILLATOR_STRENGTH * LYMAN_ALPHA;
+    const double dv_cgs = dv * All.UnitVelocity_in_cm_per_s;
+    const double b = gas->b > 0 ? gas->b : 1e-6 * dv;
+
+    double u[LYA_CHORD_SAMPLES], wk[LYA_CHORD_SAMPLES];
+    int k;
+    for(k = 0; k < LYA_CHORD_SAMPLES; k++) {
+        const double x = halfchord * (2 * (k + 0.5) / LYA_CHORD_SAMPLES - 1);
+        u[k] = sqrt(dist * dist + x * x) / hsml;
+    }
+    density_kernel_wk_many(kernel, u, wk, LYA_CHORD_SAMPLES);
+
+    for(k = 0; k < LYA_CHORD_SAMPLES; k++) {
+        if(wk[k] <= 0)
+            continue;
+        const double x = P[i].Pos[ax] + halfchord * (2 * (k + 0.5) / LYA_CHORD_SAMPLES - 1);
+        /* Column density of the sample, in cm^-2*/
+        const double column = gas->nHI_norm * wk[k] * dx;
+        /* Centre of the line in units of the pixel width*/
+        const double vc = (x * vfac + vpec) / dv;
+        const int first = floor(vc - LYA_PROFILE_WIDTH * b / dv);
+        const int last = floor(vc + LYA_PROFILE_WIDTH * b / dv);
+        int p;
+        for(p = first; p <= last; p++) {
+            /* The mean of the thermal profile over the pixel*/
+            const double frac = 0.5 * (erf((p + 1 - vc) * dv / b) - erf((p - vc) * dv / b));
+            const int pix = ((p % Npix) + Npix) % Npix;
+            #pragma omp atomic update
+            tau[pix] += sigma_c * column * frac / dv_cgs;
+        }
+    }
+}
+
+void
+lya_skewers_write(int num)
+{
+    const int Npix = LyaParams.Npix;
+    const int nskewers = 3 * LyaParams.NumSkewers;
+    const double BoxSize = All.BoxSize;
+    const double redshift = 1. / All.Time - 1;
+    /* Hubble velocity per comoving length, and the width of a velocity pixel*/
+    const double vfac = All.Time * All.cf.hubble;
+    const double dv = vfac * BoxSize / Npix;
+
+    walltime_measure("/Misc");
+    message(0, "Casting %d Lyman-alpha sightlines of %d pixels at z = %g\n", nskewers, Npix, redshift);
+
+    double (*pos)[2] = (double (*)[2]) mymalloc("LyaSkewerPos", nskewers * sizeof(pos[0]));
+    lya_skewer_positions(pos, nskewers, BoxSize);
+    double * tau = (double *) mymalloc("LyaTau", (size_t) nskewers * Npix * sizeof(double));
+    memset(tau, 0, (size_t) nskewers * Npix * sizeof(double));
+
+    int ax;
+    for(ax = 0; ax < 3; ax++) {
+        const int t0 = (ax + 1) % 3, t1 = (ax + 2) % 3;
+        struct LyaSkewerGrid grid;
+        lya_skewer_grid_build(&grid, pos, ax * LyaParams.NumSkewers, LyaParams.NumSkewers, BoxSize);
+        int i;
+        #pragma omp parallel for schedule(dynamic, 256)
+        for(i = 0; i < PartManager->NumPart; i++) {
+            if(P[i].Type != 0 || P[i].IsGarbage || P[i].Swallowed)
+                continue;
+            const double hsml = P[i].Hsml;
+            const int lo0 = floor((P[i].Pos[t0] - hsml) / grid.CellSize);
+            const int hi0 = floor((P[i].Pos[t0] + hsml) / grid.CellSize);
+            const int lo1 = floor((P[i].Pos[t1] - hsml) / grid.CellSize);
+            const int hi1 = floor((P[i].Pos[t1] + hsml) / grid.CellSize);
+            int computed = 0;
+            struct LyaGas gas;
+            DensityKernel kernel;
+            int c0, c1;
+            for(c0 = lo0; c0 <= hi0 && c0 < lo0 + grid.Ngrid; c0++)
+            for(c1 = lo1; c1 <= hi1 && c1 < lo1 + grid.Ngrid; c1++) {
+                const int cell = ((c0 % grid.Ngrid + grid.Ngrid) % grid.Ngrid) * grid.Ngrid
+                               + (c1 % grid.Ngrid + grid.Ngrid) % grid.Ngrid;
+                int j;
+                for(j = grid.CellStart[cell]; j < grid.CellStart[cell + 1]; j++) {
+                    const int s = grid.Skewer[j];
+                    const double d0 = NEAREST(P[i].Pos[t0] - pos[s][0], BoxSize);
+                    const double d1 = NEAREST(P[i].Pos[t1] - pos[s][1], BoxSize);
+                    const double dist = sqrt(d0 * d0 + d1 * d1);
+                    if(dist >= hsml)
+                        continue;
+                    /* The neutral fraction and temperature need a cooling solve: only for particles on a line*/
+                    if(!computed) {
+                        gas = lya_gas_properties(i, redshift);
+                        density_kernel_init(&kernel, hsml, All.DensityKernelType);
+                        computed = 1;
+                    }
+                    lya_add_particle(tau + (size_t) s * Npix, i, &gas, ax, dist, &kernel, vfac, dv);
+                }
+            }
+        }
+        lya_skewer_grid_free(&grid);
+    }
+    walltime_measure("/LyaSkewers/Compute");
+
+    /* Sum the skewers over the ranks; rank r keeps skewers firsts[r] to firsts[r+1]-1.*/
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    int * recvcounts = ta_malloc("LyaCounts", int, NTask);
+    int r;
+    for(r = 0; r < NTask; r++)
+        recvcounts[r] = (((int64_t) (r + 1) * nskewers) / NTask - ((int64_t) r * nskewers) / NTask) * Npix;
+    const int firstskewer = ((int64_t) ThisTask * nskewers) / NTask;
+    const int nlocal = recvcounts[ThisTask] / Npix;
+    MPI_Reduce_scatter(MPI_IN_PLACE, tau, recvcounts, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    ta_free(recvcounts);
+
+    /* Store in single precision, in place: entry i is read before it is overwritten.*/
+    float * ftau = (float *) tau;
+    int64_t i;
+    for(i = 0; i < (int64_t) nlocal * Npix; i++)
+        ftau[i] = tau[i];
+    int * axis = (int *) mymalloc("LyaAxis", (nlocal + 1) * sizeof(int));
+    double (*spos)[3] = (double (*)[3]) mymalloc("LyaPos", (nlocal + 1) * sizeof(spos[0]));
+    for(i = 0; i < nlocal; i++) {
+        const int s = firstskewer + i;
+        axis[i] = s / LyaParams.NumSkewers;
+        spos[i][axis[i]] = 0;
+        spos[i][(axis[i] + 1) % 3] = pos[s][0];
+        spos[i][(axis[i] + 2) % 3] = pos[s][1];
+    }
+
+    char * fname = fastpm_strdup_printf("%s/LyaSkewers_%03d", All.OutputDir, num);
+    message(0, "Saving Lyman-alpha skewers to %s\n", fname);
+    BigFile bf = {0};
+    if(0 != big_file_mpi_create(&bf, fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create skewers at %s:%s\n", fname, big_file_get_error_message());
+    }
+    BigBlock bh;
+    if(0 != big_file_mpi_create_block(&bf, &bh, "Header", NULL, 0, 0, 0, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create header at %s:%s\n", fname, big_file_get_error_message());
+    }
+    /* The velocity extent of the box in km/s*/
+    const double vbox = vfac * BoxSize * All.UnitVelocity_in_cm_per_s / 1e5;
+    if((0 != big_block_set_attr(&bh, "Time", &All.Time, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "BoxSize", &All.BoxSize, "f8", 1)) ||
+       (0 != big_block_set_attr(&bh, "Npix", &LyaParams.Npix, "i4", 1)) ||
+       (0 != big_block_set_attr(&bh, "VelocityBoxSize", &vbox, "f8", 1))) {
+        endrun(0, "Failed to write header attributes %s\n", big_file_get_error_message());
+    }
+    big_block_mpi_close(&bh, MPI_COMM_WORLD);
+
+    BigArray array = {0};
+    size_t dims[2] = {nlocal, 1};
+    ptrdiff_t strides[2] = {sizeof(int), sizeof(int)};
+    big_array_init(&array, axis, "i4", 2, dims, strides);
+    petaio_save_block(&bf, "Axis", &array, 0);
+
+    dims[1] = 3;
+    strides[0] = sizeof(spos[0]);
+    strides[1] = sizeof(double);
+    big_array_init(&array, spos, "f8", 2, dims, strides);
+    petaio_save_block(&bf, "Position", &array, 0);
+
+    dims[1] = Npix;
+    strides[0] = Npix * sizeof(float);
+    strides[1] = sizeof(float);
+    big_array_init(&array, ftau, "f4", 2, dims, strides);
+    petaio_save_block(&bf, "Tau", &array, 0);
+
+    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to close skewers at %s:%s\n", fname, big_file_get_error_message());
+    }
+    myfree(fname);
+    myfree(spos);
+    myfree(axis);
+    myfree(tau);
+    myfree(pos);
+    walltime_measure("/LyaSkewers/Write");
+}
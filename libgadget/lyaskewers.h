@@ -0,0 +1,12 @@
+#ifndef _LYASKEWERS_H
+#define _LYASKEWERS_H
+
+#include "utils/paramset.h"
+
+void set_lya_skewer_params(ParameterSet * ps);
+
+/* Cast LyaSkewerNum sightlines along each axis through the gas and write
+ * their Lyman-alpha optical depth in redshift space to LyaSkewers_%03d. Collective.*/
+void lya_skewers_write(int num);
+
+#endif
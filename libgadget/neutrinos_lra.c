@@ -6,6 +6,7 @@
  * from the non-linear CDM power.
  */
 
+#include <mpi.h>
 #include <math.h>
 #include <string.h>
 #include <bigfile-mpi.h>
@@ -28,6 +29,8 @@
 #define FLOAT_ACC   1e-6
 /** Number of bins in integrations*/
 #define GSL_VAL 200
+/** Number of points in the table of specialJ for hybrid neutrinos*/
+#define SPECIALJ_NTAB 2048
 
 /** Update the last value of delta_tot in the table with a new value computed
  from the given delta_cdm_curr and delta_nu_curr.
@@ -39,7 +42,9 @@ void update_delta_tot(_delta_tot_table * const d_tot, const double a, const doub
  * @param d_tot Initialised structure for storing total matter density.
  * @param a Current scale factor.
  * @param delta_nu_curr Pointer to array to store square root of neutrino power spectrum. Main output.
- * @param mnu Neutrino mass in eV.*/
+ * @param mnu Neutrino mass in eV.
+ * Must be called on all ranks, which each integrate a share of the k bins.
+ * The free-streaming length table must have been filled by init_fslength_table.*/
 void get_delta_nu(Cosmology * CP, const _delta_tot_table * const d_tot, const double a, double delta_nu_curr[], const double mnu);
 
 /** Function which wraps three get_delta_nu calls to get delta_nu three times,
@@ -60,6 +65,9 @@ Arguments:
 */
 double fslength(Cosmology * CP, const double logai, const double logaf, const double light);
 
+/** Fill the table of free-streaming lengths since TimeTransfer.*/
+static void init_fslength_table(Cosmology * CP, _delta_tot_table * const d_tot);
+
 /** Combine the CDM and neutrino power spectra together to get the total power.
  * OmegaNua3 = OmegaNu(a) * a^3
  * Omeganonu = Omega0 - OmegaNu(1)
@@ -155,6 +163,7 @@ void delta_nu_from_power(struct _powerspectrum * PowerSpectrum, Cosmology * CP,
             /* Otherwise compute delta_nu from the transfer functions*/
             delta_tot_first_init(&delta_tot_table, PowerSpectrum->nonzero, PowerSpectrum->kk, PowerSpectrum->Power, TimeIC);
 
+        init_fslength_table(CP, &delta_tot_table);
         /*Initialise the first delta_nu*/
         get_delta_nu_combined(CP, &delta_tot_table, exp(delta_tot_table.scalefact[delta_tot_table.ia-1]), delta_tot_table.delta_nu_last);
         delta_tot_table.delta_tot_init_done = 1;
@@ -426,6 +435,14 @@ void init_neutrinos_lra(const int nk_in, const double TimeTransfer, const double
    d_tot->delta_nu_last = (double *) mymalloc("kspace_delta_nu", sizeof(double) * 3 * nk_in);
    d_tot->delta_nu_init = d_tot->delta_nu_last + nk_in;
    d_tot->wavenum = d_tot->delta_nu_init + nk_in;
+   /* Free-streaming length table, much finer than the stored power spectra.
+    * The small margin past TimeMax allows for rounding in the final time.*/
+   d_tot->fs_n = 16 * d_tot->namax;
+   d_tot->fs_loga = (double *) mymalloc("kspace_fslength", 2 * d_tot->fs_n * sizeof(double));
+   d_tot->fs_cumulative = d_tot->fs_loga + d_tot->fs_n;
+   for(count = 0; count < d_tot->fs_n; count++)
+       d_tot->fs_loga[count] = log(TimeTransfer) + count * (log(TimeMax) + 0.01 - log(TimeTransfer)) / (d_tot->fs_n - 1.);
+   d_tot->fs_spline = NULL;
    /*Allocate actual data. Note that this means data can be accessed either as:
     * delta_tot[k][a] OR as
     * delta_tot[0][a+k*namax] */
@@ -523,6 +540,22 @@ double fslength(Cosmology * CP, const double logai, const double logaf, const do
   return light*fslength_val;
 }
 
+/* Integrate the free-streaming length piecewise over the table, so each
+ * later free-streaming length is a difference of two interpolated values
+ * and the cost of get_delta_nu does not grow as the run goes on.*/
+static void init_fslength_table(Cosmology * CP, _delta_tot_table * const d_tot)
+{
+    int i;
+    d_tot->fs_cumulative[0] = 0;
+    for(i = 1; i < d_tot->fs_n; i++)
+        d_tot->fs_cumulative[i] = d_tot->fs_cumulative[i-1] + fslength(CP, d_tot->fs_loga[i-1], d_tot->fs_loga[i], d_tot->light);
+    if(!d_tot->fs_spline)
+        d_tot->fs_spline = gsl_interp_alloc(gsl_interp_cspline, d_tot->fs_n);
+    if(!d_tot->fs_spline)
+        endrun(2016, "Error allocating the free-streaming length interpolator.\n");
+    gsl_interp_init(d_tot->fs_spline, d_tot->fs_loga, d_tot->fs_cumulative, d_tot->fs_n);
+}
+
 /**************************************************************************************************
 Fit to the special function J(x) that is accurate to better than 3% relative and 0.07% absolute
     J(x) = Integrate[(Sin[q*x]/(q*x))*(q^2/(Exp[q] + 1)), {q, 0, Infinity}]
@@ -589,11 +622,13 @@ struct _delta_nu_int_params
     gsl_interp_accel *acc;
     gsl_interp *spline;
     Cosmology * CP;
-    /**Precomputed free-streaming lengths*/
+    /**Precomputed free-streaming lengths since TimeTransfer*/
     gsl_interp_accel *fs_acc;
-    gsl_interp *fs_spline;
-    double * fslengths;
-    double * fsscales;
+    const gsl_interp *fs_spline;
+    const double * fslengths;
+    const double * fsscales;
+    /**Free-streaming length from TimeTransfer to the current time*/
+    double fsl_a;
     /**Make sure this is at the same k as above*/
     double * delta_tot;
     double * scale;
@@ -603,16 +638,55 @@ struct _delta_nu_int_params
     double qc;
     /*Fraction of neutrinos in particles for normalisation with hybrid neutrinos*/
     double nufrac_low;
+    /** Table of specialJ against log(1+x), used when qc > 0 and specialJ is a slow sum. NULL otherwise.*/
+    const gsl_interp * J_spline;
+    gsl_interp_accel * J_acc;
+    const double * J_logx;
+    const double * J_tab;
 };
 typedef struct _delta_nu_int_params delta_nu_int_params;
 
+/* Tabulate specialJ(x, qc, nufrac_low) for 0 <= x <= xmax, evenly in log(1+x),
+ * which is fine where J varies quickly and coarse in its power law tail.
+ * The table is only worth having for hybrid neutrinos: otherwise specialJ is a cheap fit.*/
+static void
+specialJ_table_init(delta_nu_int_params * params, double * J_logx, double * J_tab, const double xmax)
+{
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < SPECIALJ_NTAB; i++) {
+        J_logx[i] = i * log1p(xmax) / (SPECIALJ_NTAB - 1.);
+        J_tab[i] = specialJ(expm1(J_logx[i]), params->qc, params->nufrac_low);
+    }
+    gsl_interp * J_spline = gsl_interp_alloc(gsl_interp_cspline, SPECIALJ_NTAB);
+    if(!J_spline)
+        endrun(2016, "Error allocating the specialJ interpolator.\n");
+    gsl_interp_init(J_spline, J_logx, J_tab, SPECIALJ_NTAB);
+    params->J_spline = J_spline;
+    params->J_logx = J_logx;
+    params->J_tab = J_tab;
+}
+
+static inline double
+specialJ_eval(const delta_nu_int_params * p, const double x)
+{
+    const double logx = log1p(x);
+    if(!p->J_spline || logx > p->J_logx[SPECIALJ_NTAB-1])
+        return specialJ(x, p->qc, p->nufrac_low);
+    return gsl_interp_eval(p->J_spline, p->J_logx, p->J_tab, logx, p->J_acc);
+}
+
 /**GSL integration kernel for get_delta_nu*/
 double get_delta_nu_int(double logai, void * params)
 {
     delta_nu_int_params * p = (delta_nu_int_params *) params;
-    double fsl_aia = gsl_interp_eval(p->fs_spline,p->fsscales,p->fslengths,logai,p->fs_acc);
+    double fsl_aia = p->fsl_a - gsl_interp_eval(p->fs_spline,p->fsscales,p->fslengths,logai,p->fs_acc);
+    /* The cumulative free-streaming length is monotone, but guard against interpolation
+     * making it very slightly negative just below the current time.*/
+    if(fsl_aia < 0)
+        fsl_aia = 0;
     double delta_tot_at_a = gsl_interp_eval(p->spline,p->scale,p->delta_tot,logai,p->acc);
-    double specJ = specialJ(p->k*fsl_aia/p->mnubykT, p->qc, p->nufrac_low);
+    double specJ = specialJ_eval(p, p->k*fsl_aia/p->mnubykT);
     double ai = exp(logai);
     return fsl_aia/(ai*hubble_function(p->CP, ai)) * specJ * delta_tot_at_a;
 }
@@ -636,7 +710,7 @@ void get_delta_nu(Cosmology * CP, const _delta_tot_table * const d_tot, const do
   double relerr = 1e-6;
 //       message(0,"Start get_delta_nu: a=%g Na =%d wavenum[0]=%g delta_tot[0]=%g m_nu=%g\n",a,Na,wavenum[0],d_tot->delta_tot[0][Na-1],mnu);
 
-  fsl_A0a = fslength(CP, log(d_tot->TimeTransfer), log(a),d_tot->light);
+  fsl_A0a = gsl_interp_eval(d_tot->fs_spline, d_tot->fs_loga, d_tot->fs_cumulative, log(a), NULL);
   /*Precompute factor used to get delta_nu_init. This assumes that delta ~ a, so delta-dot is roughly 1.*/
   deriv_prefac = d_tot->TimeTransfer*(hubble_function(CP, d_tot->TimeTransfer)/d_tot->light)* d_tot->TimeTransfer;
   for (ik = 0; ik < d_tot->nk; ik++) {
@@ -667,58 +741,73 @@ void get_delta_nu(Cosmology * CP, const _delta_tot_table * const d_tot, const do
   /*If neutrino mass is zero, we are not accurate, just use the initial conditions piece*/
   if(Na > 1 && mnubykT > 0){
         delta_nu_int_params params;
-        params.acc = gsl_interp_accel_alloc();
-        gsl_integration_workspace * w = gsl_integration_workspace_alloc (GSL_VAL);
-        gsl_function F;
-        F.function = &get_delta_nu_int;
-        F.params=&params;
-        /*Use cubic interpolation*/
-        if(Na > 2) {
-                params.spline=gsl_interp_alloc(gsl_interp_cspline,Na);
-        }
-        /*Unless we have only two points*/
-        else {
-                params.spline=gsl_interp_alloc(gsl_interp_linear,Na);
-        }
         params.scale=d_tot->scalefact;
         params.mnubykT=mnubykT;
         params.qc = qc;
         params.nufrac_low = d_tot->omnu->hybnu.nufrac_low[0];
-        /* Massively over-sample the free-streaming lengths.
-         * Interpolation is least accurate where the free-streaming length -> 0,
-         * which is exactly where it doesn't matter, but
-         * we still want to be safe. */
-        int Nfs = Na*16;
-        params.fs_acc = gsl_interp_accel_alloc();
-        params.fs_spline=gsl_interp_alloc(gsl_interp_cspline,Nfs);
         params.CP = CP;
-        /*Pre-compute the free-streaming lengths, which are scale-independent*/
-        double * fslengths = mymalloc("fslengths", Nfs* sizeof(double));
-        double * fsscales = mymalloc("fsscales", Nfs* sizeof(double));
-        for(ik=0; ik < Nfs; ik++) {
-            fsscales[ik] = log(d_tot->TimeTransfer) + ik*(log(a) - log(d_tot->TimeTransfer))/(Nfs-1.);
-            fslengths[ik] = fslength(CP, fsscales[ik], log(a),d_tot->light);
+        params.fs_spline = d_tot->fs_spline;
+        params.fslengths = d_tot->fs_cumulative;
+        params.fsscales = d_tot->fs_loga;
+        params.fsl_a = fsl_A0a;
+        params.J_spline = NULL;
+        params.J_acc = NULL;
+        double * J_logx = NULL;
+        if(qc > 0 && fsl_A0a > 0) {
+            /* The largest argument of specialJ in the integral, at the largest k and the longest free-streaming length.*/
+            J_logx = mymalloc("specialJ_tab", 2 * SPECIALJ_NTAB * sizeof(double));
+            specialJ_table_init(&params, J_logx, J_logx + SPECIALJ_NTAB, d_tot->wavenum[d_tot->nk-1] * fsl_A0a / mnubykT);
+        }
+
+        /* Each rank integrates a contiguous share of the k bins, spread over its threads,
+         * and the shares are summed so that all ranks have the full delta_nu.*/
+        int ThisTask, NTask;
+        MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+        MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+        const int kstart = ((int64_t) d_tot->nk * ThisTask) / NTask;
+        const int kend = ((int64_t) d_tot->nk * (ThisTask + 1)) / NTask;
+        double * d_nu_int = mymalloc("delta_nu_int", d_tot->nk * sizeof(double));
+        memset(d_nu_int, 0, d_tot->nk * sizeof(double));
+
+        #pragma omp parallel
+        {
+            delta_nu_int_params tparams = params;
+            tparams.acc = gsl_interp_accel_alloc();
+            tparams.fs_acc = gsl_interp_accel_alloc();
+            if(tparams.J_spline)
+                tparams.J_acc = gsl_interp_accel_alloc();
+            /*Use cubic interpolation, unless we have only two points*/
+            tparams.spline = gsl_interp_alloc(Na > 2 ? gsl_interp_cspline : gsl_interp_linear, Na);
+            gsl_integration_workspace * w = gsl_integration_workspace_alloc (GSL_VAL);
+            gsl_function F;
+            F.function = &get_delta_nu_int;
+            F.params = &tparams;
+            if(!tparams.spline || !tparams.acc || !w || !tparams.fs_acc)
+                endrun(2016,"Error initialising and allocating memory for gsl interpolator and integrator.\n");
+            int jk;
+            #pragma omp for schedule(dynamic)
+            for (jk = kstart; jk < kend; jk++) {
+                double abserr;
+                tparams.k=d_tot->wavenum[jk];
+                tparams.delta_tot=d_tot->delta_tot[jk];
+                gsl_interp_init(tparams.spline,tparams.scale,tparams.delta_tot,Na);
+                gsl_integration_qag (&F, log(d_tot->TimeTransfer), log(a), 0, relerr,GSL_VAL,6,w,&d_nu_int[jk], &abserr);
+            }
+            gsl_integration_workspace_free (w);
+            gsl_interp_free(tparams.spline);
+            gsl_interp_accel_free(tparams.acc);
+            gsl_interp_accel_free(tparams.fs_acc);
+            if(tparams.J_acc)
+                gsl_interp_accel_free(tparams.J_acc);
+        }
+        MPI_Allreduce(MPI_IN_PLACE, d_nu_int, d_tot->nk, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        for (ik = 0; ik < d_tot->nk; ik++)
+            delta_nu_curr[ik] += d_tot->delta_nu_prefac * d_nu_int[ik];
+        myfree(d_nu_int);
+        if(J_logx) {
+            gsl_interp_free((gsl_interp *) params.J_spline);
+            myfree(J_logx);
         }
-        params.fslengths = fslengths;
-        params.fsscales = fsscales;
-
-        if(!params.spline || !params.acc || !w || !params.fs_spline || !params.fs_acc || !fslengths || !fsscales)
-              endrun(2016,"Error initialising and allocating memory for gsl interpolator and integrator.\n");
-
-        gsl_interp_init(params.fs_spline,params.fsscales,params.fslengths,Nfs);
-        for (ik = 0; ik < d_tot->nk; ik++) {
-            double abserr,d_nu_tmp;
-            params.k=d_tot->wavenum[ik];
-            params.delta_tot=d_tot->delta_tot[ik];
-            gsl_interp_init(params.spline,params.scale,params.delta_tot,Na);
-            gsl_integration_qag (&F, log(d_tot->TimeTransfer), log(a), 0, relerr,GSL_VAL,6,w,&d_nu_tmp, &abserr);
-            delta_nu_curr[ik] += d_tot->delta_nu_prefac * d_nu_tmp;
-         }
-         gsl_integration_workspace_free (w);
-         gsl_interp_free(params.spline);
-         gsl_interp_accel_free(params.acc);
-         myfree(fsscales);
-         myfree(fslengths);
    }
 //     for(ik=0; ik< 3; ik++)
 //         message(0,"k %g d_nu %g\n",wavenum[d_tot->nk/8*ik], delta_nu_curr[d_tot->nk/8*ik]);
@@ -41,6 +41,14 @@ struct _delta_tot_table {
     double light;
     /** The time at which the simulation starts*/
     double TimeTransfer;
+    /** Number of points in the free-streaming length table*/
+    int fs_n;
+    /** Log scale factors of the free-streaming length table, evenly spaced from TimeTransfer to TimeMax*/
+    double * fs_loga;
+    /** Free-streaming length from TimeTransfer to each fs_loga, computed once on the first call to delta_nu_from_power.
+     * The free-streaming length between any two times is then a difference of interpolated values.*/
+    double * fs_cumulative;
+    gsl_interp * fs_spline;
 };
 typedef struct _delta_tot_table _delta_tot_table;
 
@@ -1,8 +1,10 @@
 #include <string.h>
+#include <limits.h>
 
 #include "utils.h"
 
 #include "partmanager.h"
+#include "slotsmanager.h"
 
 /*! This structure holds all the information that is
  * stored for each particle of the simulation on the local processor.
@@ -26,7 +28,64 @@ particle_alloc_memory(int MaxPart)
      * seems to be to do with how the struct is padded and
      * the missing holes being accessed by __kmp_atomic functions.
      * (memory lock etc?)
+     *
+     * Each thread zeroes the particles a static loop over the particles would give it,
+     * as in drift_all_particles and the treewalk queues, so P is placed on its NUMA node.
      * */
-    memset(P, 0, sizeof(struct particle_data) * MaxPart);
+    mymalloc_first_touch(P, sizeof(struct particle_data) * MaxPart);
     message(0, "Allocated %g MByte for particle storage.\n", bytes / (1024.0 * 1024.0));
 }
+
+int
+particle_reserve_memory(struct part_manager_type * pman, struct slots_manager_type * sman, const double freefrac)
+{
+    if(pman->MaxPart - pman->NumPart >= freefrac * pman->NumPart)
+        return 0;
+
+    const int64_t MaxPart = pman->NumPart * (1 + 2 * freefrac) + 1;
+    if(MaxPart > INT_MAX)
+        return ALLOC_ENOMEMORY;
+    void * base = pman->Base;
+    void * slots = sman->Base;
+    int ret = allocator_realloc_under(A_MAIN, &base, MaxPart * sizeof(struct particle_data), slots ? &slots : NULL);
+    if(ret != 0) {
+        message(1, "Could not grow the particle table from %d to %ld: %s.\n", pman->MaxPart, MaxPart,
+                ret == ALLOC_ENOMEMORY ? "not enough memory" : "other memory is allocated after it");
+        return ret;
+    }
+    /* The slot arrays moved with their base*/
+    if(slots) {
+        int ptype;
+        for(ptype = 0; ptype < 6; ptype++)
+            sman->info[ptype].ptr = sman->info[ptype].ptr - sman->Base + (char *) slots;
+        sman->Base = slots;
+    }
+    pman->Base = base;
+    /* As in particle_alloc_memory*/
+    mymalloc_first_touch(pman->Base + pman->MaxPart, (MaxPart - pman->MaxPart) * sizeof(struct particle_data));
+    message(1, "Grew the particle table from %d to %ld particles.\n", pman->MaxPart, MaxPart);
+    pman->MaxPart = MaxPart;
+    return 0;
+}
+
+void
+particle_gravcopy_build(void)
+{
+    int i;
+    PartManager->GravCopy = (struct particle_gravcopy *) mymalloc("GravCopy", PartManager->NumPart * sizeof(struct particle_gravcopy));
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int k;
+        for(k = 0; k < 3; k++)
+            PartManager->GravCopy[i].Pos[k] = P[i].Pos[k];
+        PartManager->GravCopy[i].Mass = P[i].Mass;
+        PartManager->GravCopy[i].Soft = FORCE_SOFTENING(i);
+    }
+}
+
+void
+particle_gravcopy_free(void)
+{
+    myfree(PartManager->GravCopy);
+    PartManager->GravCopy = NULL;
+}
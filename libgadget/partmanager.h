@@ -13,6 +13,7 @@ struct particle_data
 
     inttime_t Ti_drift;       /*!< current time of the particle position */
     inttime_t Ti_kick;        /*!< current time of the particle momentum */
+    float WalkTime;     /*!< wall time in seconds spent in tree walks for this particle on its last active step */
 
     double Pos[3];   /*!< particle position at its current time */
     float Mass;     /*!< particle mass */
@@ -25,16 +26,20 @@ struct particle_data
         unsigned int DensityIterationDone :1; /* True if the density-like iterations already finished; */
         unsigned int Swallowed            :1; /* True if the particle is being swallowed; used in BH to determine swallower and swallowee;*/
         unsigned int HeIIIionized         :1; /*True if the particle has undergone helium reionization*/
+        unsigned int InZoom               :1; /* True if the particle was inside the zoom PM region on the last PM step. Only by gravpm.c and gravshort-tree.c */
+        unsigned int InDeltaBase          :1; /* True if the particle is in the last full snapshot with its current type, so delta snapshots may omit its constant blocks. See petaio.c */
         unsigned char Generation; /* How many particles it has spawned; used to generate unique particle ID.
                                      may wrap around with too many SFR/BH if a feedback model goes rogue */
 
         signed char TimeBin; /* Time step bin; -1 for unassigned.*/
-        /* To ensure alignment to a 32-bit boundary.*/
-        char spare_1;
+        /* The ten bits above, Generation and TimeBin fill a 32-bit word.*/
     };
 
     int PI; /* particle property index; used by BH, SPH and STAR.
                         points to the corresponding structure in (SPH|BH|STAR)P array.*/
+    /* Hash of the FOF group label of the particle at the last FOF call. Only a hint, used by fof.c
+     * to seed the next call: any value is safe. Fills the padding before ID.*/
+    unsigned int FOFHint;
     MyIDType ID;
 
     MyFloat Vel[3];   /* particle velocity at its current time */
@@ -63,8 +68,20 @@ struct particle_data
 
 };
 
+/* A compact copy of the particle fields read in the particle leaf loop of the
+ * gravity tree walk. Two of these fit in a 64 byte cache line, where a
+ * particle_data spans two or more lines.*/
+struct particle_gravcopy
+{
+    double Pos[3];
+    float Mass;
+    float Soft; /* FORCE_SOFTENING of the particle */
+};
+
 extern struct part_manager_type {
     struct particle_data *Base; /* Pointer to particle data on local processor. */
+    /* Copy of the gravity fields for each particle, if particle_gravcopy_build was called. NULL otherwise.*/
+    struct particle_gravcopy *GravCopy;
     /*!< number of particles on the LOCAL processor: number of valid entries in P array. */
     int NumPart;
     /*!< Amount of memory we have available for particles locally: maximum size of P array. */
@@ -77,6 +94,13 @@ extern struct part_manager_type {
 /*Allocate memory for the particles*/
 void particle_alloc_memory(int MaxPart);
 
+struct slots_manager_type;
+/* Grow the particle table so that at least a fraction freefrac of NumPart is free, to twice that.
+ * The table grows in place, moving the slots up in memory, so they must be the only memory
+ * allocated after the particles, as after a domain exchange. Not collective.
+ * Returns 0 if the table is large enough or has grown, non-zero if it could not grow.*/
+int particle_reserve_memory(struct part_manager_type * pman, struct slots_manager_type * sman, const double freefrac);
+
 extern double GravitySofteningTable[6];
 
 static inline double FORCE_SOFTENING(int i)
@@ -89,6 +113,11 @@ static inline double FORCE_SOFTENING(int i)
     }
 }
 
+/* Allocate and fill PartManager->GravCopy from the current particle table.
+ * The copy is not updated when P changes, so it should be freed once the tree walk is done.*/
+void particle_gravcopy_build(void);
+void particle_gravcopy_free(void);
+
 /* Finds the correct relative position accounting for periodicity*/
 #define NEAREST(x, BoxSize) (((x)>0.5*BoxSize)?((x)-BoxSize):(((x)<-0.5*BoxSize)?((x)+BoxSize):(x)))
 
@@ -5,6 +5,11 @@
 #include <math.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <bigfile-mpi.h>
 
@@ -30,9 +35,42 @@
 
 static void petaio_write_header(BigFile * bf, const int64_t * NTotal);
 static void petaio_read_header_internal(BigFile * bf);
+static void petaio_set_particle_totals(const int64_t * NTotal);
+static int petaio_block_nfiles(size_t size, int elsize, int * NumWriters);
+static void petaio_compress_buffer(BigArray * array, const IOTableEntry * ent, double * step, char * blockname, int verbose);
+static void petaio_save_block_quantized(BigFile * bf, char * blockname, BigArray * array, double QuantizeStep, int verbose);
+static int petaio_read_domain_counts(BigFile * bf, const int64_t * NTotal, int * NLocal, MPI_Comm Comm);
+static int petaio_build_view(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager);
+static void petaio_peano_order(BigFile * bf, int * selection, const int * ptype_offset, const int * ptype_count);
+static int petaio_delta_selection(const int * selection, const int NumSelection, int * deltasel);
+static void petaio_write_delta_header(BigFile * bf);
+static int64_t petaio_block_size(BigFile * bf, char * blockname, MPI_Comm Comm);
+static void petaio_read_delta(BigFile * bf, const int DeltaBase, struct IOTable * IOTable, const int64_t * NTotal, const int * NLocal, MPI_Comm Comm);
+static int petaio_read_block_comm(BigFile * bf, char * blockname, BigArray * array, int required, MPI_Comm comm);
+
+/* The last full snapshot, which delta snapshots refer to, or -1 if there is none*/
+static int DeltaBaseNum = -1;
+
+/* Groups of consecutive ranks shipping their data to an I/O aggregator, the first rank of each group.
+ * IOLeaders holds the aggregators, and is MPI_COMM_NULL on the other ranks.
+ * Both are MPI_COMM_NULL if aggregation is disabled.*/
+static MPI_Comm IOGroup = MPI_COMM_NULL;
+static MPI_Comm IOLeaders = MPI_COMM_NULL;
 
 /* these are only used in reading in */
 void petaio_init(void) {
+    if(All.IO.AggregatorGroupSize > 1 && IOGroup == MPI_COMM_NULL) {
+        int ThisTask, NTask;
+        MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+        MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+        /* Consecutive ranks keep the particle order within each block*/
+        MPI_Comm_split(MPI_COMM_WORLD, ThisTask / All.IO.AggregatorGroupSize, ThisTask, &IOGroup);
+        int GroupRank;
+        MPI_Comm_rank(IOGroup, &GroupRank);
+        MPI_Comm_split(MPI_COMM_WORLD, GroupRank == 0 ? 0 : MPI_UNDEFINED, ThisTask, &IOLeaders);
+        message(0, "IO is done by %d aggregator ranks, each serving %d ranks.\n",
+                (NTask + All.IO.AggregatorGroupSize - 1) / All.IO.AggregatorGroupSize, All.IO.AggregatorGroupSize);
+    }
     /* Smaller files will do aggregated IO.*/
     if(All.IO.EnableAggregatedIO) {
         message(0, "Aggregated IO is enabled\n");
@@ -128,6 +166,14 @@ static void petaio_save_internal(char * fname, struct IOTable * IOTable, int ver
 
     petaio_write_header(&bf, NTotal);
 
+    if(IOTable->Delta)
+        petaio_write_delta_header(&bf);
+
+    if(All.IO.PeanoOrder)
+        petaio_peano_order(&bf, selection, ptype_offset, ptype_count);
+
+    int * deltasel = IOTable->Delta ? mymalloc("DeltaSelection", sizeof(int) * PartManager->NumPart) : NULL;
+
     int i;
     for(i = 0; i < IOTable->used; i ++) {
         /* only process the particle blocks */
@@ -139,10 +185,24 @@ static void petaio_save_internal(char * fname, struct IOTable * IOTable, int ver
             continue;
         }
         sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
-        petaio_build_buffer(&array, &IOTable->ent[i], selection + ptype_offset[ptype], ptype_count[ptype], P, SlotsManager);
-        petaio_save_block(&bf, blockname, &array, verbose);
-        petaio_destroy_buffer(&array);
+        const int * sel = selection + ptype_offset[ptype];
+        int nsel = ptype_count[ptype];
+        if(deltasel && IOTable->ent[i].constant) {
+            nsel = petaio_delta_selection(sel, nsel, deltasel);
+            sel = deltasel;
+        }
+        /* Write plain fields straight from the particles if we can*/
+        const int direct = petaio_build_view(&array, &IOTable->ent[i], sel, nsel, P, SlotsManager);
+        if(!direct)
+            petaio_build_buffer(&array, &IOTable->ent[i], sel, nsel, P, SlotsManager);
+        double QuantizeStep;
+        petaio_compress_buffer(&array, &IOTable->ent[i], &QuantizeStep, blockname, verbose);
+        petaio_save_block_quantized(&bf, blockname, &array, QuantizeStep, verbose);
+        if(!direct)
+            petaio_destroy_buffer(&array);
     }
+    if(deltasel)
+        myfree(deltasel);
 
     if(All.MassiveNuLinRespOn) {
         int ThisTask;
@@ -157,46 +217,750 @@ static void petaio_save_internal(char * fname, struct IOTable * IOTable, int ver
     myfree(selection);
 }
 
-void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Comm Comm) {
+/* Snapshots written in Peano order have an index of the rows of each particle type by coarse Peano cell.
+ * The cell of a particle is its key shifted right by PeanoKeyIndexShift, a Header attribute,
+ * so there are 2^(3 PETAIO_KEY_INDEX_LEVEL) cells, each a cube of side BoxSize / 2^PETAIO_KEY_INDEX_LEVEL.*/
+#ifndef PETAIO_KEY_INDEX_LEVEL
+#define PETAIO_KEY_INDEX_LEVEL 6
+#endif
+#define PETAIO_KEY_INDEX_SHIFT (3 * (BITS_PER_DIMENSION - PETAIO_KEY_INDEX_LEVEL))
+
+/* Keys of the particles, for sorting the selection*/
+static peano_t * SelectionKeys;
+
+static int
+petaio_order_by_key(const void * a, const void * b)
+{
+    const int i = *(const int *) a, j = *(const int *) b;
+    if(SelectionKeys[i] != SelectionKeys[j])
+        return SelectionKeys[i] < SelectionKeys[j] ? -1 : 1;
+    return (i > j) - (i < j);
+}
+
+/* Sort the selection of each type by Peano key and write the PeanoKeyIndex block of each type.
+ * Each rank writes a contiguous range of rows, so a block is sorted within the rows of each rank.
+ * The index has a row of (cell, first row, number of rows) for each run of rows in one cell.
+ * The keys are computed from the current positions, as the reader computes the cells of a sub-volume.*/
+static void
+petaio_peano_order(BigFile * bf, int * selection, const int * ptype_offset, const int * ptype_count)
+{
+    SelectionKeys = mymalloc("SelectionKeys", sizeof(peano_t) * PartManager->NumPart);
+    peano_hilbert_keys(&P[0].Pos[0], sizeof(struct particle_data), SelectionKeys, sizeof(peano_t), PartManager->NumPart, All.BoxSize);
+
     int ptype;
-    int i;
-    BigFile bf = {0};
+    for(ptype = 0; ptype < 6; ptype++) {
+        int * sel = selection + ptype_offset[ptype];
+        const int n = ptype_count[ptype];
+        qsort_openmp(sel, n, sizeof(int), petaio_order_by_key);
+
+        int64_t offset = 0, nlocal = n;
+        MPI_Exscan(&nlocal, &offset, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        int ThisTask;
+        MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+        if(ThisTask == 0)
+            offset = 0;
+
+        int64_t (*rows)[3] = mymalloc("PeanoKeyIndex", sizeof(rows[0]) * (n + 1));
+        int64_t nrows = 0;
+        int i;
+        for(i = 0; i < n; i++) {
+            const int64_t cell = SelectionKeys[sel[i]] >> PETAIO_KEY_INDEX_SHIFT;
+            if(nrows == 0 || rows[nrows-1][0] != cell) {
+                rows[nrows][0] = cell;
+                rows[nrows][1] = offset + i;
+                rows[nrows][2] = 0;
+                nrows++;
+            }
+            rows[nrows-1][2]++;
+        }
+        BigArray array = {0};
+        size_t dims[2] = {nrows, 3};
+        ptrdiff_t strides[2] = {sizeof(rows[0]), sizeof(int64_t)};
+        big_array_init(&array, rows, "=i8", 2, dims, strides);
+        char blockname[128];
+        snprintf(blockname, sizeof(blockname), "%d/PeanoKeyIndex", ptype);
+        petaio_save_block(bf, blockname, &array, 0);
+        myfree(rows);
+    }
+    myfree(SelectionKeys);
+}
+
+/* Mark the index rows of the cells in cellmask, a bit per cell, and merge them into ranges of rows.*/
+static int64_t
+petaio_key_index_select(BigFile * bf, int ptype, const uint64_t * cellmask, int64_t ** ranges)
+{
+    char blockname[128];
+    snprintf(blockname, sizeof(blockname), "%d/PeanoKeyIndex", ptype);
+    BigBlock bb;
+    if(0 != big_file_open_block(bf, &bb, blockname))
+        return -1;
+    const int64_t nrows = bb.size;
+    int64_t (*rows)[3] = mymalloc("PeanoKeyIndex", sizeof(rows[0]) * (nrows + 1));
+    BigArray array = {0};
+    size_t dims[2] = {nrows, 3};
+    ptrdiff_t strides[2] = {sizeof(rows[0]), sizeof(int64_t)};
+    big_array_init(&array, rows, "=i8", 2, dims, strides);
+    BigBlockPtr ptr;
+    if(nrows > 0 && (0 != big_block_seek(&bb, &ptr, 0) || 0 != big_block_read(&bb, &ptr, &array)))
+        endrun(1, "Failed to read %s: %s\n", blockname, big_file_get_error_message());
+    big_block_close(&bb);
+
+    /* The ranges are returned in the memory of the index, which is at least as large*/
+    int64_t * range = (int64_t *) rows;
+    int64_t i, nranges = 0;
+    for(i = 0; i < nrows; i++) {
+        const int64_t cell = rows[i][0], start = rows[i][1], end = rows[i][1] + rows[i][2];
+        if(!(cellmask[cell / 64] & (1ull << (cell % 64))))
+            continue;
+        if(nranges > 0 && range[2 * nranges - 1] == start)
+            range[2 * nranges - 1] = end;
+        else {
+            range[2 * nranges] = start;
+            range[2 * nranges + 1] = end;
+            nranges++;
+        }
+    }
+    *ranges = range;
+    return nranges;
+}
+
+/* Transform a position to the coordinate of its coarse cell, as PEANO does*/
+static int
+petaio_key_index_coord(double x, double BoxSize)
+{
+    const double DomainFac = 1.0 / (BoxSize*1.001) * (((peano_t) 1) << (BITS_PER_DIMENSION));
+    int64_t ix = (x + BoxSize/2000) * DomainFac;
+    ix >>= BITS_PER_DIMENSION - PETAIO_KEY_INDEX_LEVEL;
+    if(ix < 0)
+        return 0;
+    if(ix >= (1 << PETAIO_KEY_INDEX_LEVEL))
+        return (1 << PETAIO_KEY_INDEX_LEVEL) - 1;
+    return ix;
+}
+
+/* Check the snapshot has an index at our level, and allocate the mask of wanted cells*/
+static uint64_t *
+petaio_key_index_mask(BigFile * bf, double * BoxSize)
+{
     BigBlock bh;
-    message(0, "Reading snapshot %s\n", fname);
+    if(0 != big_file_open_block(bf, &bh, "Header"))
+        endrun(1, "Failed to open Header: %s\n", big_file_get_error_message());
+    int shift = -1;
+    const int failed = big_block_get_attr(&bh, "PeanoKeyIndexShift", &shift, "i4", 1)
+        || big_block_get_attr(&bh, "BoxSize", BoxSize, "f8", 1);
+    big_block_close(&bh);
+    if(failed || shift != PETAIO_KEY_INDEX_SHIFT)
+        return NULL;
+    const int64_t nwords = (PEANOCELLS >> PETAIO_KEY_INDEX_SHIFT) / 64 + 1;
+    uint64_t * cellmask = mymalloc("CellMask", nwords * sizeof(uint64_t));
+    memset(cellmask, 0, nwords * sizeof(uint64_t));
+    return cellmask;
+}
 
-    if(0 != big_file_mpi_open(&bf, fname, Comm)) {
-        endrun(0, "Failed to open snapshot at %s:%s\n", fname,
+int64_t
+petaio_key_index_box(BigFile * bf, int ptype, const double * lo, const double * hi, int64_t ** ranges)
+{
+    double BoxSize;
+    uint64_t * cellmask = petaio_key_index_mask(bf, &BoxSize);
+    if(!cellmask)
+        return -1;
+    int start[3], end[3], k;
+    for(k = 0; k < 3; k++) {
+        start[k] = petaio_key_index_coord(lo[k], BoxSize);
+        end[k] = petaio_key_index_coord(hi[k], BoxSize);
+    }
+    int x, y, z;
+    for(x = start[0]; x <= end[0]; x++)
+        for(y = start[1]; y <= end[1]; y++)
+            for(z = start[2]; z <= end[2]; z++) {
+                /* The top bits of a key are the key of the coarse cell*/
+                const peano_t cell = peano_hilbert_key(x, y, z, PETAIO_KEY_INDEX_LEVEL);
+                cellmask[cell / 64] |= 1ull << (cell % 64);
+            }
+    int64_t * range;
+    const int64_t nranges = petaio_key_index_select(bf, ptype, cellmask, &range);
+    myfree(cellmask);
+    *ranges = range;
+    return nranges;
+}
+
+int64_t
+petaio_key_index_keys(BigFile * bf, int ptype, const peano_t StartKey, const peano_t EndKey, int64_t ** ranges)
+{
+    double BoxSize;
+    uint64_t * cellmask = petaio_key_index_mask(bf, &BoxSize);
+    if(!cellmask)
+        return -1;
+    peano_t cell;
+    for(cell = StartKey >> PETAIO_KEY_INDEX_SHIFT; EndKey > StartKey && cell <= (EndKey - 1) >> PETAIO_KEY_INDEX_SHIFT; cell++)
+        cellmask[cell / 64] |= 1ull << (cell % 64);
+    int64_t * range;
+    const int64_t nranges = petaio_key_index_select(bf, ptype, cellmask, &range);
+    myfree(cellmask);
+    *ranges = range;
+    return nranges;
+}
+
+int64_t
+petaio_read_block_ranges(BigFile * bf, char * blockname, const int64_t * ranges, const int64_t nranges, BigArray * array)
+{
+    BigBlock bb;
+    if(0 != big_file_open_block(bf, &bb, blockname))
+        endrun(1, "Failed to open block %s: %s\n", blockname, big_file_get_error_message());
+    int64_t i, nrows = 0;
+    for(i = 0; i < nranges; i++)
+        nrows += ranges[2 * i + 1] - ranges[2 * i];
+    const size_t itemsize = big_file_dtype_itemsize(bb.dtype);
+    char * data = mymalloc("BlockRanges", nrows * itemsize * bb.nmemb + 1);
+    size_t dims[2] = {nrows, bb.nmemb};
+    ptrdiff_t strides[2] = {itemsize * bb.nmemb, itemsize};
+    big_array_init(array, data, bb.dtype, 2, dims, strides);
+
+    int64_t row = 0;
+    for(i = 0; i < nranges; i++) {
+        BigArray part = {0};
+        size_t pdims[2] = {ranges[2 * i + 1] - ranges[2 * i], bb.nmemb};
+        big_array_init(&part, data + row * strides[0], bb.dtype, 2, pdims, strides);
+        BigBlockPtr ptr;
+        if(0 != big_block_seek(&bb, &ptr, ranges[2 * i]) || 0 != big_block_read(&bb, &ptr, &part))
+            endrun(1, "Failed to read rows %ld to %ld of %s: %s\n", ranges[2 * i], ranges[2 * i + 1], blockname, big_file_get_error_message());
+        row += pdims[0];
+    }
+    big_block_close(&bb);
+    return nrows;
+}
+
+/* A block of an asynchronous snapshot, copied to staging memory*/
+struct AsyncBlock {
+    char name[128];
+    BigBlock bb;
+    BigBlockPtr ptr;
+    BigArray array;
+};
+
+/* State of the snapshot being written by the helper thread.
+ * Only the helper thread touches the blocks between petaio_save_snapshot_async
+ * and the join in petaio_async_wait; it makes no MPI calls.*/
+static struct {
+    int Pending;
+    pthread_t Thread;
+    BigFile bf;
+    char * fname;
+    struct AsyncBlock * Blocks;
+    int NBlock;
+    /* Index of the block that failed to write, or -1*/
+    int Failed;
+    char ErrorMessage[512];
+    /* Staging memory is outside the main arena, which must stay LIFO while the run continues*/
+    Allocator Stage[1];
+} AsyncIO;
+
+static void *
+petaio_async_writer(void * unused)
+{
+    int i;
+    for(i = 0; i < AsyncIO.NBlock; i ++) {
+        struct AsyncBlock * blk = &AsyncIO.Blocks[i];
+        if(blk->array.dims[0] == 0)
+            continue;
+        /* Each rank writes its own contiguous range of the block*/
+        if(0 != big_block_write(&blk->bb, &blk->ptr, &blk->array)) {
+            AsyncIO.Failed = i;
+            strncpy(AsyncIO.ErrorMessage, big_file_get_error_message(), sizeof(AsyncIO.ErrorMessage) - 1);
+            break;
+        }
+    }
+    return NULL;
+}
+
+void
+petaio_save_snapshot_async(struct IOTable * IOTable, int verbose, const char *fmt, ...)
+{
+    /* Only one snapshot is staged at a time*/
+    petaio_async_wait();
+
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    va_list va;
+    va_start(va, fmt);
+    char * fname = fastpm_strdup_vprintf(fmt, va);
+    va_end(va);
+    message(0, "saving snapshot into %s in the background\n", fname);
+
+    if(0 != allocator_malloc_init(AsyncIO.Stage, "IOSTAGE", 0, 0, NULL))
+        endrun(1, "Failed to initialise staging memory for %s\n", fname);
+
+    AsyncIO.fname = allocator_alloc_bot(AsyncIO.Stage, "fname", strlen(fname) + 1);
+    strcpy(AsyncIO.fname, fname);
+    myfree(fname);
+
+    AsyncIO.Blocks = allocator_alloc_bot(AsyncIO.Stage, "AsyncBlocks", sizeof(struct AsyncBlock) * (IOTable->used + 1));
+    AsyncIO.NBlock = 0;
+    AsyncIO.Failed = -1;
+
+    memset(&AsyncIO.bf, 0, sizeof(AsyncIO.bf));
+    if(0 != big_file_mpi_create(&AsyncIO.bf, AsyncIO.fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to create snapshot at %s:%s\n", AsyncIO.fname,
                     big_file_get_error_message());
     }
 
-    int64_t NTotal[6];
-    if(0 != big_file_mpi_open_block(&bf, &bh, "Header", Comm)) {
-        endrun(0, "Failed to create block at %s:%s\n", "Header",
+    int ptype_offset[6]={0};
+    int ptype_count[6]={0};
+    int64_t NTotal[6]={0};
+
+    int * selection = mymalloc("Selection", sizeof(int) * PartManager->NumPart);
+
+    petaio_build_selection(selection, ptype_offset, ptype_count, P, PartManager->NumPart, NULL);
+
+    sumup_large_ints(6, ptype_count, NTotal);
+
+    petaio_write_header(&AsyncIO.bf, NTotal);
+    if(IOTable->Delta)
+        petaio_write_delta_header(&AsyncIO.bf);
+
+    /* The index is small and written now*/
+    if(All.IO.PeanoOrder)
+        petaio_peano_order(&AsyncIO.bf, selection, ptype_offset, ptype_count);
+
+    int * deltasel = IOTable->Delta ? mymalloc("DeltaSelection", sizeof(int) * PartManager->NumPart) : NULL;
+
+    int i;
+    for(i = 0; i < IOTable->used; i ++) {
+        int ptype = IOTable->ent[i].ptype;
+        BigArray array = {0};
+        /*This exclude FOF blocks*/
+        if(!(ptype < 6 && ptype >= 0)) {
+            continue;
+        }
+        struct AsyncBlock * blk = &AsyncIO.Blocks[AsyncIO.NBlock++];
+        sprintf(blk->name, "%d/%s", ptype, IOTable->ent[i].name);
+        const int * sel = selection + ptype_offset[ptype];
+        int nsel = ptype_count[ptype];
+        if(deltasel && IOTable->ent[i].constant) {
+            nsel = petaio_delta_selection(sel, nsel, deltasel);
+            sel = deltasel;
+        }
+        petaio_build_buffer(&array, &IOTable->ent[i], sel, nsel, P, SlotsManager);
+        double QuantizeStep;
+        petaio_compress_buffer(&array, &IOTable->ent[i], &QuantizeStep, blk->name, verbose);
+
+        /* Copy to the staging memory, so the particles may change while it is written*/
+        const size_t nbytes = array.dims[0] * array.strides[0];
+        char * data = allocator_alloc_bot(AsyncIO.Stage, blk->name, nbytes);
+        memcpy(data, array.data, nbytes);
+        size_t dims[2] = {array.dims[0], array.dims[1]};
+        big_array_init(&blk->array, data, array.dtype, 2, dims, array.strides);
+        petaio_destroy_buffer(&array);
+
+        int NumWriters;
+        size_t size = count_sum(dims[0]);
+        int NumFiles = petaio_block_nfiles(size, big_file_dtype_itemsize(blk->array.dtype), &NumWriters);
+        if(verbose && size > 0) {
+            message(0, "Will write %td particles to %d Files for %s\n", size, NumFiles, blk->name);
+        }
+        if(0 != big_file_mpi_create_block(&AsyncIO.bf, &blk->bb, blk->name, blk->array.dtype, dims[1], NumFiles, size, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to create block at %s:%s\n", blk->name,
+                        big_file_get_error_message());
+        }
+        if(QuantizeStep > 0 && 0 != big_block_set_attr(&blk->bb, "QuantizeStep", &QuantizeStep, "f8", 1)) {
+            endrun(0, "Failed to write attributes %s\n", big_file_get_error_message());
+        }
+        int64_t offset = 0;
+        int64_t nlocal = dims[0];
+        MPI_Exscan(&nlocal, &offset, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        if(ThisTask == 0)
+            offset = 0;
+        if(0 != big_block_seek(&blk->bb, &blk->ptr, offset)) {
+            endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+        }
+    }
+    if(deltasel)
+        myfree(deltasel);
+    myfree(selection);
+
+    /* The neutrino tables are small and written now*/
+    if(All.MassiveNuLinRespOn) {
+        petaio_save_neutrinos(&AsyncIO.bf, ThisTask);
+    }
+
+    AsyncIO.Pending = 1;
+    if(0 != pthread_create(&AsyncIO.Thread, NULL, petaio_async_writer, NULL)) {
+        message(1, "Could not start the snapshot writer thread; writing %s now.\n", AsyncIO.fname);
+        petaio_async_writer(NULL);
+        AsyncIO.Pending = 2;
+    }
+}
+
+int
+petaio_async_wait(void)
+{
+    if(!AsyncIO.Pending)
+        return 0;
+
+    if(AsyncIO.Pending == 1)
+        pthread_join(AsyncIO.Thread, NULL);
+    AsyncIO.Pending = 0;
+
+    if(AsyncIO.Failed >= 0) {
+        endrun(1, "Failed to write block %s of %s: %s\n", AsyncIO.Blocks[AsyncIO.Failed].name,
+                AsyncIO.fname, AsyncIO.ErrorMessage);
+    }
+
+    /* Closing reduces the checksums of each block, so is collective*/
+    int i;
+    for(i = 0; i < AsyncIO.NBlock; i ++) {
+        if(0 != big_block_mpi_close(&AsyncIO.Blocks[i].bb, MPI_COMM_WORLD)) {
+            endrun(0, "Failed to close block at %s:%s\n", AsyncIO.Blocks[i].name,
                     big_file_get_error_message());
+        }
     }
-    if ((0 != big_block_get_attr(&bh, "TotNumPart", NTotal, "u8", 6)) ||
-        (0 != big_block_mpi_close(&bh, Comm))) {
-        endrun(0, "Failed to close block: %s\n",
+    if(0 != big_file_mpi_close(&AsyncIO.bf, MPI_COMM_WORLD)){
+        endrun(0, "Failed to close snapshot at %s:%s\n", AsyncIO.fname,
                     big_file_get_error_message());
     }
+    message(0, "Finished writing snapshot %s\n", AsyncIO.fname);
+
+    for(i = AsyncIO.NBlock - 1; i >= 0; i --)
+        allocator_free(AsyncIO.Blocks[i].array.data);
+    allocator_free(AsyncIO.Blocks);
+    allocator_free(AsyncIO.fname);
+    allocator_destroy(AsyncIO.Stage);
+    return 1;
+}
+
+/* Size of the buffer each rank copies snapshot files through*/
+#ifndef PETAIO_DRAIN_BUFFER
+#define PETAIO_DRAIN_BUFFER (8L*1024*1024)
+#endif
+
+/* State of the copy of a local snapshot to its final location.
+ * The files are shared out round robin over the ranks; the helper thread of each
+ * rank copies its share and makes no MPI calls.*/
+static struct {
+    int Pending;
+    pthread_t Thread;
+    char * src;
+    char * dst;
+    /* Paths of the files relative to src, each terminated by a NUL*/
+    char * files;
+    size_t nfilebytes;
+    char * buffer;
+    int ThisTask;
+    int NTask;
+    /* Bytes copied by this rank*/
+    double copied;
+    int Failed;
+    char ErrorMessage[512];
+    /* The list and buffer are outside the main arena, which must stay LIFO while the run continues*/
+    Allocator Stage[1];
+} Drain;
+
+/* Append the files below src/rel to the list and make the matching directories below dst.
+ * Only called on the first rank, before the helper threads start. Returns 0 on success.*/
+static int
+petaio_drain_scan(const char * rel, size_t * allocated)
+{
+    char * srcdir = fastpm_strdup_printf("%s%s", Drain.src, rel);
+    char * dstdir = fastpm_strdup_printf("%s%s", Drain.dst, rel);
+    int ret = 0;
+    if(mkdir(dstdir, S_IRWXU | S_IRWXG | S_IRWXO) != 0 && errno != EEXIST) {
+        snprintf(Drain.ErrorMessage, sizeof(Drain.ErrorMessage), "mkdir %s: %s", dstdir, strerror(errno));
+        ret = 1;
+    }
+    DIR * dir = ret ? NULL : opendir(srcdir);
+    if(!ret && !dir) {
+        snprintf(Drain.ErrorMessage, sizeof(Drain.ErrorMessage), "opendir %s: %s", srcdir, strerror(errno));
+        ret = 1;
+    }
+    struct dirent * ent;
+    while(dir && !ret && (ent = readdir(dir))) {
+        if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        char * path = fastpm_strdup_printf("%s/%s", rel, ent->d_name);
+        char * full = fastpm_strdup_printf("%s%s", Drain.src, path);
+        struct stat st;
+        if(stat(full, &st) != 0) {
+            snprintf(Drain.ErrorMessage, sizeof(Drain.ErrorMessage), "stat %s: %s", full, strerror(errno));
+            ret = 1;
+        }
+        myfree(full);
+        if(!ret && S_ISDIR(st.st_mode))
+            ret = petaio_drain_scan(path, allocated);
+        else if(!ret) {
+            const size_t len = strlen(path) + 1;
+            while(Drain.nfilebytes + len > *allocated) {
+                *allocated *= 2;
+                Drain.files = allocator_realloc(Drain.Stage, Drain.files, *allocated);
+            }
+            memcpy(Drain.files + Drain.nfilebytes, path, len);
+            Drain.nfilebytes += len;
+        }
+        myfree(path);
+    }
+    if(dir)
+        closedir(dir);
+    myfree(dstdir);
+    myfree(srcdir);
+    return ret;
+}
 
+static void *
+petaio_drain_writer(void * unused)
+{
+    size_t off;
+    int i = 0;
+    char srcname[4096], dstname[4096];
+    for(off = 0; off < Drain.nfilebytes; off += strlen(Drain.files + off) + 1, i++) {
+        if(i % Drain.NTask != Drain.ThisTask)
+            continue;
+        snprintf(srcname, sizeof(srcname), "%s%s", Drain.src, Drain.files + off);
+        snprintf(dstname, sizeof(dstname), "%s%s", Drain.dst, Drain.files + off);
+        FILE * in = fopen(srcname, "r");
+        FILE * out = in ? fopen(dstname, "w") : NULL;
+        size_t n = 1;
+        while(out && n > 0) {
+            n = fread(Drain.buffer, 1, PETAIO_DRAIN_BUFFER, in);
+            if(n > 0 && fwrite(Drain.buffer, 1, n, out) != n)
+                break;
+            Drain.copied += n;
+        }
+        const int failed = !out || ferror(in) || ferror(out);
+        if(failed)
+            snprintf(Drain.ErrorMessage, sizeof(Drain.ErrorMessage), "copying %s to %s: %s", srcname, dstname, strerror(errno));
+        if(in)
+            fclose(in);
+        if(out && fclose(out) != 0 && !failed) {
+            snprintf(Drain.ErrorMessage, sizeof(Drain.ErrorMessage), "closing %s: %s", dstname, strerror(errno));
+            Drain.Failed = 1;
+        }
+        if(failed) {
+            Drain.Failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+void
+petaio_drain_start(const char * src, const char * dst)
+{
+    /* Only one snapshot is drained at a time*/
+    petaio_drain_wait();
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &Drain.ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &Drain.NTask);
+
+    /* The local copy is complete: the snapshot was closed collectively*/
+    if(Drain.ThisTask == 0) {
+        char * marker = fastpm_strdup_printf("%s.complete", src);
+        FILE * fd = fopen(marker, "w");
+        if(!fd)
+            message(1, "Could not mark %s as complete: %s\n", src, strerror(errno));
+        else
+            fclose(fd);
+        myfree(marker);
+    }
+    message(0, "copying snapshot %s to %s in the background\n", src, dst);
+
+    if(0 != allocator_malloc_init(Drain.Stage, "DRAIN", 0, 0, NULL))
+        endrun(1, "Failed to initialise memory to copy %s\n", src);
+
+    Drain.src = allocator_alloc_bot(Drain.Stage, "src", strlen(src) + 1);
+    strcpy(Drain.src, src);
+    Drain.dst = allocator_alloc_bot(Drain.Stage, "dst", strlen(dst) + 1);
+    strcpy(Drain.dst, dst);
+    Drain.Failed = 0;
+    Drain.copied = 0;
+
+    /* The first rank lists the files and makes the directories, so the threads only copy files*/
+    size_t allocated = 4096;
+    Drain.files = allocator_alloc_bot(Drain.Stage, "files", allocated);
+    Drain.nfilebytes = 0;
+    int failed = 0;
+    if(Drain.ThisTask == 0) {
+        fastpm_path_ensure_dirname(dst);
+        failed = petaio_drain_scan("", &allocated);
+    }
+    MPI_Bcast(&failed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(failed)
+        endrun(1, "Failed to list %s for copying: %s\n", src, Drain.ErrorMessage);
+    MPI_Bcast(&Drain.nfilebytes, sizeof(Drain.nfilebytes), MPI_BYTE, 0, MPI_COMM_WORLD);
+    if(Drain.nfilebytes > allocated)
+        Drain.files = allocator_realloc(Drain.Stage, Drain.files, Drain.nfilebytes);
+    MPI_Bcast(Drain.files, Drain.nfilebytes, MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    Drain.buffer = allocator_alloc_bot(Drain.Stage, "buffer", PETAIO_DRAIN_BUFFER);
+
+    Drain.Pending = 1;
+    if(0 != pthread_create(&Drain.Thread, NULL, petaio_drain_writer, NULL)) {
+        message(1, "Could not start the snapshot copy thread; copying %s now.\n", src);
+        petaio_drain_writer(NULL);
+        Drain.Pending = 2;
+    }
+}
+
+int
+petaio_drain_wait(void)
+{
+    if(!Drain.Pending)
+        return 0;
+
+    if(Drain.Pending == 1)
+        pthread_join(Drain.Thread, NULL);
+    Drain.Pending = 0;
+
+    if(Drain.Failed)
+        endrun(1, "Failed to copy snapshot %s to %s: %s\n", Drain.src, Drain.dst, Drain.ErrorMessage);
+
+    /* Every rank has finished its share before the copy is complete*/
+    MPI_Allreduce(MPI_IN_PLACE, &Drain.copied, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    message(0, "Finished copying snapshot %s to %s: %g MB\n", Drain.src, Drain.dst, Drain.copied / (1024. * 1024.));
+
+    allocator_free(Drain.buffer);
+    allocator_free(Drain.files);
+    allocator_free(Drain.dst);
+    allocator_free(Drain.src);
+    allocator_destroy(Drain.Stage);
+    return 1;
+}
+
+/* Name of snapshot num. It is the copy in LocalCheckpointDir if that was completely
+ * written, which is faster to read, and otherwise the one in OutputDir. Collective on Comm.*/
+static char *
+petaio_snapshot_fname(int num, MPI_Comm Comm)
+{
+    int local = 0;
+    int ThisTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    if(All.IO.LocalCheckpointDir[0] && ThisTask == 0) {
+        char * marker = fastpm_strdup_printf("%s/%s_%03d.complete", All.IO.LocalCheckpointDir, All.SnapshotFileBase, num);
+        struct stat st;
+        local = stat(marker, &st) == 0;
+        myfree(marker);
+    }
+    MPI_Bcast(&local, 1, MPI_INT, 0, Comm);
+    return fastpm_strdup_printf("%s/%s_%03d", local ? All.IO.LocalCheckpointDir : All.OutputDir, All.SnapshotFileBase, num);
+}
+
+/* A particle block being read by petaio_read_internal*/
+struct ReadAheadBlock {
+    char name[128];
+    IOTableEntry * ent;
+    BigBlock bb;
+    BigBlockPtr ptr;
+    BigArray array;
+    /* -1: the block is missing, 0: read with petaio_read_block,
+     * 1: being read by the helper thread, 2: already read.*/
+    int prefetch;
+    pthread_t Thread;
+    int failed;
+    char ErrorMessage[256];
+};
+
+/* Reads this rank's part of a block. Makes no MPI calls.*/
+static void *
+petaio_readahead_reader(void * data)
+{
+    struct ReadAheadBlock * blk = (struct ReadAheadBlock *) data;
+    if(blk->array.dims[0] > 0 && 0 != big_block_read(&blk->bb, &blk->ptr, &blk->array)) {
+        blk->failed = 1;
+        strncpy(blk->ErrorMessage, big_file_get_error_message(), sizeof(blk->ErrorMessage) - 1);
+    }
+    return NULL;
+}
+
+/* Allocate the buffer for a block and, if SnapshotReadAhead is set, start reading it in a helper thread.
+ * Every rank reads its own rows at once, so this is only done if NumWriters does not throttle
+ * the readers, and not for aggregated or quantized blocks.
+ * Buffers alternate between the two ends of the main allocator (top = 1 for the top end),
+ * so two blocks may be in flight and each is freed in the reverse order of allocation. Collective.*/
+static void
+petaio_readahead_start(BigFile * bf, struct ReadAheadBlock * blk, IOTableEntry * ent, int64_t nlocal, int top, MPI_Comm Comm)
+{
     int NTask, ThisTask;
     MPI_Comm_size(Comm, &NTask);
     MPI_Comm_rank(Comm, &ThisTask);
 
+    blk->ent = ent;
+    snprintf(blk->name, sizeof(blk->name), "%d/%s", ent->ptype, ent->name);
+    blk->prefetch = 0;
+    blk->failed = 0;
+    blk->ErrorMessage[0] = '\0';
+
+    const int elsize = dtype_itemsize(ent->dtype);
+    size_t dims[2] = {nlocal, ent->items};
+    ptrdiff_t strides[2] = {elsize * ent->items, elsize};
+    char * buffer = top ? mymalloc2("IOBUFFER", dims[0] * strides[0]) : mymalloc("IOBUFFER", dims[0] * strides[0]);
+    big_array_init(&blk->array, buffer, ent->dtype, 2, dims, strides);
+
+    if(!All.IO.ReadAhead || IOGroup != MPI_COMM_NULL || All.IO.NumWriters < NTask)
+        return;
+
+    if(0 != big_file_mpi_open_block(bf, &blk->bb, blk->name, Comm)) {
+        if(ent->required)
+            endrun(0, "Failed to open block at %s:%s\n", blk->name, big_file_get_error_message());
+        blk->prefetch = -1;
+        return;
+    }
+    double QuantizeStep = 0;
+    if(0 == big_block_get_attr(&blk->bb, "QuantizeStep", &QuantizeStep, "f8", 1) && QuantizeStep > 0) {
+        if(0 != big_block_mpi_close(&blk->bb, Comm))
+            endrun(0, "Failed to close block at %s:%s\n", blk->name, big_file_get_error_message());
+        return;
+    }
+    int64_t offset = 0;
+    MPI_Exscan(&nlocal, &offset, 1, MPI_INT64, MPI_SUM, Comm);
+    if(ThisTask == 0)
+        offset = 0;
+    if(0 != big_block_seek(&blk->bb, &blk->ptr, offset)) {
+        endrun(1, "Failed to seek block %s: %s\n", blk->name, big_file_get_error_message());
+    }
+    blk->prefetch = 1;
+    if(0 != pthread_create(&blk->Thread, NULL, petaio_readahead_reader, blk)) {
+        petaio_readahead_reader(blk);
+        blk->prefetch = 2;
+    }
+}
+
+/* Finish reading a block, unpack it into the particles and free its buffer. Collective.*/
+static void
+petaio_readahead_finish(BigFile * bf, struct ReadAheadBlock * blk, MPI_Comm Comm)
+{
+    int missing = 0;
+    if(blk->prefetch > 0) {
+        if(blk->prefetch == 1)
+            pthread_join(blk->Thread, NULL);
+        if(blk->failed)
+            endrun(1, "Failed to read from block %s: %s\n", blk->name, blk->ErrorMessage);
+        if(0 != big_block_mpi_close(&blk->bb, Comm))
+            endrun(0, "Failed to close block at %s:%s\n", blk->name, big_file_get_error_message());
+    }
+    else if(blk->prefetch == 0)
+        missing = petaio_read_block(bf, blk->name, &blk->array, blk->ent->required);
+    else
+        missing = 1;
+
+    if(!missing)
+        petaio_readout_buffer(&blk->array, blk->ent);
+    myfree(blk->array.data);
+}
+
+void
+petaio_alloc_particles(const int * NLocal, MPI_Comm Comm)
+{
+    int NTask;
+    MPI_Comm_size(Comm, &NTask);
+
     /* sets the maximum number of particles that may reside on a processor */
     int MaxPart = (int) (All.PartAllocFactor * All.TotNumPartInit / NTask);
 
     /*Allocate the particle memory*/
     particle_alloc_memory(MaxPart);
 
-    int NLocal[6];
-    for(ptype = 0; ptype < 6; ptype ++) {
-        int64_t start = ThisTask * NTotal[ptype] / NTask;
-        int64_t end = (ThisTask + 1) * NTotal[ptype] / NTask;
-        NLocal[ptype] = end - start;
+    int ptype, i;
+    for(ptype = 0; ptype < 6; ptype ++)
         PartManager->NumPart += NLocal[ptype];
-    }
 
     /* Allocate enough memory for stars and black holes.
      * This will be dynamically increased as needed.*/
@@ -233,12 +997,57 @@ void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Co
 
     /* so we can set up the memory topology of secondary slots */
     slots_setup_topology(PartManager, SlotsManager);
+}
+
+/* Read snapshot fname. Returns the full snapshot it refers to if it is a delta snapshot, and -1 otherwise.*/
+int petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Comm Comm) {
+    int ptype;
+    int i;
+    BigFile bf = {0};
+    BigBlock bh;
+    message(0, "Reading snapshot %s\n", fname);
 
+    if(0 != big_file_mpi_open(&bf, fname, Comm)) {
+        endrun(0, "Failed to open snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+
+    int64_t NTotal[6];
+    if(0 != big_file_mpi_open_block(&bf, &bh, "Header", Comm)) {
+        endrun(0, "Failed to create block at %s:%s\n", "Header",
+                    big_file_get_error_message());
+    }
+    int DeltaBase = -1;
+    if(ic || 0 != big_block_get_attr(&bh, "DeltaBase", &DeltaBase, "i4", 1))
+        DeltaBase = -1;
+    if ((0 != big_block_get_attr(&bh, "TotNumPart", NTotal, "u8", 6)) ||
+        (0 != big_block_mpi_close(&bh, Comm))) {
+        endrun(0, "Failed to close block: %s\n",
+                    big_file_get_error_message());
+    }
+
+    int NTask, ThisTask;
+    MPI_Comm_size(Comm, &NTask);
+    MPI_Comm_rank(Comm, &ThisTask);
+
+    int NLocal[6];
+    /* Read the particles each rank had when the snapshot was written, if we can,
+     * otherwise split the particles evenly*/
+    if(ic || !petaio_read_domain_counts(&bf, NTotal, NLocal, Comm)) {
+        for(ptype = 0; ptype < 6; ptype ++) {
+            int64_t start = ThisTask * NTotal[ptype] / NTask;
+            int64_t end = (ThisTask + 1) * NTotal[ptype] / NTask;
+            NLocal[ptype] = end - start;
+        }
+    }
+    petaio_alloc_particles(NLocal, Comm);
+
+    /* The blocks to read, in order*/
+    int * toread = ta_malloc("ReadBlocks", int, IOTable->used + 1);
+    int nread = 0;
     for(i = 0; i < IOTable->used; i ++) {
         /* only process the particle blocks */
-        char blockname[128];
         int ptype = IOTable->ent[i].ptype;
-        BigArray array = {0};
         if(!(ptype < 6 && ptype >= 0)) {
             continue;
         }
@@ -261,12 +1070,27 @@ void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Co
              * internally intialized; */
             continue;
         }
-        sprintf(blockname, "%d/%s", ptype, IOTable->ent[i].name);
-        petaio_alloc_buffer(&array, &IOTable->ent[i], NLocal[ptype]);
-        if(0 == petaio_read_block(&bf, blockname, &array, IOTable->ent[i].required))
-            petaio_readout_buffer(&array, &IOTable->ent[i]);
-        petaio_destroy_buffer(&array);
+        /* Only part of the block is in a delta snapshot: see petaio_read_delta*/
+        if(DeltaBase >= 0 && IOTable->ent[i].constant)
+            continue;
+        toread[nread++] = i;
+    }
+
+    /* Block k + 1 is read in the background while block k is unpacked*/
+    struct ReadAheadBlock ahead[2];
+    if(nread > 0)
+        petaio_readahead_start(&bf, &ahead[0], &IOTable->ent[toread[0]], NLocal[IOTable->ent[toread[0]].ptype], 0, Comm);
+    for(i = 0; i < nread; i ++) {
+        if(i + 1 < nread) {
+            IOTableEntry * next = &IOTable->ent[toread[i + 1]];
+            petaio_readahead_start(&bf, &ahead[(i + 1) % 2], next, NLocal[next->ptype], (i + 1) % 2, Comm);
+        }
+        petaio_readahead_finish(&bf, &ahead[i % 2], Comm);
     }
+    ta_free(toread);
+
+    if(DeltaBase >= 0)
+        petaio_read_delta(&bf, DeltaBase, IOTable, NTotal, NLocal, Comm);
 
     /*Read neutrinos from the snapshot if necessary*/
     if(All.MassiveNuLinRespOn) {
@@ -284,17 +1108,47 @@ void petaio_read_internal(char * fname, int ic, struct IOTable * IOTable, MPI_Co
 
     /* now we have IDs, set up the ID consistency between slots. */
     slots_setup_id(PartManager, SlotsManager);
+    return DeltaBase;
+}
+/* Functions making the initial conditions in memory, if set*/
+static struct {
+    petaio_ic_header header;
+    petaio_ic_particles particles;
+} ICGenerator;
+
+void
+petaio_set_ic_generator(petaio_ic_header header, petaio_ic_particles particles)
+{
+    ICGenerator.header = header;
+    ICGenerator.particles = particles;
 }
+
 void
 petaio_read_header(int num)
 {
     BigFile bf = {0};
 
+    if(num == -1 && ICGenerator.header) {
+        struct ICHeader header = {0};
+        message(0, "Making the header of the initial conditions in memory\n");
+        ICGenerator.header(&header);
+        memcpy(All.MassTable, header.MassTable, sizeof(All.MassTable));
+        All.BoxSize = header.BoxSize;
+        All.TimeInit = All.TimeIC = header.Time;
+        All.UnitVelocity_in_cm_per_s = header.UnitVelocity_in_cm_per_s;
+        All.UnitLength_in_cm = header.UnitLength_in_cm;
+        All.UnitMass_in_g = header.UnitMass_in_g;
+        All.IO.UsePeculiarVelocity = header.UsePeculiarVelocity;
+        memcpy(All.NTotalInit, header.NTotal, sizeof(All.NTotalInit));
+        petaio_set_particle_totals(header.NTotal);
+        return;
+    }
+
     char * fname;
     if(num == -1) {
         fname = fastpm_strdup_printf("%s", All.InitCondFile);
     } else {
-        fname = fastpm_strdup_printf("%s/%s_%03d", All.OutputDir, All.SnapshotFileBase, num);
+        fname = petaio_snapshot_fname(num, MPI_COMM_WORLD);
     }
     message(0, "Probing Header of snapshot file: %s\n", fname);
 
@@ -327,7 +1181,17 @@ petaio_read_snapshot(int num, MPI_Comm Comm)
          *  InitTemp in paramfile, then use init.c to convert to
          *  entropy.
          * */
-        petaio_read_internal(fname, 1, &IOTable, Comm);
+        if(ICGenerator.particles) {
+            /* The neutrino transfer function is only stored in an IC file*/
+            if(All.MassiveNuLinRespOn)
+                endrun(0, "Initial conditions made in memory do not support MassiveNuLinRespOn\n");
+            message(0, "Making the particles of the initial conditions in memory\n");
+            ICGenerator.particles(Comm);
+            /* now we have IDs, set up the ID consistency between slots. */
+            slots_setup_id(PartManager, SlotsManager);
+        }
+        else
+            petaio_read_internal(fname, 1, &IOTable, Comm);
 
         int i;
         /* touch up the mass -- IC files save mass in header */
@@ -349,16 +1213,486 @@ petaio_read_snapshot(int num, MPI_Comm Comm)
 
         }
     } else {
-        fname = fastpm_strdup_printf("%s/%s_%03d", All.OutputDir, All.SnapshotFileBase, num);
+        fname = petaio_snapshot_fname(num, Comm);
         /*
          * we always save the Entropy, init.c will not mess with the entropy
          * */
-        petaio_read_internal(fname, 0, &IOTable, Comm);
+        const int DeltaBase = petaio_read_internal(fname, 0, &IOTable, Comm);
+        /* Later delta snapshots refer to the same full snapshot as this one.
+         * petaio_read_delta has marked the particles in it.*/
+        if(DeltaBase < 0)
+            petaio_set_delta_base(num);
+        else
+            DeltaBaseNum = DeltaBase;
     }
     myfree(fname);
 }
 
 
+/* The rows of a constant block in a delta snapshot: the particles of the selection which are not in the base snapshot.
+ * They are stored in deltasel and their number returned.*/
+static int
+petaio_delta_selection(const int * selection, const int NumSelection, int * deltasel)
+{
+    int i, n = 0;
+    for(i = 0; i < NumSelection; i++)
+        if(!P[selection[i]].InDeltaBase)
+            deltasel[n++] = selection[i];
+    return n;
+}
+
+static void
+petaio_write_delta_header(BigFile * bf)
+{
+    BigBlock bh;
+    if(0 != big_file_mpi_open_block(bf, &bh, "Header", MPI_COMM_WORLD)) {
+        endrun(0, "Failed to open block at %s:%s\n", "Header",
+                big_file_get_error_message());
+    }
+    if((0 != big_block_set_attr(&bh, "DeltaBase", &DeltaBaseNum, "i4", 1)) ||
+       (0 != big_block_mpi_close(&bh, MPI_COMM_WORLD))) {
+        endrun(0, "Failed to write attributes %s\n",
+                    big_file_get_error_message());
+    }
+}
+
+/* Marks the particles not in the base snapshot in the DeltaNew blocks*/
+static void GTDeltaNew(int i, unsigned char * out, void * baseptr, void * smanptr) {
+    *out = !((struct particle_data *) baseptr)[i].InDeltaBase;
+}
+
+int
+petaio_make_delta(struct IOTable * IOTable)
+{
+    if(DeltaBaseNum < 0)
+        return 0;
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++)
+        IO_REG_WRONLY(DeltaNew, "u1", 1, ptype, IOTable);
+    IOTable->Delta = 1;
+    return 1;
+}
+
+void
+petaio_set_delta_base(int num)
+{
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+        P[i].InDeltaBase = 1;
+    DeltaBaseNum = num;
+}
+
+static int
+petaio_cmp_delta_id(const void * a, const void * b)
+{
+    const MyIDType ia = *(const MyIDType *) a, ib = *(const MyIDType *) b;
+    return (ia > ib) - (ia < ib);
+}
+
+/* Rank holding the rows of the base snapshot for a particle while a delta is read*/
+#define DELTA_ID_TASK(id, NTask) ((int) ((id) % (NTask)))
+
+/* Read constant block ent of a delta snapshot, for the nlocal particles of its type from P[first].
+ * isnew marks the particles not in the base snapshot: their rows are in the delta snapshot.
+ * The rows of the others are read from the base snapshot, spread evenly over the ranks,
+ * and sent to their particles, which are found by ID through a rank chosen by ID. Collective on Comm.*/
+static void
+petaio_read_delta_block(BigFile * bf, BigFile * bfbase, IOTableEntry * ent, const unsigned char * isnew, const int first, const int nlocal, MPI_Comm Comm)
+{
+    int ThisTask, NTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    MPI_Comm_size(Comm, &NTask);
+
+    char blockname[128], idname[128];
+    sprintf(blockname, "%d/%s", ent->ptype, ent->name);
+    sprintf(idname, "%d/ID", ent->ptype);
+
+    BigArray array = {0};
+    petaio_alloc_buffer(&array, ent, nlocal);
+    const size_t rowsize = array.strides[0];
+    int i, k, nnew = 0;
+    for(i = 0; i < nlocal; i++)
+        nnew += isnew[i];
+
+    /* The rows of the new particles are in the delta snapshot, in order*/
+    BigArray newrows = {0};
+    petaio_alloc_buffer(&newrows, ent, nnew);
+    petaio_read_block_comm(bf, blockname, &newrows, 1, Comm);
+    for(i = 0, k = 0; i < nlocal; i++)
+        if(isnew[i])
+            memcpy(array.data + i * rowsize, newrows.data + (k++) * rowsize, rowsize);
+    petaio_destroy_buffer(&newrows);
+
+    const int64_t nbasetot = petaio_block_size(bfbase, blockname, Comm);
+    if(nbasetot < 0)
+        endrun(1, "Block %s is not in the base snapshot of the delta snapshot.\n", blockname);
+    const int nbase = (ThisTask + 1) * nbasetot / NTask - ThisTask * nbasetot / NTask;
+
+    /* Rows of the base snapshot, each after the ID of its particle*/
+    const size_t entsize = sizeof(MyIDType) + ((rowsize + 7) & ~7);
+    BigArray baserows = {0};
+    petaio_alloc_buffer(&baserows, ent, nbase);
+    petaio_read_block_comm(bfbase, blockname, &baserows, 1, Comm);
+    MyIDType * baseid = (MyIDType *) mymalloc("DeltaBaseID", nbase * sizeof(MyIDType) + 1);
+    BigArray idarray = {0};
+    size_t iddims[2] = {nbase, 1};
+    ptrdiff_t idstrides[2] = {sizeof(MyIDType), sizeof(MyIDType)};
+    big_array_init(&idarray, baseid, "u8", 2, iddims, idstrides);
+    petaio_read_block_comm(bfbase, idname, &idarray, 1, Comm);
+
+    int * counts = ta_malloc("DeltaCounts", int, 8 * NTask);
+    int * sendcount = counts, * senddispl = counts + NTask, * recvcount = counts + 2 * NTask, * recvdispl = counts + 3 * NTask;
+    int * reqcount = counts + 4 * NTask, * reqdispl = counts + 5 * NTask, * anscount = counts + 6 * NTask, * ansdispl = counts + 7 * NTask;
+    MPI_Datatype enttype, idtype, rowtype;
+    MPI_Type_contiguous(entsize, MPI_BYTE, &enttype);
+    MPI_Type_commit(&enttype);
+    MPI_Type_contiguous(sizeof(MyIDType), MPI_BYTE, &idtype);
+    MPI_Type_commit(&idtype);
+    MPI_Type_contiguous(rowsize, MPI_BYTE, &rowtype);
+    MPI_Type_commit(&rowtype);
+
+    /* Send the base rows to the rank chosen by their ID*/
+    memset(counts, 0, 8 * NTask * sizeof(int));
+    for(i = 0; i < nbase; i++)
+        sendcount[DELTA_ID_TASK(baseid[i], NTask)]++;
+    MPI_Alltoall(sendcount, 1, MPI_INT, recvcount, 1, MPI_INT, Comm);
+    int nsend = 0, nrecv = 0;
+    for(i = 0; i < NTask; i++) {
+        senddispl[i] = nsend;
+        recvdispl[i] = nrecv;
+        nsend += sendcount[i];
+        nrecv += recvcount[i];
+        sendcount[i] = 0;
+    }
+    char * sendents = (char *) mymalloc("DeltaSendRows", nsend * entsize + 1);
+    for(i = 0; i < nbase; i++) {
+        const int task = DELTA_ID_TASK(baseid[i], NTask);
+        char * e = sendents + (senddispl[task] + sendcount[task]++) * entsize;
+        memcpy(e, &baseid[i], sizeof(MyIDType));
+        memcpy(e + sizeof(MyIDType), baserows.data + i * rowsize, rowsize);
+    }
+    char * recvents = (char *) mymalloc("DeltaRecvRows", nrecv * entsize + 1);
+    MPI_Alltoallv_sparse(sendents, sendcount, senddispl, enttype,
+                 recvents, recvcount, recvdispl, enttype, Comm);
+    qsort(recvents, nrecv, entsize, petaio_cmp_delta_id);
+
+    /* Ask the same ranks for the rows of our particles in the base snapshot*/
+    int nreq = 0;
+    for(i = 0; i < nlocal; i++)
+        if(!isnew[i])
+            reqcount[DELTA_ID_TASK(P[first + i].ID, NTask)]++;
+    MPI_Alltoall(reqcount, 1, MPI_INT, anscount, 1, MPI_INT, Comm);
+    int nask = 0;
+    for(i = 0; i < NTask; i++) {
+        reqdispl[i] = nreq;
+        ansdispl[i] = nask;
+        nreq += reqcount[i];
+        nask += anscount[i];
+        reqcount[i] = 0;
+    }
+    MyIDType * reqid = (MyIDType *) mymalloc("DeltaReqID", nreq * sizeof(MyIDType) + 1);
+    int * reqrow = (int *) mymalloc("DeltaReqRow", nreq * sizeof(int) + 1);
+    for(i = 0; i < nlocal; i++) {
+        if(isnew[i])
+            continue;
+        const int task = DELTA_ID_TASK(P[first + i].ID, NTask);
+        const int slot = reqdispl[task] + reqcount[task]++;
+        reqid[slot] = P[first + i].ID;
+        reqrow[slot] = i;
+    }
+    MyIDType * askid = (MyIDType *) mymalloc("DeltaAskID", nask * sizeof(MyIDType) + 1);
+    MPI_Alltoallv_sparse(reqid, reqcount, reqdispl, idtype,
+                 askid, anscount, ansdispl, idtype, Comm);
+
+    /* Answer in the order asked*/
+    char * answer = (char *) mymalloc("DeltaAnswer", nask * rowsize + 1);
+    for(i = 0; i < nask; i++) {
+        const char * e = bsearch(&askid[i], recvents, nrecv, entsize, petaio_cmp_delta_id);
+        if(!e)
+            endrun(1, "Particle %lu is not in the base snapshot of the delta snapshot.\n", (unsigned long) askid[i]);
+        memcpy(answer + i * rowsize, e + sizeof(MyIDType), rowsize);
+    }
+    char * replies = (char *) mymalloc("DeltaReplies", nreq * rowsize + 1);
+    MPI_Alltoallv_sparse(answer, anscount, ansdispl, rowtype,
+                 replies, reqcount, reqdispl, rowtype, Comm);
+    for(i = 0; i < nreq; i++)
+        memcpy(array.data + reqrow[i] * rowsize, replies + i * rowsize, rowsize);
+
+    myfree(replies);
+    myfree(answer);
+    myfree(askid);
+    myfree(reqrow);
+    myfree(reqid);
+    myfree(recvents);
+    myfree(sendents);
+    MPI_Type_free(&rowtype);
+    MPI_Type_free(&idtype);
+    MPI_Type_free(&enttype);
+    ta_free(counts);
+    myfree(baseid);
+    petaio_destroy_buffer(&baserows);
+
+    petaio_readout_buffer(&array, ent);
+    petaio_destroy_buffer(&array);
+}
+
+/* Complete the constant blocks of a delta snapshot from the full snapshot DeltaBase,
+ * and mark the particles which are in it. Collective on Comm.*/
+static void
+petaio_read_delta(BigFile * bf, const int DeltaBase, struct IOTable * IOTable, const int64_t * NTotal, const int * NLocal, MPI_Comm Comm)
+{
+    char * basename = petaio_snapshot_fname(DeltaBase, Comm);
+    message(0, "Reading the constant blocks of the delta snapshot from %s\n", basename);
+    BigFile bfbase = {0};
+    if(0 != big_file_mpi_open(&bfbase, basename, Comm)) {
+        endrun(0, "Failed to open the base snapshot at %s:%s\n", basename,
+                    big_file_get_error_message());
+    }
+
+    /* The particles are ordered by type, as in petaio_alloc_particles*/
+    const int NumPart = PartManager->NumPart;
+    unsigned char * isnew = (unsigned char *) mymalloc("DeltaNew", NumPart + 1);
+    int first[6];
+    int ptype, i, offset = 0;
+    for(ptype = 0; ptype < 6; ptype++) {
+        first[ptype] = offset;
+        offset += NLocal[ptype];
+        if(NTotal[ptype] == 0)
+            continue;
+        char blockname[128];
+        sprintf(blockname, "%d/DeltaNew", ptype);
+        BigArray array = {0};
+        size_t dims[2] = {NLocal[ptype], 1};
+        ptrdiff_t strides[2] = {1, 1};
+        big_array_init(&array, isnew + first[ptype], "u1", 2, dims, strides);
+        petaio_read_block_comm(bf, blockname, &array, 1, Comm);
+    }
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++)
+        P[i].InDeltaBase = !isnew[i];
+
+    for(i = 0; i < IOTable->used; i++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        ptype = ent->ptype;
+        if(!(ptype < 6 && ptype >= 0) || !ent->constant || ent->setter == NULL || NTotal[ptype] == 0)
+            continue;
+        petaio_read_delta_block(bf, &bfbase, ent, isnew + first[ptype], first[ptype], NLocal[ptype], Comm);
+    }
+    myfree(isnew);
+
+    if(0 != big_file_mpi_close(&bfbase, Comm)) {
+        endrun(0, "Failed to close the base snapshot at %s:%s\n", basename,
+                    big_file_get_error_message());
+    }
+    myfree(basename);
+}
+
+/* Number of rows in a block, or -1 if there is no such block.*/
+static int64_t
+petaio_block_size(BigFile * bf, char * blockname, MPI_Comm Comm)
+{
+    BigBlock bb;
+    if(0 != big_file_mpi_open_block(bf, &bb, blockname, Comm))
+        return -1;
+    int64_t size = bb.size;
+    if(0 != big_block_mpi_close(&bb, Comm)) {
+        endrun(0, "Failed to close block at %s:%s\n", blockname,
+                    big_file_get_error_message());
+    }
+    return size;
+}
+
+/* Domain tables are the same on all ranks, so only the first rank writes them
+ * and it reads them for everyone.*/
+static void
+petaio_save_domain_table(BigFile * bf, char * blockname, void * data, char * dtype, int nmemb, int64_t nrow)
+{
+    BigArray array = {0};
+    size_t dims[2] = {nrow, nmemb};
+    ptrdiff_t strides[2] = {nmemb * big_file_dtype_itemsize(dtype), big_file_dtype_itemsize(dtype)};
+    big_array_init(&array, data, dtype, 2, dims, strides);
+    petaio_save_block(bf, blockname, &array, 0);
+}
+
+static void
+petaio_read_domain_table(BigFile * bf, char * blockname, void * data, char * dtype, int nmemb, int64_t nrow, MPI_Comm Comm)
+{
+    int ThisTask;
+    MPI_Comm_rank(Comm, &ThisTask);
+    BigArray array = {0};
+    size_t dims[2] = {ThisTask == 0 ? nrow : 0, nmemb};
+    ptrdiff_t strides[2] = {nmemb * big_file_dtype_itemsize(dtype), big_file_dtype_itemsize(dtype)};
+    big_array_init(&array, data, dtype, 2, dims, strides);
+    petaio_read_block(bf, blockname, &array, 1);
+    MPI_Bcast(data, nrow * strides[0], MPI_BYTE, 0, Comm);
+}
+
+void
+petaio_save_domain(const DomainDecomp * ddecomp, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    char * fname = fastpm_strdup_vprintf(fmt, va);
+    va_end(va);
+
+    BigFile bf = {0};
+    if(0 != big_file_mpi_open(&bf, fname, MPI_COMM_WORLD)) {
+        endrun(0, "Failed to open snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    const int NTopNodes = ThisTask == 0 ? ddecomp->NTopNodes : 0;
+    const int NTopLeaves = ThisTask == 0 ? ddecomp->NTopLeaves : 0;
+    const int NOrder = ThisTask == 0 ? NTask : 0;
+
+    int64_t * topnodes = (int64_t *) mymalloc("DomainTopNodes", 4 * sizeof(int64_t) * (NTopNodes + 1));
+    int * leaftask = (int *) mymalloc("DomainLeafTask", sizeof(int) * (NTopLeaves + 1));
+    int i;
+    for(i = 0; i < NTopNodes; i ++) {
+        topnodes[4 * i] = ddecomp->TopNodes[i].StartKey;
+        topnodes[4 * i + 1] = ddecomp->TopNodes[i].Daughter;
+        topnodes[4 * i + 2] = ddecomp->TopNodes[i].Shift;
+        topnodes[4 * i + 3] = ddecomp->TopNodes[i].Leaf;
+    }
+    for(i = 0; i < NTopLeaves; i ++)
+        leaftask[i] = ddecomp->TopLeaves[i].Task;
+
+    petaio_save_domain_table(&bf, "Domain/TopNodes", topnodes, "i8", 4, NTopNodes);
+    petaio_save_domain_table(&bf, "Domain/LeafTask", leaftask, "i4", 1, NTopLeaves);
+    petaio_save_domain_table(&bf, "Domain/TaskOrder", ddecomp->TaskOrder, "i4", 1, NOrder);
+
+    /* Where the next decomposition should start, see domain_get_policy_hint*/
+    int hint[2];
+    domain_get_policy_hint(&hint[0], &hint[1]);
+    petaio_save_domain_table(&bf, "Domain/PolicyHint", hint, "i4", 2, ThisTask == 0 ? 1 : 0);
+    /* The tuned number of TopLeaves per task, see domain_get_overdecomposition*/
+    int overdecomp = domain_get_overdecomposition();
+    petaio_save_domain_table(&bf, "Domain/OverDecomposition", &overdecomp, "i4", 1, ThisTask == 0 ? 1 : 0);
+
+    /* The particles of each rank, in the order petaio_build_selection wrote them*/
+    int64_t count[6] = {0};
+    for(i = 0; i < PartManager->NumPart; i ++)
+        if(!P[i].IsGarbage)
+            count[P[i].Type]++;
+    petaio_save_domain_table(&bf, "Domain/NumPartPerTask", count, "i8", 6, 1);
+
+    myfree(leaftask);
+    myfree(topnodes);
+
+    if(0 != big_file_mpi_close(&bf, MPI_COMM_WORLD)){
+        endrun(0, "Failed to close snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+    myfree(fname);
+}
+
+/* Read the number of particles of each type this rank had when the snapshot was written.
+ * Returns 0 if this is not possible.*/
+static int
+petaio_read_domain_counts(BigFile * bf, const int64_t * NTotal, int * NLocal, MPI_Comm Comm)
+{
+    if(!All.IO.SnapshotWithDomain)
+        return 0;
+
+    int NTask;
+    MPI_Comm_size(Comm, &NTask);
+    const int64_t nsaved = petaio_block_size(bf, "Domain/NumPartPerTask", Comm);
+    if(nsaved < 0)
+        return 0;
+    if(nsaved != NTask) {
+        message(0, "Snapshot domain was saved by %ld ranks, not %d. Doing a new domain decomposition.\n", nsaved, NTask);
+        return 0;
+    }
+    int64_t count[6];
+    BigArray array = {0};
+    size_t dims[2] = {1, 6};
+    ptrdiff_t strides[2] = {6 * sizeof(int64_t), sizeof(int64_t)};
+    big_array_init(&array, count, "i8", 2, dims, strides);
+    petaio_read_block(bf, "Domain/NumPartPerTask", &array, 1);
+
+    int64_t total[6];
+    MPI_Allreduce(count, total, 6, MPI_INT64, MPI_SUM, Comm);
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype ++) {
+        if(total[ptype] != NTotal[ptype])
+            endrun(1, "Snapshot domain has %ld particles of type %d, but the header has %ld\n", total[ptype], ptype, NTotal[ptype]);
+        NLocal[ptype] = count[ptype];
+    }
+    message(0, "Reading the particles of each rank from the saved domain.\n");
+    return 1;
+}
+
+int
+petaio_read_domain(int num, DomainDecomp * ddecomp, MPI_Comm Comm)
+{
+    if(num < 0 || !All.IO.SnapshotWithDomain)
+        return 0;
+
+    char * fname = petaio_snapshot_fname(num, Comm);
+    BigFile bf = {0};
+    if(0 != big_file_mpi_open(&bf, fname, Comm)) {
+        endrun(0, "Failed to open snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+
+    int NTask;
+    MPI_Comm_size(Comm, &NTask);
+    const int64_t nsaved = petaio_block_size(&bf, "Domain/NumPartPerTask", Comm);
+    const int64_t NTopNodes = petaio_block_size(&bf, "Domain/TopNodes", Comm);
+    const int64_t NTopLeaves = petaio_block_size(&bf, "Domain/LeafTask", Comm);
+
+    int restored = 0;
+    /* Older snapshots have no hint*/
+    if(nsaved == NTask && petaio_block_size(&bf, "Domain/PolicyHint", Comm) == 1) {
+        int hint[2];
+        petaio_read_domain_table(&bf, "Domain/PolicyHint", hint, "i4", 2, 1, Comm);
+        domain_set_policy_hint(hint[0], hint[1]);
+        message(0, "Next domain decomposition starts from policy %d with at least %d TopNodes.\n", hint[0], hint[1]);
+    }
+    if(nsaved == NTask && petaio_block_size(&bf, "Domain/OverDecomposition", Comm) == 1) {
+        int overdecomp;
+        petaio_read_domain_table(&bf, "Domain/OverDecomposition", &overdecomp, "i4", 1, 1, Comm);
+        domain_set_overdecomposition(overdecomp);
+    }
+    if(nsaved == NTask && NTopNodes > 0 && NTopLeaves > 0) {
+        int64_t * topnodes = (int64_t *) mymalloc("DomainTopNodes", 4 * sizeof(int64_t) * NTopNodes);
+        int * leaftask = (int *) mymalloc("DomainLeafTask", sizeof(int) * NTopLeaves);
+        int * order = (int *) mymalloc("DomainTaskOrder", sizeof(int) * NTask);
+        petaio_read_domain_table(&bf, "Domain/TopNodes", topnodes, "i8", 4, NTopNodes, Comm);
+        petaio_read_domain_table(&bf, "Domain/LeafTask", leaftask, "i4", 1, NTopLeaves, Comm);
+        petaio_read_domain_table(&bf, "Domain/TaskOrder", order, "i4", 1, NTask, Comm);
+
+        /* Converted in place: the struct is no larger than the four integers*/
+        struct topnode_data * TopNodes = (struct topnode_data *) topnodes;
+        int i;
+        for(i = 0; i < NTopNodes; i ++) {
+            struct topnode_data node;
+            node.StartKey = topnodes[4 * i];
+            node.Daughter = topnodes[4 * i + 1];
+            node.Shift = topnodes[4 * i + 2];
+            node.Leaf = topnodes[4 * i + 3];
+            TopNodes[i] = node;
+        }
+        domain_restore(ddecomp, TopNodes, NTopNodes, leaftask, NTopLeaves, order);
+        myfree(order);
+        myfree(leaftask);
+        myfree(topnodes);
+        restored = 1;
+    }
+
+    if(0 != big_file_mpi_close(&bf, Comm)) {
+        endrun(0, "Failed to close snapshot at %s:%s\n", fname,
+                    big_file_get_error_message());
+    }
+    myfree(fname);
+    return restored;
+}
+
 /* write a header block */
 static void petaio_write_header(BigFile * bf, const int64_t * NTotal) {
     BigBlock bh;
@@ -398,6 +1732,12 @@ static void petaio_write_header(BigFile * bf, const int64_t * NTotal) {
                     big_file_get_error_message());
     }
 
+    const int PeanoKeyIndexShift = PETAIO_KEY_INDEX_SHIFT;
+    if(All.IO.PeanoOrder && 0 != big_block_set_attr(&bh, "PeanoKeyIndexShift", &PeanoKeyIndexShift, "i4", 1)) {
+        endrun(0, "Failed to write attributes %s\n",
+                    big_file_get_error_message());
+    }
+
     if(0 != big_block_mpi_close(&bh, MPI_COMM_WORLD)) {
         endrun(0, "Failed to close block %s\n",
                     big_file_get_error_message());
@@ -419,7 +1759,39 @@ _get_attr_int(BigBlock * bh, char * name, int def)
     if(0 != big_block_get_attr(bh, name, &foo, "i4", 1)) {
         foo = def;
     }
-    return foo;
+    return foo;
+}
+
+/* Set the initial particle numbers, mean separations and the default Nmesh from the header,
+ * once NTotalInit is known.*/
+static void
+petaio_set_particle_totals(const int64_t * NTotal)
+{
+    int ptype;
+    /*Set Nmesh to triple the mean grid spacing of the dark matter by default.*/
+    if(All.Nmesh  < 0)
+        All.Nmesh = 3*pow(2, (int)(log(NTotal[1])/3./log(2)) );
+
+    int64_t TotNumPart = 0;
+    All.TotNumPartInit = 0;
+    for(ptype = 0; ptype < 6; ptype ++) {
+        TotNumPart += NTotal[ptype];
+        All.TotNumPartInit += All.NTotalInit[ptype];
+        if(All.NTotalInit[ptype] > 0) {
+            All.MeanSeparation[ptype] = All.BoxSize / pow(All.NTotalInit[ptype], 1.0 / 3);
+        } else {
+            All.MeanSeparation[ptype] = 0;
+        }
+    }
+
+    message(0, "Total number of particles: %018ld\n", TotNumPart);
+
+    const char * PARTICLE_TYPE_NAMES [] = {"Gas", "DarkMatter", "Neutrino", "Unknown", "Star", "BlackHole"};
+
+    for(ptype = 0; ptype < 6; ptype ++) {
+        message(0, "% 11s: Total: %018ld Init: %018ld Mean-Sep %g \n",
+                PARTICLE_TYPE_NAMES[ptype], NTotal[ptype], All.NTotalInit[ptype], All.MeanSeparation[ptype]);
+    }
 }
 
 static void
@@ -430,7 +1802,6 @@ petaio_read_header_internal(BigFile * bf) {
                     big_file_get_error_message());
     }
     double Time = 0.;
-    int ptype;
     int64_t NTotal[6];
     if(
     (0 != big_block_get_attr(&bh, "TotNumPart", NTotal, "u8", 6)) ||
@@ -442,9 +1813,6 @@ petaio_read_header_internal(BigFile * bf) {
                     big_file_get_error_message());
     }
 
-    /*Set Nmesh to triple the mean grid spacing of the dark matter by default.*/
-    if(All.Nmesh  < 0)
-        All.Nmesh = 3*pow(2, (int)(log(NTotal[1])/3./log(2)) );
     All.TimeInit = Time;
     if(0!= big_block_get_attr(&bh, "TimeIC", &All.TimeIC, "f8", 1))
         All.TimeIC = Time;
@@ -478,26 +1846,7 @@ petaio_read_header_internal(BigFile * bf) {
         }
     }
 
-    int64_t TotNumPart = 0;
-    All.TotNumPartInit = 0;
-    for(ptype = 0; ptype < 6; ptype ++) {
-        TotNumPart += NTotal[ptype];
-        All.TotNumPartInit += All.NTotalInit[ptype];
-        if(All.NTotalInit[ptype] > 0) {
-            All.MeanSeparation[ptype] = All.BoxSize / pow(All.NTotalInit[ptype], 1.0 / 3);
-        } else {
-            All.MeanSeparation[ptype] = 0;
-        }
-    }
-
-    message(0, "Total number of particles: %018ld\n", TotNumPart);
-
-    const char * PARTICLE_TYPE_NAMES [] = {"Gas", "DarkMatter", "Neutrino", "Unknown", "Star", "BlackHole"};
-
-    for(ptype = 0; ptype < 6; ptype ++) {
-        message(0, "% 11s: Total: %018ld Init: %018ld Mean-Sep %g \n",
-                PARTICLE_TYPE_NAMES[ptype], NTotal[ptype], All.NTotalInit[ptype], All.MeanSeparation[ptype]);
-    }
+    petaio_set_particle_totals(NTotal);
 
     /*FIXME: check others as well */
     /*
@@ -527,14 +1876,40 @@ void petaio_alloc_buffer(BigArray * array, IOTableEntry * ent, int64_t localsize
 
 /* readout array into P struct with setters */
 void petaio_readout_buffer(BigArray * array, IOTableEntry * ent) {
-    int i;
-    /* fill the buffer */
-    char * p = array->data;
-    for(i = 0; i < PartManager->NumPart; i ++) {
-        if(P[i].Type != ent->ptype) continue;
-        ent->setter(i, p, P, SlotsManager);
-        p += array->strides[0];
+    const int NumPart = PartManager->NumPart;
+    /* Number of particles of this type before the range of each thread*/
+    const int Nt = stage_threads(THREADS_IO);
+    int64_t * first = ta_malloc("ReadoutFirst", int64_t, Nt + 1);
+#pragma omp parallel num_threads(Nt)
+    {
+        int i;
+        const int tid = omp_get_thread_num();
+        const int NT = omp_get_num_threads();
+        const int start = NumPart * (size_t) tid / NT;
+        const int end = NumPart * ((size_t) tid + 1) / NT;
+        int64_t count = 0;
+        for(i = start; i < end; i ++)
+            if(P[i].Type == ent->ptype)
+                count++;
+        first[tid + 1] = count;
+#pragma omp barrier
+#pragma omp single
+        {
+            int t;
+            first[0] = 0;
+            for(t = 0; t < NT; t++)
+                first[t + 1] += first[t];
+        }
+        /* fill the particles */
+        char * p = array->data;
+        p += array->strides[0] * first[tid];
+        for(i = start; i < end; i ++) {
+            if(P[i].Type != ent->ptype) continue;
+            ent->setter(i, p, P, SlotsManager);
+            p += array->strides[0];
+        }
     }
+    ta_free(first);
 }
 /* build an IO buffer for block, based on selection
  * only check P[ selection[i]]. If selection is NULL, just use P[i].
@@ -555,7 +1930,7 @@ petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection,
         return;
     }
 
-#pragma omp parallel
+#pragma omp parallel num_threads(stage_threads(THREADS_IO))
     {
         int i;
         const int tid = omp_get_thread_num();
@@ -576,18 +1951,271 @@ petaio_build_buffer(BigArray * array, IOTableEntry * ent, const int * selection,
     }
 }
 
+/* Point array at the particle memory of a block stored directly (see IOTableEntry),
+ * if the selected particles, or their slots, are consecutive. Returns 0 if this is not possible,
+ * in which case petaio_build_buffer must be used. The view must not be freed or modified.
+ * Not used with I/O aggregators, which gather contiguous rows.*/
+static int
+petaio_build_view(BigArray * array, IOTableEntry * ent, const int * selection, const int NumSelection, struct particle_data * Parts, struct slots_manager_type * SlotsManager)
+{
+    if(ent->direct_offset < 0 || ent->compress != IO_COMPRESS_NONE || IOGroup != MPI_COMM_NULL || NumSelection == 0)
+        return 0;
+
+    char * base;
+    ptrdiff_t stride;
+    int i, first;
+    if(ent->direct_slot) {
+        struct slot_info * info = &SlotsManager->info[ent->ptype];
+        base = info->ptr;
+        stride = info->elsize;
+        first = Parts[selection[0]].PI;
+        for(i = 1; i < NumSelection; i ++)
+            if(Parts[selection[i]].PI != first + i)
+                return 0;
+    } else {
+        base = (char *) Parts;
+        stride = sizeof(struct particle_data);
+        first = selection[0];
+        for(i = 1; i < NumSelection; i ++)
+            if(selection[i] != first + i)
+                return 0;
+    }
+    size_t dims[2] = {NumSelection, ent->items};
+    ptrdiff_t strides[2] = {stride, dtype_itemsize(ent->dtype)};
+    big_array_init(array, base + stride * first + ent->direct_offset, ent->dtype, 2, dims, strides);
+    return 1;
+}
+
 /* destroy a buffer, freeing its memory */
 void petaio_destroy_buffer(BigArray * array) {
     myfree(array->data);
 }
 
 /* read a block from disk, spread the values to memory with setters  */
-int petaio_read_block(BigFile * bf, char * blockname, BigArray * array, int required) {
+/* Only arrays with contiguous rows can be shipped to the aggregator as bytes*/
+static int
+petaio_array_is_contiguous(BigArray * array)
+{
+    const int elsize = big_file_dtype_itemsize(array->dtype);
+    return array->ndim == 2 && array->strides[1] == elsize && array->strides[0] == elsize * array->dims[1];
+}
+
+/* Kind (u, i or f) and size in bytes of a bigfile dtype*/
+static int
+petaio_dtype_kind(const char * dtype, char * kind)
+{
+    if(strchr("<>=|!", dtype[0]))
+        dtype++;
+    *kind = dtype[0];
+    return atoi(dtype + 1);
+}
+
+static uint64_t
+petaio_load_uint(const char * p, int size)
+{
+    uint8_t u1; uint16_t u2; uint32_t u4; uint64_t u8;
+    switch(size) {
+        case 1: memcpy(&u1, p, 1); return u1;
+        case 2: memcpy(&u2, p, 2); return u2;
+        case 4: memcpy(&u4, p, 4); return u4;
+        default: memcpy(&u8, p, 8); return u8;
+    }
+}
+
+static int64_t
+petaio_load_int(const char * p, int size)
+{
+    int8_t i1; int16_t i2; int32_t i4; int64_t i8;
+    switch(size) {
+        case 1: memcpy(&i1, p, 1); return i1;
+        case 2: memcpy(&i2, p, 2); return i2;
+        case 4: memcpy(&i4, p, 4); return i4;
+        default: memcpy(&i8, p, 8); return i8;
+    }
+}
+
+/* Store the low size bytes of v: correct for both signed and unsigned values which fit*/
+static void
+petaio_store_int(char * p, int size, uint64_t v)
+{
+    uint8_t u1 = v; uint16_t u2 = v; uint32_t u4 = v;
+    switch(size) {
+        case 1: memcpy(p, &u1, 1); break;
+        case 2: memcpy(p, &u2, 2); break;
+        case 4: memcpy(p, &u4, 4); break;
+        default: memcpy(p, &v, 8); break;
+    }
+}
+
+/* Encode a block buffer in place as requested by ent->compress,
+ * replacing the dtype of array. *step is set to the quantization step, or 0 if the encoding is lossless.
+ * Collective, as the range of the values is that of the whole block.*/
+static void
+petaio_compress_buffer(BigArray * array, const IOTableEntry * ent, double * step, char * blockname, int verbose)
+{
+    *step = 0;
+    if(ent->compress == IO_COMPRESS_NONE || !petaio_array_is_contiguous(array))
+        return;
+
+    char kind;
+    const int size = petaio_dtype_kind(array->dtype, &kind);
+    const int64_t n = array->dims[0] * array->dims[1];
+    char * data = array->data;
+    int64_t e;
+    int newsize = size;
+    char newkind = kind;
+
+    if(ent->compress == IO_COMPRESS_INTEGERS) {
+        if(kind == 'u') {
+            uint64_t max = 0;
+            for(e = 0; e < n; e++) {
+                uint64_t v = petaio_load_uint(data + e * size, size);
+                if(v > max)
+                    max = v;
+            }
+            MPI_Allreduce(MPI_IN_PLACE, &max, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+            newsize = max <= UINT8_MAX ? 1 : max <= UINT16_MAX ? 2 : max <= UINT32_MAX ? 4 : 8;
+        }
+        else if(kind == 'i') {
+            int64_t minmax[2] = {0, 0};
+            for(e = 0; e < n; e++) {
+                int64_t v = petaio_load_int(data + e * size, size);
+                /* -INT64_MIN overflows: clamp it, it needs 8 bytes anyway*/
+                const int64_t negv = v < -INT64_MAX ? INT64_MAX : -v;
+                if(negv > minmax[0])
+                    minmax[0] = negv;
+                if(v > minmax[1])
+                    minmax[1] = v;
+            }
+            MPI_Allreduce(MPI_IN_PLACE, minmax, 2, MPI_INT64_T, MPI_MAX, MPI_COMM_WORLD);
+            const int64_t max = minmax[0] > minmax[1] ? minmax[0] : minmax[1];
+            newsize = max < INT8_MAX ? 1 : max < INT16_MAX ? 2 : max < INT32_MAX ? 4 : 8;
+        }
+        if(newsize >= size)
+            return;
+        /* The new items are no larger, so they never overwrite an item not yet converted*/
+        for(e = 0; e < n; e++) {
+            uint64_t v = kind == 'u' ? petaio_load_uint(data + e * size, size) : (uint64_t) petaio_load_int(data + e * size, size);
+            petaio_store_int(data + e * newsize, newsize, v);
+        }
+    }
+    else if(ent->compress == IO_COMPRESS_QUANTIZE) {
+        if(kind != 'f' || ent->tolerance <= 0)
+            return;
+        double maxabs = 0;
+        for(e = 0; e < n; e++) {
+            double v;
+            if(size == 4) {
+                float f;
+                memcpy(&f, data + e * size, 4);
+                v = f;
+            } else
+                memcpy(&v, data + e * size, 8);
+            /* NaN and infinity are not representable*/
+            if(!isfinite(v))
+                v = INFINITY;
+            if(fabs(v) > maxabs)
+                maxabs = fabs(v);
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &maxabs, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+        const double s = 2 * ent->tolerance;
+        /* Only worth it if the integers are smaller than the floats*/
+        if(maxabs / s < INT16_MAX)
+            newsize = 2;
+        else if(maxabs / s < INT32_MAX && size == 8)
+            newsize = 4;
+        else
+            return;
+        newkind = 'i';
+        for(e = 0; e < n; e++) {
+            double v;
+            if(size == 4) {
+                float f;
+                memcpy(&f, data + e * size, 4);
+                v = f;
+            } else
+                memcpy(&v, data + e * size, 8);
+            petaio_store_int(data + e * newsize, newsize, (uint64_t) (int64_t) lround(v / s));
+        }
+        *step = s;
+    }
+    else if(ent->compress == IO_COMPRESS_FLOAT32) {
+        if(kind != 'f' || size != 8)
+            return;
+        newsize = 4;
+        for(e = 0; e < n; e++) {
+            double v;
+            memcpy(&v, data + e * size, 8);
+            float f = v;
+            memcpy(data + e * newsize, &f, 4);
+        }
+    }
+    else
+        return;
+
+    char newdtype[8];
+    snprintf(newdtype, 8, "=%c%d", newkind, newsize);
+    size_t dims[2] = {array->dims[0], array->dims[1]};
+    ptrdiff_t strides[2] = {newsize * array->dims[1], newsize};
+    big_array_init(array, data, newdtype, 2, dims, strides);
+    if(verbose)
+        message(0, "Storing %s as %s, quantization step %g\n", blockname, newdtype, *step);
+}
+
+/* Convert the quantized values q back to the floating point type of array, of size bytes.*/
+static void
+petaio_dequantize(const int32_t * q, BigArray * array, const double step, const int size)
+{
+    size_t i, j;
+    for(i = 0; i < array->dims[0]; i++) {
+        for(j = 0; j < array->dims[1]; j++) {
+            char * out = (char *) array->data + i * array->strides[0] + j * array->strides[1];
+            const double v = q[i * array->dims[1] + j] * step;
+            if(size == 4) {
+                float f = v;
+                memcpy(out, &f, 4);
+            } else
+                memcpy(out, &v, 8);
+        }
+    }
+}
+
+/* Read a quantized block into array, converting back to the floating point type of array.*/
+static void
+petaio_read_quantized(BigBlock * bb, BigBlockPtr * ptr, BigArray * array, double step, int NumReaders, char * blockname, MPI_Comm comm)
+{
+    char kind;
+    const int size = petaio_dtype_kind(array->dtype, &kind);
+    if(kind != 'f')
+        endrun(1, "Block %s is quantized but is read as %s\n", blockname, array->dtype);
+
+    size_t dims[2] = {array->dims[0], array->dims[1]};
+    ptrdiff_t strides[2] = {sizeof(int32_t) * dims[1], sizeof(int32_t)};
+    int32_t * q = mymalloc("IOQuantized", dims[0] * dims[1] * sizeof(int32_t));
+    BigArray qarray = {0};
+    big_array_init(&qarray, q, "=i4", 2, dims, strides);
+    if(0 != big_block_mpi_read(bb, ptr, &qarray, NumReaders, comm)) {
+        endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
+    }
+    petaio_dequantize(q, array, step, size);
+    myfree(q);
+}
+
+/* read a block from disk over the ranks of comm */
+static int
+petaio_read_block_comm(BigFile * bf, char * blockname, BigArray * array, int required, MPI_Comm comm)
+{
     BigBlock bb;
     BigBlockPtr ptr;
 
+    int NumReaders = All.IO.NumWriters;
+    int NTask;
+    MPI_Comm_size(comm, &NTask);
+    if(NumReaders > NTask)
+        NumReaders = NTask;
+
     /* open the block */
-    if(0 != big_file_mpi_open_block(bf, &bb, blockname, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_open_block(bf, &bb, blockname, comm)) {
         if(required)
             endrun(0, "Failed to open block at %s:%s\n", blockname, big_file_get_error_message());
         else
@@ -596,74 +2224,340 @@ int petaio_read_block(BigFile * bf, char * blockname, BigArray * array, int requ
     if(0 != big_block_seek(&bb, &ptr, 0)) {
             endrun(1, "Failed to seek block %s: %s\n", blockname, big_file_get_error_message());
     }
-    if(0 != big_block_mpi_read(&bb, &ptr, array, All.IO.NumWriters, MPI_COMM_WORLD)) {
+    /* Narrowed integers are converted by bigfile, quantized floats here*/
+    double QuantizeStep = 0;
+    if(0 == big_block_get_attr(&bb, "QuantizeStep", &QuantizeStep, "f8", 1) && QuantizeStep > 0)
+        petaio_read_quantized(&bb, &ptr, array, QuantizeStep, NumReaders, blockname, comm);
+    else if(0 != big_block_mpi_read(&bb, &ptr, array, NumReaders, comm)) {
         endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
     }
-    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(&bb, comm)) {
         endrun(0, "Failed to close block at %s:%s\n", blockname,
                     big_file_get_error_message());
     }
     return 0;
 }
 
-/* save a block to disk */
-void petaio_save_block(BigFile * bf, char * blockname, BigArray * array, int verbose)
+/* Create a block for the rows of array, nlocal on this rank, over the ranks of comm.
+ * Sets the number of files and writers, and returns the total number of rows.*/
+static int64_t
+petaio_create_block_comm(BigFile * bf, BigBlock * bb, char * blockname, BigArray * array, int64_t nlocal,
+        double QuantizeStep, int verbose, MPI_Comm comm, int * NumFiles, int * NumWriters)
 {
-
-    BigBlock bb;
-    BigBlockPtr ptr;
-
-    int elsize = big_file_dtype_itemsize(array->dtype);
-
-    int NumWriters = All.IO.NumWriters;
-
-    size_t size = count_sum(array->dims[0]);
-    int NumFiles;
-
-    if(All.IO.EnableAggregatedIO) {
-        NumFiles = (size * elsize + All.IO.BytesPerFile - 1) / All.IO.BytesPerFile;
-        if(NumWriters > NumFiles * All.IO.WritersPerFile) {
-            NumWriters = NumFiles * All.IO.WritersPerFile;
-            message(0, "Throttling NumWriters to %d.\n", NumWriters);
-        }
-        if(NumWriters < All.IO.MinNumWriters) {
-            NumWriters = All.IO.MinNumWriters;
-            NumFiles = (NumWriters + All.IO.WritersPerFile - 1) / All.IO.WritersPerFile ;
-            message(0, "Throttling NumWriters to %d.\n", NumWriters);
-        }
-    } else {
-        NumFiles = NumWriters;
-    }
-    /*Do not write empty files*/
-    if(size == 0) {
-        NumFiles = 0;
-    }
+    int64_t size = nlocal;
+    MPI_Allreduce(MPI_IN_PLACE, &size, 1, MPI_INT64, MPI_SUM, comm);
+    *NumFiles = petaio_block_nfiles(size, big_file_dtype_itemsize(array->dtype), NumWriters);
+    int NTask;
+    MPI_Comm_size(comm, &NTask);
+    if(*NumWriters > NTask)
+        *NumWriters = NTask;
 
     if(verbose && size > 0) {
-        message(0, "Will write %td particles to %d Files for %s\n", size, NumFiles, blockname);
+        message(0, "Will write %td particles to %d Files for %s\n", size, *NumFiles, blockname);
     }
     /* create the block */
     /* dims[1] is the number of members per item */
-    if(0 != big_file_mpi_create_block(bf, &bb, blockname, array->dtype, array->dims[1], NumFiles, size, MPI_COMM_WORLD)) {
+    if(0 != big_file_mpi_create_block(bf, bb, blockname, array->dtype, array->dims[1], *NumFiles, size, comm)) {
         endrun(0, "Failed to create block at %s:%s\n", blockname,
                     big_file_get_error_message());
     }
+    if(QuantizeStep > 0 && 0 != big_block_set_attr(bb, "QuantizeStep", &QuantizeStep, "f8", 1)) {
+        endrun(0, "Failed to write attributes %s\n", big_file_get_error_message());
+    }
+    return size;
+}
+
+/* save a block to disk from the ranks of comm */
+static void
+petaio_save_block_comm(BigFile * bf, char * blockname, BigArray * array, double QuantizeStep, int verbose, MPI_Comm comm)
+{
+
+    BigBlock bb;
+    BigBlockPtr ptr;
+
+    int NumWriters, NumFiles;
+    const int64_t size = petaio_create_block_comm(bf, &bb, blockname, array, array->dims[0], QuantizeStep, verbose, comm, &NumFiles, &NumWriters);
+
     if(0 != big_block_seek(&bb, &ptr, 0)) {
         endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
     }
-    if(0 != big_block_mpi_write(&bb, &ptr, array, NumWriters, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_write(&bb, &ptr, array, NumWriters, comm)) {
         endrun(0, "Failed to write :%s\n", big_file_get_error_message());
     }
 
     if(verbose && size > 0)
         message(0, "Done writing %td particles to %d Files\n", size, NumFiles);
 
-    if(0 != big_block_mpi_close(&bb, MPI_COMM_WORLD)) {
+    if(0 != big_block_mpi_close(&bb, comm)) {
         endrun(0, "Failed to close block at %s:%s\n", blockname,
                 big_file_get_error_message());
     }
 }
 
+/* Largest number of bytes the aggregator gathers or scatters in one round*/
+#define IO_AGGREGATOR_CHUNK_BYTES (256L * 1024 * 1024)
+
+/* Number of rows of each rank of the group, known to all ranks of the group.
+ * Returns the total number of rows of the group.*/
+static int64_t
+petaio_aggregator_layout(int64_t nlocal, int64_t * counts)
+{
+    int GroupSize, i;
+    MPI_Comm_size(IOGroup, &GroupSize);
+    MPI_Allgather(&nlocal, 1, MPI_INT64, counts, 1, MPI_INT64, IOGroup);
+    int64_t total = 0;
+    for(i = 0; i < GroupSize; i++)
+        total += counts[i];
+    return total;
+}
+
+/* Number of rows of rowsize bytes the aggregator handles in one round: at most IO_AGGREGATOR_CHUNK_BYTES,
+ * and at most half of the free main memory, which is bounded by MaxMemSizePerNode.*/
+static int64_t
+petaio_aggregator_chunk(const int64_t total, const size_t rowsize)
+{
+    int64_t chunk = 0;
+    if(IOLeaders != MPI_COMM_NULL) {
+        size_t bytes = IO_AGGREGATOR_CHUNK_BYTES;
+        if(bytes > mymalloc_freebytes() / 2)
+            bytes = mymalloc_freebytes() / 2;
+        chunk = bytes / rowsize;
+        if(chunk < 1)
+            endrun(1, "No memory on the I/O aggregator for a row of %td bytes: %td bytes free.\n", rowsize, mymalloc_freebytes());
+        if(chunk > total)
+            chunk = total;
+    }
+    MPI_Bcast(&chunk, 1, MPI_INT64, 0, IOGroup);
+    return chunk;
+}
+
+/* Counts and displacements on the aggregator of the rows of each rank in the round of group rows
+ * [start, start + n). Returns the number of rows of this rank in the round, from local row *first.*/
+static int
+petaio_aggregator_round(const int64_t * counts, const int64_t start, const int64_t n, int * rcounts, int * rdispls, int64_t * first)
+{
+    int GroupSize, ThisRank, i, mycount = 0;
+    MPI_Comm_size(IOGroup, &GroupSize);
+    MPI_Comm_rank(IOGroup, &ThisRank);
+    int64_t offset = 0;
+    *first = 0;
+    for(i = 0; i < GroupSize; i++) {
+        const int64_t lo = offset > start ? offset : start;
+        const int64_t hi = offset + counts[i] < start + n ? offset + counts[i] : start + n;
+        rcounts[i] = hi > lo ? hi - lo : 0;
+        rdispls[i] = hi > lo ? lo - start : 0;
+        if(i == ThisRank) {
+            mycount = rcounts[i];
+            if(mycount > 0)
+                *first = lo - offset;
+        }
+        offset += counts[i];
+    }
+    return mycount;
+}
+
+/* read a block from disk, spread the values to memory with setters  */
+int petaio_read_block(BigFile * bf, char * blockname, BigArray * array, int required) {
+    if(IOGroup == MPI_COMM_NULL || !petaio_array_is_contiguous(array))
+        return petaio_read_block_comm(bf, blockname, array, required, MPI_COMM_WORLD);
+
+    /* The aggregator reads the rows of its group in rounds of bounded size, scattering each*/
+    int GroupSize;
+    MPI_Comm_size(IOGroup, &GroupSize);
+    int64_t * counts = ta_malloc("IOCounts", int64_t, GroupSize);
+    int * rcounts = ta_malloc("IORoundCounts", int, GroupSize);
+    int * rdispls = ta_malloc("IORoundDispls", int, GroupSize);
+    const size_t rowsize = array->strides[0];
+    const int64_t total = petaio_aggregator_layout(array->dims[0], counts);
+    const int64_t chunk = petaio_aggregator_chunk(total, rowsize);
+
+    MPI_Datatype rowtype;
+    MPI_Type_contiguous(rowsize, MPI_BYTE, &rowtype);
+    MPI_Type_commit(&rowtype);
+
+    BigBlock bb;
+    BigBlockPtr ptr;
+    int64_t offset = 0;
+    double QuantizeStep = 0;
+    int missing = 0;
+    if(IOLeaders != MPI_COMM_NULL) {
+        if(0 != big_file_mpi_open_block(bf, &bb, blockname, IOLeaders)) {
+            if(required)
+                endrun(0, "Failed to open block at %s:%s\n", blockname, big_file_get_error_message());
+            missing = 1;
+        }
+        else {
+            MPI_Exscan(&total, &offset, 1, MPI_INT64, MPI_SUM, IOLeaders);
+            int LeaderRank;
+            MPI_Comm_rank(IOLeaders, &LeaderRank);
+            if(LeaderRank == 0)
+                offset = 0;
+            if(0 != big_block_get_attr(&bb, "QuantizeStep", &QuantizeStep, "f8", 1))
+                QuantizeStep = 0;
+        }
+    }
+    MPI_Bcast(&missing, 1, MPI_INT, 0, IOGroup);
+    if(missing) {
+        MPI_Type_free(&rowtype);
+        ta_free(rdispls);
+        ta_free(rcounts);
+        ta_free(counts);
+        return missing;
+    }
+
+    char * data = NULL;
+    int32_t * q = NULL;
+    char kind;
+    const int size = petaio_dtype_kind(array->dtype, &kind);
+    if(IOLeaders != MPI_COMM_NULL && chunk > 0) {
+        data = mymalloc("IOAggregated", chunk * rowsize);
+        if(QuantizeStep > 0) {
+            if(kind != 'f')
+                endrun(1, "Block %s is quantized but is read as %s\n", blockname, array->dtype);
+            q = mymalloc("IOQuantized", chunk * array->dims[1] * sizeof(int32_t));
+        }
+    }
+
+    int64_t start;
+    for(start = 0; start < total; start += chunk) {
+        const int64_t n = total - start < chunk ? total - start : chunk;
+        if(IOLeaders != MPI_COMM_NULL) {
+            BigArray agg = {0};
+            size_t dims[2] = {n, array->dims[1]};
+            big_array_init(&agg, data, array->dtype, 2, dims, array->strides);
+            int rt;
+            if(q) {
+                ptrdiff_t qstrides[2] = {sizeof(int32_t) * dims[1], sizeof(int32_t)};
+                BigArray qarray = {0};
+                big_array_init(&qarray, q, "=i4", 2, dims, qstrides);
+                rt = big_block_seek(&bb, &ptr, offset + start) || big_block_read(&bb, &ptr, &qarray);
+                if(!rt)
+                    petaio_dequantize(q, &agg, QuantizeStep, size);
+            }
+            else
+                rt = big_block_seek(&bb, &ptr, offset + start) || big_block_read(&bb, &ptr, &agg);
+            if(rt)
+                endrun(1, "Failed to read from block %s: %s\n", blockname, big_file_get_error_message());
+        }
+        int64_t first;
+        const int mycount = petaio_aggregator_round(counts, start, n, rcounts, rdispls, &first);
+        MPI_Scatterv(data, rcounts, rdispls, rowtype, (char *) array->data + first * rowsize, mycount, rowtype, 0, IOGroup);
+    }
+
+    if(q)
+        myfree(q);
+    if(data)
+        myfree(data);
+    if(IOLeaders != MPI_COMM_NULL && 0 != big_block_mpi_close(&bb, IOLeaders))
+        endrun(0, "Failed to close block at %s:%s\n", blockname, big_file_get_error_message());
+    MPI_Type_free(&rowtype);
+    ta_free(rdispls);
+    ta_free(rcounts);
+    ta_free(counts);
+    return 0;
+}
+
+/* save a block to disk, recording the quantization step if it is not zero */
+static void
+petaio_save_block_quantized(BigFile * bf, char * blockname, BigArray * array, double QuantizeStep, int verbose)
+{
+    if(IOGroup == MPI_COMM_NULL || !petaio_array_is_contiguous(array)) {
+        petaio_save_block_comm(bf, blockname, array, QuantizeStep, verbose, MPI_COMM_WORLD);
+        return;
+    }
+
+    /* Ship the rows to the aggregator in rounds of bounded size, and it writes each round.*/
+    int GroupSize;
+    MPI_Comm_size(IOGroup, &GroupSize);
+    int64_t * counts = ta_malloc("IOCounts", int64_t, GroupSize);
+    int * rcounts = ta_malloc("IORoundCounts", int, GroupSize);
+    int * rdispls = ta_malloc("IORoundDispls", int, GroupSize);
+    const size_t rowsize = array->strides[0];
+    const int64_t total = petaio_aggregator_layout(array->dims[0], counts);
+    const int64_t chunk = petaio_aggregator_chunk(total, rowsize);
+
+    MPI_Datatype rowtype;
+    MPI_Type_contiguous(rowsize, MPI_BYTE, &rowtype);
+    MPI_Type_commit(&rowtype);
+
+    BigBlock bb;
+    BigBlockPtr ptr;
+    int64_t offset = 0;
+    int NumFiles, NumWriters;
+    char * data = NULL;
+    if(IOLeaders != MPI_COMM_NULL) {
+        petaio_create_block_comm(bf, &bb, blockname, array, total, QuantizeStep, verbose, IOLeaders, &NumFiles, &NumWriters);
+        MPI_Exscan(&total, &offset, 1, MPI_INT64, MPI_SUM, IOLeaders);
+        int LeaderRank;
+        MPI_Comm_rank(IOLeaders, &LeaderRank);
+        if(LeaderRank == 0)
+            offset = 0;
+        if(chunk > 0)
+            data = mymalloc("IOAggregated", chunk * rowsize);
+    }
+
+    int64_t start;
+    for(start = 0; start < total; start += chunk) {
+        const int64_t n = total - start < chunk ? total - start : chunk;
+        int64_t first;
+        const int mycount = petaio_aggregator_round(counts, start, n, rcounts, rdispls, &first);
+        MPI_Gatherv((char *) array->data + first * rowsize, mycount, rowtype, data, rcounts, rdispls, rowtype, 0, IOGroup);
+        if(IOLeaders != MPI_COMM_NULL) {
+            BigArray agg = {0};
+            size_t dims[2] = {n, array->dims[1]};
+            big_array_init(&agg, data, array->dtype, 2, dims, array->strides);
+            if(0 != big_block_seek(&bb, &ptr, offset + start) || 0 != big_block_write(&bb, &ptr, &agg))
+                endrun(0, "Failed to write block %s: %s\n", blockname, big_file_get_error_message());
+        }
+    }
+    MPI_Type_free(&rowtype);
+
+    if(IOLeaders != MPI_COMM_NULL) {
+        if(data)
+            myfree(data);
+        if(0 != big_block_mpi_close(&bb, IOLeaders))
+            endrun(0, "Failed to close block at %s:%s\n", blockname, big_file_get_error_message());
+    }
+    ta_free(rdispls);
+    ta_free(rcounts);
+    ta_free(counts);
+}
+
+/* save a block to disk */
+void petaio_save_block(BigFile * bf, char * blockname, BigArray * array, int verbose)
+{
+    petaio_save_block_quantized(bf, blockname, array, 0, verbose);
+}
+
+/* Number of files for a block of size items of elsize bytes,
+ * and the number of concurrent writers to use for it.*/
+static int
+petaio_block_nfiles(size_t size, int elsize, int * NumWriters)
+{
+    int NumFiles;
+    *NumWriters = All.IO.NumWriters;
+
+    if(All.IO.EnableAggregatedIO) {
+        NumFiles = (size * elsize + All.IO.BytesPerFile - 1) / All.IO.BytesPerFile;
+        if(*NumWriters > NumFiles * All.IO.WritersPerFile) {
+            *NumWriters = NumFiles * All.IO.WritersPerFile;
+            message(0, "Throttling NumWriters to %d.\n", *NumWriters);
+        }
+        if(*NumWriters < All.IO.MinNumWriters) {
+            *NumWriters = All.IO.MinNumWriters;
+            NumFiles = (*NumWriters + All.IO.WritersPerFile - 1) / All.IO.WritersPerFile ;
+            message(0, "Throttling NumWriters to %d.\n", *NumWriters);
+        }
+    } else {
+        NumFiles = *NumWriters;
+    }
+    /*Do not write empty files*/
+    if(size == 0) {
+        NumFiles = 0;
+    }
+    return NumFiles;
+}
+
 /*
  * register an IO block of name for particle type ptype.
  *
@@ -702,6 +2596,11 @@ void io_register_io_block(char * name,
     ent->setter = setter;
     ent->items = items;
     ent->required = required;
+    ent->compress = IO_COMPRESS_NONE;
+    ent->tolerance = 0;
+    ent->direct_offset = -1;
+    ent->direct_slot = 0;
+    ent->constant = 0;
     IOTable->used ++;
 }
 
@@ -884,10 +2783,112 @@ static int order_by_type(const void *a, const void *b)
     return 0;
 }
 
+/* Choose the compression of the snapshot blocks from the parameters*/
+static void
+petaio_set_compression(struct IOTable * IOTable)
+{
+    int i;
+    for(i = 0; i < IOTable->used; i ++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        if(All.IO.CompressIntegers && (ent->dtype[0] == 'u' || ent->dtype[0] == 'i'))
+            ent->compress = IO_COMPRESS_INTEGERS;
+        if(ent->dtype[0] != 'f')
+            continue;
+        /* Fields which are not read back on restart*/
+        if(All.IO.OutputTolerance > 0 && ent->setter == NULL) {
+            ent->compress = IO_COMPRESS_QUANTIZE;
+            ent->tolerance = All.IO.OutputTolerance;
+        }
+    }
+}
+
+/* Quantize the velocities of a table which is only written for analysis.
+ * Not done in petaio_set_compression, as the velocities of a restart snapshot must be exact.*/
+void
+petaio_set_output_compression(struct IOTable * IOTable)
+{
+    int i;
+    if(All.IO.VelocityTolerance <= 0)
+        return;
+    for(i = 0; i < IOTable->used; i ++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        if(ent->dtype[0] == 'f' && !strcmp(ent->name, "Velocity")) {
+            ent->compress = IO_COMPRESS_QUANTIZE;
+            ent->tolerance = All.IO.VelocityTolerance;
+        }
+    }
+}
+
+/* Mark the blocks which do not change after a particle is created with its type.
+ * Particles change type only through slots_convert, which takes them out of the delta base.*/
+static void
+petaio_set_constant_blocks(struct IOTable * IOTable)
+{
+    int i;
+    for(i = 0; i < IOTable->used; i ++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        const char * name = ent->name;
+        /* Only gas loses mass to the stars it spawns*/
+        if(!strcmp(name, "Mass") && ent->ptype >= 1 && ent->ptype <= 3)
+            ent->constant = 1;
+        /* Stars and black holes do not spawn particles*/
+        if(!strcmp(name, "Generation") && (ent->ptype == 4 || ent->ptype == 5))
+            ent->constant = 1;
+        if(!strcmp(name, "StarFormationTime") || !strcmp(name, "BirthDensity"))
+            ent->constant = 1;
+    }
+}
+
+/* The bigfile dtype of a particle field, or "" if there is none*/
+#define PETAIO_FIELD_DTYPE(field) _Generic((field), float: "f4", double: "f8", uint64_t: "u8", int: "i4", unsigned char: "u1", default: "")
+/* Declares that the getter of block name for ptype (-1 for all types) copies field of stype.*/
+#define IO_DIRECT(name, ptype, stype, field, slot, IOTable) \
+    petaio_set_direct(# name, ptype, offsetof(stype, field), PETAIO_FIELD_DTYPE(((stype *) 0)->field), slot, IOTable)
+
+/* Mark the blocks which are stored in particle memory in the dtype they are written in.*/
+static void
+petaio_set_direct(const char * name, int ptype, ptrdiff_t offset, const char * dtype, int slot, struct IOTable * IOTable)
+{
+    int i;
+    for(i = 0; i < IOTable->used; i ++) {
+        IOTableEntry * ent = &IOTable->ent[i];
+        if(strcmp(ent->name, name) || (ptype >= 0 && ent->ptype != ptype))
+            continue;
+        /* Eg, Mass is written as f4 but stored as double unless LOW_PRECISION is float*/
+        if(strcmp(ent->dtype, dtype))
+            continue;
+        ent->direct_offset = offset;
+        ent->direct_slot = slot;
+    }
+}
+
+static void
+petaio_set_direct_blocks(struct IOTable * IOTable)
+{
+    IO_DIRECT(Mass, -1, struct particle_data, Mass, 0, IOTable);
+    IO_DIRECT(ID, -1, struct particle_data, ID, 0, IOTable);
+    IO_DIRECT(Generation, -1, struct particle_data, Generation, 0, IOTable);
+    IO_DIRECT(SmoothingLength, -1, struct particle_data, Hsml, 0, IOTable);
+    IO_DIRECT(Density, 0, struct sph_particle_data, Density, 1, IOTable);
+    IO_DIRECT(EgyWtDensity, 0, struct sph_particle_data, EgyWtDensity, 1, IOTable);
+    IO_DIRECT(ElectronAbundance, 0, struct sph_particle_data, Ne, 1, IOTable);
+    IO_DIRECT(DelayTime, 0, struct sph_particle_data, DelayTime, 1, IOTable);
+    IO_DIRECT(Metallicity, 0, struct sph_particle_data, Metallicity, 1, IOTable);
+    IO_DIRECT(StarFormationTime, 4, struct star_particle_data, FormationTime, 1, IOTable);
+    IO_DIRECT(BirthDensity, 4, struct star_particle_data, BirthDensity, 1, IOTable);
+    IO_DIRECT(Metallicity, 4, struct star_particle_data, Metallicity, 1, IOTable);
+    IO_DIRECT(StarFormationTime, 5, struct bh_particle_data, FormationTime, 1, IOTable);
+    IO_DIRECT(BlackholeMass, 5, struct bh_particle_data, Mass, 1, IOTable);
+    IO_DIRECT(BlackholeAccretionRate, 5, struct bh_particle_data, Mdot, 1, IOTable);
+    IO_DIRECT(BlackholeMinPotPos, 5, struct bh_particle_data, MinPotPos[0], 1, IOTable);
+    IO_DIRECT(BlackholeJumpToMinPot, 5, struct bh_particle_data, JumpToMinPot, 1, IOTable);
+}
+
 void register_io_blocks(struct IOTable * IOTable) {
     int i;
     IOTable->used = 0;
     IOTable->allocated = 100;
+    IOTable->Delta = 0;
     IOTable->ent = mymalloc2("IOTable", IOTable->allocated * sizeof(IOTableEntry));
     /* Bare Bone Gravity*/
     for(i = 0; i < 6; i ++) {
@@ -945,6 +2946,10 @@ void register_io_blocks(struct IOTable * IOTable) {
     /* Marks whether a BH particle has been swallowed*/
     IO_REG_NONFATAL(Swallowed, "u1", 1, 5, IOTable);
 
+    petaio_set_direct_blocks(IOTable);
+    petaio_set_compression(IOTable);
+    petaio_set_constant_blocks(IOTable);
+
     /*Sort IO blocks so similar types are together; then ordered by the sequence they are declared. */
     qsort_openmp(IOTable->ent, IOTable->used, sizeof(struct IOTableEntry), order_by_type);
 }
@@ -980,6 +2985,9 @@ void register_debug_io_blocks(struct IOTable * IOTable)
     IO_REG_WRONLY(DhsmlEgyDensityFactor,       "f4", 1, 0, IOTable);
     IO_REG_WRONLY(DivVel,       "f4", 1, 0, IOTable);
     IO_REG_WRONLY(CurlVel,       "f4", 1, 0, IOTable);
+
+    petaio_set_compression(IOTable);
+
     /*Sort IO blocks so similar types are together; then ordered by the sequence they are declared. */
     qsort_openmp(IOTable->ent, IOTable->used, sizeof(struct IOTableEntry), order_by_type);
 }
@@ -988,3 +2996,27 @@ void destroy_io_blocks(struct IOTable * IOTable) {
     myfree(IOTable->ent);
     IOTable->allocated = 0;
 }
+
+void petaio_select_io_blocks(struct IOTable * IOTable, const char * names)
+{
+    /* Match ",name," against the list with spaces removed and commas at both ends*/
+    char * list = fastpm_strdup_printf(",%s,", names);
+    char * c, * d;
+    for(c = d = list; *c; c++)
+        if(*c != ' ')
+            *d++ = *c;
+    *d = '\0';
+    if(!strcmp(list, ",,")) {
+        myfree(list);
+        return;
+    }
+    int i, used = 0;
+    for(i = 0; i < IOTable->used; i ++) {
+        char * key = fastpm_strdup_printf(",%s,", IOTable->ent[i].name);
+        if(strstr(list, key))
+            IOTable->ent[used++] = IOTable->ent[i];
+        myfree(key);
+    }
+    IOTable->used = used;
+    myfree(list);
+}
@@ -5,11 +5,24 @@
 #include "bigfile.h"
 #include "partmanager.h"
 #include "slotsmanager.h"
+#include "domain.h"
 
 typedef void (*property_getter) (int i, void * result, void * baseptr, void * slotptr);
 typedef void (*property_setter) (int i, void * target, void * baseptr, void * slotptr);
 typedef int (*petaio_selection) (int i);
 
+/* How a block is encoded on disk. Readers decode transparently in petaio_read_block.*/
+enum IOCompression {
+    IO_COMPRESS_NONE = 0,
+    /* Lossless: integers are stored in the narrowest type holding the range of the block.*/
+    IO_COMPRESS_INTEGERS = 1,
+    /* Lossy: floats are rounded to multiples of 2 * tolerance and stored as 2-byte integers,
+     * so the error is at most tolerance. Blocks whose range needs more bits are stored as they are.*/
+    IO_COMPRESS_QUANTIZE = 2,
+    /* Lossy: double precision floats are stored in single precision.*/
+    IO_COMPRESS_FLOAT32 = 3,
+};
+
 typedef struct IOTableEntry {
     int zorder;
     char name[64];
@@ -19,12 +32,25 @@ typedef struct IOTableEntry {
     int required;
     property_getter getter;
     property_setter setter;
+    enum IOCompression compress;
+    /* Maximum absolute error for IO_COMPRESS_QUANTIZE*/
+    double tolerance;
+    /* If >= 0, the getter copies the field at this byte offset of struct particle_data
+     * (direct_slot = 0) or of the slot of ptype (direct_slot = 1) without conversion,
+     * so the block may be written straight from particle memory.*/
+    ptrdiff_t direct_offset;
+    int direct_slot;
+    /* If true, the field does not change after a particle is created with its type,
+     * so a delta snapshot only writes it for the particles not in the full snapshot it refers to.*/
+    int constant;
 } IOTableEntry;
 
 struct IOTable {
     IOTableEntry * ent;
     int used;
     int allocated;
+    /* If true, write a delta snapshot on the last full snapshot. Set by petaio_make_delta.*/
+    int Delta;
 };
 
 #define PTYPE_FOF_GROUP  1024
@@ -33,8 +59,12 @@ struct IOTable {
 void register_io_blocks(struct IOTable * IOTable);
 /* Write (but don't read) some extra output blocks useful for debugging the particle structure*/
 void register_debug_io_blocks(struct IOTable * IOTable);
+/* Quantize the velocities with SnapshotVelocityTolerance. Only for tables which are never read on restart.*/
+void petaio_set_output_compression(struct IOTable * IOTable);
 /* Free the entries in the IOTable.*/
 void destroy_io_blocks(struct IOTable * IOTable);
+/* Keep only the blocks named in the comma separated list names. An empty list keeps all blocks.*/
+void petaio_select_io_blocks(struct IOTable * IOTable, const char * names);
 
 void petaio_init();
 void petaio_alloc_buffer(BigArray * array, IOTableEntry * ent, int64_t npartLocal);
@@ -46,9 +76,76 @@ void petaio_save_block(BigFile * bf, char * blockname, BigArray * array, int ver
 int petaio_read_block(BigFile * bf, char * blockname, BigArray * array, int required);
 
 void petaio_save_snapshot(struct IOTable * IOTable, int verbose, const char *fmt, ...);
+/* Like petaio_save_snapshot, but the blocks are copied to staging memory outside the main
+ * allocator and written by a helper thread, so the caller may continue with the simulation.
+ * Waits for any earlier asynchronous snapshot first. Collective.*/
+void petaio_save_snapshot_async(struct IOTable * IOTable, int verbose, const char *fmt, ...);
+/* Wait for the asynchronous snapshot to be written, then close it and free the staging memory.
+ * Returns 1 if there was a snapshot to finish, 0 otherwise. Collective.*/
+int petaio_async_wait(void);
+/* Copy the complete snapshot src, written to a local or burst buffer directory, to dst with a helper
+ * thread on each rank, so the caller may continue with the simulation. Marks the local copy complete
+ * with the file src.complete, which restarts check to read src instead of dst.
+ * Waits for any earlier copy first. Collective.*/
+void petaio_drain_start(const char * src, const char * dst);
+/* Wait for the copy started by petaio_drain_start to finish.
+ * Returns 1 if there was a copy to finish, 0 otherwise. Collective.*/
+int petaio_drain_wait(void);
+/* Reads snapshot num, which may be a delta snapshot: its constant blocks are then
+ * completed from the full snapshot it refers to, matching the particles by ID.*/
 void petaio_read_snapshot(int num, MPI_Comm Comm);
+/* Delta snapshots write the constant blocks only for the particles which are not in the last
+ * full snapshot, and record its number as the DeltaBase attribute of their Header.
+ * Turn IOTable into a delta snapshot table. Returns 0, leaving the table unchanged,
+ * if there is no full snapshot to refer to.*/
+int petaio_make_delta(struct IOTable * IOTable);
+/* Record that snapshot num was written in full, so later delta snapshots refer to it.*/
+void petaio_set_delta_base(int num);
+/* Add the domain decomposition and the number of particles of each type on each rank
+ * to a snapshot written with petaio_save_snapshot(_async). Collective.*/
+void petaio_save_domain(const DomainDecomp * ddecomp, const char *fmt, ...);
+/* Restore the domain decomposition saved in snapshot num, if SnapshotWithDomain is set,
+ * the snapshot has one and it was written by the same number of ranks.
+ * petaio_read_snapshot has then given each rank the particles it had when the snapshot was written.
+ * Returns 1 if the domain was restored. Collective.*/
+int petaio_read_domain(int num, DomainDecomp * ddecomp, MPI_Comm Comm);
 void petaio_read_header(int num);
 
+/* Readers of part of a snapshot written with SnapshotPeanoOrder. They are not collective.
+ * The rows of particles of type ptype in the box from lo to hi, or with keys from StartKey up to EndKey,
+ * are returned as *nranges pairs of first and last + 1 row in *ranges, allocated with mymalloc.
+ * The rows are those of every coarse Peano cell touching the region, so may include particles outside it.
+ * Returns the number of ranges, or -1 if the snapshot has no index.*/
+int64_t petaio_key_index_box(BigFile * bf, int ptype, const double * lo, const double * hi, int64_t ** ranges);
+int64_t petaio_key_index_keys(BigFile * bf, int ptype, const peano_t StartKey, const peano_t EndKey, int64_t ** ranges);
+/* Read the rows in the ranges of a block into array, allocated with mymalloc, in the type stored on disk.
+ * Quantized blocks are read as integers, to be multiplied by their QuantizeStep attribute.
+ * Returns the number of rows read.*/
+int64_t petaio_read_block_ranges(BigFile * bf, char * blockname, const int64_t * ranges, const int64_t nranges, BigArray * array);
+
+/* The header of initial conditions made in memory, with the fields petaio_read_header reads from an IC file.*/
+struct ICHeader {
+    int64_t NTotal[6];
+    double MassTable[6];
+    double BoxSize;
+    double Time;
+    double UnitVelocity_in_cm_per_s;
+    double UnitLength_in_cm;
+    double UnitMass_in_g;
+    int UsePeculiarVelocity;
+};
+/* Fills the header of the initial conditions.*/
+typedef void (*petaio_ic_header)(struct ICHeader * header);
+/* Makes the particles of the initial conditions: calls petaio_alloc_particles,
+ * then sets the type, position, velocity and ID of each particle, as in an IC file.*/
+typedef void (*petaio_ic_particles)(MPI_Comm Comm);
+/* Make the initial conditions in memory with these functions, instead of reading InitCondFile.
+ * petaio_read_header(-1) and petaio_read_snapshot(-1) then call them.*/
+void petaio_set_ic_generator(petaio_ic_header header, petaio_ic_particles particles);
+/* Allocate the particle and slot memory for NLocal particles of each type on this rank,
+ * ordered by type, and set the type of each particle. Collective.*/
+void petaio_alloc_particles(const int * NLocal, MPI_Comm Comm);
+
 void
 petaio_build_selection(int * selection,
     int * ptype_offset,
@@ -11,20 +11,30 @@
 #include "utils.h"
 #include "walltime.h"
 
+#ifdef PETAPM_SINGLE
+#define PFFT(name) pfftf_ ## name
+#else
+#define PFFT(name) pfft_ ## name
+#endif
+
 static void
 layout_prepare(PetaPM * pm,
                struct Layout * L,
-               double * meshbuf,
+               PetaPMReal * meshbuf,
                PetaPMRegion * regions,
                const int Nregions,
                MPI_Comm comm);
 static void layout_finish(struct Layout * L);
-static void layout_build_and_exchange_cells_to_pfft(PetaPM * pm, struct Layout * L, double * meshbuf, double * real);
-static void layout_build_and_exchange_cells_to_local(PetaPM * pm, struct Layout * L, double * meshbuf, double * real);
+static void layout_cache_free(PetaPM * pm);
+static void layout_build_and_exchange_cells_to_pfft(PetaPM * pm, struct Layout * L, PetaPMReal * meshbuf, PetaPMReal * real);
+static void layout_start_exchange_cells_to_pfft(PetaPM * pm, struct Layout * L, PetaPMReal * meshbuf);
+static void layout_finish_exchange_cells_to_pfft(PetaPM * pm, struct Layout * L, PetaPMReal * real);
+static void layout_build_and_exchange_cells_to_local(PetaPM * pm, struct Layout * L, PetaPMReal * meshbuf, PetaPMReal * real);
+static PetaPMReal * layout_exchange_batch_to_local(PetaPM * pm, struct Layout * L, PetaPMReal * real, const int ncomp);
 
-/* cell_iterator needs to be thread safe !*/
-typedef void (* cell_iterator)(double * cell_value, double * comm_buffer);
-static void layout_iterate_cells(PetaPM * pm, struct Layout * L, cell_iterator iter, double * real);
+/* cell_iterator needs to be thread safe ! Cells have ncomp interleaved components.*/
+typedef void (* cell_iterator)(PetaPMReal * cell_value, PetaPMReal * comm_buffer, const int ncomp);
+static void layout_iterate_cells(PetaPM * pm, struct Layout * L, cell_iterator iter, PetaPMReal * real, const int ncomp);
 
 struct Pencil { /* a pencil starting at offset, with lenght len */
     int offset[3];
@@ -38,19 +48,19 @@ static int pos_get_target(PetaPM * pm, const int pos[2]);
 
 /* FIXME: move this to MPIU_. */
 static int64_t reduce_int64(int64_t input, MPI_Comm comm);
-#ifdef DEBUG
 /* for debugging */
-static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, const size_t meshsize);
-#endif
+static void verify_density_field(PetaPM * pm, PetaPMReal * real, PetaPMReal * meshbuf, const size_t meshsize);
+/* Verify the density field of the next force calculations. Always on in DEBUG builds.*/
+static int VerifyDensity;
 
 static MPI_Datatype MPI_PENCIL;
 
 /*Used only in MP-GenIC*/
-pfft_complex *
+PetaPMComplex *
 petapm_alloc_rhok(PetaPM * pm)
 {
-    pfft_complex * rho_k = (pfft_complex * ) mymalloc("PMrho_k", pm->priv->fftsize * sizeof(double));
-    memset(rho_k, 0, pm->priv->fftsize * sizeof(double));
+    PetaPMComplex * rho_k = (PetaPMComplex * ) mymalloc("PMrho_k", pm->priv->fftsize * sizeof(PetaPMReal));
+    memset(rho_k, 0, pm->priv->fftsize * sizeof(PetaPMReal));
     return rho_k;
 }
 
@@ -82,9 +92,9 @@ int *petapm_get_ntask2d(PetaPM * pm) {
 void
 petapm_module_init(int Nthreads)
 {
-    pfft_init();
+    PFFT(init)();
 
-    pfft_plan_with_nthreads(Nthreads);
+    PFFT(plan_with_nthreads)(Nthreads);
 
     /* initialize the MPI Datatype of pencil */
     MPI_Type_contiguous(sizeof(struct Pencil), MPI_BYTE, &MPI_PENCIL);
@@ -93,12 +103,43 @@ petapm_module_init(int Nthreads)
 
 void
 petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm)
+{
+    petapm_init_subset(pm, BoxSize, Asmth, Nmesh, G, comm, 0);
+}
+
+/* Ranks of comm that hold part of the FFT mesh: the first rank of each of NTaskFFT
+ * equal blocks of comm, so that they land on different nodes. Rank 0 is always one of them.*/
+static int
+pm_is_fft_task(int task, int NTask, int NTaskFFT)
+{
+    return task == 0 || (int64_t) task * NTaskFFT / NTask != (int64_t) (task - 1) * NTaskFFT / NTask;
+}
+
+static inline int
+pm_has_fft(PetaPM * pm)
+{
+    return pm->priv->comm_cart_2d != MPI_COMM_NULL;
+}
+
+static void pm_report_mesh_memory(PetaPM * pm);
+
+/* As petapm_init, but the FFTs run on NTaskFFT ranks of comm only (all ranks if NTaskFFT <= 0).
+ * All ranks paint and read out their particles; the cells travel to and from
+ * the FFT ranks in the region layout exchange, which is the only all-to-all on comm.
+ * The transposes of the FFT run on the smaller communicator.*/
+void
+petapm_init_subset(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm, int NTaskFFT)
 {
     /* define the global long / short range force cut */
     pm->BoxSize = BoxSize;
     pm->Asmth = Asmth;
     pm->Nmesh = Nmesh;
     pm->G = G;
+    pm->priv->nbatch = 0;
+    pm->priv->InPlace = 0;
+    pm->priv->UseLayoutCache = 0;
+    pm->AssignmentOrder = 2;
+    pm->Interlace = 0;
     pm->CellSize = BoxSize / Nmesh;
     pm->comm = comm;
 
@@ -114,30 +155,48 @@ petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_
     MPI_Comm_rank(comm, &ThisTask);
     MPI_Comm_size(comm, &NTask);
 
+    if(NTaskFFT <= 0 || NTaskFFT > NTask)
+        NTaskFFT = NTask;
+    MPI_Comm comm_fft;
+    MPI_Comm_split(comm, pm_is_fft_task(ThisTask, NTask, NTaskFFT) ? 0 : MPI_UNDEFINED, ThisTask, &comm_fft);
+
     /* try to find a square 2d decomposition */
     int i;
     int k;
-    for(i = sqrt(NTask) + 1; i >= 0; i --) {
-        if(NTask % i == 0) break;
+    for(i = sqrt(NTaskFFT) + 1; i >= 0; i --) {
+        if(NTaskFFT % i == 0) break;
     }
     np[0] = i;
-    np[1] = NTask / i;
-
-    message(0, "Using 2D Task mesh %td x %td \n", np[0], np[1]);
-    if( pfft_create_procmesh_2d(comm, np[0], np[1], &pm->priv->comm_cart_2d) ){
-        endrun(0, "Error: This test file only works with %td processes.\n", np[0]*np[1]);
+    np[1] = NTaskFFT / i;
+
+    message(0, "Using 2D Task mesh %td x %td on %d of %d ranks\n", np[0], np[1], NTaskFFT, NTask);
+    pm->priv->comm_cart_2d = MPI_COMM_NULL;
+    pm->priv->fftsize = 0;
+    pm->NTask2d[0] = np[0];
+    pm->NTask2d[1] = np[1];
+    pm->ThisTask2d[0] = pm->ThisTask2d[1] = -1;
+    for(k = 0; k < 3; k ++) {
+        pm->real_space_region.offset[k] = pm->real_space_region.size[k] = 0;
+        pm->fourier_space_region.offset[k] = pm->fourier_space_region.size[k] = 0;
     }
 
-    int periods_unused[2];
-    MPI_Cart_get(pm->priv->comm_cart_2d, 2, pm->NTask2d, periods_unused, pm->ThisTask2d);
+    if(comm_fft != MPI_COMM_NULL) {
+        if( PFFT(create_procmesh_2d)(comm_fft, np[0], np[1], &pm->priv->comm_cart_2d) ){
+            endrun(0, "Error: This test file only works with %td processes.\n", np[0]*np[1]);
+        }
+        MPI_Comm_free(&comm_fft);
 
-    if(pm->NTask2d[0] != np[0]) abort();
-    if(pm->NTask2d[1] != np[1]) abort();
+        int periods_unused[2];
+        MPI_Cart_get(pm->priv->comm_cart_2d, 2, pm->NTask2d, periods_unused, pm->ThisTask2d);
 
-    pm->priv->fftsize = 2 * pfft_local_size_dft_r2c_3d(n, pm->priv->comm_cart_2d,
-           PFFT_TRANSPOSED_OUT,
-           pm->real_space_region.size, pm->real_space_region.offset,
-           pm->fourier_space_region.size, pm->fourier_space_region.offset);
+        if(pm->NTask2d[0] != np[0]) abort();
+        if(pm->NTask2d[1] != np[1]) abort();
+
+        pm->priv->fftsize = 2 * PFFT(local_size_dft_r2c_3d)(n, pm->priv->comm_cart_2d,
+               PFFT_TRANSPOSED_OUT,
+               pm->real_space_region.size, pm->real_space_region.offset,
+               pm->fourier_space_region.size, pm->fourier_space_region.offset);
+    }
 
     /*
      * In fourier space, the transposed array is ordered in
@@ -165,16 +224,18 @@ petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_
 
     /* planning the fft; need temporary arrays */
 
-    double * real = (double * ) mymalloc("PMreal", pm->priv->fftsize * sizeof(double));
-    pfft_complex * rho_k = (pfft_complex * ) mymalloc("PMrho_k", pm->priv->fftsize * sizeof(double));
-    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
-
-    pm->priv->plan_forw = pfft_plan_dft_r2c_3d(
-        n, real, rho_k, pm->priv->comm_cart_2d, PFFT_FORWARD,
-        PFFT_TRANSPOSED_OUT | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
-    pm->priv->plan_back = pfft_plan_dft_c2r_3d(
-        n, complx, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
-        PFFT_TRANSPOSED_IN | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+    PetaPMReal * real = (PetaPMReal * ) mymalloc("PMreal", pm->priv->fftsize * sizeof(PetaPMReal));
+    PetaPMComplex * rho_k = (PetaPMComplex * ) mymalloc("PMrho_k", pm->priv->fftsize * sizeof(PetaPMReal));
+    PetaPMComplex * complx = (PetaPMComplex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(PetaPMReal));
+
+    if(pm_has_fft(pm)) {
+        pm->priv->plan_forw = PFFT(plan_dft_r2c_3d)(
+            n, real, rho_k, pm->priv->comm_cart_2d, PFFT_FORWARD,
+            PFFT_TRANSPOSED_OUT | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+        pm->priv->plan_back = PFFT(plan_dft_c2r_3d)(
+            n, complx, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
+            PFFT_TRANSPOSED_IN | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+    }
 
     myfree(complx);
     myfree(rho_k);
@@ -210,14 +271,174 @@ petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_
         */
     }
     myfree(tmp);
+
+    /* the rank in comm of each FFT task, in the row major order of the 2d task mesh */
+    pm->priv->Task2dToTask = mymalloc("Task2dToTask", sizeof(int) * NTaskFFT);
+    for(i = 0; i < NTaskFFT; i ++)
+        pm->priv->Task2dToTask[i] = -1;
+    if(pm_has_fft(pm))
+        pm->priv->Task2dToTask[pm->ThisTask2d[0] * pm->NTask2d[1] + pm->ThisTask2d[1]] = ThisTask;
+    MPI_Allreduce(MPI_IN_PLACE, pm->priv->Task2dToTask, NTaskFFT, MPI_INT, MPI_MAX, comm);
+
+    pm_report_mesh_memory(pm);
+}
+
+/* Report the size of one FFT mesh buffer on the largest rank, and how many of them
+ * a force calculation holds at once. Collective.*/
+static void
+pm_report_mesh_memory(PetaPM * pm)
+{
+    int64_t fftsize = pm->priv->fftsize;
+    MPI_Allreduce(MPI_IN_PLACE, &fftsize, 1, MPI_INT64, MPI_MAX, pm->comm);
+    const double MB = fftsize * sizeof(PetaPMReal) / (1024. * 1024.);
+    /* out of place, petapm_force_c2r holds rho_k, the transferred field and its transform */
+    const int nbuf = pm->priv->InPlace ? 2 : 3;
+    message(0, "PetaPM: mesh buffers of %g MB on the largest rank, at most %d at once (%g MB)%s\n",
+            MB, nbuf, nbuf * MB, pm->priv->InPlace ? ", in place" : "");
+}
+
+/* Transform in place: the density is transformed to rho_k in its own buffer, and each field
+ * is transformed back to real space in the buffer of its transfer, so at most two meshes are held
+ * at once instead of three. The real space mesh is padded along z to 2 (Nmesh / 2 + 1) cells,
+ * as an in-place r2c needs. Not compatible with petapm_init_batch.*/
+void
+petapm_init_inplace(PetaPM * pm)
+{
+    if(pm->priv->nbatch > 1)
+        endrun(1, "In-place PM transforms do not support batched transforms\n");
+    pm->priv->InPlace = 1;
+    if(pm_has_fft(pm)) {
+        ptrdiff_t n[3] = {pm->Nmesh, pm->Nmesh, pm->Nmesh};
+        ptrdiff_t local_ni[3], local_i_start[3], local_no[3], local_o_start[3];
+        PFFT(destroy_plan)(pm->priv->plan_forw);
+        PFFT(destroy_plan)(pm->priv->plan_back);
+
+        /* the local sizes are unchanged by the padding: only the strides of the real mesh are */
+        pm->priv->fftsize = 2 * PFFT(local_size_dft_r2c_3d)(n, pm->priv->comm_cart_2d,
+               PFFT_TRANSPOSED_OUT | PFFT_PADDED_R2C,
+               local_ni, local_i_start, local_no, local_o_start);
+        PetaPMRegion * real_region = &pm->real_space_region;
+        if(real_region->size[2] != pm->Nmesh)
+            endrun(1, "In-place PM transforms need the z axis of the real mesh on one rank\n");
+        real_region->strides[2] = 1;
+        real_region->strides[1] = 2 * (pm->Nmesh / 2 + 1);
+        real_region->strides[0] = real_region->strides[1] * real_region->size[1];
+        real_region->totalsize = real_region->strides[0] * real_region->size[0];
+
+        PetaPMReal * real = (PetaPMReal * ) mymalloc("PMreal", pm->priv->fftsize * sizeof(PetaPMReal));
+        pm->priv->plan_forw = PFFT(plan_dft_r2c_3d)(
+            n, real, (PetaPMComplex *) real, pm->priv->comm_cart_2d, PFFT_FORWARD,
+            PFFT_TRANSPOSED_OUT | PFFT_PADDED_R2C | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+        pm->priv->plan_back = PFFT(plan_dft_c2r_3d)(
+            n, (PetaPMComplex *) real, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
+            PFFT_TRANSPOSED_IN | PFFT_PADDED_C2R | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+        myfree(real);
+    }
+    pm_report_mesh_memory(pm);
+}
+
+/* Plan a backward transform of nbatch interleaved fields, so that petapm_force_c2r
+ * transforms and exchanges that many fields at once. Needs memory for nbatch meshes.*/
+void
+petapm_init_batch(PetaPM * pm, int nbatch)
+{
+    if(nbatch < 2)
+        return;
+    if(pm->priv->InPlace)
+        endrun(1, "Batched PM transforms do not support in-place transforms\n");
+    ptrdiff_t n[3] = {pm->Nmesh, pm->Nmesh, pm->Nmesh};
+    ptrdiff_t local_ni[3], local_i_start[3], local_no[3], local_o_start[3];
+
+    pm->priv->nbatch = nbatch;
+    pm->priv->fftsize_batch = 0;
+    if(!pm_has_fft(pm))
+        return;
+    pm->priv->fftsize_batch = 2 * PFFT(local_size_many_dft_r2c)(3, n, n, n, nbatch,
+            PFFT_DEFAULT_BLOCKS, PFFT_DEFAULT_BLOCKS, pm->priv->comm_cart_2d,
+            PFFT_TRANSPOSED_OUT, local_ni, local_i_start, local_no, local_o_start);
+
+    PetaPMReal * real = (PetaPMReal * ) mymalloc("PMreal", pm->priv->fftsize_batch * sizeof(PetaPMReal));
+    PetaPMComplex * complx = (PetaPMComplex *) mymalloc("PMcomplex", pm->priv->fftsize_batch * sizeof(PetaPMReal));
+
+    pm->priv->plan_back_batch = PFFT(plan_many_dft_c2r)(3, n, n, n, nbatch,
+        PFFT_DEFAULT_BLOCKS, PFFT_DEFAULT_BLOCKS, complx, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
+        PFFT_TRANSPOSED_IN | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+
+    myfree(complx);
+    myfree(real);
+    message(0, "PetaPM: transforming %d fields at once to real space\n", nbatch);
+}
+
+/* Use an assignment window of the given order (2 = CIC, 3 = TSC, 4 = PCS) for painting and readout,
+ * and if interlace is true a second mesh shifted by half a cell. The transfer functions
+ * must deconvolve the window, sinc(pi kpos / Nmesh)^order along each axis.*/
+void
+petapm_init_window(PetaPM * pm, int order, int interlace)
+{
+    if(order < 2 || order > 4)
+        endrun(1, "PM assignment order %d is not supported: use 2 (CIC), 3 (TSC) or 4 (PCS)\n", order);
+    pm->AssignmentOrder = order;
+    pm->Interlace = !!interlace;
+    message(0, "PetaPM: assignment window of order %d%s\n", order, pm->Interlace ? ", interlaced" : "");
+}
+
+/* Change the side of the periodic box covered by the mesh, keeping Nmesh and the FFT plans.
+ * Used by meshes that follow a moving region.*/
+void
+petapm_set_boxsize(PetaPM * pm, double BoxSize)
+{
+    pm->BoxSize = BoxSize;
+    pm->CellSize = BoxSize / pm->Nmesh;
+}
+
+/* Keep the pencil layout between force calculations, so that it is rebuilt
+ * only when the regions change or mass moves out of the cached pencils.*/
+void
+petapm_init_layout_cache(PetaPM * pm)
+{
+    if(0 != allocator_malloc_init(pm->priv->LayoutCache, "PMLAYOUT", 0, 0, NULL))
+        endrun(1, "Could not initialize the PM layout cache\n");
+    pm->priv->UseLayoutCache = 1;
+    pm->priv->cached_Nregions = -1;
+}
+
+/* Paint the mass and interpolate the mesh to the particles on an OpenMP target device.
+ * The transfer and readout functions and the FFTs still run on the host.*/
+void
+petapm_init_offload(PetaPM * pm)
+{
+#ifndef PM_OFFLOAD
+    endrun(1, "PMOffload requires compiling with -DPM_OFFLOAD.\n");
+#endif
+    pm->priv->Offload = 1;
+}
+
+/* Read out the fields of up to PETAPM_FUSED_MAX functions in one pass over the particles,
+ * computing the assignment window of each particle once. The fields are kept in an
+ * interleaved copy of the local mesh, so this needs memory for that many local meshes.
+ * If any rank does not have it free, the fields are read out one at a time instead.
+ * Batched transforms always read out this way.*/
+void
+petapm_init_fused_readout(PetaPM * pm)
+{
+    pm->priv->FusedReadout = 1;
 }
 
 void
 petapm_destroy(PetaPM * pm)
 {
-    pfft_destroy_plan(pm->priv->plan_forw);
-    pfft_destroy_plan(pm->priv->plan_back);
-    MPI_Comm_free(&pm->priv->comm_cart_2d);
+    if(pm->priv->UseLayoutCache) {
+        layout_cache_free(pm);
+        allocator_destroy(pm->priv->LayoutCache);
+    }
+    if(pm_has_fft(pm)) {
+        PFFT(destroy_plan)(pm->priv->plan_forw);
+        PFFT(destroy_plan)(pm->priv->plan_back);
+        if(pm->priv->nbatch > 1)
+            PFFT(destroy_plan)(pm->priv->plan_back_batch);
+        MPI_Comm_free(&pm->priv->comm_cart_2d);
+    }
+    myfree(pm->priv->Task2dToTask);
     myfree(pm->Mesh2Task[0]);
 }
 
@@ -225,14 +446,22 @@ petapm_destroy(PetaPM * pm)
  * read out field to particle i, with value no need to be thread safe
  * (particle i is never done by same thread)
  * */
-typedef void (* pm_iterator)(PetaPM * pm, int i, double * mesh, double weight);
-static void pm_iterate(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions);
+typedef void (* pm_iterator)(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+/* shift is added to the particle positions in units of the cell size, norm multiplies the weights */
+static void pm_iterate(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions, const double shift, const double norm);
+/* As pm_iterate for the nf fields of functions, interleaved in mesh, with one pass over the particles*/
+static void pm_iterate_fused(PetaPM * pm, PetaPMFunctions * functions, const int nf, const PetaPMReal * mesh,
+        PetaPMRegion * regions, const double shift, const double norm);
+static void pm_set_region_buffers(PetaPM * pm, PetaPMRegion * regions, const int Nregions, PetaPMReal * meshbuf);
+/* undo or apply the half cell shift of the interlaced mesh in fourier space */
+static void pm_interlace_combine(PetaPM * pm, PetaPMComplex * dst, PetaPMComplex * shifted);
+static void pm_interlace_shift(PetaPM * pm, PetaPMComplex * value, const int dststride);
 /* apply transfer function to value, kpos array is in x, y, z order */
 static void pm_apply_transfer_function(PetaPM * pm,
-        pfft_complex * src,
-        pfft_complex * dst, petapm_transfer_func H);
+        PetaPMComplex * src,
+        PetaPMComplex * dst, const int dststride, petapm_transfer_func H);
 
-static void put_particle_to_mesh(PetaPM * pm, int i, double * mesh, double weight);
+static void pm_paint(PetaPM * pm, PetaPMRegion * regions, const int Nregions, const double shift);
 
 /*
  * 1. calls prepare to build the Regions covering particles
@@ -259,9 +488,16 @@ petapm_force_init(
     int Nregions = 0;
     PetaPMRegion * regions = prepare(pm, userdata, &Nregions);
     pm_init_regions(pm, regions, Nregions);
+    pm->priv->real_pending = NULL;
 
     walltime_measure("/PMgrav/Misc");
-    pm_iterate(pm, put_particle_to_mesh, regions);
+    pm_paint(pm, regions, Nregions, 0);
+    if(pm->Interlace) {
+        /* paint the same particles on the mesh shifted by half a cell */
+        pm_set_region_buffers(pm, regions, Nregions, pm->priv->meshbuf_shifted);
+        pm_paint(pm, regions, Nregions, 0.5);
+        pm_set_region_buffers(pm, regions, Nregions, pm->priv->meshbuf);
+    }
     walltime_measure("/PMgrav/cic");
 
     layout_prepare(pm, &pm->priv->layout, pm->priv->meshbuf, regions, Nregions, pm->comm);
@@ -270,7 +506,19 @@ petapm_force_init(
     return regions;
 }
 
-pfft_complex * petapm_force_r2c(PetaPM * pm,
+/* Post the exchange of the painted cells to the FFT layout without waiting for it.
+ * Other work, with balanced allocations, may run before petapm_force_r2c completes it.*/
+void
+petapm_force_r2c_start(PetaPM * pm)
+{
+    PetaPMReal * real = (PetaPMReal * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(PetaPMReal));
+    memset(real, 0, sizeof(PetaPMReal) * pm->priv->fftsize);
+    layout_start_exchange_cells_to_pfft(pm, &pm->priv->layout, pm->priv->meshbuf);
+    pm->priv->real_pending = real;
+    walltime_measure("/PMgrav/comm2");
+}
+
+PetaPMComplex * petapm_force_r2c(PetaPM * pm,
         PetaPMGlobalFunctions * global_functions
         ) {
     /* call pfft rho_k is CFT of rho */
@@ -280,65 +528,256 @@ pfft_complex * petapm_force_r2c(PetaPM * pm,
      * CFT = DFT * dx **3
      * CFT[rho] = DFT [rho * dx **3] = DFT[CIC]
      * */
-    double * real = (double * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(double));
-    memset(real, 0, sizeof(double) * pm->priv->fftsize);
-    layout_build_and_exchange_cells_to_pfft(pm, &pm->priv->layout, pm->priv->meshbuf, real);
+    if(!pm->priv->real_pending)
+        petapm_force_r2c_start(pm);
+    PetaPMReal * real = pm->priv->real_pending;
+    pm->priv->real_pending = NULL;
+    layout_finish_exchange_cells_to_pfft(pm, &pm->priv->layout, real);
     walltime_measure("/PMgrav/comm2");
 
-#ifdef DEBUG
-    verify_density_field(pm, real, pm->priv->meshbuf, pm->priv->meshbufsize);
-    walltime_measure("/PMgrav/Misc");
+#ifndef DEBUG
+    if(VerifyDensity)
 #endif
+    {
+        verify_density_field(pm, real, pm->priv->meshbuf, pm->priv->meshbufsize);
+        walltime_measure("/PMgrav/Misc");
+    }
+    if(global_functions->global_density)
+        global_functions->global_density(pm, real);
+
+    const int InPlace = pm->priv->InPlace;
+    PetaPMComplex * complx = InPlace ? (PetaPMComplex *) real :
+        (PetaPMComplex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(PetaPMReal));
+    if(pm_has_fft(pm))
+        PFFT(execute_dft_r2c)(pm->priv->plan_forw, real, complx);
+
+    if(pm->Interlace) {
+        /* transform the shifted mesh and average it with the first, cancelling the odd aliases */
+        PetaPMComplex * shifted = (PetaPMComplex *) mymalloc("PMshifted", pm->priv->fftsize * sizeof(PetaPMReal));
+        PetaPMReal * shifted_real = InPlace ? (PetaPMReal *) shifted : real;
+        memset(shifted_real, 0, sizeof(PetaPMReal) * pm->priv->fftsize);
+        layout_build_and_exchange_cells_to_pfft(pm, &pm->priv->layout, pm->priv->meshbuf_shifted, shifted_real);
+        if(pm_has_fft(pm))
+            PFFT(execute_dft_r2c)(pm->priv->plan_forw, shifted_real, shifted);
+        pm_interlace_combine(pm, complx, shifted);
+        myfree(shifted);
+    }
 
-    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
-    pfft_execute_dft_r2c(pm->priv->plan_forw, real, complx);
-    myfree(real);
-
-    pfft_complex * rho_k = (pfft_complex * ) mymalloc2("PMrho_k", pm->priv->fftsize * sizeof(double));
+    /* in place, rho_k replaces the density in its buffer */
+    PetaPMComplex * rho_k = complx;
+    if(!InPlace) {
+        myfree(real);
+        rho_k = (PetaPMComplex * ) mymalloc2("PMrho_k", pm->priv->fftsize * sizeof(PetaPMReal));
+    }
 
     /*Do any analysis that may be required before the transfer function is applied*/
     petapm_transfer_func global_readout = global_functions->global_readout;
     if(global_readout)
-        pm_apply_transfer_function(pm, complx, rho_k, global_readout);
+        pm_apply_transfer_function(pm, complx, rho_k, 1, global_readout);
     if(global_functions->global_analysis)
         global_functions->global_analysis(pm);
     /*Apply the transfer function*/
     petapm_transfer_func global_transfer = global_functions->global_transfer;
-    pm_apply_transfer_function(pm, complx, rho_k, global_transfer);
+    pm_apply_transfer_function(pm, complx, rho_k, 1, global_transfer);
     walltime_measure("/PMgrav/r2c");
 
     report_memory_usage("PetaPM");
 
-    myfree(complx);
+    if(!InPlace)
+        myfree(complx);
     return rho_k;
 }
 
+/* Transform the fields of up to nbatch functions with one batched FFT and one exchange,
+ * then read them out in turn. Unused fields of the batch are zero.*/
+static void
+petapm_force_c2r_batch(PetaPM * pm,
+        PetaPMComplex * rho_k,
+        PetaPMRegion * regions,
+        PetaPMFunctions * functions,
+        const int nf,
+        const int shifted)
+{
+    const int nbatch = pm->priv->nbatch;
+    PetaPMComplex * complx = (PetaPMComplex *) mymalloc("PMcomplex", pm->priv->fftsize_batch * sizeof(PetaPMReal));
+    if(nf < nbatch)
+        memset(complx, 0, pm->priv->fftsize_batch * sizeof(PetaPMReal));
+    int f;
+    for(f = 0; f < nf; f ++) {
+        /* apply the greens function turn rho_k into potential in fourier space */
+        pm_apply_transfer_function(pm, rho_k, complx + f, nbatch, functions[f].transfer);
+        if(shifted)
+            pm_interlace_shift(pm, complx + f, nbatch);
+    }
+    walltime_measure("/PMgrav/calc");
+
+    PetaPMReal * real = (PetaPMReal * ) mymalloc2("PMreal", pm->priv->fftsize_batch * sizeof(PetaPMReal));
+    if(pm_has_fft(pm))
+        PFFT(execute_dft_c2r)(pm->priv->plan_back_batch, complx, real);
+    walltime_measure("/PMgrav/c2r");
+    myfree(complx);
+    /* this will free real.*/
+    PetaPMReal * cells = layout_exchange_batch_to_local(pm, &pm->priv->layout, real, nbatch);
+    walltime_measure("/PMgrav/comm");
+
+    struct Layout * L = &pm->priv->layout;
+    if(!pm->priv->Offload && nf <= PETAPM_FUSED_MAX) {
+        /* distribute the fields of the cells to an interleaved mesh and read them out together*/
+        const size_t meshsize = pm->priv->meshbufsize;
+        PetaPMReal * mesh = (PetaPMReal *) hbmalloc("PMmeshfused", (meshsize * nf + 1) * sizeof(PetaPMReal));
+        memset(mesh, 0, meshsize * nf * sizeof(PetaPMReal));
+        int i;
+        #pragma omp parallel for num_threads(stage_threads(THREADS_PM))
+        for(i = 0; i < L->NpExport; i ++) {
+            struct Pencil * p = &L->PencilSend[i];
+            int j;
+            for(j = 0; j < p->len; j ++)
+                for(f = 0; f < nf; f ++)
+                    mesh[(p->meshbuf_first + j) * nf + f] = cells[(p->first + j) * nbatch + f];
+        }
+        pm_iterate_fused(pm, functions, nf, mesh, regions, 0.5 * shifted, 1. / (1 + pm->Interlace));
+        walltime_measure("/PMgrav/readout");
+        myfree(mesh);
+        myfree(cells);
+        return;
+    }
+    for(f = 0; f < nf; f ++) {
+        /* distribute one field of the cells to meshbuf */
+        int i;
+        #pragma omp parallel for num_threads(stage_threads(THREADS_PM))
+        for(i = 0; i < L->NpExport; i ++) {
+            struct Pencil * p = &L->PencilSend[i];
+            int j;
+            for(j = 0; j < p->len; j ++)
+                pm->priv->meshbuf[p->meshbuf_first + j] = cells[(p->first + j) * nbatch + f];
+        }
+        pm_iterate(pm, functions[f].readout, regions, 0.5 * shifted, 1. / (1 + pm->Interlace));
+        walltime_measure("/PMgrav/readout");
+    }
+    myfree(cells);
+}
+
+/* Transform the fields of up to PETAPM_FUSED_MAX functions one at a time, keeping each
+ * in an interleaved mesh, then read them all out in one pass over the particles.*/
+static void
+petapm_force_c2r_fused(PetaPM * pm,
+        PetaPMComplex * rho_k,
+        PetaPMRegion * regions,
+        PetaPMFunctions * functions,
+        const int nf,
+        const int shifted)
+{
+    const size_t meshsize = pm->priv->meshbufsize;
+    PetaPMReal * mesh = (PetaPMReal *) hbmalloc("PMmeshfused", (meshsize * nf + 1) * sizeof(PetaPMReal));
+    int f;
+    for(f = 0; f < nf; f ++) {
+        PetaPMComplex * complx = pm->priv->InPlace ?
+            (PetaPMComplex *) mymalloc2("PMcomplex", pm->priv->fftsize * sizeof(PetaPMReal)) :
+            (PetaPMComplex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(PetaPMReal));
+        pm_apply_transfer_function(pm, rho_k, complx, 1, functions[f].transfer);
+        if(shifted)
+            pm_interlace_shift(pm, complx, 1);
+        walltime_measure("/PMgrav/calc");
+
+        PetaPMReal * real = (PetaPMReal *) complx;
+        if(!pm->priv->InPlace)
+            real = (PetaPMReal * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(PetaPMReal));
+        if(pm_has_fft(pm))
+            PFFT(execute_dft_c2r)(pm->priv->plan_back, complx, real);
+        walltime_measure("/PMgrav/c2r");
+        if(!pm->priv->InPlace)
+            myfree(complx);
+        layout_build_and_exchange_cells_to_local(pm, &pm->priv->layout, pm->priv->meshbuf, real);
+        walltime_measure("/PMgrav/comm");
+
+        size_t i;
+        #pragma omp parallel for num_threads(stage_threads(THREADS_PM))
+        for(i = 0; i < meshsize; i ++)
+            mesh[i * nf + f] = pm->priv->meshbuf[i];
+    }
+    pm_iterate_fused(pm, functions, nf, mesh, regions, 0.5 * shifted, 1. / (1 + pm->Interlace));
+    walltime_measure("/PMgrav/readout");
+    myfree(mesh);
+}
+
+/* Is there room on every rank for the nf interleaved meshes of petapm_force_c2r_fused,
+ * next to the buffers of one transform? Collective, so all ranks take the same path.*/
+static int
+petapm_fused_fits(PetaPM * pm, const int nf)
+{
+    const size_t need = ((pm->priv->meshbufsize * nf + 1) + 2 * pm->priv->fftsize) * sizeof(PetaPMReal) + 4 * 4096;
+    int fits = mymalloc_freebytes() >= need;
+    MPI_Allreduce(MPI_IN_PLACE, &fits, 1, MPI_INT, MPI_LAND, pm->comm);
+    return fits;
+}
+
 void
 petapm_force_c2r(PetaPM * pm,
-        pfft_complex * rho_k,
+        PetaPMComplex * rho_k,
         PetaPMRegion * regions,
         PetaPMFunctions * functions)
 {
 
     PetaPMFunctions * f = functions;
-    for (f = functions; f->name; f ++) {
+    /* With interlacing each field is read out from both meshes, with half the weight each*/
+    int shifted;
+    if(pm->priv->nbatch > 1) {
+        while(f->name) {
+            int nf = 0;
+            while(nf < pm->priv->nbatch && f[nf].name)
+                nf ++;
+            for(shifted = 0; shifted <= pm->Interlace; shifted ++)
+                petapm_force_c2r_batch(pm, rho_k, regions, f, nf, shifted);
+            f += nf;
+        }
+        walltime_measure("/PMgrav/Misc");
+        return;
+    }
+    int nfused = 0;
+    while(nfused < PETAPM_FUSED_MAX && f[nfused].name)
+        nfused ++;
+    if(pm->priv->FusedReadout && !pm->priv->Offload && !petapm_fused_fits(pm, nfused))
+        message(0, "Not enough memory for the fused PM readout of %d fields: reading them out one at a time.\n", nfused);
+    else if(pm->priv->FusedReadout && !pm->priv->Offload) {
+        while(f->name) {
+            int nf = 0;
+            while(nf < PETAPM_FUSED_MAX && f[nf].name)
+                nf ++;
+            for(shifted = 0; shifted <= pm->Interlace; shifted ++)
+                petapm_force_c2r_fused(pm, rho_k, regions, f, nf, shifted);
+            f += nf;
+        }
+        walltime_measure("/PMgrav/Misc");
+        return;
+    }
+    for (f = functions; f->name; f ++)
+    for (shifted = 0; shifted <= pm->Interlace; shifted ++) {
         petapm_transfer_func transfer = f->transfer;
         petapm_readout_func readout = f->readout;
 
-        pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
+        /* in place the field is transformed in its own buffer, which is on top as layout_build_and_exchange_cells_to_local frees it */
+        PetaPMComplex * complx = pm->priv->InPlace ?
+            (PetaPMComplex *) mymalloc2("PMcomplex", pm->priv->fftsize * sizeof(PetaPMReal)) :
+            (PetaPMComplex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(PetaPMReal));
         /* apply the greens function turn rho_k into potential in fourier space */
-        pm_apply_transfer_function(pm, rho_k, complx, transfer);
+        pm_apply_transfer_function(pm, rho_k, complx, 1, transfer);
+        if(shifted)
+            pm_interlace_shift(pm, complx, 1);
         walltime_measure("/PMgrav/calc");
 
-        double * real = (double * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(double));
-        pfft_execute_dft_c2r(pm->priv->plan_back, complx, real);
+        PetaPMReal * real = (PetaPMReal *) complx;
+        if(!pm->priv->InPlace)
+            real = (PetaPMReal * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(PetaPMReal));
+        if(pm_has_fft(pm))
+            PFFT(execute_dft_c2r)(pm->priv->plan_back, complx, real);
         walltime_measure("/PMgrav/c2r");
-        myfree(complx);
+        if(!pm->priv->InPlace)
+            myfree(complx);
         /* read out the potential: this will copy and free real.*/
         layout_build_and_exchange_cells_to_local(pm, &pm->priv->layout, pm->priv->meshbuf, real);
         walltime_measure("/PMgrav/comm");
 
-        pm_iterate(pm, readout, regions);
+        pm_iterate(pm, readout, regions, 0.5 * shifted, 1. / (1 + pm->Interlace));
         walltime_measure("/PMgrav/readout");
     }
     walltime_measure("/PMgrav/Misc");
@@ -346,6 +785,8 @@ petapm_force_c2r(PetaPM * pm,
 }
 void petapm_force_finish(PetaPM * pm) {
     layout_finish(&pm->priv->layout);
+    if(pm->priv->meshbuf_shifted)
+        myfree(pm->priv->meshbuf_shifted);
     myfree(pm->priv->meshbuf);
 }
 
@@ -355,7 +796,7 @@ void petapm_force(PetaPM * pm, petapm_prepare_func prepare,
         PetaPMParticleStruct * pstruct,
         void * userdata) {
     PetaPMRegion * regions = petapm_force_init(pm, prepare, pstruct, userdata);
-    pfft_complex * rho_k = petapm_force_r2c(pm, global_functions);
+    PetaPMComplex * rho_k = petapm_force_r2c(pm, global_functions);
     if(functions)
         petapm_force_c2r(pm, rho_k, regions, functions);
     myfree(rho_k);
@@ -365,17 +806,26 @@ void petapm_force(PetaPM * pm, petapm_prepare_func prepare,
 
 /* build a communication layout */
 
-static void layout_build_pencils(PetaPM * pm, struct Layout * L, double * meshbuf, PetaPMRegion * regions, const int Nregions);
+static int layout_build_pencils(PetaPM * pm, struct Layout * L, PetaPMReal * meshbuf, PetaPMRegion * regions, const int Nregions);
 static void layout_exchange_pencils(struct Layout * L);
+static int layout_cache_valid(PetaPM * pm, PetaPMReal * meshbuf, PetaPMRegion * regions, const int Nregions);
+static void layout_cache_load(PetaPM * pm, struct Layout * L);
+static void layout_cache_store(PetaPM * pm, struct Layout * L, PetaPMRegion * regions, const int Nregions);
+
+/* A cell is empty if it has no mass on the mesh or on the interlaced mesh */
+static inline int
+layout_cell_empty(PetaPM * pm, PetaPMReal * meshbuf, const size_t i)
+{
+    return meshbuf[i] == 0.0 && (!pm->priv->meshbuf_shifted || pm->priv->meshbuf_shifted[i] == 0.0);
+}
 static void
 layout_prepare (PetaPM * pm,
                 struct Layout * L,
-                double * meshbuf,
+                PetaPMReal * meshbuf,
                 PetaPMRegion * regions,
                 const int Nregions,
                 MPI_Comm comm)
 {
-    int r;
     int i;
     int NTask;
     L->comm = comm;
@@ -394,20 +844,17 @@ layout_prepare (PetaPM * pm,
     L->DpSend = &L->ibuffer[NTask * 6];
     L->DpRecv = &L->ibuffer[NTask * 7];
 
+    if(pm->priv->UseLayoutCache && layout_cache_valid(pm, meshbuf, regions, Nregions)) {
+        layout_cache_load(pm, L);
+        return;
+    }
+
     L->NpExport = 0;
     L->NcExport = 0;
     L->NpImport = 0;
     L->NcImport = 0;
 
-    int NpAlloc = 0;
-    /* count pencils until buffer would run out */
-    for (r = 0; r < Nregions; r ++) {
-        NpAlloc += regions[r].size[0] * regions[r].size[1];
-    }
-
-    L->PencilSend = mymalloc("PencilSend", NpAlloc * sizeof(struct Pencil));
-
-    layout_build_pencils(pm, L, meshbuf, regions, Nregions);
+    int NpAlloc = layout_build_pencils(pm, L, meshbuf, regions, Nregions);
 
     /* sort the pencils by the target rank for ease of next step */
     qsort_openmp(L->PencilSend, NpAlloc, sizeof(struct Pencil), pencil_cmp_target);
@@ -421,13 +868,13 @@ layout_prepare (PetaPM * pm,
 
     /* count total number of cells to be exported */
     int NcExport = 0;
-#pragma omp parallel for reduction(+: NcExport)
+#pragma omp parallel for num_threads(stage_threads(THREADS_PM)) reduction(+: NcExport)
     for(i = 0; i < L->NpExport; i++) {
         NcExport += L->PencilSend[i].len;
     }
     L->NcExport = NcExport;
 
-#pragma omp parallel for
+#pragma omp parallel for num_threads(stage_threads(THREADS_PM))
     for(i = 0; i < L->NpExport; i ++) {
         int task = L->PencilSend[i].task;
 #pragma omp atomic
@@ -476,50 +923,221 @@ layout_prepare (PetaPM * pm,
     L->PencilRecv = mymalloc("PencilRecv", L->NpImport * sizeof(struct Pencil));
     memset(L->PencilRecv, 0xfc, L->NpImport * sizeof(struct Pencil));
     layout_exchange_pencils(L);
+
+    if(pm->priv->UseLayoutCache)
+        layout_cache_store(pm, L, regions, Nregions);
 }
 
+/* The cached layout can be reused if all the regions are the same as when it was built
+ * and no cell with mass is outside the cached pencils, on every rank. Collective.*/
+static int
+layout_cache_valid(PetaPM * pm, PetaPMReal * meshbuf, PetaPMRegion * regions, const int Nregions)
+{
+    PetaPMPriv * priv = pm->priv;
+    int valid = priv->cached_Nregions == Nregions;
+    int r, k;
+    for(r = 0; valid && r < Nregions; r ++) {
+        for(k = 0; k < 3; k ++) {
+            if(priv->cached_regions[6 * r + k] != regions[r].offset[k] ||
+               priv->cached_regions[6 * r + 3 + k] != regions[r].size[k])
+                valid = 0;
+        }
+    }
+    if(valid && priv->meshbufsize > 0) {
+        /* mark the cells that the cached pencils send */
+        char * covered = mymalloc("PMcovered", priv->meshbufsize);
+        memset(covered, 0, priv->meshbufsize);
+        int i;
+        #pragma omp parallel for num_threads(stage_threads(THREADS_PM))
+        for(i = 0; i < priv->cached_layout.NpExport; i ++) {
+            struct Pencil * p = &priv->cached_layout.PencilSend[i];
+            memset(covered + p->meshbuf_first, 1, p->len);
+        }
+        size_t j;
+        int outside = 0;
+        #pragma omp parallel for reduction(+: outside)
+        for(j = 0; j < priv->meshbufsize; j ++) {
+            if(!covered[j] && !layout_cell_empty(pm, meshbuf, j))
+                outside ++;
+        }
+        myfree(covered);
+        valid = outside == 0;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &valid, 1, MPI_INT, MPI_LAND, pm->comm);
+    return valid;
+}
+
+/* Copy the cached pencils and counts into a freshly allocated layout. */
 static void
+layout_cache_load(PetaPM * pm, struct Layout * L)
+{
+    struct Layout * C = &pm->priv->cached_layout;
+    int NTask;
+    MPI_Comm_size(L->comm, &NTask);
+    memcpy(L->ibuffer, C->ibuffer, sizeof(int) * NTask * 8);
+    L->NpExport = C->NpExport;
+    L->NpImport = C->NpImport;
+    L->NcExport = C->NcExport;
+    L->NcImport = C->NcImport;
+    L->PencilSend = mymalloc("PencilSend", L->NpExport * sizeof(struct Pencil));
+    memcpy(L->PencilSend, C->PencilSend, L->NpExport * sizeof(struct Pencil));
+    L->PencilRecv = mymalloc("PencilRecv", L->NpImport * sizeof(struct Pencil));
+    memcpy(L->PencilRecv, C->PencilRecv, L->NpImport * sizeof(struct Pencil));
+    message(0, "PetaPM: reusing the cached layout\n");
+}
+
+/* Empty the cache. The blocks are malloc backed, so must be freed one by one. */
+static void
+layout_cache_free(PetaPM * pm)
+{
+    PetaPMPriv * priv = pm->priv;
+    if(priv->cached_Nregions < 0)
+        return;
+    allocator_free(priv->cached_layout.PencilRecv);
+    allocator_free(priv->cached_layout.PencilSend);
+    allocator_free(priv->cached_layout.ibuffer);
+    allocator_free(priv->cached_regions);
+    priv->cached_Nregions = -1;
+}
+
+/* Replace the cached layout with L, built for these regions. */
+static void
+layout_cache_store(PetaPM * pm, struct Layout * L, PetaPMRegion * regions, const int Nregions)
+{
+    PetaPMPriv * priv = pm->priv;
+    struct Layout * C = &priv->cached_layout;
+    int NTask;
+    MPI_Comm_size(L->comm, &NTask);
+
+    layout_cache_free(pm);
+    priv->cached_Nregions = Nregions;
+    priv->cached_regions = allocator_alloc_bot(priv->LayoutCache, "PMCacheRegions", sizeof(ptrdiff_t) * 6 * (Nregions + 1));
+    int r, k;
+    for(r = 0; r < Nregions; r ++) {
+        for(k = 0; k < 3; k ++) {
+            priv->cached_regions[6 * r + k] = regions[r].offset[k];
+            priv->cached_regions[6 * r + 3 + k] = regions[r].size[k];
+        }
+    }
+    *C = *L;
+    C->ibuffer = allocator_alloc_bot(priv->LayoutCache, "PMCacheLayout", sizeof(int) * NTask * 8);
+    memcpy(C->ibuffer, L->ibuffer, sizeof(int) * NTask * 8);
+    C->PencilSend = allocator_alloc_bot(priv->LayoutCache, "PMCachePencilSend", (L->NpExport + 1) * sizeof(struct Pencil));
+    memcpy(C->PencilSend, L->PencilSend, L->NpExport * sizeof(struct Pencil));
+    C->PencilRecv = allocator_alloc_bot(priv->LayoutCache, "PMCachePencilRecv", (L->NpImport + 1) * sizeof(struct Pencil));
+    memcpy(C->PencilRecv, L->PencilRecv, L->NpImport * sizeof(struct Pencil));
+}
+
+/* Split the n cells of a row of meshbuf starting at first into pencils of cells with mass,
+ * separated by runs of at least gap empty cells, which are not sent.
+ * Each pencil is widened by up to margin empty cells on either side, inside the row.
+ * If p is not NULL, the pencils are stored there, with offset[2] relative to the row.
+ * Returns the number of pencils.*/
+static int
+layout_split_row(PetaPM * pm, PetaPMReal * meshbuf, const ptrdiff_t first, const int n,
+        const int gap, const int margin, struct Pencil * p)
+{
+    int np = 0;
+    int i = 0;
+    while(i < n) {
+        while(i < n && layout_cell_empty(pm, meshbuf, first + i))
+            i ++;
+        if(i == n)
+            break;
+        /* the pencil is [start, end); stop at the first long enough run of empty cells */
+        const int start = i;
+        int end = i + 1;
+        for(i = end; i < n; i ++) {
+            if(!layout_cell_empty(pm, meshbuf, first + i))
+                end = i + 1;
+            else if(i + 1 - end >= gap)
+                break;
+        }
+        if(p) {
+            /* a cached layout keeps a margin of empty cells, so it survives small particle motions */
+            int lo = start < margin ? start : margin;
+            int hi = n - end < margin ? n - end : margin;
+            p[np].offset[2] = start - lo;
+            p[np].len = end - start + lo + hi;
+            p[np].meshbuf_first = first + start - lo;
+        }
+        np ++;
+    }
+    return np;
+}
+
+/* Build the pencils to be exported in L->PencilSend and return their number.
+ * Runs of empty cells inside a row are cut out when they are longer than the
+ * header of a pencil, so sparse rows send few cells.*/
+static int
 layout_build_pencils(PetaPM * pm,
                      struct Layout * L,
-                     double * meshbuf,
+                     PetaPMReal * meshbuf,
                      PetaPMRegion * regions,
                      const int Nregions)
 {
-    /* now build pencils to be exported */
-    int p0 = 0;
+    const int margin = pm->priv->UseLayoutCache ? pm->AssignmentOrder : 0;
+    /* a run of empty cells is cut if it costs more than a pencil header,
+     * and is longer than the margins of the pencils on either side */
+    const int gap = (sizeof(struct Pencil) + sizeof(PetaPMReal) - 1) / sizeof(PetaPMReal) + 2 * margin + 1;
+
+    int Nrows = 0;
     int r;
-    for (r = 0; r < Nregions; r++) {
-        int ix;
-#pragma omp parallel for private(ix)
-        for(ix = 0; ix < regions[r].size[0]; ix++) {
-            int iy;
-            for(iy = 0; iy < regions[r].size[1]; iy++) {
-                int poffset = ix * regions[r].size[1] + iy;
-                struct Pencil * p = &L->PencilSend[p0 + poffset];
-
-                p->offset[0] = ix + regions[r].offset[0];
-                p->offset[1] = iy + regions[r].offset[1];
-                p->offset[2] = regions[r].offset[2];
-                p->len = regions[r].size[2];
-                p->meshbuf_first = (regions[r].buffer - meshbuf) +
-                    regions[r].strides[0] * ix +
-                    regions[r].strides[1] * iy;
-                /* now lets compress the pencil */
-                while((p->len > 0) && (meshbuf[p->meshbuf_first + p->len - 1] == 0.0)) {
-                    p->len --;
-                }
-                while((p->len > 0) && (meshbuf[p->meshbuf_first] == 0.0)) {
-                    p->len --;
-                    p->meshbuf_first++;
-                    p->offset[2] ++;
-                }
+    for (r = 0; r < Nregions; r ++) {
+        Nrows += regions[r].size[0] * regions[r].size[1];
+    }
+    /* the first pencil of each row, and of each region */
+    int * RowStart = mymalloc2("PMRowStart", sizeof(int) * (Nrows + 1));
+    int * RegionStart = mymalloc2("PMRegionStart", sizeof(int) * (Nregions + 1));
+    RegionStart[0] = 0;
+    for (r = 0; r < Nregions; r ++) {
+        RegionStart[r + 1] = RegionStart[r] + regions[r].size[0] * regions[r].size[1];
+    }
 
-                p->task = pos_get_target(pm, p->offset);
+    int pass;
+    for(pass = 0; pass < 2; pass ++) {
+        if(pass == 1) {
+            /* turn the counts into offsets */
+            int i, NpAlloc = 0;
+            for(i = 0; i < Nrows; i ++) {
+                int np = RowStart[i];
+                RowStart[i] = NpAlloc;
+                NpAlloc += np;
+            }
+            RowStart[Nrows] = NpAlloc;
+            L->PencilSend = mymalloc("PencilSend", NpAlloc * sizeof(struct Pencil));
+        }
+        for (r = 0; r < Nregions; r++) {
+            int ix;
+#pragma omp parallel for num_threads(stage_threads(THREADS_PM)) private(ix)
+            for(ix = 0; ix < regions[r].size[0]; ix++) {
+                int iy;
+                for(iy = 0; iy < regions[r].size[1]; iy++) {
+                    const int row = RegionStart[r] + ix * regions[r].size[1] + iy;
+                    const ptrdiff_t first = (regions[r].buffer - meshbuf) +
+                        regions[r].strides[0] * ix +
+                        regions[r].strides[1] * iy;
+                    if(pass == 0) {
+                        RowStart[row] = layout_split_row(pm, meshbuf, first, regions[r].size[2], gap, margin, NULL);
+                        continue;
+                    }
+                    struct Pencil * p = &L->PencilSend[RowStart[row]];
+                    const int np = layout_split_row(pm, meshbuf, first, regions[r].size[2], gap, margin, p);
+                    int j;
+                    for(j = 0; j < np; j ++) {
+                        p[j].offset[0] = ix + regions[r].offset[0];
+                        p[j].offset[1] = iy + regions[r].offset[1];
+                        p[j].offset[2] += regions[r].offset[2];
+                        p[j].task = pos_get_target(pm, p[j].offset);
+                    }
+                }
             }
         }
-        p0 += regions[r].size[0] * regions[r].size[1];
     }
-
+    const int NpAlloc = RowStart[Nrows];
+    myfree(RegionStart);
+    myfree(RowStart);
+    return NpAlloc;
 }
 
 static void layout_exchange_pencils(struct Layout * L) {
@@ -541,7 +1159,7 @@ static void layout_exchange_pencils(struct Layout * L) {
         offset += L->NpSend[i];
     }
 
-    MPI_Alltoallv(
+    MPI_Alltoallv_large(
             L->PencilSend, L->NpSend, L->DpSend, MPI_PENCIL,
             L->PencilRecv, L->NpRecv, L->DpRecv, MPI_PENCIL,
             L->comm);
@@ -577,20 +1195,20 @@ static void layout_finish(struct Layout * L) {
 
 /* exchange cells to their pfft host, then reduce the cells to the pfft
  * array */
-static void to_pfft(double * cell, double * buf) {
+static void to_pfft(PetaPMReal * cell, PetaPMReal * buf, const int ncomp) {
 #pragma omp atomic
             cell[0] += buf[0];
 }
 
+/* Gather the cells of the pencils and post their exchange */
 static void
-layout_build_and_exchange_cells_to_pfft(
+layout_start_exchange_cells_to_pfft(
         PetaPM * pm,
         struct Layout * L,
-        double * meshbuf,
-        double * real)
+        PetaPMReal * meshbuf)
 {
-    L->BufSend = mymalloc("PMBufSend", L->NcExport * sizeof(double));
-    L->BufRecv = mymalloc("PMBufRecv", L->NcImport * sizeof(double));
+    L->BufSend = mymalloc("PMBufSend", L->NcExport * sizeof(PetaPMReal));
+    L->BufRecv = mymalloc("PMBufRecv", L->NcImport * sizeof(PetaPMReal));
 
     int i;
     int offset;
@@ -600,68 +1218,74 @@ layout_build_and_exchange_cells_to_pfft(
     for(i = 0; i < L->NpExport; i ++) {
         struct Pencil * p = &L->PencilSend[i];
         memcpy(L->BufSend + offset, &meshbuf[p->meshbuf_first],
-                sizeof(double) * p->len);
+                sizeof(PetaPMReal) * p->len);
         offset += p->len;
     }
 
     /* receive cells */
-    MPI_Alltoallv(
-            L->BufSend, L->NcSend, L->DcSend, MPI_DOUBLE,
-            L->BufRecv, L->NcRecv, L->DcRecv, MPI_DOUBLE,
-            L->comm);
-
-#if 0
-    double massExport = 0;
-    for(i = 0; i < L->NcExport; i ++) {
-        massExport += L->BufSend[i];
-    }
+    MPI_Ialltoallv(
+            L->BufSend, L->NcSend, L->DcSend, MPI_PETAPM_REAL,
+            L->BufRecv, L->NcRecv, L->DcRecv, MPI_PETAPM_REAL,
+            L->comm, &L->request);
+}
 
-    double massImport = 0;
-    for(i = 0; i < L->NcImport; i ++) {
-        massImport += L->BufRecv[i];
-    }
-    double totmassExport;
-    double totmassImport;
-    MPI_Allreduce(&massExport, &totmassExport, 1, MPI_DOUBLE, MPI_SUM, L->comm);
-    MPI_Allreduce(&massImport, &totmassImport, 1, MPI_DOUBLE, MPI_SUM, L->comm);
-    message(0, "totmassExport = %g totmassImport = %g\n", totmassExport, totmassImport);
-#endif
+/* Wait for the cells and reduce them to the pfft array */
+static void
+layout_finish_exchange_cells_to_pfft(
+        PetaPM * pm,
+        struct Layout * L,
+        PetaPMReal * real)
+{
+    MPI_Wait(&L->request, MPI_STATUS_IGNORE);
 
-    layout_iterate_cells(pm, L, to_pfft, real);
+    layout_iterate_cells(pm, L, to_pfft, real, 1);
     myfree(L->BufRecv);
     myfree(L->BufSend);
 }
 
+static void
+layout_build_and_exchange_cells_to_pfft(
+        PetaPM * pm,
+        struct Layout * L,
+        PetaPMReal * meshbuf,
+        PetaPMReal * real)
+{
+    layout_start_exchange_cells_to_pfft(pm, L, meshbuf);
+    layout_finish_exchange_cells_to_pfft(pm, L, real);
+}
+
 /* readout cells on their pfft host, then exchange the cells to the domain
  * host */
-static void to_region(double * cell, double * region) {
-    *region = *cell;
+static void to_region(PetaPMReal * cell, PetaPMReal * region, const int ncomp) {
+    int c;
+    for(c = 0; c < ncomp; c ++)
+        region[c] = cell[c];
 }
 
 static void
 layout_build_and_exchange_cells_to_local(
         PetaPM * pm,
         struct Layout * L,
-        double * meshbuf,
-        double * real)
+        PetaPMReal * meshbuf,
+        PetaPMReal * real)
 {
-    L->BufRecv = mymalloc("PMBufRecv", L->NcImport * sizeof(double));
+    L->BufRecv = mymalloc("PMBufRecv", L->NcImport * sizeof(PetaPMReal));
     int i;
     int offset;
 
     /*layout_iterate_cells transfers real to L->BufRecv*/
-    layout_iterate_cells(pm, L, to_region, real);
+    layout_iterate_cells(pm, L, to_region, real, 1);
 
     /*Real is done now: reuse the memory for BufSend*/
     myfree(real);
     /*Now allocate BufSend, which is confusingly used to receive data*/
-    L->BufSend = mymalloc("PMBufSend", L->NcExport * sizeof(double));
+    L->BufSend = mymalloc("PMBufSend", L->NcExport * sizeof(PetaPMReal));
 
     /* exchange cells */
     /* notice the order is reversed from to_pfft */
-    MPI_Alltoallv(
-            L->BufRecv, L->NcRecv, L->DcRecv, MPI_DOUBLE,
-            L->BufSend, L->NcSend, L->DcSend, MPI_DOUBLE,
+    MPI_Alltoallv_large(
+            L->BufRecv, L->NcRecv, L->DcRecv, MPI_PETAPM_REAL,
+            L->BufSend, L->NcSend, L->DcSend, MPI_PETAPM_REAL,
             L->comm);
 
     /* distribute BufSend to meshbuf */
@@ -670,13 +1294,44 @@ layout_build_and_exchange_cells_to_local(
         struct Pencil * p = &L->PencilSend[i];
         memcpy(&meshbuf[p->meshbuf_first],
                 L->BufSend + offset,
-                sizeof(double) * p->len);
+                sizeof(PetaPMReal) * p->len);
         offset += p->len;
     }
     myfree(L->BufSend);
     myfree(L->BufRecv);
 }
 
+/* As layout_build_and_exchange_cells_to_local, for cells of ncomp interleaved fields,
+ * with one exchange for all of them. This frees real and returns the cells in the
+ * order of the exported pencils, which the caller frees.*/
+static PetaPMReal *
+layout_exchange_batch_to_local(
+        PetaPM * pm,
+        struct Layout * L,
+        PetaPMReal * real,
+        const int ncomp)
+{
+    L->BufRecv = mymalloc("PMBufRecv", L->NcImport * ncomp * sizeof(PetaPMReal));
+
+    layout_iterate_cells(pm, L, to_region, real, ncomp);
+
+    /*Real is done now: reuse the memory for BufSend, which outlives BufRecv*/
+    myfree(real);
+    L->BufSend = mymalloc2("PMBufSend", L->NcExport * ncomp * sizeof(PetaPMReal));
+
+    MPI_Datatype MPI_CELLS;
+    MPI_Type_contiguous(ncomp, MPI_PETAPM_REAL, &MPI_CELLS);
+    MPI_Type_commit(&MPI_CELLS);
+    MPI_Alltoallv_large(
+            L->BufRecv, L->NcRecv, L->DcRecv, MPI_CELLS,
+            L->BufSend, L->NcSend, L->DcSend, MPI_CELLS,
+            L->comm);
+    MPI_Type_free(&MPI_CELLS);
+
+    myfree(L->BufRecv);
+    return L->BufSend;
+}
+
 /* iterate over the pairs of real field cells and RecvBuf cells
  *
  * !!! iter has to be thread safe. !!!
@@ -685,10 +1340,11 @@ static void
 layout_iterate_cells(PetaPM * pm,
                      struct Layout * L,
                      cell_iterator iter,
-                     double * real)
+                     PetaPMReal * real,
+                     const int ncomp)
 {
     int i;
-#pragma omp parallel for
+#pragma omp parallel for num_threads(stage_threads(THREADS_PM))
     for(i = 0; i < L->NpImport; i ++) {
         struct Pencil * p = &L->PencilRecv[i];
         int k;
@@ -717,7 +1373,7 @@ layout_iterate_cells(PetaPM * pm,
             /*
              * operate on the pencil, either modifying real or BufRecv
              * */
-            iter(&real[linear], &L->BufRecv[p->first + j]);
+            iter(&real[linear * ncomp], &L->BufRecv[(p->first + j) * ncomp], ncomp);
         }
     }
 }
@@ -725,90 +1381,497 @@ layout_iterate_cells(PetaPM * pm,
 static void
 pm_init_regions(PetaPM * pm, PetaPMRegion * regions, const int Nregions)
 {
+    pm->priv->meshbuf_shifted = NULL;
     if(regions) {
         int i;
+        /* The regions are sized for CIC. Wider windows reach (order - 1) / 2 more cells
+         * on either side, and the shifted mesh one more cell above.*/
+        const int lo = (pm->AssignmentOrder - 1) / 2;
+        const int hi = lo + pm->Interlace;
+        if(lo + hi > 0) {
+            for(i = 0 ; i < Nregions; i ++) {
+                int k;
+                for(k = 0; k < 3; k ++) {
+                    regions[i].offset[k] -= lo;
+                    regions[i].size[k] += lo + hi;
+                }
+                petapm_region_init_strides(&regions[i]);
+            }
+        }
         size_t size = 0;
         for(i = 0 ; i < Nregions; i ++) {
             size += regions[i].totalsize;
         }
         pm->priv->meshbufsize = size;
         if ( size == 0 ) return;
-        pm->priv->meshbuf = (double *) mymalloc("PMmesh", size * sizeof(double));
+        pm->priv->meshbuf = (PetaPMReal *) hbmalloc("PMmesh", size * sizeof(PetaPMReal));
         /* this takes care of the padding */
-        memset(pm->priv->meshbuf, 0, size * sizeof(double));
-        size = 0;
-        for(i = 0 ; i < Nregions; i ++) {
-            regions[i].buffer = pm->priv->meshbuf + size;
-            size += regions[i].totalsize;
+        memset(pm->priv->meshbuf, 0, size * sizeof(PetaPMReal));
+        if(pm->Interlace) {
+            pm->priv->meshbuf_shifted = (PetaPMReal *) hbmalloc("PMmeshShifted", size * sizeof(PetaPMReal));
+            memset(pm->priv->meshbuf_shifted, 0, size * sizeof(PetaPMReal));
         }
+        pm_set_region_buffers(pm, regions, Nregions, pm->priv->meshbuf);
     }
 }
 
-
+/* Point the regions at their part of a mesh buffer with the layout of meshbuf */
 static void
-pm_iterate_one(PetaPM * pm,
+pm_set_region_buffers(PetaPM * pm, PetaPMRegion * regions, const int Nregions, PetaPMReal * meshbuf)
+{
+    int i;
+    size_t size = 0;
+    for(i = 0 ; i < Nregions; i ++) {
+        regions[i].buffer = meshbuf + size;
+        size += regions[i].totalsize;
+    }
+}
+
+#ifdef PM_OFFLOAD
+#pragma omp declare target
+#endif
+/* Weights of the assignment window of the given order on the order cells starting
+ * at the returned cell, for a coordinate x in units of the cell size.*/
+static int
+pm_window_weights(const int order, const double x, double w[4])
+{
+    const int ic = floor(x);
+    const double r = x - ic;
+    switch(order) {
+        case 3: {
+            /* TSC: the nearest cell and its two neighbours */
+            const int near = floor(x + 0.5);
+            const double d = x - near;
+            w[0] = 0.5 * (0.5 - d) * (0.5 - d);
+            w[1] = 0.75 - d * d;
+            w[2] = 0.5 * (0.5 + d) * (0.5 + d);
+            return near - 1;
+        }
+        case 4: {
+            /* PCS: the cubic B-spline over two cells either side */
+            const double s = 1 - r;
+            w[0] = s * s * s / 6.;
+            w[1] = (4 - 6 * r * r + 3 * r * r * r) / 6.;
+            w[2] = (4 - 6 * s * s + 3 * s * s * s) / 6.;
+            w[3] = r * r * r / 6.;
+            return ic - 1;
+        }
+        default:
+            /* CIC */
+            w[0] = 1 - r;
+            w[1] = r;
+            return ic;
+    }
+}
+#ifdef PM_OFFLOAD
+#pragma omp end declare target
+#endif
+
+
+/* Find the assignment window of particle i on its region.
+ * iCell is the first cell of the window on the regional mesh, W the weights along each axis.
+ * Returns NULL for particles without a region.*/
+static PetaPMRegion *
+pm_particle_window(PetaPM * pm,
                int i,
-               pm_iterator iterator,
-               PetaPMRegion * regions)
+               PetaPMRegion * regions,
+               const double shift,
+               int iCell[3],
+               double W[3][4])
 {
     int k;
-    int iCell[3];  /* integer coordinate on the regional mesh */
-    double Res[3]; /* residual*/
+    const int order = pm->AssignmentOrder;
     double * Pos = POS(i);
     int RegionInd = REGION(i)[0];
-    
+
     /* Asserts that the swallowed particles are not considered (region -2) */
     if(RegionInd<0)
-        return;
+        return NULL;
 
     PetaPMRegion * region = &regions[RegionInd];
     for(k = 0; k < 3; k++) {
-        double tmp = Pos[k] / pm->CellSize;
-        iCell[k] = floor(tmp);
-        Res[k] = tmp - iCell[k];
+        double tmp = Pos[k] / pm->CellSize + shift;
+        iCell[k] = pm_window_weights(order, tmp, W[k]);
         iCell[k] -= region->offset[k];
         /* seriously?! particles are supposed to be contained in cells */
-        if(iCell[k] >= region->size[k] - 1 || iCell[k] < 0) {
+        if(iCell[k] + order - 1 >= region->size[k] || iCell[k] < 0) {
             endrun(1, "particle out of cell better stop %d (k=%d) %g %g %g region: %td %td\n", iCell[k],k,
                 Pos[0], Pos[1], Pos[2],
                 region->offset[k], region->size[k]);
         }
     }
+    return region;
+}
+
+/* Interpolate the mesh to particle i and pass the value to the iterator with weight norm.
+ * The innermost axis of the window is contiguous in the region and is summed with simd.*/
+static void
+pm_iterate_one(PetaPM * pm,
+               int i,
+               pm_iterator iterator,
+               PetaPMRegion * regions,
+               const double shift,
+               const double norm)
+{
+    const int order = pm->AssignmentOrder;
+    int iCell[3];
+    double W[3][4];
+    PetaPMRegion * region = pm_particle_window(pm, i, regions, shift, iCell, W);
+    if(!region)
+        return;
+
+    double value = 0;
+    int a, b, c;
+    for(a = 0; a < order; a++) {
+        for(b = 0; b < order; b++) {
+            const PetaPMReal * row = region->buffer + (iCell[0] + a) * region->strides[0]
+                                   + (iCell[1] + b) * region->strides[1] + iCell[2];
+            double rowsum = 0;
+            #pragma omp simd reduction(+: rowsum)
+            for(c = 0; c < order; c++)
+                rowsum += W[2][c] * row[c];
+            value += W[0][a] * W[1][b] * rowsum;
+        }
+    }
+    PetaPMReal mesh = value;
+    iterator(pm, i, &mesh, norm);
+}
+
+#ifdef PM_OFFLOAD
+/* A particle with a region, sent to the device*/
+struct PMOffloadPart {
+    double Pos[3];
+    double Mass;
+    int Region;
+};
+
+/* A region, with its buffer as an offset into the mesh*/
+struct PMOffloadRegion {
+    ptrdiff_t offset[3];
+    ptrdiff_t size[3];
+    ptrdiff_t strides[3];
+    size_t first;
+};
+
+/* Copy the particles with a region, and only the active ones if active_only is set, to parts.
+ * index is the particle number of each copy. Returns the number of copies,
+ * and the number of regions used in *nregions.*/
+static int
+pm_offload_gather(const int active_only, struct PMOffloadPart * parts, int * index, int * nregions)
+{
+    int i, n = 0, nreg = 0;
+    for(i = 0; i < CPS->NumPart; i ++) {
+        const int r = REGION(i)[0];
+        if(r < 0 || (active_only && INACTIVE(i)))
+            continue;
+        int k;
+        for(k = 0; k < 3; k ++)
+            parts[n].Pos[k] = POS(i)[k];
+        parts[n].Mass = *MASS(i);
+        parts[n].Region = r;
+        index[n] = i;
+        if(r >= nreg)
+            nreg = r + 1;
+        n++;
+    }
+    *nregions = nreg;
+    return n;
+}
+
+/* The regions as offsets into the mesh of the first region*/
+static struct PMOffloadRegion *
+pm_offload_regions(PetaPMRegion * regions, const int nregions)
+{
+    struct PMOffloadRegion * oreg = (struct PMOffloadRegion *) mymalloc("PMOffloadRegion", (nregions + 1) * sizeof(struct PMOffloadRegion));
+    int r;
+    for(r = 0; r < nregions; r ++) {
+        int k;
+        for(k = 0; k < 3; k ++) {
+            oreg[r].offset[k] = regions[r].offset[k];
+            oreg[r].size[k] = regions[r].size[k];
+            oreg[r].strides[k] = regions[r].strides[k];
+        }
+        oreg[r].first = regions[r].buffer - regions[0].buffer;
+    }
+    return oreg;
+}
 
-    int connection;
-    for(connection = 0; connection < 8; connection++) {
-        double weight = 1.0;
-        size_t linear = 0;
-        for(k = 0; k < 3; k++) {
-            int offset = (connection >> k) & 1;
-            int tmp = iCell[k] + offset;
-            linear += tmp * region->strides[k];
-            weight *= offset?
-                /* offset == 1*/ (Res[k])    :
-                /* offset == 0*/ (1 - Res[k]);
+/* Paint the mass of the active particles on the device. The windows of particles in the
+ * same region overlap, so the cells are updated atomically.*/
+static void
+pm_paint_offload(PetaPM * pm, PetaPMRegion * regions, const double shift)
+{
+    const size_t meshsize = pm->priv->meshbufsize;
+    if(meshsize == 0)
+        return;
+    const int order = pm->AssignmentOrder;
+    const double CellSize = pm->CellSize;
+    PetaPMReal * mesh = regions[0].buffer;
+
+    int * index = (int *) mymalloc("PMOffloadIndex", CPS->NumPart * sizeof(int));
+    struct PMOffloadPart * parts = (struct PMOffloadPart *) mymalloc("PMOffloadParts", CPS->NumPart * sizeof(struct PMOffloadPart));
+    int nregions;
+    const int n = pm_offload_gather(1, parts, index, &nregions);
+    struct PMOffloadRegion * oreg = pm_offload_regions(regions, nregions);
+
+    int i, nbad = 0;
+    #pragma omp target teams distribute parallel for map(to: parts[0:n], oreg[0:nregions]) map(tofrom: mesh[0:meshsize]) reduction(+: nbad)
+    for(i = 0; i < n; i ++) {
+        const struct PMOffloadRegion * region = &oreg[parts[i].Region];
+        int iCell[3];
+        double W[3][4];
+        int k, a, b, c, bad = 0;
+        for(k = 0; k < 3; k ++) {
+            iCell[k] = pm_window_weights(order, parts[i].Pos[k] / CellSize + shift, W[k]) - region->offset[k];
+            if(iCell[k] + order - 1 >= region->size[k] || iCell[k] < 0)
+                bad = 1;
         }
-        if(linear >= region->totalsize) {
-            endrun(1, "particle linear index out of cell better stop\n");
+        if(bad) {
+            nbad++;
+            continue;
         }
-        iterator(pm, i, &region->buffer[linear], weight);
+        for(a = 0; a < order; a++)
+            for(b = 0; b < order; b++) {
+                const size_t row = region->first + (iCell[0] + a) * region->strides[0]
+                                 + (iCell[1] + b) * region->strides[1] + iCell[2];
+                const double wab = parts[i].Mass * W[0][a] * W[1][b];
+                for(c = 0; c < order; c++) {
+                    #pragma omp atomic update
+                    mesh[row + c] += wab * W[2][c];
+                }
+            }
     }
+    if(nbad > 0)
+        endrun(1, "%d particles are outside their PM regions\n", nbad);
+    myfree(oreg);
+    myfree(parts);
+    myfree(index);
 }
 
+/* Interpolate the mesh to all particles with a region on the device,
+ * then pass the values to the iterator on the host.*/
+static void
+pm_iterate_offload(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions, const double shift, const double norm)
+{
+    const size_t meshsize = pm->priv->meshbufsize;
+    if(meshsize == 0) {
+        MPIU_Barrier(pm->comm);
+        return;
+    }
+    const int order = pm->AssignmentOrder;
+    const double CellSize = pm->CellSize;
+    const PetaPMReal * mesh = regions[0].buffer;
+
+    int * index = (int *) mymalloc("PMOffloadIndex", CPS->NumPart * sizeof(int));
+    struct PMOffloadPart * parts = (struct PMOffloadPart *) mymalloc("PMOffloadParts", CPS->NumPart * sizeof(struct PMOffloadPart));
+    int nregions;
+    const int n = pm_offload_gather(0, parts, index, &nregions);
+    struct PMOffloadRegion * oreg = pm_offload_regions(regions, nregions);
+    PetaPMReal * value = (PetaPMReal *) mymalloc("PMOffloadValue", (n + 1) * sizeof(PetaPMReal));
+
+    int i, nbad = 0;
+    #pragma omp target teams distribute parallel for map(to: parts[0:n], oreg[0:nregions], mesh[0:meshsize]) map(from: value[0:n]) reduction(+: nbad)
+    for(i = 0; i < n; i ++) {
+        const struct PMOffloadRegion * region = &oreg[parts[i].Region];
+        int iCell[3];
+        double W[3][4];
+        int k, a, b, c, bad = 0;
+        for(k = 0; k < 3; k ++) {
+            iCell[k] = pm_window_weights(order, parts[i].Pos[k] / CellSize + shift, W[k]) - region->offset[k];
+            if(iCell[k] + order - 1 >= region->size[k] || iCell[k] < 0)
+                bad = 1;
+        }
+        value[i] = 0;
+        if(bad) {
+            nbad++;
+            continue;
+        }
+        double sum = 0;
+        for(a = 0; a < order; a++)
+            for(b = 0; b < order; b++) {
+                const size_t row = region->first + (iCell[0] + a) * region->strides[0]
+                                 + (iCell[1] + b) * region->strides[1] + iCell[2];
+                for(c = 0; c < order; c++)
+                    sum += W[0][a] * W[1][b] * W[2][c] * mesh[row + c];
+            }
+        value[i] = sum;
+    }
+    if(nbad > 0)
+        endrun(1, "%d particles are outside their PM regions\n", nbad);
+
+    #pragma omp parallel for
+    for(i = 0; i < n; i ++)
+        iterator(pm, index[i], &value[i], norm);
+
+    myfree(value);
+    myfree(oreg);
+    myfree(parts);
+    myfree(index);
+    MPIU_Barrier(pm->comm);
+}
+#endif
+
 /*
- * iterate over all particle / mesh pairs, call iterator
- * function . iterator function shall be aware of thread safety.
- * no threads run on same particle same time but may
- * access one mesh points same time.
+ * read out the mesh to all particles. The iterator is called once per particle
+ * with the interpolated value, so it need not be thread safe.
  * */
-static void pm_iterate(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions) {
+static void pm_iterate(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions, const double shift, const double norm) {
+#ifdef PM_OFFLOAD
+    if(pm->priv->Offload) {
+        pm_iterate_offload(pm, iterator, regions, shift, norm);
+        return;
+    }
+#endif
     int i;
 #pragma omp parallel for
     for(i = 0; i < CPS->NumPart; i ++) {
-        pm_iterate_one(pm, i, iterator, regions);
+        pm_iterate_one(pm, i, iterator, regions, shift, norm);
+    }
+    MPIU_Barrier(pm->comm);
+}
+
+/* Interpolate the nf fields of mesh, which is laid out as meshbuf with the fields of each
+ * cell adjacent, to every particle. The window of each particle is computed once and
+ * the fields are summed together, then passed to the readout of each function.*/
+static void
+pm_iterate_fused(PetaPM * pm, PetaPMFunctions * functions, const int nf, const PetaPMReal * mesh,
+        PetaPMRegion * regions, const double shift, const double norm)
+{
+    const int order = pm->AssignmentOrder;
+    int i;
+#pragma omp parallel for num_threads(stage_threads(THREADS_PM))
+    for(i = 0; i < CPS->NumPart; i ++) {
+        int iCell[3];
+        double W[3][4];
+        PetaPMRegion * region = pm_particle_window(pm, i, regions, shift, iCell, W);
+        if(!region)
+            continue;
+        const PetaPMReal * buffer = mesh + (region->buffer - pm->priv->meshbuf) * nf;
+        double value[PETAPM_FUSED_MAX] = {0};
+        int a, b, c, f;
+        for(a = 0; a < order; a++) {
+            for(b = 0; b < order; b++) {
+                const PetaPMReal * row = buffer + ((iCell[0] + a) * region->strides[0]
+                                       + (iCell[1] + b) * region->strides[1] + iCell[2]) * nf;
+                const double wab = W[0][a] * W[1][b];
+                for(c = 0; c < order; c++) {
+                    const double w = wab * W[2][c];
+                    #pragma omp simd
+                    for(f = 0; f < nf; f++)
+                        value[f] += w * row[c * nf + f];
+                }
+            }
+        }
+        for(f = 0; f < nf; f++) {
+            PetaPMReal v = value[f];
+            functions[f].readout(pm, i, &v, norm);
+        }
     }
     MPIU_Barrier(pm->comm);
 }
 
+/* Add the mass of particle i to its window. Not thread safe: see pm_paint.*/
+static void
+pm_paint_one(PetaPM * pm, int i, PetaPMRegion * regions, const double shift)
+{
+    const int order = pm->AssignmentOrder;
+    int iCell[3];
+    double W[3][4];
+    PetaPMRegion * region = pm_particle_window(pm, i, regions, shift, iCell, W);
+    const double Mass = *MASS(i);
+
+    int a, b, c;
+    for(a = 0; a < order; a++) {
+        for(b = 0; b < order; b++) {
+            PetaPMReal * row = region->buffer + (iCell[0] + a) * region->strides[0]
+                             + (iCell[1] + b) * region->strides[1] + iCell[2];
+            const double wab = Mass * W[0][a] * W[1][b];
+            #pragma omp simd
+            for(c = 0; c < order; c++)
+                row[c] += wab * W[2][c];
+        }
+    }
+}
+
+/*
+ * Paint the mass of the active particles to the regions, without atomics.
+ * The particles of each region are sorted into slabs of AssignmentOrder cells along x.
+ * A window reaches at most into the next slab of its region and the regions do not share
+ * memory, so the threads paint all the even slabs at once, then all the odd slabs.
+ * */
+static void
+pm_paint(PetaPM * pm, PetaPMRegion * regions, const int Nregions, const double shift)
+{
+#ifdef PM_OFFLOAD
+    if(pm->priv->Offload) {
+        pm_paint_offload(pm, regions, shift);
+        return;
+    }
+#endif
+    const int order = pm->AssignmentOrder;
+    int r;
+    /* The first slab of each region. Regions get an even number of slabs,
+     * so that the parity of a slab is the same in the region and in the list.*/
+    int * SlabStart = mymalloc("PMSlabStart", sizeof(int) * (Nregions + 1));
+    SlabStart[0] = 0;
+    for(r = 0; r < Nregions; r ++) {
+        int nslab = (regions[r].size[0] + order - 1) / order;
+        SlabStart[r + 1] = SlabStart[r] + nslab + (nslab % 2);
+    }
+    const int Nslab = SlabStart[Nregions];
+
+    /* Count the particles of each slab, offset by one for the cumulative sum below*/
+    size_t * SlabFirst = mymalloc("PMSlabFirst", sizeof(size_t) * (Nslab + 1));
+    memset(SlabFirst, 0, sizeof(size_t) * (Nslab + 1));
+    int * Slab = mymalloc("PMSlab", sizeof(int) * CPS->NumPart);
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < CPS->NumPart; i ++) {
+        int iCell[3];
+        double W[3][4];
+        Slab[i] = -1;
+        if(INACTIVE(i))
+            continue;
+        if(!pm_particle_window(pm, i, regions, shift, iCell, W))
+            continue;
+        Slab[i] = SlabStart[REGION(i)[0]] + iCell[0] / order;
+        #pragma omp atomic
+        SlabFirst[Slab[i] + 1] ++;
+    }
+    int s;
+    for(s = 0; s < Nslab; s ++)
+        SlabFirst[s + 1] += SlabFirst[s];
+
+    /* Sort the particles by slab */
+    size_t * SlabFill = mymalloc("PMSlabFill", sizeof(size_t) * Nslab);
+    memcpy(SlabFill, SlabFirst, sizeof(size_t) * Nslab);
+    int * SlabPart = mymalloc("PMSlabPart", sizeof(int) * (SlabFirst[Nslab] + 1));
+    #pragma omp parallel for
+    for(i = 0; i < CPS->NumPart; i ++) {
+        if(Slab[i] < 0)
+            continue;
+        size_t j;
+        #pragma omp atomic capture
+        j = SlabFill[Slab[i]]++;
+        SlabPart[j] = i;
+    }
+
+    int colour;
+    for(colour = 0; colour < 2; colour ++) {
+        #pragma omp parallel for schedule(dynamic)
+        for(s = colour; s < Nslab; s += 2) {
+            size_t j;
+            for(j = SlabFirst[s]; j < SlabFirst[s + 1]; j ++)
+                pm_paint_one(pm, SlabPart[j], regions, shift);
+        }
+    }
+    myfree(SlabPart);
+    myfree(SlabFill);
+    myfree(Slab);
+    myfree(SlabFirst);
+    myfree(SlabStart);
+}
+
 void petapm_region_init_strides(PetaPMRegion * region) {
     int k;
     size_t rt = 1;
@@ -823,15 +1886,13 @@ void petapm_region_init_strides(PetaPMRegion * region) {
 static int pos_get_target(PetaPM * pm, const int pos[2]) {
     int k;
     int task2d[2];
-    int rank;
     for(k = 0; k < 2; k ++) {
         int ix = pos[k];
         while(ix < 0) ix += pm->Nmesh;
         while(ix >= pm->Nmesh) ix -= pm->Nmesh;
         task2d[k] = pm->Mesh2Task[k][ix];
     }
-    MPI_Cart_rank(pm->priv->comm_cart_2d, task2d, &rank);
-    return rank;
+    return pm->priv->Task2dToTask[task2d[0] * pm->NTask2d[1] + task2d[1]];
 }
 static int pencil_cmp_target(const void * v1, const void * v2) {
     const struct Pencil * p1 = v1;
@@ -845,8 +1906,13 @@ static int pencil_cmp_target(const void * v1, const void * v2) {
         ((p2->meshbuf_first < p1->meshbuf_first) - (p1->meshbuf_first < p2->meshbuf_first));
 }
 
-#ifdef DEBUG
-static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, const size_t meshsize) {
+void
+petapm_verify_density(int verify)
+{
+    VerifyDensity = verify;
+}
+
+static void verify_density_field(PetaPM * pm, PetaPMReal * real, PetaPMReal * meshbuf, const size_t meshsize) {
     /* verify the density field */
     double mass_Part = 0;
     int j;
@@ -868,20 +1934,24 @@ static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, c
     double totmass_Region = 0;
     MPI_Allreduce(&mass_Region, &totmass_Region, 1, MPI_DOUBLE, MPI_SUM, pm->comm);
     double mass_CIC = 0;
-#pragma omp parallel for reduction(+: mass_CIC)
+    int64_t nbad = 0;
+#pragma omp parallel for reduction(+: mass_CIC, nbad)
     for(i = 0; i < pm->real_space_region.totalsize; i ++) {
         mass_CIC += real[i];
+        nbad += !isfinite(real[i]);
     }
     double totmass_CIC = 0;
     MPI_Allreduce(&mass_CIC, &totmass_CIC, 1, MPI_DOUBLE, MPI_SUM, pm->comm);
+    nbad = reduce_int64(nbad, pm->comm);
+    if(nbad > 0)
+        endrun(0, "%ld cells of the density mesh are not finite\n", nbad);
 
     message(0, "total Region mass err = %g CIC mass err = %g Particle mass = %g\n", totmass_Region / totmass_Part - 1, totmass_CIC / totmass_Part - 1, totmass_Part);
 }
-#endif
 
 static void pm_apply_transfer_function(PetaPM * pm,
-        pfft_complex * src,
-        pfft_complex * dst, petapm_transfer_func H
+        PetaPMComplex * src,
+        PetaPMComplex * dst, const int dststride, petapm_transfer_func H
         ){
     size_t ip = 0;
 
@@ -912,26 +1982,66 @@ static void pm_apply_transfer_function(PetaPM * pm,
         pos[0] = kpos[2];
         pos[1] = kpos[0];
         pos[2] = kpos[1];
-        dst[ip][0] = src[ip][0];
-        dst[ip][1] = src[ip][1];
+        PetaPMComplex * out = &dst[ip * dststride];
+        out[0][0] = src[ip][0];
+        out[0][1] = src[ip][1];
         if(H) {
-            H(pm, k2, pos, &dst[ip]);
+            H(pm, k2, pos, out);
         }
     }
 
 }
 
+/* Phase of the half cell shift of the interlaced mesh for fourier cell ip: k . (CellSize / 2)*/
+static double
+pm_interlace_phase(PetaPM * pm, const size_t ip)
+{
+    PetaPMRegion * region = &pm->fourier_space_region;
+    ptrdiff_t tmp = ip;
+    int ksum = 0;
+    int k;
+    for(k = 0; k < 3; k ++) {
+        int pos = tmp / region->strides[k];
+        tmp -= pos * region->strides[k];
+        ksum += petapm_mesh_to_k(pm, pos + region->offset[k]);
+    }
+    return M_PI * ksum / pm->Nmesh;
+}
 
-/**************
- * functions iterating over particle / mesh pairs
- ***************/
-static void put_particle_to_mesh(PetaPM * pm, int i, double * mesh, double weight) {
-    double Mass = *MASS(i);
-    if(INACTIVE(i))
-        return;
-#pragma omp atomic
-    mesh[0] += weight * Mass;
+/* The shifted mesh samples the density half a cell below the grid points:
+ * undo the shift and average it with the unshifted mesh, dst = (dst + shifted * exp(i phase)) / 2 */
+static void
+pm_interlace_combine(PetaPM * pm, PetaPMComplex * dst, PetaPMComplex * shifted)
+{
+    size_t ip;
+#pragma omp parallel for
+    for(ip = 0; ip < pm->fourier_space_region.totalsize; ip ++) {
+        const double phase = pm_interlace_phase(pm, ip);
+        const double c = cos(phase), s = sin(phase);
+        const double re = shifted[ip][0] * c - shifted[ip][1] * s;
+        const double im = shifted[ip][0] * s + shifted[ip][1] * c;
+        dst[ip][0] = 0.5 * (dst[ip][0] + re);
+        dst[ip][1] = 0.5 * (dst[ip][1] + im);
+    }
 }
+
+/* Shift a field to the interlaced mesh before the backward transform: value *= exp(-i phase) */
+static void
+pm_interlace_shift(PetaPM * pm, PetaPMComplex * value, const int dststride)
+{
+    size_t ip;
+#pragma omp parallel for
+    for(ip = 0; ip < pm->fourier_space_region.totalsize; ip ++) {
+        const double phase = pm_interlace_phase(pm, ip);
+        const double c = cos(phase), s = sin(phase);
+        PetaPMComplex * out = &value[ip * dststride];
+        const double re = out[0][0] * c + out[0][1] * s;
+        const double im = out[0][1] * c - out[0][0] * s;
+        out[0][0] = re;
+        out[0][1] = im;
+    }
+}
+
 static int64_t reduce_int64(int64_t input, MPI_Comm comm) {
     int64_t result = 0;
     MPI_Allreduce(&input, &result, 1, MPI_INT64, MPI_SUM, comm);
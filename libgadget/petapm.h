@@ -2,7 +2,25 @@
 #define __PETAPM_H__
 #include <pfft.h>
 
+/* Compile with -DPETAPM_SINGLE to hold the PM mesh and its transforms in single precision.
+ * This halves the memory and communication of the mesh; forces are still accumulated in double.*/
+#ifdef PETAPM_SINGLE
+typedef float PetaPMReal;
+typedef pfftf_complex PetaPMComplex;
+typedef pfftf_plan PetaPMPlan;
+#define MPI_PETAPM_REAL MPI_FLOAT
+#else
+typedef double PetaPMReal;
+typedef pfft_complex PetaPMComplex;
+typedef pfft_plan PetaPMPlan;
+#define MPI_PETAPM_REAL MPI_DOUBLE
+#endif
+
 #include "powerspectrum.h"
+#include "utils/memory.h"
+
+/* Most fields read out in one pass by the fused readout*/
+#define PETAPM_FUSED_MAX 8
 
 typedef struct Region {
     /* represents a region in the FFT Mesh */
@@ -10,7 +28,7 @@ typedef struct Region {
     ptrdiff_t size[3];
     ptrdiff_t strides[3];
     size_t totalsize;
-    double * buffer;
+    PetaPMReal * buffer;
     /* below are used mostly for investigation */
     double center[3];
     double len;
@@ -39,8 +57,9 @@ struct Layout {
     int * DcSend;
     int * DcRecv;
 
-    double * BufSend;
-    double * BufRecv;
+    PetaPMReal * BufSend;
+    PetaPMReal * BufRecv;
+    MPI_Request request; /* pending exchange of BufSend to BufRecv */
     int * ibuffer;
 };
 
@@ -49,12 +68,37 @@ typedef struct PetaPMPriv {
     /* These varibles are initialized by petapm_init*/
 
     int fftsize;
-    pfft_plan plan_forw;
-    pfft_plan plan_back;
+    PetaPMPlan plan_forw;
+    PetaPMPlan plan_back;
+    /* MPI_COMM_NULL on ranks without a part of the FFT mesh */
     MPI_Comm comm_cart_2d;
+    /* rank in comm of the FFT task at each position of the 2d task mesh, row major */
+    int * Task2dToTask;
+    /* Set by petapm_init_batch: backward transform of nbatch interleaved fields*/
+    int nbatch;
+    size_t fftsize_batch;
+    PetaPMPlan plan_back_batch;
+    /* Set by petapm_init_inplace: transform in place, with the real mesh padded along z*/
+    int InPlace;
+    /* Set by petapm_init_offload: paint and interpolate the mesh on an OpenMP target device*/
+    int Offload;
+    /* Set by petapm_init_fused_readout: read out several fields in one pass over the particles*/
+    int FusedReadout;
+
+    /* Set by petapm_init_layout_cache: the layout of the last force calculation,
+     * reused while the regions are the same and the mass stays inside its pencils.*/
+    int UseLayoutCache;
+    Allocator LayoutCache[1];
+    struct Layout cached_layout;
+    int cached_Nregions;
+    ptrdiff_t * cached_regions;
 
     /* these variables are allocated every force calculation */
-    double * meshbuf;
+    PetaPMReal * meshbuf;
+    /* Density on the interlaced mesh, same layout as meshbuf */
+    PetaPMReal * meshbuf_shifted;
+    /* FFT input whose cells are still being exchanged, set by petapm_force_r2c_start */
+    PetaPMReal * real_pending;
     size_t meshbufsize;
     struct Layout layout;
 } PetaPMPriv;
@@ -69,6 +113,10 @@ typedef struct PetaPM {
     double Asmth;
     double BoxSize;
     double G;
+    /* Order of the mass assignment window: 2 = CIC, 3 = TSC, 4 = PCS. Set by petapm_init_window.*/
+    int AssignmentOrder;
+    /* If true, also assign to a mesh shifted by half a cell and average the two to cancel the leading aliasing.*/
+    int Interlace;
     PetaPMPriv priv[1];
     int ThisTask2d[2];
     int NTask2d[2];
@@ -76,8 +124,9 @@ typedef struct PetaPM {
     Power ps[1];
 } PetaPM;
 
-typedef void (*petapm_transfer_func)(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-typedef void (*petapm_readout_func)(PetaPM * pm, int i, double * mesh, double weight);
+typedef void (*petapm_transfer_func)(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+/* Called once per particle with the mesh interpolated to it in mesh[0]; must add weight * mesh[0].*/
+typedef void (*petapm_readout_func)(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
 typedef PetaPMRegion * (*petapm_prepare_func)(PetaPM * pm, void * data, int *Nregions);
 
 typedef struct {
@@ -92,6 +141,8 @@ typedef struct {
     petapm_transfer_func global_readout;
     void (*global_analysis)(PetaPM * pm);
     petapm_transfer_func global_transfer;
+    /* real space analysis of the mass in each mesh cell, before the forward transform destroys it */
+    void (*global_density)(PetaPM * pm, PetaPMReal * real);
 } PetaPMGlobalFunctions;
 
 /* UNUSED! */
@@ -110,7 +161,18 @@ typedef struct {
 
 void petapm_module_init(int Nthreads);
 
+/* If verify, check the mass and finiteness of the density mesh in the next force calculations. Always on in DEBUG builds.*/
+void petapm_verify_density(int verify);
+
 void petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm);
+void petapm_init_subset(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm, int NTaskFFT);
+void petapm_init_batch(PetaPM * pm, int nbatch);
+void petapm_init_inplace(PetaPM * pm);
+void petapm_init_window(PetaPM * pm, int order, int interlace);
+void petapm_init_layout_cache(PetaPM * pm);
+void petapm_init_offload(PetaPM * pm);
+void petapm_init_fused_readout(PetaPM * pm);
+void petapm_set_boxsize(PetaPM * pm, double BoxSize);
 void petapm_destroy(PetaPM * pm);
 void petapm_region_init_strides(PetaPMRegion * region);
 
@@ -125,11 +187,12 @@ PetaPMRegion * petapm_force_init(PetaPM * pm,
         petapm_prepare_func prepare,
         PetaPMParticleStruct * pstruct,
         void * userdata);
-pfft_complex * petapm_force_r2c(PetaPM * pm,
+void petapm_force_r2c_start(PetaPM * pm);
+PetaPMComplex * petapm_force_r2c(PetaPM * pm,
         PetaPMGlobalFunctions * global_functions
         );
 void petapm_force_c2r(PetaPM * pm,
-        pfft_complex * rho_k, PetaPMRegion * regions,
+        PetaPMComplex * rho_k, PetaPMRegion * regions,
         PetaPMFunctions * functions);
 void petapm_force_finish(PetaPM * pm);
 
@@ -138,6 +201,6 @@ PetaPMRegion * petapm_get_real_region(PetaPM * pm);
 int petapm_mesh_to_k(PetaPM * pm, int i);
 int *petapm_get_thistask2d(PetaPM * pm);
 int *petapm_get_ntask2d(PetaPM * pm);
-pfft_complex * petapm_alloc_rhok(PetaPM * pm);
+PetaPMComplex * petapm_alloc_rhok(PetaPM * pm);
 
 #endif
@@ -53,21 +53,33 @@ void powerspectrum_free(Power * ps)
  * and fix the units. */
 void powerspectrum_sum(Power * ps)
 {
-    /*Sum power spectrum thread-local storage*/
+    /*Sum power spectrum thread-local storage, one contiguous thread copy at a time*/
     int i,j;
-    for(i = 0; i < ps->size; i ++) {
-        for(j = 1; j < ps->nalloc/ps->size; j++) {
-            ps->Power[i] += ps->Power[i+ ps->size*j];
-            ps->kk[i] += ps->kk[i+ ps->size*j];
-            ps->Nmodes[i] += ps->Nmodes[i +ps->size*j];
+    for(j = 1; j < ps->nalloc/ps->size; j++) {
+        const int off = ps->size*j;
+        for(i = 0; i < ps->size; i ++) {
+            ps->Power[i] += ps->Power[i + off];
+            ps->kk[i] += ps->kk[i + off];
+            ps->Nmodes[i] += ps->Nmodes[i + off];
         }
     }
 
-    /*Now sum power spectrum MPI storage*/
-    MPI_Allreduce(MPI_IN_PLACE, &(ps->Norm), 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, ps->kk, ps->size, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, ps->Power, ps->size, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(MPI_IN_PLACE, ps->Nmodes, ps->size, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    /*Now sum power spectrum MPI storage. The Norm, k, power and the counts are packed
+     * into one buffer so there is a single collective. The counts are exact as doubles
+     * up to 2^53 modes.*/
+    double * buf = mymalloc("PowerSum", sizeof(double) * (3 * ps->size + 1));
+    memcpy(buf, ps->kk, sizeof(double) * ps->size);
+    memcpy(buf + ps->size, ps->Power, sizeof(double) * ps->size);
+    for(i = 0; i < ps->size; i ++)
+        buf[2 * ps->size + i] = ps->Nmodes[i];
+    buf[3 * ps->size] = ps->Norm;
+    MPI_Allreduce(MPI_IN_PLACE, buf, 3 * ps->size + 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    memcpy(ps->kk, buf, sizeof(double) * ps->size);
+    memcpy(ps->Power, buf + ps->size, sizeof(double) * ps->size);
+    for(i = 0; i < ps->size; i ++)
+        ps->Nmodes[i] = buf[2 * ps->size + i];
+    ps->Norm = buf[3 * ps->size];
+    myfree(buf);
 
     int nk_nz = 0;
     /*Now fix power spectrum units and remove zero entries.*/
@@ -13,6 +13,9 @@ typedef struct _powerspectrum {
     int nalloc;
     int nonzero;
     double Norm;
+    /* The bin of a mode is floor(LogK2BinFac * log(k2)), in integer mesh units.
+     * Set by the caller once the mesh size is known.*/
+    double LogK2BinFac;
     /* Used to set the output units of the power to Mpc*/
     double BoxSize_in_MPC;
     /*These are for the LRA neutrino code*/
@@ -19,8 +19,10 @@
 #include "petaio.h"
 #include "petapm.h"
 #include "timestep.h"
+#include "timefac.h"
 #include "drift.h"
 #include "forcetree.h"
+#include "treewalk.h"
 #include "blackhole.h"
 #include "hydra.h"
 #include "sfr_eff.h"
@@ -28,6 +30,10 @@
 #include "hci.h"
 #include "fof.h"
 #include "cooling_qso_lightup.h"
+#include "lightcone.h"
+#include "lyaskewers.h"
+#include "sanitychecks.h"
+#include "buddy.h"
 
 void energy_statistics(void); /* stats.c only used here */
 
@@ -59,6 +65,7 @@ static void update_random_offset(double * rel_random_shift);
 
 static void set_units();
 static void set_softenings();
+static void reconfigure_run(char * request);
 
 static void
 open_outputfiles(int RestartSnapNum);
@@ -74,9 +81,11 @@ void begrun(int RestartSnapNum)
 {
     hci_init(HCI_DEFAULT_MANAGER, All.OutputDir, All.TimeLimitCPU, All.AutoSnapshotTime);
 
-    petapm_module_init(All.NumThreads);
+    petapm_module_init(stage_threads(THREADS_PM));
     petaio_init();
     walltime_init(&All.CT);
+    if(All.PerfCounters)
+        walltime_perf_open(MPI_COMM_WORLD);
 
     petaio_read_header(RestartSnapNum);
 
@@ -107,11 +116,12 @@ void begrun(int RestartSnapNum)
     init_cooling_and_star_formation();
 
     gravshort_fill_ntab(All.ShortRangeForceWindowType, All.Asmth);
+    gravshort_fill_poly(get_gravshort_treepar().ShortRangePolyOrder);
 
     set_random_numbers(All.RandomSeed);
 
 #ifdef LIGHTCONE
-    lightcone_init(All.Time);
+    lightcone_init(&All.CP, All.TimeInit, RestartSnapNum);
 #endif
 
     open_outputfiles(RestartSnapNum);
@@ -122,6 +132,8 @@ run(int RestartSnapNum)
 {
     /*Number of timesteps performed this run*/
     int NumCurrentTiStep = 0;
+    /*Number of PM steps performed this run*/
+    int NumPMSteps = 0;
     /*Minimum occupied timebin. Initially (but never again) zero*/
     int minTimeBin = 0;
     /*Is gas physics enabled?*/
@@ -131,7 +143,8 @@ run(int RestartSnapNum)
     gravpm_init_periodic(&pm, All.BoxSize, All.Asmth, All.Nmesh, All.G);
 
     DomainDecomp ddecomp[1] = {0};
-    init(RestartSnapNum, ddecomp);          /* ... read in initial model */
+    /* ... read in initial model */
+    int DomainRestored = init(RestartSnapNum, ddecomp);
 
     /* Stored scale factor of the next black hole seeding check*/
     double TimeNextSeedingCheck = All.Time;
@@ -140,6 +153,12 @@ run(int RestartSnapNum)
 
     write_cpu_log(NumCurrentTiStep); /* produce some CPU usage info */
 
+    MPIU_Trace_aggregate(All.AggregateRankMessages);
+
+    /* The force tree. This is usually rebuilt every timestep,
+     * but may be kept from one short timestep to the next and refit.*/
+    ForceTree Tree = {0};
+
     while(1) /* main loop */
     {
         /* Find next synchronization point and the timebins active during this timestep.
@@ -155,6 +174,7 @@ run(int RestartSnapNum)
         /*1.0 check for rate setting in sfr_eff.c*/
         if(NumCurrentTiStep > 0 && All.TimeStep < 0)
             endrun(1, "Negative timestep: %g New Time: %g!\n", All.TimeStep, All.Time);
+        treewalk_stats_set_step(NumCurrentTiStep, All.Time);
 
         int is_PM = is_PM_timestep(All.Ti_Current);
 
@@ -174,44 +194,108 @@ run(int RestartSnapNum)
             /* query HCI requests only on PM step; where kick and drifts are synced */
             stop = hci_query(HCI_DEFAULT_MANAGER, action);
 
+            if(action->reconfigure) {
+                reconfigure_run(action->reconfigure);
+                myfree(action->reconfigure);
+                action->reconfigure = NULL;
+            }
+
             if(action->type == HCI_TERMINATE) {
                 endrun(0, "Human triggered termination.\n");
             }
+            NumPMSteps++;
+            if(All.MaxPMSteps > 0 && NumPMSteps >= All.MaxPMSteps) {
+                message(0, "Stopping after %d PM steps.\n", NumPMSteps);
+                stop = 1;
+            }
         }
 
         double rel_random_shift[3] = {0};
         if(NumCurrentTiStep > 0 && is_PM  && All.RandomParticleOffset > 0) {
             update_random_offset(rel_random_shift);
         }
-        /* Sync positions of all particles */
-        drift_all_particles(All.Ti_Current, rel_random_shift);
+        /* Are the particle neutrinos gravitating this timestep?
+         * If so we need to add them to the tree.*/
+        int HybridNuGrav = All.HybridNeutrinosOn && All.Time <= All.HybridNuPartTime;
+
+        /* Keep the tree past the end of this step so the next step may refit it.
+         * PM steps and sync points decompose the domain or write snapshots, which need a new tree.*/
+        const int KeepTree = All.TreeRefitOn && !is_PM && !planned_sync;
+        const int TryRefit = KeepTree && force_tree_allocated(&Tree);
+
+        /* Sync positions of all particles. The peano keys are only needed by the domain exchange
+         * and the tree build, so are not computed if we may refit the tree instead.*/
+        drift_all_particles(All.Ti_Current, rel_random_shift, !TryRefit);
+
+#ifdef LIGHTCONE
+        /* Always append at sync points, so a restart from a snapshot neither loses nor repeats lightcone particles*/
+        lightcone_flush(planned_sync || (is_PM && action->write_snapshot));
+#endif
+
+        /* If we kept the tree from the last step and no particle has left its tree node,
+         * (enlarged by at most TreeRefitSlack, and never past the top level nodes),
+         * no particle has left our domain either. Recompute the tree moments and skip the exchange.*/
+        int TreeRefit = 0;
+        if(force_tree_allocated(&Tree)) {
+            /* The kept tree is above the slots, so a refit step cannot reserve more star slots.
+             * Only refit if the slots reserved when the tree was built still hold this step's new stars.*/
+            int SlotsReserved = 1;
+            if(KeepTree && GasEnabled)
+                SlotsReserved = !MPIU_Any(!sfr_star_slots_reserved(), MPI_COMM_WORLD);
+            if(KeepTree && SlotsReserved)
+                TreeRefit = force_tree_refit(&Tree, ddecomp, HybridNuGrav);
+            if(!TreeRefit)
+                force_tree_free(&Tree);
+        }
+        /* The refit failed, so we exchange and rebuild after all*/
+        if(TryRefit && !TreeRefit)
+            drift_update_keys();
 
         /* drift and ddecomp decomposition */
 
-        /* at first step this is a noop */
-        if(is_PM) {
+        /* at first step this is a noop; a domain restored from the snapshot is kept */
+        if(is_PM && !DomainRestored) {
             /* full decomposition rebuilds the tree */
             domain_decompose_full(ddecomp);
-        } else {
+        } else if(!TreeRefit) {
             /* FIXME: add a parameter for ddecomp_decompose_incremental */
             /* currently we drift all particles every step */
             /* If it is not a PM step, do a shorter version
              * of the ddecomp decomp which just exchanges particles.*/
             domain_maintain(ddecomp);
         }
+        DomainRestored = 0;
+
+        /* The exchange leaves the particles and then the slots last in memory: grow the particle table now, if it is short.*/
+        if(All.PartAllocGrow > 0 && !TreeRefit)
+            particle_reserve_memory(PartManager, SlotsManager, All.PartAllocGrow);
+
+        /* The exchange leaves the slots last in memory: extend them for this step's new stars now.*/
+        if(GasEnabled && !TreeRefit)
+            sfr_reserve_star_slots();
+
+        /* A kept tree is allocated before the active list so that it can outlive it.*/
+        if(KeepTree && !TreeRefit)
+            force_tree_rebuild(&Tree, ddecomp, All.BoxSize, HybridNuGrav);
 
         ActiveParticles Act = {0};
         rebuild_activelist(&Act, All.Ti_Current, NumCurrentTiStep);
 
-        set_random_numbers(All.RandomSeed + All.Ti_Current);
+        /* The measured tree walk time is kept from the last step on which a particle was active*/
+        if(domain_measured_cost()) {
+            int pa;
+            #pragma omp parallel for
+            for(pa = 0; pa < Act.NumActiveParticle; pa++) {
+                const int p_i = Act.ActiveParticle ? Act.ActiveParticle[pa] : pa;
+                P[p_i].WalkTime = 0;
+            }
+        }
 
-        /* Are the particle neutrinos gravitating this timestep?
-         * If so we need to add them to the tree.*/
-        int HybridNuGrav = All.HybridNeutrinosOn && All.Time <= All.HybridNuPartTime;
+        set_random_numbers(All.RandomSeed + All.Ti_Current);
 
         /* Need to rebuild the force tree because all TopLeaves are out of date.*/
-        ForceTree Tree = {0};
-        force_tree_rebuild(&Tree, ddecomp, All.BoxSize, HybridNuGrav);
+        if(!KeepTree)
+            force_tree_rebuild(&Tree, ddecomp, All.BoxSize, HybridNuGrav);
 
         /* this will find new black hole seed halos.
          * Note: the FOF code does not know about garbage particles,
@@ -223,7 +307,8 @@ run(int RestartSnapNum)
         {
             if ((All.BlackHoleOn && All.Time >= TimeNextSeedingCheck) || during_helium_reionization(1/All.Time - 1)) {
                 /* Seeding */
-                FOFGroups fof = fof_fof(&Tree, All.BoxSize, All.BlackHoleOn, MPI_COMM_WORLD);
+                /* Only the seeding fields of the groups are needed here*/
+                FOFGroups fof = fof_fof_seeding(&Tree, All.BoxSize, All.BlackHoleOn, MPI_COMM_WORLD);
                 if(All.BlackHoleOn && All.Time >= TimeNextSeedingCheck) {
                     fof_seed(&fof, MPI_COMM_WORLD);
                     TimeNextSeedingCheck = All.Time * All.TimeBetweenSeedingSearch;
@@ -238,7 +323,11 @@ run(int RestartSnapNum)
 
         /*Allocate the extra SPH data for transient SPH particle properties.*/
         if(GasEnabled)
-            slots_allocate_sph_scratch_data(sfr_need_to_compute_sph_grad_rho(), SlotsManager->info[0].size, &SlotsManager->sph_scratch);
+        {
+            /* The ghosts of the halo have scratch data after the local slots*/
+            const int nscratch = treewalk_halo_enabled() ? SlotsManager->info[0].maxsize : SlotsManager->info[0].size;
+            slots_allocate_sph_scratch_data(sfr_need_to_compute_sph_grad_rho(), nscratch, &SlotsManager->sph_scratch);
+        }
         /* update force to Ti_Current */
         compute_accelerations(&Act, is_PM, &pm, NumCurrentTiStep == 0, GasEnabled, HybridNuGrav, &Tree, ddecomp);
 
@@ -274,17 +363,23 @@ run(int RestartSnapNum)
 
         int WriteSnapshot = 0;
         int WriteFOF = 0;
+        int LightOutputNum = -1;
+        int LyaSkewerNum = -1;
 
         if(planned_sync) {
             WriteSnapshot |= planned_sync->write_snapshot;
             WriteFOF |= planned_sync->write_fof;
+            if(planned_sync->write_light)
+                LightOutputNum = planned_sync->light_num;
+            if(planned_sync->write_lya && GasEnabled)
+                LyaSkewerNum = planned_sync->lya_num;
         }
 
         if(is_PM) { /* the if here is unnecessary but to signify checkpointing occurs only at PM steps. */
             WriteSnapshot |= action->write_snapshot;
         }
 
-        if(WriteSnapshot || WriteFOF) {
+        if(WriteSnapshot || WriteFOF || LightOutputNum >= 0 || LyaSkewerNum >= 0) {
             /* The accel may have created garbage -- collect them before writing a snapshot.
              * If we do collect, rebuild tree and reset active list size.*/
             int compact[6] = {0};
@@ -295,16 +390,28 @@ run(int RestartSnapNum)
             }
         }
 
-        write_checkpoint(WriteSnapshot, WriteFOF, &Tree);
+        if(LyaSkewerNum >= 0)
+            lya_skewers_write(LyaSkewerNum);
+
+        write_checkpoint(WriteSnapshot, WriteFOF, LightOutputNum, ddecomp, &Tree);
+
+        /* Kicks and drifts are synchronized on PM steps, as for a snapshot*/
+        if(is_PM && All.BuddyCheckpointEvery > 0 && NumPMSteps % All.BuddyCheckpointEvery == 0)
+            buddy_checkpoint_save(PartManager, SlotsManager, All.Ti_Current, MPI_COMM_WORLD);
+
+        sanity_checks(NumCurrentTiStep, All.Ti_Current, PartManager, SlotsManager, MPI_COMM_WORLD);
 
         write_cpu_log(NumCurrentTiStep);    /* produce some CPU usage info */
 
+        MPIU_Trace_flush(MPI_COMM_WORLD);
+
         NumCurrentTiStep++;
 
         report_memory_usage("RUN");
 
         /*Note FoF may free the tree too*/
-        force_tree_free(&Tree);
+        if(!KeepTree)
+            force_tree_free(&Tree);
 
         if(!next_sync || stop) {
             /* out of sync points, or a requested stop, the run has finally finished! Yay.*/
@@ -318,6 +425,11 @@ run(int RestartSnapNum)
          * and advance the PM timestep.*/
         minTimeBin = find_timesteps(&Act, All.Ti_Current);
 
+        /* Tabulate the drift and kick factors of this PM step. The PM kick starts
+         * from the middle of the last PM step, which is the earliest kick time.*/
+        const inttime_t ti_first = PM.Ti_kick < PM.start ? PM.Ti_kick : PM.start;
+        update_step_factor_tables(&All.CP, ti_first, PM.start + PM.length, minTimeBin);
+
         /* Update velocity to the new step, with the newly computed step size */
         apply_half_kick(&Act);
 
@@ -329,9 +441,160 @@ run(int RestartSnapNum)
         free_activelist(&Act);
     }
 
+    write_checkpoint_wait();
+    buddy_checkpoint_free();
+    MPIU_Trace_aggregate(0);
+
+#ifdef LIGHTCONE
+    lightcone_close();
+#endif
+
     close_outputfiles();
 }
 
+/* Change the performance parameters named in a reconfigure request, which has the format of the parameter file.
+ * Only parameters which do not change the physics and may change between PM steps are allowed.
+ * A request which does not parse is ignored, so that a typo does not end the run.*/
+static void
+reconfigure_run(char * request)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_double(ps, "ErrTolForceAcc", OPTIONAL_UNDEF, 0, "Force accuracy required from tree.");
+    param_declare_int(ps, "ImportBufferBoost", OPTIONAL_UNDEF, 0, "Memory factor for imported particles during a treewalk.");
+    param_declare_int(ps, "DomainOverDecompositionFactor", OPTIONAL_UNDEF, 0, "Number of sub domains on a MPI rank.");
+    param_declare_int(ps, "NumWriters", OPTIONAL_UNDEF, 0, "Max number of concurrent writer processes. 0 implies Number of Tasks.");
+    param_declare_int(ps, "WritersPerFile", OPTIONAL_UNDEF, 0, "Number of Writer groups assigned to a file.");
+    param_declare_double(ps, "AutoSnapshotTime", OPTIONAL_UNDEF, 0, "Seconds after which to automatically generate a snapshot.");
+
+    char * error;
+    if(0 != param_parse(ps, request, &error) || 0 != param_validate(ps, &error)) {
+        message(0, "Ignoring reconfigure request: %s\n", error);
+        myfree(error);
+        parameter_set_free(ps);
+        return;
+    }
+
+    /* Every rank has the request, so the parameters are set everywhere*/
+    if(!param_is_nil(ps, "ErrTolForceAcc")) {
+        struct gravshort_tree_params tree_params = get_gravshort_treepar();
+        tree_params.ErrTolForceAcc = param_get_double(ps, "ErrTolForceAcc");
+        set_gravshort_treepar(tree_params);
+        message(0, "Reconfigured ErrTolForceAcc = %g\n", tree_params.ErrTolForceAcc);
+    }
+    if(!param_is_nil(ps, "ImportBufferBoost")) {
+        set_treewalk_import_buffer_boost(param_get_int(ps, "ImportBufferBoost"));
+        message(0, "Reconfigured ImportBufferBoost = %d\n", param_get_int(ps, "ImportBufferBoost"));
+    }
+    if(!param_is_nil(ps, "DomainOverDecompositionFactor")) {
+        DomainParams dp = get_domain_par();
+        dp.DomainOverDecompositionFactor = param_get_int(ps, "DomainOverDecompositionFactor");
+        set_domain_par(dp);
+        message(0, "Reconfigured DomainOverDecompositionFactor = %d\n", dp.DomainOverDecompositionFactor);
+    }
+    if(!param_is_nil(ps, "NumWriters")) {
+        All.IO.NumWriters = param_get_int(ps, "NumWriters");
+        if(All.IO.NumWriters == 0)
+            MPI_Comm_size(MPI_COMM_WORLD, &All.IO.NumWriters);
+        message(0, "Reconfigured NumWriters = %d\n", All.IO.NumWriters);
+    }
+    if(!param_is_nil(ps, "WritersPerFile")) {
+        All.IO.WritersPerFile = param_get_int(ps, "WritersPerFile");
+        message(0, "Reconfigured WritersPerFile = %d\n", All.IO.WritersPerFile);
+    }
+    if(!param_is_nil(ps, "AutoSnapshotTime")) {
+        All.AutoSnapshotTime = param_get_double(ps, "AutoSnapshotTime");
+        hci_set_auto_checkpoint_time(HCI_DEFAULT_MANAGER, All.AutoSnapshotTime);
+        message(0, "Reconfigured AutoSnapshotTime = %g\n", All.AutoSnapshotTime);
+    }
+    parameter_set_free(ps);
+}
+
+/* The arguments of compute_accelerations, for its stages*/
+struct ForceStages {
+    const ActiveParticles * act;
+    PetaPM * pm;
+    ForceTree * tree;
+    DomainDecomp * ddecomp;
+    int HybridNuGrav;
+    int NeutrinoTracer;
+    double rho0;
+};
+
+static void
+stage_density(void * data)
+{
+    struct ForceStages * st = (struct ForceStages *) data;
+    /***** density *****/
+    message(0, "Start density computation...\n");
+
+    /* Keep the neighbour candidates of the density walk for the hydro walk, if enabled*/
+    treewalk_ngbcache_alloc(st->tree, 0);
+    /* Import the gas near our domain, if enabled, so fewer particles are exported.
+     * The halo covers the smoothing lengths the iteration is expected to find.*/
+    treewalk_halo_build(st->tree, st->ddecomp, All.DensityOn ? density_search_factor() : 1);
+
+    density(st->act, 1, All.DensityIndependentSphOn, st->tree);  /* computes density, and pressure */
+
+    /***** update smoothing lengths in tree *****/
+    treewalk_ngbcache_update_hmax(st->act->ActiveParticle, st->act->NumActiveParticle, st->tree, st->ddecomp);
+    /* The ghosts need the new smoothing lengths and densities for the hydro walk*/
+    treewalk_halo_build(st->tree, st->ddecomp, 1);
+}
+
+static void
+stage_hydro(void * data)
+{
+    struct ForceStages * st = (struct ForceStages *) data;
+    /***** hydro forces *****/
+    message(0, "Start hydro-force computation...\n");
+
+    hydro_force(st->act, st->tree);		/* adds hydrodynamical accelerations  and computes du/dt  */
+
+    treewalk_halo_free(st->tree);
+    treewalk_ngbcache_free(st->tree);
+}
+
+static void
+stage_grav_short(void * data)
+{
+    struct ForceStages * st = (struct ForceStages *) data;
+    grav_short_tree(st->act, st->pm, st->tree, st->rho0, st->NeutrinoTracer, All.FastParticleType);
+}
+
+/* Paint the PM mesh and post the exchange of the density. The tree is kept for the other stages.*/
+static void
+stage_pm_post(void * data)
+{
+    struct ForceStages * st = (struct ForceStages *) data;
+    gravpm_force_start(st->pm, st->tree, 0);
+}
+
+static void
+stage_pm_complete(void * data)
+{
+    struct ForceStages * st = (struct ForceStages *) data;
+    gravpm_force_finish(st->pm);
+
+    /* compute and output energy statistics if desired. */
+    if(All.OutputEnergyDebug)
+        energy_statistics();
+}
+
+/* The PM force without overlap, which frees the tree during the PM step to save memory*/
+static void
+stage_pm(void * data)
+{
+    struct ForceStages * st = (struct ForceStages *) data;
+    gravpm_force(st->pm, st->tree);
+
+    /*Rebuild the force tree we freed in gravpm to save memory*/
+    force_tree_rebuild(st->tree, st->ddecomp, All.BoxSize, st->HybridNuGrav);
+
+    /* compute and output energy statistics if desired. */
+    if(All.OutputEnergyDebug)
+        energy_statistics();
+}
+
 /*! This routine computes the accelerations for all active particles.  First, the gravitational forces are
  * computed. This also reconstructs the tree, if needed, otherwise the drift/kick operations have updated the
  * tree to make it fully usable at the current time.
@@ -341,6 +604,8 @@ run(int RestartSnapNum)
  * the hydro part.  The density for active SPH particles is computed next. If the number of neighbours should
  * be outside the allowed bounds, it will be readjusted by the function ensure_neighbours(), and for those
  * particle, the densities are recomputed accordingly. Finally, the hydrodynamical forces are added.
+ *
+ * The stages are run as a task graph, so that the PM exchange progresses while the walks run.
  */
 void compute_accelerations(const ActiveParticles * act, int is_PM, PetaPM * pm, int FirstStep, int GasEnabled, int HybridNuGrav, ForceTree * tree, DomainDecomp * ddecomp)
 {
@@ -348,6 +613,21 @@ void compute_accelerations(const ActiveParticles * act, int is_PM, PetaPM * pm,
 
     walltime_measure("/Misc");
 
+    struct ForceStages st = {0};
+    st.act = act;
+    st.pm = pm;
+    st.tree = tree;
+    st.ddecomp = ddecomp;
+    st.HybridNuGrav = HybridNuGrav;
+    st.NeutrinoTracer =  All.HybridNeutrinosOn && (All.Time <= All.HybridNuPartTime);
+    st.rho0 = All.CP.Omega0 * 3 * All.CP.Hubble * All.CP.Hubble / (8 * M_PI * All.G);
+
+    /* The tree walk uses the zoom region of the last PM step*/
+    if(is_PM)
+        gravpm_zoom_update_region(pm);
+
+    TaskGraph tg = {0};
+
     /* density() happens before gravity because it also initializes the predicted variables.
      * This ensures that prediction consistently uses the grav and hydro accel from the
      * timestep before this one, which matches Gadget-2/3. It was tested to make a small difference,
@@ -355,21 +635,12 @@ void compute_accelerations(const ActiveParticles * act, int is_PM, PetaPM * pm,
      *
      * Doing it first also means the density is up to date for
      * adaptive gravitational softenings. */
-    if(GasEnabled)
-    {
-        /***** density *****/
-        message(0, "Start density computation...\n");
-
-        density(act, 1, All.DensityIndependentSphOn, tree);  /* computes density, and pressure */
+    const int dens = GasEnabled ? taskgraph_add(&tg, "density", TASK_COMPUTE, stage_density, &st) : -1;
+    const int hydro = GasEnabled ? taskgraph_add(&tg, "hydro", TASK_COMPUTE, stage_hydro, &st) : -1;
+    taskgraph_depends(&tg, hydro, dens);
 
-        /***** update smoothing lengths in tree *****/
-        force_update_hmax(act->ActiveParticle, act->NumActiveParticle, tree, ddecomp);
-        /***** hydro forces *****/
-        MPIU_Barrier(MPI_COMM_WORLD);
-        message(0, "Start hydro-force computation...\n");
-
-        hydro_force(act, tree);		/* adds hydrodynamical accelerations  and computes du/dt  */
-    }
+    const int grav = All.TreeGravOn ? taskgraph_add(&tg, "gravshort", TASK_COMPUTE, stage_grav_short, &st) : -1;
+    taskgraph_depends(&tg, grav, dens);
 
     /* The opening criterion for the gravtree
      * uses the *total* gravitational acceleration
@@ -379,11 +650,23 @@ void compute_accelerations(const ActiveParticles * act, int is_PM, PetaPM * pm,
      * this timestep to GravPM. Note initially both
      * are zero and so the tree is opened maximally
      * on the first timestep.*/
-    const int NeutrinoTracer =  All.HybridNeutrinosOn && (All.Time <= All.HybridNuPartTime);
-    const double rho0 = All.CP.Omega0 * 3 * All.CP.Hubble * All.CP.Hubble / (8 * M_PI * All.G);
-
-    if(All.TreeGravOn)
-        grav_short_tree(act, pm, tree, rho0, NeutrinoTracer, All.FastParticleType);
+    int pmdone = -1;
+    if(is_PM && All.PMOverlapTree && All.TreeGravOn) {
+        /* Paint the PM mesh first, so that the exchange of the density
+         * progresses during the tree walk, and also during the SPH walks if PMOverlapSph is set.
+         * The walks do not move the particles, so the mesh stays valid.*/
+        const int post = taskgraph_add(&tg, "pm-post", TASK_POST, stage_pm_post, &st);
+        if(!All.PMOverlapSph)
+            taskgraph_depends(&tg, post, hydro);
+        pmdone = taskgraph_add(&tg, "pm-complete", TASK_COMPLETE, stage_pm_complete, &st);
+        taskgraph_depends(&tg, pmdone, post);
+    }
+    else if(is_PM) {
+        pmdone = taskgraph_add(&tg, "pm", TASK_COMPLETE, stage_pm, &st);
+        /* The tree is freed during the PM step*/
+        taskgraph_depends(&tg, pmdone, hydro);
+    }
+    taskgraph_depends(&tg, pmdone, grav);
 
     /* We use the total gravitational acc.
      * to open the tree and total acc for the timestep.
@@ -395,26 +678,19 @@ void compute_accelerations(const ActiveParticles * act, int is_PM, PetaPM * pm,
      * for opening angle or short-range timesteps,
      * or include hydro in the opening angle.*/
 
-    if(is_PM)
-    {
-        gravpm_force(pm, tree);
-
-        /*Rebuild the force tree we freed in gravpm to save memory*/
-        force_tree_rebuild(tree, ddecomp, All.BoxSize, HybridNuGrav);
-
-        /* compute and output energy statistics if desired. */
-        if(All.OutputEnergyDebug)
-            energy_statistics();
-    }
-
     /* For the first timestep, we do tree force twice
      * to allow usage of relative opening
      * criterion for consistent accuracy.
      * This happens after PM because we want to
      * use the total acceleration for tree opening.
      */
-    if(FirstStep && All.TreeGravOn)
-        grav_short_tree(act, pm, tree, rho0, NeutrinoTracer, All.FastParticleType);
+    if(FirstStep && All.TreeGravOn) {
+        const int regrav = taskgraph_add(&tg, "gravshort-again", TASK_COMPUTE, stage_grav_short, &st);
+        taskgraph_depends(&tg, regrav, grav);
+        taskgraph_depends(&tg, regrav, pmdone);
+    }
+
+    taskgraph_run(&tg);
 
     MPIU_Barrier(MPI_COMM_WORLD);
     message(0, "Forces computed.\n");
@@ -434,9 +710,40 @@ void write_cpu_log(int NumCurrentTiStep)
         fflush(FdCPU);
     }
     walltime_report(FdCPU, 0, MPI_COMM_WORLD);
+    walltime_report_perf(FdCPU, 0, MPI_COMM_WORLD);
     if(ThisTask == 0) {
         fflush(FdCPU);
     }
+
+    /* The high-water mark of the main allocator on the worst rank, and the block which set it*/
+    struct {
+        double peak;
+        int task;
+    } peak = {A_MAIN->peak, ThisTask}, maxpeak;
+    MPI_Allreduce(&peak, &maxpeak, 1, MPI_DOUBLE_INT, MPI_MAXLOC, MPI_COMM_WORLD);
+    char peak_name[sizeof(A_MAIN->peak_name)];
+    strncpy(peak_name, A_MAIN->peak_name, sizeof(peak_name));
+    MPI_Bcast(peak_name, sizeof(peak_name), MPI_CHAR, maxpeak.task, MPI_COMM_WORLD);
+
+    if(ThisTask == 0)
+    {
+        const double totalmb = A_MAIN->size / (1024. * 1024.);
+        fprintf(FdMemory, "Step %d, Time: %g, MPIs: %d Allocator: %g MB Peak: %g MB (%.1f%%) on task %d by %s\n",
+                NumCurrentTiStep, All.Time, NTask, totalmb, maxpeak.peak / (1024. * 1024.),
+                maxpeak.peak / A_MAIN->size * 100., maxpeak.task, peak_name);
+    }
+    if(A_HBM->size > 0) {
+        double hbmpeak = A_HBM->peak, maxhbmpeak;
+        MPI_Reduce(&hbmpeak, &maxhbmpeak, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        if(ThisTask == 0)
+            fprintf(FdMemory, "HBM Allocator: %g MB Peak: %g MB (%.1f%%)\n", A_HBM->size / (1024. * 1024.),
+                maxhbmpeak / (1024. * 1024.), maxhbmpeak / A_HBM->size * 100.);
+    }
+    /* Columns are MB and percent of the allocator for this step and for the whole run*/
+    walltime_report_memory(FdMemory, 0, MPI_COMM_WORLD, A_MAIN->size);
+    if(ThisTask == 0) {
+        fflush(FdMemory);
+    }
 }
 
 /* We operate in a situation where the particles are in a coordinate frame
@@ -483,6 +790,14 @@ open_outputfiles(int RestartSnapNum)
     char * buf;
     char * postfix;
 
+    /* Every rank writes its own event trace, if enabled*/
+    if(strlen(All.TraceFile) > 0) {
+        buf = fastpm_strdup_printf("%s/%s.%d.json", All.OutputDir, All.TraceFile, ThisTask);
+        fastpm_path_ensure_dirname(buf);
+        walltime_trace_open(buf, MPI_COMM_WORLD);
+        myfree(buf);
+    }
+
     if(ThisTask != 0) {
         /* only the root processors writes to the log files */
         return;
@@ -514,6 +829,12 @@ open_outputfiles(int RestartSnapNum)
         endrun(1, "error in opening file '%s'\n", buf);
     myfree(buf);
 
+    buf = fastpm_strdup_printf("%s/%s%s", All.OutputDir, "memory.txt", postfix);
+    fastpm_path_ensure_dirname(buf);
+    if(!(FdMemory = fopen(buf, mode)))
+        endrun(1, "error in opening file '%s'\n", buf);
+    myfree(buf);
+
     if(All.BlackHoleOn) {
         buf = fastpm_strdup_printf("%s/%s%s", All.OutputDir, "blackholes.txt", postfix);
         fastpm_path_ensure_dirname(buf);
@@ -530,6 +851,8 @@ open_outputfiles(int RestartSnapNum)
 static void
 close_outputfiles(void)
 {
+    walltime_trace_close();
+    walltime_perf_close();
 
     if(ThisTask != 0)		/* only the root processors writes to the log files */
         return;
@@ -539,6 +862,7 @@ close_outputfiles(void)
         fclose(FdEnergy);
 
     fclose(FdSfr);
+    fclose(FdMemory);
 
     if(All.BlackHoleOn)
         fclose(FdBlackHoles);
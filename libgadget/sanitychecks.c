@@ -0,0 +1,120 @@
+/*! \file sanitychecks.c
+ *  \brief Sampled consistency checks of the particle and slot tables, for production runs.
+ *
+ *  The full checks, slots_check_id_consistency, domain_test_id_uniqueness and the drift time
+ *  checks, only run in DEBUG builds, as each is a pass over all particles or a sort, every step.
+ *  These check a rotating sample of the particles instead, so the cost is a fraction of a pass.
+ */
+#include <mpi.h>
+#include <math.h>
+#include <string.h>
+
+#include "utils.h"
+#include "sanitychecks.h"
+#include "exchange.h"
+#include "petapm.h"
+#include "walltime.h"
+
+static struct sanity_check_params
+{
+    /* Fraction of the particles checked each time. 0 disables the checks.*/
+    double Fraction;
+    /* Steps between checks*/
+    int Every;
+} SanityParams;
+
+void
+set_sanity_check_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        SanityParams.Fraction = param_get_double(ps, "SanityCheckFraction");
+        SanityParams.Every = param_get_int(ps, "SanityCheckEvery");
+        if(SanityParams.Every < 1)
+            SanityParams.Every = 1;
+    }
+    MPI_Bcast(&SanityParams, sizeof(struct sanity_check_params), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+/* The splitmix64 finaliser, so that neighbouring IDs fall in different classes*/
+static inline uint64_t
+sanity_id_hash(MyIDType id)
+{
+    uint64_t h = id;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/* Check the particles of class hashclass of nclass. Returns the number of failures on this rank:
+ * the first few are printed.*/
+static int64_t
+sanity_check_particles(const uint64_t hashclass, const uint64_t nclass, const inttime_t Ti_Current,
+        struct part_manager_type * pman, struct slots_manager_type * sman, int64_t * nchecked)
+{
+    int64_t nbad = 0, nsample = 0;
+    int i;
+    #pragma omp parallel for reduction(+: nbad, nsample)
+    for(i = 0; i < pman->NumPart; i++) {
+        struct particle_data * p = &pman->Base[i];
+        /* Swallowed particles are not drifted*/
+        if(p->IsGarbage || p->Swallowed || sanity_id_hash(p->ID) % nclass != hashclass)
+            continue;
+        nsample++;
+        const char * fail = NULL;
+        if(p->Ti_drift != Ti_Current)
+            fail = "drift time is not the current time";
+        else if(!isfinite(p->Pos[0]) || !isfinite(p->Pos[1]) || !isfinite(p->Pos[2]))
+            fail = "position is not finite";
+        else if(!isfinite(p->Vel[0]) || !isfinite(p->Vel[1]) || !isfinite(p->Vel[2]))
+            fail = "velocity is not finite";
+        else if(!(p->Mass >= 0))
+            fail = "mass is negative";
+        else if(sman->info[p->Type].enabled) {
+            if(p->PI < 0 || p->PI >= sman->info[p->Type].size)
+                fail = "slot index is out of range";
+            else if(BASESLOT_PI(p->PI, p->Type, sman)->ID != p->ID)
+                fail = "slot has a different ID";
+        }
+        if(!fail)
+            continue;
+        if(nbad < 10)
+            message(1, "Sanity check failed for particle %d ID %lu type %d: %s\n", i, (unsigned long) p->ID, p->Type, fail);
+        nbad++;
+    }
+    *nchecked = nsample;
+    return nbad;
+}
+
+void
+sanity_checks(int NumCurrentTiStep, inttime_t Ti_Current, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm)
+{
+    /* The class checked this time: calls are collective, so it is the same on every task*/
+    static uint64_t phase = 0;
+
+    if(SanityParams.Fraction <= 0)
+        return;
+    const int due = NumCurrentTiStep % SanityParams.Every == 0;
+    /* Verify the density mesh of the next PM step after a check*/
+    petapm_verify_density(due);
+    if(!due)
+        return;
+
+    uint64_t nclass = SanityParams.Fraction < 1 ? (uint64_t) (1. / SanityParams.Fraction + 0.5) : 1;
+    const uint64_t hashclass = phase++ % nclass;
+
+    int64_t counts[2];
+    counts[0] = sanity_check_particles(hashclass, nclass, Ti_Current, pman, sman, &counts[1]);
+    MPI_Allreduce(MPI_IN_PLACE, counts, 2, MPI_INT64, MPI_SUM, Comm);
+    if(counts[0] > 0)
+        endrun(0, "Sanity checks failed for %ld of %ld sampled particles\n", counts[0], counts[1]);
+
+    /* A different 1/nclass of the IDs each time*/
+    int64_t dup = domain_check_id_uniqueness(pman, nclass, Comm);
+    if(dup > 0)
+        endrun(0, "Sanity checks found %ld duplicate particle IDs\n", dup);
+
+    message(0, "Sanity checks passed for %ld particles, 1/%lu of the total.\n", counts[1], (unsigned long) nclass);
+    walltime_measure("/Misc/Sanity");
+}
@@ -0,0 +1,19 @@
+#ifndef _SANITYCHECKS_H
+#define _SANITYCHECKS_H
+
+#include <mpi.h>
+#include "utils/paramset.h"
+#include "partmanager.h"
+#include "slotsmanager.h"
+#include "types.h"
+
+void set_sanity_check_params(ParameterSet * ps);
+
+/* The checks of a DEBUG build, on a sample of the particles, cheap enough to run in production.
+ * Every SanityCheckEvery steps the particles of one of 1/SanityCheckFraction classes, chosen by a hash
+ * of the ID, have their slot, drift time and position and velocity checked, and their IDs are checked
+ * for uniqueness. The class changes each time, so every particle is checked over 1/SanityCheckFraction checks.
+ * The next PM step then also verifies the mass of the density mesh. Collective; ends the run on a failure.*/
+void sanity_checks(int NumCurrentTiStep, inttime_t Ti_Current, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
+
+#endif
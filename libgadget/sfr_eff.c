@@ -117,6 +117,38 @@ void set_sfr_params(ParameterSet * ps)
 }
 
 
+struct NewStarPair {
+    int parent;
+    int star;
+};
+
+static int
+cmp_new_star_parent(const void * a, const void * b)
+{
+    const struct NewStarPair * pa = a, * pb = b;
+    return (pa->parent > pb->parent) - (pa->parent < pb->parent);
+}
+
+/* Sort the new star queue by parent index*/
+static void
+sfr_sort_new_stars(int * NewStars, int * NewParents, const int NumNewStar)
+{
+    if(NumNewStar <= 1)
+        return;
+    struct NewStarPair * pairs = mymalloc2("NewStarPairs", NumNewStar * sizeof(struct NewStarPair));
+    int i;
+    for(i = 0; i < NumNewStar; i++) {
+        pairs[i].parent = NewParents[i];
+        pairs[i].star = NewStars[i];
+    }
+    qsort(pairs, NumNewStar, sizeof(struct NewStarPair), cmp_new_star_parent);
+    for(i = 0; i < NumNewStar; i++) {
+        NewParents[i] = pairs[i].parent;
+        NewStars[i] = pairs[i].star;
+    }
+    myfree(pairs);
+}
+
 /* cooling and star formation routine.*/
 void
 cooling_and_starformation(ActiveParticles * act, ForceTree * tree)
@@ -124,94 +156,82 @@ cooling_and_starformation(ActiveParticles * act, ForceTree * tree)
     if(!All.CoolingOn)
         return;
 
-    const int nthreads = omp_get_max_threads();
     /*This is a queue for the new stars and their parents, so we can reallocate the slots after the main cooling loop.*/
     int * NewStars = NULL;
     int * NewParents = NULL;
     int NumNewStar = 0;
-    size_t *nqthrsfr = ta_malloc("nqthrsfr", size_t, nthreads);
-    int **thrqueuesfr = ta_malloc("thrqueuesfr", int *, nthreads);
-    int **thrqueueparent = ta_malloc("thrqueueparent", int *, nthreads);
 
     /*Need to capture this so that when NumActiveParticle increases during the loop
      * we don't add extra loop iterations on particles with invalid slots.*/
     const int nactive = act->NumActiveParticle;
 
     if(All.StarformationOn) {
-        /* Need 1 extra for non-integer part and 1 extra
-         * for the case where one thread loops an extra time*/
-        int narr = nactive/nthreads+2;
-        NewStars = mymalloc("NewStars", narr * sizeof(int) * nthreads);
-        gadget_setup_thread_arrays(NewStars, thrqueuesfr, nqthrsfr, narr, nthreads);
-        NewParents = mymalloc2("NewParents", narr * sizeof(int) * nthreads);
-        gadget_setup_thread_arrays(NewParents, thrqueueparent, nqthrsfr, narr, nthreads);
+        /* Each active gas particle makes at most one new star*/
+        NewStars = mymalloc("NewStars", (nactive + 1) * sizeof(int));
+        NewParents = mymalloc2("NewParents", (nactive + 1) * sizeof(int));
     }
 
+    /* Only the gas, so that the cooling loop does not stream the stars and dark matter.*/
+    int ngas;
+    int * GasList = get_active_particles_of_type(act, 0, &ngas);
+    int i;
+
     double sum_sm = 0, sum_mass_stars = 0, localsfr = 0;
 
     /* First decide which stars are cooling and which starforming. If star forming we add them to a list.
      * Note the dynamic scheduling: individual particles may have very different loop iteration lengths.
-     * Cooling is much slower than sfr. I tried splitting it into a separate loop instead, but this was faster.*/
-    #pragma omp parallel reduction(+:localsfr) reduction(+: sum_sm) reduction(+:sum_mass_stars)
+     * Cooling is much slower than sfr. I tried splitting it into a separate loop instead, but this was faster.
+     * The chunks are small enough to balance the load but keep neighbouring particles on one thread.*/
+    #pragma omp parallel for schedule(dynamic, 32) reduction(+:localsfr) reduction(+: sum_sm) reduction(+:sum_mass_stars)
+    for(i = 0; i < ngas; i++)
     {
-        int i;
-        const int tid = omp_get_thread_num();
+        /*Use raw particle number if the list is null*/
+        const int p_i = GasList ? GasList[i] : i;
+        /* Without the typed lists, skip non-gas, swallowed, or garbage particles */
+        if(P[p_i].Type != 0 || P[p_i].IsGarbage || P[p_i].Swallowed || P[p_i].Mass <= 0)
+            continue;
+
+        int shall_we_star_form = 0;
+        if(All.StarformationOn) {
+            /*Reduce delaytime for wind particles.*/
+            winds_evolve(p_i, All.cf.a3inv, All.cf.hubble);
+            /* check whether we are star forming gas.*/
+            if(sfr_params.QuickLymanAlphaProbability > 0)
+                shall_we_star_form = quicklyastarformation(p_i);
+            else
+                shall_we_star_form = sfreff_on_eeqos(&SPHP(p_i));
+        }
 
-        for(i=tid; i < nactive; i+=nthreads)
-        {
-            /*Use raw particle number if active_set is null, otherwise use active_set*/
-            const int p_i = act->ActiveParticle ? act->ActiveParticle[i] : i;
-            /* Skip non-gas, swallowed, or garbage particles */
-            if(P[p_i].Type != 0 || P[p_i].IsGarbage || P[p_i].Swallowed || P[p_i].Mass <= 0)
-                continue;
-
-            int shall_we_star_form = 0;
-            if(All.StarformationOn) {
-                /*Reduce delaytime for wind particles.*/
-                winds_evolve(p_i, All.cf.a3inv, All.cf.hubble);
-                /* check whether we are star forming gas.*/
-                if(sfr_params.QuickLymanAlphaProbability > 0)
-                    shall_we_star_form = quicklyastarformation(p_i);
-                else
-                    shall_we_star_form = sfreff_on_eeqos(&SPHP(p_i));
+        if(shall_we_star_form) {
+            int newstar = -1;
+            if(sfr_params.QuickLymanAlphaProbability > 0) {
+                /*New star is always the same particle as the parent for quicklya*/
+                newstar = p_i;
+            } else {
+                newstar = starformation(p_i, &localsfr, &sum_sm);
             }
-
-            if(shall_we_star_form) {
-                int newstar = -1;
-                if(sfr_params.QuickLymanAlphaProbability > 0) {
-                    /*New star is always the same particle as the parent for quicklya*/
-                    newstar = p_i;
-                } else {
-                    newstar = starformation(p_i, &localsfr, &sum_sm);
-                }
-                /*Add this particle to the stellar conversion queue if necessary.*/
-                if(newstar >= 0) {
-                    int tid = omp_get_thread_num();
-                    thrqueuesfr[tid][nqthrsfr[tid]] = newstar;
-                    thrqueueparent[tid][nqthrsfr[tid]] = p_i;
-                    nqthrsfr[tid]++;
-                }
+            /*Add this particle to the stellar conversion queue if necessary.*/
+            if(newstar >= 0) {
+                const int slot = atomic_fetch_and_add(&NumNewStar, 1);
+                NewStars[slot] = newstar;
+                NewParents[slot] = p_i;
             }
-            else
-                cooling_direct(p_i);
         }
+        else
+            cooling_direct(p_i);
     }
 
     report_memory_usage("SFR");
-    /*Merge step for the queue.*/
     if(NewStars) {
-        NumNewStar = gadget_compact_thread_arrays(NewStars, thrqueuesfr, nqthrsfr, nthreads);
-        int NumNewParent = gadget_compact_thread_arrays(NewParents, thrqueueparent, nqthrsfr, nthreads);
-        if(NumNewStar != NumNewParent)
-            endrun(3,"%d new stars, but %d new parents!\n",NumNewStar, NumNewParent);
+        /* The queue is filled in whatever order the threads finish:
+         * sort it by parent so the star slots do not depend on the scheduling.*/
+        sfr_sort_new_stars(NewStars, NewParents, NumNewStar);
+        /* Attach the spawned stars to the tree and the active list in one batch*/
+        slots_emit_forks(NewParents, NewStars, NumNewStar);
         /*Shrink star memory as we keep it for the wind model*/
         NewStars = myrealloc(NewStars, sizeof(int) * NumNewStar);
     }
 
-    ta_free(thrqueueparent);
-    ta_free(thrqueuesfr);
-    ta_free(nqthrsfr);
-
     walltime_measure("/Cooling/Cooling");
 
     /*Get some empty slots for the stars*/
@@ -227,7 +247,6 @@ cooling_and_starformation(ActiveParticles * act, ForceTree * tree)
     SlotsManager->info[4].size += NumNewStar;
 
     int stars_converted=0, stars_spawned=0;
-    int i;
 
     /*Now we turn the particles into stars*/
     #pragma omp parallel for reduction(+:stars_converted) reduction(+:stars_spawned) reduction(+:sum_mass_stars)
@@ -292,6 +311,46 @@ cooling_and_starformation(ActiveParticles * act, ForceTree * tree)
     myfree(NewStars);
 }
 
+/* Number of star-forming gas particles: each forms at most one star per step.*/
+static int
+sfr_count_star_forming(void)
+{
+    int nsfr = 0;
+    int i;
+    #pragma omp parallel for reduction(+: nsfr)
+    for(i = 0; i < PartManager->NumPart; i++)
+        if(P[i].Type == 0 && !P[i].IsGarbage && !P[i].Swallowed && SPHP(i).Sfr > 0)
+            nsfr++;
+    return nsfr;
+}
+
+/* Reserving a star slot for each star-forming gas particle means a burst of star formation
+ * does not need sfr_reserve_slots to move the tree and the active list.*/
+void
+sfr_reserve_star_slots(void)
+{
+    if(!All.StarformationOn)
+        return;
+    const int nsfr = sfr_count_star_forming();
+    int atleast[6];
+    int i;
+    for(i = 0; i < 6; i++)
+        atleast[i] = SlotsManager->info[i].size;
+    atleast[4] += nsfr;
+    slots_reserve(1, atleast, SlotsManager);
+}
+
+/* True if the star slots already reserved hold a star for each star-forming gas particle.
+ * A tree kept for refitting is above the slots, so they cannot grow in place while it is allocated.*/
+int
+sfr_star_slots_reserved(void)
+{
+    if(!All.StarformationOn)
+        return 1;
+    const int nsfr = sfr_count_star_forming();
+    return SlotsManager->info[4].size + nsfr <= SlotsManager->info[4].maxsize;
+}
+
 /* Get enough memory for new star slots. This may be excessively slow! Don't do it too often.
  * It is also not elegant, but I couldn't think of a better way. May be fragile and need updating
  * if memory allocation patterns change. */
@@ -314,11 +373,31 @@ sfr_reserve_slots(ActiveParticles * act, int * NewStars, int NumNewStar, ForceTr
         struct NODE * nodes_base_tmp=NULL;
         int *Nextnode_tmp=NULL;
         int *Father_tmp=NULL;
+        int *LeafParticles_tmp=NULL;
         int *ActiveParticle_tmp=NULL;
+        /* The tree is usually allocated after the active list, but a tree kept
+         * from the last timestep for refitting (see run.c) is below it.*/
+        const int act_above_tree = act->ActiveParticle && force_tree_allocated(tree)
+                                && (char *) act->ActiveParticle > (char *) tree->Father;
+        /* The typed lists are directly above the active list. Nothing needs them after star formation.*/
+        if(act_above_tree && act->ActiveByType) {
+            myfree(act->ActiveByType);
+            act->ActiveByType = NULL;
+        }
+        if(act_above_tree) {
+            ActiveParticle_tmp = mymalloc2("ActiveParticle_tmp", act->NumActiveParticle * sizeof(int));
+            memmove(ActiveParticle_tmp, act->ActiveParticle, act->NumActiveParticle * sizeof(int));
+            myfree(act->ActiveParticle);
+        }
         if(force_tree_allocated(tree)) {
             nodes_base_tmp = mymalloc2("nodesbasetmp", tree->numnodes * sizeof(struct NODE));
             memmove(nodes_base_tmp, tree->Nodes_base, tree->numnodes * sizeof(struct NODE));
             myfree(tree->Nodes_base);
+            if(tree->LeafParticles) {
+                LeafParticles_tmp = mymalloc2("LeafParticles_tmp", tree->lastnode * sizeof(int));
+                memmove(LeafParticles_tmp, tree->LeafParticles, tree->lastnode * sizeof(int));
+                myfree(tree->LeafParticles);
+            }
             Father_tmp = mymalloc2("Father_tmp", PartManager->MaxPart * sizeof(int));
             memmove(Father_tmp, tree->Father, PartManager->MaxPart * sizeof(int));
             myfree(tree->Father);
@@ -326,7 +405,11 @@ sfr_reserve_slots(ActiveParticles * act, int * NewStars, int NumNewStar, ForceTr
             memmove(Nextnode_tmp, tree->Nextnode, tree->Nnextnode * sizeof(int));
             myfree(tree->Nextnode);
         }
-        if(act->ActiveParticle) {
+        if(act->ActiveByType) {
+            myfree(act->ActiveByType);
+            act->ActiveByType = NULL;
+        }
+        if(act->ActiveParticle && !act_above_tree) {
             ActiveParticle_tmp = mymalloc2("ActiveParticle_tmp", act->NumActiveParticle * sizeof(int));
             memmove(ActiveParticle_tmp, act->ActiveParticle, act->NumActiveParticle * sizeof(int));
             myfree(act->ActiveParticle);
@@ -340,24 +423,34 @@ sfr_reserve_slots(ActiveParticles * act, int * NewStars, int NumNewStar, ForceTr
         slots_reserve(1, atleast, SlotsManager);
 
         /*And now we need our memory back in the right place*/
-        if(ActiveParticle_tmp) {
+        if(ActiveParticle_tmp && !act_above_tree) {
             act->ActiveParticle = mymalloc("ActiveParticle", sizeof(int)*(act->NumActiveParticle + PartManager->MaxPart - PartManager->NumPart));
             memmove(act->ActiveParticle, ActiveParticle_tmp, act->NumActiveParticle * sizeof(int));
             myfree(ActiveParticle_tmp);
         }
         if(force_tree_allocated(tree)) {
-            tree->Nextnode = mymalloc("Nextnode", tree->Nnextnode * sizeof(int));
+            tree->Nextnode = hbmalloc("Nextnode", tree->Nnextnode * sizeof(int));
             memmove(tree->Nextnode, Nextnode_tmp, tree->Nnextnode * sizeof(int));
             myfree(Nextnode_tmp);
             tree->Father = mymalloc("Father", PartManager->MaxPart * sizeof(int));
             memmove(tree->Father, Father_tmp, PartManager->MaxPart * sizeof(int));
             myfree(Father_tmp);
-            tree->Nodes_base = mymalloc("Nodes_base", tree->numnodes * sizeof(struct NODE));
+            if(LeafParticles_tmp) {
+                tree->LeafParticles = mymalloc("LeafParticles", tree->lastnode * sizeof(int));
+                memmove(tree->LeafParticles, LeafParticles_tmp, tree->lastnode * sizeof(int));
+                myfree(LeafParticles_tmp);
+            }
+            tree->Nodes_base = hbmalloc("Nodes_base", tree->numnodes * sizeof(struct NODE));
             memmove(tree->Nodes_base, nodes_base_tmp, tree->numnodes * sizeof(struct NODE));
             myfree(nodes_base_tmp);
             /*Don't forget to update the Node pointer as well as Node_base!*/
             tree->Nodes = tree->Nodes_base - tree->firstnode;
         }
+        if(act_above_tree) {
+            act->ActiveParticle = mymalloc("ActiveParticle", sizeof(int)*(act->NumActiveParticle + PartManager->MaxPart - PartManager->NumPart));
+            memmove(act->ActiveParticle, ActiveParticle_tmp, act->NumActiveParticle * sizeof(int));
+            myfree(ActiveParticle_tmp);
+        }
         if(new_star_tmp) {
             NewStars = mymalloc("NewStars", NumNewStar*sizeof(int));
             memmove(NewStars, new_star_tmp, NumNewStar * sizeof(int));
@@ -602,7 +695,7 @@ starformation(int i, double *localsfr, double * sum_sm)
         /* If we get a fraction of the mass we need to create
          * a new particle for the star and remove mass from i.*/
         if(P[i].Mass >= 1.1 * mass_of_star)
-            newstar = slots_split_particle(i, mass_of_star, PartManager);
+            newstar = slots_split_particle_deferred(i, mass_of_star, PartManager);
     }
 
     /* Add the rest of the metals if we didn't form a star.
@@ -28,6 +28,14 @@ void init_cooling_and_star_formation(void);
 /*Do the cooling and the star formation. The tree is required for the winds only.*/
 void cooling_and_starformation(ActiveParticles * act, ForceTree * tree);
 
+/* Reserve a star slot for every local star-forming gas particle.
+ * Call after the domain exchange and before the tree or the active list are allocated,
+ * when the slots can be extended in place.*/
+void sfr_reserve_star_slots(void);
+/* True if the star slots reserved by sfr_reserve_star_slots are still enough for every
+ * local star-forming gas particle. Used to decide whether a step may refit a kept tree.*/
+int sfr_star_slots_reserved(void);
+
 /*Get the neutral fraction of a particle correctly, even when on the star-forming equation of state.
  * This calls the cooling routines for the current internal energy when off the equation of state, but
  * when on the equation of state calls them separately for the cold and hot gas.*/
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <omp.h>
 #include "slotsmanager.h"
 #include "partmanager.h"
 
@@ -8,6 +9,11 @@ struct slots_manager_type SlotsManager[1];
 
 #define SLOTS_ENABLED(ptype, sman) (sman->info[ptype].enabled)
 
+/* Above this fraction of garbage, gc shifts all particles down over the holes, preserving their order.
+ * Below it, gc moves particles from the end of the array into the holes, which touches
+ * only as many particles as there is garbage, but does not preserve the order.*/
+#define SLOTS_GC_FILL_FRACTION 0.05
+
 MPI_Datatype MPI_TYPE_PARTICLE = 0;
 MPI_Datatype MPI_TYPE_PLAN_ENTRY = 0;
 MPI_Datatype MPI_TYPE_SLOT[6] = {0};
@@ -79,6 +85,8 @@ slots_convert(int parent, int ptype, int placement, struct part_manager_type * p
         slots_connect_new_slot(parent, newPI, ptype, pman, sman);
     }
     /*Type changed after slot updated*/
+    if(pman->Base[parent].Type != ptype)
+        pman->Base[parent].InDeltaBase = 0;
     pman->Base[parent].Type = ptype;
     return parent;
 }
@@ -97,10 +105,10 @@ slots_convert(int parent, int ptype, int placement, struct part_manager_type * p
  * the new particle's index is returned.
  *
  * Its mass and ptype can be then adjusted using slots_convert.
- * The 'new particle' event is emitted.
+ * The 'new particle' event is not emitted: see slots_split_particle.
  * */
 int
-slots_split_particle(int parent, double childmass, struct part_manager_type * pman)
+slots_split_particle_deferred(int parent, double childmass, struct part_manager_type * pman)
 {
     int child = atomic_fetch_and_add(&pman->NumPart, 1);
 
@@ -121,6 +129,17 @@ slots_split_particle(int parent, double childmass, struct part_manager_type * pm
 
     /*Invalidate the slot of the child. Call slots_convert soon afterwards!*/
     pman->Base[child].PI = -1;
+    /* The child is a new particle, not in any snapshot*/
+    pman->Base[child].InDeltaBase = 0;
+
+    return child;
+}
+
+/* Split a particle as slots_split_particle_deferred, and emit the 'new particle' event.*/
+int
+slots_split_particle(int parent, double childmass, struct part_manager_type * pman)
+{
+    int child = slots_split_particle_deferred(parent, childmass, pman);
 
     /*! When a new additional star particle is created, we can put it into the
      *  tree at the position of the spawning gas particle. This is possible
@@ -138,10 +157,28 @@ slots_split_particle(int parent, double childmass, struct part_manager_type * pm
     return child;
 }
 
+void
+slots_emit_forks(const int * parents, const int * children, const int n)
+{
+    EISlotsFork * events = (EISlotsFork *) mymalloc("ForkEvents", (n + 1) * sizeof(EISlotsFork));
+    int i, nfork = 0;
+    for(i = 0; i < n; i++) {
+        if(children[i] == parents[i])
+            continue;
+        events[nfork].parent = parents[i];
+        events[nfork].child = children[i];
+        nfork++;
+    }
+    event_emit_batch(&EventSlotsFork, (EIBase *) events, nfork, sizeof(EISlotsFork));
+    myfree(events);
+}
+
 /* remove garbage particles, holes in sph chunk and holes in bh buffer.
- * This algorithm is O(n), and shifts particles over the holes.
+ * With a little garbage, particles from the end of the array are moved into the holes,
+ * so only O(garbage) particles move. With more than SLOTS_GC_FILL_FRACTION garbage,
+ * the algorithm is O(n), and shifts particles over the holes, preserving their order.
  * compact_slots is a 6-member array, 1 if that slot should be compacted, 0 otherwise.
- * As slots_gc_base preserves the order of the slots, one may usually skip compaction.*/
+ * As slots_gc_base does not move the slots, one may usually skip compaction.*/
 int
 slots_gc(int * compact_slots, struct part_manager_type * pman, struct slots_manager_type * sman)
 {
@@ -231,6 +268,96 @@ slots_gc_compact(const int used, int ptype, struct part_manager_type * pman, str
     return ngc;
 }
 
+/* Find the garbage particles, in ascending order. Two passes with the same static schedule,
+ * so each thread writes the garbage of its own contiguous range at its own offset.
+ * Returns the number of garbage particles. If there are more than maxgc, returns without storing them.
+ * The list is allocated with mymalloc2 and must be freed by the caller if it is not NULL.*/
+static int
+slots_gc_find_garbage(const int used, const int maxgc, int ** garbage, int ptype, struct part_manager_type * pman, struct slots_manager_type * sman)
+{
+    int * ngthread = ta_malloc("ngthread", int, omp_get_max_threads() + 1);
+    int ngc = 0;
+    *garbage = NULL;
+
+    #pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        int i, nlocal = 0;
+        #pragma omp for schedule(static)
+        for(i = 0; i < used; i++)
+            if(GARBAGE(i, ptype, pman, sman))
+                nlocal++;
+        ngthread[tid] = nlocal;
+        #pragma omp barrier
+        #pragma omp single
+        {
+            int t;
+            for(t = 0; t < omp_get_num_threads(); t++) {
+                const int nt = ngthread[t];
+                ngthread[t] = ngc;
+                ngc += nt;
+            }
+            if(ngc > 0 && ngc <= maxgc)
+                *garbage = (int *) mymalloc2("GarbageList", ngc * sizeof(int));
+        }
+        /* The implicit barrier of single makes the list visible*/
+        if(*garbage) {
+            int offset = ngthread[tid];
+            #pragma omp for schedule(static)
+            for(i = 0; i < used; i++)
+                if(GARBAGE(i, ptype, pman, sman))
+                    (*garbage)[offset++] = i;
+        }
+    }
+    ta_free(ngthread);
+    return ngc;
+}
+
+/* Remove the garbage by moving the last non-garbage particles into the holes.
+ * Only the particles at the end of the array move, so the cost scales with the amount of garbage,
+ * but the order is not preserved. With much garbage, falls back to the order-preserving slots_gc_compact.
+ * When compacting slots, the moved slots are relinked here, using the ReverseLink set by slots_gc_mark.
+ * Returns the number of garbage particles removed and sets *filled if the fill was used.*/
+static int
+slots_gc_fill(const int used, int ptype, int * filled, struct part_manager_type * pman, struct slots_manager_type * sman)
+{
+    int * garbage;
+    const int maxgc = SLOTS_GC_FILL_FRACTION * used;
+    const int ngc = slots_gc_find_garbage(used, maxgc, &garbage, ptype, pman, sman);
+
+    *filled = 0;
+    if(ngc == 0)
+        return 0;
+    if(!garbage)
+        return slots_gc_compact(used, ptype, pman, sman);
+
+    size_t size = sizeof(struct particle_data);
+    if(sman)
+        size = sman->info[ptype].elsize;
+
+    /* Holes below newused are filled with the non-garbage particles at or above it,
+     * of which there are exactly as many.*/
+    const int newused = used - ngc;
+    int last = ngc - 1;
+    int src = used - 1;
+    int h;
+    for(h = 0; h < ngc && garbage[h] < newused; h++) {
+        /* Skip garbage at the end of the array*/
+        while(last >= 0 && garbage[last] == src) {
+            last--;
+            src--;
+        }
+        const int dest = garbage[h];
+        memcpy(PART(dest, ptype, pman, sman), PART(src, ptype, pman, sman), size);
+        if(sman)
+            pman->Base[BASESLOT_PI(dest, ptype, sman)->ReverseLink].PI = dest;
+        src--;
+    }
+    myfree(garbage);
+    *filled = 1;
+    return ngc;
+}
+
 static int
 slots_gc_base(struct part_manager_type * pman)
 {
@@ -240,7 +367,8 @@ slots_gc_base(struct part_manager_type * pman)
 
     /*Compactify the P array: this invalidates the ReverseLink, so
         * that ReverseLink is valid only within gc.*/
-    int ngc = slots_gc_compact(pman->NumPart, -1, pman, NULL);
+    int filled;
+    int ngc = slots_gc_fill(pman->NumPart, -1, &filled, pman, NULL);
 
     pman->NumPart -= ngc;
 
@@ -304,17 +432,25 @@ slots_gc_mark(const struct part_manager_type * pman, const struct slots_manager_
     return 0;
 }
 
-/* sweep removes unused entries in the slot list. */
+static void
+slots_gc_collect(int ptype, struct part_manager_type * pman, struct slots_manager_type * sman);
+
+/* sweep removes unused entries in the slot list and updates the links from P. */
 static int
 slots_gc_sweep(int ptype, struct part_manager_type * pman, struct slots_manager_type * sman)
 {
     if(!SLOTS_ENABLED(ptype, sman)) return 0;
     int used = sman->info[ptype].size;
 
-    int ngc = slots_gc_compact(used, ptype, pman, sman);
+    int filled;
+    int ngc = slots_gc_fill(used, ptype, &filled, pman, sman);
 
     sman->info[ptype].size -= ngc;
 
+    /* The fill relinks the slots it moved; a compaction moves everything after the first hole.*/
+    if(ngc > 0 && !filled)
+        slots_gc_collect(ptype, pman, sman);
+
     return ngc;
 }
 
@@ -368,7 +504,6 @@ slots_gc_slots(int * compact_slots, struct part_manager_type * pman, struct slot
             if(!compact_slots[ptype])
                 continue;
             slots_gc_sweep(ptype, pman, sman);
-            slots_gc_collect(ptype, pman, sman);
         }
     }
 #ifdef DEBUG
@@ -385,26 +520,18 @@ slots_gc_slots(int * compact_slots, struct part_manager_type * pman, struct slot
     return 0;
 }
 
-static int
-order_by_type_and_key(const void *a, const void *b)
+/* Garbage goes last. Particles of all types are then in Peano order,
+ * so each tree node covers a contiguous range of particles.
+ * Peano keys have 3 * BITS_PER_DIMENSION = 63 bits, so the garbage flag is the top bit.*/
+static void
+radix_by_key_and_type(const void * a, void * radix, void * arg)
 {
     const struct particle_data * pa  = (const struct particle_data *) a;
-    const struct particle_data * pb  = (const struct particle_data *) b;
-
-    if(pa->IsGarbage && !pb->IsGarbage)
-        return +1;
-    if(!pa->IsGarbage && pb->IsGarbage)
-        return -1;
-    if(pa->Type < pb->Type)
-        return -1;
-    if(pa->Type > pb->Type)
-        return +1;
-    if(pa->Key < pb->Key)
-        return -1;
-    if(pa->Key > pb->Key)
-        return +1;
-
-    return 0;
+    uint64_t * u = (uint64_t *) radix;
+    u[0] = pa->Type;
+    u[1] = pa->Key;
+    if(pa->IsGarbage)
+        u[1] |= ((uint64_t) 1) << 63;
 }
 
 /*Returns the number of non-Garbage particles in an array with garbage sorted to the end.
@@ -435,7 +562,7 @@ slots_get_last_garbage(int nfirst, int nlast, int ptype, const struct part_manag
     return nlast;
 }
 
-/* Sort the particles and their slots by type and peano order.
+/* Sort the particles by peano order and their slots by the order of the particles.
  * This does a gc by sorting the Garbage to the end of the array and then trimming.
  * It is a different algorithm to slots_gc, somewhat slower,
  * but delivers a spatially compact sort. It always compacts the slots*/
@@ -443,9 +570,9 @@ void
 slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sman)
 {
     int ptype;
-    /* Resort the particles such that those of the same type and key are close by.
+    /* Resort the particles such that those with the same key are close by.
      * The locality is broken by the exchange. */
-    qsort_openmp(pman->Base, pman->NumPart, sizeof(struct particle_data), order_by_type_and_key);
+    radix_sort_openmp(pman->Base, pman->NumPart, sizeof(struct particle_data), radix_by_key_and_type, 16, NULL);
 
     /*Remove garbage particles*/
     pman->NumPart = slots_get_last_garbage(0, pman->NumPart -1 , -1, pman, NULL);
@@ -675,11 +802,15 @@ slots_allocate_sph_scratch_data(int sph_grad_rho, int nsph, struct sph_scratch_d
     sph_scratch->Injected_BH_Energy = NULL;
     sph_scratch->EntVarPred = mymalloc2("EntVarPred", sizeof(MyFloat) * nsph);
     sph_scratch->VelPred = mymalloc2("VelPred", sizeof(MyFloat) * 3 * nsph);
+    sph_scratch->PredState = mymalloc2("SPH_PredState", sizeof(int) * nsph);
+    memset(sph_scratch->PredState, 0, sizeof(int) * nsph);
 }
 
 void
 slots_free_sph_scratch_data(struct sph_scratch_data * sph_scratch)
 {
+    myfree(sph_scratch->PredState);
+    sph_scratch->PredState = NULL;
     myfree(sph_scratch->VelPred);
     sph_scratch->VelPred = NULL;
     myfree(sph_scratch->EntVarPred);
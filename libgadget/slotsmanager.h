@@ -21,6 +21,9 @@ struct particle_data_ext {
     /* Used at GC for reverse link to P.
      * Garbage slots have this impossibly large. */
     int ReverseLink;
+    /* Distance to the nearest DM particle at the last FOF call, used by fof.c as the
+     * first search radius of the next call. Only a hint: any value is safe. Fills the padding before ID.*/
+    float FOFDMDist;
     MyIDType ID; /* for data consistency check, same as particle ID */
 };
 
@@ -87,6 +90,11 @@ struct sph_particle_data
                             /*!< VS08: remaining waiting for wind particle to be eligible to form winds again */
     MyFloat Sfr; /* Star formation rate. Stored here because, if the H2 dependent star formation is used,
                     it depends on the scratch variable GradRho and thus cannot be recomputed after a fof-exchange. */
+    /* Smallest timebin of the SPH neighbours at the last hydro step, for the NgbTimeBinLimit*/
+    int MinNgbTimeBin;
+    /* Set by the hydro walk of a neighbour on a much shorter step. The step of this
+     * particle is then shortened so that it is active at the next timestep.*/
+    int WakeUp;
 };
 
 struct sph_scratch_data
@@ -101,10 +109,21 @@ struct sph_scratch_data
      * which defeats the lookup cache in timefac.c. Because VelPred is used multiple times,
      * it is much quicker to compute it once and re-use this*/
     MyFloat * VelPred;            /*!< Predicted velocity at current particle drift time for SPH. 3x vector.*/
+    /* EntVarPred and VelPred of a slot are computed on first use, by density_ensure_predicted.
+     * On small steps only the active particles and their neighbours are predicted.
+     * One of the SPH_PRED_ values for each slot.*/
+    int * PredState;
     /*Used to store the BH feedback energy if black holes are on*/
     MyFloat * Injected_BH_Energy;
 };
 
+enum SphPredState {
+    SPH_PRED_NONE = 0,
+    /* Being computed by another thread*/
+    SPH_PRED_BUSY = 1,
+    SPH_PRED_DONE = 2,
+};
+
 extern struct slots_manager_type {
     struct slot_info info[6];
     char * Base; /* memory ptr that holds of all slots */
@@ -142,6 +161,12 @@ void slots_mark_garbage(int i, struct part_manager_type * pman, struct slots_man
 void slots_setup_topology(struct part_manager_type * pman, struct slots_manager_type * sman);
 void slots_setup_id(const struct part_manager_type * pman, struct slots_manager_type * sman);
 int slots_split_particle(int parent, double childmass, struct part_manager_type * pman);
+/* Split a particle without emitting the fork event. Call slots_emit_forks
+ * for all the new particles before the tree or the active particle list are used.*/
+int slots_split_particle_deferred(int parent, double childmass, struct part_manager_type * pman);
+/* Emit the fork events for the particles children[i] split from parents[i] in one batch.
+ * Entries with children[i] == parents[i] were not split and are skipped.*/
+void slots_emit_forks(const int * parents, const int * children, const int n);
 int slots_convert(int parent, int ptype, int placement, struct part_manager_type * pman, struct slots_manager_type * sman);
 int slots_gc(int * compact_slots, struct part_manager_type * pman, struct slots_manager_type * sman);
 void slots_gc_sorted(struct part_manager_type * pman, struct slots_manager_type * sman);
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <omp.h>
 
 #include "allvars.h"
 #include "timestep.h"
@@ -42,8 +43,10 @@ struct state_of_system
  * Currently, not all the information that's computed here is
  * actually used (e.g. momentum is not really used anywhere),
  * just the energies are written to a log-file every once in a while.
+ * The mean gas temperature needs the ionization equilibrium of every gas particle,
+ * so it is only computed if WithTemperature is true.
  */
-struct state_of_system compute_global_quantities_of_system(void)
+struct state_of_system compute_global_quantities_of_system(int WithTemperature)
 {
     int i, j;
     struct state_of_system sys;
@@ -57,40 +60,67 @@ struct state_of_system compute_global_quantities_of_system(void)
     double redshift = 1. / All.Time - 1;
     memset(&sys, 0, sizeof(sys));
 
+    /* Each thread sums into its own copy, which are added up afterwards.*/
+    const int NumThreads = omp_get_max_threads();
+    struct state_of_system * ThreadSys = ta_malloc("ThreadSys", struct state_of_system, NumThreads);
+    memset(ThreadSys, 0, NumThreads * sizeof(ThreadSys[0]));
+
     #pragma omp parallel for
     for(i = 0; i < PartManager->NumPart; i++)
     {
+        struct state_of_system * tsys = &ThreadSys[omp_get_thread_num()];
         int j;
         double entr = 0, egyspec;
 
-        sys.MassComp[P[i].Type] += P[i].Mass;
+        tsys->MassComp[P[i].Type] += P[i].Mass;
 
-        sys.EnergyPotComp[P[i].Type] += 0.5 * P[i].Mass * P[i].Potential / a1;
+        tsys->EnergyPotComp[P[i].Type] += 0.5 * P[i].Mass * P[i].Potential / a1;
 
-        sys.EnergyKinComp[P[i].Type] +=
+        tsys->EnergyKinComp[P[i].Type] +=
             0.5 * P[i].Mass * (P[i].Vel[0] * P[i].Vel[0] + P[i].Vel[1] * P[i].Vel[1] + P[i].Vel[2] * P[i].Vel[2]) / a2;
 
         if(P[i].Type == 0)
         {
-            struct UVBG uvbg = get_local_UVBG(redshift, P[i].Pos);
             entr = SPHP(i).Entropy;
             egyspec = entr / (GAMMA_MINUS1) * pow(SPH_EOMDensity(i) / a3, GAMMA_MINUS1);
-            sys.EnergyIntComp[0] += P[i].Mass * egyspec;
-            double ne = SPHP(i).Ne;
-            sys.TemperatureComp[0] += P[i].Mass * get_temp(SPH_EOMDensity(i), egyspec, (1 - HYDROGEN_MASSFRAC), &uvbg, &ne);
+            tsys->EnergyIntComp[0] += P[i].Mass * egyspec;
+            if(WithTemperature) {
+                struct UVBG uvbg = get_local_UVBG(redshift, P[i].Pos);
+                double ne = SPHP(i).Ne;
+                tsys->TemperatureComp[0] += P[i].Mass * get_temp(SPH_EOMDensity(i), egyspec, (1 - HYDROGEN_MASSFRAC), &uvbg, &ne);
+            }
         }
 
         for(j = 0; j < 3; j++)
         {
-            sys.MomentumComp[P[i].Type][j] += P[i].Mass * P[i].Vel[j];
-            sys.CenterOfMassComp[P[i].Type][j] += P[i].Mass * P[i].Pos[j];
+            tsys->MomentumComp[P[i].Type][j] += P[i].Mass * P[i].Vel[j];
+            tsys->CenterOfMassComp[P[i].Type][j] += P[i].Mass * P[i].Pos[j];
         }
 
-        sys.AngMomentumComp[P[i].Type][0] += P[i].Mass * (P[i].Pos[1] * P[i].Vel[2] - P[i].Pos[2] * P[i].Vel[1]);
-        sys.AngMomentumComp[P[i].Type][1] += P[i].Mass * (P[i].Pos[2] * P[i].Vel[0] - P[i].Pos[0] * P[i].Vel[2]);
-        sys.AngMomentumComp[P[i].Type][2] += P[i].Mass * (P[i].Pos[0] * P[i].Vel[1] - P[i].Pos[1] * P[i].Vel[0]);
+        tsys->AngMomentumComp[P[i].Type][0] += P[i].Mass * (P[i].Pos[1] * P[i].Vel[2] - P[i].Pos[2] * P[i].Vel[1]);
+        tsys->AngMomentumComp[P[i].Type][1] += P[i].Mass * (P[i].Pos[2] * P[i].Vel[0] - P[i].Pos[0] * P[i].Vel[2]);
+        tsys->AngMomentumComp[P[i].Type][2] += P[i].Mass * (P[i].Pos[0] * P[i].Vel[1] - P[i].Pos[1] * P[i].Vel[0]);
     }
 
+    int t;
+    for(t = 0; t < NumThreads; t++)
+    {
+        for(i = 0; i < 6; i++)
+        {
+            sys.MassComp[i] += ThreadSys[t].MassComp[i];
+            sys.EnergyPotComp[i] += ThreadSys[t].EnergyPotComp[i];
+            sys.EnergyKinComp[i] += ThreadSys[t].EnergyKinComp[i];
+            sys.EnergyIntComp[i] += ThreadSys[t].EnergyIntComp[i];
+            sys.TemperatureComp[i] += ThreadSys[t].TemperatureComp[i];
+            for(j = 0; j < 3; j++)
+            {
+                sys.MomentumComp[i][j] += ThreadSys[t].MomentumComp[i][j];
+                sys.AngMomentumComp[i][j] += ThreadSys[t].AngMomentumComp[i][j];
+                sys.CenterOfMassComp[i][j] += ThreadSys[t].CenterOfMassComp[i][j];
+            }
+        }
+    }
+    ta_free(ThreadSys);
 
     /* some the stuff over all processors */
     MPI_Reduce(&sys.MassComp[0], &SysState.MassComp[0], 6, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
@@ -188,13 +218,15 @@ struct state_of_system compute_global_quantities_of_system(void)
 /*! This routine first calls a computation of various global
  * quantities of the particle distribution, and then writes some
  * statistics about the energies in the various particle components to
- * the file FdEnergy.
+ * the file FdEnergy. The gas temperature is written as zero
+ * unless OutputEnergyTemperature is set.
  */
 void energy_statistics(void)
 {
-    struct state_of_system SysState = compute_global_quantities_of_system();
+    struct state_of_system SysState = compute_global_quantities_of_system(All.OutputEnergyTemperature);
 
-    message(0, "Time %g Mean Temperature of Gas %g\n",
+    if(All.OutputEnergyTemperature)
+        message(0, "Time %g Mean Temperature of Gas %g\n",
                 All.Time, SysState.TemperatureComp[0]);
 
     if(ThisTask == 0)
@@ -0,0 +1,113 @@
+/*Tests for the in-memory buddy checkpoints*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <mpi.h>
+#include <string.h>
+
+#include <libgadget/buddy.h>
+#include <libgadget/slotsmanager.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/walltime.h>
+#include <libgadget/slotsmanager.c>
+#include "stub.h"
+
+double walltime_measure_site(struct WalltimeSite * site, char * name, char * file, int line) {
+    return MPI_Wtime();
+}
+
+struct part_manager_type PartManager[1] = {{0}};
+int NTask, ThisTask;
+
+/* Each rank has a different number of particles, so a copy restored to the wrong rank is noticed*/
+static void
+setup_particles(void)
+{
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    int NType[6] = {4 + ThisTask, 2, 0, 0, 3 + ThisTask, 1};
+    PartManager->MaxPart = 1024;
+    PartManager->NumPart = 0;
+    int ptype, i;
+    for(ptype = 0; ptype < 6; ptype ++)
+        PartManager->NumPart += NType[ptype];
+
+    P = (struct particle_data *) mymalloc("P", PartManager->MaxPart * sizeof(struct particle_data));
+    memset(P, 0, sizeof(struct particle_data) * PartManager->MaxPart);
+
+    slots_init(0.01 * PartManager->MaxPart, SlotsManager);
+    slots_set_enabled(0, sizeof(struct sph_particle_data), SlotsManager);
+    slots_set_enabled(4, sizeof(struct star_particle_data), SlotsManager);
+    slots_set_enabled(5, sizeof(struct bh_particle_data), SlotsManager);
+    slots_reserve(1, NType, SlotsManager);
+
+    ptype = 0;
+    int itype = 0;
+    for(i = 0; i < PartManager->NumPart; i ++) {
+        while(NType[ptype] == 0)
+            ptype++;
+        P[i].ID = 1000 * ThisTask + i;
+        P[i].Type = ptype;
+        P[i].Mass = ThisTask + 0.5;
+        itype ++;
+        if(itype == NType[ptype]) {
+            ptype++; itype = 0;
+        }
+    }
+    slots_setup_topology(PartManager, SlotsManager);
+    slots_setup_id(PartManager, SlotsManager);
+    for(i = 0; i < SlotsManager->info[4].size; i++)
+        ((struct star_particle_data *) SlotsManager->info[4].ptr)[i].Metallicity = ThisTask + i;
+}
+
+static void
+teardown_particles(void)
+{
+    slots_free(SlotsManager);
+    myfree(P);
+}
+
+static void
+test_buddy_checkpoint(void **state)
+{
+    setup_particles();
+    int64_t tag = -1;
+    /* Nothing saved yet*/
+    assert_int_equal(buddy_checkpoint_restore(PartManager, SlotsManager, &tag, MPI_COMM_WORLD), -1);
+
+    buddy_checkpoint_save(PartManager, SlotsManager, 42, MPI_COMM_WORLD);
+    const int NumPart = PartManager->NumPart;
+    const int nstar = SlotsManager->info[4].size;
+
+    /* Lose the state of this rank*/
+    memset(P, 0, sizeof(struct particle_data) * PartManager->MaxPart);
+    PartManager->NumPart = 0;
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++)
+        SlotsManager->info[ptype].size = 0;
+
+    assert_int_equal(buddy_checkpoint_restore(PartManager, SlotsManager, &tag, MPI_COMM_WORLD), 0);
+    assert_int_equal(tag, 42);
+    assert_int_equal(PartManager->NumPart, NumPart);
+    assert_int_equal(SlotsManager->info[4].size, nstar);
+    int i;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        assert_int_equal(P[i].ID, 1000 * ThisTask + i);
+        assert_true(P[i].Mass == ThisTask + 0.5);
+    }
+    for(i = 0; i < nstar; i++)
+        assert_true(((struct star_particle_data *) SlotsManager->info[4].ptr)[i].Metallicity == ThisTask + i);
+    slots_check_id_consistency(PartManager, SlotsManager);
+
+    buddy_checkpoint_free();
+    teardown_particles();
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_buddy_checkpoint),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
@@ -252,11 +252,58 @@ static void test_heatingcooling_rate(void ** state)
     assert_true(fabs(LambdaNet/ (-1.64834) - 1) < 1e-3);
 }
 
+/* Check the batched rates with the tabulated starting point agree with the scalar rates.*/
+static void test_heatingcooling_rate_batch(void ** state)
+{
+    struct cooling_params coolpar = get_test_coolpar();
+    const char * TreeCool = GADGET_TESTDATA_ROOT "/examples/TREECOOL_ep_2018p";
+    const char * MetalCool = "";
+
+    Cosmology CP = {0};
+    CP.OmegaCDM = 0.3;
+    CP.OmegaBaryon = coolpar.fBar * CP.OmegaCDM;
+    CP.HubbleParam = 0.7;
+
+    set_coolpar(coolpar);
+    init_cooling_rates(TreeCool, MetalCool, &CP);
+    struct UVBG uvbg = get_global_UVBG(2);
+
+    #define NBATCH 40
+    double dens[NBATCH], ienergy[NBATCH], helium[NBATCH], metal[NBATCH];
+    double ne[NBATCH], LambdaNet[NBATCH], neref[NBATCH], Lambdaref[NBATCH];
+    double maxlambda = 0;
+    int i;
+    for(i = 0; i < NBATCH; i++) {
+        dens[i] = pow(10, -6 + (i % 8) * 0.75);
+        ienergy[i] = pow(10, 11 + (i / 8) * 0.8);
+        helium[i] = 1 - HYDROGEN_MASSFRAC;
+        metal[i] = 0;
+        /* The reference is computed before the table exists*/
+        neref[i] = 1.0;
+        Lambdaref[i] = get_heatingcooling_rate(dens[i], ienergy[i], helium[i], 2, 0, &uvbg, &neref[i]);
+        if(fabs(Lambdaref[i]) > maxlambda)
+            maxlambda = fabs(Lambdaref[i]);
+        ne[i] = 1.0;
+    }
+    /* One particle does not match the helium fraction of the table*/
+    helium[3] = 0.2;
+    neref[3] = 1.0;
+    Lambdaref[3] = get_heatingcooling_rate(dens[3], ienergy[3], helium[3], 2, 0, &uvbg, &neref[3]);
+
+    set_equilib_ne_table(&uvbg, 1 - HYDROGEN_MASSFRAC);
+    get_heatingcooling_rate_batch(NBATCH, dens, ienergy, helium, 2, metal, &uvbg, ne, LambdaNet);
+    for(i = 0; i < NBATCH; i++) {
+        assert_true(fabs(ne[i] - neref[i]) < 1e-5);
+        assert_true(fabs(LambdaNet[i] - Lambdaref[i]) < 1e-4 * maxlambda);
+    }
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_recomb_rates),
         cmocka_unit_test(test_rate_network),
         cmocka_unit_test(test_heatingcooling_rate),
+        cmocka_unit_test(test_heatingcooling_rate_batch),
         cmocka_unit_test(test_uvbg_loader)
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
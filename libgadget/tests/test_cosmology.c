@@ -11,6 +11,7 @@
 #include <gsl/gsl_sf_hyperg.h>
 #include <libgadget/physconst.h>
 #include <libgadget/cosmology.h>
+#include <libgadget/utils.h>
 #include "stub.h"
 
 /*Neutrinos are tested elsewhere*/
@@ -90,9 +91,30 @@ static void test_cosmology(void ** state)
     assert_true(fabs(0.01*log(GrowthFactor(&CP, 0.01+1e-5,0.01-1e-5))/2e-5 -  F_Omega(&CP, 0.01)) < 1e-3);
 }
 
+/*Check the interpolated growth factor against the direct integration*/
+static void test_growth_table(void ** state)
+{
+    Cosmology CP;
+    setup_cosmology(&CP, 0.3, 0.0455, 0.7);
+    /* No table: always integrates*/
+    Cosmology CPexact = CP;
+    init_growth_table(&CP, 0.01, 1.);
+    assert_int_equal(CP.GrowthTableN, 1024);
+    double a;
+    for(a = 0.01; a <= 1; a *= 1.07) {
+        assert_true(fabs(GrowthFactor(&CP, a, 1.)/GrowthFactor(&CPexact, a, 1.) - 1) < 1e-5);
+        assert_true(fabs(F_Omega(&CP, a)/F_Omega(&CPexact, a) - 1) < 1e-4);
+    }
+    /* The ends of the table are interpolated, outside it is integrated*/
+    assert_true(fabs(GrowthFactor(&CP, 0.01, 1.)/GrowthFactor(&CPexact, 0.01, 1.) - 1) < 1e-5);
+    assert_true(GrowthFactor(&CP, 0.005, 2.) == GrowthFactor(&CPexact, 0.005, 2.));
+    myfree(CP.GrowthTable);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_cosmology),
+        cmocka_unit_test(test_growth_table),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
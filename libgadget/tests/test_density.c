@@ -170,7 +170,7 @@ static void test_density_flat(void ** state) {
         P[i].Pos[1] = (All.BoxSize/ncbrt) * ((i/ncbrt) % ncbrt);
         P[i].Pos[2] = (All.BoxSize/ncbrt) * (i % ncbrt);
     }
-    do_density_test(state, numpart, 0.508875, 1e-4);
+    do_density_test(state, numpart, 0.507921, 1e-4);
 }
 
 static void test_density_close(void ** state) {
@@ -252,6 +252,28 @@ static void test_density_random(void ** state) {
 }
 
 
+/* Check the batched kernels agree with the scalar ones for each kernel type*/
+static void test_density_kernel_many(void ** state) {
+    const enum DensityKernelType types[3] = {DENSITY_KERNEL_CUBIC_SPLINE, DENSITY_KERNEL_QUINTIC_SPLINE, DENSITY_KERNEL_QUARTIC_SPLINE};
+    const int n = 37;
+    double u[37], wk[37], dwk[37];
+    int i, t;
+    for(i = 0; i < n; i++)
+        u[i] = 1.1 * i / (n - 1);
+    for(t = 0; t < 3; t++) {
+        DensityKernel kernel;
+        density_kernel_init(&kernel, 0.7, types[t]);
+        density_kernel_wk_many(&kernel, u, wk, n);
+        density_kernel_dwk_many(&kernel, u, dwk, n);
+        for(i = 0; i < n; i++) {
+            assert_true(fabs(wk[i] - density_kernel_wk(&kernel, u[i])) <= 1e-12 * kernel.Wknorm);
+            assert_true(fabs(dwk[i] - density_kernel_dwk(&kernel, u[i])) <= 1e-12 * kernel.dWknorm);
+            if(u[i] >= 1)
+                assert_true(wk[i] == 0 && dwk[i] == 0);
+        }
+    }
+}
+
 /*Make a simple trivial domain for all data on a single processor*/
 void trivial_domain(DomainDecomp * ddecomp)
 {
@@ -329,6 +351,7 @@ int main(void) {
         cmocka_unit_test(test_density_flat),
         cmocka_unit_test(test_density_close),
         cmocka_unit_test(test_density_random),
+        cmocka_unit_test(test_density_kernel_many),
     };
     return cmocka_run_group_tests_mpi(tests, setup_density, teardown_density);
 }
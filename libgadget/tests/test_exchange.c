@@ -17,12 +17,13 @@
 #include <libgadget/domain.h>
 #include <libgadget/slotsmanager.h>
 #include <libgadget/partmanager.h>
+#include <libgadget/walltime.h>
 /*Note this includes the garbage collection!
  * Should be tested separately.*/
 #include <libgadget/slotsmanager.c>
 #include "stub.h"
 
-double walltime_measure_full(char * name, char * file, int line) {
+double walltime_measure_site(struct WalltimeSite * site, char * name, char * file, int line) {
     return MPI_Wtime();
 }
 
@@ -105,7 +106,7 @@ test_exchange(void **state)
 
     int i;
 
-    int fail = domain_exchange(&test_exchange_layout_func, NULL, 1, PartManager, SlotsManager, MPI_COMM_WORLD);
+    int fail = domain_exchange(&test_exchange_layout_func, NULL, 1, 1, PartManager, SlotsManager, MPI_COMM_WORLD);
 
     assert_all_true(!fail);
 
@@ -129,7 +130,7 @@ test_exchange_zero_slots(void **state)
 
     int i;
 
-    int fail = domain_exchange(&test_exchange_layout_func, NULL, 1, PartManager, SlotsManager, MPI_COMM_WORLD);
+    int fail = domain_exchange(&test_exchange_layout_func, NULL, 1, 1, PartManager, SlotsManager, MPI_COMM_WORLD);
 
     assert_all_true(!fail);
 
@@ -155,7 +156,7 @@ test_exchange_with_garbage(void **state)
     slots_mark_garbage(0, PartManager, SlotsManager); /* watch out! this propogates the garbage flag to children */
     TotNumPart -= NTask;
 
-    int fail = domain_exchange(&test_exchange_layout_func, NULL, 1, PartManager, SlotsManager, MPI_COMM_WORLD);
+    int fail = domain_exchange(&test_exchange_layout_func, NULL, 1, 1, PartManager, SlotsManager, MPI_COMM_WORLD);
 
     assert_all_true(!fail);
 
@@ -174,6 +175,33 @@ test_exchange_with_garbage(void **state)
     return;
 }
 
+/* The table is too full for the imported particles to go after the ones we have,
+ * so this uses the exchange in batches, which collects the exported particles first.*/
+static void
+test_exchange_full(void **state)
+{
+    int newSlots[6] = {170, 170, 170, 170, 170, 170};
+
+    setup_particles(newSlots);
+
+    int i;
+
+    int fail = domain_exchange(&test_exchange_layout_func, NULL, 0, 1, PartManager, SlotsManager, MPI_COMM_WORLD);
+
+    assert_all_true(!fail);
+
+    slots_check_id_consistency(PartManager, SlotsManager);
+    domain_test_id_uniqueness(PartManager);
+
+    for(i = 0; i < PartManager->NumPart; i ++) {
+        assert_true(P[i].ID % NTask == ThisTask);
+        assert_true(P[i].IsGarbage == 0);
+    }
+
+    teardown_particles(state);
+    return;
+}
+
 static int
 test_exchange_layout_func_uneven(int i, const void * userdata)
 {
@@ -191,7 +219,7 @@ test_exchange_uneven(void **state)
     int i;
 
     /* this will trigger a slot growth on slot type 0 due to the inbalance */
-    int fail = domain_exchange(&test_exchange_layout_func_uneven, NULL, 1, PartManager, SlotsManager, MPI_COMM_WORLD);
+    int fail = domain_exchange(&test_exchange_layout_func_uneven, NULL, 1, 1, PartManager, SlotsManager, MPI_COMM_WORLD);
 
     assert_all_true(!fail);
 
@@ -215,12 +243,43 @@ test_exchange_uneven(void **state)
     return;
 }
 
+static void
+test_check_id_uniqueness(void **state)
+{
+    int newSlots[6] = {NUMPART1, NUMPART1, NUMPART1, NUMPART1, NUMPART1, NUMPART1};
+
+    setup_particles(newSlots);
+
+    assert_int_equal(domain_check_id_uniqueness(PartManager, 1, MPI_COMM_WORLD), 0);
+
+    /* Every task has a copy of the first ID of task 0, which also has the original*/
+    P[2].ID = 0;
+    assert_int_equal(domain_check_id_uniqueness(PartManager, 1, MPI_COMM_WORLD), NTask);
+
+    /* Sampled checks find each duplicate once in every sample calls*/
+    int64_t nduplicate = 0;
+    int i;
+    for(i = 0; i < 3; i++)
+        nduplicate += domain_check_id_uniqueness(PartManager, 3, MPI_COMM_WORLD);
+    assert_int_equal(nduplicate, NTask);
+
+    /* Garbage is not checked*/
+    slots_mark_garbage(2, PartManager, SlotsManager);
+    assert_int_equal(domain_check_id_uniqueness(PartManager, 1, MPI_COMM_WORLD), 0);
+
+    P[2].IsGarbage = 0;
+    teardown_particles(state);
+    return;
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_exchange_with_garbage),
         cmocka_unit_test(test_exchange),
         cmocka_unit_test(test_exchange_zero_slots),
         cmocka_unit_test(test_exchange_uneven),
+        cmocka_unit_test(test_exchange_full),
+        cmocka_unit_test(test_check_id_uniqueness),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
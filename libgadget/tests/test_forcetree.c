@@ -14,6 +14,7 @@
 #include <libgadget/forcetree.h>
 #include <libgadget/partmanager.h>
 #include <libgadget/domain.h>
+#include <libgadget/walltime.h>
 
 
 #include "stub.h"
@@ -47,7 +48,7 @@ struct forcetree_testdata
 
 void dump_snapshot() { }
 
-double walltime_measure_full(char * name, char * file, int line) {
+double walltime_measure_site(struct WalltimeSite * site, char * name, char * file, int line) {
     return MPI_Wtime();
 }
 
@@ -151,6 +152,22 @@ static int check_moments(const ForceTree * tb, const int numpart, const int nrea
     assert_int_equal(counter, nrealnode);
     assert_true(sibcntr < counter/100);
 
+    /* Every node above a particle has its type in the mask, and its softening in the softening range*/
+    unsigned int allmask = 0;
+    for(i=0; i<numpart; i++)
+    {
+        const unsigned int mask = force_type_mask(P[i].Type);
+        allmask |= mask;
+        int fnode = force_get_father(i, tb);
+        while(fnode >= 0) {
+            assert_true((tb->Nodes[fnode].f.TypeMask & mask) == mask);
+            assert_true(tb->Nodes[fnode].u.d.MinSoftening <= FORCE_SOFTENING(i));
+            assert_true(tb->Nodes[fnode].u.d.MaxSoftening >= FORCE_SOFTENING(i));
+            fnode = tb->Nodes[fnode].father;
+        }
+    }
+    assert_int_equal(tb->Nodes[tb->firstnode].f.TypeMask, allmask);
+
     free(oldmass);
     return nrealnode;
 }
@@ -304,11 +321,12 @@ static void test_rebuild_close(void ** state) {
 
 void do_random_test(gsl_rng * r, const int numpart, const ForceTree tb, DomainDecomp * ddecomp)
 {
-    /* Create a regular grid of particles, 8x8x8, all of type 1,
+    /* A uniform background of gas, and two clumps of type 1,
      * in a box 8 kpc across.*/
     int i;
     for(i=0; i<numpart/4; i++) {
-        P[i].Type = 1;
+        P[i].Type = 0;
+        P[i].Hsml = 0.1;
         int j;
         for(j=0; j<3; j++)
             P[i].Pos[j] = BoxSize * gsl_rng_uniform(r);
@@ -349,6 +367,47 @@ static void test_rebuild_random(void ** state) {
     free(P);
 }
 
+static void test_refit_random(void ** state) {
+    int ncbrt = 64;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    DomainDecomp ddecomp = data->ddecomp;
+    gsl_rng * r = (gsl_rng *) data->r;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    ddecomp.TopLeaves[0].topnode = numpart;
+    ForceTree tb = force_treeallocate(numpart, numpart, &ddecomp);
+    P = malloc(numpart*sizeof(struct particle_data));
+    PartManager->NumPart = numpart;
+    do_random_test(r, numpart, tb, &ddecomp);
+    tb.NumParticles = numpart;
+    tb.HybridNuGrav = 0;
+    /* Move each particle halfway to the center of its node, so it stays inside, and change the masses.*/
+    int i, j;
+    for(i=0; i<numpart; i++) {
+        const int father = force_get_father(i, &tb);
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = (P[i].Pos[j] + tb.Nodes[father].center[j])/2;
+        P[i].Mass = 1 + (i % 2);
+    }
+    assert_int_equal(force_tree_refit(&tb, &ddecomp, 0), 1);
+    assert_true(fabs(tb.Nodes[numpart].u.d.mass - 1.5*numpart) < 0.5);
+    int nrealnode = 0, node = tb.firstnode;
+    while(node >= 0) {
+        if(node >= tb.firstnode)
+            nrealnode++;
+        node = force_get_next_node(node, &tb);
+    }
+    check_moments(&tb, numpart, nrealnode);
+    /* A particle outside its node, or a removed particle, means the tree must be rebuilt.*/
+    const int father = force_get_father(0, &tb);
+    P[0].Pos[0] = tb.Nodes[father].center[0] + tb.Nodes[father].len;
+    assert_int_equal(force_tree_refit(&tb, &ddecomp, 0), 0);
+    P[0].Pos[0] = tb.Nodes[father].center[0];
+    P[1].IsGarbage = 1;
+    assert_int_equal(force_tree_refit(&tb, &ddecomp, 0), 0);
+    force_tree_free(&tb);
+    free(P);
+}
+
 /*Make a simple trivial domain for all data on a single processor*/
 void trivial_domain(DomainDecomp * ddecomp)
 {
@@ -406,6 +465,7 @@ int main(void) {
         cmocka_unit_test(test_rebuild_flat),
         cmocka_unit_test(test_rebuild_close),
         cmocka_unit_test(test_rebuild_random),
+        cmocka_unit_test(test_refit_random),
     };
     return cmocka_run_group_tests_mpi(tests, setup_tree, teardown_tree);
 }
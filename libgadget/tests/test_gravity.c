@@ -155,6 +155,19 @@ static int check_against_force_direct(double ErrTolForceAcc)
     return 0;
 }
 
+/* If true, walk the gravity tree in groups*/
+static int TreeGroupWalk;
+/* If true, include the quadrupole moments of the tree nodes*/
+static int TreeQuadrupole;
+/* If true, compute the local part of the tree force with OpenMP target offload*/
+static int TreeOffload;
+/* Number of terms of the polynomial short-range window, or 0 for the table*/
+static int ShortRangePolyOrder;
+/* If true, compute the interactions in single precision*/
+static int TreeMixedPrecision;
+/* If true, walk the compact copy of the tree nodes; otherwise the full nodes*/
+static int TreeNodeCopy = 1;
+
 static void do_force_test(double BoxSize, int Nmesh, double Asmth, double ErrTolForceAcc, int direct)
 {
     /*Sort by peano key so this is more realistic*/
@@ -181,6 +194,7 @@ static void do_force_test(double BoxSize, int Nmesh, double Asmth, double ErrTol
     ForceTree Tree = {0};
     force_tree_rebuild(&Tree, &ddecomp, BoxSize, 1);
     gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, Asmth);
+    gravshort_fill_poly(ShortRangePolyOrder);
     gravpm_force(&pm, &Tree);
     force_tree_rebuild(&Tree, &ddecomp, BoxSize, 1);
     const double rho0 = All.CP.Omega0 * 3 * All.CP.Hubble * All.CP.Hubble / (8 * M_PI * All.G);
@@ -191,6 +205,11 @@ static void do_force_test(double BoxSize, int Nmesh, double Asmth, double ErrTol
     treeacc.TreeUseBH = 1;
     treeacc.Rcut = 7;
     treeacc.ErrTolForceAcc = ErrTolForceAcc;
+    treeacc.TreeGroupWalk = TreeGroupWalk;
+    treeacc.TreeNodeCopy = TreeNodeCopy;
+    treeacc.TreeQuadrupole = TreeQuadrupole;
+    treeacc.TreeOffload = TreeOffload;
+    treeacc.TreeMixedPrecision = TreeMixedPrecision;
 
     set_gravshort_treepar(treeacc);
 
@@ -270,7 +289,8 @@ static void test_force_close(void ** state) {
     myfree(P);
 }
 
-void do_random_test(gsl_rng * r, const int numpart)
+/* Place numpart particles in a uniform background and two clumps*/
+static void fill_random_particles(gsl_rng * r, const int numpart)
 {
     /* Create a regular grid of particles, 8x8x8, all of type 1,
      * in a box 8 kpc across.*/
@@ -292,6 +312,11 @@ void do_random_test(gsl_rng * r, const int numpart)
     }
     PartManager->NumPart = numpart;
     PartManager->MaxPart = numpart;
+}
+
+void do_random_test(gsl_rng * r, const int numpart)
+{
+    fill_random_particles(r, numpart);
     do_force_test(All.BoxSize, 48, 1.5, 0.002, 1);
 }
 
@@ -309,6 +334,119 @@ static void test_force_random(void ** state) {
     myfree(P);
 }
 
+static void test_force_random_group(void ** state) {
+    /* Walking the tree in groups should be at least as accurate as walking it per particle*/
+    TreeGroupWalk = 1;
+    test_force_random(state);
+    TreeGroupWalk = 0;
+}
+
+static void test_force_random_quadrupole(void ** state) {
+    /* Quadrupole moments should only make the force more accurate*/
+    TreeQuadrupole = 1;
+    test_force_random(state);
+    TreeQuadrupole = 0;
+}
+
+static void test_force_random_poly(void ** state) {
+    /* The polynomial window should be as accurate as the table*/
+    ShortRangePolyOrder = 20;
+    test_force_random(state);
+    ShortRangePolyOrder = 0;
+}
+
+static void test_force_random_mixed(void ** state) {
+    /* Single precision interactions should not change the force error*/
+    TreeMixedPrecision = 1;
+    test_force_random(state);
+    TreeGroupWalk = 1;
+    test_force_random(state);
+    TreeGroupWalk = 0;
+    TreeMixedPrecision = 0;
+}
+
+static void test_force_random_nodecopy(void ** state) {
+    /* Reading the full tree nodes should be as accurate as reading the compact copy*/
+    TreeNodeCopy = 0;
+    test_force_random(state);
+    TreeGroupWalk = 1;
+    test_force_random(state);
+    TreeGroupWalk = 0;
+    TreeNodeCopy = 1;
+}
+
+static void set_leaf_ranges(int TreeLeafRanges)
+{
+    ParameterSet * ps = parameter_set_new();
+    param_declare_int(ps, "TreeLeafRanges", OPTIONAL, TreeLeafRanges, "");
+    set_forcetree_params(ps);
+    parameter_set_free(ps);
+}
+
+static void test_force_random_leafranges(void ** state) {
+    /* Walking the leaves as particle ranges visits the particles in the order of Nextnode,
+     * so the force and potential are bitwise those of a walk without leaf ranges*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    P = mymalloc("part", numpart*sizeof(struct particle_data));
+    memset(P, 0, numpart*sizeof(struct particle_data));
+    for(TreeGroupWalk = 0; TreeGroupWalk < 2; TreeGroupWalk++) {
+        fill_random_particles(r, numpart);
+        /* Decompose first, so that both walks below start from the same particle order*/
+        set_leaf_ranges(0);
+        do_force_test(All.BoxSize, 48, 1.5, 0.002, 0);
+        const int nlocal = PartManager->NumPart;
+        double * ref = (double *) mymalloc("RefForce", 7 * nlocal * sizeof(double));
+        int i, k;
+        /* The potential is accumulated over calls, so start both walks from zero*/
+        for(i = 0; i < nlocal; i++)
+            P[i].Potential = 0;
+        do_force_test(All.BoxSize, 48, 1.5, 0.002, 0);
+        for(i = 0; i < nlocal; i++) {
+            for(k = 0; k < 3; k++) {
+                ref[7*i + k] = P[i].Pos[k];
+                ref[7*i + 3 + k] = P[i].GravAccel[k];
+            }
+            ref[7*i + 6] = P[i].Potential;
+        }
+        for(i = 0; i < nlocal; i++)
+            P[i].Potential = 0;
+        set_leaf_ranges(1);
+        do_force_test(All.BoxSize, 48, 1.5, 0.002, 1);
+        assert_int_equal(PartManager->NumPart, nlocal);
+        for(i = 0; i < nlocal; i++) {
+            for(k = 0; k < 3; k++) {
+                assert_true(P[i].Pos[k] == ref[7*i + k]);
+                assert_true(P[i].GravAccel[k] == ref[7*i + 3 + k]);
+            }
+            assert_true(P[i].Potential == ref[7*i + 6]);
+        }
+        myfree(ref);
+    }
+    TreeGroupWalk = 0;
+    set_leaf_ranges(0);
+    myfree(P);
+}
+
+#ifdef TREE_OFFLOAD
+static void test_force_random_offload(void ** state) {
+    /* The device walk of the local mass should give the same force as the host*/
+    TreeOffload = 1;
+    test_force_random(state);
+    TreeOffload = 0;
+}
+#endif
+
+#ifdef PM_OFFLOAD
+static void test_force_random_pmoffload(void ** state) {
+    /* Painting and reading out the PM mesh on the device should give the same force*/
+    All.PMOffload = 1;
+    test_force_random(state);
+    All.PMOffload = 0;
+}
+#endif
+
 static int setup_tree(void **state) {
     walltime_init(&All.CT);
     /*Set up the important parts of the All structure.*/
@@ -364,6 +502,18 @@ int main(void) {
         cmocka_unit_test(test_force_flat),
         cmocka_unit_test(test_force_close),
         cmocka_unit_test(test_force_random),
+        cmocka_unit_test(test_force_random_group),
+        cmocka_unit_test(test_force_random_quadrupole),
+        cmocka_unit_test(test_force_random_leafranges),
+        cmocka_unit_test(test_force_random_poly),
+        cmocka_unit_test(test_force_random_mixed),
+        cmocka_unit_test(test_force_random_nodecopy),
+#ifdef TREE_OFFLOAD
+        cmocka_unit_test(test_force_random_offload),
+#endif
+#ifdef PM_OFFLOAD
+        cmocka_unit_test(test_force_random_pmoffload),
+#endif
     };
     return cmocka_run_group_tests_mpi(tests, setup_tree, teardown_tree);
 }
@@ -108,6 +108,51 @@ test_hci_timeout(void ** state)
     assert_int_equal(action->write_snapshot, 1);
 }
 
+static void
+test_hci_predictive_timeout(void ** state)
+{
+    HCIAction action[1];
+    hci_override_now(manager, 0.0);
+    hci_init(manager, prefix, 100.0, 0);
+
+    int i;
+    for(i = 1; i <= 7; i++) {
+        hci_override_now(manager, 10.0 * i);
+        hci_query(manager, action);
+        assert_int_equal(action->type, HCI_NO_ACTION);
+    }
+    /* A measured checkpoint replaces the 10% margin: the run may go on later.*/
+    hci_record_checkpoint(manager, 5.0, 0, 1e9);
+    hci_override_now(manager, 80.0);
+    hci_query(manager, action);
+    assert_int_equal(action->type, HCI_NO_ACTION);
+
+    hci_override_now(manager, 90.0);
+    hci_query(manager, action);
+    assert_int_equal(action->type, HCI_TIMEOUT);
+    assert_int_equal(action->write_snapshot, 1);
+}
+
+static void
+test_hci_predictive_timeout_growth(void ** state)
+{
+    HCIAction action[1];
+    hci_override_now(manager, 0.0);
+    hci_init(manager, prefix, 100.0, 0);
+
+    int i;
+    for(i = 1; i <= 7; i++) {
+        hci_override_now(manager, 10.0 * i);
+        hci_query(manager, action);
+    }
+    /* The snapshot doubled in size, so the next checkpoint is forecast to take twice as long.*/
+    hci_record_checkpoint(manager, 5.0, 0, 1e9);
+    hci_record_checkpoint(manager, 5.0, 0, 2e9);
+    hci_override_now(manager, 80.0);
+    hci_query(manager, action);
+    assert_int_equal(action->type, HCI_TIMEOUT);
+}
+
 static void
 test_hci_stop(void ** state)
 {
@@ -156,6 +201,29 @@ test_hci_terminate(void ** state)
     assert_int_equal(action->write_snapshot, 0);
 }
 
+static void
+test_hci_reconfigure(void ** state)
+{
+    HCIAction action[1];
+    hci_override_now(manager, 0.0);
+    hci_init(manager, prefix, 10.0, 1.0);
+
+    char * fn = fastpm_strdup_printf("%s/%s", prefix, "reconfigure");
+    FILE * fp = fopen(fn, "w");
+    fprintf(fp, "ErrTolForceAcc = 0.005\n");
+    fclose(fp);
+    myfree(fn);
+
+    hci_override_now(manager, 4.0);
+    hci_query(manager, action);
+    assert_false(exists(prefix, "reconfigure"));
+
+    assert_int_equal(action->type, HCI_NO_ACTION);
+    assert_non_null(action->reconfigure);
+    assert_string_equal(action->reconfigure, "ErrTolForceAcc = 0.005\n");
+    myfree(action->reconfigure);
+}
+
 static int setup(void ** state)
 {
     char * ret = mkdtemp(prefix);
@@ -175,9 +243,12 @@ int main(void) {
         cmocka_unit_test(test_hci_auto_checkpoint),
         cmocka_unit_test(test_hci_auto_checkpoint2),
         cmocka_unit_test(test_hci_timeout),
+        cmocka_unit_test(test_hci_predictive_timeout),
+        cmocka_unit_test(test_hci_predictive_timeout_growth),
         cmocka_unit_test(test_hci_stop),
         cmocka_unit_test(test_hci_checkpoint),
         cmocka_unit_test(test_hci_terminate),
+        cmocka_unit_test(test_hci_reconfigure),
     };
     return cmocka_run_group_tests_mpi(tests, setup, teardown);
 }
@@ -74,9 +74,50 @@ static void test_interp(void ** state) {
     interp_destroy(&ip);
 }
 
+/* The batched interpolation must agree with the single point one, including outside the table*/
+static void test_interp_many(void ** state) {
+    Interp ip;
+    int dims[] = {DSIZE, DSIZE+1, DSIZE+2};
+    double ydata[DSIZE * (DSIZE+1) * (DSIZE+2)];
+    interp_init(&ip, 3, dims);
+    interp_init_dim(&ip, 0, 0, 1);
+    interp_init_dim(&ip, 1, -1, 2);
+    interp_init_dim(&ip, 2, 3, 4);
+    int i;
+    for(i = 0; i < DSIZE * (DSIZE+1) * (DSIZE+2); i++)
+        ydata[i] = sin(i);
+
+    #define NPOINT 200
+    double x[NPOINT][3], y[NPOINT];
+    int status[NPOINT][3];
+    for(i = 0; i < NPOINT; i++) {
+        x[i][0] = -0.5 + 2. * i / NPOINT;
+        x[i][1] = -2 + 5. * ((i * 7) % NPOINT) / NPOINT;
+        x[i][2] = 2.5 + 2. * ((i * 13) % NPOINT) / NPOINT;
+    }
+    /* A point exactly on the upper boundary*/
+    x[0][0] = 1; x[0][1] = 2; x[0][2] = 4;
+    interp_eval_many(&ip, &x[0][0], ydata, y, NPOINT, &status[0][0]);
+    for(i = 0; i < NPOINT; i++) {
+        int status1[3];
+        double y1 = interp_eval(&ip, x[i], ydata, status1);
+        assert_true(y[i] == y1);
+        assert_int_equal(status[i][0], status1[0]);
+        assert_int_equal(status[i][1], status1[1]);
+        assert_int_equal(status[i][2], status1[2]);
+        assert_int_equal(status1[0], -1*(x[i][0] < 0) + (x[i][0] > 1));
+    }
+    assert_true(fabs(y[0] - ydata[DSIZE * (DSIZE+1) * (DSIZE+2) - 1]) < 1e-14);
+    /* status is optional*/
+    interp_eval_many(&ip, &x[0][0], ydata, y, NPOINT, NULL);
+    assert_true(y[NPOINT-1] == interp_eval(&ip, x[NPOINT-1], ydata, NULL));
+    interp_destroy(&ip);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_interp),
+        cmocka_unit_test(test_interp_many),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -49,6 +49,103 @@ test_allocator(void ** state)
     allocator_destroy(A0);
 }
 
+static void
+test_allocator_peak(void ** state)
+{
+    Allocator A0[1];
+    allocator_init(A0, "Default", 4096 * 1024, 1, NULL);
+
+    void * p1 = allocator_alloc_bot(A0, "M+1", 4096);
+    void * p2 = allocator_alloc_top(A0, "M-1", 8192);
+    const size_t used = allocator_get_used_size(A0, ALLOC_DIR_BOTH);
+    allocator_free(p2);
+    allocator_free(p1);
+
+    assert_int_equal(A0->peak, used);
+    assert_string_equal(A0->peak_name, "M-1");
+    assert_int_equal(allocator_get_interval_peak(A0), used);
+
+    /* A new interval only sees the later allocations*/
+    allocator_reset_peak(A0);
+    assert_int_equal(allocator_get_interval_peak(A0), 0);
+    p1 = allocator_alloc_bot(A0, "M+1", 4096);
+    allocator_free(p1);
+    assert_true(allocator_get_interval_peak(A0) < used);
+    assert_int_equal(A0->peak, used);
+
+    allocator_destroy(A0);
+}
+
+static void
+test_allocator_realloc_under(void ** state)
+{
+    Allocator A0[1];
+    allocator_init(A0, "Default", 4096 * 1024, 1, NULL);
+
+    int * p1 = allocator_alloc_bot(A0, "M+1", 1024*sizeof(int));
+    int * p2 = allocator_alloc_bot(A0, "M+2", 2048*sizeof(int));
+    p1[1000] = 1;
+    p2[0] = 2;
+    p2[2000] = 3;
+
+    /* Grow p1: p2 moves up with its contents*/
+    void * ptr = p1, * above = p2;
+    assert_int_equal(allocator_realloc_under(A0, &ptr, 8192*sizeof(int), &above), 0);
+    assert_ptr_equal(ptr, p1);
+    p2 = above;
+    assert_true((char *) p2 >= (char *) (p1 + 8192));
+    assert_int_equal(p1[1000], 1);
+    assert_int_equal(p2[0], 2);
+    assert_int_equal(p2[2000], 3);
+    p1[8000] = 4;
+
+    /* p2 can be freed and reallocated at its new place*/
+    int * q1 = allocator_alloc_top(A0, "M-1", 1024*sizeof(int));
+    assert_int_equal(allocator_dealloc(A0, q1), 0);
+    p2 = allocator_realloc(A0, p2, 4096*sizeof(int));
+    assert_int_equal(p2[2000], 3);
+
+    /* Only the last block may be above*/
+    int * p3 = allocator_alloc_bot(A0, "M+3", 1024*sizeof(int));
+    above = p2;
+    assert_int_equal(allocator_realloc_under(A0, &ptr, 9000*sizeof(int), &above), ALLOC_EMISMATCH);
+    assert_int_equal(allocator_realloc_under(A0, &ptr, 9000*sizeof(int), NULL), ALLOC_EMISMATCH);
+    allocator_free(p3);
+
+    /* Not enough memory*/
+    assert_int_equal(allocator_realloc_under(A0, &ptr, 4096*1024, &above), ALLOC_ENOMEMORY);
+
+    /* Shrink it back*/
+    assert_int_equal(allocator_realloc_under(A0, &ptr, 1024*sizeof(int), &above), 0);
+    p2 = above;
+    assert_int_equal(p2[2000], 3);
+    assert_int_equal(p1[1000], 1);
+
+    allocator_free(p2);
+    allocator_free(p1);
+    assert_int_equal(allocator_get_used_size(A0, ALLOC_DIR_BOTH), 0);
+    allocator_destroy(A0);
+}
+
+static void
+test_allocator_hugepages(void ** state)
+{
+    Allocator A0[1];
+    /* Huge pages may not be available, but the allocator must always fall back to something*/
+    assert_int_equal(allocator_mmap_init(A0, "Huge", 4096 * 1024, 1, ALLOC_PAGES_HUGE_1GB), 0);
+    assert_true(A0->hugepages <= ALLOC_PAGES_HUGE_1GB);
+    message(0, "Huge pages: %d\n", A0->hugepages);
+
+    int * p1 = allocator_alloc_bot(A0, "M+1", 1024*sizeof(int));
+    int * q1 = allocator_alloc_top(A0, "M-1", 1024*sizeof(int));
+    assert_int_equal(p1[1000], 0);
+    p1[1000] = 1;
+    q1[1000] = 1;
+    allocator_free(q1);
+    allocator_free(p1);
+    allocator_destroy(A0);
+}
+
 static void
 test_sub_allocator(void ** state)
 {
@@ -70,6 +167,66 @@ test_sub_allocator(void ** state)
     allocator_destroy(A1);
     allocator_destroy(A0);
 }
+static void
+test_allocator_prefer(void ** state)
+{
+    Allocator Fast[1], Slow[1], Empty[1] = {0};
+    allocator_init(Fast, "Fast", 4096 * 4, 0, NULL);
+    allocator_init(Slow, "Slow", 4096 * 1024, 0, NULL);
+
+    /* Fits in the fast allocator*/
+    int * p1 = allocator_alloc_prefer(Fast, Slow, "P1", 4096, ALLOC_DIR_BOT, "%s", "test");
+    assert_true(allocator_owner(p1) == Fast);
+    /* Too big for what is left, so it goes to the fallback*/
+    int * p2 = allocator_alloc_prefer(Fast, Slow, "P2", 4096 * 4, ALLOC_DIR_BOT, "%s", "test");
+    assert_true(allocator_owner(p2) == Slow);
+    /* An empty fast allocator is never used*/
+    int * p3 = allocator_alloc_prefer(Empty, Slow, "P3", 16, ALLOC_DIR_BOT, "%s", "test");
+    assert_true(allocator_owner(p3) == Slow);
+
+    /* Blocks are resized in the allocator which owns them*/
+    p1[0] = 7;
+    p1 = allocator_realloc(allocator_owner(p1), p1, 1024);
+    assert_int_equal(p1[0], 7);
+    assert_true(allocator_owner(p1) == Fast);
+
+    allocator_free(p3);
+    allocator_free(p2);
+    allocator_free(p1);
+    assert_int_equal(allocator_get_used_size(Fast, ALLOC_DIR_BOTH), 0);
+    assert_int_equal(allocator_get_used_size(Slow, ALLOC_DIR_BOTH), 0);
+    allocator_destroy(Slow);
+    allocator_destroy(Fast);
+}
+
+static void
+test_thread_allocators(void ** state)
+{
+    Allocator A0[1];
+    Allocator AT[4];
+    allocator_init(A0, "Default", 4096 * 1024, 1, NULL);
+    assert_int_equal(allocator_split_threads(A0, AT, 4, "Thread", 4096 * 16), 0);
+
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < 4; i++) {
+        int * p = allocator_alloc_bot(&AT[i], "M+1", 1024 * sizeof(int));
+        p[1000] = i;
+        assert_int_equal(p[1000], i);
+        /* Resetting forgets everything, so the next allocation reuses the memory*/
+        allocator_reset(&AT[i], 0);
+        int * q = allocator_alloc_bot(&AT[i], "M+1", 2048 * sizeof(int));
+        assert_true(p == q);
+    }
+    /* The arenas are blocks of the parent, so the parent still allocates around them*/
+    void * p2 = allocator_alloc_bot(A0, "M+2", 2048);
+    allocator_print(A0);
+    allocator_free(p2);
+
+    allocator_destroy_threads(AT, 4);
+    allocator_destroy(A0);
+}
+
 static void
 test_allocator_malloc(void ** state)
 {
@@ -112,7 +269,12 @@ int main(void)
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_allocator),
         cmocka_unit_test(test_allocator_malloc),
+        cmocka_unit_test(test_allocator_peak),
+        cmocka_unit_test(test_allocator_realloc_under),
+        cmocka_unit_test(test_allocator_hugepages),
         cmocka_unit_test(test_sub_allocator),
+        cmocka_unit_test(test_thread_allocators),
+        cmocka_unit_test(test_allocator_prefer),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -331,6 +331,20 @@ test_mpsort_gather(void ** state)
     do_mpsort_test(2000, 32, 0, 0);
 }
 
+static void
+test_mpsort_sample(void ** state)
+{
+    mpsort_mpi_set_options(MPSORT_SAMPLE_SORT);
+    do_mpsort_test(2000, 16, 0, 0);
+    do_mpsort_test(2000, 64, 0, 0);
+    /* Empty ranks and a different destsize*/
+    do_mpsort_test(1999, 32, 1, 0);
+    /* Many equal radixes*/
+    do_mpsort_test(2000, 2, 0, 0);
+    do_long_radix_test(50);
+    mpsort_mpi_unset_options(MPSORT_SAMPLE_SORT);
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
@@ -338,6 +352,7 @@ int main(void)
         cmocka_unit_test(test_mpsort_stagger),
         cmocka_unit_test(test_basegroup),
         cmocka_unit_test(test_mpsort_gather),
+        cmocka_unit_test(test_mpsort_sample),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <omp.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "stub.h"
 
@@ -99,10 +100,104 @@ static void test_openmpsort(void ** state) {
 
 }
 
+struct __keyed
+{
+    uint64_t key;
+    int type;
+    int order;
+};
+
+static void radix_key(const void * ptr, void * radix, void * arg) {
+    *(uint64_t *) radix = ((const struct __keyed *) ptr)->key;
+}
+
+/* Sort by type, then by key*/
+static void radix_type_key(const void * ptr, void * radix, void * arg) {
+    const struct __keyed * k = (const struct __keyed *) ptr;
+    uint64_t * u = (uint64_t *) radix;
+    u[0] = k->key;
+    u[1] = k->type;
+}
+
+/* Sort with both radix functions and check the order, and that equal keys keep their order*/
+static void do_radixsort_test(const int size) {
+    int i;
+    struct __keyed *a = (struct __keyed *) malloc(size * sizeof(struct __keyed));
+
+    srand48(8675309);
+    for(i = 0; i < size; i++) {
+        /* Few distinct keys, so stability is tested, and some keys above 2^32*/
+        a[i].key = ((uint64_t) (1000 * drand48())) << (i % 2 ? 40 : 0);
+        a[i].type = (int) (6 * drand48());
+        a[i].order = i;
+    }
+
+    double start = omp_get_wtime();
+    radix_sort_openmp(a, size, sizeof(struct __keyed), radix_key, 8, NULL);
+    double end = omp_get_wtime();
+    message(1,"radix sort time = %g s %d threads\n",end-start, omp_get_max_threads());
+
+    for(i=1; i<size; i++) {
+        assert_true(a[i-1].key <= a[i].key);
+        if(a[i-1].key == a[i].key)
+            assert_true(a[i-1].order < a[i].order);
+    }
+
+    for(i = 0; i < size; i++)
+        a[i].order = i;
+    radix_sort_openmp(a, size, sizeof(struct __keyed), radix_type_key, 16, NULL);
+    for(i=1; i<size; i++) {
+        assert_true(a[i-1].type <= a[i].type);
+        if(a[i-1].type == a[i].type) {
+            assert_true(a[i-1].key <= a[i].key);
+            if(a[i-1].key == a[i].key)
+                assert_true(a[i-1].order < a[i].order);
+        }
+    }
+    free(a);
+}
+
+static void test_radixsort(void ** state) {
+    do_radixsort_test(187763);
+}
+
+/* With no memory left for the keys, the in-place fallback must also be stable*/
+static void test_radixsort_lowmem(void ** state) {
+    char * fill = (char *) mymalloc("Fill", mymalloc_freebytes() - 4096 * 4);
+    do_radixsort_test(18763);
+    myfree(fill);
+}
+
+/* Sorts on fewer threads than are available, as with SortThreads*/
+static void test_sort_threads(void ** state) {
+    const int maxthreads = omp_get_max_threads();
+    set_stage_threads(THREADS_SORT, maxthreads + 1);
+    assert_int_equal(stage_threads(THREADS_SORT), maxthreads);
+    set_stage_threads(THREADS_SORT, 1);
+    assert_int_equal(stage_threads(THREADS_SORT), 1);
+
+    int i;
+    int size = 87763;
+    int *a = (int *) malloc(size * sizeof(int));
+    srand48(8675309);
+    for(i = 0; i < size; i++)
+        a[i] = (int) (size * drand48());
+    qsort_openmp(a, size, sizeof(int), compare);
+    for(i=1; i<size; i++)
+        assert_true(a[i-1] <= a[i]);
+    free(a);
+
+    set_stage_threads(THREADS_SORT, 0);
+    assert_int_equal(stage_threads(THREADS_SORT), maxthreads);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_openmpsort),
         cmocka_unit_test(test_openmpsort_struct),
+        cmocka_unit_test(test_radixsort),
+        cmocka_unit_test(test_radixsort_lowmem),
+        cmocka_unit_test(test_sort_threads),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
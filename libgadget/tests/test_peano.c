@@ -0,0 +1,95 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libgadget/utils/peano.h>
+#include "stub.h"
+
+extern const unsigned char rottable3[48][8];
+extern const unsigned char subpix3[48][8];
+
+/* The key one level at a time, as it was computed before the two level tables*/
+static peano_t
+peano_hilbert_key_reference(int x, int y, int z, int bits)
+{
+    int mask;
+    unsigned char rotation = 0;
+    peano_t key = 0;
+
+    for(mask = 1 << (bits - 1); mask > 0; mask >>= 1)
+    {
+        unsigned char pix = ((x & mask) ? 4 : 0) | ((y & mask) ? 2 : 0) | ((z & mask) ? 1 : 0);
+
+        key <<= 3;
+        key |= subpix3[rotation][pix];
+        rotation = rottable3[rotation][pix];
+    }
+    return key;
+}
+
+static void
+test_peano_hilbert_key(void ** state)
+{
+    int bits, i;
+    srand(42);
+    for(bits = 1; bits <= BITS_PER_DIMENSION; bits++) {
+        for(i = 0; i < 1000; i++) {
+            const int x = rand() & ((1 << bits) - 1);
+            const int y = rand() & ((1 << bits) - 1);
+            const int z = rand() & ((1 << bits) - 1);
+            assert_true(peano_hilbert_key(x, y, z, bits) == peano_hilbert_key_reference(x, y, z, bits));
+        }
+    }
+    /* The curve visits every cell of a small grid once*/
+    int seen[512] = {0};
+    int x, y, z;
+    for(x = 0; x < 8; x++)
+        for(y = 0; y < 8; y++)
+            for(z = 0; z < 8; z++)
+                seen[peano_hilbert_key(x, y, z, 3)]++;
+    for(i = 0; i < 512; i++)
+        assert_int_equal(seen[i], 1);
+}
+
+struct point {
+    double Pos[3];
+    int pad;
+    peano_t Key;
+};
+
+static void
+test_peano_hilbert_keys(void ** state)
+{
+    const double BoxSize = 25000;
+    const int n = 4096;
+    struct point * pts = malloc(n * sizeof(struct point));
+    int i, j;
+    srand(7);
+    for(i = 0; i < n; i++) {
+        for(j = 0; j < 3; j++)
+            pts[i].Pos[j] = BoxSize * (rand() + 0.5) / (RAND_MAX + 1.);
+        pts[i].Key = 0;
+    }
+    peano_hilbert_keys(pts[0].Pos, sizeof(pts[0]), &pts[0].Key, sizeof(pts[0]), n, BoxSize);
+    for(i = 0; i < n; i++) {
+        const peano_t key = peano_hilbert_key_reference(
+                (pts[i].Pos[0] + BoxSize/2000) * DomainFac(BoxSize * 1.001),
+                (pts[i].Pos[1] + BoxSize/2000) * DomainFac(BoxSize * 1.001),
+                (pts[i].Pos[2] + BoxSize/2000) * DomainFac(BoxSize * 1.001), BITS_PER_DIMENSION);
+        assert_true(pts[i].Key == key);
+        assert_true(pts[i].Key == PEANO(pts[i].Pos, BoxSize));
+    }
+    free(pts);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_peano_hilbert_key),
+        cmocka_unit_test(test_peano_hilbert_keys),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
@@ -82,6 +82,39 @@ test_slots_gc(void **state)
     return;
 }
 
+/* A little garbage, some of it at the end of the arrays: gc fills the holes from the end*/
+static void
+test_slots_gc_fill(void **state)
+{
+    setup_particles(state);
+    int i;
+    int compact[6];
+    int64_t idsum = 0;
+    for(i = 0; i < PartManager->NumPart; i ++)
+        idsum += P[i].ID;
+    for(i = 0; i < 6; i ++) {
+        slots_mark_garbage(128 * i + 5, PartManager, SlotsManager);
+        slots_mark_garbage(128 * i + 127, PartManager, SlotsManager);
+        idsum -= P[128 * i + 5].ID + P[128 * i + 127].ID;
+        compact[i] = 1;
+    }
+    slots_gc(compact, PartManager, SlotsManager);
+    assert_int_equal(PartManager->NumPart, 126 * 6);
+
+    for(i = 0; i < 6; i ++)
+        assert_int_equal(SlotsManager->info[i].size, 126);
+
+    for(i = 0; i < PartManager->NumPart; i ++) {
+        assert_false(P[i].IsGarbage);
+        idsum -= P[i].ID;
+    }
+    assert_int_equal(idsum, 0);
+
+    slots_check_id_consistency(PartManager, SlotsManager);
+    teardown_particles(state);
+    return;
+}
+
 static void
 test_slots_gc_sorted(void **state)
 {
@@ -201,6 +234,62 @@ test_slots_fork(void **state)
     return;
 }
 
+/* Records the fork events received by a batch listener*/
+struct fork_record {
+    int ncalls;
+    int nevent;
+    int parent[8];
+    int child[8];
+};
+
+static int
+record_forks(EIBase * event, int nevent, void * userdata)
+{
+    EISlotsFork * ev = (EISlotsFork *) event;
+    struct fork_record * rec = (struct fork_record *) userdata;
+    int i;
+    for(i = 0; i < nevent; i++) {
+        rec->parent[rec->nevent] = ev[i].parent;
+        rec->child[rec->nevent] = ev[i].child;
+        rec->nevent++;
+    }
+    rec->ncalls++;
+    return 0;
+}
+
+static void
+test_slots_fork_batch(void **state)
+{
+    setup_particles(state);
+    struct fork_record rec = {0};
+    event_listen_batch(&EventSlotsFork, record_forks, &rec);
+
+    /* A single fork is delivered as a batch of one*/
+    int child = slots_split_particle(0, 0, PartManager);
+    assert_int_equal(rec.ncalls, 1);
+    assert_int_equal(rec.nevent, 1);
+    assert_int_equal(rec.child[0], child);
+
+    /* Deferred forks are delivered in one call, skipping the unsplit entries*/
+    int parents[4] = {128, 256, 384, 512};
+    int children[4];
+    int i;
+    for(i = 0; i < 4; i++)
+        children[i] = (i == 2) ? parents[i] : slots_split_particle_deferred(parents[i], 0, PartManager);
+    assert_int_equal(rec.ncalls, 1);
+    slots_emit_forks(parents, children, 4);
+    assert_int_equal(rec.ncalls, 2);
+    assert_int_equal(rec.nevent, 4);
+    assert_int_equal(rec.parent[1], 128);
+    assert_int_equal(rec.parent[2], 256);
+    assert_int_equal(rec.parent[3], 512);
+    assert_int_equal(rec.child[3], children[3]);
+    assert_int_equal(PartManager->NumPart, 128 * 6 + 4);
+
+    event_unlisten_batch(&EventSlotsFork, record_forks, &rec);
+    teardown_particles(state);
+}
+
 static void
 test_slots_convert(void **state)
 {
@@ -220,13 +309,38 @@ test_slots_convert(void **state)
     return;
 }
 
+/* New particles, and particles which change type, are not in the base of a delta snapshot*/
+static void
+test_slots_delta_base(void **state)
+{
+    setup_particles(state);
+    int i;
+    for(i = 0; i < PartManager->NumPart; i ++)
+        P[i].InDeltaBase = 1;
+
+    int child = slots_split_particle(0, 0, PartManager);
+    assert_false(P[child].InDeltaBase);
+    assert_true(P[0].InDeltaBase);
+
+    slots_convert(0, P[0].Type, -1, PartManager, SlotsManager);
+    assert_true(P[0].InDeltaBase);
+    slots_convert(0, 4, -1, PartManager, SlotsManager);
+    assert_false(P[0].InDeltaBase);
+    assert_true(P[1].InDeltaBase);
+
+    teardown_particles(state);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_slots_gc),
+        cmocka_unit_test(test_slots_gc_fill),
         cmocka_unit_test(test_slots_gc_sorted),
         cmocka_unit_test(test_slots_reserve),
         cmocka_unit_test(test_slots_fork),
+        cmocka_unit_test(test_slots_fork_batch),
         cmocka_unit_test(test_slots_convert),
+        cmocka_unit_test(test_slots_delta_base),
         cmocka_unit_test(test_slots_zero),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
@@ -0,0 +1,72 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <mpi.h>
+#include "stub.h"
+#include "../utils/system.h"
+
+/* Split the job into members and check that MPI_COMM_WORLD is the member of this rank*/
+static void
+do_ensemble_test(const int nmember)
+{
+    int JobTask, JobNTask;
+    MPI_Comm_rank(MPIU_COMM_JOB, &JobTask);
+    MPI_Comm_size(MPIU_COMM_JOB, &JobNTask);
+
+    const int member = MPIU_split_ensemble(nmember);
+    /* Consecutive ranks of nearly equal size*/
+    int first = 0, i;
+    while(first < JobNTask && (int64_t) first * nmember / JobNTask < member)
+        first++;
+    int size = 0;
+    for(i = first; i < JobNTask && (int64_t) i * nmember / JobNTask == member; i++)
+        size++;
+
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    assert_int_equal(member, (int64_t) JobTask * nmember / JobNTask);
+    assert_int_equal(ThisTask, JobTask - first);
+    assert_int_equal(NTask, size);
+
+    /* Collectives stay inside the member*/
+    int sum = JobTask;
+    MPI_Allreduce(MPI_IN_PLACE, &sum, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    assert_int_equal(sum, size * first + size * (size - 1) / 2);
+
+    /* The whole job is still there*/
+    int njob;
+    MPI_Comm_size(MPIU_COMM_JOB, &njob);
+    assert_int_equal(njob, JobNTask);
+
+    MPI_Comm_free(&MPIU_SimulationComm);
+    MPIU_SimulationComm = MPI_COMM_NULL;
+}
+
+static void
+test_split_ensemble(void ** state)
+{
+    int JobNTask;
+    MPI_Comm_size(MPIU_COMM_JOB, &JobNTask);
+    /* Two members if there are enough ranks*/
+    do_ensemble_test(JobNTask > 1 ? 2 : 1);
+    do_ensemble_test(JobNTask);
+    do_ensemble_test(1);
+
+    /* Back to the whole job*/
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    assert_int_equal(NTask, JobNTask);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_split_ensemble),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
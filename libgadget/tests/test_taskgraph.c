@@ -0,0 +1,57 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+
+#include <libgadget/utils/taskgraph.h>
+#include "stub.h"
+
+/* Names of the tasks in the order they ran*/
+static char Order[256];
+
+static void
+record(void * data)
+{
+    strcat(Order, (const char *) data);
+}
+
+static void
+test_taskgraph_order(void ** state)
+{
+    TaskGraph tg = {0};
+    Order[0] = '\0';
+    /* A two stage exchange around two walks, the second of which needs the first*/
+    const int walk1 = taskgraph_add(&tg, "walk1", TASK_COMPUTE, record, "a");
+    const int walk2 = taskgraph_add(&tg, "walk2", TASK_COMPUTE, record, "b");
+    taskgraph_depends(&tg, walk2, walk1);
+    const int complete = taskgraph_add(&tg, "complete", TASK_COMPLETE, record, "d");
+    const int post = taskgraph_add(&tg, "post", TASK_POST, record, "c");
+    taskgraph_depends(&tg, complete, post);
+    taskgraph_depends(&tg, complete, walk1);
+    /* Tasks which were not added are ignored*/
+    taskgraph_depends(&tg, walk1, -1);
+    taskgraph_run(&tg);
+    /* Posted first, completed last*/
+    assert_string_equal(Order, "cabd");
+    assert_int_equal(tg.ntask, 0);
+
+    /* The post waits for the first walk*/
+    Order[0] = '\0';
+    const int w1 = taskgraph_add(&tg, "walk1", TASK_COMPUTE, record, "a");
+    const int w2 = taskgraph_add(&tg, "walk2", TASK_COMPUTE, record, "b");
+    taskgraph_depends(&tg, w2, w1);
+    const int p = taskgraph_add(&tg, "post", TASK_POST, record, "c");
+    taskgraph_depends(&tg, p, w1);
+    const int c = taskgraph_add(&tg, "complete", TASK_COMPLETE, record, "d");
+    taskgraph_depends(&tg, c, p);
+    taskgraph_run(&tg);
+    assert_string_equal(Order, "acbd");
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_taskgraph_order),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
@@ -71,6 +71,29 @@ static void test_skip_first(void ** state) {
     assert_int_equal(find_current_sync_point(0)->write_snapshot, 1);
 }
 
+static void test_light_outputs(void ** state) {
+    /* One light output between snapshots, one on a snapshot and one beyond TimeMax*/
+    All.LightOutputListTimes[0] = 2;
+    All.LightOutputListTimes[1] = 0.8;
+    All.LightOutputListTimes[2] = 0.4;
+    All.LightOutputListLength = 3;
+
+    setup_sync_points(All.TimeIC, 0.0);
+
+    assert_int_equal(find_current_sync_point(2 * TIMEBASE)->write_light, 1);
+    assert_int_equal(find_current_sync_point(2 * TIMEBASE)->light_num, 0);
+    assert_int_equal(find_current_sync_point(2 * TIMEBASE)->write_snapshot, 0);
+    assert_int_equal(find_current_sync_point(3 * TIMEBASE)->write_light, 1);
+    assert_int_equal(find_current_sync_point(3 * TIMEBASE)->light_num, 1);
+    assert_int_equal(find_current_sync_point(3 * TIMEBASE)->write_snapshot, 1);
+    assert_int_equal(find_current_sync_point(TIMEBASE)->write_light, 0);
+    assert_int_equal(find_current_sync_point(4 * TIMEBASE)->write_snapshot, 1);
+    assert_int_equal(find_next_sync_point(4 * TIMEBASE), NULL);
+
+    All.LightOutputListLength = 0;
+    setup_sync_points(All.TimeIC, 0.0);
+}
+
 static void test_dloga(void ** state) {
 
     setup_sync_points(All.TimeIC, 0.0);
@@ -121,6 +144,7 @@ int main(void) {
         cmocka_unit_test(test_conversions),
         cmocka_unit_test(test_dloga),
         cmocka_unit_test(test_skip_first),
+        cmocka_unit_test(test_light_outputs),
     };
     return cmocka_run_group_tests_mpi(tests, setup, teardown);
 }
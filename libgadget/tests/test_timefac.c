@@ -109,9 +109,29 @@ void test_drift_factor(void ** state)
 
 }
 
+void test_step_factor_tables(void ** state)
+{
+    Cosmology CP;
+    CP.Omega0 = 0.25;
+    init_drift_table(&CP, AMIN, AMAX);
+    /* A step of 2^20 with a smallest timebin of 6, so the times are multiples of 32*/
+    const int ti0 = get_ti(0.8);
+    update_step_factor_tables(&CP, ti0, ti0 + (1<<20), 6);
+    const double a1 = exp(loga_from_ti(ti0 + 3200));
+    const double a2 = exp(loga_from_ti(ti0 + 960000));
+    assert_true(fabs(get_drift_factor(ti0 + 3200, ti0 + 960000) - exact_drift_factor(&CP, a1, a2, 3)) < 1e-7);
+    assert_true(fabs(get_gravkick_factor(ti0 + 3200, ti0 + 960000) - exact_drift_factor(&CP, a1, a2, 2)) < 1e-7);
+    assert_true(fabs(get_hydrokick_factor(ti0 + 3200, ti0 + 960000) - exact_drift_factor(&CP, a1, a2, 3)) < 1e-7);
+    /* Times which are not tabulated are still integrated*/
+    const double a3 = exp(loga_from_ti(ti0 + 1));
+    assert_true(fabs(get_drift_factor(ti0 + 1, ti0 + 960000) - exact_drift_factor(&CP, a3, a2, 3)) < 1e-7);
+    assert_true(fabs(get_gravkick_factor(ti0 + 1, ti0 + 960000) - exact_drift_factor(&CP, a3, a2, 2)) < 5e-5);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_drift_factor),
+        cmocka_unit_test(test_step_factor_tables),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -12,12 +12,50 @@ static int NSyncPoints;    /* number of times stored in table of desired sync po
 
 int cmp_double(const void * a, const void * b)
 {
-    return ( *(double*)a - *(double*)b );
+    /* The difference is truncated to int, so compare instead*/
+    const double da = *(const double *) a, db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+/* Find the SyncPoint at scale factor a, inserting a new one with no outputs
+ * if there is none. Returns -1 if a is beyond TimeMax. */
+static int
+insert_sync_point(double a)
+{
+    int j;
+    /* we do an insertion sort here. A heap is faster but who cares the speed for this? */
+    for(j = 0; j < NSyncPoints; j ++) {
+        if(a <= SyncPoints[j].a) {
+            break;
+        }
+    }
+    if(j == NSyncPoints) {
+        /* beyond TimeMax, skip */
+        return -1;
+    }
+    /* found, so loga >= SyncPoints[j].loga */
+    if(a == SyncPoints[j].a) {
+        /* requesting output on an existing entry, e.g. TimeInit or duplicated entry */
+        return j;
+    }
+    /* insert the item; */
+    memmove(&SyncPoints[j + 1], &SyncPoints[j],
+        sizeof(SyncPoints[0]) * (NSyncPoints - j));
+    SyncPoints[j].a = a;
+    SyncPoints[j].loga = log(a);
+    SyncPoints[j].write_snapshot = 0;
+    SyncPoints[j].write_fof = 0;
+    SyncPoints[j].write_light = 0;
+    SyncPoints[j].light_num = -1;
+    SyncPoints[j].write_lya = 0;
+    SyncPoints[j].lya_num = -1;
+    NSyncPoints ++;
+    return j;
 }
 
 /* This function compiles
  *
- * All.OutputListTimes, All.TimeIC, All.TimeMax
+ * All.OutputListTimes, All.LightOutputListTimes, All.LyaSkewerOutputListTimes, All.TimeIC, All.TimeMax
  *
  * into a list of SyncPoint objects.
  *
@@ -25,7 +63,8 @@ int cmp_double(const void * a, const void * b)
  * KkdkK timeline.
  *
  * TimeIC and TimeMax are used to ensure restarting from snapshot obtains exactly identical
- * integer stamps.
+ * integer stamps. Light outputs and Lyman-alpha skewers are numbered by their position
+ * in the sorted LightOutputList and LyaSkewerOutputList, so a restarted run gives them the same numbers.
  **/
 void
 setup_sync_points(double TimeIC, double no_snapshot_until_time)
@@ -33,10 +72,12 @@ setup_sync_points(double TimeIC, double no_snapshot_until_time)
     int i;
 
     qsort_openmp(All.OutputListTimes, All.OutputListLength, sizeof(double), cmp_double);
+    qsort_openmp(All.LightOutputListTimes, All.LightOutputListLength, sizeof(double), cmp_double);
+    qsort_openmp(All.LyaSkewerOutputListTimes, All.LyaSkewerOutputListLength, sizeof(double), cmp_double);
 
     if(NSyncPoints > 0)
         myfree(SyncPoints);
-    SyncPoints = mymalloc("SyncPoints", sizeof(SyncPoint) * (All.OutputListLength+2));
+    SyncPoints = mymalloc("SyncPoints", sizeof(SyncPoint) * (All.OutputListLength + All.LightOutputListLength + All.LyaSkewerOutputListLength + 2));
 
     /* Set up first and last entry to SyncPoints; TODO we can insert many more! */
 
@@ -44,38 +85,24 @@ setup_sync_points(double TimeIC, double no_snapshot_until_time)
     SyncPoints[0].loga = log(TimeIC);
     SyncPoints[0].write_snapshot = 0; /* by default no output here. */
     SyncPoints[0].write_fof = 0;
+    SyncPoints[0].write_light = 0;
+    SyncPoints[0].light_num = -1;
+    SyncPoints[0].write_lya = 0;
+    SyncPoints[0].lya_num = -1;
     SyncPoints[1].a = All.TimeMax;
     SyncPoints[1].loga = log(All.TimeMax);
     SyncPoints[1].write_snapshot = 1;
     SyncPoints[1].write_fof = 0;
+    SyncPoints[1].write_light = 0;
+    SyncPoints[1].light_num = -1;
+    SyncPoints[1].write_lya = 0;
+    SyncPoints[1].lya_num = -1;
     NSyncPoints = 2;
 
-    /* we do an insertion sort here. A heap is faster but who cares the speed for this? */
     for(i = 0; i < All.OutputListLength; i ++) {
-        int j = 0;
-        double a = All.OutputListTimes[i];
-        double loga = log(a);
-
-        for(j = 0; j < NSyncPoints; j ++) {
-            if(a <= SyncPoints[j].a) {
-                break;
-            }
-        }
-        if(j == NSyncPoints) {
-            /* beyond TimeMax, skip */
+        int j = insert_sync_point(All.OutputListTimes[i]);
+        if(j < 0)
             continue;
-        }
-        /* found, so loga >= SyncPoints[j].loga */
-        if(a == SyncPoints[j].a) {
-            /* requesting output on an existing entry, e.g. TimeInit or duplicated entry */
-        } else {
-            /* insert the item; */
-            memmove(&SyncPoints[j + 1], &SyncPoints[j],
-                sizeof(SyncPoints[0]) * (NSyncPoints - j));
-            SyncPoints[j].a = a;
-            SyncPoints[j].loga = loga;
-            NSyncPoints ++;
-        }
         if(SyncPoints[j].a > no_snapshot_until_time) {
             SyncPoints[j].write_snapshot = 1;
             if(All.SnapshotWithFOF) {
@@ -89,6 +116,29 @@ setup_sync_points(double TimeIC, double no_snapshot_until_time)
         }
     }
 
+    for(i = 0; i < All.LightOutputListLength; i ++) {
+        int j = insert_sync_point(All.LightOutputListTimes[i]);
+        if(j < 0)
+            continue;
+        if(SyncPoints[j].a > no_snapshot_until_time) {
+            SyncPoints[j].write_light = 1;
+            SyncPoints[j].light_num = i;
+        }
+    }
+
+    for(i = 0; i < All.LyaSkewerOutputListLength; i ++) {
+        int j = insert_sync_point(All.LyaSkewerOutputListTimes[i]);
+        if(j < 0)
+            continue;
+        if(SyncPoints[j].a > no_snapshot_until_time) {
+            SyncPoints[j].write_lya = 1;
+            SyncPoints[j].lya_num = i;
+        }
+    }
+
+    if(NSyncPoints > (int) MAXSNAPSHOTS)
+        endrun(1, "Too many sync points (%d) from OutputList, LightOutputList and LyaSkewerOutputList, can take no more than %d.\n", NSyncPoints, MAXSNAPSHOTS);
+
     for(i = 0; i < NSyncPoints; i++) {
         SyncPoints[i].ti = (i * 1L) << (TIMEBINS);
     }
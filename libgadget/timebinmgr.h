@@ -24,6 +24,12 @@ struct SyncPoint
     double loga;
     int write_snapshot;
     int write_fof;
+    /* Write a light output snapshot, numbered light_num*/
+    int write_light;
+    int light_num;
+    /* Write Lyman-alpha skewers, numbered lya_num*/
+    int write_lya;
+    int lya_num;
     inttime_t ti;
 };
 
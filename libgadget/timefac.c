@@ -41,6 +41,25 @@ static inttime_t gk_last_ti0 = -1, gk_last_ti1 = -1;
 static double gk_last_value;
 #pragma omp threadprivate(gk_last_ti0, gk_last_ti1, gk_last_value)
 
+/* Cosmology of the tables, for factors which are integrated*/
+static Cosmology * TimefacCP;
+
+/*!< Maximum number of entries in the step tables. Longer steps fall back to the tables above.*/
+#define STEP_TABLE_LENGTH (1<<16)
+
+/* Drift and kick factors from ti_start to every multiple of spacing up to ti_end,
+ * for the times of the current PM step. Factors between two tabulated times are a difference
+ * of two entries, so no integration or search is done inside loops over particles.*/
+static struct {
+    inttime_t ti_start;
+    inttime_t ti_end;
+    inttime_t spacing;
+    int N;
+    double * Drift;
+    double * GravKick;
+    double * HydroKick;
+} StepTable;
+
 /* Integrand for the drift table*/
 static double drift_integ(double a, void *param)
 {
@@ -139,6 +158,89 @@ void init_drift_table(Cosmology * CP, double timeBegin, double timeMax)
     }
   gsl_integration_workspace_free(workspace);
   df_last_ti0 = df_last_ti1 = gk_last_ti0 = gk_last_ti1 = hk_last_ti0 = hk_last_ti1 = -1;
+  TimefacCP = CP;
+  /* The step tables are filled by update_step_factor_tables*/
+  if(!StepTable.Drift) {
+      StepTable.Drift = mymalloc("StepFactorTables", 3 * sizeof(double) * STEP_TABLE_LENGTH);
+      StepTable.GravKick = StepTable.Drift + STEP_TABLE_LENGTH;
+      StepTable.HydroKick = StepTable.GravKick + STEP_TABLE_LENGTH;
+  }
+  StepTable.N = 0;
+}
+
+/* Integrate a factor over one short interval. Does not need a workspace, so is thread safe.*/
+static double
+step_factor_integral(Cosmology * CP, double a0, double a1, double (*factor) (double, void *))
+{
+    double result, abserr;
+    size_t neval;
+    gsl_function F;
+    F.function = factor;
+    F.params = CP;
+    gsl_integration_qng(&F, a0, a1, 0, 1.0e-8, &result, &abserr, &neval);
+    return result;
+}
+
+void
+update_step_factor_tables(Cosmology * CP, inttime_t ti_start, inttime_t ti_end, int mintimebin)
+{
+    /* Kicks go to the middle of a step, so the finest times are half the smallest step*/
+    const inttime_t spacing = mintimebin > 1 ? (1u << (unsigned) (mintimebin - 1)) : 1;
+    /* The tables still hold every time needed*/
+    if(StepTable.N > 0 && ti_start >= StepTable.ti_start && ti_end <= StepTable.ti_end
+        && spacing >= StepTable.spacing && (ti_start - StepTable.ti_start) % StepTable.spacing == 0)
+        return;
+
+    const int64_t N = (int64_t) (ti_end - ti_start) / spacing + 1;
+    if(N > STEP_TABLE_LENGTH || ti_end < ti_start) {
+        StepTable.N = 0;
+        return;
+    }
+    StepTable.ti_start = ti_start;
+    StepTable.ti_end = ti_start + (N - 1) * spacing;
+    StepTable.spacing = spacing;
+    StepTable.N = N;
+
+    /* Each entry first holds the integral over the interval ending at it*/
+    int i;
+    StepTable.Drift[0] = StepTable.GravKick[0] = StepTable.HydroKick[0] = 0;
+    #pragma omp parallel for
+    for(i = 1; i < N; i++) {
+        const double a0 = exp(loga_from_ti(ti_start + (i - 1) * spacing));
+        const double a1 = exp(loga_from_ti(ti_start + i * spacing));
+        StepTable.Drift[i] = step_factor_integral(CP, a0, a1, &drift_integ);
+        StepTable.GravKick[i] = step_factor_integral(CP, a0, a1, &gravkick_integ);
+        StepTable.HydroKick[i] = step_factor_integral(CP, a0, a1, &hydrokick_integ);
+    }
+    for(i = 1; i < N; i++) {
+        StepTable.Drift[i] += StepTable.Drift[i - 1];
+        StepTable.GravKick[i] += StepTable.GravKick[i - 1];
+        StepTable.HydroKick[i] += StepTable.HydroKick[i - 1];
+    }
+}
+
+/* Index of ti in the step tables, or -1 if it is not tabulated*/
+static inline int
+step_table_index(const inttime_t ti)
+{
+    if(StepTable.N == 0 || ti < StepTable.ti_start || ti > StepTable.ti_end)
+        return -1;
+    const inttime_t off = ti - StepTable.ti_start;
+    if(off % StepTable.spacing)
+        return -1;
+    return off / StepTable.spacing;
+}
+
+/* Look up a factor between ti0 and ti1 in a step table. Returns 0 if either time is not tabulated.*/
+static inline int
+get_step_table_factor(const inttime_t ti0, const inttime_t ti1, const double * table, double * factor)
+{
+    const int i0 = step_table_index(ti0);
+    const int i1 = step_table_index(ti1);
+    if(i0 < 0 || i1 < 0)
+        return 0;
+    *factor = table[i1] - table[i0];
+    return 1;
 }
 
 /*Find which bin in the table we are looking up.
@@ -196,15 +298,21 @@ static double get_cached_kick_factor(const inttime_t ti0, const inttime_t ti1, c
  */
 double get_drift_factor(inttime_t ti0, inttime_t ti1)
 {
+  double fac;
+  if(get_step_table_factor(ti0, ti1, StepTable.Drift, &fac))
+      return fac;
   if(ti0 == df_last_ti0 && ti1 == df_last_ti1)
     return df_last_value;
 
   df_last_ti0 = ti0;
   df_last_ti1 = ti1;
 
-  if(!DriftTable)
+  if(DriftTable)
+    df_last_value = get_cached_kick_factor(ti0, ti1, DriftTable);
+  else if(TimefacCP)
+    df_last_value = get_exact_drift_factor(TimefacCP, ti0, ti1);
+  else
     endrun(1, "Drift table not allocated!\n");
-  df_last_value = get_cached_kick_factor(ti0, ti1, DriftTable);
 
   return df_last_value;
 }
@@ -219,6 +327,9 @@ double get_gravkick_factor(inttime_t ti0, inttime_t ti1)
 {
   if(ti0 == ti1)
       return 0;
+  double fac;
+  if(get_step_table_factor(ti0, ti1, StepTable.GravKick, &fac))
+      return fac;
   if(ti0 == gk_last_ti0 && ti1 == gk_last_ti1)
     return gk_last_value;
 
@@ -233,6 +344,9 @@ double get_hydrokick_factor(inttime_t ti0, inttime_t ti1)
 {
   if(ti0 == ti1)
       return 0;
+  double fac;
+  if(get_step_table_factor(ti0, ti1, StepTable.HydroKick, &fac))
+      return fac;
   if(ti0 == hk_last_ti0 && ti1 == hk_last_ti1)
     return hk_last_value;
 
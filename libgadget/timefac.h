@@ -8,9 +8,14 @@ void init_drift_table(Cosmology * CP, double timeBegin, double timeMax);
 double get_hydrokick_factor(inttime_t ti0, inttime_t ti1);
 double get_gravkick_factor(inttime_t ti0, inttime_t ti1);
 
-/* Get the drift factor at given time from a cache.
- * Run is terminated if
- * ti0 and ti1 are not in the cache*/
+/* Tabulate the drift and kick factors at every time between ti_start and ti_end
+ * on which a particle in mintimebin or coarser may drift or kick, so that the factors
+ * between these times are a single lookup. Does nothing if the tables already hold these times.
+ * Call once the timebins of the step are known.*/
+void update_step_factor_tables(Cosmology * CP, inttime_t ti_start, inttime_t ti_end, int mintimebin);
+
+/* Get the drift factor at given time from the step tables,
+ * or by integrating if ti0 and ti1 are not tabulated.*/
 double get_drift_factor(inttime_t ti0, inttime_t ti1);
 
 /* Get the exact drift factor at given time by integrating.
@@ -16,6 +16,10 @@
 #include "partmanager.h"
 #include "hydra.h"
 #include "timestep.h"
+#ifdef LIGHTCONE
+#include "lightcone.h"
+#endif
+#include "gravity.h"
 
 /*! \file timestep.c
  *  \brief routines for 'kicking' particles in
@@ -40,7 +44,7 @@ static inline int get_active_particle(const ActiveParticles * act, int pa)
 }
 
 static int
-timestep_eh_slots_fork(EIBase * event, void * userdata)
+timestep_eh_slots_fork(EIBase * event, int nevent, void * userdata)
 {
     /*Update the active particle list:
      * if the parent is active the child should also be active.
@@ -48,30 +52,66 @@ timestep_eh_slots_fork(EIBase * event, void * userdata)
      * BHs need not be: a halo can be seeded when the particle in question is inactive.*/
 
     EISlotsFork * ev = (EISlotsFork *) event;
-
-    int parent = ev->parent;
-    int child = ev->child;
     ActiveParticles * act = (ActiveParticles *) userdata;
 
-    if(is_timebin_active(P[parent].TimeBin, All.Ti_Current)) {
-        int childactive = atomic_fetch_and_add(&act->NumActiveParticle, 1);
-        if(act->ActiveParticle) {
-            /* This should never happen because we allocate as much space for active particles as we have space
-             * for particles, but just in case*/
-            if(childactive >= act->MaxActiveParticle)
-                endrun(5, "Tried to add %d active particles, more than %d allowed\n", childactive, act->MaxActiveParticle);
-            act->ActiveParticle[childactive] = child;
+    int i, nactive = 0;
+    for(i = 0; i < nevent; i++)
+        nactive += is_timebin_active(P[ev[i].parent].TimeBin, All.Ti_Current);
+    if(nactive == 0)
+        return 0;
+
+    /* Reserve space for all the active children at once*/
+    int childactive = atomic_fetch_and_add(&act->NumActiveParticle, nactive);
+    if(act->ActiveParticle) {
+        /* This should never happen because we allocate as much space for active particles as we have space
+         * for particles, but just in case*/
+        if(childactive + nactive > act->MaxActiveParticle)
+            endrun(5, "Tried to add %d active particles, more than %d allowed\n", childactive + nactive, act->MaxActiveParticle);
+        for(i = 0; i < nevent; i++) {
+            if(is_timebin_active(P[ev[i].parent].TimeBin, All.Ti_Current))
+                act->ActiveParticle[childactive++] = ev[i].child;
         }
     }
     return 0;
 }
 
-static inttime_t get_timestep_ti(const int p, const inttime_t dti_max);
+/* Which criterion set the timestep of a particle, for the TimestepLimiterReport*/
+enum TimestepLimiter {
+    TS_ACCEL = 0,
+    TS_COURANT,
+    TS_ACCRETION,
+    TS_BHNGB,
+    TS_GASNGB,
+    TS_MAXSTEP,
+    TS_MINSTEP,
+    TS_NLIMITER,
+};
+
+static const char * TimestepLimiterNames[TS_NLIMITER] = {"Accel", "Courant", "Accretion", "BHNgb", "GasNgb", "Max", "Min"};
+
+/* Factors of the timestep criteria which depend only on the current time,
+ * computed once per call to find_timesteps rather than once per particle.*/
+struct TimestepFactors {
+    /* Comoving to physical acceleration, for gravity and hydro*/
+    double gravaccel;
+    double hydroaccel;
+    /* dt^2 * accel / softening for the acceleration criterion*/
+    double accelfac;
+    /* dt * MaxSignalVel / Hsml for the Courant criterion*/
+    double courantfac;
+    double hubble;
+};
+
+static void set_timestep_factors(struct TimestepFactors * tf);
+static void print_timestep_limiters(int64_t * LimiterCount);
+static inttime_t get_timestep_ti(const int p, const inttime_t dti_max, const struct TimestepFactors * tf, enum TimestepLimiter * limiter);
 static int get_timestep_bin(inttime_t dti);
 static void do_the_short_range_kick(int i, inttime_t tistart, inttime_t tiend);
+static void do_the_hydro_kick(int i, inttime_t tistart, inttime_t tiend);
 static void do_the_long_range_kick(inttime_t tistart, inttime_t tiend);
 /* Get the current PM (global) timestep.*/
 static inttime_t get_PM_timestep_ti(inttime_t Ti_Current);
+static int64_t timestep_wakeup(inttime_t Ti_Current);
 
 /*Initialise the integer timeline*/
 void
@@ -145,6 +185,17 @@ find_timesteps(const ActiveParticles * act, inttime_t Ti_Current)
         PM.start = PM.Ti_kick;
     }
 
+    struct TimestepFactors tf;
+    set_timestep_factors(&tf);
+
+    /* Number of particles in each bin set by each criterion, for each thread*/
+    int64_t * LimiterCount = NULL;
+    const int reportlimiter = All.TimestepLimiterReport && !All.ForceEqualTimesteps;
+    if(reportlimiter) {
+        LimiterCount = ta_malloc("LimiterCount", int64_t, (TIMEBINS+1) * TS_NLIMITER * All.NumThreads);
+        memset(LimiterCount, 0, (TIMEBINS+1) * TS_NLIMITER * All.NumThreads * sizeof(int64_t));
+    }
+
     /* Now assign new timesteps and kick */
     if(All.ForceEqualTimesteps) {
         int i;
@@ -155,7 +206,8 @@ find_timesteps(const ActiveParticles * act, inttime_t Ti_Current)
              * Avoid making it active. */
             if(P[i].IsGarbage || P[i].Swallowed)
                 continue;
-            inttime_t dti = get_timestep_ti(i, dti_max);
+            enum TimestepLimiter limiter;
+            inttime_t dti = get_timestep_ti(i, dti_max, &tf, &limiter);
             if(dti < dti_min)
                 dti_min = dti;
         }
@@ -177,10 +229,11 @@ find_timesteps(const ActiveParticles * act, inttime_t Ti_Current)
         }
 
         inttime_t dti;
+        enum TimestepLimiter limiter = TS_MAXSTEP;
         if(All.ForceEqualTimesteps) {
             dti = dti_min;
         } else {
-            dti = get_timestep_ti(i, dti_max);
+            dti = get_timestep_ti(i, dti_max, &tf, &limiter);
         }
 
         /* make it a power 2 subdivision */
@@ -205,6 +258,8 @@ find_timesteps(const ActiveParticles * act, inttime_t Ti_Current)
          * until rebuild_activelist is called
          * (after domain, on new timestep).*/
         P[i].TimeBin = bin;
+        if(reportlimiter && bin >= 0)
+            LimiterCount[(omp_get_thread_num() * (TIMEBINS+1) + bin) * TS_NLIMITER + limiter]++;
         /*Find max and min*/
         if(bin < mTimeBin)
             mTimeBin = bin;
@@ -223,6 +278,11 @@ find_timesteps(const ActiveParticles * act, inttime_t Ti_Current)
         PM.length = dti_from_timebin(maxTimeBin);
     message(0, "PM timebin: %x dloga = %g  Max = (%g)\n", PM.length, dloga_from_dti(PM.length), All.MaxSizeTimestep);
 
+    if(reportlimiter) {
+        print_timestep_limiters(LimiterCount);
+        ta_free(LimiterCount);
+    }
+
     if(badstepsizecount) {
         message(0, "bad timestep spotted: terminating and saving snapshot.\n");
         dump_snapshot();
@@ -232,7 +292,41 @@ find_timesteps(const ActiveParticles * act, inttime_t Ti_Current)
     return mTimeBin;
 }
 
-/* Apply half a kick, for the second half of the timestep.*/
+/* Sum the thread-local counts of which criterion set the timesteps in each bin,
+ * and print them, so the timestep parameters can be tuned.*/
+static void
+print_timestep_limiters(int64_t * LimiterCount)
+{
+    int i, j;
+    const int nent = (TIMEBINS+1) * TS_NLIMITER;
+    for(i = 1; i < All.NumThreads; i++)
+        for(j = 0; j < nent; j++)
+            LimiterCount[j] += LimiterCount[nent * i + j];
+
+    MPI_Allreduce(MPI_IN_PLACE, LimiterCount, nent, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+
+    char line[200];
+    int len = 0;
+    for(j = 0; j < TS_NLIMITER; j++)
+        len += snprintf(line + len, sizeof(line) - len, " %12s", TimestepLimiterNames[j]);
+    message(0, "Limiter:%s\n", line);
+    for(i = TIMEBINS; i >= 0; i--) {
+        int64_t tot = 0;
+        for(j = 0; j < TS_NLIMITER; j++)
+            tot += LimiterCount[i * TS_NLIMITER + j];
+        if(tot == 0)
+            continue;
+        len = 0;
+        for(j = 0; j < TS_NLIMITER; j++)
+            len += snprintf(line + len, sizeof(line) - len, " %12ld", LimiterCount[i * TS_NLIMITER + j]);
+        message(0, "  bin=%2d %s\n", i, line);
+    }
+}
+
+/* Apply half a kick, for the second half of the timestep.
+ * The gravitational kick, common to all types, is one pass over the active list.
+ * The hydro kick and entropy update are a second pass over the active gas only,
+ * so the first pass does not branch on type or touch the SPH slots.*/
 void
 apply_half_kick(const ActiveParticles * act)
 {
@@ -252,6 +346,21 @@ apply_half_kick(const ActiveParticles * act)
         /*This only changes particle i, so is thread-safe.*/
         do_the_short_range_kick(i, tistart, tiend);
     }
+
+    int ngas;
+    const int * gas = get_active_particles_of_type(act, 0, &ngas);
+    #pragma omp parallel for
+    for(pa = 0; pa < ngas; pa++)
+    {
+        const int i = gas ? gas[pa] : pa;
+        /* Needed if the typed lists were not built*/
+        if(P[i].Type != 0)
+            continue;
+        /* The gravity kick already moved Ti_kick on by half a step*/
+        const inttime_t tiend = P[i].Ti_kick;
+        const inttime_t tistart = tiend - dti_from_timebin(P[i].TimeBin) / 2;
+        do_the_hydro_kick(i, tistart, tiend);
+    }
     walltime_measure("/Timeline/HalfKick/Short");
 }
 
@@ -305,44 +414,6 @@ do_the_short_range_kick(int i, inttime_t tistart, inttime_t tiend)
         P[i].Vel[j] += P[i].GravAccel[j] * Fgravkick;
     }
 
-    if(P[i].Type == 0) {
-        const double Fhydrokick = get_hydrokick_factor(tistart, tiend);
-        /* Add kick from hydro and SPH stuff */
-        for(j = 0; j < 3; j++) {
-            P[i].Vel[j] += SPHP(i).HydroAccel[j] * Fhydrokick;
-        }
-
-        /* Code here imposes a hard limit (default to speed of light)
-         * on the gas velocity. This should rarely be hit.*/
-        double vv=0;
-        for(j=0; j < 3; j++)
-            vv += P[i].Vel[j] * P[i].Vel[j];
-        vv = sqrt(vv);
-
-        if(vv > 0 && vv/All.cf.a > All.MaxGasVel) {
-            message(1,"Gas Particle ID %ld exceeded the gas velocity limit: %g > %g\n",P[i].ID, vv / All.cf.a, All.MaxGasVel);
-            for(j=0;j < 3; j++)
-            {
-                P[i].Vel[j] *= All.MaxGasVel * All.cf.a / vv;
-            }
-        }
-
-        /* In case of cooling, we prevent that the entropy (and
-           hence temperature) decreases by more than a factor 0.5.
-           This limiter is here as well as in sfr_eff.c because the
-           timestep may increase. */
-
-        const double dt_entr = dloga_from_dti(tiend-tistart);
-        if(SPHP(i).DtEntropy * dt_entr < -0.5 * SPHP(i).Entropy)
-            SPHP(i).Entropy *= 0.5;
-        else
-            SPHP(i).Entropy += SPHP(i).DtEntropy * dt_entr;
-
-        /* Limit entropy in simulations with cooling disabled*/
-        const double enttou = pow(SPH_EOMDensity(i) * All.cf.a3inv, GAMMA_MINUS1) / GAMMA_MINUS1;
-        if(SPHP(i).Entropy < All.MinEgySpec/enttou)
-            SPHP(i).Entropy = All.MinEgySpec / enttou;
-    }
 #ifdef DEBUG
     /* Check we have reasonable velocities. If we do not, try to explain why*/
     if(isnan(P[i].Vel[0]) || isnan(P[i].Vel[1]) || isnan(P[i].Vel[2])) {
@@ -353,28 +424,79 @@ do_the_short_range_kick(int i, inttime_t tistart, inttime_t tiend)
 #endif
 }
 
-double
-get_timestep_dloga(const int p)
+/* The hydro part of the short-range kick of gas particle i, applied after the gravitational kick.
+ * Also enforces the gas velocity limit and updates the entropy.*/
+static void
+do_the_hydro_kick(int i, inttime_t tistart, inttime_t tiend)
+{
+    int j;
+    const double Fhydrokick = get_hydrokick_factor(tistart, tiend);
+    /* Add kick from hydro and SPH stuff */
+    for(j = 0; j < 3; j++) {
+        P[i].Vel[j] += SPHP(i).HydroAccel[j] * Fhydrokick;
+    }
+
+    /* Code here imposes a hard limit (default to speed of light)
+     * on the gas velocity. This should rarely be hit.*/
+    double vv=0;
+    for(j=0; j < 3; j++)
+        vv += P[i].Vel[j] * P[i].Vel[j];
+    vv = sqrt(vv);
+
+    if(vv > 0 && vv/All.cf.a > All.MaxGasVel) {
+        message(1,"Gas Particle ID %ld exceeded the gas velocity limit: %g > %g\n",P[i].ID, vv / All.cf.a, All.MaxGasVel);
+        for(j=0;j < 3; j++)
+        {
+            P[i].Vel[j] *= All.MaxGasVel * All.cf.a / vv;
+        }
+    }
+
+    /* In case of cooling, we prevent that the entropy (and
+       hence temperature) decreases by more than a factor 0.5.
+       This limiter is here as well as in sfr_eff.c because the
+       timestep may increase. */
+
+    const double dt_entr = dloga_from_dti(tiend-tistart);
+    if(SPHP(i).DtEntropy * dt_entr < -0.5 * SPHP(i).Entropy)
+        SPHP(i).Entropy *= 0.5;
+    else
+        SPHP(i).Entropy += SPHP(i).DtEntropy * dt_entr;
+
+    /* Limit entropy in simulations with cooling disabled*/
+    const double enttou = pow(SPH_EOMDensity(i) * All.cf.a3inv, GAMMA_MINUS1) / GAMMA_MINUS1;
+    if(SPHP(i).Entropy < All.MinEgySpec/enttou)
+        SPHP(i).Entropy = All.MinEgySpec / enttou;
+}
+
+static void
+set_timestep_factors(struct TimestepFactors * tf)
+{
+    tf->gravaccel = All.cf.a2inv;
+    tf->hydroaccel = 1 / pow(All.Time, 3 * GAMMA - 2);
+    /* mind the factor 2.8 difference between gravity and softening used here. */
+    tf->accelfac = 2 * All.ErrTolIntAccuracy * All.cf.a / 2.8;
+    tf->courantfac = 2 * All.CourantFac * All.Time / pow(All.Time, 3 * (1 - GAMMA) / 2.0);
+    tf->hubble = All.cf.hubble;
+}
+
+/* Returns the timestep of particle p in dloga, and which criterion set it.*/
+static double
+get_timestep_dloga(const int p, const struct TimestepFactors * tf, enum TimestepLimiter * limiter)
 {
     double ac = 0;
     double dt = 0, dt_courant = 0;
 
     /*Compute physical acceleration*/
     {
-        double ax = All.cf.a2inv * P[p].GravAccel[0];
-        double ay = All.cf.a2inv * P[p].GravAccel[1];
-        double az = All.cf.a2inv * P[p].GravAccel[2];
-
-        ax += All.cf.a2inv * P[p].GravPM[0];
-        ay += All.cf.a2inv * P[p].GravPM[1];
-        az += All.cf.a2inv * P[p].GravPM[2];
+        double ax = tf->gravaccel * (P[p].GravAccel[0] + P[p].GravPM[0]);
+        double ay = tf->gravaccel * (P[p].GravAccel[1] + P[p].GravPM[1]);
+        double az = tf->gravaccel * (P[p].GravAccel[2] + P[p].GravPM[2]);
 
         if(P[p].Type == 0)
         {
-            const double fac2 = 1 / pow(All.Time, 3 * GAMMA - 2);
-            ax += fac2 * SPHP(p).HydroAccel[0];
-            ay += fac2 * SPHP(p).HydroAccel[1];
-            az += fac2 * SPHP(p).HydroAccel[2];
+            ax += tf->hydroaccel * SPHP(p).HydroAccel[0];
+            ay += tf->hydroaccel * SPHP(p).HydroAccel[1];
+            az += tf->hydroaccel * SPHP(p).HydroAccel[2];
         }
 
         ac = sqrt(ax * ax + ay * ay + az * az);	/* this is now the physical acceleration */
@@ -383,15 +505,25 @@ get_timestep_dloga(const int p)
     if(ac == 0)
         ac = 1.0e-30;
 
-    /* mind the factor 2.8 difference between gravity and softening used here. */
-    dt = sqrt(2 * All.ErrTolIntAccuracy * All.cf.a * (FORCE_SOFTENING(p) / 2.8) / ac);
+    dt = sqrt(tf->accelfac * FORCE_SOFTENING(p) / ac);
+    *limiter = TS_ACCEL;
 
     if(P[p].Type == 0)
     {
-        const double fac3 = pow(All.Time, 3 * (1 - GAMMA) / 2.0);
-        dt_courant = 2 * All.CourantFac * All.Time * P[p].Hsml / (fac3 * SPHP(p).MaxSignalVel);
-        if(dt_courant < dt)
+        dt_courant = tf->courantfac * P[p].Hsml / SPHP(p).MaxSignalVel;
+        if(dt_courant < dt) {
             dt = dt_courant;
+            *limiter = TS_COURANT;
+        }
+        /* No more than NgbTimeBinLimit bins above the shortest step of the neighbours*/
+        if(All.NgbTimeBinLimit > 0 && SPHP(p).MinNgbTimeBin > 0 && SPHP(p).MinNgbTimeBin < TIMEBINS) {
+            const int maxbin = DMIN(SPHP(p).MinNgbTimeBin + All.NgbTimeBinLimit, TIMEBINS);
+            double dt_limiter = get_dloga_for_bin(maxbin) / tf->hubble;
+            if(dt_limiter < dt) {
+                dt = dt_limiter;
+                *limiter = TS_GASNGB;
+            }
+        }
     }
 
     if(P[p].Type == 5)
@@ -399,33 +531,32 @@ get_timestep_dloga(const int p)
         if(BHP(p).Mdot > 0 && BHP(p).Mass > 0)
         {
             double dt_accr = 0.25 * BHP(p).Mass / BHP(p).Mdot;
-            if(dt_accr < dt)
+            if(dt_accr < dt) {
                 dt = dt_accr;
+                *limiter = TS_ACCRETION;
+            }
         }
         if(BHP(p).minTimeBin > 0 && BHP(p).minTimeBin < TIMEBINS) {
-            double dt_limiter = get_dloga_for_bin(BHP(p).minTimeBin) / All.cf.hubble;
+            double dt_limiter = get_dloga_for_bin(BHP(p).minTimeBin) / tf->hubble;
             /* Set the black hole timestep to the minimum timesteps of neighbouring gas particles.
              * It should be at least this for accretion accuracy, and it does not make sense to
              * make it less than this.*/
             dt = dt_limiter;
+            *limiter = TS_BHNGB;
         }
     }
 
     /* d a / a = dt * H */
-    double dloga = dt * All.cf.hubble;
+    double dloga = dt * tf->hubble;
 
     return dloga;
 }
 
-/*! This function returns the maximum allowed timestep of a particle, expressed in
- *  terms of the integer mapping that is used to represent the total simulated timespan.
- *  Arguments:
- *  p -> particle index
- *  dti_max -> maximal timestep.  */
 static inttime_t
-get_timestep_ti(const int p, const inttime_t dti_max)
+get_timestep_ti(const int p, const inttime_t dti_max, const struct TimestepFactors * tf, enum TimestepLimiter * limiter)
 {
     inttime_t dti;
+    *limiter = TS_MAXSTEP;
     /*Give a useful message if we are broken*/
     if(dti_max == 0)
         return 0;
@@ -434,15 +565,19 @@ get_timestep_ti(const int p, const inttime_t dti_max)
     if(!All.TreeGravOn)
         return dti_max;
 
-    double dloga = get_timestep_dloga(p);
+    double dloga = get_timestep_dloga(p, tf, limiter);
 
-    if(dloga < All.MinSizeTimestep)
+    if(dloga < All.MinSizeTimestep) {
         dloga = All.MinSizeTimestep;
+        *limiter = TS_MINSTEP;
+    }
 
     dti = dti_from_dloga(dloga);
 
-    if(dti > dti_max)
+    if(dti > dti_max) {
         dti = dti_max;
+        *limiter = TS_MAXSTEP;
+    }
 
     /*
     sqrt(2 * All.ErrTolIntAccuracy * All.cf.a * All.SofteningTable[P[p].Type] / ac) * All.cf.hubble,
@@ -523,7 +658,10 @@ get_long_range_timestep_dloga(void)
         if(count_sum[type] > 0)
         {
             double omega, dmean, dloga1;
-            const double asmth = All.Asmth * All.BoxSize / All.Nmesh;
+            double asmth = All.Asmth * All.BoxSize / All.Nmesh;
+            /* Particles in the zoom region feel the force of the finer zoom mesh*/
+            if(gravpm_zoom_region()->Enabled)
+                asmth = DMIN(asmth, All.Asmth * gravpm_zoom_region()->cellsize);
             if(type == 0 || (type == 4 && All.StarformationOn)
                 || (type == 5 && All.BlackHoleOn)
                 ) {
@@ -612,6 +750,76 @@ inttime_t find_next_kick(inttime_t Ti_Current, int minTimeBin)
 static void print_timebin_statistics(int NumCurrentTiStep, int * TimeBinCountType);
 
 /* mark the bins that will be active before the next kick*/
+/* Position of each type in ActiveByType. Gas and black holes are adjacent for the density.*/
+static const int ActiveTypeOrder[6] = {0, 3, 4, 5, 2, 1};
+
+/* Group the live active particles by type, in the same parallel pass order as the active list.
+ * Each thread counts its static share of the list, then writes its particles at its offset within each type.*/
+static void
+build_active_type_lists(ActiveParticles * act)
+{
+    const int nact = act->NumActiveParticle;
+    const int NumThreads = omp_get_max_threads();
+    int * counts = ta_malloc("ActiveTypeCounts", int, 6 * NumThreads);
+    memset(counts, 0, 6 * NumThreads * sizeof(int));
+    act->ActiveByType = (int *) mymalloc("ActiveByType", (nact + 1) * sizeof(int));
+
+    #pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        int i;
+        #pragma omp for schedule(static)
+        for(i = 0; i < nact; i++) {
+            const int p_i = act->ActiveParticle ? act->ActiveParticle[i] : i;
+            if(P[p_i].IsGarbage || P[p_i].Swallowed)
+                continue;
+            counts[6 * tid + P[p_i].Type]++;
+        }
+        #pragma omp single
+        {
+            int t, o, offset = 0;
+            for(o = 0; o < 6; o++) {
+                /* Find the type at this position*/
+                for(t = 0; t < 6; t++)
+                    if(ActiveTypeOrder[t] == o)
+                        break;
+                act->TypeStart[t] = offset;
+                int th;
+                for(th = 0; th < NumThreads; th++) {
+                    const int cnt = counts[6 * th + t];
+                    counts[6 * th + t] = offset;
+                    offset += cnt;
+                }
+                act->TypeCount[t] = offset - act->TypeStart[t];
+            }
+        }
+        /* Same static schedule, so each thread sees the same particles as in the counting loop*/
+        #pragma omp for schedule(static)
+        for(i = 0; i < nact; i++) {
+            const int p_i = act->ActiveParticle ? act->ActiveParticle[i] : i;
+            if(P[p_i].IsGarbage || P[p_i].Swallowed)
+                continue;
+            act->ActiveByType[counts[6 * tid + P[p_i].Type]++] = p_i;
+        }
+    }
+    ta_free(counts);
+}
+
+int *
+get_active_particles_of_type(const ActiveParticles * act, const int ptype, int * size)
+{
+    if(!act->ActiveByType) {
+        *size = act->NumActiveParticle;
+        return act->ActiveParticle;
+    }
+    if(ptype == ACTIVE_GAS_AND_BH) {
+        *size = act->TypeCount[0] + act->TypeCount[5];
+        return act->ActiveByType + act->TypeStart[0];
+    }
+    *size = act->TypeCount[ptype];
+    return act->ActiveByType + act->TypeStart[ptype];
+}
+
 int rebuild_activelist(ActiveParticles * act, inttime_t Ti_Current, int NumCurrentTiStep)
 {
     int i;
@@ -630,6 +838,14 @@ int rebuild_activelist(ActiveParticles * act, inttime_t Ti_Current, int NumCurre
         act->NumActiveParticle = 0;
     }
 
+    /* Move the gas flagged by the timebin limiter to a bin active now*/
+    if(All.NgbTimeBinLimit > 0) {
+        int64_t nwoken = timestep_wakeup(Ti_Current);
+        MPI_Allreduce(MPI_IN_PLACE, &nwoken, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        if(nwoken > 0)
+            message(0, "Woke up %ld gas particles next to particles on shorter timesteps.\n", nwoken);
+    }
+
     int * TimeBinCountType = mymalloc("TimeBinCountType", 6*(TIMEBINS+1)*All.NumThreads * sizeof(int));
     memset(TimeBinCountType, 0, 6 * (TIMEBINS+1) * All.NumThreads * sizeof(int));
 
@@ -673,18 +889,58 @@ int rebuild_activelist(ActiveParticles * act, inttime_t Ti_Current, int NumCurre
         act->MaxActiveParticle = act->NumActiveParticle + PartManager->MaxPart - PartManager->NumPart;
         /* listen to the slots events such that we can set timebin of new particles */
     }
-    event_listen(&EventSlotsFork, timestep_eh_slots_fork, act);
+    build_active_type_lists(act);
+    event_listen_batch(&EventSlotsFork, timestep_eh_slots_fork, act);
     walltime_measure("/Timeline/Active");
 
     return 0;
 }
 
+/* Shorten the step of each gas particle flagged in the hydro walk, so that it ends now.
+ * The new step is the longest one which ends now and fits inside the old one, and it
+ * starts where the old one did. The kick to the middle of the old step is replaced with
+ * a kick to the middle of the new step, so that the kick at the end of this timestep
+ * completes it as for any other active particle. Returns the number of particles woken.*/
+static int64_t
+timestep_wakeup(inttime_t Ti_Current)
+{
+    int i;
+    int64_t nwoken = 0;
+    #pragma omp parallel for reduction(+: nwoken)
+    for(i = 0; i < PartManager->NumPart; i++)
+    {
+        if(P[i].Type != 0 || P[i].IsGarbage || P[i].Swallowed || !SPHP(i).WakeUp)
+            continue;
+        SPHP(i).WakeUp = 0;
+        const int oldbin = P[i].TimeBin;
+        if(is_timebin_active(oldbin, Ti_Current))
+            continue;
+        const inttime_t tistart = P[i].Ti_kick - dti_from_timebin(oldbin) / 2;
+        int bin = oldbin - 1;
+        while(bin > 0 && (dti_from_timebin(bin) > Ti_Current - tistart || !is_timebin_active(bin, Ti_Current)))
+            bin--;
+        if(bin < 1)
+            continue;
+        const inttime_t timid = Ti_Current - dti_from_timebin(bin) / 2;
+        const inttime_t tiold = P[i].Ti_kick;
+        do_the_short_range_kick(i, tiold, timid);
+        do_the_hydro_kick(i, tiold, timid);
+        P[i].TimeBin = bin;
+        nwoken++;
+    }
+    return nwoken;
+}
+
 void free_activelist(ActiveParticles * act)
 {
+    if(act->ActiveByType) {
+        myfree(act->ActiveByType);
+        act->ActiveByType = NULL;
+    }
     if(act->ActiveParticle) {
         myfree(act->ActiveParticle);
     }
-    event_unlisten(&EventSlotsFork, timestep_eh_slots_fork, act);
+    event_unlisten_batch(&EventSlotsFork, timestep_eh_slots_fork, act);
 }
 
 /*! This routine writes one line for every timestep.
@@ -9,8 +9,18 @@ typedef struct ActiveParticles
     int MaxActiveParticle;
     int NumActiveParticle;
     int *ActiveParticle;
+    /* The live active particles grouped by type: gas, black holes, stars, then the rest,
+     * each in particle order. Particles created after rebuild_activelist are not included.
+     * NULL if not built. Use get_active_particles_of_type.*/
+    int *ActiveByType;
+    /* Offset and number of the particles of each type in ActiveByType*/
+    int TypeStart[6];
+    int TypeCount[6];
 } ActiveParticles;
 
+/* Pseudo-type for get_active_particles_of_type: the gas followed by the black holes*/
+#define ACTIVE_GAS_AND_BH 6
+
 /* variables for organizing PM steps of discrete timeline */
 typedef struct {
     inttime_t length; /*!< Duration of the current PM integer timestep*/
@@ -22,6 +32,11 @@ extern TimeSpan PM;
 
 int rebuild_activelist(ActiveParticles * act, inttime_t ti_current, int NumCurrentTiStep);
 void free_activelist(ActiveParticles * act);
+
+/* Get the active particles of type ptype, or of ACTIVE_GAS_AND_BH, and set size.
+ * If the typed lists were not built this is the whole active list
+ * (NULL meaning all particles), and the caller must still check the types.*/
+int * get_active_particles_of_type(const ActiveParticles * act, const int ptype, int * size);
 void set_global_time(double newtime);
 
 /* This function assigns new short-range timesteps to particles.
@@ -2,21 +2,35 @@
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <omp.h>
 
 #include "utils.h"
 
 #include "treewalk.h"
+#include "treewalk_ngbiter.h"
 #include "partmanager.h"
 #include "domain.h"
 #include "forcetree.h"
+#include "slotsmanager.h"
+#include "walltime.h"
 
 #include <signal.h>
 #define BREAKPOINT raise(SIGTRAP)
 
 #define FACT1 0.366025403785	/* FACT1 = 0.5 * (sqrt(3)-1) */
 
-static int *Ngblist;
+/* Thread-local arenas, carved from the main allocator for each treewalk, which hold the neighbour list of each thread.*/
+static Allocator * NgbArena;
+/* Length of the neighbour list of each thread*/
+static int NgblistSize;
+/* A list long enough for any query, taken under NgblistBigLock by a thread whose own list is full.
+ * NULL if the thread lists are already long enough.*/
+static int * NgblistBig;
+static int NgblistBigSize;
+static omp_lock_t NgblistBigLock;
+/* Shortest neighbour list of a thread. Longer queries are rare and go to NgblistBig.*/
+#define TREEWALK_MIN_NGBLIST 16384
 static int *Exportflag;    /*!< Buffer used for flagging whether a particle needs to be exported to another process */
 static int *Exportnodecount;
 static int *Exportindex;
@@ -24,10 +38,68 @@ static int *Send_offset, *Send_count, *Recv_count, *Recv_offset;
 
 /*!< Memory factor to leave for (N imported particles) > (N exported particles). */
 static int ImportBufferBoost;
+/*!< If true, exchange exports with non-blocking point-to-point messages and evaluate imports as they arrive. */
+static int TreeWalkPipeline;
+/* Counts pipelined exchange rounds, so that messages from different rounds never match.
+ * Every rank runs the same sequence of rounds, so this is consistent between ranks. */
+static int PipelineRound;
+/*!< Size of the neighbour candidate pool kept between the density and hydro walks, in MB. 0 disables it. */
+static double NgbCacheMB;
+/*!< If true, exports between ranks on the same node go through MPI-3 shared memory windows. */
+static int TreeWalkSharedMemory;
+/* Send exported positions as floats relative to the first node in the node list*/
+static int TreeWalkExportFloatPos;
+/* Import the gas near our domain as ghosts for the SPH walks, out to this factor
+ * times the smoothing lengths. 0 disables. See treewalk_halo_build*/
+static double TreeWalkHalo;
+/* Put the particles of top leaves next to another task first in each thread's queue,
+ * so their exports are found early in ev_primary. See ev_order_export_first*/
+static int TreeWalkExportFirst;
+/*!< If not empty, the root rank appends a line of statistics for every treewalk_run to this file. */
+static char TreeWalkStatsFile[200];
+static FILE * FdTreeWalkStats;
+/* The step and time stamped on the statistics, from treewalk_stats_set_step*/
+static int StatsStep;
+static double StatsTime;
+
+/* Ranks sharing memory with this one, created by the first shared memory exchange. */
+static MPI_Comm NodeComm = MPI_COMM_NULL;
+/* Rank in NodeComm of every task, or -1 for tasks on other nodes. */
+static int * NodeRank;
+/* Export and import counts with the tasks on this node removed, for the MPI exchange. */
+static int *Send_count_remote, *Recv_count_remote;
+/* Shared windows holding the packed exports and the results of the imports.
+ * Each starts with the send or receive offsets of its owner, see ev_alloc_shared.*/
+static MPI_Win QueryWin, ResultWin;
+
+/* Number of primary particles a thread claims at once from its queue.
+ * Small enough to balance the threads, large enough that the queue locks are cheap.*/
+#define TREEWALK_CHUNK 16
+/* Protects the currentIndex and currentEnd of each thread while other threads steal from it. */
+static omp_lock_t *QueueLock;
+
+/* The export buffer is sized from the number of exports per work set particle
+ * on the last run of the same evaluator, times this factor, plus TREEWALK_MIN_BUNCH.
+ * If the prediction is too small the buffer grows to all free memory for the next round.*/
+#define TREEWALK_EXPORT_SLACK 1.5
+#define TREEWALK_MIN_BUNCH 1024
+#define TREEWALK_MAX_HISTORY 32
+
+static struct export_history
+{
+    const char * ev_label;
+    double ExportPerWork;
+} ExportHistory[TREEWALK_MAX_HISTORY];
+static int NExportHistory;
+
+/* Length of the node list sent with an export. Most exports reach a single top level
+ * node of the other task. An export reaching more is split into several exports,
+ * each evaluated separately, as with NODELISTLENGTH before, so the list need not be long.*/
+#define TREEWALK_EXPORT_NODES 2
 
 static struct data_nodelist
 {
-    int NodeList[NODELISTLENGTH];
+    int NodeList[TREEWALK_EXPORT_NODES];
 }
 *DataNodeList;
 
@@ -47,23 +119,176 @@ static struct data_index *DataIndexTable;	/*!< the particles to be exported are
 					   results to be disentangled again and to be
 					   assigned to the correct particle */
 
+void set_treewalk_import_buffer_boost(int boost)
+{
+    ImportBufferBoost = boost;
+}
+
 /*Initialise global treewalk parameters*/
 void set_treewalk_params(ParameterSet * ps)
 {
     int ThisTask;
     MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0)
+    if(ThisTask == 0) {
         ImportBufferBoost = param_get_int(ps, "ImportBufferBoost");
+        TreeWalkPipeline = param_get_int(ps, "TreeWalkPipeline");
+        NgbCacheMB = param_get_double(ps, "NgbCacheMB");
+        TreeWalkSharedMemory = param_get_int(ps, "TreeWalkSharedMemory");
+        TreeWalkExportFloatPos = param_get_int(ps, "TreeWalkExportFloatPos");
+        TreeWalkHalo = param_get_double(ps, "TreeWalkHalo");
+        /* A smaller halo would miss the neighbours whose own smoothing length reaches
+         * a local particle, which the symmetric hydro walk needs.*/
+        if(TreeWalkHalo > 0 && TreeWalkHalo < 1)
+            endrun(0, "TreeWalkHalo = %g must be 0 or at least 1.\n", TreeWalkHalo);
+        TreeWalkExportFirst = param_get_int(ps, "TreeWalkExportFirst");
+        char * statsfile = param_get_string(ps, "TreeWalkStatsFile");
+        if(strlen(statsfile) > 0)
+            snprintf(TreeWalkStatsFile, sizeof(TreeWalkStatsFile), "%s/%s", param_get_string(ps, "OutputDir"), statsfile);
+    }
     MPI_Bcast(&ImportBufferBoost, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&TreeWalkPipeline, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&NgbCacheMB, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&TreeWalkSharedMemory, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&TreeWalkExportFloatPos, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&TreeWalkHalo, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&TreeWalkExportFirst, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(TreeWalkStatsFile, sizeof(TreeWalkStatsFile), MPI_CHAR, 0, MPI_COMM_WORLD);
+}
+
+void treewalk_stats_set_step(const int step, const double time)
+{
+    StatsStep = step;
+    StatsTime = time;
+}
+
+/* The counters of a treewalk which are summed over its runs, saved at the start of treewalk_run*/
+struct treewalk_counters
+{
+    int64_t Ninteractions;
+    int64_t Nexport_sum;
+    int64_t Niterations;
+    double timewait;
+    double timecomm;
+};
+
+static void
+ev_save_counters(TreeWalk * tw, struct treewalk_counters * c)
+{
+    c->Ninteractions = tw->Ninteractions;
+    c->Nexport_sum = tw->Nexport_sum;
+    c->Niterations = tw->Niterations;
+    c->timewait = tw->timewait1 + tw->timewait2;
+    c->timecomm = tw->timecommsumm1 + tw->timecommsumm2;
 }
 
+/* Append the statistics of one treewalk_run to TreeWalkStatsFile, as comma separated values.
+ * Collective. The times are min, mean and max over the ranks, so max / mean is the imbalance.*/
+static void
+ev_write_stats(TreeWalk * tw, const struct treewalk_counters * start, const double walltime)
+{
+    struct treewalk_counters end;
+    ev_save_counters(tw, &end);
+
+    /* Summed: work, interactions, exports, wait, comm, walltime. Min and max: walltime*/
+    double local[6] = {tw->WorkSetSize, end.Ninteractions - start->Ninteractions,
+        end.Nexport_sum - start->Nexport_sum, end.timewait - start->timewait,
+        end.timecomm - start->timecomm, walltime};
+    double sum[6], tmin, tmax;
+    MPI_Reduce(local, sum, 6, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&walltime, &tmin, 1, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&walltime, &tmax, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask != 0)
+        return;
+
+    if(!FdTreeWalkStats) {
+        fastpm_path_ensure_dirname(TreeWalkStatsFile);
+        if(!(FdTreeWalkStats = fopen(TreeWalkStatsFile, "a")))
+            endrun(1, "error in opening file '%s'\n", TreeWalkStatsFile);
+        if(ftell(FdTreeWalkStats) == 0)
+            fprintf(FdTreeWalkStats, "# step, time, label, nwork, interactions/work, exports/work, iterations, "
+                    "walltime min, mean, max, wait mean, comm mean\n");
+    }
+    const double nwork = DMAX(sum[0], 1);
+    fprintf(FdTreeWalkStats, "%d, %g, %s, %ld, %g, %g, %ld, %g, %g, %g, %g, %g\n",
+            StatsStep, StatsTime, tw->ev_label, (int64_t) sum[0],
+            sum[1] / nwork, sum[2] / nwork, end.Niterations - start->Niterations,
+            tmin, sum[5] / tw->NTask, tmax, sum[3] / tw->NTask, sum[4] / tw->NTask);
+    fflush(FdTreeWalkStats);
+}
+
+/* Neighbour candidates found by one walk, for reuse by a later walk on the same tree.
+ * The candidates of a particle are the raw output of ngb_treefind_threads for a symmetric
+ * search of radius Radius, before the distance cut. They remain complete for a later
+ * symmetric search of radius <= Radius as long as no node hmax grows enough to reach
+ * the particle, which treewalk_ngbcache_update_hmax checks.*/
+struct NgbCache
+{
+    int * Pool;
+    int PoolSize;
+    int Used;
+    /* Start in Pool and number of candidates of each particle. Count < 0 if not cached.*/
+    int * Offset;
+    int * Count;
+    /* Number of pseudo particles each particle was exported to, < 0 if not cached. They are
+     * stored in Pool from ExportOffset, after its candidates if those are cached, and the
+     * exports are repeated on reuse. If only the exports fit, a walk which reuses them
+     * searches the local tree without looking for exports again.*/
+    int * NExport;
+    int * ExportOffset;
+    /* Search radius of the cached candidates*/
+    MyFloat * Radius;
+    int NumPart;
+    /* Number of lookups and successful lookups, and lookups which reused only the exports*/
+    int64_t Lookups;
+    int64_t Hits;
+    int64_t ExportHits;
+};
+
+/* Ghosts are searched in chunks of this many, culled by their bounding box*/
+#define HALO_CHUNK 16
+
+struct halo_chunk
+{
+    double center[3];
+    double half[3];
+    /* Largest Hsml in the chunk, for symmetric searches*/
+    MyFloat hmax;
+    /* Position of the first ghost in NgbHalo.Index, and number of ghosts*/
+    int start;
+    int count;
+};
+
+/* Gas particles of other tasks, imported by treewalk_halo_build.*/
+struct NgbHalo
+{
+    /* The ghosts are P[NumPart + k] for k < NGhost, with SPH data in SphP[size + k]. */
+    int NGhost;
+    /* Ghosts in top leaf l are in chunks LeafChunk[l] to LeafChunk[l+1]. Index holds
+     * the particle index of the ghosts, sorted by top leaf.*/
+    int * LeafChunk;
+    struct halo_chunk * Chunks;
+    int * Index;
+    /* Our top leaves sorted by tree node, and the search radius around
+     * the particles of each leaf inside which all the neighbours are local or ghosts.*/
+    int NLocalLeaves;
+    int * LocalLeafNode;
+    double * LocalLeafRadius;
+};
+
 static void ev_init_thread(TreeWalk * tw, LocalTreeWalk * lv);
+static void ev_alloc_export_buffer(TreeWalk * tw);
 static void ev_begin(TreeWalk * tw, int * active_set, const int size);
+static size_t ev_packed_query_size(const TreeWalk * tw);
 static void ev_finish(TreeWalk * tw);
 static int ev_primary(TreeWalk * tw);
 static void ev_get_remote(TreeWalk * tw);
 static void ev_secondary(TreeWalk * tw);
 static void ev_reduce_result(TreeWalk * tw);
+static void ev_pipelined_exchange(TreeWalk * tw);
+static char * ev_alloc_shared(MPI_Win * win, const int * offset, const size_t size, const int NTask);
 static int ev_ndone(TreeWalk * tw);
 
 static void
@@ -77,34 +302,6 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
         LocalTreeWalk * lv);
 
 
-/*! This function is used as a comparison kernel in a sort routine. It is
- *  used to group particles in the communication buffer that are going to
- *  be sent to the same CPU.
- */
-static int data_index_compare(const void *a, const void *b)
-{
-    if(((struct data_index *) a)->Task < (((struct data_index *) b)->Task))
-        return -1;
-
-    if(((struct data_index *) a)->Task > (((struct data_index *) b)->Task))
-        return +1;
-
-    if(((struct data_index *) a)->Index < (((struct data_index *) b)->Index))
-        return -1;
-
-    if(((struct data_index *) a)->Index > (((struct data_index *) b)->Index))
-        return +1;
-
-    if(((struct data_index *) a)->IndexGet < (((struct data_index *) b)->IndexGet))
-        return -1;
-
-    if(((struct data_index *) a)->IndexGet > (((struct data_index *) b)->IndexGet))
-        return +1;
-
-    return 0;
-}
-
-
 /*
  * for debugging
  */
@@ -126,7 +323,15 @@ ev_init_thread(TreeWalk * const tw, LocalTreeWalk * lv)
     lv->Ninteractions = 0;
     lv->Nnodesinlist = 0;
     lv->Nlist = 0;
-    lv->ngblist = Ngblist + thread_id * PartManager->NumPart;
+    lv->Nexported = 0;
+    lv->Nhalo = 0;
+    lv->SkipExports = 0;
+    lv->targets = NULL;
+    /* Nothing outlives a visit in the arena, so it is emptied for each new walk.*/
+    allocator_reset(&NgbArena[thread_id], 0);
+    lv->ngblist_thread = (int *) allocator_alloc_bot(&NgbArena[thread_id], "Ngblist", NgblistSize * sizeof(int));
+    lv->ngblist = lv->ngblist_thread;
+    lv->NgblistSize = NgblistSize;
     for(j = 0; j < NTask; j++)
         lv->exportflag[j] = -1;
 }
@@ -145,72 +350,167 @@ ev_free_threadlocals()
     ta_free(Exportflag);
 }
 
+/* Give each thread a neighbour list of its own share of the particles in a thread-local arena,
+ * instead of one for all the particles. The rare thread needing more takes NgblistBig.*/
+static void
+ev_alloc_ngblists(const int NumThreads, const int NumPart)
+{
+    NgblistSize = NumPart / NumThreads + TREEWALK_MIN_NGBLIST;
+    if(NgblistSize > NumPart)
+        NgblistSize = NumPart;
+
+    NgbArena = ta_malloc("NgbArena", Allocator, NumThreads);
+    /* Leave room for the block header in each arena*/
+    if(allocator_split_threads(A_MAIN, NgbArena, NumThreads, "NgbArena", NgblistSize * sizeof(int) + 4096) != 0)
+        endrun(1, "Could not allocate thread-local neighbour lists of %d particles\n", NgblistSize);
+
+    NgblistBig = NULL;
+    NgblistBigSize = NumPart;
+    if(NgblistSize < NumPart) {
+        NgblistBig = (int *) mymalloc("NgblistBig", NumPart * sizeof(int));
+        omp_init_lock(&NgblistBigLock);
+    }
+}
+
+static void
+ev_free_ngblists(const int NumThreads)
+{
+    if(NgblistBig) {
+        omp_destroy_lock(&NgblistBigLock);
+        myfree(NgblistBig);
+    }
+    allocator_destroy_threads(NgbArena, NumThreads);
+    ta_free(NgbArena);
+}
+
+/* Move the neighbour list of this thread to NgblistBig, waiting for any other thread using it.
+ * A query never finds more candidates than there are particles, so it fits.*/
+static void
+ngb_take_big_ngblist(LocalTreeWalk * lv, const int numcand)
+{
+    if(!NgblistBig || lv->ngblist == NgblistBig)
+        endrun(12313, "Neighbour list of %d entries is full with %d candidates\n", lv->NgblistSize, numcand);
+    omp_set_lock(&NgblistBigLock);
+    memcpy(NgblistBig, lv->ngblist, numcand * sizeof(int));
+    lv->ngblist = NgblistBig;
+    lv->NgblistSize = NgblistBigSize;
+}
+
+/* Return NgblistBig once its candidates are used, so other threads can take it.*/
+static void
+ngb_release_big_ngblist(LocalTreeWalk * lv)
+{
+    if(lv->ngblist != lv->ngblist_thread) {
+        lv->ngblist = lv->ngblist_thread;
+        lv->NgblistSize = NgblistSize;
+        omp_unset_lock(&NgblistBigLock);
+    }
+}
+
+/* Find the export history of an evaluator, adding an empty entry if there is none.
+ * Returns NULL if the history table is full.*/
+static struct export_history *
+ev_find_history(const char * ev_label)
+{
+    int i;
+    for(i = 0; i < NExportHistory; i++)
+        if(!strcmp(ExportHistory[i].ev_label, ev_label))
+            return &ExportHistory[i];
+    if(NExportHistory == TREEWALK_MAX_HISTORY)
+        return NULL;
+    ExportHistory[NExportHistory].ev_label = ev_label;
+    ExportHistory[NExportHistory].ExportPerWork = -1;
+    return &ExportHistory[NExportHistory++];
+}
+
+static void
+ev_alloc_export_buffer(TreeWalk * tw)
+{
+    DataIndexTable =
+        (struct data_index *) mymalloc("DataIndexTable", tw->BunchSize * sizeof(struct data_index));
+    DataNodeList =
+        (struct data_nodelist *) mymalloc("DataNodeList", tw->BunchSize * sizeof(struct data_nodelist));
+
+#ifdef DEBUG
+    memset(DataNodeList, -1, sizeof(struct data_nodelist) * tw->BunchSize);
+#endif
+}
+
 static void
 ev_begin(TreeWalk * tw, int * active_set, const int size)
 {
     const int NumThreads = omp_get_max_threads();
     MPI_Comm_size(MPI_COMM_WORLD, &tw->NTask);
     tw->NThread = NumThreads;
+    tw->MeasureWalkTime = domain_measured_cost();
     /* The last argument is may_have_garbage: in practice the only
      * trivial haswork is the gravtree, which has no (active) garbage because
      * the active list was just rebuilt. If we ever add a trivial haswork after
      * sfr/bh we should change this*/
     treewalk_build_queue(tw, active_set, size, 0);
 
-    Ngblist = (int*) mymalloc("Ngblist", PartManager->NumPart * NumThreads * sizeof(int));
+    /* Ghosts are also candidates*/
+    const int nghost = tw->halo && tw->tree->Halo ? tw->tree->Halo->NGhost : 0;
+    ev_alloc_ngblists(NumThreads, PartManager->NumPart + nghost);
 
     report_memory_usage(tw->ev_label);
 
     /*The amount of memory eventually allocated per tree buffer*/
-    int bytesperbuffer = sizeof(struct data_index) + sizeof(struct data_nodelist) + tw->query_type_elsize;
+    int bytesperbuffer = sizeof(struct data_index) + sizeof(struct data_nodelist) + ev_packed_query_size(tw);
     /*This memory scales like the number of imports. In principle this could be much larger than Nexport
      * if the tree is very imbalanced and many processors all need to export to this one. In practice I have
      * not seen this happen, but provide a parameter to boost the memory for Nimport just in case.*/
-    bytesperbuffer += ImportBufferBoost * (tw->query_type_elsize + tw->result_type_elsize);
+    bytesperbuffer += ImportBufferBoost * (tw->query_type_elsize + ev_packed_query_size(tw) + tw->result_type_elsize);
     /*Use all free bytes for the tree buffer, as in exchange. Leave some free memory for array overhead.*/
     size_t freebytes = mymalloc_freebytes();
     /* if freebytes is greater than 2GB we run into issues computing BunchSize.
      * It is probable not a good idea to send too many particles around in one bunch anyways. */
     if(freebytes > 1024 * 1024 * 1024) freebytes =  1024 * 1024 * 1024;
 
-    tw->BunchSize = (int)floor(((double)freebytes  - 4096 * 10)/ bytesperbuffer);
-    if(tw->BunchSize <= 0) {
+    tw->MaxBunchSize = (int)floor(((double)freebytes  - 4096 * 10)/ bytesperbuffer);
+    if(tw->MaxBunchSize <= 0) {
         endrun(1231245, "Not enough memory for exporting any particles: needed %d bytes have %d. \n", bytesperbuffer, freebytes-4096*10);
     }
-    DataIndexTable =
-        (struct data_index *) mymalloc("DataIndexTable", tw->BunchSize * sizeof(struct data_index));
-    DataNodeList =
-        (struct data_nodelist *) mymalloc("DataNodeList", tw->BunchSize * sizeof(struct data_nodelist));
-
-#ifdef DEBUG
-    memset(DataNodeList, -1, sizeof(struct data_nodelist) * tw->BunchSize);
-#endif
+    tw->BunchSize = tw->MaxBunchSize;
+    tw->BufferFullFlag = 0;
+    /* Only take the memory the exports are likely to need, leaving the rest for the imports.*/
+    const struct export_history * hist = ev_find_history(tw->ev_label);
+    if(hist && hist->ExportPerWork >= 0) {
+        const double predicted = TREEWALK_EXPORT_SLACK * hist->ExportPerWork * tw->WorkSetSize + TREEWALK_MIN_BUNCH;
+        if(predicted < tw->BunchSize)
+            tw->BunchSize = predicted;
+    }
+    ev_alloc_export_buffer(tw);
     tw->currentIndex = ta_malloc("currentIndexPerThread", int,  NumThreads);
     tw->currentEnd = ta_malloc("currentEndPerThread", int, NumThreads);
+    QueueLock = ta_malloc("QueueLock", omp_lock_t, NumThreads);
 
     int i;
     for(i = 0; i < NumThreads; i ++) {
         tw->currentIndex[i] = ((size_t) i) * tw->WorkSetSize / NumThreads;
         tw->currentEnd[i] = ((size_t) i + 1) * tw->WorkSetSize / NumThreads;
+        omp_init_lock(&QueueLock[i]);
     }
 }
 
 static void ev_finish(TreeWalk * tw)
 {
+    int i;
+    for(i = 0; i < tw->NThread; i ++)
+        omp_destroy_lock(&QueueLock[i]);
+    ta_free(QueueLock);
     ta_free(tw->currentEnd);
     ta_free(tw->currentIndex);
     myfree(DataNodeList);
     myfree(DataIndexTable);
-    myfree(Ngblist);
+    ev_free_ngblists(tw->NThread);
     if(!tw->work_set_stolen_from_active)
         myfree(tw->WorkSet);
 
 }
 
-int data_index_compare(const void *a, const void *b);
-
 static void
-treewalk_init_query(TreeWalk * tw, TreeWalkQueryBase * query, int i, int * NodeList)
+treewalk_init_query(TreeWalk * tw, TreeWalkQueryBase * query, int i)
 {
     query->ID = P[i].ID;
 
@@ -219,12 +519,8 @@ treewalk_init_query(TreeWalk * tw, TreeWalkQueryBase * query, int i, int * NodeL
         query->Pos[d] = P[i].Pos[d];
     }
 
-    if(NodeList) {
-        memcpy(query->NodeList, NodeList, sizeof(int) * NODELISTLENGTH);
-    } else {
-        query->NodeList[0] = tw->tree->firstnode; /* root node */
-        query->NodeList[1] = -1; /* terminate immediately */
-    }
+    query->NodeList[0] = tw->tree->firstnode; /* root node */
+    query->NodeList[1] = -1; /* terminate immediately */
 
     tw->fill(i, query, tw);
 };
@@ -239,11 +535,108 @@ treewalk_init_result(TreeWalk * tw, TreeWalkResultBase * result, TreeWalkQueryBa
 static void
 treewalk_reduce_result(TreeWalk * tw, TreeWalkResultBase * result, int i, enum TreeWalkReduceMode mode)
 {
+    /* Work done for the particle here and on other processors, for the domain cost model.*/
+    if(tw->MeasureWalkTime)
+        P[i].WalkTime += result->WalkTime;
     if(tw->reduce != NULL)
         tw->reduce(i, result, mode, tw);
 }
 
-static void real_ev(TreeWalk * tw, int * ninter) {
+/* Take the upper half of the remaining queue of the most loaded thread.
+ * Each thread starts with a contiguous part of the WorkSet, so the
+ * stolen particles are still contiguous and close in the tree.
+ * Returns 0 if there is no work left worth stealing.*/
+static int
+ev_steal_work(TreeWalk * tw, const int tid)
+{
+    int i, victim = -1, most = 2 * TREEWALK_CHUNK;
+    /* Unlocked reads: only used to pick a victim, and checked again under the lock.*/
+    for(i = 0; i < tw->NThread; i++) {
+        const int left = tw->currentEnd[i] - tw->currentIndex[i];
+        if(i != tid && left > most) {
+            most = left;
+            victim = i;
+        }
+    }
+    if(victim < 0)
+        return 0;
+
+    int start = 0, end = 0;
+    omp_set_lock(&QueueLock[victim]);
+    const int left = tw->currentEnd[victim] - tw->currentIndex[victim];
+    if(left > 2 * TREEWALK_CHUNK) {
+        end = tw->currentEnd[victim];
+        start = end - left / 2;
+        tw->currentEnd[victim] = start;
+    }
+    omp_unset_lock(&QueueLock[victim]);
+
+    /* Our own queue is empty, so nobody steals from it while we refill it.*/
+    omp_set_lock(&QueueLock[tid]);
+    tw->currentIndex[tid] = start;
+    tw->currentEnd[tid] = end;
+    omp_unset_lock(&QueueLock[tid]);
+    return 1;
+}
+
+/* Number of particles from WorkSet[k] onwards, up to end, which share a parent tree node.*/
+static int
+ev_group_size(TreeWalk * tw, const int k, const int end)
+{
+    const int * Father = tw->tree->Father;
+    const int father = Father[tw->WorkSet ? tw->WorkSet[k] : k];
+    int n = 1;
+    while(n < TREEWALK_GROUP_MAX && k + n < end) {
+        const int j = tw->WorkSet ? tw->WorkSet[k + n] : k + n;
+        if(Father[j] != father)
+            break;
+        n++;
+    }
+    return n;
+}
+
+static void ev_discard_exports(TreeWalk * tw, const int target);
+
+/* Evaluate the group of primary particles WorkSet[k .. k + ngroup) with visit_group.
+ * Returns -1 if the export buffer filled up and the whole group must be redone.*/
+static int
+ev_visit_group(TreeWalk * tw, LocalTreeWalk * lv, const int k, const int ngroup, char * inputs, char * outputs)
+{
+    TreeWalkQueryBase * input[TREEWALK_GROUP_MAX];
+    TreeWalkResultBase * output[TREEWALK_GROUP_MAX];
+    int targets[TREEWALK_GROUP_MAX];
+    int m;
+    for(m = 0; m < ngroup; m++) {
+        targets[m] = tw->WorkSet ? tw->WorkSet[k + m] : k + m;
+        input[m] = (TreeWalkQueryBase *) (inputs + m * tw->query_type_elsize);
+        output[m] = (TreeWalkResultBase *) (outputs + m * tw->result_type_elsize);
+        treewalk_init_query(tw, input[m], targets[m]);
+        treewalk_init_result(tw, output[m], input[m]);
+    }
+    lv->targets = targets;
+    lv->target = targets[0];
+    const double tvisit = tw->MeasureWalkTime ? second() : 0;
+    const int rt = tw->visit_group(input, output, ngroup, lv);
+    const double walktime = tw->MeasureWalkTime ? timediff(tvisit, second()) / ngroup : 0;
+    lv->targets = NULL;
+
+    if(rt < 0) {
+        /* treewalk_export_particle only discarded the exports of the member it was exporting.*/
+        for(m = 0; m < ngroup; m++)
+            ev_discard_exports(tw, targets[m]);
+        return rt;
+    }
+    for(m = 0; m < ngroup; m++) {
+        output[m]->WalkTime = walktime;
+        treewalk_reduce_result(tw, output[m], targets[m], TREEWALK_PRIMARY);
+    }
+    return rt;
+}
+
+/* Runs the primary walk for one thread and returns the time the thread was busy.
+ * Threads claim chunks of their own queue, and steal from other threads once it runs out.*/
+static double real_ev(TreeWalk * tw, int * ninter) {
+    const double tstart = second();
     int tid = omp_get_thread_num();
     LocalTreeWalk lv[1];
 
@@ -251,37 +644,76 @@ static void real_ev(TreeWalk * tw, int * ninter) {
     lv->mode = 0;
 
     /* Note: exportflag is local to each thread */
-    int k;
-    /* use old index to recover from a buffer overflow*/;
     TreeWalkQueryBase * input = alloca(tw->query_type_elsize);
     TreeWalkResultBase * output = alloca(tw->result_type_elsize);
+    char * groupinputs = NULL, * groupoutputs = NULL;
+    if(tw->visit_group) {
+        groupinputs = alloca(TREEWALK_GROUP_MAX * tw->query_type_elsize);
+        groupoutputs = alloca(TREEWALK_GROUP_MAX * tw->result_type_elsize);
+    }
+
+    while(!tw->BufferFullFlag) {
+        int k, end;
+        omp_set_lock(&QueueLock[tid]);
+        k = tw->currentIndex[tid];
+        end = k + TREEWALK_CHUNK;
+        if(end > tw->currentEnd[tid])
+            end = tw->currentEnd[tid];
+        tw->currentIndex[tid] = end;
+        omp_unset_lock(&QueueLock[tid]);
+
+        if(k >= end) {
+            if(!ev_steal_work(tw, tid))
+                break;
+            continue;
+        }
 
-    for(k = tw->currentIndex[tid];
-        k < tw->currentEnd[tid];
-        k++) {
-        if(tw->BufferFullFlag) break;
+        int ngroup;
+        for(; k < end; k += ngroup) {
+            if(tw->BufferFullFlag) break;
+
+            ngroup = tw->visit_group ? ev_group_size(tw, k, end) : 1;
+            if(ngroup > 1) {
+                if(ev_visit_group(tw, lv, k, ngroup, groupinputs, groupoutputs) < 0)
+                    break; /* export buffer has filled up, redo this group */
+                continue;
+            }
 
-        const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+            const int i = tw->WorkSet ? tw->WorkSet[k] : k;
 #ifdef DEBUG
-        if(tw->haswork && !tw->haswork(i, tw)) {
-            BREAKPOINT;
-        }
+            if(tw->haswork && !tw->haswork(i, tw)) {
+                BREAKPOINT;
+            }
 #endif
-        /* Primary never uses node list */
-        treewalk_init_query(tw, input, i, NULL);
-        treewalk_init_result(tw, output, input);
+            /* Primary never uses node list */
+            treewalk_init_query(tw, input, i);
+            treewalk_init_result(tw, output, input);
 
-        lv->target = i;
-        const int rt = tw->visit(input, output, lv);
+            lv->target = i;
+            const double tvisit = tw->MeasureWalkTime ? second() : 0;
+            const int rt = tw->visit(input, output, lv);
 
-        if(rt < 0) {
-            break; /* export buffer has filled up, redo this particle */
-        } else {
-            treewalk_reduce_result(tw, output, i, TREEWALK_PRIMARY);
+            if(rt < 0) {
+                break; /* export buffer has filled up, redo this particle */
+            } else {
+                if(tw->MeasureWalkTime)
+                    output->WalkTime = timediff(tvisit, second());
+                treewalk_reduce_result(tw, output, i, TREEWALK_PRIMARY);
+            }
+        }
+        if(k < end) {
+            /* Return the unfinished part of the chunk to the queue for the next export round.
+             * Other threads only steal above currentIndex, so the range is still ours.*/
+            omp_set_lock(&QueueLock[tid]);
+            tw->currentIndex[tid] = k;
+            omp_unset_lock(&QueueLock[tid]);
+            break;
         }
     }
-    tw->currentIndex[tid] = k;
     *ninter += lv->Ninteractions;
+    const double tend = second();
+    walltime_trace_event(tw->ev_label, "primary_thread", tstart, tend);
+    return timediff(tstart, tend);
 }
 
 #if 0
@@ -297,6 +729,135 @@ cmpint(const void *a, const void *b)
 }
 #endif
 
+static int
+ev_cmp_int(const void * a, const void * b)
+{
+    const int ia = *(const int *) a, ib = *(const int *) b;
+    return (ia > ib) - (ia < ib);
+}
+
+/* Find our top leaves with a top leaf of another task within half their size,
+ * or their hmax if it is larger, of their surface. Their particles are the ones likely to be exported.
+ * Returns a sorted list of their tree nodes, of length *nboundary, allocated with mymalloc.*/
+static int *
+ev_boundary_leaves(const ForceTree * tree, const int ThisTask, int * nboundary)
+{
+    const double BoxSize = tree->BoxSize;
+    int * leaves = (int *) mymalloc("BoundaryLeaves", tree->NTopLeaves * sizeof(int));
+    int i, n = 0;
+    for(i = 0; i < tree->NTopLeaves; i++) {
+        if(tree->TopLeaves[i].Task != ThisTask)
+            continue;
+        const struct NODE * leaf = &tree->Nodes[tree->TopLeaves[i].treenode];
+        double margin = 0.5 * leaf->len;
+        if(tree->hmax_computed_flag && leaf->u.d.hmax > margin)
+            margin = leaf->u.d.hmax;
+        /* Walk the top-level nodes, as in halo_find_tasks*/
+        int no = tree->firstnode;
+        while(no >= 0) {
+            if(node_is_pseudo_particle(no, tree)) {
+                if(tree->TopLeaves[no - tree->lastnode].Task != ThisTask) {
+                    leaves[n++] = tree->TopLeaves[i].treenode;
+                    break;
+                }
+                no = force_get_next_node(no, tree);
+                continue;
+            }
+            const struct NODE * current = &tree->Nodes[no];
+            if(!current->f.TopLevel) {
+                no = current->u.d.sibling;
+                continue;
+            }
+            const double dist = 0.5 * (current->len + leaf->len) + margin;
+            int d;
+            for(d = 0; d < 3; d ++) {
+                if(fabs(NEAREST(current->center[d] - leaf->center[d], BoxSize)) > dist)
+                    break;
+            }
+            /* Skip nodes out of range and our own top leaves*/
+            if(d < 3 || (!current->f.InternalTopLevel && current->f.ChildType != PSEUDO_NODE_TYPE))
+                no = current->u.d.sibling;
+            else
+                no = current->u.d.nextnode;
+        }
+    }
+    qsort(leaves, n, sizeof(int), ev_cmp_int);
+    *nboundary = n;
+    return leaves;
+}
+
+/* Is particle p in one of the sorted boundary top leaves? Particles which are not in the tree are not.*/
+static int
+ev_in_boundary_leaf(const ForceTree * tree, const int p, const int * leaves, const int nboundary)
+{
+    int no = tree->Father[p];
+    if(p >= tree->NumParticles || no < tree->firstnode || no >= tree->firstnode + tree->numnodes)
+        return 0;
+    /* The Father of a particle of a type not in the tree is stale*/
+    if(!(tree->Nodes[no].f.TypeMask & (1 << P[p].Type)))
+        return 0;
+    while(no >= 0 && !tree->Nodes[no].f.TopLevel)
+        no = tree->Nodes[no].father;
+    if(no < 0)
+        return 0;
+    return bsearch(&no, leaves, nboundary, sizeof(int), ev_cmp_int) != NULL;
+}
+
+/* Does particle p have exports? If the neighbour cache holds its exports from an earlier
+ * walk this is known exactly, otherwise guess from its top leaf.*/
+static int
+ev_exports_early(const TreeWalk * tw, const struct NgbCache * cache, const int p, const int * leaves, const int nboundary)
+{
+    if(cache && cache->NExport[p] >= 0)
+        return cache->NExport[p] > 0;
+    return ev_in_boundary_leaf(tw->tree, p, leaves, nboundary);
+}
+
+/* Reorder the WorkSet so that each thread starts with the particles of the top leaves
+ * next to other tasks. ev_primary then finds their exports first, and they can be sent
+ * (for example with TreeWalkPipeline) while the interior particles are evaluated.
+ * Particles with exports stored in the neighbour cache are placed by those exports.
+ * The split into threads is the one of ev_begin, and the order within each part is kept,
+ * so particles sharing a tree node stay together.*/
+static void
+ev_order_export_first(TreeWalk * tw)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const int size = tw->WorkSetSize;
+    int * order = (int *) mymalloc("ExportFirstSet", size * sizeof(int));
+    int nboundary;
+    int * leaves = ev_boundary_leaves(tw->tree, ThisTask, &nboundary);
+    const struct NgbCache * cache = (tw->ngbcache & TREEWALK_NGBCACHE_USE) ? tw->tree->NgbCache : NULL;
+
+    #pragma omp parallel num_threads(tw->NThread)
+    {
+        const int tid = omp_get_thread_num();
+        const int start = ((size_t) tid) * size / tw->NThread;
+        const int end = ((size_t) tid + 1) * size / tw->NThread;
+        int i, n = start;
+        for(i = start; i < end; i++) {
+            const int p_i = tw->WorkSet ? tw->WorkSet[i] : i;
+            if(ev_exports_early(tw, cache, p_i, leaves, nboundary))
+                order[n++] = p_i;
+        }
+        for(i = start; i < end; i++) {
+            const int p_i = tw->WorkSet ? tw->WorkSet[i] : i;
+            if(!ev_exports_early(tw, cache, p_i, leaves, nboundary))
+                order[n++] = p_i;
+        }
+    }
+    myfree(leaves);
+
+    if(tw->work_set_stolen_from_active) {
+        tw->WorkSet = order;
+        tw->work_set_stolen_from_active = 0;
+    } else {
+        memcpy(tw->WorkSet, order, size * sizeof(int));
+        myfree(order);
+    }
+}
+
 static void
 treewalk_build_queue(TreeWalk * tw, int * active_set, const int size, int may_have_garbage) {
     int i;
@@ -306,6 +867,8 @@ treewalk_build_queue(TreeWalk * tw, int * active_set, const int size, int may_ha
         tw->WorkSetSize = size;
         tw->WorkSet = active_set;
         tw->work_set_stolen_from_active = 1;
+        if(TreeWalkExportFirst && tw->NTask > 1 && tw->tree)
+            ev_order_export_first(tw);
         return;
     }
 
@@ -357,9 +920,60 @@ treewalk_build_queue(TreeWalk * tw, int * active_set, const int size, int may_ha
     }
 #endif
     tw->WorkSetSize = nqueue;
+    if(TreeWalkExportFirst && tw->NTask > 1 && tw->tree)
+        ev_order_export_first(tw);
 }
 
 /* returns number of exports */
+/* Group the DataIndexTable by target task, with the discarded exports (Task == NTask) at the end.
+ * This is a counting sort: each thread counts and then scatters its own contiguous part of the table,
+ * so every pass is threaded. The sort is stable, so the exports to each task keep the order
+ * in which they were found, which follows the tree.*/
+static void
+ev_sort_exports_by_task(TreeWalk * tw)
+{
+    const int NTask = tw->NTask;
+    const int Nexport = tw->Nexport;
+    const int NThread = omp_get_max_threads();
+    /* Start of each thread's part in each task, including the discarded exports */
+    int * offset = ta_malloc("ExportOffset", int, (NTask + 1) * NThread);
+    memset(offset, 0, (NTask + 1) * NThread * sizeof(int));
+    struct data_index * sorted = (struct data_index *) mymalloc("DataIndexSorted", Nexport * sizeof(struct data_index));
+
+#pragma omp parallel num_threads(NThread)
+    {
+        const int tid = omp_get_thread_num();
+        const int nthr = omp_get_num_threads();
+        const int start = ((int64_t) tid) * Nexport / nthr;
+        const int end = ((int64_t) tid + 1) * Nexport / nthr;
+        int * myoffset = offset + tid * (NTask + 1);
+        int i;
+        for(i = start; i < end; i++)
+            myoffset[DataIndexTable[i].Task]++;
+#pragma omp barrier
+        /* Turn the counts into offsets, ordered by task and then by thread*/
+#pragma omp single
+        {
+            int total = 0;
+            int task, t;
+            for(task = 0; task <= NTask; task++)
+                for(t = 0; t < nthr; t++) {
+                    const int count = offset[t * (NTask + 1) + task];
+                    offset[t * (NTask + 1) + task] = total;
+                    total += count;
+                }
+        }
+        for(i = start; i < end; i++)
+            sorted[myoffset[DataIndexTable[i].Task]++] = DataIndexTable[i];
+    }
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < Nexport; i++)
+        DataIndexTable[i] = sorted[i];
+    myfree(sorted);
+    ta_free(offset);
+}
+
 static int ev_primary(TreeWalk * tw)
 {
     const int NTask = tw->NTask;
@@ -373,9 +987,10 @@ static int ev_primary(TreeWalk * tw)
     ev_alloc_threadlocals(tw->NTask * tw->NThread);
 
     int nint = tw->Ninteractions;
-#pragma omp parallel reduction(+: nint)
+    double busy = 0;
+#pragma omp parallel reduction(+: nint) reduction(+: busy)
     {
-        real_ev(tw, &nint);
+        busy += real_ev(tw, &nint);
     }
     tw->Ninteractions = nint;
 
@@ -389,15 +1004,17 @@ static int ev_primary(TreeWalk * tw)
 
     tend = second();
     tw->timecomp1 += timediff(tstart, tend);
+    tw->timeidle1 += timediff(tstart, tend) - busy / tw->NThread;
 
-    qsort_openmp(DataIndexTable, tw->Nexport, sizeof(struct data_index), data_index_compare);
+    ev_sort_exports_by_task(tw);
 
     /* adjust Nexport to skip the allocated but unused ones due to threads */
     while (tw->Nexport > 0 && DataIndexTable[tw->Nexport - 1].Task == NTask) {
         tw->Nexport --;
     }
 
-    if(tw->BufferFullFlag) {
+    /* A buffer smaller than the free memory is grown before the next round, so only warn if memory is short.*/
+    if(tw->BufferFullFlag && tw->BunchSize == tw->MaxBunchSize) {
         message(1, "Tree export buffer full with %d particles. This is not fatal but slows the treewalk. Increase free memory during treewalk if possible.\n", tw->Nexport);
     }
 
@@ -419,8 +1036,19 @@ static int ev_primary(TreeWalk * tw)
         Send_count[DataIndexTable[i].Task]++;
     }
 
+    /* The pipelined exchange discovers the imports from the incoming messages,
+     * so we only need the send layout here.*/
+    if(TreeWalkPipeline) {
+        Send_offset[0] = 0;
+        for(i = 1; i < NTask; i++)
+            Send_offset[i] = Send_offset[i - 1] + Send_count[i - 1];
+        tw->Nimport = 0;
+        return tw->Nexport;
+    }
+
     tstart = second();
-    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+    /* Each treewalk exports only to the nearby domains, so only send the non-zero counts*/
+    MPI_Alltoall_sparse(Send_count, Recv_count, MPI_INT, MPI_COMM_WORLD);
     tend = second();
     tw->timewait1 += timediff(tstart, tend);
 
@@ -458,45 +1086,89 @@ static int ev_ndone(TreeWalk * tw)
 
 }
 
-static void ev_secondary(TreeWalk * tw)
+/* Evaluate the imported queries in dataget[start, start + nimport),
+ * storing the results in the same slots of dataresult.
+ * The thread local export arrays must already be allocated.
+ * Imports from one task are contiguous and roughly ordered along the tree, so a dynamic
+ * schedule with small chunks balances the threads without losing locality.*/
+static void
+ev_secondary_range(TreeWalk * tw, const int start, const int nimport)
 {
-    double tstart, tend;
-
-    tstart = second();
-    tw->dataresult = mymalloc("EvDataResult", tw->Nimport * tw->result_type_elsize);
-
-    ev_alloc_threadlocals(tw->NTask * tw->NThread);
-    int nint = tw->Ninteractions;
-    int nnodes = tw->Nnodesinlist;
-    int nlist = tw->Nlist;
-#pragma omp parallel reduction(+: nint) reduction(+: nnodes) reduction(+: nlist)
+    int64_t nint = tw->Ninteractions;
+    int64_t nnodes = tw->Nnodesinlist;
+    int64_t nlist = tw->Nlist;
+    double busy = 0;
+    const double tstart = second();
+#pragma omp parallel reduction(+: nint) reduction(+: nnodes) reduction(+: nlist) reduction(+: busy)
     {
         int j;
         LocalTreeWalk lv[1];
 
         ev_init_thread(tw, lv);
         lv->mode = 1;
-#pragma omp for
-        for(j = 0; j < tw->Nimport; j++) {
+#pragma omp for schedule(dynamic, TREEWALK_CHUNK) nowait
+        for(j = start; j < start + nimport; j++) {
             TreeWalkQueryBase * input = (TreeWalkQueryBase*) (tw->dataget + j * tw->query_type_elsize);
             TreeWalkResultBase * output = (TreeWalkResultBase*)(tw->dataresult + j * tw->result_type_elsize);
             treewalk_init_result(tw, output, input);
             lv->target = -1;
-            tw->visit(input, output, lv);
+            if(tw->MeasureWalkTime) {
+                const double tvisit = second();
+                tw->visit(input, output, lv);
+                output->WalkTime = timediff(tvisit, second());
+            }
+            else
+                tw->visit(input, output, lv);
         }
         nint += lv->Ninteractions;
         nnodes += lv->Nnodesinlist;
         nlist += lv->Nlist;
+        const double tend = second();
+        walltime_trace_event(tw->ev_label, "secondary_thread", tstart, tend);
+        busy += timediff(tstart, tend);
     }
     tw->Ninteractions = nint;
     tw->Nnodesinlist = nnodes;
     tw->Nlist = nlist;
+    tw->timeidle2 += timediff(tstart, second()) - busy / tw->NThread;
+}
+
+static void ev_secondary(TreeWalk * tw)
+{
+    double tstart, tend;
+
+    tstart = second();
+    if(TreeWalkSharedMemory)
+        tw->dataresult = ev_alloc_shared(&ResultWin, Recv_offset, tw->Nimport * tw->result_type_elsize, tw->NTask);
+    else
+        tw->dataresult = hbmalloc("EvDataResult", tw->Nimport * tw->result_type_elsize);
 
+    ev_alloc_threadlocals(tw->NTask * tw->NThread);
+    ev_secondary_range(tw, 0, tw->Nimport);
     ev_free_threadlocals();
     tend = second();
     tw->timecomp2 += timediff(tstart, tend);
 }
 
+/* Touch up the DataIndexTable, so that exports associated with the target particle
+ * won't be exported. This is expensive but rare. */
+static void
+ev_discard_exports(TreeWalk * tw, const int target)
+{
+    int i;
+    for(i=0; i < tw->BunchSize; i++) {
+        /* This reads the buffer looking for exports associated with the target
+         * particle. We cannot just discard from the end because of threading.*/
+        if(DataIndexTable[i].Index == target)
+        {
+            /* NTask will be placed to the end by sorting */
+            DataIndexTable[i].Task = tw->NTask;
+            /* put in some junk so that we can detect them */
+            DataNodeList[DataIndexTable[i].IndexGet].NodeList[0] = -2;
+        }
+    }
+}
+
 /* export a particle at target and no, thread safely
  *
  * This can also be called from a nonthreaded code
@@ -517,10 +1189,10 @@ int treewalk_export_particle(LocalTreeWalk * lv, int no) {
     if(exportflag[task] != target)
     {
         exportflag[task] = target;
-        exportnodecount[task] = NODELISTLENGTH;
+        exportnodecount[task] = TREEWALK_EXPORT_NODES;
     }
 
-    if(exportnodecount[task] == NODELISTLENGTH)
+    if(exportnodecount[task] == TREEWALK_EXPORT_NODES)
     {
         const int nexp = atomic_fetch_and_add(&tw->Nexport, 1);
 
@@ -530,21 +1202,7 @@ int treewalk_export_particle(LocalTreeWalk * lv, int no) {
             /* This reduces the time until the other threads see the buffer is full and the loop can exit.
              * Since it is a pure optimization, no need for a full atomic.*/
             #pragma omp flush (tw)
-            /* Touch up the DataIndexTable, so that exports associated with the current particle
-             * won't be exported. This is expensive but rare. */
-            int i;
-            for(i=0; i < tw->BunchSize; i++) {
-                /* target is the current particle, so this reads the buffer looking for
-                 * exports associated with the current particle. We cannot just discard
-                 * from the end because of threading.*/
-                if(DataIndexTable[i].Index == target)
-                {
-                    /* NTask will be placed to the end by sorting */
-                    DataIndexTable[i].Task = tw->NTask;
-                    /* put in some junk so that we can detect them */
-                    DataNodeList[DataIndexTable[i].IndexGet].NodeList[0] = -2;
-                }
-            }
+            ev_discard_exports(tw, target);
             return -1;
         }
         else {
@@ -556,15 +1214,30 @@ int treewalk_export_particle(LocalTreeWalk * lv, int no) {
         }
     }
 
+    lv->Nexported++;
     /* Set the NodeList entry*/
     DataNodeList[exportindex[task]].NodeList[exportnodecount[task]++] =
             tw->tree->TopLeaves[no - tw->tree->lastnode].treenode;
 
-    if(exportnodecount[task] < NODELISTLENGTH)
+    if(exportnodecount[task] < TREEWALK_EXPORT_NODES)
             DataNodeList[exportindex[task]].NodeList[exportnodecount[task]] = -1;
     return 0;
 }
 
+int
+treewalk_export_group(LocalTreeWalk * lv, const int ngroup, const int * nodes, const int nnodes)
+{
+    int m, k;
+    for(m = 0; m < ngroup; m++) {
+        lv->target = lv->targets[m];
+        for(k = 0; k < nnodes; k++)
+            if(-1 == treewalk_export_particle(lv, nodes[k]))
+                return -1;
+    }
+    lv->target = lv->targets[0];
+    return 0;
+}
+
 /* run a treewalk on an active_set.
  *
  * active_set : a list of indices of particles. If active_set is NULL,
@@ -580,6 +1253,10 @@ treewalk_run(TreeWalk * tw, int * active_set, int size)
 
     GDB_current_ev = tw;
 
+    const double trunstart = second();
+    struct treewalk_counters counters;
+    ev_save_counters(tw, &counters);
+
     ev_begin(tw, active_set, size);
 
     if(tw->preprocess) {
@@ -594,19 +1271,50 @@ treewalk_run(TreeWalk * tw, int * active_set, int size)
     if(tw->visit) {
         do
         {
+            /* The predicted export buffer was too small: use all the free memory.
+             * All exports of the last round are done, so nothing in the buffer is needed.*/
+            if(tw->BufferFullFlag && tw->BunchSize < tw->MaxBunchSize) {
+                myfree(DataNodeList);
+                myfree(DataIndexTable);
+                tw->BunchSize = tw->MaxBunchSize;
+                ev_alloc_export_buffer(tw);
+            }
+            /* Phase boundaries for the event trace, if enabled*/
+            double tphase = second(), tnext;
             ev_primary(tw); /* do local particles and prepare export list */
-            /* exchange particle data */
-            ev_get_remote(tw);
-            /* now do the particles that were sent to us */
-            ev_secondary(tw);
-
-            /* import the result to local particles */
-            ev_reduce_result(tw);
+            tnext = second();
+            walltime_trace_event(tw->ev_label, "ev_primary", tphase, tnext);
+            tphase = tnext;
+            if(TreeWalkPipeline) {
+                /* exchange particle data, evaluating imports as they arrive, and reduce the results */
+                ev_pipelined_exchange(tw);
+                walltime_trace_event(tw->ev_label, "ev_pipelined_exchange", tphase, second());
+            }
+            else {
+                /* exchange particle data */
+                ev_get_remote(tw);
+                tnext = second();
+                walltime_trace_event(tw->ev_label, "ev_get_remote", tphase, tnext);
+                tphase = tnext;
+                /* now do the particles that were sent to us */
+                ev_secondary(tw);
+                tnext = second();
+                walltime_trace_event(tw->ev_label, "ev_secondary", tphase, tnext);
+                tphase = tnext;
+
+                /* import the result to local particles */
+                ev_reduce_result(tw);
+                walltime_trace_event(tw->ev_label, "ev_reduce_result", tphase, second());
+            }
 
             tw->Niterations ++;
             tw->Nexport_sum += tw->Nexport;
             ta_free(Send_count);
         } while(ev_ndone(tw) < tw->NTask);
+
+        struct export_history * hist = ev_find_history(tw->ev_label);
+        if(hist)
+            hist->ExportPerWork = (double) tw->Nexport_sum / DMAX(tw->WorkSetSize, 1);
     }
 
 #ifdef DEBUG
@@ -630,136 +1338,574 @@ treewalk_run(TreeWalk * tw, int * active_set, int size)
     tend = second();
     tw->timecomp3 = timediff(tstart, tend);
     ev_finish(tw);
+
+    if(strlen(TreeWalkStatsFile) > 0)
+        ev_write_stats(tw, &counters, timediff(trunstart, second()));
 }
 
 static void
-ev_communicate(void * sendbuf, void * recvbuf, size_t elsize, int import) {
-    /* if import is 1, import the results from neigbhours */
+ev_communicate(void * sendbuf, void * recvbuf, size_t elsize) {
     MPI_Datatype type;
     MPI_Type_contiguous(elsize, MPI_BYTE, &type);
     MPI_Type_commit(&type);
 
-    if(import) {
-        MPI_Alltoallv_sparse(
-                sendbuf, Recv_count, Recv_offset, type,
-                recvbuf, Send_count, Send_offset, type, MPI_COMM_WORLD);
-    } else {
-        MPI_Alltoallv_sparse(
-                sendbuf, Send_count, Send_offset, type,
-                recvbuf, Recv_count, Recv_offset, type, MPI_COMM_WORLD);
-    }
+    /* Tasks on this node have already been copied through the shared windows*/
+    int * sendcount = TreeWalkSharedMemory ? Send_count_remote : Send_count;
+    int * recvcount = TreeWalkSharedMemory ? Recv_count_remote : Recv_count;
+
+    MPI_Alltoallv_sparse(
+            sendbuf, sendcount, Send_offset, type,
+            recvbuf, recvcount, Recv_offset, type, MPI_COMM_WORLD);
     MPI_Type_free(&type);
 }
 
-/* returns the remote particles */
-static void ev_get_remote(TreeWalk * tw)
+/* Size of the offset table at the start of a shared window, padded to a cache line*/
+static size_t
+ev_shared_header(const int NTask)
 {
-    int j;
-    double tstart, tend;
-
-    void * recvbuf = mymalloc("EvDataGet", tw->Nimport * tw->query_type_elsize);
-    char * sendbuf = mymalloc("EvDataIn", tw->Nexport * tw->query_type_elsize);
+    return ((NTask * sizeof(int) + 63) / 64) * 64;
+}
+
+/* Find the node rank of every task and the counts for the MPI exchange,
+ * which skips the tasks on this node.*/
+static void
+ev_begin_shared(TreeWalk * tw)
+{
+    const int NTask = tw->NTask;
+    if(NodeComm == MPI_COMM_NULL)
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &NodeComm);
+
+    NodeRank = ta_malloc("NodeRank", int, 3 * NTask);
+    Send_count_remote = NodeRank + NTask;
+    Recv_count_remote = NodeRank + 2 * NTask;
+
+    MPI_Group worldgroup, nodegroup;
+    MPI_Comm_group(MPI_COMM_WORLD, &worldgroup);
+    MPI_Comm_group(NodeComm, &nodegroup);
+    int i;
+    for(i = 0; i < NTask; i++)
+        Send_count_remote[i] = i;
+    MPI_Group_translate_ranks(worldgroup, NTask, Send_count_remote, nodegroup, NodeRank);
+    MPI_Group_free(&nodegroup);
+    MPI_Group_free(&worldgroup);
+
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    for(i = 0; i < NTask; i++) {
+        if(NodeRank[i] == MPI_UNDEFINED || i == ThisTask)
+            NodeRank[i] = -1;
+        Send_count_remote[i] = NodeRank[i] >= 0 ? 0 : Send_count[i];
+        Recv_count_remote[i] = NodeRank[i] >= 0 ? 0 : Recv_count[i];
+    }
+}
+
+/* Allocate a shared window for size bytes of data, preceded by the offset table of the owner.
+ * Returns the start of the data.*/
+static char *
+ev_alloc_shared(MPI_Win * win, const int * offset, const size_t size, const int NTask)
+{
+    const size_t header = ev_shared_header(NTask);
+    char * base;
+    MPI_Win_allocate_shared(header + size, 1, MPI_INFO_NULL, NodeComm, &base, win);
+    memcpy(base, offset, NTask * sizeof(int));
+    return base + header;
+}
+
+/* Copy elements directly from the shared window of each task on this node.
+ * The owner of the window placed the count[t] elements for us at its own offset table entry for us,
+ * and they go to offset[t] in dest. The window must have been synchronised with MPI_Win_fence.*/
+static void
+ev_copy_from_shared(MPI_Win win, char * dest, const int * count, const int * offset, const size_t elsize, const int NTask)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const size_t header = ev_shared_header(NTask);
+    int t;
+    for(t = 0; t < NTask; t++) {
+        if(NodeRank[t] < 0 || count[t] == 0)
+            continue;
+        MPI_Aint segsize;
+        int disp;
+        char * peerbase;
+        MPI_Win_shared_query(win, NodeRank[t], &segsize, &disp, &peerbase);
+        const int peeroffset = ((int *) peerbase)[ThisTask];
+        memcpy(dest + offset[t] * elsize, peerbase + header + peeroffset * elsize, count[t] * elsize);
+    }
+}
+
+/* Exports are sent packed: the ID, the TREEWALK_EXPORT_NODES long node list, the position,
+ * and then the part of the query the evaluator added to TreeWalkQueryBase.
+ * With TreeWalkExportFloatPos the position is a float offset from the center of the first
+ * node in the list, which all tasks know, and so is accurate to a fraction FLT_EPSILON of the node size.*/
+static size_t
+ev_packed_query_size(const TreeWalk * tw)
+{
+    const size_t possize = 3 * (TreeWalkExportFloatPos ? sizeof(float) : sizeof(double));
+    return sizeof(MyIDType) + TREEWALK_EXPORT_NODES * sizeof(int) + possize
+        + tw->query_type_elsize - sizeof(TreeWalkQueryBase);
+}
+
+static void
+ev_pack_query(const TreeWalk * tw, char * packed, const TreeWalkQueryBase * query, const int * nodelist)
+{
+    memcpy(packed, &query->ID, sizeof(MyIDType));
+    packed += sizeof(MyIDType);
+    memcpy(packed, nodelist, TREEWALK_EXPORT_NODES * sizeof(int));
+    packed += TREEWALK_EXPORT_NODES * sizeof(int);
+    if(TreeWalkExportFloatPos) {
+        const struct NODE * node = &tw->tree->Nodes[nodelist[0]];
+        float dpos[3];
+        int d;
+        for(d = 0; d < 3; d++)
+            dpos[d] = NEAREST(query->Pos[d] - node->center[d], tw->tree->BoxSize);
+        memcpy(packed, dpos, sizeof(dpos));
+        packed += sizeof(dpos);
+    }
+    else {
+        memcpy(packed, query->Pos, 3 * sizeof(double));
+        packed += 3 * sizeof(double);
+    }
+    memcpy(packed, (const char *) query + sizeof(TreeWalkQueryBase), tw->query_type_elsize - sizeof(TreeWalkQueryBase));
+}
+
+static void
+ev_unpack_query(const TreeWalk * tw, TreeWalkQueryBase * query, const char * packed)
+{
+    memcpy(&query->ID, packed, sizeof(MyIDType));
+    packed += sizeof(MyIDType);
+    memcpy(query->NodeList, packed, TREEWALK_EXPORT_NODES * sizeof(int));
+    packed += TREEWALK_EXPORT_NODES * sizeof(int);
+    if(TREEWALK_EXPORT_NODES < NODELISTLENGTH)
+        query->NodeList[TREEWALK_EXPORT_NODES] = -1;
+    if(TreeWalkExportFloatPos) {
+        const struct NODE * node = &tw->tree->Nodes[query->NodeList[0]];
+        const double BoxSize = tw->tree->BoxSize;
+        float dpos[3];
+        memcpy(dpos, packed, sizeof(dpos));
+        packed += sizeof(dpos);
+        int d;
+        for(d = 0; d < 3; d++) {
+            query->Pos[d] = node->center[d] + dpos[d];
+            while(query->Pos[d] < 0)
+                query->Pos[d] += BoxSize;
+            while(query->Pos[d] >= BoxSize)
+                query->Pos[d] -= BoxSize;
+        }
+    }
+    else {
+        memcpy(query->Pos, packed, 3 * sizeof(double));
+        packed += 3 * sizeof(double);
+    }
+    memcpy((char *) query + sizeof(TreeWalkQueryBase), packed, tw->query_type_elsize - sizeof(TreeWalkQueryBase));
+}
+
+/* prepare particle data for export */
+static void
+ev_pack_exports(TreeWalk * tw, char * sendbuf)
+{
+    const size_t packedsize = ev_packed_query_size(tw);
+#pragma omp parallel
+    {
+        int j;
+        TreeWalkQueryBase * input = alloca(tw->query_type_elsize);
+#pragma omp for
+        for(j = 0; j < tw->Nexport; j++)
+        {
+            int place = DataIndexTable[j].Index;
+            int * nodelist = DataNodeList[DataIndexTable[j].IndexGet].NodeList;
+            treewalk_init_query(tw, input, place);
+            ev_pack_query(tw, sendbuf + j * packedsize, input, nodelist);
+        }
+    }
+}
+
+/* Unpack nimport received queries into dataget, starting at start*/
+static void
+ev_unpack_imports(TreeWalk * tw, const char * recvbuf, const int start, const int nimport)
+{
+    const size_t packedsize = ev_packed_query_size(tw);
+    int j;
+#pragma omp parallel for
+    for(j = 0; j < nimport; j++) {
+        TreeWalkQueryBase * input = (TreeWalkQueryBase*) (tw->dataget + (start + j) * tw->query_type_elsize);
+        ev_unpack_query(tw, input, recvbuf + j * packedsize);
+    }
+}
+
+/* returns the remote particles */
+static void ev_get_remote(TreeWalk * tw)
+{
+    double tstart, tend;
+    const size_t packedsize = ev_packed_query_size(tw);
+
+    tw->dataget = hbmalloc("EvDataGet", tw->Nimport * tw->query_type_elsize);
+    char * recvbuf = mymalloc("EvDataGetPacked", tw->Nimport * packedsize);
+    char * sendbuf;
+    /* With shared memory the exports are packed straight into a window the other ranks on the node can read*/
+    if(TreeWalkSharedMemory) {
+        ev_begin_shared(tw);
+        sendbuf = ev_alloc_shared(&QueryWin, Send_offset, tw->Nexport * packedsize, tw->NTask);
+    }
+    else
+        sendbuf = mymalloc("EvDataIn", tw->Nexport * packedsize);
 
 #ifdef DEBUG
-    memset(sendbuf, -1, tw->Nexport * tw->query_type_elsize);
+    memset(sendbuf, -1, tw->Nexport * packedsize);
 #endif
 
     tstart = second();
-    /* prepare particle data for export */
-    //
-#pragma omp parallel for
-    for(j = 0; j < tw->Nexport; j++)
-    {
-        int place = DataIndexTable[j].Index;
-        TreeWalkQueryBase * input = (TreeWalkQueryBase*) (sendbuf + j * tw->query_type_elsize);
-        int * nodelist = DataNodeList[DataIndexTable[j].IndexGet].NodeList;
-        treewalk_init_query(tw, input, place, nodelist);
-    }
+    ev_pack_exports(tw, sendbuf);
     tend = second();
     tw->timecomp1 += timediff(tstart, tend);
 
     tstart = second();
-    ev_communicate(sendbuf, recvbuf, tw->query_type_elsize, 0);
+    if(TreeWalkSharedMemory) {
+        MPI_Win_fence(0, QueryWin);
+        ev_copy_from_shared(QueryWin, recvbuf, Recv_count, Recv_offset, packedsize, tw->NTask);
+    }
+    ev_communicate(sendbuf, recvbuf, packedsize);
     tend = second();
     tw->timecommsumm1 += timediff(tstart, tend);
-    myfree(sendbuf);
-    tw->dataget = recvbuf;
+    if(TreeWalkSharedMemory) {
+        /* Wait until the other ranks have read our exports*/
+        MPI_Win_fence(0, QueryWin);
+        MPI_Win_free(&QueryWin);
+    }
+    else
+        myfree(sendbuf);
+
+    tstart = second();
+    ev_unpack_imports(tw, recvbuf, 0, tw->Nimport);
+    tend = second();
+    tw->timecomp2 += timediff(tstart, tend);
+    myfree(recvbuf);
 }
 
-static int data_index_compare_by_index(const void *a, const void *b)
+/* Move the results of a block of n imports which contribute something to the front of the block,
+ * and replace their ID with their position in the block. This is also the position of the query
+ * in the exports of the task which sent the block, so it can find the target particle.
+ * A result which is still zero after the base, as set by treewalk_init_result, is dropped.
+ * This is only correct because every reduce function is required to do nothing with such a
+ * result in TREEWALK_GHOSTS mode (see TreeWalk::reduce): a sum is fine, but a reduce which
+ * assigns, counts results, or takes a minimum against zero would be silently skipped here.
+ * Returns the number of results to send back.*/
+static int
+ev_compact_results(TreeWalk * tw, char * block, const int n)
 {
-    if(((struct data_index *) a)->Index < (((struct data_index *) b)->Index))
-        return -1;
-
-    if(((struct data_index *) a)->Index > (((struct data_index *) b)->Index))
-        return +1;
+    const size_t elsize = tw->result_type_elsize;
+    const size_t base = sizeof(TreeWalkResultBase);
+    int j, nreturn = 0;
+    for(j = 0; j < n; j++) {
+        char * result = block + j * elsize;
+        size_t b;
+        for(b = base; b < elsize; b++)
+            if(result[b])
+                break;
+        if(b == elsize)
+            continue;
+        ((TreeWalkResultBase *) result)->ID = j;
+        if(nreturn != j)
+            memcpy(block + nreturn * elsize, result, elsize);
+        nreturn++;
+    }
+    return nreturn;
+}
 
-    if(((struct data_index *) a)->IndexGet < (((struct data_index *) b)->IndexGet))
-        return -1;
+/* Reduce the results of our exported particles to the local particles.
+ * The count[task] results of each task are at the start of its block of recvbuf,
+ * compacted by ev_compact_results. The results are bucketed by ranges of target particles
+ * with a counting sort, and each bucket is reduced by one thread, so no particle is
+ * reduced by two threads at once and each result is visited once.*/
+static void
+ev_reduce_export_result(TreeWalk * tw, char * recvbuf, const int * count)
+{
+    if(tw->reduce == NULL)
+        return;
 
-    if(((struct data_index *) a)->IndexGet > (((struct data_index *) b)->IndexGet))
-        return +1;
+    const size_t elsize = tw->result_type_elsize;
+    int task, nresult = 0;
+    for(task = 0; task < tw->NTask; task++)
+        nresult += count[task];
+
+    const int NumPart = PartManager->NumPart;
+    const int nbucket = omp_get_max_threads();
+    /* Number of results, then offset, of each bucket*/
+    int * BucketOffset = ta_malloc("ReduceBucketOffset", int, nbucket + 1);
+    memset(BucketOffset, 0, (nbucket + 1) * sizeof(int));
+    for(task = 0; task < tw->NTask; task++) {
+        char * block = recvbuf + Send_offset[task] * elsize;
+        int k;
+        for(k = 0; k < count[task]; k++) {
+            const int place = DataIndexTable[Send_offset[task] + ((TreeWalkResultBase *) (block + k * elsize))->ID].Index;
+            BucketOffset[(int64_t) place * nbucket / NumPart + 1]++;
+        }
+    }
+    int b;
+    for(b = 0; b < nbucket; b++)
+        BucketOffset[b + 1] += BucketOffset[b];
+
+    /* The results and target particles, sorted by bucket. Stable, so each particle still
+     * reduces its results in the order of DataIndexTable.*/
+    TreeWalkResultBase ** Result = (TreeWalkResultBase **) mymalloc("ReduceResult", nresult * sizeof(TreeWalkResultBase *));
+    int * Place = (int *) mymalloc("ReducePlace", nresult * sizeof(int));
+    int * BucketNext = ta_malloc("ReduceBucketNext", int, nbucket);
+    memcpy(BucketNext, BucketOffset, nbucket * sizeof(int));
+    for(task = 0; task < tw->NTask; task++) {
+        char * block = recvbuf + Send_offset[task] * elsize;
+        int k;
+        for(k = 0; k < count[task]; k++) {
+            TreeWalkResultBase * result = (TreeWalkResultBase *) (block + k * elsize);
+            const int place = DataIndexTable[Send_offset[task] + result->ID].Index;
+            const int j = BucketNext[(int64_t) place * nbucket / NumPart]++;
+            Result[j] = result;
+            Place[j] = place;
+        }
+    }
 
-    return 0;
+#pragma omp parallel for schedule(static, 1) if(nresult > 16)
+    for(b = 0; b < nbucket; b++) {
+        int j;
+        for(j = BucketOffset[b]; j < BucketOffset[b + 1]; j++)
+            treewalk_reduce_result(tw, Result[j], Place[j], TREEWALK_GHOSTS);
+    }
+    myfree(Place);
+    myfree(Result);
+    ta_free(BucketNext);
+    ta_free(BucketOffset);
 }
 
 static void ev_reduce_result(TreeWalk * tw)
 {
-
-    int j;
     double tstart, tend;
+    const int NTask = tw->NTask;
 
     const int Nexport = tw->Nexport;
-    void * sendbuf = tw->dataresult;
+    char * sendbuf = tw->dataresult;
     char * recvbuf = (char*) mymalloc("EvDataOut",
                 Nexport * tw->result_type_elsize);
 
+    /* Only return the results which contribute something*/
+    int * Return_count = ta_malloc("Return_count", int, 2 * NTask);
+    int * Reduce_count = Return_count + NTask;
+    int i;
     tstart = second();
-    ev_communicate(sendbuf, recvbuf, tw->result_type_elsize, 1);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(i = 0; i < NTask; i++) {
+        char * block = sendbuf + Recv_offset[i] * tw->result_type_elsize;
+        if(TreeWalkSharedMemory && NodeRank[i] >= 0) {
+            /* Tasks on this node copy their whole block from our shared window*/
+            int j;
+            for(j = 0; j < Recv_count[i]; j++)
+                ((TreeWalkResultBase *) (block + j * tw->result_type_elsize))->ID = j;
+            Return_count[i] = 0;
+        }
+        else
+            Return_count[i] = ev_compact_results(tw, block, Recv_count[i]);
+    }
     tend = second();
-    tw->timecommsumm2 += timediff(tstart, tend);
+    tw->timecomp2 += timediff(tstart, tend);
 
     tstart = second();
+    MPI_Alltoall_sparse(Return_count, Reduce_count, MPI_INT, MPI_COMM_WORLD);
+    MPI_Datatype type;
+    MPI_Type_contiguous(tw->result_type_elsize, MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+    MPI_Alltoallv_sparse(sendbuf, Return_count, Recv_offset, type,
+            recvbuf, Reduce_count, Send_offset, type, MPI_COMM_WORLD);
+    MPI_Type_free(&type);
+    if(TreeWalkSharedMemory) {
+        MPI_Win_fence(0, ResultWin);
+        ev_copy_from_shared(ResultWin, recvbuf, Send_count, Send_offset, tw->result_type_elsize, NTask);
+        for(i = 0; i < NTask; i++)
+            if(NodeRank[i] >= 0)
+                Reduce_count[i] = Send_count[i];
+    }
+    tend = second();
+    tw->timecommsumm2 += timediff(tstart, tend);
 
-    for(j = 0; j < Nexport; j++) {
-        DataIndexTable[j].IndexGet = j;
+    tstart = second();
+    ev_reduce_export_result(tw, recvbuf, Reduce_count);
+    tend = second();
+    tw->timecomp1 += timediff(tstart, tend);
+    ta_free(Return_count);
+    myfree(recvbuf);
+    if(TreeWalkSharedMemory) {
+        MPI_Win_fence(0, ResultWin);
+        MPI_Win_free(&ResultWin);
+        ta_free(NodeRank);
     }
+    else
+        myfree(tw->dataresult);
+    myfree(tw->dataget);
+}
 
-    /* mysort is a lie! */
-    qsort_openmp(DataIndexTable, Nexport, sizeof(struct data_index), data_index_compare_by_index);
+/* Pipelined replacement for ev_get_remote, ev_secondary and ev_reduce_result.
+ *
+ * There is no MPI_Alltoall of the export counts. The exports for each task
+ * are sent with a synchronous non-blocking send as soon as they are packed.
+ * Imported queries are received as they arrive, evaluated at once and the
+ * results sent straight back, so a rank only waits on the ranks it talks to.
+ * Termination is the non-blocking consensus of Hoefler, Siebert & Lumsdaine 2010:
+ * once all our sends have been matched we enter a non-blocking barrier,
+ * and keep serving imports until the barrier completes.
+ *
+ * The import buffer uses the remaining free memory. If it fills up, we wait
+ * for the results already sent back and reuse it. This cannot deadlock because
+ * every rank posts its result receives before sending any query.
+ */
+static void
+ev_pipelined_exchange(TreeWalk * tw)
+{
+    const int NTask = tw->NTask;
+    const int querytag = 1024 + 2 * (PipelineRound % 8192);
+    const int resulttag = querytag + 1;
+    double tstart, tend;
+    int i;
+
+    PipelineRound++;
+
+    const size_t packedsize = ev_packed_query_size(tw);
+    MPI_Datatype querytype, resulttype;
+    MPI_Type_contiguous(packedsize, MPI_BYTE, &querytype);
+    MPI_Type_commit(&querytype);
+    MPI_Type_contiguous(tw->result_type_elsize, MPI_BYTE, &resulttype);
+    MPI_Type_commit(&resulttype);
+
+    char * sendbuf = mymalloc("EvDataIn", tw->Nexport * packedsize);
+    char * recvbuf = mymalloc("EvDataOut", tw->Nexport * tw->result_type_elsize);
+
+    tstart = second();
+    ev_pack_exports(tw, sendbuf);
+    tend = second();
+    tw->timecomp1 += timediff(tstart, tend);
 
-    int * UniqueOff = mymalloc("UniqueIndex", sizeof(int) * (Nexport + 1));
-    UniqueOff[0] = 0;
-    int Nunique = 0;
+    /* One query send and one result receive for each task we export to,
+     * and at most one result send for each task which exports to us.*/
+    MPI_Request * queryreq = ta_malloc("QueryRequests", MPI_Request, 3 * NTask);
+    MPI_Request * resultrecvreq = queryreq + NTask;
+    MPI_Request * resultsendreq = queryreq + 2 * NTask;
+    /* The task of each result receive, and the number of results it returned*/
+    MPI_Status * resultstatus = ta_malloc("ResultStatus", MPI_Status, NTask);
+    int * resulttask = ta_malloc("ResultTask", int, 2 * NTask);
+    int * Reduce_count = resulttask + NTask;
+    memset(Reduce_count, 0, NTask * sizeof(int));
+    int nquery = 0, nresultsend = 0;
 
-    for(j = 1; j < Nexport; j++) {
-        if(DataIndexTable[j].Index != DataIndexTable[j-1].Index)
-            UniqueOff[++Nunique] = j;
+    tstart = second();
+    for(i = 0; i < NTask; i++) {
+        if(Send_count[i] == 0)
+            continue;
+        MPI_Irecv(recvbuf + Send_offset[i] * tw->result_type_elsize, Send_count[i], resulttype,
+                i, resulttag, MPI_COMM_WORLD, &resultrecvreq[nquery]);
+        MPI_Issend(sendbuf + Send_offset[i] * packedsize, Send_count[i], querytype,
+                i, querytag, MPI_COMM_WORLD, &queryreq[nquery]);
+        resulttask[nquery] = i;
+        nquery++;
     }
-    if(Nexport > 0)
-        UniqueOff[++Nunique] = Nexport;
+    tend = second();
+    tw->timecommsumm1 += timediff(tstart, tend);
 
-    if(tw->reduce != NULL) {
-#pragma omp parallel for private(j) if(Nunique > 16)
-        for(j = 0; j < Nunique; j++)
-        {
-            int k;
-            int place = DataIndexTable[UniqueOff[j]].Index;
-            int start = UniqueOff[j];
-            int end = UniqueOff[j + 1];
-            for(k = start; k < end; k++) {
-                int get = DataIndexTable[k].IndexGet;
-                TreeWalkResultBase * output = (TreeWalkResultBase*) (recvbuf + tw->result_type_elsize * get);
-                treewalk_reduce_result(tw, output, place, TREEWALK_GHOSTS);
+    /* Use the remaining memory for the imports, leaving the same slack as ev_begin.*/
+    const size_t importelsize = tw->query_type_elsize + tw->result_type_elsize + packedsize;
+    size_t freebytes = mymalloc_freebytes();
+    if(freebytes > 1024 * 1024 * 1024) freebytes = 1024 * 1024 * 1024;
+    const int capacity = (int) floor(((double) freebytes - 4096 * 10) / importelsize);
+    if(capacity <= 0)
+        endrun(1231246, "Not enough memory for importing any particles: needed %lu bytes have %lu.\n", importelsize, freebytes);
+
+    tw->dataget = hbmalloc("EvDataGet", capacity * tw->query_type_elsize);
+    tw->dataresult = hbmalloc("EvDataResult", capacity * tw->result_type_elsize);
+    char * packedget = mymalloc("EvDataGetPacked", capacity * packedsize);
+
+    ev_alloc_threadlocals(tw->NTask * tw->NThread);
+
+    int used = 0;
+    int barrier_active = 0;
+    int done = 0;
+    MPI_Request barrier;
+
+    while(!done) {
+        int flag;
+        MPI_Status status;
+        tstart = second();
+        MPI_Iprobe(MPI_ANY_SOURCE, querytag, MPI_COMM_WORLD, &flag, &status);
+        if(flag) {
+            int nimport;
+            MPI_Get_count(&status, querytype, &nimport);
+            if(used + nimport > capacity) {
+                /* Recycle the import buffer once the results we sent have been received.*/
+                MPI_Waitall(nresultsend, resultsendreq, MPI_STATUSES_IGNORE);
+                nresultsend = 0;
+                used = 0;
+                if(nimport > capacity)
+                    endrun(1231247, "Import of %d particles from task %d does not fit in buffer of %d. Free some memory during treewalk.\n",
+                            nimport, status.MPI_SOURCE, capacity);
+            }
+            MPI_Recv(packedget + used * packedsize, nimport, querytype,
+                    status.MPI_SOURCE, querytag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            tend = second();
+            tw->timecommsumm1 += timediff(tstart, tend);
+
+            tstart = second();
+            ev_unpack_imports(tw, packedget + used * packedsize, used, nimport);
+            ev_secondary_range(tw, used, nimport);
+            tend = second();
+            tw->timecomp2 += timediff(tstart, tend);
+
+            tstart = second();
+            char * results = tw->dataresult + used * tw->result_type_elsize;
+            const int nreturn = ev_compact_results(tw, results, nimport);
+            MPI_Isend(results, nreturn, resulttype,
+                    status.MPI_SOURCE, resulttag, MPI_COMM_WORLD, &resultsendreq[nresultsend++]);
+            tend = second();
+            tw->timecommsumm2 += timediff(tstart, tend);
+
+            used += nimport;
+            tw->Nimport += nimport;
+            continue;
+        }
+        if(!barrier_active) {
+            int sent;
+            MPI_Testall(nquery, queryreq, &sent, MPI_STATUSES_IGNORE);
+            if(sent) {
+                MPI_Ibarrier(MPI_COMM_WORLD, &barrier);
+                barrier_active = 1;
             }
         }
+        else
+            MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+        tend = second();
+        tw->timewait1 += timediff(tstart, tend);
     }
-    myfree(UniqueOff);
+
+    ev_free_threadlocals();
+
+    tstart = second();
+    MPI_Waitall(nresultsend, resultsendreq, MPI_STATUSES_IGNORE);
+    MPI_Waitall(nquery, resultrecvreq, resultstatus);
+    tend = second();
+    tw->timewait2 += timediff(tstart, tend);
+
+    /* Only the results which contribute something were returned*/
+    for(i = 0; i < nquery; i++)
+        MPI_Get_count(&resultstatus[i], resulttype, &Reduce_count[resulttask[i]]);
+
+    MPI_Type_free(&querytype);
+    MPI_Type_free(&resulttype);
+
+    tstart = second();
+    ev_reduce_export_result(tw, recvbuf, Reduce_count);
     tend = second();
     tw->timecomp1 += timediff(tstart, tend);
-    myfree(recvbuf);
+    ta_free(resulttask);
+    ta_free(resultstatus);
+    ta_free(queryreq);
+
+    myfree(packedget);
     myfree(tw->dataresult);
     myfree(tw->dataget);
+    myfree(recvbuf);
+    myfree(sendbuf);
 }
 
 #if 0
@@ -816,84 +1962,166 @@ static void fill_task_queue (TreeWalk * tw, struct ev_task * tq, int * pq, int l
  * Before the iteration starts, ngbiter is called with iter->base.other == -1.
  * The callback function shall initialize the interator with Hsml, mask, and symmetric.
  *
+ * The loop itself is in treewalk_ngbiter.h. A module may use TREEWALK_DEFINE_NGBITER_VISIT
+ * to define a copy of this function which calls its own ngbiter directly.
+ *
  *****/
 int treewalk_visit_ngbiter(TreeWalkQueryBase * I,
             TreeWalkResultBase * O,
             LocalTreeWalk * lv)
 {
-
     TreeWalkNgbIterBase * iter = alloca(lv->tw->ngbiter_type_elsize);
+    return treewalk_visit_ngbiter_with(I, O, iter, lv, lv->tw->ngbiter);
+}
 
-    /* Kick-start the iteration with other == -1 */
-    iter->other = -1;
-    lv->tw->ngbiter(I, O, iter, lv);
-    const double BoxSize = lv->tw->tree->BoxSize;
-
-    int ninteractions = 0;
-    int inode = 0;
-
-    for(inode = 0; inode < NODELISTLENGTH && I->NodeList[inode] >= 0; inode++)
-    {
-        int startnode = lv->tw->tree->Nodes[I->NodeList[inode]].u.d.nextnode;  /* open it */
-
-        int numcand = ngb_treefind_threads(I, O, iter, startnode, lv);
-        /* Export buffer is full end prematurally */
-        if(numcand < 0) return numcand;
-
-        /* If we are here, export is succesful. Work on the this particle -- first
-         * filter out all of the candidates that are actually outside. */
-        int numngb;
-
-        for(numngb = 0; numngb < numcand; numngb ++) {
-            int other = lv->ngblist[numngb];
-
-            /* skip garbage */
-            if(P[other].IsGarbage) continue;
-
-            /* must be the correct type */
-            if(!((1<<P[other].Type) & iter->mask))
-                continue;
-
-            /* must be the correct time bin */
-            if(lv->tw->type == TREEWALK_SPLIT && !(BINMASK(P[other].TimeBin) & lv->tw->bgmask))
-                continue;
+void
+treewalk_ngb_release(LocalTreeWalk * lv)
+{
+    ngb_release_big_ngblist(lv);
+}
 
-            double dist;
+int
+treewalk_ngb_candidates(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter,
+        const int inode, LocalTreeWalk * lv, const int ** ngblist)
+{
+    struct NgbCache * cache = lv->tw->ngbcache != TREEWALK_NGBCACHE_NONE ? lv->tw->tree->NgbCache : NULL;
+    /* Primary particles always start at the root, so have a single entry in the node list.*/
+    if(lv->mode != 0)
+        cache = NULL;
+
+    if(cache && (lv->tw->ngbcache & TREEWALK_NGBCACHE_USE)) {
+        const int target = lv->target;
+        #pragma omp atomic
+        cache->Lookups++;
+        if(cache->Count[target] >= 0 && iter->Hsml <= cache->Radius[target]) {
+            *ngblist = cache->Pool + cache->Offset[target];
+            /* The stored radius covers the same top leaves of other tasks, so export to them again*/
+            const int * exportnodes = *ngblist + cache->Count[target];
+            int k;
+            for(k = 0; k < cache->NExport[target]; k++)
+                if(-1 == treewalk_export_particle(lv, exportnodes[k]))
+                    return -1;
+            #pragma omp atomic
+            cache->Hits++;
+            return cache->Count[target];
+        }
+        /* Only the exports are stored: repeat them and search the local tree.
+         * A walk which also fills the cache needs to find them again to store them.*/
+        if(!(lv->tw->ngbcache & TREEWALK_NGBCACHE_FILL) && cache->NExport[target] >= 0 && iter->Hsml <= cache->Radius[target]) {
+            const int * exportnodes = cache->Pool + cache->ExportOffset[target];
+            int k;
+            for(k = 0; k < cache->NExport[target]; k++)
+                if(-1 == treewalk_export_particle(lv, exportnodes[k]))
+                    return -1;
+            #pragma omp atomic
+            cache->ExportHits++;
+            lv->SkipExports = 1;
+        }
+    }
 
-            if(iter->symmetric == NGB_TREEFIND_SYMMETRIC) {
-                dist = DMAX(P[other].Hsml, iter->Hsml);
-            } else {
-                dist = iter->Hsml;
+    int startnode = lv->tw->tree->Nodes[I->NodeList[inode]].u.d.nextnode;  /* open it */
+    const int64_t nhalo = lv->Nhalo;
+    const enum NgbTreeFindSymmetric symmetric = iter->symmetric;
+
+    /* Find the candidates with a symmetric search, so they are complete for a later symmetric walk.
+     * The candidates are still filtered with the symmetry the walk asked for.*/
+    if(cache && (lv->tw->ngbcache & TREEWALK_NGBCACHE_FILL))
+        iter->symmetric = NGB_TREEFIND_SYMMETRIC;
+    lv->NExportNodes = 0;
+    const int numcand = ngb_treefind_threads(I, O, iter, startnode, lv);
+    iter->symmetric = symmetric;
+    lv->SkipExports = 0;
+    /* Export buffer is full end prematurally */
+    if(numcand < 0) {
+        ngb_release_big_ngblist(lv);
+        return numcand;
+    }
+    /* The search may have moved to the big list*/
+    *ngblist = lv->ngblist;
+
+    /* Particles exported to a few top leaves are cached with the pseudo particles they were exported to,
+     * so that later iterations need not walk the tree for them either. Particles with ghost
+     * neighbours are not cached, as the halo may be rebuilt before the next walk.*/
+    if(cache && (lv->tw->ngbcache & TREEWALK_NGBCACHE_FILL)) {
+        const int target = lv->target;
+        const int nexport = lv->NExportNodes;
+        cache->Count[target] = -1;
+        cache->NExport[target] = -1;
+        if(nexport <= TREEWALK_CACHE_EXPORTS && lv->Nhalo == nhalo && cache->Used < cache->PoolSize) {
+            int offset = atomic_fetch_and_add(&cache->Used, numcand + nexport);
+            if(offset + (int64_t) numcand + nexport <= cache->PoolSize) {
+                memcpy(cache->Pool + offset, lv->ngblist, numcand * sizeof(int));
+                cache->Offset[target] = offset;
+                cache->Count[target] = numcand;
+                offset += numcand;
             }
-
-            double r2 = 0;
-            int d;
-            double h2 = dist * dist;
-            for(d = 0; d < 3; d ++) {
-                /* the distance vector points to 'other' */
-                iter->dist[d] = NEAREST(I->Pos[d] - P[other].Pos[d], BoxSize);
-                r2 += iter->dist[d] * iter->dist[d];
-                if(r2 > h2) break;
+            /* The candidates did not fit: the exports alone may, as the pool fills from
+             * the front and the entries of the other threads may be smaller.*/
+            else if(nexport > 0)
+                offset = atomic_fetch_and_add(&cache->Used, nexport);
+            if(offset + (int64_t) nexport <= cache->PoolSize) {
+                memcpy(cache->Pool + offset, lv->ExportNodes, nexport * sizeof(int));
+                cache->ExportOffset[target] = offset;
+                cache->NExport[target] = nexport;
+                cache->Radius[target] = iter->Hsml;
             }
-            if(r2 > h2) continue;
-
-            /* update the iter and call the iteration function*/
-            iter->r2 = r2;
-            iter->r = sqrt(r2);
-            iter->other = other;
-
-            lv->tw->ngbiter(I, O, iter, lv);
         }
+    }
+    return numcand;
+}
 
-        ninteractions += numngb;
+/* The search radius around a local particle inside which all the neighbours are local
+ * or ghosts in the halo, or -1 if the particle is not in the tree.*/
+static double
+halo_radius(const struct NgbHalo * halo, const ForceTree * tree, const int target)
+{
+    if(target < 0)
+        return -1;
+    /* Climb to the top leaf containing the particle*/
+    int no = tree->Father[target];
+    while(no >= 0 && !tree->Nodes[no].f.TopLevel)
+        no = tree->Nodes[no].father;
+    if(no < 0)
+        return -1;
+    int left = 0, right = halo->NLocalLeaves;
+    while(right > left) {
+        const int mid = (left + right) / 2;
+        if(halo->LocalLeafNode[mid] < no)
+            left = mid + 1;
+        else
+            right = mid;
     }
+    if(left == halo->NLocalLeaves || halo->LocalLeafNode[left] != no)
+        return -1;
+    return halo->LocalLeafRadius[left];
+}
 
-    lv->Ninteractions += ninteractions;
-    if(lv->mode == 1) {
-        lv->Nnodesinlist += inode;
-        lv->Nlist += 1;
+/* Add the ghosts of top leaf 'leaf' which may be inside the search radius to the neighbour list.
+ * Returns the new number of candidates.*/
+static int
+halo_add_candidates(const struct NgbHalo * halo, const TreeWalkQueryBase * I, const TreeWalkNgbIterBase * iter,
+        const int leaf, int numcand, LocalTreeWalk * lv, const double BoxSize)
+{
+    int c;
+    for(c = halo->LeafChunk[leaf]; c < halo->LeafChunk[leaf + 1]; c++) {
+        const struct halo_chunk * chunk = &halo->Chunks[c];
+        double dist = iter->Hsml;
+        if(iter->symmetric == NGB_TREEFIND_SYMMETRIC)
+            dist = DMAX(chunk->hmax, iter->Hsml);
+        int d;
+        for(d = 0; d < 3; d ++) {
+            if(fabs(NEAREST(chunk->center[d] - I->Pos[d], BoxSize)) > dist + chunk->half[d])
+                break;
+        }
+        if(d < 3)
+            continue;
+        if(numcand + chunk->count > lv->NgblistSize)
+            ngb_take_big_ngblist(lv, numcand);
+        int k;
+        for(k = 0; k < chunk->count; k++)
+            lv->ngblist[numcand++] = halo->Index[chunk->start + k];
     }
-    return 0;
+    return numcand;
 }
 
 /**
@@ -905,6 +2133,11 @@ int treewalk_visit_ngbiter(TreeWalkQueryBase * I,
 static int
 cull_node(const TreeWalkQueryBase * const I, const TreeWalkNgbIterBase * const iter, const struct NODE * const current, const double BoxSize)
 {
+    /* Nothing of the wanted types in the node: for example the SPH walks
+     * skip the dark matter and FOF skips the gas.*/
+    if(!(current->f.TypeMask & iter->mask))
+        return 0;
+
     double dist;
     if(iter->symmetric == NGB_TREEFIND_SYMMETRIC) {
         dist = DMAX(current->u.d.hmax, iter->Hsml) + 0.5 * current->len;
@@ -937,6 +2170,8 @@ cull_node(const TreeWalkQueryBase * const I, const TreeWalkNgbIterBase * const i
  *
  * Particle that intersects with other domains are marked for export.
  * The hosting nodes (leaves of the global tree) are exported as well.
+ * If the walk uses the halo and it covers the search radius, the ghosts
+ * of those domains are candidates instead.
  *
  * For all 'other' particle within the neighbourhood and are local on this processor,
  * this function calls the ngbiter member of the TreeWalk object.
@@ -954,13 +2189,19 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
     int numcand = 0;
 
     const ForceTree * tree = lv->tw->tree;
+    const int * leaf = force_get_leaf_particles(tree);
     const double BoxSize = tree->BoxSize;
+    const struct NgbHalo * halo = (lv->tw->halo && lv->mode == 0) ? tree->Halo : NULL;
+    /* Found at the first pseudo particle, as most particles never reach one*/
+    double haloradius = -2;
     no = startnode;
 
     while(no >= 0)
     {
         int nextnode = force_get_next_node(no, tree);
         if(node_is_particle(no, tree))  /* single particle */ {
+            if(numcand >= lv->NgblistSize)
+                ngb_take_big_ngblist(lv, numcand);
             lv->ngblist[numcand++] = no;
             no = nextnode;
             continue;
@@ -969,9 +2210,23 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
             /* pseudo particle */
             if(lv->mode == 1) {
                 endrun(12312, "Touching outside of my domain from a node list of a ghost. This shall not happen.");
+            } else if(lv->SkipExports) {
+                /* Exported already, from the neighbour cache*/
             } else {
-                if(-1 == treewalk_export_particle(lv, no))
-                    return -1;
+                if(halo && haloradius < -1)
+                    haloradius = halo_radius(halo, tree, lv->target);
+                /* The radius is the same for every pseudo particle, so either all or none are exported.*/
+                if(halo && iter->Hsml <= haloradius) {
+                    numcand = halo_add_candidates(halo, I, iter, no - tree->lastnode, numcand, lv, BoxSize);
+                    lv->Nhalo++;
+                }
+                else {
+                    if(-1 == treewalk_export_particle(lv, no))
+                        return -1;
+                    if(lv->NExportNodes < TREEWALK_CACHE_EXPORTS)
+                        lv->ExportNodes[lv->NExportNodes] = no;
+                    lv->NExportNodes++;
+                }
             }
             no = nextnode;
             continue;
@@ -995,7 +2250,24 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
             continue;
         }
 
+        /* The evaluator knows that nothing in this node is new to the target*/
+        if(lv->mode == 0 && lv->tw->ngbskip && !current->f.TopLevel && lv->tw->ngbskip(no, lv)) {
+            no = current->u.d.sibling;
+            continue;
+        }
+
         /* ok, we need to open the node */
+        if(leaf && current->f.ChildType == PARTICLE_NODE_TYPE) {
+            /* The particles of a leaf are contiguous, so take them all and skip the leaf*/
+            const int * lp = leaf + leaf[no];
+            int k;
+            if(numcand + current->f.NumParticles > lv->NgblistSize)
+                ngb_take_big_ngblist(lv, numcand);
+            for(k = 0; k < current->f.NumParticles; k++)
+                lv->ngblist[numcand++] = lp[k];
+            no = current->u.d.sibling;
+            continue;
+        }
         no = nextnode;
         continue;
     }
@@ -1003,3 +2275,482 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
     return numcand;
 }
 
+
+void
+treewalk_ngbcache_alloc(ForceTree * tree, const int64_t maxcand)
+{
+    if(NgbCacheMB <= 0)
+        return;
+    struct NgbCache * cache = ta_malloc("NgbCache", struct NgbCache, 1);
+    const int NumPart = PartManager->NumPart;
+    double poolsize = NgbCacheMB * 1024 * 1024 / sizeof(int);
+    if(maxcand > 0 && poolsize > maxcand)
+        poolsize = maxcand;
+    if(poolsize > INT_MAX)
+        poolsize = INT_MAX;
+    cache->PoolSize = poolsize;
+    cache->Used = 0;
+    cache->NumPart = NumPart;
+    cache->Lookups = 0;
+    cache->Hits = 0;
+    cache->ExportHits = 0;
+    cache->Offset = (int *) mymalloc("NgbCacheOffset", NumPart * sizeof(int));
+    cache->Count = (int *) mymalloc("NgbCacheCount", NumPart * sizeof(int));
+    cache->NExport = (int *) mymalloc("NgbCacheNExport", NumPart * sizeof(int));
+    cache->ExportOffset = (int *) mymalloc("NgbCacheExportOffset", NumPart * sizeof(int));
+    cache->Radius = (MyFloat *) mymalloc("NgbCacheRadius", NumPart * sizeof(MyFloat));
+    cache->Pool = (int *) mymalloc("NgbCachePool", cache->PoolSize * sizeof(int));
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++) {
+        cache->Count[i] = -1;
+        cache->NExport[i] = -1;
+    }
+    tree->NgbCache = cache;
+}
+
+double
+treewalk_ngbcache_radius(const ForceTree * tree, const int i)
+{
+    const struct NgbCache * cache = tree->NgbCache;
+    if(!cache || cache->Count[i] < 0)
+        return 0;
+    return cache->Radius[i];
+}
+
+void
+treewalk_ngbcache_free(ForceTree * tree)
+{
+    struct NgbCache * cache = tree->NgbCache;
+    if(!cache)
+        return;
+    int64_t stats[4] = {cache->Lookups, cache->Hits, cache->Used < cache->PoolSize ? cache->Used : cache->PoolSize, cache->ExportHits}, totstats[4];
+    MPI_Reduce(stats, totstats, 4, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    message(0, "Neighbour cache: %ld of %ld lookups reused the stored candidates and %ld only the exports. %ld candidates stored.\n",
+            totstats[1], totstats[0], totstats[3], totstats[2]);
+    myfree(cache->Pool);
+    myfree(cache->Radius);
+    myfree(cache->ExportOffset);
+    myfree(cache->NExport);
+    myfree(cache->Count);
+    myfree(cache->Offset);
+    ta_free(cache);
+    tree->NgbCache = NULL;
+}
+
+/* Drop the cached candidates of every local particle within h of pos.*/
+static void
+ngbcache_drop_near(struct NgbCache * cache, const ForceTree * tree, const double * pos, const double h)
+{
+    const double BoxSize = tree->BoxSize;
+    int no = tree->firstnode;
+    while(no >= 0)
+    {
+        if(node_is_particle(no, tree)) {
+            double r2 = 0;
+            int d;
+            for(d = 0; d < 3; d ++) {
+                const double dx = NEAREST(P[no].Pos[d] - pos[d], BoxSize);
+                r2 += dx * dx;
+            }
+            if(r2 < h * h)
+                cache->Count[no] = -1;
+            no = force_get_next_node(no, tree);
+            continue;
+        }
+        if(node_is_pseudo_particle(no, tree)) {
+            no = force_get_next_node(no, tree);
+            continue;
+        }
+        const struct NODE * current = &tree->Nodes[no];
+        const double dist = h + 0.5 * current->len;
+        int d;
+        for(d = 0; d < 3; d ++) {
+            if(fabs(NEAREST(current->center[d] - pos[d], BoxSize)) > dist)
+                break;
+        }
+        if(d < 3)
+            no = current->u.d.sibling;
+        else
+            no = current->u.d.nextnode;
+    }
+}
+
+void
+treewalk_ngbcache_update_hmax(int * activeset, int size, ForceTree * tree, DomainDecomp * ddecomp)
+{
+    struct NgbCache * cache = tree->NgbCache;
+    if(!cache) {
+        force_update_hmax(activeset, size, tree, ddecomp);
+        return;
+    }
+    int i;
+    /* A local particle whose smoothing length is now larger than the hmax of its leaf
+     * may be a neighbour of particles which did not find it in the density walk.*/
+    #pragma omp parallel for schedule(dynamic, TREEWALK_CHUNK)
+    for(i = 0; i < size; i++) {
+        const int p_i = activeset ? activeset[i] : i;
+        if(P[p_i].Type != 0 || P[p_i].IsGarbage)
+            continue;
+        const int leaf = tree->Father[p_i];
+        if(leaf >= 0 && P[p_i].Hsml > tree->Nodes[leaf].u.d.hmax)
+            ngbcache_drop_near(cache, tree, P[p_i].Pos, P[p_i].Hsml);
+    }
+
+    double * OldTopLeafhmax = (double *) mymalloc("OldTopLeafhmax", ddecomp->NTopLeaves * sizeof(double));
+    for(i = 0; i < ddecomp->NTopLeaves; i++)
+        OldTopLeafhmax[i] = tree->Nodes[ddecomp->TopLeaves[i].treenode].u.d.hmax;
+
+    force_update_hmax(activeset, size, tree, ddecomp);
+
+    /* The hmax of a top leaf on another task grew: particles which may now open
+     * its parent node need to be exported, so walk the tree for them again.*/
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    const double BoxSize = tree->BoxSize;
+    for(i = 0; i < ddecomp->NTopLeaves; i++) {
+        const struct NODE * leaf = &tree->Nodes[ddecomp->TopLeaves[i].treenode];
+        if(ddecomp->TopLeaves[i].Task == ThisTask || leaf->u.d.hmax <= OldTopLeafhmax[i] || leaf->father < 0)
+            continue;
+        const struct NODE * father = &tree->Nodes[leaf->father];
+        int j;
+        #pragma omp parallel for
+        for(j = 0; j < cache->NumPart; j++) {
+            if(cache->Count[j] < 0 && cache->NExport[j] < 0)
+                continue;
+            const double dist = DMAX(father->u.d.hmax, cache->Radius[j]) + 0.5 * father->len;
+            int d;
+            for(d = 0; d < 3; d ++) {
+                if(fabs(NEAREST(father->center[d] - P[j].Pos[d], BoxSize)) > dist)
+                    break;
+            }
+            if(d == 3) {
+                cache->Count[j] = -1;
+                cache->NExport[j] = -1;
+            }
+        }
+    }
+    myfree(OldTopLeafhmax);
+}
+
+int
+treewalk_halo_enabled(void)
+{
+    return TreeWalkHalo > 0;
+}
+
+int
+treewalk_halo_nghost(const ForceTree * tree)
+{
+    return tree->Halo ? tree->Halo->NGhost : 0;
+}
+
+/* Walk the top-level nodes around gas particle i and find the other tasks with a top leaf
+ * within TreeWalkHalo * hfac * max(Hsml, hmax of the leaf), and at least hfac * Hsml, so the symmetric
+ * walks on that task find i if its own smoothing length reaches them. Each task is counted once in count,
+ * using mark to remember the last particle which counted it. If sendindex is not NULL,
+ * i is stored at sendindex[count[task]] before counting.*/
+static void
+halo_find_tasks(const ForceTree * tree, const int i, const double hfac, const int ThisTask, int * mark, int * count, int * sendindex)
+{
+    const double BoxSize = tree->BoxSize;
+    int no = tree->firstnode;
+    while(no >= 0)
+    {
+        if(node_is_pseudo_particle(no, tree)) {
+            const int task = tree->TopLeaves[no - tree->lastnode].Task;
+            if(task != ThisTask && mark[task] != i) {
+                mark[task] = i;
+                if(sendindex)
+                    sendindex[count[task]] = i;
+                count[task]++;
+            }
+            no = force_get_next_node(no, tree);
+            continue;
+        }
+        const struct NODE * current = &tree->Nodes[no];
+        /* Below the top leaves the tree is local*/
+        if(!current->f.TopLevel) {
+            no = current->u.d.sibling;
+            continue;
+        }
+        const double dist = hfac * DMAX(TreeWalkHalo * DMAX(current->u.d.hmax, P[i].Hsml), P[i].Hsml) + 0.5 * current->len;
+        int d;
+        for(d = 0; d < 3; d ++) {
+            if(fabs(NEAREST(current->center[d] - P[i].Pos[d], BoxSize)) > dist)
+                break;
+        }
+        /* Skip nodes out of range and our own top leaves*/
+        if(d < 3 || (!current->f.InternalTopLevel && current->f.ChildType != PSEUDO_NODE_TYPE))
+            no = current->u.d.sibling;
+        else
+            no = current->u.d.nextnode;
+    }
+}
+
+/* Predicted SPH quantities of a ghost, from the scratch data*/
+struct halo_pred
+{
+    /* If false, the ghost is predicted from its imported data when first used*/
+    int Predicted;
+    MyFloat EntVarPred;
+    MyFloat VelPred[3];
+};
+
+int
+treewalk_halo_build(ForceTree * tree, DomainDecomp * ddecomp, const double hfac)
+{
+    treewalk_halo_free(tree);
+    if(TreeWalkHalo <= 0)
+        return 0;
+
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const int NThread = omp_get_max_threads();
+    const int NumPart = PartManager->NumPart;
+    const int NumSph = SlotsManager->info[0].size;
+    int i, t;
+
+    /* Count the tasks each gas particle is sent to, per thread*/
+    int * Count = (int *) mymalloc("HaloCount", NThread * NTask * sizeof(int));
+    int * Mark = (int *) mymalloc("HaloMark", NThread * NTask * sizeof(int));
+    memset(Count, 0, NThread * NTask * sizeof(int));
+    for(i = 0; i < NThread * NTask; i++)
+        Mark[i] = -1;
+
+    #pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        #pragma omp for schedule(static)
+        for(i = 0; i < NumPart; i++) {
+            if(P[i].Type != 0 || P[i].IsGarbage)
+                continue;
+            halo_find_tasks(tree, i, hfac, ThisTask, Mark + tid * NTask, Count + tid * NTask, NULL);
+        }
+    }
+
+    int * sendcount = ta_malloc("sendcount", int, 4 * NTask);
+    int * senddispl = sendcount + NTask;
+    int * recvcount = senddispl + NTask;
+    int * recvdispl = recvcount + NTask;
+    int64_t nsend = 0;
+    for(i = 0; i < NTask; i++) {
+        senddispl[i] = nsend;
+        /* Each thread fills its range of the send list for this task*/
+        for(t = 0; t < NThread; t++) {
+            const int c = Count[t * NTask + i];
+            Count[t * NTask + i] = nsend;
+            nsend += c;
+        }
+        sendcount[i] = nsend - senddispl[i];
+    }
+    MPI_Alltoall(sendcount, 1, MPI_INT, recvcount, 1, MPI_INT, MPI_COMM_WORLD);
+    int64_t nghost = 0;
+    for(i = 0; i < NTask; i++) {
+        recvdispl[i] = nghost;
+        nghost += recvcount[i];
+    }
+
+    /* The ghosts go after the particles and SPH slots, so every task needs room for them*/
+    int fits = (NumPart + nghost <= PartManager->MaxPart) && (NumSph + nghost <= SlotsManager->info[0].maxsize);
+    MPI_Allreduce(MPI_IN_PLACE, &fits, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    if(!fits) {
+        message(0, "Not enough free particle or SPH slots for the halo: exporting instead.\n");
+        ta_free(sendcount);
+        myfree(Mark);
+        myfree(Count);
+        return 0;
+    }
+
+    int * SendIndex = (int *) mymalloc("HaloSendIndex", nsend * sizeof(int));
+    for(i = 0; i < NThread * NTask; i++)
+        Mark[i] = -1;
+    /* Same schedule as the first pass, so each thread finds the same particles*/
+    #pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        #pragma omp for schedule(static)
+        for(i = 0; i < NumPart; i++) {
+            if(P[i].Type != 0 || P[i].IsGarbage)
+                continue;
+            halo_find_tasks(tree, i, hfac, ThisTask, Mark + tid * NTask, Count + tid * NTask, SendIndex);
+        }
+    }
+
+    /* Send the particles, SPH data, and the predicted quantities if they have been allocated*/
+    struct particle_data * PartSend = (struct particle_data *) mymalloc("HaloPartSend", nsend * sizeof(struct particle_data));
+    struct sph_particle_data * SphSend = (struct sph_particle_data *) mymalloc("HaloSphSend", nsend * sizeof(struct sph_particle_data));
+    #pragma omp parallel for
+    for(i = 0; i < nsend; i++) {
+        PartSend[i] = P[SendIndex[i]];
+        SphSend[i] = SPHP(SendIndex[i]);
+    }
+    MPI_Alltoallv_sparse(PartSend, sendcount, senddispl, MPI_TYPE_PARTICLE,
+                 P + NumPart, recvcount, recvdispl, MPI_TYPE_PARTICLE, MPI_COMM_WORLD);
+    MPI_Alltoallv_sparse(SphSend, sendcount, senddispl, MPI_TYPE_SLOT[0],
+                 SphP + NumSph, recvcount, recvdispl, MPI_TYPE_SLOT[0], MPI_COMM_WORLD);
+    myfree(SphSend);
+    myfree(PartSend);
+
+    if(SphP_scratch->EntVarPred) {
+        MPI_Datatype MPI_TYPE_HALO_PRED;
+        MPI_Type_contiguous(sizeof(struct halo_pred), MPI_BYTE, &MPI_TYPE_HALO_PRED);
+        MPI_Type_commit(&MPI_TYPE_HALO_PRED);
+        struct halo_pred * PredSend = (struct halo_pred *) mymalloc("HaloPredSend", nsend * sizeof(struct halo_pred));
+        struct halo_pred * PredRecv = (struct halo_pred *) mymalloc("HaloPredRecv", nghost * sizeof(struct halo_pred));
+        #pragma omp parallel for
+        for(i = 0; i < nsend; i++) {
+            const int PI = P[SendIndex[i]].PI;
+            /* Unpredicted particles are predicted on first use on the importing task*/
+            PredSend[i].Predicted = SphP_scratch->PredState[PI] == SPH_PRED_DONE;
+            PredSend[i].EntVarPred = SphP_scratch->EntVarPred[PI];
+            memcpy(PredSend[i].VelPred, SphP_scratch->VelPred + 3 * PI, 3 * sizeof(MyFloat));
+        }
+        MPI_Alltoallv_sparse(PredSend, sendcount, senddispl, MPI_TYPE_HALO_PRED,
+                 PredRecv, recvcount, recvdispl, MPI_TYPE_HALO_PRED, MPI_COMM_WORLD);
+        #pragma omp parallel for
+        for(i = 0; i < nghost; i++) {
+            SphP_scratch->PredState[NumSph + i] = PredRecv[i].Predicted ? SPH_PRED_DONE : SPH_PRED_NONE;
+            SphP_scratch->EntVarPred[NumSph + i] = PredRecv[i].EntVarPred;
+            memcpy(SphP_scratch->VelPred + 3 * (NumSph + i), PredRecv[i].VelPred, 3 * sizeof(MyFloat));
+        }
+        myfree(PredRecv);
+        myfree(PredSend);
+        MPI_Type_free(&MPI_TYPE_HALO_PRED);
+    }
+    myfree(SendIndex);
+    ta_free(sendcount);
+    myfree(Mark);
+    myfree(Count);
+
+    /* Link the ghosts to their SPH data*/
+    #pragma omp parallel for
+    for(i = 0; i < nghost; i++) {
+        P[NumPart + i].PI = NumSph + i;
+        SphP[NumSph + i].base.ReverseLink = NumPart + i;
+    }
+
+    struct NgbHalo * halo = ta_malloc("NgbHalo", struct NgbHalo, 1);
+    halo->NGhost = nghost;
+
+    /* Our top leaves, and the radius the halo covers around their particles*/
+    const int StartLeaf = ddecomp->Tasks[ThisTask].StartLeaf;
+    halo->NLocalLeaves = ddecomp->Tasks[ThisTask].EndLeaf - StartLeaf;
+    halo->LocalLeafNode = (int *) mymalloc("HaloLocalLeafNode", halo->NLocalLeaves * sizeof(int));
+    halo->LocalLeafRadius = (double *) mymalloc("HaloLocalLeafRadius", halo->NLocalLeaves * sizeof(double));
+    for(i = 0; i < halo->NLocalLeaves; i++)
+        halo->LocalLeafNode[i] = ddecomp->TopLeaves[StartLeaf + i].treenode;
+    qsort(halo->LocalLeafNode, halo->NLocalLeaves, sizeof(int), ev_cmp_int);
+    for(i = 0; i < halo->NLocalLeaves; i++)
+        halo->LocalLeafRadius[i] = TreeWalkHalo * hfac * tree->Nodes[halo->LocalLeafNode[i]].u.d.hmax;
+
+    /* Sort the ghosts by top leaf, and split each leaf into chunks*/
+    const int NTopLeaves = ddecomp->NTopLeaves;
+    int * LeafCount = ta_malloc("HaloLeafCount", int, NTopLeaves + 1);
+    memset(LeafCount, 0, (NTopLeaves + 1) * sizeof(int));
+    for(i = 0; i < nghost; i++)
+        LeafCount[domain_get_topleaf(P[NumPart + i].Key, ddecomp)]++;
+    halo->LeafChunk = (int *) mymalloc("HaloLeafChunk", (NTopLeaves + 1) * sizeof(int));
+    int nchunk = 0, nplaced = 0;
+    for(i = 0; i < NTopLeaves; i++) {
+        halo->LeafChunk[i] = nchunk;
+        nchunk += (LeafCount[i] + HALO_CHUNK - 1) / HALO_CHUNK;
+        const int c = LeafCount[i];
+        LeafCount[i] = nplaced;
+        nplaced += c;
+    }
+    halo->LeafChunk[NTopLeaves] = nchunk;
+    halo->Index = (int *) mymalloc("HaloIndex", nghost * sizeof(int));
+    for(i = 0; i < nghost; i++)
+        halo->Index[LeafCount[domain_get_topleaf(P[NumPart + i].Key, ddecomp)]++] = NumPart + i;
+    /* LeafCount[i] is now the end of leaf i*/
+    halo->Chunks = (struct halo_chunk *) mymalloc("HaloChunks", nchunk * sizeof(struct halo_chunk));
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(i = 0; i < NTopLeaves; i++) {
+        const int end = LeafCount[i];
+        int start = i > 0 ? LeafCount[i - 1] : 0;
+        int c = halo->LeafChunk[i];
+        for( ; start < end; start += HALO_CHUNK, c++) {
+            struct halo_chunk * chunk = &halo->Chunks[c];
+            chunk->start = start;
+            chunk->count = end - start < HALO_CHUNK ? end - start : HALO_CHUNK;
+            chunk->hmax = 0;
+            double min[3], max[3];
+            int k, d;
+            for(k = 0; k < chunk->count; k++) {
+                const struct particle_data * pp = &P[halo->Index[start + k]];
+                for(d = 0; d < 3; d++) {
+                    if(k == 0 || pp->Pos[d] < min[d])
+                        min[d] = pp->Pos[d];
+                    if(k == 0 || pp->Pos[d] > max[d])
+                        max[d] = pp->Pos[d];
+                }
+                chunk->hmax = DMAX(chunk->hmax, pp->Hsml);
+            }
+            for(d = 0; d < 3; d++) {
+                chunk->center[d] = 0.5 * (min[d] + max[d]);
+                chunk->half[d] = 0.5 * (max[d] - min[d]);
+            }
+        }
+    }
+    ta_free(LeafCount);
+    tree->Halo = halo;
+
+    int64_t totghost;
+    MPI_Reduce(&nghost, &totghost, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    message(0, "Halo: imported %ld ghost gas particles.\n", totghost);
+    return nghost;
+}
+
+void
+treewalk_halo_free(ForceTree * tree)
+{
+    struct NgbHalo * halo = tree->Halo;
+    if(!halo)
+        return;
+    myfree(halo->Chunks);
+    myfree(halo->Index);
+    myfree(halo->LeafChunk);
+    myfree(halo->LocalLeafRadius);
+    myfree(halo->LocalLeafNode);
+    ta_free(halo);
+    tree->Halo = NULL;
+}
+
+void
+treewalk_scatter_alloc(TreeWalkScatter * sc, MyFloat * dest, const int64_t ndest, const int64_t size)
+{
+    sc->dest = dest;
+    sc->Ndest = ndest;
+    sc->NThread = omp_get_max_threads();
+    sc->Size = size;
+    sc->Used = (int64_t *) mymalloc("ScatterUsed", sc->NThread * sizeof(int64_t));
+    memset(sc->Used, 0, sc->NThread * sizeof(int64_t));
+    sc->Entries = (struct TreeWalkScatterEntry *) mymalloc("ScatterEntries", sc->NThread * size * sizeof(struct TreeWalkScatterEntry));
+}
+
+void
+treewalk_scatter_merge_free(TreeWalkScatter * sc)
+{
+    /* Each thread owns one range of dest and applies the entries of every buffer which fall in it,
+     * in the order the buffers were filled.*/
+    #pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        const int nthr = omp_get_num_threads();
+        const int64_t start = sc->Ndest * tid / nthr;
+        const int64_t end = sc->Ndest * (tid + 1) / nthr;
+        int t;
+        int64_t i;
+        for(t = 0; t < sc->NThread; t++) {
+            const struct TreeWalkScatterEntry * entries = sc->Entries + t * sc->Size;
+            for(i = 0; i < sc->Used[t]; i++)
+                if(entries[i].index >= start && entries[i].index < end)
+                    sc->dest[entries[i].index] += entries[i].value;
+        }
+    }
+    myfree(sc->Entries);
+    myfree(sc->Used);
+}
@@ -2,10 +2,14 @@
 #define _EVALUATOR_H_
 
 #include <stdint.h>
+#include <omp.h>
 #include "utils/paramset.h"
 #include "forcetree.h"
 
 #define  NODELISTLENGTH      8
+/* Largest number of particles which walk the tree together in a group visit.
+ * Groups are particles sharing a parent node, so there are at most NMAXCHILD.*/
+#define  TREEWALK_GROUP_MAX  NMAXCHILD
 
 enum NgbTreeFindSymmetric {
     NGB_TREEFIND_SYMMETRIC,
@@ -27,6 +31,8 @@ typedef struct {
 
 typedef struct {
     MyIDType ID;
+    /* Wall time of the visit, added to P[i].WalkTime of the target by the treewalk*/
+    float WalkTime;
 } TreeWalkResultBase;
 
 typedef struct {
@@ -37,33 +43,74 @@ typedef struct {
     double r2;
     double r;
     int other;
+    /* Set by the ngbiter on the first call if it wants to be called once more,
+     * with other == -2, after the last neighbour. Used to finish batched neighbours.*/
+    int finish;
 } TreeWalkNgbIterBase;
 
+/* Largest number of top leaves of other tasks a particle can be exported to
+ * and still have its candidates and exports kept in the neighbour cache.*/
+#define TREEWALK_CACHE_EXPORTS 32
+
 typedef struct {
     TreeWalk * tw;
 
     int mode; /* 0 for Primary, 1 for Secondary */
     int target; /* defined only for primary (mode == 0) */
+    /* Particle index of each member during a group visit, NULL otherwise.
+     * Set lv->target to a member before exporting it.*/
+    const int * targets;
 
     int *exportflag;
     int *exportnodecount;
     int *exportindex;
+    /* Neighbour candidates of the current query, NgblistSize long:
+     * either the list of this thread, ngblist_thread, or a longer shared list.*/
     int * ngblist;
+    int * ngblist_thread;
+    int NgblistSize;
     int64_t Ninteractions;
     int64_t Nnodesinlist;
     int64_t Nlist;
+    /* Number of exports made by this thread, used to tell whether a particle was exported.*/
+    int64_t Nexported;
+    /* Number of top leaves of other tasks this thread searched in the halo instead of exporting.*/
+    int64_t Nhalo;
+    /* Pseudo particles the current query was exported to, for the neighbour cache.
+     * NExportNodes may be larger than TREEWALK_CACHE_EXPORTS, when only the first are stored.*/
+    int ExportNodes[TREEWALK_CACHE_EXPORTS];
+    int NExportNodes;
+    /* If set, the neighbour search skips the pseudo particles, as the exports
+     * of the current query were made from the neighbour cache.*/
+    int SkipExports;
 } LocalTreeWalk;
 
 typedef int (*TreeWalkVisitFunction) (TreeWalkQueryBase * input, TreeWalkResultBase * output, LocalTreeWalk * lv);
 
 typedef void (*TreeWalkNgbIterFunction) (TreeWalkQueryBase * input, TreeWalkResultBase * output, TreeWalkNgbIterBase * iter, LocalTreeWalk * lv);
 
+/* Walks the tree once for ngroup nearby particles, filling one output for each input.
+ * Returns -1 if the buffer is full.*/
+typedef int (*TreeWalkGroupVisitFunction) (TreeWalkQueryBase ** input, TreeWalkResultBase ** output, const int ngroup, LocalTreeWalk * lv);
+
 typedef int (*TreeWalkHasWorkFunction) (const int i, TreeWalk * tw);
+/* Returns true if a neighbour walk of the primary particle lv->target need not open the local node no.*/
+typedef int (*TreeWalkNgbSkipFunction) (const int no, LocalTreeWalk * lv);
 typedef void (*TreeWalkProcessFunction) (const int i, TreeWalk * tw);
 
 typedef void (*TreeWalkFillQueryFunction)(const int j, TreeWalkQueryBase * query, TreeWalk * tw);
 typedef void (*TreeWalkReduceResultFunction)(const int j, TreeWalkResultBase * result, const enum TreeWalkReduceMode mode, TreeWalk * tw);
 
+/* The modes are flags: with both set, stored candidates are reused where
+ * complete and the other particles are searched and stored again.*/
+enum TreeWalkNgbCacheMode {
+    TREEWALK_NGBCACHE_NONE = 0,
+    /* Search symmetrically and store the candidates of each primary particle which was not exported*/
+    TREEWALK_NGBCACHE_FILL = 1,
+    /* Reuse the stored candidates instead of walking the tree, where they are still complete*/
+    TREEWALK_NGBCACHE_USE = 2,
+};
+
 enum TreeWalkType {
     TREEWALK_ACTIVE = 0,
     TREEWALK_ALL,
@@ -87,11 +134,28 @@ struct TreeWalk {
 
     binmask_t bgmask; /* if set, the bins to compute force from; used if TreeWalkType is SPLIT */
 
+    /* Whether a neighbour walk fills or uses tree->NgbCache. Ignored if there is no cache.*/
+    enum TreeWalkNgbCacheMode ngbcache;
+
+    /* If set, a neighbour walk searches the ghosts of tree->Halo instead of exporting
+     * a primary particle whose search radius they cover. Ignored if there is no halo.
+     * The ngbiter may only read the ghosts, so must not update the other particle.*/
+    int halo;
+
     TreeWalkVisitFunction visit;                /* Function to be called between a tree node and a particle */
+    /* If set, primary particles sharing a parent tree node are evaluated together with this function.
+     * Secondary (imported) particles are always evaluated with visit.*/
+    TreeWalkGroupVisitFunction visit_group;
     TreeWalkHasWorkFunction haswork; /* Is the particle part of this interaction? */
     TreeWalkFillQueryFunction fill;       /* Copy the useful attributes of a particle to a query */
-    TreeWalkReduceResultFunction reduce;  /* Reduce a partial result to the local particle storage */
+    /* Reduce a partial result to the local particle storage. Results from other tasks which are
+     * still zero after the base, as set by treewalk_init_result, are not returned, so
+     * in TREEWALK_GHOSTS mode reduce must do nothing with such a result. */
+    TreeWalkReduceResultFunction reduce;
     TreeWalkNgbIterFunction ngbiter;     /* called for each pair of particles if visit is set to ngbiter */
+    /* If set, local nodes for which this is true are not opened by the neighbour walk of a primary particle.
+     * Top level nodes are always opened, so exports are not affected. Do not use with the neighbour cache.*/
+    TreeWalkNgbSkipFunction ngbskip;
     TreeWalkProcessFunction postprocess; /* postprocess finalizes quantities for each particle, e.g. divide the normalization */
     TreeWalkProcessFunction preprocess; /* Preprocess initializes quantities for each particle */
     int NTask; /*Number of MPI tasks*/
@@ -110,6 +174,10 @@ struct TreeWalk {
     double timecomp3;
     double timecommsumm1;
     double timecommsumm2;
+    /* Mean time each thread spent waiting for the other threads to finish,
+     * in the primary and secondary walks. Included in timecomp1 and timecomp2.*/
+    double timeidle1;
+    double timeidle2;
     /* Total number of interactions for all particles on this tree walk.*/
     int64_t Ninteractions;
     /* For secondary tree walks this stores the
@@ -132,8 +200,13 @@ struct TreeWalk {
     int Nimport;
     /* Flags that our export buffer is full*/
     int BufferFullFlag;
+    /* If set, each visit is timed for the domain cost model (DomainMeasuredCost)*/
+    int MeasureWalkTime;
     /* Number of particles we can fit into the export buffer*/
     int BunchSize;
+    /* Number of particles that would fit into the export buffer using all free memory.
+     * BunchSize is smaller if the last walk of this evaluator needed fewer exports.*/
+    int MaxBunchSize;
 
     int * WorkSet;
     int WorkSetSize;
@@ -148,6 +221,11 @@ struct TreeWalk {
 
 /*Initialise treewalk parameters on first run*/
 void set_treewalk_params(ParameterSet * ps);
+/* Change the memory factor for imported particles, eg, on a reconfigure request*/
+void set_treewalk_import_buffer_boost(int boost);
+
+/* Set the step number and time written with the treewalk statistics, if TreeWalkStatsFile is set.*/
+void treewalk_stats_set_step(const int step, const double time);
 
 void treewalk_run(TreeWalk * tw, int * active_set, int size);
 
@@ -157,5 +235,92 @@ int treewalk_visit_ngbiter(TreeWalkQueryBase * I,
 
 /*returns -1 if the buffer is full */
 int treewalk_export_particle(LocalTreeWalk * lv, int no);
+
+/* Export every member of a group visit, lv->targets, to the nnodes pseudo particles in nodes.
+ * Each member is exported to all the nodes in turn, so nodes of the same task share one export.
+ * Returns -1 if the buffer is full.*/
+int treewalk_export_group(LocalTreeWalk * lv, const int ngroup, const int * nodes, const int nnodes);
+
+/* Allocate tree->NgbCache, so one walk can store neighbour candidates for the next:
+ * density for hydro, and black hole accretion for feedback.
+ * The pool holds at most maxcand candidates if maxcand > 0. Does nothing unless NgbCacheMB > 0.*/
+void treewalk_ngbcache_alloc(ForceTree * tree, const int64_t maxcand);
+/* Radius out to which the stored candidates of particle i are complete, or 0 if none are stored.*/
+double treewalk_ngbcache_radius(const ForceTree * tree, const int i);
+/* Free tree->NgbCache and report how often it was used.*/
+void treewalk_ngbcache_free(ForceTree * tree);
+/* Update the hmax of the tree after density, as force_update_hmax, and drop
+ * the cached candidates of particles which a grown smoothing length may now reach.*/
+void treewalk_ngbcache_update_hmax(int * activeset, int size, ForceTree * tree, DomainDecomp * ddecomp);
+
+/* Is TreeWalkHalo set? Then the SPH scratch data needs room for the ghosts,
+ * up to the maximum number of SPH slots.*/
+int treewalk_halo_enabled(void);
+/* Import copies of the gas particles of other tasks which may be neighbours of our particles,
+ * as ghosts in tree->Halo, so that a walk with tw->halo set can search them instead of exporting.
+ * A gas particle is sent to every task with a top leaf within TreeWalkHalo * max(Hsml, hmax of the leaf)
+ * of it, so the halo covers the particles of each of our top leaves out to TreeWalkHalo times its hmax.
+ * The ghosts are stored after the local particles and SPH slots, without changing NumPart or the slot count.
+ * If the SPH scratch data is allocated, the predicted entropy and velocity of the ghosts are imported too.
+ * hfac >= 1 scales the smoothing lengths and hmax when sizing the halo, for a walk in which they may still grow.
+ * Replaces any existing halo. Does nothing unless TreeWalkHalo is set, or if the ghosts
+ * do not fit on some task. Collective. Returns the number of ghosts.*/
+int treewalk_halo_build(ForceTree * tree, DomainDecomp * ddecomp, const double hfac);
+/* Number of ghosts in tree->Halo: they are P[NumPart] to P[NumPart + n - 1]. 0 if there is no halo.*/
+int treewalk_halo_nghost(const ForceTree * tree);
+/* Free tree->Halo.*/
+void treewalk_halo_free(ForceTree * tree);
 #define TREEWALK_REDUCE(A, B) (A) = (mode==TREEWALK_PRIMARY)?(B):((A) + (B))
+
+/* Updating the data of the other particle from ngbiter.
+ * Several threads may reach the same neighbour, so a plain += is a race.
+ * A single accumulator can use treewalk_atomic_add. For an array which
+ * receives many additions, a TreeWalkScatter queues the additions of each
+ * thread in its own buffer and applies them all after the walk, so the walk
+ * takes neither locks nor atomics. Updates of several fields that must stay
+ * consistent (swallowing, wind kicks) still need the particle spinlocks.*/
+static inline void
+treewalk_atomic_add(MyFloat * ptr, const MyFloat value)
+{
+#pragma omp atomic
+    *ptr += value;
+}
+
+struct TreeWalkScatterEntry {
+    int index;
+    MyFloat value;
+};
+
+typedef struct TreeWalkScatter {
+    /* Array the additions are applied to, of length Ndest*/
+    MyFloat * dest;
+    int64_t Ndest;
+    int NThread;
+    /* Number of entries in each thread buffer*/
+    int64_t Size;
+    /* Entries used in each thread buffer*/
+    int64_t * Used;
+    struct TreeWalkScatterEntry * Entries;
+} TreeWalkScatter;
+
+/* Allocate a buffer of size additions per thread for the array dest[0..ndest).*/
+void treewalk_scatter_alloc(TreeWalkScatter * sc, MyFloat * dest, const int64_t ndest, const int64_t size);
+
+/* Queue dest[index] += value. Called from inside a treewalk.
+ * If the buffer of this thread is full the addition is made atomically.*/
+static inline void
+treewalk_scatter_add(TreeWalkScatter * sc, const int index, const MyFloat value)
+{
+    const int tid = omp_get_thread_num();
+    if(sc->Used[tid] >= sc->Size) {
+        treewalk_atomic_add(&sc->dest[index], value);
+        return;
+    }
+    struct TreeWalkScatterEntry * entry = &sc->Entries[tid * sc->Size + sc->Used[tid]++];
+    entry->index = index;
+    entry->value = value;
+}
+
+/* Apply all queued additions to dest and free the buffers. Call after the treewalk.*/
+void treewalk_scatter_merge_free(TreeWalkScatter * sc);
 #endif
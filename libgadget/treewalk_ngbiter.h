@@ -0,0 +1,150 @@
+#ifndef _TREEWALK_NGBITER_H_
+#define _TREEWALK_NGBITER_H_
+
+/* The neighbour loop of a treewalk, as inline functions taking the ngbiter as an argument.
+ * A module defines its own visit function with TREEWALK_DEFINE_NGBITER_VISIT, so the
+ * ngbiter is a constant in the loop: the compiler calls it directly, or inlines it,
+ * instead of loading tw->ngbiter for every neighbour.
+ * treewalk_visit_ngbiter is the same loop with the ngbiter of the TreeWalk.*/
+
+#include <math.h>
+#include "treewalk.h"
+#include "partmanager.h"
+
+/* Candidates are filtered in batches of this size: the distances of a batch are
+ * computed in one loop the compiler can vectorize, and then ngbiter is called
+ * only for the candidates inside the search radius.*/
+#define NGB_FILTER_BATCH 64
+
+/* Find the candidates of the query in node list entry inode, either in the tree or
+ * in the neighbour cache. On return *ngblist points to the candidates, which are valid
+ * until treewalk_ngb_release. Returns the number of candidates, or -1 if the export buffer is full.*/
+int treewalk_ngb_candidates(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter,
+        const int inode, LocalTreeWalk * lv, const int ** ngblist);
+
+/* Return the shared neighbour list, if the last search needed it.*/
+void treewalk_ngb_release(LocalTreeWalk * lv);
+
+/* Call ngbiter for each candidate in ngblist which is of the right type and time bin and
+ * close enough. For each batch the positions and search radii are gathered first, so the
+ * distance computation and the cut do not depend on the incoming particle data.*/
+static inline __attribute__((always_inline)) void
+treewalk_ngb_filter_candidates(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter,
+        const int * ngblist, const int numcand, LocalTreeWalk * lv, const TreeWalkNgbIterFunction ngbiter)
+{
+    const double BoxSize = lv->tw->tree->BoxSize;
+    const int splitbins = lv->tw->type == TREEWALK_SPLIT;
+    const double pos[3] = {I->Pos[0], I->Pos[1], I->Pos[2]};
+    int start;
+
+    for(start = 0; start < numcand; start += NGB_FILTER_BATCH)
+    {
+        const int nb = numcand - start < NGB_FILTER_BATCH ? numcand - start : NGB_FILTER_BATCH;
+        double px[NGB_FILTER_BATCH], py[NGB_FILTER_BATCH], pz[NGB_FILTER_BATCH], h2[NGB_FILTER_BATCH];
+        double dx[NGB_FILTER_BATCH], dy[NGB_FILTER_BATCH], dz[NGB_FILTER_BATCH], r2[NGB_FILTER_BATCH];
+        int sel[NGB_FILTER_BATCH];
+        int k, nsel = 0;
+
+        /* Gather. A candidate which fails the type or time bin test gets a negative radius.*/
+        for(k = 0; k < nb; k++) {
+            const int other = ngblist[start + k];
+            px[k] = P[other].Pos[0];
+            py[k] = P[other].Pos[1];
+            pz[k] = P[other].Pos[2];
+            double dist = iter->Hsml;
+            if(iter->symmetric == NGB_TREEFIND_SYMMETRIC)
+                dist = DMAX(P[other].Hsml, iter->Hsml);
+            h2[k] = dist * dist;
+            /* skip garbage, and candidates of the wrong type or time bin */
+            if(P[other].IsGarbage || !((1<<P[other].Type) & iter->mask)
+                || (splitbins && !(BINMASK(P[other].TimeBin) & lv->tw->bgmask)))
+                h2[k] = -1;
+        }
+
+        /* the distance vector points to 'other' */
+        #pragma omp simd
+        for(k = 0; k < nb; k++) {
+            dx[k] = NEAREST(pos[0] - px[k], BoxSize);
+            dy[k] = NEAREST(pos[1] - py[k], BoxSize);
+            dz[k] = NEAREST(pos[2] - pz[k], BoxSize);
+            r2[k] = dx[k] * dx[k] + dy[k] * dy[k] + dz[k] * dz[k];
+        }
+
+        /* Compact the list to the neighbours inside the search radius*/
+        for(k = 0; k < nb; k++) {
+            sel[nsel] = k;
+            nsel += (r2[k] <= h2[k]);
+        }
+
+        /* update the iter and call the iteration function*/
+        for(k = 0; k < nsel; k++) {
+            const int j = sel[k];
+            iter->dist[0] = dx[j];
+            iter->dist[1] = dy[j];
+            iter->dist[2] = dz[j];
+            iter->r2 = r2[j];
+            iter->r = sqrt(r2[j]);
+            iter->other = ngblist[start + j];
+
+            ngbiter(I, O, iter, lv);
+        }
+    }
+}
+
+/* Visit the neighbours of a query with ngbiter. iter is storage for the iterator
+ * of the evaluator, ngbiter_type_elsize bytes long. Returns -1 if the export buffer is full.*/
+static inline __attribute__((always_inline)) int
+treewalk_visit_ngbiter_with(TreeWalkQueryBase * I, TreeWalkResultBase * O, TreeWalkNgbIterBase * iter,
+        LocalTreeWalk * lv, const TreeWalkNgbIterFunction ngbiter)
+{
+    /* Kick-start the iteration with other == -1 */
+    iter->other = -1;
+    iter->finish = 0;
+    ngbiter(I, O, iter, lv);
+
+    int64_t ninteractions = 0;
+    int inode;
+
+    for(inode = 0; inode < NODELISTLENGTH && I->NodeList[inode] >= 0; inode++)
+    {
+        const int * ngblist;
+        const int numcand = treewalk_ngb_candidates(I, O, iter, inode, lv, &ngblist);
+        /* Export buffer is full end prematurally */
+        if(numcand < 0)
+            return numcand;
+
+        /* If we are here, export is succesful. Work on the this particle -- first
+         * filter out all of the candidates that are actually outside. */
+        treewalk_ngb_filter_candidates(I, O, iter, ngblist, numcand, lv, ngbiter);
+        treewalk_ngb_release(lv);
+
+        ninteractions += numcand;
+    }
+
+    if(iter->finish) {
+        iter->other = -2;
+        ngbiter(I, O, iter, lv);
+    }
+
+    lv->Ninteractions += ninteractions;
+    if(lv->mode == 1) {
+        lv->Nnodesinlist += inode;
+        lv->Nlist += 1;
+    }
+    return 0;
+}
+
+/* Define a static visit function, name, which walks the neighbours with the ngbiter function
+ * of the module and an iterator of type itertype. Use it after ngbiter is declared, and set
+ * tw->visit = name instead of treewalk_visit_ngbiter. For example:
+ *   TREEWALK_DEFINE_NGBITER_VISIT(density_visit, density_ngbiter, TreeWalkNgbIterDensity)
+ * The ngbiter is passed through TreeWalkNgbIterFunction, as when it is stored in tw->ngbiter.*/
+#define TREEWALK_DEFINE_NGBITER_VISIT(name, ngbiter, itertype) \
+static int \
+name(TreeWalkQueryBase * I, TreeWalkResultBase * O, LocalTreeWalk * lv) \
+{ \
+    itertype iter[1]; \
+    return treewalk_visit_ngbiter_with(I, O, (TreeWalkNgbIterBase *) iter, lv, (TreeWalkNgbIterFunction) ngbiter); \
+}
+
+#endif
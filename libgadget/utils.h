@@ -21,4 +21,6 @@
 #include "utils/endrun.h"
 #include "utils/interp.h"
 #include "utils/spinlocks.h"
+#include "utils/taskgraph.h"
+#include "utils/threads.h"
 #endif
@@ -149,6 +149,8 @@ void
 endrun(int where, const char * fmt, ...)
 {
 
+    /* Print the messages this rank buffered, and then the error at once*/
+    MPIU_Trace_aggregate(0);
     va_list va;
     va_start(va, fmt);
     MPIU_Tracev(MPI_COMM_WORLD, where, fmt, va);
@@ -2,12 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 
-int
-event_listen(EventSpec * eh, eventfunc func, void * userdata)
+static int
+event_add_handler(EventSpec * eh, eventfunc func, eventbatchfunc batchfunc, void * userdata)
 {
     int i;
     for(i = 0; i < eh->used; i ++) {
-        if(eh->h[i].func == func && eh->h[i].userdata == userdata) {
+        if(eh->h[i].func == func && eh->h[i].batchfunc == batchfunc && eh->h[i].userdata == userdata) {
             return 0;
         }
     }
@@ -17,17 +17,18 @@ event_listen(EventSpec * eh, eventfunc func, void * userdata)
     }
 
     eh->h[eh->used].func = func;
+    eh->h[eh->used].batchfunc = batchfunc;
     eh->h[eh->used].userdata = userdata;
     eh->used ++;
     return 0;
 }
 
-int
-event_unlisten(EventSpec * eh, eventfunc func, void * userdata)
+static int
+event_remove_handler(EventSpec * eh, eventfunc func, eventbatchfunc batchfunc, void * userdata)
 {
     int i;
     for(i = 0; i < eh->used; i ++) {
-        if(eh->h[i].func == func && eh->h[i].userdata == userdata) {
+        if(eh->h[i].func == func && eh->h[i].batchfunc == batchfunc && eh->h[i].userdata == userdata) {
             break;
         }
     }
@@ -39,6 +40,29 @@ event_unlisten(EventSpec * eh, eventfunc func, void * userdata)
     return 0;
 }
 
+int
+event_listen(EventSpec * eh, eventfunc func, void * userdata)
+{
+    return event_add_handler(eh, func, NULL, userdata);
+}
+
+int
+event_unlisten(EventSpec * eh, eventfunc func, void * userdata)
+{
+    return event_remove_handler(eh, func, NULL, userdata);
+}
+
+int
+event_listen_batch(EventSpec * eh, eventbatchfunc func, void * userdata)
+{
+    return event_add_handler(eh, NULL, func, userdata);
+}
+
+int
+event_unlisten_batch(EventSpec * eh, eventbatchfunc func, void * userdata)
+{
+    return event_remove_handler(eh, NULL, func, userdata);
+}
 
 int
 event_emit(EventSpec * eh, EIBase * event)
@@ -46,7 +70,29 @@ event_emit(EventSpec * eh, EIBase * event)
 
     int i;
     for(i = 0; i < eh->used; i ++) {
-        eh->h[i].func(event, eh->h[i].userdata);
+        if(eh->h[i].batchfunc)
+            eh->h[i].batchfunc(event, 1, eh->h[i].userdata);
+        else
+            eh->h[i].func(event, eh->h[i].userdata);
+    }
+    return 0;
+}
+
+int
+event_emit_batch(EventSpec * eh, EIBase * events, int nevent, size_t elsize)
+{
+    if(nevent <= 0)
+        return 0;
+
+    int i;
+    for(i = 0; i < eh->used; i ++) {
+        if(eh->h[i].batchfunc) {
+            eh->h[i].batchfunc(events, nevent, eh->h[i].userdata);
+            continue;
+        }
+        int j;
+        for(j = 0; j < nevent; j ++)
+            eh->h[i].func((EIBase *) ((char *) events + j * elsize), eh->h[i].userdata);
     }
     return 0;
 }
@@ -54,4 +100,3 @@ event_emit(EventSpec * eh, EIBase * event)
 EventSpec EventSlotsFork = {"SlotsFork", 0, {{0}}};
 EventSpec EventSlotsAfterGC = {"SlotsAfterGC", 0, {{0}}};
 
-
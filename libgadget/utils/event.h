@@ -1,6 +1,7 @@
 #ifndef _EVENT_H_
 #define _EVENT_H_
 
+#include <stddef.h>
 
 typedef struct EventHandler EventHandler;
 
@@ -10,10 +11,13 @@ typedef struct {
 } EIBase;
 
 typedef int (*eventfunc) (EIBase * event, void * userdata);
+/* A listener for an array of nevent events of the same type.*/
+typedef int (*eventbatchfunc) (EIBase * events, int nevent, void * userdata);
 
 struct EventHandler
 {
     eventfunc func;
+    eventbatchfunc batchfunc;
     void * userdata;
 };
 
@@ -35,6 +39,19 @@ event_unlisten(EventSpec * e, eventfunc func, void * userdata);
 int
 event_emit(EventSpec * eh, EIBase * event);
 
+/* Listen with a function which takes all the events of event_emit_batch in one call.
+ * event_emit calls it with a single event.*/
+int
+event_listen_batch(EventSpec * e, eventbatchfunc func, void * userdata);
+
+int
+event_unlisten_batch(EventSpec * e, eventbatchfunc func, void * userdata);
+
+/* Emit nevent events, stored in an array with elements of elsize bytes.
+ * Batch listeners get the whole array, the others each event in turn.*/
+int
+event_emit_batch(EventSpec * eh, EIBase * events, int nevent, size_t elsize);
+
 /* A new particle is formed by spliting an existing particle. */
 extern EventSpec EventSlotsFork;
 /* GC is done, things may have been violated. */
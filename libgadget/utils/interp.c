@@ -63,70 +63,105 @@ static ptrdiff_t linearindex(ptrdiff_t * strides, int * xi, int Ndim) {
     return rt;
 }
 
-/* status:
- * 0 if interplation is good on that axis
- * -1 below
- * +1 above 
- * status needs to be array of Ndim
- * */
-double interp_eval(Interp * obj, double * x, double * ydata, int * status) {
-    int d;
-    if(status == NULL) {
-        status = alloca(sizeof(int) * obj->Ndim);
+/* Find the cell of x on an axis with grid points Min + i * Step, i = 0 .. last:
+ * returns the lower grid point and sets f to the weight of the upper one.
+ * Outside the table the end point is used and status is -1 below, +1 above.
+ * The lower point is kept below the last grid point, so that the upper point
+ * is always inside the table: at the end of the axis f = 1.*/
+static inline int
+interp_locate(const double x, const double Min, const double Max, const double Step, const int last, double * f, int * status)
+{
+    double xd = (x - Min) / Step;
+    *status = 0;
+    if(x < Min) {
+        *status = -1;
+        xd = 0;
     }
-    int * xi = alloca(sizeof(int) * obj->Ndim);
-    double * f = alloca(sizeof(double) * obj->Ndim);
-
-    for(d = 0; d < obj->Ndim; d++) {
-        double xd = (x[d] - obj->Min[d]) / obj->Step[d];
-        if (x[d] < obj->Min[d]) {
-            status[d] = -1;
-            xi[d] = 0;
-            f[d] = 0;
-        } else
-        if (x[d] > obj->Max[d]) {
-            status[d] = 1;
-            xi[d] = obj->dims[d] - 1;
-            f[d] = 0;
-        } else {
-            xi[d] = floor(xd);
-            f[d] = xd - xi[d];
-            status[d] = 0;
-        }
+    if(x > Max) {
+        *status = 1;
+        xd = last;
     }
+    int xi = floor(xd);
+    if(xi > last - 1)
+        xi = last - 1;
+    /* An axis with one point*/
+    if(xi < 0)
+        xi = 0;
+    *f = xd - xi;
+    return xi;
+}
 
-    double ret = 0;
-    /* the origin, "this point" */
-    ptrdiff_t l0 = linearindex(obj->strides, xi, obj->Ndim);
+/* Interpolate at n points in Ndim dimensions. Ndim is a compile time constant
+ * in the 2D and 3D fast paths, so the loops over dimensions and corners are unrolled.
+ * The weights of all 2^Ndim corners are summed in the order of interp_eval,
+ * including the zero weights at the ends of the table.*/
+static inline __attribute__((always_inline)) void
+interp_eval_many_ndim(const Interp * obj, const double * x, const double * ydata, double * out, const ptrdiff_t n, int * status, const int Ndim)
+{
+    /* Hoisted setup. upper is the offset of the upper neighbour on each axis,
+     * zero for an axis with one point*/
+    double Min[Ndim], Max[Ndim], Step[Ndim];
+    ptrdiff_t strides[Ndim], upper[Ndim];
+    int last[Ndim];
+    int d;
+    for(d = 0; d < Ndim; d++) {
+        Min[d] = obj->Min[d];
+        Max[d] = obj->Max[d];
+        Step[d] = obj->Step[d];
+        last[d] = obj->dims[d] - 1;
+        strides[d] = obj->strides[d];
+        upper[d] = obj->dims[d] > 1 ? obj->strides[d] : 0;
+    }
 
-    int i;
-    /* for each point covered by the filter */
-    for(i = 0; i < obj->fsize; i ++) {
-        double filter = 1.0;
-        ptrdiff_t l = l0;
-        int skip = 0;
-        for(d = 0; d < obj->Ndim; d++ ) {
-            int foffset = (i & (1 << d))?1:0;
-            if(f[d] == 0 && foffset == 1) {
-                /* on this dimension the second data point 
-                 * is not needed */
-                skip = 1;
-                break;
+    const int fsize = 1 << Ndim;
+    ptrdiff_t k;
+    for(k = 0; k < n; k++) {
+        double f[Ndim];
+        int st[Ndim];
+        ptrdiff_t l0 = 0;
+        for(d = 0; d < Ndim; d++)
+            l0 += interp_locate(x[k * Ndim + d], Min[d], Max[d], Step[d], last[d], &f[d], &st[d]) * strides[d];
+
+        double ret = 0;
+        int i;
+        /* for each point covered by the filter */
+        for(i = 0; i < fsize; i ++) {
+            double filter = 1.0;
+            ptrdiff_t l = l0;
+            for(d = 0; d < Ndim; d++ ) {
+                /*
+                 * are we on this point or next point?
+                 *
+                 * weight on next point is f[d]
+                 * weight on this point is 1 - f[d]
+                 * */
+                const int foffset = (i & (1 << d))?1:0;
+                filter *= foffset?f[d] : (1 - f[d]);
+                l += foffset * upper[d];
             }
-
-            /* 
-             * are we on this point or next point?
-             *
-             * weight on next point is f[d]
-             * weight on this point is 1 - f[d] 
-             * */
-            filter *= foffset?f[d] : (1 - f[d]);
-            l += foffset * obj->strides[d];
-        }
-        if(!skip) {
             ret += ydata[l] * filter;
         }
+        out[k] = ret;
+        if(status)
+            for(d = 0; d < Ndim; d++)
+                status[k * Ndim + d] = st[d];
     }
+}
+
+void
+interp_eval_many(Interp * obj, const double * x, const double * ydata, double * out, const ptrdiff_t n, int * status)
+{
+    if(obj->Ndim == 3)
+        interp_eval_many_ndim(obj, x, ydata, out, n, status, 3);
+    else if(obj->Ndim == 2)
+        interp_eval_many_ndim(obj, x, ydata, out, n, status, 2);
+    else
+        interp_eval_many_ndim(obj, x, ydata, out, n, status, obj->Ndim);
+}
+
+double interp_eval(Interp * obj, double * x, double * ydata, int * status) {
+    double ret;
+    interp_eval_many(obj, x, ydata, &ret, 1, status);
     return ret;
 }
 
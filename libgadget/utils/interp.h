@@ -21,10 +21,14 @@ void interp_init(Interp * obj, int Ndim, int * dims);
 void interp_init_dim(Interp * obj, int d, double Min, double Max);
 
 /* interpolate the table at point x; 
- * status: array of length dimension,
+ * status: array of length dimension, or NULL,
  * will be -1 if below lower bound
  *         +1 if above upper bound  */
 double interp_eval(Interp * obj, double * x, double * ydata, int * status);
+/* interpolate the table at the n points x[n][Ndim], storing the values in out.
+ * status is optional: if not NULL it is an array of n * Ndim flags, as for interp_eval.
+ * The setup is done once for all points, with fast paths for 2 and 3 dimensions. */
+void interp_eval_many(Interp * obj, const double * x, const double * ydata, double * out, const ptrdiff_t n, int * status);
 double interp_eval_periodic(Interp * obj, double * x, double * ydata);
 
 void interp_destroy(Interp * obj);
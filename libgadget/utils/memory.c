@@ -2,6 +2,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#ifdef USE_MEMKIND
+#include <hbwmalloc.h>
+#endif
 #include "memory.h"
 #include "endrun.h"
 
@@ -20,6 +26,8 @@ struct BlockHeader {
     char annotation[];
 } ;
 
+static int is_header(struct BlockHeader * header);
+
 int
 allocator_init(Allocator * alloc, const char * name, size_t request_size, int zero, Allocator * parent)
 {
@@ -38,13 +46,130 @@ allocator_init(Allocator * alloc, const char * name, size_t request_size, int ze
     alloc->base = ((char*) rawbase) + ALIGNMENT - ((size_t) rawbase % ALIGNMENT);
     alloc->size = size;
     alloc->use_malloc = 0;
+    alloc->mmap_size = 0;
+    alloc->hugepages = ALLOC_PAGES_NORMAL;
+    alloc->hbw = 0;
     strncpy(alloc->name, name, 11);
 
     allocator_reset(alloc, zero);
+    alloc->peak = 0;
+    alloc->peak_name[0] = '\0';
+    alloc->interval_peak = 0;
 
     return 0;
 }
 
+int
+allocator_hbw_init(Allocator * alloc, const char * name, size_t request_size, int zero)
+{
+#ifdef USE_MEMKIND
+    if(hbw_check_available() != 0)
+        return ALLOC_ENOMEMORY;
+    size_t size = (request_size / ALIGNMENT + 1) * ALIGNMENT;
+
+    void * rawbase;
+    /* Fail rather than fall back to DDR: the caller decides what goes there instead*/
+    hbw_set_policy(HBW_POLICY_BIND);
+    if(0 != hbw_posix_memalign(&rawbase, ALIGNMENT, size))
+        return ALLOC_ENOMEMORY;
+
+    alloc->parent = NULL;
+    alloc->rawbase = rawbase;
+    alloc->base = rawbase;
+    alloc->size = size;
+    alloc->use_malloc = 0;
+    alloc->mmap_size = 0;
+    alloc->hugepages = ALLOC_PAGES_NORMAL;
+    alloc->hbw = 1;
+    strncpy(alloc->name, name, 11);
+
+    allocator_reset(alloc, zero);
+    alloc->peak = 0;
+    alloc->peak_name[0] = '\0';
+    alloc->interval_peak = 0;
+    return 0;
+#else
+    return ALLOC_ENOMEMORY;
+#endif
+}
+
+#ifdef __linux__
+/* From linux/mman.h: the log2 of the huge page size goes in the bits above MAP_HUGE_SHIFT*/
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+/* Map size bytes backed by the pages in hugepages, or return NULL*/
+static void *
+allocator_mmap_pages(size_t size, int hugepages)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if(hugepages == ALLOC_PAGES_HUGE_2MB || hugepages == ALLOC_PAGES_HUGE_1GB) {
+#ifdef MAP_HUGETLB
+        flags |= MAP_HUGETLB;
+        flags |= (hugepages == ALLOC_PAGES_HUGE_2MB ? 21 : 30) << MAP_HUGE_SHIFT;
+#else
+        return NULL;
+#endif
+    }
+    void * ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if(ptr == MAP_FAILED)
+        return NULL;
+    return ptr;
+}
+#endif
+
+int
+allocator_mmap_init(Allocator * alloc, const char * name, size_t request_size, int zero, int hugepages)
+{
+#ifdef __linux__
+    size_t size = (request_size / ALIGNMENT + 1) * ALIGNMENT;
+
+    void * rawbase = NULL;
+    size_t mapsize = 0;
+    /* Try each kind of explicit huge page no larger than the one asked for.
+     * The mapping must be a whole number of huge pages.*/
+    for(; hugepages >= ALLOC_PAGES_HUGE_2MB; hugepages--) {
+        const size_t pagesize = 1L << (hugepages == ALLOC_PAGES_HUGE_2MB ? 21 : 30);
+        mapsize = (size + pagesize - 1) / pagesize * pagesize;
+        rawbase = allocator_mmap_pages(mapsize, hugepages);
+        if(rawbase)
+            break;
+    }
+    if(!rawbase) {
+        mapsize = size;
+        rawbase = allocator_mmap_pages(mapsize, ALLOC_PAGES_NORMAL);
+        if(!rawbase)
+            return ALLOC_ENOMEMORY;
+#ifdef MADV_HUGEPAGE
+        if(hugepages == ALLOC_PAGES_TRANSPARENT && 0 != madvise(rawbase, mapsize, MADV_HUGEPAGE))
+            hugepages = ALLOC_PAGES_NORMAL;
+#else
+        hugepages = ALLOC_PAGES_NORMAL;
+#endif
+    }
+
+    alloc->parent = NULL;
+    alloc->rawbase = rawbase;
+    /* mmap is page aligned*/
+    alloc->base = rawbase;
+    alloc->size = size;
+    alloc->use_malloc = 0;
+    alloc->mmap_size = mapsize;
+    alloc->hugepages = hugepages;
+    alloc->hbw = 0;
+    strncpy(alloc->name, name, 11);
+
+    /* Fresh mappings are already zero*/
+    allocator_reset(alloc, 0);
+    alloc->peak = 0;
+    alloc->peak_name[0] = '\0';
+    alloc->interval_peak = 0;
+    return 0;
+#else
+    return allocator_init(alloc, name, request_size, zero, NULL);
+#endif
+}
+
 int
 allocator_malloc_init(Allocator * alloc, const char * name, size_t request_size, int zero, Allocator * parent)
 {
@@ -61,12 +186,18 @@ allocator_malloc_init(Allocator * alloc, const char * name, size_t request_size,
 
     alloc->parent = parent;
     alloc->use_malloc = 1;
+    alloc->mmap_size = 0;
+    alloc->hugepages = ALLOC_PAGES_NORMAL;
+    alloc->hbw = 0;
     alloc->rawbase = rawbase;
     alloc->base = rawbase;
     alloc->size = size;
     strncpy(alloc->name, name, 11);
 
     allocator_reset(alloc, zero);
+    alloc->peak = 0;
+    alloc->peak_name[0] = '\0';
+    alloc->interval_peak = 0;
 
     return 0;
 }
@@ -84,6 +215,20 @@ allocator_reset(Allocator * alloc, int zero)
     return 0;
 }
 
+/* Record the high-water marks after the block name has grown the used memory*/
+static void
+allocator_update_peak(Allocator * alloc, const char * name)
+{
+    const size_t used = allocator_get_used_size(alloc, ALLOC_DIR_BOTH);
+    if(used > alloc->interval_peak)
+        alloc->interval_peak = used;
+    if(used > alloc->peak) {
+        alloc->peak = used;
+        strncpy(alloc->peak_name, name, sizeof(alloc->peak_name) - 1);
+        alloc->peak_name[sizeof(alloc->peak_name) - 1] = '\0';
+    }
+}
+
 static void *
 allocator_alloc_va(Allocator * alloc, const char * name, size_t request_size, int dir, char * fmt, va_list va)
 {
@@ -118,6 +263,8 @@ allocator_alloc_va(Allocator * alloc, const char * name, size_t request_size, in
         return NULL;
     }
 
+    allocator_update_peak(alloc, name);
+
     struct BlockHeader * header = ptr;
     memcpy(header->magic, MAGIC, 8);
     header->self = ptr;
@@ -134,6 +281,8 @@ allocator_alloc_va(Allocator * alloc, const char * name, size_t request_size, in
     if(alloc->use_malloc) {
         /* prepend a copy of the header to the malloc block; allocator_free will use it*/
         cptr = malloc(request_size + ALIGNMENT);
+        if(cptr == NULL)
+            endrun(1, "Not enough memory for %s %td bytes\n", name, request_size);
         header->ptr = cptr + ALIGNMENT;
         memcpy(cptr, header, ALIGNMENT);
         cptr += ALIGNMENT;
@@ -153,6 +302,30 @@ allocator_alloc(Allocator * alloc, const char * name, size_t request_size, int d
     return rt;
 }
 
+void *
+allocator_alloc_prefer(Allocator * fast, Allocator * fallback, const char * name, size_t request_size, int dir, char * fmt, ...)
+{
+    /* The block and its header, rounded as allocator_alloc_va does*/
+    const size_t size = ((request_size + ALIGNMENT - 1) / ALIGNMENT) * ALIGNMENT + ALIGNMENT;
+    Allocator * alloc = fallback;
+    if(fast->size > 0 && allocator_get_free_size(fast) >= size)
+        alloc = fast;
+    va_list va;
+    va_start(va, fmt);
+    void * rt = allocator_alloc_va(alloc, name, request_size, dir, fmt, va);
+    va_end(va);
+    return rt;
+}
+
+Allocator *
+allocator_owner(void * ptr)
+{
+    struct BlockHeader * header = (struct BlockHeader*) ((char *) ptr - ALIGNMENT);
+    if (!is_header(header))
+        endrun(1, "Not an allocated address: Header = %08p ptr = %08p\n", header, ptr);
+    return header->alloc;
+}
+
 int
 allocator_destroy(Allocator * alloc)
 {
@@ -162,11 +335,44 @@ allocator_destroy(Allocator * alloc)
     }
     if(alloc->parent)
         allocator_dealloc(alloc->parent, alloc->rawbase);
+#ifdef __linux__
+    else if(alloc->mmap_size)
+        munmap(alloc->rawbase, alloc->mmap_size);
+#endif
+#ifdef USE_MEMKIND
+    else if(alloc->hbw)
+        hbw_free(alloc->rawbase);
+#endif
     else
         free(alloc->rawbase);
     return 0;
 }
 
+int
+allocator_split_threads(Allocator * parent, Allocator * children, const int nthread, const char * name, size_t size)
+{
+    int i;
+    for(i = 0; i < nthread; i++) {
+        int rt = allocator_init(&children[i], name, size, 0, parent);
+        if(rt != 0)
+            return rt;
+    }
+    return 0;
+}
+
+int
+allocator_destroy_threads(Allocator * children, const int nthread)
+{
+    int i;
+    /* The children are blocks of the parent, so go in reverse order.
+     * Anything still allocated from a child is dropped with it.*/
+    for(i = nthread - 1; i >= 0; i--) {
+        allocator_reset(&children[i], 0);
+        allocator_destroy(&children[i]);
+    }
+    return 0;
+}
+
 int
 allocator_iter_start(
         AllocatorIter * iter,
@@ -248,6 +454,18 @@ allocator_get_used_size(Allocator * alloc, int dir)
     return 0;
 }
 
+size_t
+allocator_get_interval_peak(Allocator * alloc)
+{
+    return alloc->interval_peak;
+}
+
+void
+allocator_reset_peak(Allocator * alloc)
+{
+    alloc->interval_peak = allocator_get_used_size(alloc, ALLOC_DIR_BOTH);
+}
+
 void
 allocator_print(Allocator * alloc)
 {
@@ -262,6 +480,7 @@ allocator_print(Allocator * alloc)
             allocator_get_used_size(alloc, ALLOC_DIR_TOP),
             allocator_get_used_size(alloc, ALLOC_DIR_BOT)
             );
+    message(1, " Peak: %010td reached by %s\n", alloc->peak, alloc->peak_name);
     AllocatorIter iter[1];
     message(1, " %-20s | %c | %-10s %-10s | %s\n", "Name", 'd', "Requested", "Allocated", "Annotation");
     message(1, "-------------------------------------------------------\n");
@@ -322,6 +541,58 @@ allocator_realloc_int(Allocator * alloc, void * ptr, size_t new_size, char * fmt
     return newptr;
 }
 
+int
+allocator_realloc_under(Allocator * alloc, void ** ptr, size_t new_size, void ** above)
+{
+    struct BlockHeader * header = (struct BlockHeader*) ((char *) *ptr - ALIGNMENT);
+    if (!is_header(header) || header->dir != ALLOC_DIR_BOT)
+        return ALLOC_ENOTALLOC;
+
+    /* The headers in the allocator: the block above must be the only one after ptr*/
+    char * self = header->self;
+    char * next = self + header->size;
+    char * end = (char *) alloc->base + alloc->bottom;
+    struct BlockHeader * aheader = NULL;
+    if(above) {
+        aheader = (struct BlockHeader*) ((char *) *above - ALIGNMENT);
+        if(!is_header(aheader) || aheader->self != next)
+            return ALLOC_EMISMATCH;
+        next += ((struct BlockHeader *) aheader->self)->size;
+    }
+    if(next != end)
+        return ALLOC_EMISMATCH;
+
+    if(alloc->use_malloc) {
+        /* Only ptr changes: above is a separate malloc block*/
+        struct BlockHeader * header2 = realloc(header, new_size + ALIGNMENT);
+        if(!header2)
+            return ALLOC_ENOMEMORY;
+        header2->ptr = (char*) header2 + ALIGNMENT;
+        header2->request_size = new_size;
+        memcpy(header2->self, header2, sizeof(header2[0]));
+        *ptr = header2->ptr;
+        return 0;
+    }
+
+    const size_t size = ((new_size + ALIGNMENT - 1) / ALIGNMENT) * ALIGNMENT + ALIGNMENT;
+    const ptrdiff_t shift = size - header->size;
+    if(shift > 0 && alloc->bottom + shift > alloc->top)
+        return ALLOC_ENOMEMORY;
+
+    if(aheader) {
+        memmove((char *) aheader + shift, aheader, aheader->size);
+        aheader = (struct BlockHeader *) ((char *) aheader + shift);
+        aheader->self = aheader;
+        aheader->ptr = (char *) aheader + ALIGNMENT;
+        *above = aheader->ptr;
+    }
+    header->size = size;
+    header->request_size = new_size;
+    alloc->bottom += shift;
+    allocator_update_peak(alloc, header->name);
+    return 0;
+}
+
 void
 allocator_free (void * ptr)
 {
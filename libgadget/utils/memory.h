@@ -13,6 +13,16 @@ typedef struct Allocator Allocator;
 #define ALLOC_DIR_BOT +1
 #define ALLOC_DIR_BOTH 0
 
+/* Kinds of pages backing an allocator from allocator_mmap_init*/
+enum AllocHugePages {
+    ALLOC_PAGES_NORMAL = 0,
+    /* Normal pages, which the kernel may merge into transparent huge pages*/
+    ALLOC_PAGES_TRANSPARENT = 1,
+    /* Explicit huge pages from the hugetlbfs pool*/
+    ALLOC_PAGES_HUGE_2MB = 2,
+    ALLOC_PAGES_HUGE_1GB = 3,
+};
+
 struct Allocator {
     char name[12];
     Allocator * parent;
@@ -26,6 +36,18 @@ struct Allocator {
 
     int refcount;
     int use_malloc; /* only do the book keeping. delegate to libc malloc/free */
+    /* Length of the mapping if rawbase is from mmap, or 0 if it is from malloc or the parent*/
+    size_t mmap_size;
+    /* An AllocHugePages: the pages which actually back the allocator*/
+    int hugepages;
+    /* rawbase is from hbw_malloc, in high-bandwidth memory*/
+    int hbw;
+
+    /* High-water mark of the used size since allocator_init, and the block which reached it*/
+    size_t peak;
+    char peak_name[32];
+    /* High-water mark since the last allocator_reset_peak, for reports by phase*/
+    size_t interval_peak;
 };
 
 typedef struct AllocatorIter AllocatorIter;
@@ -47,6 +69,17 @@ struct AllocatorIter {
 int
 allocator_init(Allocator * alloc, const char * name, size_t size, int zero, Allocator * parent);
 
+/* Like allocator_init with no parent, but map the memory with mmap, asking for the pages in hugepages.
+ * If those are not available, falls back to transparent huge pages and then normal pages:
+ * alloc->hugepages says which were used.*/
+int
+allocator_mmap_init(Allocator * alloc, const char * name, size_t request_size, int zero, int hugepages);
+
+/* Like allocator_init with no parent, but in high-bandwidth memory (KNL MCDRAM or HBM) from memkind.
+ * Returns ALLOC_ENOMEMORY if there is no high-bandwidth memory or the code is built without USE_MEMKIND.*/
+int
+allocator_hbw_init(Allocator * alloc, const char * name, size_t request_size, int zero);
+
 int
 allocator_malloc_init(Allocator * alloc,
         const char * name, size_t size, int zero, Allocator * parent
@@ -58,12 +91,31 @@ allocator_split(Allocator * alloc, Allocator * parent, const char * name, size_t
 int
 allocator_destroy(Allocator * alloc);
 
+/* Carve nthread sub-allocators of size bytes each out of parent, one for each thread.
+ * Each is only used by its own thread, so needs no locking, and is emptied in O(1)
+ * by allocator_reset. Free them with allocator_destroy_threads, which also
+ * drops anything still allocated from them.*/
+int
+allocator_split_threads(Allocator * parent, Allocator * children, const int nthread, const char * name, size_t size);
+
+int
+allocator_destroy_threads(Allocator * children, const int nthread);
+
 void *
 allocator_alloc(Allocator * alloc, const char * name, size_t size, int dir, char * fmt, ...);
 
 void *
 allocator_realloc_int(Allocator * alloc, void * ptr, size_t size, char * fmt, ...);
 
+/* Allocate from fast if the block fits in its free memory, otherwise from fallback.
+ * Either way the block is freed with allocator_free, and resized in the allocator from allocator_owner.*/
+void *
+allocator_alloc_prefer(Allocator * fast, Allocator * fallback, const char * name, size_t size, int dir, char * fmt, ...);
+
+/* The allocator which owns the block ptr*/
+Allocator *
+allocator_owner(void * ptr);
+
 #define allocator_alloc_bot(alloc, name, size) \
     allocator_alloc(alloc, name, size, ALLOC_DIR_BOT, "%s:%d", __FILE__, __LINE__)
 
@@ -73,6 +125,13 @@ allocator_realloc_int(Allocator * alloc, void * ptr, size_t size, char * fmt, ..
 #define allocator_realloc(alloc, ptr, size) \
     allocator_realloc_int(alloc, ptr, size, "%s:%d", __FILE__, __LINE__)
 
+/* Resize the bottom block *ptr, which is followed only by the bottom block *above, or by nothing if above is NULL.
+ * The block above is moved by the change in size: *above is set to its new address, and the caller must update any
+ * pointers into it. Returns 0, ALLOC_ENOMEMORY if there is not enough free memory, or ALLOC_EMISMATCH if other
+ * blocks were allocated after *ptr. Only with use_malloc may *ptr change.*/
+int
+allocator_realloc_under(Allocator * alloc, void ** ptr, size_t new_size, void ** above);
+
 /* free like API, will look up allocator pointer. */
 void
 allocator_free(void * ptr);
@@ -86,6 +145,14 @@ allocator_get_free_size(Allocator * alloc);
 size_t
 allocator_get_used_size(Allocator * alloc, int dir);
 
+/* Returns the largest used size since allocator_reset_peak was last called*/
+size_t
+allocator_get_interval_peak(Allocator * alloc);
+
+/* Start a new interval for allocator_get_interval_peak at the current used size*/
+void
+allocator_reset_peak(Allocator * alloc);
+
 int
 allocator_iter_ended(AllocatorIter * iter);
 
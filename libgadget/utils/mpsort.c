@@ -180,29 +180,14 @@ void _setup_radix_sort(
 
 /****
  * sort by radix;
- * internally this uses qsort_r of glibc.
+ * internally this uses the threaded LSD radix sort of openmpsort.
  *
  **** */
-static struct crstruct _cacr_d;
-
-/* implementation ; internal */
-static int _compute_and_compar_radix(const void * p1, const void * p2) {
-    char r1[_cacr_d.rsize], r2[_cacr_d.rsize];
-    _cacr_d.radix(p1, r1, _cacr_d.arg);
-    _cacr_d.radix(p2, r2, _cacr_d.arg);
-    int c1 = _cacr_d.compar(r1, r2, _cacr_d.rsize);
-    return c1;
-}
-
 static void radix_sort(void * base, size_t nmemb, size_t size,
         void (*radix)(const void * ptr, void * radix, void * arg),
         size_t rsize,
         void * arg) {
-
-    memset(&_cacr_d, 0, sizeof(struct crstruct));
-    _setup_radix_sort(&_cacr_d, base, nmemb, size, radix, rsize, arg);
-
-    qsort_openmp(_cacr_d.base, _cacr_d.nmemb, _cacr_d.size, _compute_and_compar_radix);
+    radix_sort_openmp(base, nmemb, size, radix, rsize, arg);
 }
 
 
@@ -749,6 +734,8 @@ mpsort_mpi_impl (void * mybase, size_t mynmemb, size_t size,
 
 static int
 mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o, struct TIMER * tmr);
+static int
+mpsort_mpi_sample_sort(struct crstruct d, struct crmpistruct o, struct TIMER * tmr);
 
 static void
 MPIU_Scatter (MPI_Comm comm, int root, const void * sendbuffer, void * recvbuffer, int nrecv, size_t elsize, int * totalnsend);
@@ -886,7 +873,10 @@ mpsort_mpi_newarray_impl (void * mybase, size_t mynmemb,
 
         _setup_mpsort_mpi(&o, &d, myoutsegmentbase, myoutsegmentnmemb, seggrp->Leaders);
 
-        mpsort_mpi_histogram_sort(d, o, tmr);
+        if(mpsort_mpi_has_options(MPSORT_SAMPLE_SORT))
+            mpsort_mpi_sample_sort(d, o, tmr);
+        else
+            mpsort_mpi_histogram_sort(d, o, tmr);
 
         _destroy_mpsort_mpi(&o);
     }
@@ -1273,6 +1263,285 @@ mpsort_mpi_histogram_sort(struct crstruct d, struct crmpistruct o, struct TIMER
     return 0;
 }
 
+/*
+ * Regular sampling sort.
+ *
+ * The histogram sort above needs one pair of Allreduces per bisection of the splitters,
+ * which is up to the number of bits in the radix. Here the number of collective operations
+ * is fixed: each rank sends evenly spaced samples of its sorted array to rank 0, which
+ * picks the splitters, every item is sent to the rank of its bucket, and a final exchange
+ * moves the sorted buckets to the requested output layout, which is a shift of contiguous ranges.
+ *
+ * Samples and splitters are made unique by appending the rank and local index of the item,
+ * so a run of equal radixes is divided between buckets instead of all landing in one.
+ * The buckets hold at most about nmemb / NTask + 2 nmemb / (NTask * nsample) items;
+ * if a bucket does not fit in memory we fall back to the histogram sort.
+ * */
+
+/* Largest number of samples gathered on rank 0 */
+#define MPSORT_MAX_TOTAL_SAMPLES (1 << 22)
+
+/* A sample is the item radix extended by the rank and index of the item,
+ * laid out so the extended radix compares as one larger integer, followed by a weight.*/
+struct SampleLayout {
+    size_t rsize;
+    /* Size of the extended radix*/
+    size_t krsize;
+    /* Size of a sample, including the weight*/
+    size_t ssize;
+    size_t keyoff;
+    size_t taskoff;
+    size_t indexoff;
+};
+
+static void
+_sample_layout(struct SampleLayout * sl, size_t rsize)
+{
+    union {
+        uint32_t i;
+        char c[4];
+    } be_detect = {0x01020304};
+
+    sl->rsize = rsize;
+    sl->krsize = rsize + 2 * sizeof(uint64_t);
+    sl->ssize = sl->krsize + sizeof(double);
+    if(be_detect.c[0] != 1) {
+        /* little endian: the most significant part is at the end. */
+        sl->indexoff = 0;
+        sl->taskoff = sizeof(uint64_t);
+        sl->keyoff = 2 * sizeof(uint64_t);
+    } else {
+        sl->keyoff = 0;
+        sl->taskoff = rsize;
+        sl->indexoff = rsize + sizeof(uint64_t);
+    }
+}
+
+static void
+_sample_radix(const void * ptr, void * radix, void * arg)
+{
+    memcpy(radix, ptr, ((struct SampleLayout *) arg)->krsize);
+}
+
+/* Number of local items that come before the extended radix S. */
+static ptrdiff_t
+_sample_rank(const char * S, struct SampleLayout * sl, int ThisTask, void * mybase, size_t mynmemb, struct crstruct * d)
+{
+    uint64_t task, index;
+    memcpy(&task, S + sl->taskoff, sizeof(uint64_t));
+    memcpy(&index, S + sl->indexoff, sizeof(uint64_t));
+    char P[d->rsize];
+    memcpy(P, S + sl->keyoff, d->rsize);
+
+    ptrdiff_t lt = _bsearch_last_lt(P, mybase, mynmemb, d) + 1;
+    if((uint64_t) ThisTask > task)
+        return lt;
+    ptrdiff_t le = _bsearch_last_le(P, mybase, mynmemb, d) + 1;
+    if((uint64_t) ThisTask < task)
+        return le;
+    if((ptrdiff_t) index < lt)
+        return lt;
+    if((ptrdiff_t) index > le)
+        return le;
+    return index;
+}
+
+static int
+mpsort_mpi_sample_sort(struct crstruct d, struct crmpistruct o, struct TIMER * tmr)
+{
+    int i;
+
+    (tmr->time = MPI_Wtime(), strcpy(tmr->name, "START"), tmr++);
+
+    /* and sort the local array */
+    radix_sort(d.base, d.nmemb, d.size, d.radix, d.rsize, d.arg);
+
+    MPI_Barrier(o.comm);
+
+    (tmr->time = MPI_Wtime(), strcpy(tmr->name, "FirstSort"), tmr++);
+
+    /* Desired output offsets */
+    ptrdiff_t * C = ta_malloc("sampleC", ptrdiff_t, o.NTask + 1);
+    {
+        ptrdiff_t * eachoutnmemb = ta_malloc("eachoutnmemb", ptrdiff_t, o.NTask);
+        MPI_Allgather(&o.myoutnmemb, 1, MPI_TYPE_PTRDIFF,
+                eachoutnmemb, 1, MPI_TYPE_PTRDIFF, o.comm);
+        C[0] = 0;
+        for(i = 0; i < o.NTask; i ++)
+            C[i + 1] = C[i] + eachoutnmemb[i];
+        ta_free(eachoutnmemb);
+    }
+
+    int * SendCount = ta_malloc("SendCount", int, o.NTask);
+    int * SendDispl = ta_malloc("SendDispl", int, o.NTask);
+    int * RecvCount = ta_malloc("RecvCount", int, o.NTask);
+    int * RecvDispl = ta_malloc("RecvDispl", int, o.NTask);
+
+    struct SampleLayout sl;
+    _sample_layout(&sl, d.rsize);
+
+    /* Enough samples per rank to bound the buckets by a few times the average,
+     * but not so many that rank 0 runs out of memory*/
+    int nsample = o.NTask;
+    if(nsample > MPSORT_MAX_TOTAL_SAMPLES / o.NTask)
+        nsample = MPSORT_MAX_TOTAL_SAMPLES / o.NTask;
+    if(nsample < 64)
+        nsample = 64;
+
+    /* Splitters, as extended radixes */
+    char * P = ta_malloc("SampleP", char, sl.krsize * o.NTask);
+
+    char * samples = ta_malloc("Samples", char, sl.ssize * nsample);
+    memset(samples, 0, sl.ssize * nsample);
+    const double weight = (double) o.mynmemb / nsample;
+    for(i = 0; i < nsample; i ++) {
+        char * S = samples + i * sl.ssize;
+        uint64_t task = o.ThisTask;
+        /* middle of each of nsample equal intervals */
+        uint64_t index = ((2 * (uint64_t) i + 1) * o.mynmemb) / (2 * (uint64_t) nsample);
+        if(o.mynmemb > 0)
+            d.radix((char*) d.base + index * d.size, S + sl.keyoff, d.arg);
+        memcpy(S + sl.taskoff, &task, sizeof(uint64_t));
+        memcpy(S + sl.indexoff, &index, sizeof(uint64_t));
+        memcpy(S + sl.krsize, &weight, sizeof(double));
+    }
+
+    MPI_Datatype MPI_TYPE_SAMPLE;
+    MPI_Type_contiguous(sl.ssize, MPI_BYTE, &MPI_TYPE_SAMPLE);
+    MPI_Type_commit(&MPI_TYPE_SAMPLE);
+
+    char * allsamples = NULL;
+    if(o.ThisTask == 0)
+        allsamples = mymalloc("AllSamples", sl.ssize * nsample * o.NTask);
+
+    MPI_Gather(samples, nsample, MPI_TYPE_SAMPLE, allsamples, nsample, MPI_TYPE_SAMPLE, 0, o.comm);
+    MPI_Type_free(&MPI_TYPE_SAMPLE);
+
+    if(o.ThisTask == 0) {
+        const size_t ntotal = (size_t) nsample * o.NTask;
+        radix_sort(allsamples, ntotal, sl.ssize, _sample_radix, sl.krsize, &sl);
+        /* Splitter t - 1 is the first sample at which the cumulative weight reaches C[t]:
+         * items before it go to rank t - 1.*/
+        double cum = 0;
+        size_t s;
+        int t = 1;
+        for(s = 0; s < ntotal && t < o.NTask; s ++) {
+            double w;
+            memcpy(&w, allsamples + s * sl.ssize + sl.krsize, sizeof(double));
+            cum += w;
+            while(t < o.NTask && cum >= C[t]) {
+                memcpy(P + (t - 1) * sl.krsize, allsamples + s * sl.ssize, sl.krsize);
+                t++;
+            }
+        }
+        /* Rounding of the weights: the rest go after the last sample */
+        for(; t < o.NTask; t++)
+            memcpy(P + (t - 1) * sl.krsize, allsamples + (ntotal - 1) * sl.ssize, sl.krsize);
+        myfree(allsamples);
+    }
+    ta_free(samples);
+
+    MPI_Bcast(P, sl.krsize * (o.NTask - 1), MPI_BYTE, 0, o.comm);
+
+    (tmr->time = MPI_Wtime(), strcpy(tmr->name, "Splitters"), tmr++);
+
+    ptrdiff_t prev = 0;
+    for(i = 0; i < o.NTask - 1; i ++) {
+        ptrdiff_t next = _sample_rank(P + i * sl.krsize, &sl, o.ThisTask, d.base, d.nmemb, &d);
+        SendCount[i] = next - prev;
+        prev = next;
+    }
+    SendCount[o.NTask - 1] = d.nmemb - prev;
+    ta_free(P);
+
+    MPI_Alltoall(SendCount, 1, MPI_INT,
+            RecvCount, 1, MPI_INT, o.comm);
+
+    SendDispl[0] = 0;
+    RecvDispl[0] = 0;
+    ptrdiff_t nbucket = RecvCount[0];
+    for(i = 1; i < o.NTask; i ++) {
+        SendDispl[i] = SendDispl[i - 1] + SendCount[i - 1];
+        RecvDispl[i] = RecvDispl[i - 1] + RecvCount[i - 1];
+        nbucket += RecvCount[i];
+    }
+
+    (tmr->time = MPI_Wtime(), strcpy(tmr->name, "LaySolve"), tmr++);
+
+    int nomem = mymalloc_freebytes() < nbucket * d.size + 4096 * 4 + 2 * nbucket * (d.rsize + sizeof(size_t));
+    MPI_Allreduce(MPI_IN_PLACE, &nomem, 1, MPI_INT, MPI_LOR, o.comm);
+    if(nomem) {
+        ta_free(RecvDispl);
+        ta_free(RecvCount);
+        ta_free(SendDispl);
+        ta_free(SendCount);
+        ta_free(C);
+        message(0, "MPSort: buckets of the sample sort do not fit in memory, using the histogram sort.\n");
+        return mpsort_mpi_histogram_sort(d, o, tmr);
+    }
+
+    char * bucket = mymalloc("SampleBucket", nbucket * d.size);
+
+    MPI_Alltoallv_smart(
+            o.mybase, SendCount, SendDispl, o.MPI_TYPE_DATA,
+            bucket, RecvCount, RecvDispl, o.MPI_TYPE_DATA,
+            o.comm);
+
+    MPI_Barrier(o.comm);
+    (tmr->time = MPI_Wtime(), strcpy(tmr->name, "Exchange"), tmr++);
+
+    radix_sort(bucket, nbucket, d.size, d.radix, d.rsize, d.arg);
+
+    MPI_Barrier(o.comm);
+    (tmr->time = MPI_Wtime(), strcpy(tmr->name, "SecondSort"), tmr++);
+
+    /* The buckets are globally sorted; move the items in [start, start + nbucket)
+     * to the ranks owning [C[i], C[i + 1]).*/
+    ptrdiff_t start = 0;
+    MPI_Exscan(&nbucket, &start, 1, MPI_TYPE_PTRDIFF, MPI_SUM, o.comm);
+    if(o.ThisTask == 0)
+        start = 0;
+
+    for(i = 0; i < o.NTask; i ++) {
+        ptrdiff_t left = C[i] > start ? C[i] : start;
+        ptrdiff_t right = C[i + 1] < start + nbucket ? C[i + 1] : start + nbucket;
+        SendCount[i] = right > left ? right - left : 0;
+    }
+
+    MPI_Alltoall(SendCount, 1, MPI_INT,
+            RecvCount, 1, MPI_INT, o.comm);
+
+    SendDispl[0] = 0;
+    RecvDispl[0] = 0;
+    size_t totrecv = RecvCount[0];
+    for(i = 1; i < o.NTask; i ++) {
+        SendDispl[i] = SendDispl[i - 1] + SendCount[i - 1];
+        RecvDispl[i] = RecvDispl[i - 1] + RecvCount[i - 1];
+        totrecv += RecvCount[i];
+    }
+    if(totrecv != o.myoutnmemb) {
+        endrun(8, "totrecv = %td, mismatch with %td\n", totrecv, o.myoutnmemb);
+    }
+
+    MPI_Alltoallv_smart(
+            bucket, SendCount, SendDispl, o.MPI_TYPE_DATA,
+            o.myoutbase, RecvCount, RecvDispl, o.MPI_TYPE_DATA,
+            o.comm);
+
+    myfree(bucket);
+    ta_free(RecvDispl);
+    ta_free(RecvCount);
+    ta_free(SendDispl);
+    ta_free(SendCount);
+    ta_free(C);
+
+    MPI_Barrier(o.comm);
+    (tmr->time = MPI_Wtime(), strcpy(tmr->name, "Balance"), tmr++);
+
+    (tmr->time = MPI_Wtime(), strcpy(tmr->name, "END"), tmr++);
+    return 0;
+}
+
 static void _find_Pmax_Pmin_C(void * mybase, size_t mynmemb,
         size_t myoutnmemb,
         char * Pmax, char * Pmin,
@@ -1403,6 +1672,8 @@ static void _mpsort_mpi_parse_env()
         mpsort_mpi_set_options(MPSORT_DISABLE_GATHER_SORT);
     if(getenv("MPSORT_REQUIRE_GATHER_SORT "))
         mpsort_mpi_set_options(MPSORT_REQUIRE_GATHER_SORT );
+    if(getenv("MPSORT_SAMPLE_SORT"))
+        mpsort_mpi_set_options(MPSORT_SAMPLE_SORT);
 }
 
 void
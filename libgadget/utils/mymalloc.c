@@ -7,6 +7,9 @@
 #include <math.h>
 
 #include <omp.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include "mymalloc.h"
 #include "string.h"
 #include "memory.h"
@@ -21,10 +24,17 @@ Allocator A_MAIN[1];
  * */
 Allocator A_TEMP[1];
 
+/* High-bandwidth memory for the hot blocks from hbmalloc. Zero sized if there is none,
+ * so that they all go to A_MAIN.*/
+Allocator A_HBM[1];
+
 #ifdef VALGRIND
 #define allocator_init allocator_malloc_init
 #endif
 
+/* Size of a transparent huge page on x86-64 and most other Linux targets*/
+#define MYMALLOC_HUGE_PAGE_SIZE (2L * 1024 * 1024)
+
 void
 tamalloc_init(void)
 {
@@ -45,7 +55,7 @@ tamalloc_init(void)
 }
 
 void
-mymalloc_init(double MaxMemSizePerNode)
+mymalloc_init(double MaxMemSizePerNode, int HugePages)
 {
     /* Warning: this uses ta_malloc*/
     size_t Nhost = cluster_get_num_hosts();
@@ -62,10 +72,86 @@ mymalloc_init(double MaxMemSizePerNode)
     message(0, "Nhost = %d\n", Nhost);
     message(0, "Reserving %td bytes per rank for MAIN memory allocator. \n", n);
 
-    if (MPIU_Any(ALLOC_ENOMEMORY == allocator_init(A_MAIN, "MAIN", n, 1, NULL), MPI_COMM_WORLD)) {
+    int rt;
+#ifdef VALGRIND
+    rt = allocator_init(A_MAIN, "MAIN", n, 0, NULL);
+#else
+    if(HugePages != ALLOC_PAGES_NORMAL)
+        rt = allocator_mmap_init(A_MAIN, "MAIN", n, 0, HugePages);
+    else
+        rt = allocator_init(A_MAIN, "MAIN", n, 0, NULL);
+#endif
+    if (MPIU_Any(ALLOC_ENOMEMORY == rt, MPI_COMM_WORLD)) {
         endrun(0, "Insufficient memory for the MAIN allocator on at least one nodes."
                   "Requestion %td bytes. Try reducing MaxMemSizePerNode. Also check the node health status.\n", n);
     }
+    if(HugePages != ALLOC_PAGES_NORMAL) {
+        const char * pagenames[] = {"normal pages", "transparent huge pages", "2MB huge pages", "1GB huge pages"};
+        int minpages, maxpages;
+        MPI_Allreduce(&A_MAIN->hugepages, &minpages, 1, MPI_INT, MPI_MIN, comm);
+        MPI_Allreduce(&A_MAIN->hugepages, &maxpages, 1, MPI_INT, MPI_MAX, comm);
+        if(minpages == maxpages)
+            message(0, "MAIN memory allocator is backed by %s (asked for %s).\n", pagenames[minpages], pagenames[HugePages]);
+        else
+            message(0, "MAIN memory allocator is backed by %s to %s depending on the rank (asked for %s).\n",
+                    pagenames[minpages], pagenames[maxpages], pagenames[HugePages]);
+    }
+    /* Zero the arena from all threads, so it is spread over the NUMA nodes of the threads*/
+    mymalloc_first_touch(A_MAIN->base, A_MAIN->size);
+}
+
+void
+hbmalloc_init(double MemoryMB)
+{
+    if(MemoryMB <= 0)
+        return;
+    size_t Nhost = cluster_get_num_hosts();
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    size_t n = 1.0 * MemoryMB * Nhost / NTask * 1024. * 1024.;
+
+    int rt = allocator_hbw_init(A_HBM, "HBM", n, 0);
+    /* Use the high-bandwidth memory only if every rank has it, so that the ranks stay balanced*/
+    if(MPIU_Any(rt != 0, MPI_COMM_WORLD)) {
+        if(rt == 0)
+            allocator_destroy(A_HBM);
+        memset(A_HBM, 0, sizeof(A_HBM[0]));
+#ifdef USE_MEMKIND
+        message(0, "No high-bandwidth memory for %td bytes per rank on at least one node: hot blocks stay in the MAIN allocator.\n", n);
+#else
+        message(0, "HBMMemSizePerNode needs compiling with -DUSE_MEMKIND: hot blocks stay in the MAIN allocator.\n");
+#endif
+        return;
+    }
+    message(0, "Reserving %td bytes per rank of high-bandwidth memory for the HBM allocator.\n", n);
+}
+
+void
+mymalloc_first_touch(void * ptr, const size_t size)
+{
+    char * cptr = (char *) ptr;
+#if defined(__linux__) && defined(MADV_DONTNEED)
+    /* Give the whole pages back to the kernel, so that the touch below places them again.
+     * They are private anonymous memory, so they come back zeroed.
+     * Only whole 2MB aligned ranges are released: releasing part of a transparent huge page
+     * would split it, and the rest of the range would then be backed by small pages.*/
+    const size_t pagesize = MYMALLOC_HUGE_PAGE_SIZE;
+    char * start = (char *) ((((uintptr_t) cptr) + pagesize - 1) / pagesize * pagesize);
+    char * end = (char *) ((((uintptr_t) cptr) + size) / pagesize * pagesize);
+    if(end > start)
+        madvise(start, end - start, MADV_DONTNEED);
+#endif
+    /* Each thread touches an equal contiguous part, as in a static loop over the elements.*/
+    const size_t chunk = 4096;
+    const int64_t nchunk = (size + chunk - 1) / chunk;
+    int64_t i;
+    #pragma omp parallel for schedule(static)
+    for(i = 0; i < nchunk; i++) {
+        size_t len = size - i * chunk;
+        if(len > chunk)
+            len = chunk;
+        memset(cptr + i * chunk, 0, len);
+    }
 }
 
 static size_t highest_memory_usage = 0;
@@ -98,4 +184,6 @@ void report_detailed_memory_usage(const char *label, const char * fmt, ...)
     message(1, "Peak Memory usage induced by %s\n", buf);
     myfree(buf);
     allocator_print(A_MAIN);
+    if(A_HBM->size > 0)
+        allocator_print(A_HBM);
 }
@@ -5,17 +5,29 @@
 
 extern Allocator A_MAIN[1];
 extern Allocator A_TEMP[1];
+/* High-bandwidth memory, for hot blocks of bounded size. Empty unless hbmalloc_init found some.*/
+extern Allocator A_HBM[1];
 
-/* Initialize the main memory block*/
-void mymalloc_init(double MemoryMB);
+/* Initialize the main memory block, backed by the AllocHugePages kind of pages in HugePages if possible*/
+void mymalloc_init(double MemoryMB, int HugePages);
 /* Initialize the small temporary memory block*/
 void tamalloc_init(void);
+/* Reserve MemoryMB per node of high-bandwidth memory for hbmalloc, if there is any*/
+void hbmalloc_init(double MemoryMB);
+/* Zero memory in equal contiguous parts from each thread, as an OpenMP static loop would
+ * divide it, so that each page is placed on the NUMA node of the thread which uses it.
+ * On Linux the pages are first returned to the kernel, so this also works for memory
+ * which has been touched before, such as blocks from the main allocator.*/
+void mymalloc_first_touch(void * ptr, const size_t size);
 void report_detailed_memory_usage(const char *label, const char * fmt, ...);
 
 #define  mymalloc(name, size)            allocator_alloc_bot(A_MAIN, name, size)
 #define  mymalloc2(name, size)           allocator_alloc_top(A_MAIN, name, size)
 
-#define  myrealloc(ptr, size)     allocator_realloc(A_MAIN, ptr, size)
+/* Hot blocks: placed in high-bandwidth memory when they fit, otherwise in the main allocator*/
+#define  hbmalloc(name, size)           allocator_alloc_prefer(A_HBM, A_MAIN, name, size, ALLOC_DIR_BOT, "%s:%d", __FILE__, __LINE__)
+
+#define  myrealloc(ptr, size)     allocator_realloc(allocator_owner(ptr), ptr, size)
 #define  myfree(x)                 allocator_free(x)
 
 #define  ma_malloc(name, type, nele)            (type*) allocator_alloc_bot(A_MAIN, name, sizeof(type) * (nele))
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdint.h>
 #include "mymalloc.h"
+#include "threads.h"
 /* Below is a merge-sort routine copied directly from glibc version 2.26
  * (although the code is the same since Dec. 2010, glibc 2.13).
  * The copy is so that we can control our memory allocation
@@ -204,7 +205,7 @@ static void merge(void * base1, size_t nmemb1, void * base2, size_t nmemb2, void
 
 void qsort_openmp(void *base, size_t nmemb, size_t size,
                          int(*compar)(const void *, const void *)) {
-    int Nt = omp_get_max_threads();
+    int Nt = stage_threads(THREADS_SORT);
     ptrdiff_t * Anmemb = ta_malloc("Anmemb", ptrdiff_t, Nt);
     ptrdiff_t * Anmemb_old = ta_malloc("Anmemb_old", ptrdiff_t, Nt);
 
@@ -225,7 +226,7 @@ void qsort_openmp(void *base, size_t nmemb, size_t size,
     else
         tmp = mymalloc("qsort", size * nmemb);
 
-#pragma omp parallel
+#pragma omp parallel num_threads(Nt)
     {
         int tid = omp_get_thread_num();
         /* actual number of threads*/
@@ -375,3 +376,310 @@ void qsort_openmp(void *base, size_t nmemb, size_t size,
     }
     myfree(tmp);
 }
+
+/* Is this machine big-endian? Then the most significant byte of a key comes first.*/
+static int
+radix_big_endian(void)
+{
+    union {
+        uint32_t i;
+        char c[4];
+    } be_detect = {0x01020304};
+    return be_detect.c[0] == 1;
+}
+
+/* Compare two keys of radix_sort_openmp, from the most significant part.
+ * Keys of whole uint64_t words are compared a word at a time, with the words ordered as in mpsort.*/
+static int
+radix_compar_keys(const unsigned char * r1, const unsigned char * r2, const size_t rsize, const int bigendian)
+{
+    size_t d;
+    if(rsize % sizeof(uint64_t) == 0) {
+        const size_t nw = rsize / sizeof(uint64_t);
+        for(d = 0; d < nw; d++) {
+            const size_t w = bigendian ? d : nw - 1 - d;
+            uint64_t u1, u2;
+            memcpy(&u1, r1 + w * sizeof(uint64_t), sizeof(uint64_t));
+            memcpy(&u2, r2 + w * sizeof(uint64_t), sizeof(uint64_t));
+            if(u1 != u2)
+                return u1 < u2 ? -1 : 1;
+        }
+        return 0;
+    }
+    for(d = 0; d < rsize; d++) {
+        const size_t byte = bigendian ? d : rsize - 1 - d;
+        if(r1[byte] != r2[byte])
+            return r1[byte] < r2[byte] ? -1 : 1;
+    }
+    return 0;
+}
+
+/* State of the in-place stable merge sort used by radix_sort_openmp when memory is short*/
+struct radix_stable
+{
+    char * base;
+    size_t size;
+    void (*radix)(const void * ptr, void * radix, void * arg);
+    size_t rsize;
+    void * arg;
+    int bigendian;
+    /* Room for one element and two keys*/
+    char * tmp;
+    unsigned char * k1;
+    unsigned char * k2;
+};
+
+/* Is the key of element i less than that of element j?*/
+static int
+radix_stable_less(const struct radix_stable * st, const size_t i, const size_t j)
+{
+    st->radix(st->base + i * st->size, st->k1, st->arg);
+    st->radix(st->base + j * st->size, st->k2, st->arg);
+    return radix_compar_keys(st->k1, st->k2, st->rsize, st->bigendian) < 0;
+}
+
+/* Swap the n elements starting at a with the n elements starting at b*/
+static void
+radix_stable_swap(const struct radix_stable * st, const size_t a, const size_t b, const size_t n)
+{
+    size_t i;
+    for(i = 0; i < n; i++) {
+        char * pa = st->base + (a + i) * st->size;
+        char * pb = st->base + (b + i) * st->size;
+        memcpy(st->tmp, pa, st->size);
+        memcpy(pa, pb, st->size);
+        memcpy(pb, st->tmp, st->size);
+    }
+}
+
+/* Exchange the blocks [a, m) and [m, b)*/
+static void
+radix_stable_rotate(const struct radix_stable * st, const size_t a, const size_t m, const size_t b)
+{
+    size_t i = m - a, j = b - m;
+    while(i != j) {
+        if(i > j) {
+            radix_stable_swap(st, m - i, m, j);
+            i -= j;
+        } else {
+            radix_stable_swap(st, m - i, m + j - i, i);
+            j -= i;
+        }
+    }
+    radix_stable_swap(st, m - i, m, i);
+}
+
+/* Merge the sorted ranges [a, m) and [m, b) in place, keeping the order of equal keys.
+ * This is the SymMerge of Kim and Kutzner, 2004, which needs no buffer.*/
+static void
+radix_stable_merge(const struct radix_stable * st, const size_t a, const size_t m, const size_t b)
+{
+    size_t i, j, k;
+    if(m - a == 1) {
+        /* Insert element a into [m, b)*/
+        i = m;
+        j = b;
+        while(i < j) {
+            const size_t h = i + (j - i) / 2;
+            if(radix_stable_less(st, h, a))
+                i = h + 1;
+            else
+                j = h;
+        }
+        for(k = a; k + 1 < i; k++)
+            radix_stable_swap(st, k, k + 1, 1);
+        return;
+    }
+    if(b - m == 1) {
+        /* Insert element m into [a, m)*/
+        i = a;
+        j = m;
+        while(i < j) {
+            const size_t h = i + (j - i) / 2;
+            if(!radix_stable_less(st, m, h))
+                i = h + 1;
+            else
+                j = h;
+        }
+        for(k = m; k > i; k--)
+            radix_stable_swap(st, k, k - 1, 1);
+        return;
+    }
+    const size_t mid = a + (b - a) / 2;
+    const size_t n = mid + m;
+    size_t start, r;
+    if(m > mid) {
+        start = n - b;
+        r = mid;
+    } else {
+        start = a;
+        r = m;
+    }
+    const size_t p = n - 1;
+    while(start < r) {
+        const size_t c = start + (r - start) / 2;
+        if(!radix_stable_less(st, p - c, c))
+            start = c + 1;
+        else
+            r = c;
+    }
+    const size_t end = n - start;
+    if(start < m && m < end)
+        radix_stable_rotate(st, start, m, end);
+    if(a < start && start < mid)
+        radix_stable_merge(st, a, start, mid);
+    if(mid < end && end < b)
+        radix_stable_merge(st, mid, end, b);
+}
+
+/* Stable sort by the radix keys which uses no memory beyond a few elements:
+ * insertion sort of small blocks, then in-place merges of doubling size. Serial.*/
+static void
+radix_stable_sort(void * base, size_t nmemb, size_t size,
+        void (*radix)(const void * ptr, void * radix, void * arg), size_t rsize, void * arg, const int bigendian)
+{
+    const size_t block = 20;
+    char * tmp = ta_malloc("RadixStableTmp", char, size + 2 * rsize);
+    const struct radix_stable st = {
+        .base = (char *) base, .size = size, .radix = radix, .rsize = rsize, .arg = arg, .bigendian = bigendian,
+        .tmp = tmp, .k1 = (unsigned char *) tmp + size, .k2 = (unsigned char *) tmp + size + rsize,
+    };
+
+    size_t a, i, j, width;
+    for(a = 0; a < nmemb; a += block) {
+        const size_t b = a + block < nmemb ? a + block : nmemb;
+        for(i = a + 1; i < b; i++)
+            for(j = i; j > a && radix_stable_less(&st, j, j - 1); j--)
+                radix_stable_swap(&st, j, j - 1, 1);
+    }
+    for(width = block; width < nmemb; width *= 2) {
+        for(a = 0; a + width < nmemb; a += 2 * width) {
+            const size_t b = a + 2 * width < nmemb ? a + 2 * width : nmemb;
+            radix_stable_merge(&st, a, a + width, b);
+        }
+    }
+    ta_free(tmp);
+}
+
+/* Move element order[i] of base to position i, for all i, without a copy of the array.
+ * Knuth vol. 3 (2nd ed.) exercise 5.2-10, done serially. order is destroyed.*/
+static void
+radix_permute_inplace(char * base, size_t nmemb, size_t size, size_t * order)
+{
+    char * save = ta_malloc("RadixSave", char, size);
+    size_t i;
+    for(i = 0; i < nmemb; i++) {
+        if(order[i] == i)
+            continue;
+        memcpy(save, base + i * size, size);
+        size_t j = i;
+        while(order[j] != i) {
+            const size_t k = order[j];
+            memcpy(base + j * size, base + k * size, size);
+            order[j] = j;
+            j = k;
+        }
+        memcpy(base + j * size, save, size);
+        order[j] = j;
+    }
+    ta_free(save);
+}
+
+void
+radix_sort_openmp(void * base, size_t nmemb, size_t size,
+        void (*radix)(const void * ptr, void * radix, void * arg), size_t rsize, void * arg)
+{
+    const int bigendian = radix_big_endian();
+    /* Not enough memory for the keys and the order: sort in place instead, still stably.*/
+    if(mymalloc_freebytes() < 2 * nmemb * (rsize + sizeof(size_t)) + 4 * 4096 * 2) {
+        radix_stable_sort(base, nmemb, size, radix, rsize, arg, bigendian);
+        return;
+    }
+
+    const int Nt = stage_threads(THREADS_SORT);
+    /* Histogram of each thread, replaced by the thread's offset into each bucket*/
+    size_t * count = ta_malloc("RadixCount", size_t, 256 * Nt);
+    size_t * order[2];
+    unsigned char * key[2];
+    order[0] = (size_t *) mymalloc("RadixOrder", nmemb * sizeof(size_t));
+    order[1] = (size_t *) mymalloc("RadixOrder2", nmemb * sizeof(size_t));
+    key[0] = (unsigned char *) mymalloc("RadixKey", nmemb * rsize);
+    key[1] = (unsigned char *) mymalloc("RadixKey2", nmemb * rsize);
+    /* Set if every key has the same digit, so the pass can be skipped*/
+    int skip = 0;
+    int sorted = 0;
+
+#pragma omp parallel num_threads(Nt)
+    {
+        const int tid = omp_get_thread_num();
+        const int nthr = omp_get_num_threads();
+        /* Each thread keeps the same part of every pass, so the sort is stable. */
+        const size_t start = tid * nmemb / nthr;
+        const size_t end = (tid + 1) * nmemb / nthr;
+        size_t * mycount = count + 256 * tid;
+        int cur = 0;
+        size_t i, d;
+        for(i = start; i < end; i++) {
+            radix((char *) base + i * size, key[0] + i * rsize, arg);
+            order[0][i] = i;
+        }
+        for(d = 0; d < rsize; d++) {
+            const size_t byte = bigendian ? rsize - 1 - d : d;
+            const unsigned char * kin = key[cur];
+            memset(mycount, 0, 256 * sizeof(size_t));
+            for(i = start; i < end; i++)
+                mycount[kin[i * rsize + byte]]++;
+#pragma omp barrier
+#pragma omp single
+            {
+                /* Offsets ordered by digit and then by thread*/
+                size_t total = 0;
+                int b, t;
+                skip = 0;
+                for(b = 0; b < 256; b++)
+                    for(t = 0; t < nthr; t++) {
+                        const size_t c = count[256 * t + b];
+                        if(c == nmemb)
+                            skip = 1;
+                        count[256 * t + b] = total;
+                        total += c;
+                    }
+            }
+            if(skip)
+                continue;
+            unsigned char * kout = key[1 - cur];
+            const size_t * oin = order[cur];
+            size_t * oout = order[1 - cur];
+            for(i = start; i < end; i++) {
+                const size_t o = mycount[kin[i * rsize + byte]]++;
+                memcpy(kout + o * rsize, kin + i * rsize, rsize);
+                oout[o] = oin[i];
+            }
+            cur = 1 - cur;
+#pragma omp barrier
+        }
+        if(tid == 0)
+            sorted = cur;
+    }
+    myfree(key[1]);
+    myfree(key[0]);
+
+    size_t * neworder = order[sorted];
+    if(mymalloc_freebytes() > nmemb * size + 4096 * 2) {
+        char * tmp = (char *) mymalloc("RadixTmp", nmemb * size);
+        size_t i;
+        #pragma omp parallel for num_threads(Nt)
+        for(i = 0; i < nmemb; i++)
+            memcpy(tmp + i * size, (char *) base + neworder[i] * size, size);
+        #pragma omp parallel for num_threads(Nt)
+        for(i = 0; i < nmemb; i++)
+            memcpy((char *) base + i * size, tmp + i * size, size);
+        myfree(tmp);
+    }
+    else
+        radix_permute_inplace((char *) base, nmemb, size, neworder);
+
+    myfree(order[1]);
+    myfree(order[0]);
+    ta_free(count);
+}
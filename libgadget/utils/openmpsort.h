@@ -6,4 +6,13 @@
 void qsort_openmp(void *base, size_t nmemb, size_t size,
                          int(*compar)(const void *, const void *));
 
+/* Threaded stable LSD radix sort by a fixed-width key.
+ * radix writes the key of the element at ptr to radix, as an unsigned integer of rsize bytes
+ * in machine byte order. Longer keys are ordered as in mpsort: on little-endian machines
+ * they are arrays of uint64_t with the least significant first. Equal keys keep their order.
+ * If there is not enough memory for the keys, falls back to a serial in-place merge sort,
+ * which is also stable.*/
+void radix_sort_openmp(void * base, size_t nmemb, size_t size,
+        void (*radix)(const void * ptr, void * radix, void * arg), size_t rsize, void * arg);
+
 #endif
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include <gsl/gsl_heapsort.h>
 #include "peano.h"
@@ -113,24 +114,89 @@ const unsigned char subpix3[48][8] = {
     {2, 5, 1, 6, 3, 4, 0, 7}
 };
 
-/*! This function computes a Peano-Hilbert key for an integer triplet (x,y,z),
- *  with x,y,z in the range between 0 and 2^bits-1.
- */
-peano_t peano_hilbert_key(int x, int y, int z, int bits)
+/* Two levels of the curve at once, built from the tables above: for each rotation
+ * and pair of successive octants, (coarse octant << 3) | fine octant,
+ * the six bits of the key and the rotation after both levels.
+ * This halves the chain of dependent table lookups in a key.*/
+static unsigned char subpix3x2[48][64];
+static unsigned char rottable3x2[48][64];
+static pthread_once_t peano_tables_once = PTHREAD_ONCE_INIT;
+
+static void
+init_peano_tables(void)
+{
+    int rotation, pix;
+    for(rotation = 0; rotation < 48; rotation++)
+        for(pix = 0; pix < 64; pix++) {
+            const int coarse = pix >> 3, fine = pix & 7;
+            const int rotation1 = rottable3[rotation][coarse];
+            subpix3x2[rotation][pix] = (subpix3[rotation][coarse] << 3) | subpix3[rotation1][fine];
+            rottable3x2[rotation][pix] = rottable3[rotation1][fine];
+        }
+}
+
+/* Spread the low 21 bits of v so that there are two zero bits between each.*/
+static inline uint64_t
+spread_bits3(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+/* The key is computed from the Morton (bit interleaved) index of the point, which gives the octant
+ * on every level at once, and then the rotation state of the curve is followed two levels at a time.*/
+static inline peano_t
+peano_hilbert_key_internal(int x, int y, int z, int bits)
 {
-    int mask;
+    const uint64_t morton = (spread_bits3(x) << 2) | (spread_bits3(y) << 1) | spread_bits3(z);
     unsigned char rotation = 0;
     peano_t key = 0;
+    int level = bits;
 
-    for(mask = 1 << (bits - 1); mask > 0; mask >>= 1)
-    {
-        unsigned char pix = ((x & mask) ? 4 : 0) | ((y & mask) ? 2 : 0) | ((z & mask) ? 1 : 0);
-
-        key <<= 3;
-        key |= subpix3[rotation][pix];
+    /* An odd level first, so the rest come in pairs*/
+    if(level % 2) {
+        level--;
+        const unsigned char pix = (morton >> (3 * level)) & 7;
+        key = subpix3[rotation][pix];
         rotation = rottable3[rotation][pix];
     }
-
+    while(level > 0) {
+        level -= 2;
+        const unsigned char pix = (morton >> (3 * level)) & 63;
+        key = (key << 6) | subpix3x2[rotation][pix];
+        rotation = rottable3x2[rotation][pix];
+    }
     return key;
 }
 
+/*! This function computes a Peano-Hilbert key for an integer triplet (x,y,z),
+ *  with x,y,z in the range between 0 and 2^bits-1.
+ */
+peano_t peano_hilbert_key(int x, int y, int z, int bits)
+{
+    pthread_once(&peano_tables_once, init_peano_tables);
+    return peano_hilbert_key_internal(x, y, z, bits);
+}
+
+void
+peano_hilbert_keys(const double * Pos, const size_t posstride, peano_t * Keys, const size_t keystride, const int64_t n, const double BoxSize)
+{
+    pthread_once(&peano_tables_once, init_peano_tables);
+    const double DomainFac = 1.0 / (BoxSize*1.001) * (((peano_t) 1) << (BITS_PER_DIMENSION));
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < n; i++) {
+        const double * pos = (const double *) ((const char *) Pos + i * posstride);
+        peano_t * key = (peano_t *) ((char *) Keys + i * keystride);
+        /* As in PEANO*/
+        const int x = (pos[0] + BoxSize/2000) * DomainFac;
+        const int y = (pos[1] + BoxSize/2000) * DomainFac;
+        const int z = (pos[2] + BoxSize/2000) * DomainFac;
+        *key = peano_hilbert_key_internal(x, y, z, BITS_PER_DIMENSION);
+    }
+}
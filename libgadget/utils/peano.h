@@ -11,6 +11,11 @@ typedef uint64_t peano_t;
 
 peano_t peano_hilbert_key(int x, int y, int z, int bits);
 
+/* The keys of n points as computed by PEANO, threaded over the points.
+ * Point i is the three doubles at Pos + i * posstride bytes and its key is stored
+ * at Keys + i * keystride bytes, so they may be members of an array of structs.*/
+void peano_hilbert_keys(const double * Pos, const size_t posstride, peano_t * Keys, const size_t keystride, const int64_t n, const double BoxSize);
+
 static inline peano_t PEANO(double *Pos, double BoxSize)
 {
     /*No reason known for the Box/2000 and 1.001 factors*/
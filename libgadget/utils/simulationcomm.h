@@ -0,0 +1,29 @@
+#ifndef __UTILS_SIMULATIONCOMM_H__
+#define __UTILS_SIMULATIONCOMM_H__
+
+#include <mpi.h>
+
+/* The communicator of the simulation. Most of the code uses MPI_COMM_WORLD, which is redefined here
+ * to be this communicator. It is the whole job, unless the job runs an ensemble of independent
+ * simulations (see MPIU_split_ensemble), when it is the ranks running the simulation of this rank.
+ * The globals, such as All and PartManager, are already separate for each rank.
+ * Code which must see the whole job uses MPIU_COMM_JOB.
+ * Makefile.rules includes this header first in every file, so that a file which does not
+ * include it cannot use the whole job by accident. It includes nothing but mpi.h, so it
+ * does not fix the feature macros, such as _GNU_SOURCE, before the file sets them.*/
+extern MPI_Comm MPIU_SimulationComm;
+
+static inline MPI_Comm MPIU_job_comm(void) { return MPI_COMM_WORLD; }
+#define MPIU_COMM_JOB MPIU_job_comm()
+
+static inline MPI_Comm MPIU_simulation_comm(void) {
+    return MPIU_SimulationComm != MPI_COMM_NULL ? MPIU_SimulationComm : MPIU_job_comm();
+}
+#undef MPI_COMM_WORLD
+#define MPI_COMM_WORLD MPIU_simulation_comm()
+
+/* Split the job into nmember simulations of consecutive ranks, of nearly equal size, and make
+ * MPI_COMM_WORLD the ranks of the member of this rank. Returns the member of this rank. Collective on MPIU_COMM_JOB.*/
+int MPIU_split_ensemble(int nmember);
+
+#endif
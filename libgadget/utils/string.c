@@ -27,6 +27,30 @@ fastpm_file_get_content(const char * filename)
     return buf;
 }
 
+char **
+fastpm_strsplit_table(char * str, int * nlines)
+{
+    int n = 1;
+    char * p;
+    for(p = str; *p; p++)
+        n += (*p == '\n');
+
+    char ** lines = ta_malloc("tablelines", char *, n + 1);
+    int i = 0;
+    char * saveptr;
+    char * line;
+    for(line = strtok_r(str, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        const char * start = line + strspn(line, " \t\r");
+        /* Discard blank lines and comments */
+        if(*start == '\0' || *start == '#')
+            continue;
+        lines[i++] = line;
+    }
+    lines[i] = NULL;
+    *nlines = i;
+    return lines;
+}
+
 char *
 fastpm_strdup(const char * str)
 {
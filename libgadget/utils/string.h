@@ -6,6 +6,12 @@
 char *
 fastpm_file_get_content(const char * filename);
 
+/* Split str in place into the lines of a text table, skipping blank lines and
+ * lines starting with '#'. Returns a NULL terminated array of pointers into str,
+ * allocated with ta_malloc (free with ta_free), and sets nlines to the number of lines.*/
+char **
+fastpm_strsplit_table(char * str, int * nlines);
+
 char *
 fastpm_strdup(const char * str);
 
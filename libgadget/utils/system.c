@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <string.h>
 #include <math.h>
@@ -11,11 +12,13 @@
 #include <sys/resource.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 #include <gsl/gsl_rng.h>
 
 
 #include "system.h"
 #include "mymalloc.h"
+#include "string.h"
 #include "endrun.h"
 
 
@@ -175,6 +178,202 @@ putline(const char * prefix, const char * line)
  */
 
 static double _timestart = -1;
+
+/* The messages of this rank buffered since the last MPIU_Trace_flush, one entry for each format string.
+ * The table is also the element of the reduction which merges the tables of all ranks.*/
+#define TRACE_MAX_ENTRIES 32
+#define TRACE_TEXT 256
+
+struct TraceEntry {
+    uint64_t hash;
+    int64_t count;
+    int nranks;
+    /* The lowest rank with the message, and its first message*/
+    int firstrank;
+    char text[TRACE_TEXT];
+};
+
+struct TraceTable {
+    int n;
+    /* Messages which did not fit in the table*/
+    int64_t dropped;
+    struct TraceEntry e[TRACE_MAX_ENTRIES];
+};
+
+static int TraceAggregate;
+static struct TraceTable TraceBuffer;
+/* Writes the summaries on rank 0*/
+static pthread_t TraceWriter;
+static int TraceWriterRunning;
+
+static uint64_t
+trace_hash(const char * fmt)
+{
+    /* FNV-1a of the format, so the messages differing only in their numbers are merged*/
+    uint64_t hash = 14695981039346656037ULL;
+    for(; *fmt; fmt++)
+        hash = (hash ^ (unsigned char) *fmt) * 1099511628211ULL;
+    return hash;
+}
+
+/* Add a message to the table. Returns 0 if the table is full and the message should be printed now.*/
+static int
+trace_buffer_add(const char * fmt, int ThisTask, const char * text)
+{
+    const uint64_t hash = trace_hash(fmt);
+    int added = 1;
+    #pragma omp critical (_trace_buffer_)
+    {
+        int i;
+        for(i = 0; i < TraceBuffer.n; i++)
+            if(TraceBuffer.e[i].hash == hash)
+                break;
+        if(i < TraceBuffer.n)
+            TraceBuffer.e[i].count++;
+        else if(TraceBuffer.n < TRACE_MAX_ENTRIES) {
+            struct TraceEntry * e = &TraceBuffer.e[TraceBuffer.n++];
+            e->hash = hash;
+            e->count = 1;
+            e->nranks = 1;
+            e->firstrank = ThisTask;
+            strncpy(e->text, text, TRACE_TEXT - 1);
+            e->text[TRACE_TEXT - 1] = '\0';
+        }
+        else
+            added = 0;
+    }
+    return added;
+}
+
+static void
+trace_table_merge(void * invec, void * inoutvec, int * len, MPI_Datatype * type)
+{
+    int k;
+    for(k = 0; k < *len; k++) {
+        const struct TraceTable * in = (const struct TraceTable *) invec + k;
+        struct TraceTable * out = (struct TraceTable *) inoutvec + k;
+        out->dropped += in->dropped;
+        int i, j;
+        for(i = 0; i < in->n; i++) {
+            const struct TraceEntry * e = &in->e[i];
+            for(j = 0; j < out->n; j++)
+                if(out->e[j].hash == e->hash)
+                    break;
+            if(j == out->n) {
+                if(out->n == TRACE_MAX_ENTRIES) {
+                    out->dropped += e->count;
+                    continue;
+                }
+                out->e[out->n++] = *e;
+                continue;
+            }
+            out->e[j].count += e->count;
+            out->e[j].nranks += e->nranks;
+            if(e->firstrank < out->e[j].firstrank) {
+                out->e[j].firstrank = e->firstrank;
+                memcpy(out->e[j].text, e->text, TRACE_TEXT);
+            }
+        }
+    }
+}
+
+static void *
+trace_writer(void * summary)
+{
+    write(STDOUT_FILENO, summary, strlen(summary));
+    free(summary);
+    return NULL;
+}
+
+static void
+trace_writer_wait(void)
+{
+    if(TraceWriterRunning)
+        pthread_join(TraceWriter, NULL);
+    TraceWriterRunning = 0;
+}
+
+/* Print the buffered messages of this rank as they would have been printed, and empty the buffer.*/
+static void
+trace_buffer_dump(void)
+{
+    int i;
+    for(i = 0; i < TraceBuffer.n; i++) {
+        char prefix[128];
+        if(TraceBuffer.e[i].count == 1)
+            snprintf(prefix, sizeof(prefix), "[ %09.2f ] Task %d: ", MPI_Wtime() - _timestart, TraceBuffer.e[i].firstrank);
+        else
+            snprintf(prefix, sizeof(prefix), "[ %09.2f ] Task %d (%ld times): ", MPI_Wtime() - _timestart,
+                TraceBuffer.e[i].firstrank, (long) TraceBuffer.e[i].count);
+        putline(prefix, TraceBuffer.e[i].text);
+    }
+    TraceBuffer.n = 0;
+    TraceBuffer.dropped = 0;
+}
+
+void
+MPIU_Trace_aggregate(int on)
+{
+    if(!on) {
+        trace_writer_wait();
+        trace_buffer_dump();
+    }
+    TraceAggregate = on;
+}
+
+void
+MPIU_Trace_flush(MPI_Comm comm)
+{
+    if(!TraceAggregate)
+        return;
+    int ThisTask;
+    MPI_Comm_rank(comm, &ThisTask);
+
+    MPI_Datatype MPI_TRACE_TABLE;
+    MPI_Type_contiguous(sizeof(struct TraceTable), MPI_BYTE, &MPI_TRACE_TABLE);
+    MPI_Type_commit(&MPI_TRACE_TABLE);
+    MPI_Op MPI_TRACE_MERGE;
+    MPI_Op_create(trace_table_merge, 1, &MPI_TRACE_MERGE);
+
+    struct TraceTable * all = ThisTask == 0 ? malloc(sizeof(struct TraceTable)) : NULL;
+    MPI_Reduce(&TraceBuffer, all, 1, MPI_TRACE_TABLE, MPI_TRACE_MERGE, 0, comm);
+    TraceBuffer.n = 0;
+    TraceBuffer.dropped = 0;
+
+    MPI_Op_free(&MPI_TRACE_MERGE);
+    MPI_Type_free(&MPI_TRACE_TABLE);
+
+    if(ThisTask != 0)
+        return;
+
+    /* Format the summary here and write it in the background, so that rank 0 does not wait for the file system*/
+    size_t size = (all->n + 1) * (TRACE_TEXT + 128) + 1;
+    char * summary = malloc(size);
+    size_t len = 0;
+    int i;
+    summary[0] = '\0';
+    for(i = 0; i < all->n; i++) {
+        const struct TraceEntry * e = &all->e[i];
+        const size_t textlen = strcspn(e->text, "\n");
+        if(e->nranks == 1 && e->count == 1)
+            len += snprintf(summary + len, size - len, "[ %09.2f ] Task %d: %.*s\n",
+                    MPI_Wtime() - _timestart, e->firstrank, (int) textlen, e->text);
+        else
+            len += snprintf(summary + len, size - len, "[ %09.2f ] %d ranks, %ld times, first Task %d: %.*s\n",
+                    MPI_Wtime() - _timestart, e->nranks, (long) e->count, e->firstrank, (int) textlen, e->text);
+    }
+    if(all->dropped > 0)
+        len += snprintf(summary + len, size - len, "[ %09.2f ] %ld more messages of other kinds were not shown.\n",
+                MPI_Wtime() - _timestart, (long) all->dropped);
+    free(all);
+
+    trace_writer_wait();
+    if(len == 0 || pthread_create(&TraceWriter, NULL, trace_writer, summary) != 0)
+        trace_writer(summary);
+    else
+        TraceWriterRunning = 1;
+}
+
 /*
  * va_list version of MPIU_Trace.
  * */
@@ -198,6 +397,9 @@ MPIU_Tracev(MPI_Comm comm, int where, const char * fmt, va_list va)
         sprintf(prefix, "[ %09.2f ] ", MPI_Wtime() - _timestart);
     }
 
+    if(where > 0 && TraceAggregate && trace_buffer_add(fmt, ThisTask, buf))
+        return;
+
     if(ThisTask == 0 || where > 0) {
         putline(prefix, buf);
     }
@@ -304,6 +506,39 @@ size_t sizemax(size_t a, size_t b)
     return a;
 }
 
+/* Largest message, in bytes, passed to one MPI call by the exchange functions below.
+ * Many MPI libraries count bytes in an int internally and fail for messages over 2GB.*/
+#ifndef MPIU_MAX_MESSAGE_BYTES
+#define MPIU_MAX_MESSAGE_BYTES (1L << 30)
+#endif
+
+/* Number of elements of extent elsize in one chunk of a large message*/
+static int
+message_chunk_elements(const ptrdiff_t elsize)
+{
+    if(elsize >= MPIU_MAX_MESSAGE_BYTES)
+        return 1;
+    return MPIU_MAX_MESSAGE_BYTES / elsize;
+}
+
+/* True if a message of the exchange ends more than INT_MAX bytes into the buffer on this task.*/
+static int
+alltoallv_is_large(const int *sendcnts, const int *sdispls, MPI_Datatype sendtype,
+        const int *recvcnts, const int *rdispls, MPI_Datatype recvtype, const int NTask)
+{
+    ptrdiff_t lb, send_elsize, recv_elsize;
+    MPI_Type_get_extent(sendtype, &lb, &send_elsize);
+    MPI_Type_get_extent(recvtype, &lb, &recv_elsize);
+    int i;
+    for(i = 0; i < NTask; i++) {
+        if(((int64_t) sdispls[i] + sendcnts[i]) * send_elsize > INT_MAX)
+            return 1;
+        if(((int64_t) rdispls[i] + recvcnts[i]) * recv_elsize > INT_MAX)
+            return 1;
+    }
+    return 0;
+}
+
 int MPI_Alltoallv_smart(void *sendbuf, int *sendcnts, int *sdispls,
         MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
         int *rdispls, MPI_Datatype recvtype, MPI_Comm comm)
@@ -356,11 +591,12 @@ int MPI_Alltoallv_smart(void *sendbuf, int *sendcnts, int *sdispls,
         }
     }
 
-    int dense = nn < NTask * 0.2;
-    int tot_dense = 0, ret;
-    MPI_Allreduce(&dense, &tot_dense, 1, MPI_INT, MPI_SUM, comm);
+    /* Messages too large for MPI_Alltoallv go through the chunked sparse exchange*/
+    int flags[2] = {nn < NTask * 0.2, alltoallv_is_large(sendcnts, sdispls, sendtype, recvcnts, rdispls, recvtype, NTask)};
+    int ret;
+    MPI_Allreduce(MPI_IN_PLACE, flags, 2, MPI_INT, MPI_SUM, comm);
 
-    if(tot_dense != 0) {
+    if(flags[0] != 0 && flags[1] == 0) {
         ret = MPI_Alltoallv(sendbuf, sendcnts, sdispls,
                     sendtype, recvbuf,
                     recvcnts, rdispls, recvtype, comm);
@@ -379,6 +615,66 @@ int MPI_Alltoallv_smart(void *sendbuf, int *sendcnts, int *sdispls,
     return ret;
 }
 
+/* Non-zero elements are sent with synchronous sends. The receiver finds them by probing
+ * until a non-blocking barrier, entered once our own sends are matched, completes
+ * (Hoefler, Siebert & Lumsdaine 2010). So a rank only exchanges messages with its partners,
+ * and there is no O(NTask) collective.*/
+int MPI_Alltoall_sparse(void *sendbuf, void *recvbuf, MPI_Datatype type, MPI_Comm comm)
+{
+    const int tag = 101936;
+    int NTask;
+    MPI_Comm_size(comm, &NTask);
+
+    ptrdiff_t lb;
+    ptrdiff_t elsize;
+    MPI_Type_get_extent(type, &lb, &elsize);
+
+    memset(recvbuf, 0, NTask * elsize);
+
+    MPI_Request *requests = ta_malloc("requests", MPI_Request, NTask);
+    int nsend = 0;
+    int i;
+    for(i = 0; i < NTask; i++) {
+        const char * el = (char *) sendbuf + elsize * i;
+        ptrdiff_t j;
+        for(j = 0; j < elsize; j++)
+            if(el[j])
+                break;
+        if(j == elsize)
+            continue;
+        MPI_Issend(el, 1, type, i, tag, comm, &requests[nsend++]);
+    }
+
+    int barrier_active = 0;
+    int done = 0;
+    MPI_Request barrier;
+    while(!done) {
+        int flag;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, tag, comm, &flag, &status);
+        if(flag) {
+            MPI_Recv((char *) recvbuf + elsize * status.MPI_SOURCE, 1, type,
+                    status.MPI_SOURCE, tag, comm, MPI_STATUS_IGNORE);
+            continue;
+        }
+        if(!barrier_active) {
+            int sent;
+            MPI_Testall(nsend, requests, &sent, MPI_STATUSES_IGNORE);
+            if(sent) {
+                MPI_Ibarrier(comm, &barrier);
+                barrier_active = 1;
+            }
+        }
+        else
+            MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+    }
+    ta_free(requests);
+    /* A rank may leave the loop while another is still probing:
+     * do not let the messages of the next call be received by this one.*/
+    MPI_Barrier(comm);
+    return 0;
+}
+
 int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
         MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
         int *rdispls, MPI_Datatype recvtype, MPI_Comm comm) {
@@ -399,9 +695,18 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
     MPI_Type_get_extent(sendtype, &lb, &send_elsize);
     MPI_Type_get_extent(recvtype, &lb, &recv_elsize);
 
+    /* Messages are split into chunks of at most MPIU_MAX_MESSAGE_BYTES. The chunks between
+     * a pair of tasks are matched in order, as MPI messages do not overtake each other.*/
+    const int send_chunk = message_chunk_elements(send_elsize);
+    const int recv_chunk = message_chunk_elements(recv_elsize);
+
 #ifndef NO_ISEND_IRECV_IN_DOMAIN
-    int n_requests;
-    MPI_Request *requests = mymalloc("requests", NTask * 2 * sizeof(MPI_Request));
+    int n_requests = 0;
+    for(ngrp = 0; ngrp < NTask; ngrp++) {
+        n_requests += (sendcnts[ngrp] + send_chunk - 1) / send_chunk;
+        n_requests += (recvcnts[ngrp] + recv_chunk - 1) / recv_chunk;
+    }
+    MPI_Request *requests = mymalloc("requests", n_requests * sizeof(MPI_Request));
     n_requests = 0;
 
 
@@ -410,11 +715,14 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
         int target = ThisTask ^ ngrp;
 
         if(target >= NTask) continue;
-        if(recvcnts[target] == 0) continue;
-        MPI_Irecv(
-                ((char*) recvbuf) + recv_elsize * rdispls[target],
-                recvcnts[target],
+        int64_t done;
+        for(done = 0; done < recvcnts[target]; done += recv_chunk) {
+            const int count = recvcnts[target] - done < recv_chunk ? recvcnts[target] - done : recv_chunk;
+            MPI_Irecv(
+                ((char*) recvbuf) + recv_elsize * (rdispls[target] + done),
+                count,
                 recvtype, target, 101934, comm, &requests[n_requests++]);
+        }
     }
 
     MPI_Barrier(comm);
@@ -428,10 +736,13 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
     {
         int target = ThisTask ^ ngrp;
         if(target >= NTask) continue;
-        if(sendcnts[target] == 0) continue;
-        MPI_Isend(((char*) sendbuf) + send_elsize * sdispls[target],
-                sendcnts[target],
+        int64_t done;
+        for(done = 0; done < sendcnts[target]; done += send_chunk) {
+            const int count = sendcnts[target] - done < send_chunk ? sendcnts[target] - done : send_chunk;
+            MPI_Isend(((char*) sendbuf) + send_elsize * (sdispls[target] + done),
+                count,
                 sendtype, target, 101934, comm, &requests[n_requests++]);
+        }
     }
 
     MPI_Waitall(n_requests, requests, MPI_STATUSES_IGNORE);
@@ -443,14 +754,21 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
 
         if(target >= NTask) continue;
         if(sendcnts[target] == 0 && recvcnts[target] == 0) continue;
-        MPI_Sendrecv(((char*)sendbuf) + send_elsize * sdispls[target],
-                sendcnts[target], sendtype,
+        /* Both tasks of the pair loop until the longer direction is done*/
+        int64_t sent = 0, recvd = 0;
+        while(sent < sendcnts[target] || recvd < recvcnts[target]) {
+            const int nsend = sendcnts[target] - sent < send_chunk ? sendcnts[target] - sent : send_chunk;
+            const int nrecv = recvcnts[target] - recvd < recv_chunk ? recvcnts[target] - recvd : recv_chunk;
+            MPI_Sendrecv(((char*)sendbuf) + send_elsize * (sdispls[target] + sent),
+                nsend, sendtype,
                 target, 101934,
-                ((char*)recvbuf) + recv_elsize * rdispls[target],
-                recvcnts[target], recvtype,
+                ((char*)recvbuf) + recv_elsize * (rdispls[target] + recvd),
+                nrecv, recvtype,
                 target, 101934,
                 comm, MPI_STATUS_IGNORE);
-
+            sent += nsend;
+            recvd += nrecv;
+        }
     }
 #endif
     /* ensure the collective-ness */
@@ -459,6 +777,23 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
     return 0;
 }
 
+/* MPI_Alltoallv, unless a message or a displacement is too large for the int byte
+ * counts of the MPI library on some task: then the chunked MPI_Alltoallv_sparse.*/
+int MPI_Alltoallv_large(void *sendbuf, int *sendcnts, int *sdispls,
+        MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
+        int *rdispls, MPI_Datatype recvtype, MPI_Comm comm)
+{
+    int NTask;
+    MPI_Comm_size(comm, &NTask);
+    int large = alltoallv_is_large(sendcnts, sdispls, sendtype, recvcnts, rdispls, recvtype, NTask);
+    MPI_Allreduce(MPI_IN_PLACE, &large, 1, MPI_INT, MPI_LOR, comm);
+    if(large)
+        return MPI_Alltoallv_sparse(sendbuf, sendcnts, sdispls, sendtype,
+                recvbuf, recvcnts, rdispls, recvtype, comm);
+    return MPI_Alltoallv(sendbuf, sendcnts, sdispls, sendtype,
+                recvbuf, recvcnts, rdispls, recvtype, comm);
+}
+
 /* return the number of hosts */
 int
 cluster_get_num_hosts(void)
@@ -571,6 +906,104 @@ _MPIU_Barrier(const char * fn, const int line, MPI_Comm comm)
     return 0;
 }
 
+char *
+MPIU_file_get_content(const char * filename, int root, MPI_Comm comm)
+{
+    int ThisTask;
+    MPI_Comm_rank(comm, &ThisTask);
+
+    char * content = NULL;
+    int64_t length = -1;
+    if(ThisTask == root) {
+        content = fastpm_file_get_content(filename);
+        if(content)
+            length = strlen(content);
+    }
+    MPI_Bcast(&length, 1, MPI_INT64, root, comm);
+    if(length < 0)
+        return NULL;
+    if(ThisTask != root)
+        content = ta_malloc2(filename, char, length + 1);
+    MPI_Bcast(content, length + 1, MPI_CHAR, root, comm);
+    return content;
+}
+
+/* Ranks on this node, and the first rank of each node. Created on first use.*/
+static MPI_Comm NodeComm = MPI_COMM_NULL;
+static MPI_Comm NodeLeaderComm = MPI_COMM_NULL;
+
+static void
+MPIU_init_node_comms(void)
+{
+    if(NodeComm != MPI_COMM_NULL)
+        return;
+    int ThisTask, NodeRank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &NodeComm);
+    MPI_Comm_rank(NodeComm, &NodeRank);
+    /* Ordered by world rank, so world rank 0 is rank 0 of the leaders*/
+    MPI_Comm_split(MPI_COMM_WORLD, NodeRank == 0 ? 0 : MPI_UNDEFINED, ThisTask, &NodeLeaderComm);
+}
+
+int
+MPIU_node_leader(void)
+{
+    MPIU_init_node_comms();
+    return NodeLeaderComm != MPI_COMM_NULL;
+}
+
+void *
+MPIU_alloc_node_shared(size_t size, MPI_Win * win)
+{
+    MPIU_init_node_comms();
+    char * base;
+    const size_t mysize = MPIU_node_leader() ? size : 0;
+    MPI_Win_allocate_shared(mysize, 1, MPI_INFO_NULL, NodeComm, &base, win);
+    MPI_Aint segsize;
+    int disp;
+    MPI_Win_shared_query(*win, 0, &segsize, &disp, &base);
+    MPI_Win_fence(0, *win);
+    return base;
+}
+
+void
+MPIU_Bcast_node_shared(void * table, size_t size, MPI_Win win)
+{
+    /* Finish the writes of the world root before sending*/
+    MPI_Win_fence(0, win);
+    if(NodeLeaderComm != MPI_COMM_NULL) {
+        /* Broadcast in chunks so the count fits in an int*/
+        const size_t chunk = 1L << 30;
+        size_t start;
+        for(start = 0; start < size; start += chunk) {
+            const size_t n = size - start < chunk ? size - start : chunk;
+            MPI_Bcast((char *) table + start, n, MPI_BYTE, 0, NodeLeaderComm);
+        }
+    }
+    /* Make the copy of the leader visible to the node*/
+    MPI_Win_fence(0, win);
+}
+
+MPI_Comm MPIU_SimulationComm = MPI_COMM_NULL;
+
+int
+MPIU_split_ensemble(int nmember)
+{
+    int JobTask, JobNTask;
+    MPI_Comm_rank(MPIU_COMM_JOB, &JobTask);
+    MPI_Comm_size(MPIU_COMM_JOB, &JobNTask);
+    if(nmember < 1 || nmember > JobNTask)
+        endrun(1, "Cannot run %d simulations on %d ranks\n", nmember, JobNTask);
+    /* Consecutive ranks, so a member fills whole nodes where it can*/
+    const int member = (int64_t) JobTask * nmember / JobNTask;
+    MPI_Comm comm;
+    MPI_Comm_split(MPIU_COMM_JOB, member, JobTask, &comm);
+    if(MPIU_SimulationComm != MPI_COMM_NULL)
+        MPI_Comm_free(&MPIU_SimulationComm);
+    MPIU_SimulationComm = comm;
+    return member;
+}
+
 int
 MPIU_Any(int condition, MPI_Comm comm)
 {
@@ -2,6 +2,8 @@
 #define __UTILS_SYSTEM_H__
 
 #include <stdint.h>
+#include <mpi.h>
+#include "simulationcomm.h"
 
 /* Note on a 32-bit architecture MPI_LONG may be 32-bit,
  * so these should be MPI_LONG_LONG. But in
@@ -36,6 +38,23 @@ int64_t count_sum(int64_t countLocal);
 int MPIU_Any(int condition, MPI_Comm comm);
 void MPIU_write_pids(char * filename);
 
+/* Read a whole file on the root rank and broadcast it, so that only one rank
+ * touches the file system. Returns a NUL terminated buffer on every rank of comm,
+ * allocated with ta_malloc (free with ta_free), or NULL on every rank if the file could not be read.*/
+char * MPIU_file_get_content(const char * filename, int root, MPI_Comm comm);
+
+/* Read only tables with one copy per node, in MPI-3 shared memory windows.
+ * MPIU_alloc_node_shared is collective on MPI_COMM_WORLD and returns size bytes
+ * owned by the first rank of the node, the node leader, and mapped by the other ranks.
+ * Only write to the table on world rank 0, or on the leader of each node, and then
+ * call MPIU_Bcast_node_shared, also collectively, which copies the table of world rank 0
+ * to every node and synchronises the window. With size 0 it only synchronises, for tables
+ * each node leader computed itself. The window is never freed, so use it for
+ * tables which last the whole run. World rank 0 is always a node leader.*/
+int MPIU_node_leader(void);
+void * MPIU_alloc_node_shared(size_t size, MPI_Win * win);
+void MPIU_Bcast_node_shared(void * table, size_t size, MPI_Win win);
+
 /* Compact an array which has segments (usually corresponding to different threads).
  * After this is run, it will be a single contiguous array. The memory can then be realloced.
  * Function returns size of the final array.*/
@@ -48,10 +67,22 @@ int MPI_Alltoallv_smart(void *sendbuf, int *sendcnts, int *sdispls,
         MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
         int *rdispls, MPI_Datatype recvtype, MPI_Comm comm);
 
+/* MPI_Alltoall of one element of a contiguous type per rank, sending only the non-zero elements.
+ * Zero elements of recvbuf are zeroed. For counts of exports, which mostly go to few ranks.*/
+int MPI_Alltoall_sparse(void *sendbuf, void *recvbuf, MPI_Datatype type, MPI_Comm comm);
+
+/* Point to point MPI_Alltoallv. Messages over MPIU_MAX_MESSAGE_BYTES (1GB) are sent in chunks,
+ * so the buffers may exceed 2GB. The send and receive types must have the same extent.*/
 int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
         MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
         int *rdispls, MPI_Datatype recvtype, MPI_Comm comm);
 
+/* MPI_Alltoallv for dense exchanges, which uses MPI_Alltoallv_sparse
+ * if any task has a buffer of more than 2GB.*/
+int MPI_Alltoallv_large(void *sendbuf, int *sendcnts, int *sdispls,
+        MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
+        int *rdispls, MPI_Datatype recvtype, MPI_Comm comm);
+
 double timediff(double t0, double t1);
 double second(void);
 size_t sizemax(size_t a, size_t b);
@@ -74,10 +105,22 @@ static inline int atomic_add_and_fetch(int * ptr, int value) {
     }
     return k;
 }
+/* Set *ptr to newval if it is still oldval. Returns true if the swap happened.*/
+static inline int atomic_compare_and_swap(int * ptr, int oldval, int newval) {
+    return __atomic_compare_exchange_n(ptr, &oldval, newval, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
 
 void MPIU_Trace(MPI_Comm comm, int where, const char * fmt, ...);
 void MPIU_Tracev(MPI_Comm comm, int where, const char * fmt, va_list va);
 
+/* While aggregation is on, the messages of single ranks (where > 0) are not printed but buffered,
+ * one entry for each format string, until MPIU_Trace_flush. This collective call merges the
+ * buffers of all ranks and rank 0 prints each message once, with the number of ranks and times
+ * it was seen, such as "1234 ranks, 5000 times, first Task 7: Tree export buffer full".
+ * Turning aggregation off prints what this rank still buffers, without communication, as endrun does.*/
+void MPIU_Trace_aggregate(int on);
+void MPIU_Trace_flush(MPI_Comm comm);
+
 int _MPIU_Barrier(const char * fn, const int ln, MPI_Comm comm);
 
 /* Fancy barrier which warns if there is a lot of imbalance. */
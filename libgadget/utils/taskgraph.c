@@ -0,0 +1,60 @@
+#include <string.h>
+
+#include "taskgraph.h"
+#include "endrun.h"
+
+int
+taskgraph_add(TaskGraph * tg, const char * name, enum TaskKind kind, taskgraph_function func, void * data)
+{
+    if(tg->ntask == TASKGRAPH_MAX_TASKS)
+        endrun(1, "Too many tasks in the graph adding %s\n", name);
+    TaskGraphTask * task = &tg->tasks[tg->ntask];
+    memset(task, 0, sizeof(task[0]));
+    task->name = name;
+    task->kind = kind;
+    task->func = func;
+    task->data = data;
+    return tg->ntask++;
+}
+
+void
+taskgraph_depends(TaskGraph * tg, int task, int on)
+{
+    if(task < 0 || on < 0)
+        return;
+    TaskGraphTask * t = &tg->tasks[task];
+    if(t->ndeps == TASKGRAPH_MAX_DEPS)
+        endrun(1, "Too many dependencies for task %s\n", t->name);
+    t->deps[t->ndeps++] = on;
+}
+
+static int
+taskgraph_ready(const TaskGraph * tg, const TaskGraphTask * t)
+{
+    int d;
+    for(d = 0; d < t->ndeps; d++)
+        if(!tg->tasks[t->deps[d]].done)
+            return 0;
+    return 1;
+}
+
+void
+taskgraph_run(TaskGraph * tg)
+{
+    int ndone;
+    for(ndone = 0; ndone < tg->ntask; ndone++) {
+        int i, next = -1;
+        for(i = 0; i < tg->ntask; i++) {
+            const TaskGraphTask * t = &tg->tasks[i];
+            if(t->done || !taskgraph_ready(tg, t))
+                continue;
+            if(next < 0 || t->kind < tg->tasks[next].kind)
+                next = i;
+        }
+        if(next < 0)
+            endrun(1, "The task graph has a cycle: %d of %d tasks could run\n", ndone, tg->ntask);
+        tg->tasks[next].func(tg->tasks[next].data);
+        tg->tasks[next].done = 1;
+    }
+    tg->ntask = 0;
+}
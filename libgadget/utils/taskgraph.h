@@ -0,0 +1,47 @@
+#ifndef __UTILS_TASKGRAPH_H__
+#define __UTILS_TASKGRAPH_H__
+
+/* A small dependency driven scheduler for the stages of a time step.
+ * A stage which communicates may be split in two tasks: one which posts the nonblocking
+ * communication and one which completes it. The scheduler then runs the posting tasks as
+ * early as their dependencies allow and the completing tasks as late as they allow, so that
+ * the independent stages run while the messages are in flight.
+ * Stages are collective, so the graph must be the same on every rank: it is run in the same order.*/
+
+#define TASKGRAPH_MAX_TASKS 32
+#define TASKGRAPH_MAX_DEPS 8
+
+/* Of the tasks which are ready, those of the lowest kind run first, then those added first*/
+enum TaskKind {
+    TASK_POST = 0,      /* posts communication: run as early as possible*/
+    TASK_COMPUTE = 1,
+    TASK_COMPLETE = 2,  /* completes communication: run as late as possible*/
+};
+
+typedef void (*taskgraph_function)(void * data);
+
+typedef struct TaskGraphTask {
+    const char * name;
+    taskgraph_function func;
+    void * data;
+    enum TaskKind kind;
+    int deps[TASKGRAPH_MAX_DEPS];
+    int ndeps;
+    int done;
+} TaskGraphTask;
+
+typedef struct TaskGraph {
+    TaskGraphTask tasks[TASKGRAPH_MAX_TASKS];
+    int ntask;
+} TaskGraph;
+
+/* Add a task calling func(data). Returns the task number, for taskgraph_depends.*/
+int taskgraph_add(TaskGraph * tg, const char * name, enum TaskKind kind, taskgraph_function func, void * data);
+
+/* Make task run after task on. Either may be -1, for a task which was not added, when nothing is done.*/
+void taskgraph_depends(TaskGraph * tg, int task, int on);
+
+/* Run all of the tasks, each after the tasks it depends on. Returns the graph to empty.*/
+void taskgraph_run(TaskGraph * tg);
+
+#endif
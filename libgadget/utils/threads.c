@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <string.h>
+#include <omp.h>
+
+#include "threads.h"
+#include "endrun.h"
+#include "mymalloc.h"
+#include "system.h"
+
+static int StageThreads[THREADS_NSTAGE];
+
+void
+set_thread_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        StageThreads[THREADS_PM] = param_get_int(ps, "PMThreads");
+        StageThreads[THREADS_SORT] = param_get_int(ps, "SortThreads");
+        StageThreads[THREADS_IO] = param_get_int(ps, "IOThreads");
+    }
+    MPI_Bcast(StageThreads, THREADS_NSTAGE, MPI_INT, 0, MPI_COMM_WORLD);
+    message(0, "Threads of the PM stage: %d, sort: %d, I/O: %d, of %d.\n",
+            stage_threads(THREADS_PM), stage_threads(THREADS_SORT), stage_threads(THREADS_IO), omp_get_max_threads());
+}
+
+void
+set_stage_threads(enum ThreadStage stage, int nthreads)
+{
+    StageThreads[stage] = nthreads;
+}
+
+int
+stage_threads(enum ThreadStage stage)
+{
+    const int maxthreads = omp_get_max_threads();
+    if(StageThreads[stage] <= 0 || StageThreads[stage] > maxthreads)
+        return maxthreads;
+    return StageThreads[stage];
+}
+
+/* Print the cpus in a set as a list of ranges, such as 0-3,8*/
+static void
+format_cpuset(const cpu_set_t * set, char * buf, size_t size)
+{
+    size_t len = 0;
+    int cpu;
+    buf[0] = '\0';
+    for(cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if(!CPU_ISSET(cpu, set))
+            continue;
+        int last = cpu;
+        while(last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        if(last > cpu)
+            len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        else
+            len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", cpu);
+        cpu = last;
+    }
+}
+
+void
+report_thread_affinity(MPI_Comm comm)
+{
+    int ThisTask;
+    MPI_Comm_rank(comm, &ThisTask);
+
+    const int Nt = omp_get_max_threads();
+    cpu_set_t * sets = ta_malloc("cpusets", cpu_set_t, Nt);
+    int failed = 0;
+    /* On Linux pid 0 is the calling thread, so each thread reads its own mask*/
+    #pragma omp parallel num_threads(Nt) reduction(+: failed)
+    {
+        const int tid = omp_get_thread_num();
+        CPU_ZERO(&sets[tid]);
+        if(sched_getaffinity(0, sizeof(cpu_set_t), &sets[tid]) != 0)
+            failed++;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_SUM, comm);
+    if(failed) {
+        message(0, "Could not read the thread affinity of %d threads.\n", failed);
+        ta_free(sets);
+        return;
+    }
+
+    if(ThisTask == 0) {
+        char buf[256];
+        int i;
+        for(i = 0; i < Nt; i++) {
+            format_cpuset(&sets[i], buf, sizeof(buf));
+            message(0, "Thread %d of rank 0 runs on cpus %s\n", i, buf);
+        }
+    }
+
+    /* The cpus of the rank, and whether two of its threads may run on the same cpu,
+     * as they do if they are not bound at all*/
+    cpu_set_t mine, node, shared;
+    CPU_ZERO(&mine);
+    int i, threadoverlap = 0;
+    for(i = 0; i < Nt; i++) {
+        cpu_set_t both;
+        CPU_AND(&both, &mine, &sets[i]);
+        if(CPU_COUNT(&both) > 0)
+            threadoverlap = 1;
+        CPU_OR(&mine, &mine, &sets[i]);
+    }
+    ta_free(sets);
+
+    MPI_Comm NodeComm;
+    int NodeTask, NodeSize;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &NodeComm);
+    MPI_Comm_rank(NodeComm, &NodeTask);
+    MPI_Comm_size(NodeComm, &NodeSize);
+    cpu_set_t * all = ta_malloc("nodecpusets", cpu_set_t, NodeSize);
+    MPI_Allgather(&mine, sizeof(cpu_set_t), MPI_BYTE, all, sizeof(cpu_set_t), MPI_BYTE, NodeComm);
+    CPU_ZERO(&node);
+    CPU_ZERO(&shared);
+    for(i = 0; i < NodeSize; i++) {
+        cpu_set_t both;
+        CPU_AND(&both, &node, &all[i]);
+        CPU_OR(&shared, &shared, &both);
+        CPU_OR(&node, &node, &all[i]);
+    }
+    ta_free(all);
+    MPI_Comm_free(&NodeComm);
+
+    /* Ranks sharing cpus between them, or threads of a rank sharing cpus with each other*/
+    int overlap[2] = {CPU_COUNT(&shared), threadoverlap};
+    MPI_Allreduce(MPI_IN_PLACE, overlap, 2, MPI_INT, MPI_MAX, comm);
+    if(overlap[0] > 0)
+        message(0, "Warning: the ranks on a node share %d cpus. Bind each rank to its own cpus, for example with mpirun --bind-to.\n", overlap[0]);
+    if(overlap[1] > 0)
+        message(0, "Threads of a rank may run on the same cpus. Set OMP_PROC_BIND=close and OMP_PLACES=cores to give each thread its own.\n");
+}
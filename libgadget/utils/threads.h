@@ -0,0 +1,28 @@
+#ifndef __UTILS_THREADS_H__
+#define __UTILS_THREADS_H__
+
+#include <mpi.h>
+#include "paramset.h"
+
+/* Stages which scale poorly beyond a few threads and so may run on fewer threads
+ * than the rest of the code. Use as #pragma omp parallel num_threads(stage_threads(...)).*/
+enum ThreadStage {
+    THREADS_PM = 0,     /* The FFTs and the pencil exchanges of petapm*/
+    THREADS_SORT = 1,   /* qsort_openmp and the radix sort, used by mpsort*/
+    THREADS_IO = 2,     /* Packing and unpacking the snapshot buffers in petaio*/
+    THREADS_NSTAGE = 3,
+};
+
+/* Read PMThreads, SortThreads and IOThreads. Collective.*/
+void set_thread_params(ParameterSet * ps);
+
+/* Number of threads of a stage: 0, the default, means omp_get_max_threads().
+ * Larger values are reduced to omp_get_max_threads().*/
+void set_stage_threads(enum ThreadStage stage, int nthreads);
+int stage_threads(enum ThreadStage stage);
+
+/* Print the cpus each OpenMP thread of rank 0 may run on, and warn if the threads
+ * of the ranks on a node are bound to overlapping cpus. Collective on comm.*/
+void report_thread_affinity(MPI_Comm comm);
+
+#endif
@@ -2,6 +2,13 @@
 #include <mpi.h>
 #include <string.h>
 #include <stdio.h>
+#include <omp.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #include "walltime.h"
 
 #include "utils.h"
@@ -10,6 +17,36 @@ static struct ClockTable * CT = NULL;
 
 static double WallTimeClock;
 static double LastReportTime;
+/* Incremented whenever the clocks move in the table, so the cached ids of WalltimeSite are stale*/
+static int ClockGeneration = 1;
+
+/* Events are buffered between calls to walltime_summary. If the buffer fills up
+ * within a step the later events are dropped and counted.*/
+#define TRACE_MAX_EVENTS 16384
+
+struct TraceEvent {
+    char name[128];
+    double start;
+    double end;
+    int tid;
+};
+
+static struct TraceEvent * TraceEvents;
+static int NTraceEvents;
+static int64_t NTraceDropped;
+static int64_t NTraceWritten;
+static FILE * TraceFile;
+static double TraceZero;
+static int TraceRank;
+
+static void walltime_trace_flush(void);
+
+/* perf_event file descriptors, WALLTIME_NPERF for each thread. NULL if the counters are off.*/
+static int * PerfFd;
+static int PerfNThreads;
+/* Counts at the last walltime_measure*/
+static double PerfLast[WALLTIME_NPERF];
+static void walltime_perf_read(double * counts);
 
 static void walltime_clock_insert(char * name);
 static void walltime_summary_clocks(struct Clock * C, int N, int root, MPI_Comm comm);
@@ -18,6 +55,7 @@ static double seconds();
 
 void walltime_init(struct ClockTable * ct) {
     CT = ct;
+    ClockGeneration++;
     CT->Nmax = 512;
     CT->N = 0;
     CT->ElapsedTime = 0;
@@ -27,17 +65,31 @@ void walltime_init(struct ClockTable * ct) {
 }
 
 static void walltime_summary_clocks(struct Clock * C, int N, int root, MPI_Comm comm) {
-    double * t = ta_malloc("clocks", double, 4 * N);
+    double * t = ta_malloc("clocks", double, 6 * N);
     double * min = t + N;
     double * max = t + 2 * N;
     double * sum = t + 3 * N;
+    double * mem = t + 4 * N;
+    double * maxmem = t + 5 * N;
     int i;
     for(i = 0; i < CT->N; i ++) {
         t[i] = C[i].time;
+        mem[i] = C[i].peakmem;
     }
     MPI_Reduce(t, min, N, MPI_DOUBLE, MPI_MIN, root, comm);
     MPI_Reduce(t, max, N, MPI_DOUBLE, MPI_MAX, root, comm);
     MPI_Reduce(t, sum, N, MPI_DOUBLE, MPI_SUM, root, comm);
+    MPI_Reduce(mem, maxmem, N, MPI_DOUBLE, MPI_MAX, root, comm);
+    if(PerfFd) {
+        double * perf = ta_malloc("perf", double, 2 * WALLTIME_NPERF * N);
+        double * perfsum = perf + WALLTIME_NPERF * N;
+        for(i = 0; i < CT->N; i ++)
+            memcpy(perf + WALLTIME_NPERF * i, C[i].perf, sizeof(C[i].perf));
+        MPI_Reduce(perf, perfsum, WALLTIME_NPERF * N, MPI_DOUBLE, MPI_SUM, root, comm);
+        for(i = 0; i < CT->N; i ++)
+            memcpy(C[i].perfsum, perfsum + WALLTIME_NPERF * i, sizeof(C[i].perfsum));
+        ta_free(perf);
+    }
 
     int NTask;
     MPI_Comm_size(comm, &NTask);
@@ -46,6 +98,7 @@ static void walltime_summary_clocks(struct Clock * C, int N, int root, MPI_Comm
         C[i].min = min[i];
         C[i].max = max[i];
         C[i].mean = sum[i] / NTask;
+        C[i].maxpeakmem = maxmem[i];
     }
     ta_free(t);
 }
@@ -57,7 +110,12 @@ void walltime_summary(int root, MPI_Comm comm) {
     int i;
     /* add to the cumulative time */
     for(i = 0; i < CT->N; i ++) {
+        int k;
         CT->AC[i].time += CT->C[i].time;
+        for(k = 0; k < WALLTIME_NPERF; k++)
+            CT->AC[i].perf[k] += CT->C[i].perf[k];
+        if(CT->C[i].peakmem > CT->AC[i].peakmem)
+            CT->AC[i].peakmem = CT->C[i].peakmem;
     }
     walltime_summary_clocks(CT->C, CT->N, root, comm);
     walltime_summary_clocks(CT->AC, CT->N, root, comm);
@@ -65,6 +123,8 @@ void walltime_summary(int root, MPI_Comm comm) {
     /* clear .time for next step */
     for(i = 0; i < CT->N; i ++) {
         CT->C[i].time = 0;
+        CT->C[i].peakmem = 0;
+        memset(CT->C[i].perf, 0, sizeof(CT->C[i].perf));
     }
     MPI_Barrier(comm);
     /* wo do this here because all processes are sync after summary_clocks*/
@@ -72,6 +132,7 @@ void walltime_summary(int root, MPI_Comm comm) {
     LastReportTime = seconds();
     CT->ElapsedTime += step_all;
     CT->StepTime = step_all;
+    walltime_trace_flush();
 }
 
 static int clockcmp(const void * c1, const void * c2) {
@@ -107,6 +168,7 @@ static void walltime_clock_insert(char * name) {
     CT->N ++;
     qsort_openmp(CT->C, CT->N, sizeof(struct Clock), clockcmp);
     qsort_openmp(CT->AC, CT->N, sizeof(struct Clock), clockcmp);
+    ClockGeneration++;
 }
 
 int walltime_clock(char * name) {
@@ -160,16 +222,26 @@ static void walltime_update_parents() {
         char * prefix = CT->C[i].name;
         int l = strlen(prefix);
         double t = 0;
+        double perf[WALLTIME_NPERF] = {0};
         for(j = i + 1; j < CT->N; j++) {
             if(0 == strncmp(prefix, CT->C[j].name, l)) {
+                int k;
                 t += CT->C[j].time;
+                for(k = 0; k < WALLTIME_NPERF; k++)
+                    perf[k] += CT->C[j].perf[k];
+                /* The peak memory of a parent is the largest of its children*/
+                if(CT->C[j].peakmem > CT->C[i].peakmem)
+                    CT->C[i].peakmem = CT->C[j].peakmem;
                 CT->Nchildren[i] ++;
             } else {
                 break;
             }
         }
         /* update only if there are children */
-        if (t > 0) CT->C[i].time = t;
+        if (t > 0) {
+            CT->C[i].time = t;
+            memcpy(CT->C[i].perf, perf, sizeof(perf));
+        }
     }
 }
 
@@ -182,34 +254,281 @@ double walltime_add_internal(char * name, double dt) {
     CT->C[id].time += dt;
     return dt;
 }
-double walltime_measure_internal(char * name) {
+
+/* Charge the time since the last measurement to clock id, or to nothing if id < 0.*/
+static double walltime_measure_id(const int id) {
     double t = seconds();
     double dt = t - WallTimeClock;
     WallTimeClock = seconds();
-    if(name[0] != '.') {
-        int id = walltime_clock(name);
+    /* The memory peak of the main allocator since the last measurement belongs to this clock as well*/
+    const double peakmem = allocator_get_interval_peak(A_MAIN);
+    allocator_reset_peak(A_MAIN);
+    if(TraceFile && id >= 0)
+        walltime_trace_event(CT->C[id].name, NULL, t - dt, t);
+    double perf[WALLTIME_NPERF] = {0};
+    if(PerfFd) {
+        int k;
+        walltime_perf_read(perf);
+        for(k = 0; k < WALLTIME_NPERF; k++) {
+            const double count = perf[k];
+            perf[k] -= PerfLast[k];
+            PerfLast[k] = count;
+        }
+    }
+    if(id >= 0) {
+        int k;
         CT->C[id].time += dt;
+        for(k = 0; k < WALLTIME_NPERF; k++)
+            CT->C[id].perf[k] += perf[k];
+        if(peakmem > CT->C[id].peakmem)
+            CT->C[id].peakmem = peakmem;
     }
     return dt;
 }
-double walltime_measure_full(char * name, char * file, int line) {
-    char fullname[128] = {0};
+double walltime_measure_internal(char * name) {
+    return walltime_measure_id(name[0] != '.' ? walltime_clock(name) : -1);
+}
+
+/* The clock name of a call site: name@file:line*/
+static void walltime_full_name(char * fullname, char * name, char * file, int line) {
     char * basename = file + strlen(file);
     while(basename >= file && *basename != '/') basename --;
     basename ++;
     sprintf(fullname, "%s@%s:%04d", name, basename, line);
+}
+
+double walltime_measure_full(char * name, char * file, int line) {
+    char fullname[128] = {0};
+    walltime_full_name(fullname, name, file, line);
     return walltime_measure_internal(fullname);
 }
 double walltime_add_full(char * name, double dt, char * file, int line) {
     char fullname[128] = {0};
-    char * basename = file + strlen(file);
-    while(basename >= file && *basename != '/') basename --;
-    basename ++;
-    sprintf(fullname, "%s@%s:%04d", name, basename, line);
+    walltime_full_name(fullname, name, file, line);
     return walltime_add_internal(fullname, dt);
 
 }
 
+/* The clock id of a call site, looked up only if the clocks moved since the last call.*/
+static int walltime_site_clock(struct WalltimeSite * site, char * name, char * file, int line) {
+    if(site->generation != ClockGeneration) {
+        char fullname[128] = {0};
+        walltime_full_name(fullname, name, file, line);
+        site->id = walltime_clock(fullname);
+        /* After the lookup, which may have added the clock*/
+        site->generation = ClockGeneration;
+    }
+    return site->id;
+}
+
+double walltime_measure_site(struct WalltimeSite * site, char * name, char * file, int line) {
+    if(name[0] == '.')
+        return walltime_measure_id(-1);
+    return walltime_measure_id(walltime_site_clock(site, name, file, line));
+}
+
+double walltime_add_site(struct WalltimeSite * site, char * name, double dt, char * file, int line) {
+    const int id = walltime_site_clock(site, name, file, line);
+    CT->C[id].time += dt;
+    return dt;
+}
+
+void walltime_trace_open(const char * fname, MPI_Comm comm)
+{
+    MPI_Comm_rank(comm, &TraceRank);
+    TraceFile = fopen(fname, "w");
+    if(!TraceFile)
+        endrun(1, "Could not open trace file %s\n", fname);
+    fprintf(TraceFile, "[\n");
+    TraceEvents = malloc(TRACE_MAX_EVENTS * sizeof(struct TraceEvent));
+    NTraceEvents = 0;
+    NTraceDropped = 0;
+    NTraceWritten = 0;
+    /* A common origin, so the ranks line up in the viewer*/
+    MPI_Barrier(comm);
+    TraceZero = seconds();
+}
+
+int walltime_trace_enabled(void)
+{
+    return TraceFile != NULL;
+}
+
+void walltime_trace_event(const char * name, const char * phase, double tstart, double tend)
+{
+    if(!TraceFile)
+        return;
+    int n;
+    #pragma omp atomic capture
+    n = NTraceEvents++;
+    if(n >= TRACE_MAX_EVENTS) {
+        #pragma omp atomic
+        NTraceDropped++;
+        return;
+    }
+    struct TraceEvent * ev = &TraceEvents[n];
+    if(phase)
+        snprintf(ev->name, sizeof(ev->name), "%s/%s", name, phase);
+    else
+        snprintf(ev->name, sizeof(ev->name), "%s", name);
+    ev->start = tstart;
+    ev->end = tend;
+    ev->tid = omp_get_thread_num();
+}
+
+/* Append the buffered events to the trace file. Times are in microseconds.*/
+static void walltime_trace_flush(void)
+{
+    if(!TraceFile)
+        return;
+    int i;
+    const int nev = NTraceEvents < TRACE_MAX_EVENTS ? NTraceEvents : TRACE_MAX_EVENTS;
+    for(i = 0; i < nev; i++) {
+        const struct TraceEvent * ev = &TraceEvents[i];
+        fprintf(TraceFile, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            NTraceWritten > 0 ? ",\n" : "", ev->name, TraceRank, ev->tid,
+            (ev->start - TraceZero) * 1e6, (ev->end - ev->start) * 1e6);
+        NTraceWritten++;
+    }
+    fflush(TraceFile);
+    if(NTraceDropped > 0)
+        message(1, "Dropped %ld trace events this step: more than %d.\n", NTraceDropped, TRACE_MAX_EVENTS);
+    NTraceEvents = 0;
+    NTraceDropped = 0;
+}
+
+void walltime_trace_close(void)
+{
+    if(!TraceFile)
+        return;
+    walltime_trace_flush();
+    fprintf(TraceFile, "\n]\n");
+    fclose(TraceFile);
+    TraceFile = NULL;
+    free(TraceEvents);
+    TraceEvents = NULL;
+}
+
+#ifdef __linux__
+static int
+perf_event_open_thread(const uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    /* The counts are scaled if the counters are multiplexed*/
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    /* This thread, on any cpu*/
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+int walltime_perf_open(MPI_Comm comm)
+{
+    int failed = 1;
+#ifdef __linux__
+    const uint64_t config[WALLTIME_NPERF] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES};
+    PerfNThreads = omp_get_max_threads();
+    PerfFd = malloc(PerfNThreads * WALLTIME_NPERF * sizeof(int));
+    failed = 0;
+    /* Each counter follows the thread which opened it, so every OpenMP thread opens its own.
+     * They are read from the main thread.*/
+    #pragma omp parallel num_threads(PerfNThreads) reduction(+: failed)
+    {
+        int k;
+        const int tid = omp_get_thread_num();
+        for(k = 0; k < WALLTIME_NPERF; k++) {
+            PerfFd[tid * WALLTIME_NPERF + k] = perf_event_open_thread(config[k]);
+            if(PerfFd[tid * WALLTIME_NPERF + k] < 0)
+                failed++;
+        }
+    }
+#endif
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_SUM, comm);
+    if(failed) {
+        message(0, "Could not open the hardware performance counters: check /proc/sys/kernel/perf_event_paranoid. Not recording them.\n");
+        walltime_perf_close();
+        return 0;
+    }
+    walltime_perf_read(PerfLast);
+    return 1;
+}
+
+void walltime_perf_close(void)
+{
+    if(!PerfFd)
+        return;
+#ifdef __linux__
+    int i;
+    for(i = 0; i < PerfNThreads * WALLTIME_NPERF; i++)
+        if(PerfFd[i] >= 0)
+            close(PerfFd[i]);
+#endif
+    free(PerfFd);
+    PerfFd = NULL;
+}
+
+/* Read the counts summed over the threads since walltime_perf_open*/
+static void walltime_perf_read(double * counts)
+{
+    int k;
+    for(k = 0; k < WALLTIME_NPERF; k++)
+        counts[k] = 0;
+#ifdef __linux__
+    int t;
+    for(t = 0; t < PerfNThreads; t++) {
+        for(k = 0; k < WALLTIME_NPERF; k++) {
+            /* value, time enabled, time running*/
+            uint64_t val[3];
+            if(read(PerfFd[t * WALLTIME_NPERF + k], val, sizeof(val)) != sizeof(val))
+                continue;
+            if(val[2] > 0)
+                counts[k] += (double) val[0] * val[1] / val[2];
+        }
+    }
+#endif
+}
+
+void walltime_report_perf(FILE * fp, int root, MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if(rank != root || !PerfFd) return;
+    int i, NTask;
+    MPI_Comm_size(comm, &NTask);
+    fprintf(fp, "%-28s  %10s %6s %8s %10s\n", "Hardware counters", "Gcycles", "IPC", "LLCmiss%", "LLC GB/s");
+    for(i = 0; i < CT->N; i ++) {
+        char * name = CT->C[i].name;
+        int level = 0;
+        char * p = name;
+        while(*p) {
+            if(*p == '/') {
+                level ++;
+                name = p + 1;
+            }
+            p++;
+        }
+        /* if there is just one child, don't print it*/
+        if(CT->Nchildren[i] == 1) continue;
+        const double * perf = CT->C[i].perfsum;
+        if(perf[PERF_CYCLES] == 0) continue;
+        /* Each miss moves a 64 byte cache line from memory. This is the mean memory bandwidth of a rank.*/
+        const double bandwidth = CT->C[i].mean > 0 ? perf[PERF_CACHE_MISSES] * 64 / NTask / CT->C[i].mean : 0;
+        fprintf(fp, "%*s%-26s  %10.2f %6.2f %8.2f %10.2f\n",
+                level, "",  /* indents */
+                name,   /* just the last seg of name*/
+                perf[PERF_CYCLES] / 1e9,
+                perf[PERF_INSTRUCTIONS] / perf[PERF_CYCLES],
+                perf[PERF_CACHE_REFERENCES] > 0 ? perf[PERF_CACHE_MISSES] / perf[PERF_CACHE_REFERENCES] * 100. : 0,
+                bandwidth / 1e9
+                );
+    }
+}
+
 /* returns the number of cpu-ticks in seconds that
  * have elapsed. (or the wall-clock time)
  */
@@ -247,6 +566,37 @@ void walltime_report(FILE * fp, int root, MPI_Comm comm) {
                 );
     }
 }
+
+void walltime_report_memory(FILE * fp, int root, MPI_Comm comm, double total) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if(rank != root) return;
+    int i;
+    for(i = 0; i < CT->N; i ++) {
+        char * name = CT->C[i].name;
+        int level = 0;
+        char * p = name;
+        while(*p) {
+            if(*p == '/') {
+                level ++;
+                name = p + 1;
+            }
+            p++;
+        }
+        /* if there is just one child, don't print it*/
+        if(CT->Nchildren[i] == 1) continue;
+        /* Clocks which have never seen any memory*/
+        if(CT->AC[i].maxpeakmem == 0) continue;
+        fprintf(fp, "%*s%-26s  %10.1f %5.1f%%  %10.1f %5.1f%%\n",
+                level, "",  /* indents */
+                name,   /* just the last seg of name*/
+                CT->C[i].maxpeakmem / (1024. * 1024.),
+                CT->C[i].maxpeakmem / total * 100.,
+                CT->AC[i].maxpeakmem / (1024. * 1024.),
+                CT->AC[i].maxpeakmem / total * 100.
+                );
+    }
+}
 #if 0
 #define HELLO atom(&atomtable, "Hello")
 #define WORLD atom(&atomtable, "WORLD")
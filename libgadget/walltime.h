@@ -5,12 +5,26 @@ int walltime_clock(char * name);
 void walltime_reset();
 #define WALLTIME_IGNORE "."
 #define LINENO(a, b) a ":" # b
-#define walltime_measure(name) walltime_measure_full(name, __FILE__ , __LINE__) 
-#define walltime_add(name, dt) walltime_add_full(name, dt,  __FILE__, __LINE__)
+
+/* The clock of a walltime_measure or walltime_add call site. The clock name is
+ * formatted and looked up on the first call only, and again if clocks were added since,
+ * which moves them in the table. After that a measurement is a timer read and an add.*/
+struct WalltimeSite {
+    int id;
+    /* Clock table generation when id was found. 0 if not yet found*/
+    int generation;
+};
+
+#define walltime_measure(name) ({ static struct WalltimeSite walltime_site_; \
+        walltime_measure_site(&walltime_site_, name, __FILE__, __LINE__); })
+#define walltime_add(name, dt) ({ static struct WalltimeSite walltime_site_; \
+        walltime_add_site(&walltime_site_, name, dt, __FILE__, __LINE__); })
 double walltime_measure_internal(char * name);
 double walltime_add_internal(char * name, double dt);
 double walltime_measure_full(char * name, char * file, int line);
 double walltime_add_full(char * name, double dt, char * file, int line);
+double walltime_measure_site(struct WalltimeSite * site, char * name, char * file, int line);
+double walltime_add_site(struct WalltimeSite * site, char * name, double dt, char * file, int line);
 
 enum clocktype {
     CLOCK_STEP_MEAN ,
@@ -35,6 +49,18 @@ double walltime_get(char * name, enum clocktype type);
 
 void walltime_summary(int root, MPI_Comm comm);
 void walltime_report(FILE * fd, int root, MPI_Comm comm);
+/* Write the peak memory of each clock, the largest on any rank, to fd on root. total is the size of the allocator.*/
+void walltime_report_memory(FILE * fd, int root, MPI_Comm comm, double total);
+
+/* Hardware counters recorded for each clock, if enabled by walltime_perf_open*/
+enum walltime_perf_counter {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_REFERENCES,
+    /* Last level cache misses*/
+    PERF_CACHE_MISSES,
+    WALLTIME_NPERF,
+};
 
 struct Clock {
     char name[128];
@@ -42,6 +68,13 @@ struct Clock {
     double max;
     double min;
     double mean;
+    /* Peak bytes used in the main allocator while this clock was measured,
+     * on this rank and the largest on any rank after walltime_summary*/
+    double peakmem;
+    double maxpeakmem;
+    /* Hardware counts summed over the threads on this rank, and over all ranks after walltime_summary*/
+    double perf[WALLTIME_NPERF];
+    double perfsum[WALLTIME_NPERF];
     char symbol;
 };
 
@@ -58,4 +91,23 @@ struct ClockTable {
     double PMStepTime;
 };
 void walltime_init(struct ClockTable * table);
+
+/* Optional event trace of the timeline in the Chrome trace JSON format, which Perfetto and
+ * chrome://tracing read. Each rank writes its own file, with the rank as the pid.
+ * Every walltime_measure region is an event on thread 0. Other code may add events with
+ * walltime_trace_event, which is thread safe. Events are buffered and written at walltime_summary.*/
+void walltime_trace_open(const char * fname, MPI_Comm comm);
+void walltime_trace_close(void);
+/* Add an event named name, or name/phase if phase is not NULL, from tstart to tend as returned by MPI_Wtime.*/
+void walltime_trace_event(const char * name, const char * phase, double tstart, double tend);
+int walltime_trace_enabled(void);
+
+/* Count cycles, instructions and last level cache references and misses on every thread
+ * with perf_event_open, and charge them to the walltime regions like the time.
+ * Returns 0 and leaves the counters off if the kernel does not allow it.
+ * Call after the OpenMP threads are set up, and walltime_perf_close at the end.*/
+int walltime_perf_open(MPI_Comm comm);
+void walltime_perf_close(void);
+/* Write the counters of each clock summed over the ranks, for this step, to fd on root.*/
+void walltime_report_perf(FILE * fd, int root, MPI_Comm comm);
 #endif
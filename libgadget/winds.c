@@ -6,6 +6,7 @@
 #include "winds.h"
 #include "physconst.h"
 #include "treewalk.h"
+#include "treewalk_ngbiter.h"
 #include "slotsmanager.h"
 #include "timebinmgr.h"
 #include "allvars.h"
@@ -169,14 +170,21 @@ sfr_wind_weight_ngbiter(TreeWalkQueryWind * I,
         TreeWalkNgbIterWind * iter,
         LocalTreeWalk * lv);
 
+TREEWALK_DEFINE_NGBITER_VISIT(sfr_wind_weight_visit, sfr_wind_weight_ngbiter, TreeWalkNgbIterWind)
+
 static void
 sfr_wind_feedback_ngbiter(TreeWalkQueryWind * I,
         TreeWalkResultWind * O,
         TreeWalkNgbIterWind * iter,
         LocalTreeWalk * lv);
 
+TREEWALK_DEFINE_NGBITER_VISIT(sfr_wind_feedback_visit, sfr_wind_feedback_ngbiter, TreeWalkNgbIterWind)
+
 static int* NPLeft;
 
+/* Room in the neighbour cache for the candidates of each new star, over all iterations of the weight walk*/
+#define WIND_NGBCACHE_PER_STAR 16384
+
 struct WindPriv {
     struct SpinLocks * spin;
 };
@@ -220,9 +228,15 @@ winds_and_feedback(int * NewStars, int NumNewStars, ForceTree * tree)
     tw->ngbiter = (TreeWalkNgbIterFunction) sfr_wind_weight_ngbiter;
 
     tw->haswork = sfr_wind_weight_haswork;
-    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->visit = sfr_wind_weight_visit;
     tw->postprocess = (TreeWalkProcessFunction) sfr_wind_weight_postprocess;
 
+    /* The feedback searches within Hsml, inside the radius of the weight walk, and the stars
+     * do not move in between: store the candidates of the weight walk for the feedback, if the cache is enabled.
+     * Each iteration stores the candidates of the stars it walked again.*/
+    treewalk_ngbcache_alloc(tree, (int64_t) NumNewStars * WIND_NGBCACHE_PER_STAR);
+    tw->ngbcache = TREEWALK_NGBCACHE_FILL;
+
     int64_t totalleft = 0;
     sumup_large_ints(1, &NumNewStars, &totalleft);
     NPLeft = ta_malloc("NPLeft", int, NumThreads);
@@ -243,7 +257,9 @@ winds_and_feedback(int * NewStars, int NumNewStars, ForceTree * tree)
 
     /* Then run feedback */
     tw->haswork = NULL;
+    tw->ngbcache = TREEWALK_NGBCACHE_USE;
     tw->ngbiter = (TreeWalkNgbIterFunction) sfr_wind_feedback_ngbiter;
+    tw->visit = sfr_wind_feedback_visit;
     tw->postprocess = NULL;
     tw->reduce = NULL;
     struct WindPriv priv[1];
@@ -252,6 +268,7 @@ winds_and_feedback(int * NewStars, int NumNewStars, ForceTree * tree)
     priv[0].spin = init_spinlocks(PartManager->NumPart);
     treewalk_run(tw, NewStars, NumNewStars);
     free_spinlocks(priv[0].spin);
+    treewalk_ngbcache_free(tree);
     myfree(Winddata);
     walltime_measure("/Cooling/Wind");
 }
@@ -21,10 +21,25 @@ struct genic_config {
     int Seed;
     int UnitaryAmplitude;
     int InvertPhase;
+    /* Use the counter-based generator for the modes and thermal velocities*/
+    int CounterRNG;
     double Max_nuvel;
     double WDM_therm_mass;
     int MakeGlassGas;
     int MakeGlassCDM;
+    /* Use a short-range pair force for the glass, on a mesh of GlassNmesh (0 for Nmesh)*/
+    int GlassShortRange;
+    int GlassNmesh;
+    /* Replicate a cached glass tile of GlassTileNgrid^3 particles, stored in GlassTileFile*/
+    char GlassTileFile[512];
+    int GlassTileNgrid;
+    /* Number of slabs in which grid particles are made and written*/
+    int NumChunks;
+    /* Order of the Lagrangian perturbation theory displacements, 1 or 2*/
+    int LPTOrder;
+    /* Number of displacement fields transformed to real space together*/
+    int PMBatchTransforms;
+    int PMOffload;
     int  NumFiles;
     struct power_params PowerP;
 } ;
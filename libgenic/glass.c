@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <float.h>
 
 #include <gsl/gsl_rng.h>
+#include <bigfile-mpi.h>
 
 #include "allvars.h"
 #include "proto.h"
@@ -13,14 +15,15 @@
 #include <libgadget/utils.h>
 #include <libgadget/powerspectrum.h>
 #include <libgadget/gravity.h>
-
-static void potential_transfer(PetaPM *pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void force_x_transfer(PetaPM *pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void force_y_transfer(PetaPM *pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void force_z_transfer(PetaPM *pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void readout_force_x(PetaPM *pm, int i, double * mesh, double weight);
-static void readout_force_y(PetaPM *pm, int i, double * mesh, double weight);
-static void readout_force_z(PetaPM *pm, int i, double * mesh, double weight);
+#include <libgadget/partmanager.h>
+
+static void potential_transfer(PetaPM *pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void force_x_transfer(PetaPM *pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void force_y_transfer(PetaPM *pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void force_z_transfer(PetaPM *pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void readout_force_x(PetaPM *pm, int i, PetaPMReal * mesh, double weight);
+static void readout_force_y(PetaPM *pm, int i, PetaPMReal * mesh, double weight);
+static void readout_force_z(PetaPM *pm, int i, PetaPMReal * mesh, double weight);
 static PetaPMFunctions functions [] =
 {
     {"ForceX", force_x_transfer, readout_force_x},
@@ -29,16 +32,34 @@ static PetaPMFunctions functions [] =
     {NULL, NULL, NULL},
 };
 
-static PetaPMGlobalFunctions global_functions = {measure_power_spectrum, NULL, potential_transfer};
+static PetaPMGlobalFunctions global_functions = {
+    .global_readout = measure_power_spectrum,
+    .global_transfer = potential_transfer,
+};
 
 static PetaPMRegion * _prepare(PetaPM * pm, void * userdata, int * Nregions);
+/* Defined in save.c*/
+void _bigfile_utils_create_block_from_c_array(BigFile * bf, void * baseptr, char * name, char * dtype, size_t dims[], ptrdiff_t elsize, MPI_Comm comm);
 
-static void glass_force(PetaPM * pm, double t_f, struct ic_part_data * ICP, const int NumPart);
+static double glass_force(PetaPM * pm, double t_f, struct ic_part_data * ICP, const int NumPart);
 static void glass_stats(struct ic_part_data * ICP, int NumPart);
+static void glass_short_range_force(PetaPM * pm, struct ic_part_data * ICP, const int NumPart);
+
+/* Force split scale and short-range cutoff, in glass mesh cells, for the short-range glass force.*/
+#define GLASS_ASMTH 1.25
+#define GLASS_RCUT 4.5
+/* Accuracy parameter and range of the adaptive step size, in units of the oscillation period / 4.*/
+#define GLASS_STEP_ACC 0.05
+#define GLASS_MIN_STEP (1./64)
+
+static int setup_glass_tiled(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mass, struct ic_part_data * ICP);
 
 int
 setup_glass(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mass, struct ic_part_data * ICP)
 {
+    if(All2.GlassTileNgrid > 0 && strlen(All2.GlassTileFile) > 0 && idgen->Ngrid != All2.GlassTileNgrid)
+        return setup_glass_tiled(idgen, pm, shift, seed, mass, ICP);
+
     gsl_rng * rng = gsl_rng_alloc(gsl_rng_ranlxd1);
     gsl_rng_set(rng, seed + ThisTask);
     memset(ICP, 0, idgen->NumPart*sizeof(struct ic_part_data));
@@ -67,6 +88,119 @@ setup_glass(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mas
     return idgen->NumPart;
 }
 
+/* Evolve the particles under inverted gravity with damping for nsteps quarter-oscillations.
+ * If All2.GlassShortRange is set, the mesh force is smoothed on GLASS_ASMTH cells and the
+ * repulsion between close particles comes from a short-range pair force, so a coarser mesh
+ * can be used. The step is then adaptive, as close pairs give large forces at the start.*/
+/* Read the positions of a glass tile with Ntile^3 particles into tile, in units of the tile size.
+ * Returns 0 on success and 1 if the file does not exist or is the wrong size.*/
+static int
+read_glass_tile(const char * fname, const int Ntile, double * tile)
+{
+    const int64_t NumTile = (int64_t) Ntile * Ntile * Ntile;
+    int status = 1;
+    if(ThisTask == 0) {
+        BigFile bf[1];
+        BigBlock bb[1];
+        if(0 == big_file_open(bf, fname)) {
+            if(0 == big_file_open_block(bf, bb, "Position")) {
+                if(bb->size == NumTile && bb->nmemb == 3) {
+                    BigArray array[1];
+                    BigBlockPtr ptr;
+                    size_t dims[2] = {NumTile, 3};
+                    big_array_init(array, tile, "f8", 2, dims, NULL);
+                    if(0 != big_block_seek(bb, &ptr, 0) || 0 != big_block_read(bb, &ptr, array))
+                        endrun(1, "Failed to read glass tile %s: %s\n", fname, big_file_get_error_message());
+                    status = 0;
+                }
+                else
+                    message(1, "Glass tile %s has %ld particles, not %ld: remaking it\n", fname, (long) bb->size, (long) NumTile);
+                big_block_close(bb);
+            }
+            big_file_close(bf);
+        }
+    }
+    MPI_Bcast(&status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(status == 0)
+        MPI_Bcast(tile, 3 * NumTile, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    return status;
+}
+
+/* Make a glass tile with Ntile^3 particles on its own mesh, and write it to fname.*/
+static void
+make_glass_tile(const char * fname, PetaPM * pm, const int Ntile, int seed, double * tile)
+{
+    const int64_t NumTile = (int64_t) Ntile * Ntile * Ntile;
+    PetaPM tilepm[1];
+    petapm_init(tilepm, All.BoxSize, All.Asmth, 2 * Ntile, All.G, MPI_COMM_WORLD);
+    IDGenerator idgen_tile[1];
+    idgen_init(idgen_tile, tilepm, Ntile, All.BoxSize);
+    struct ic_part_data * ICP = (struct ic_part_data *) mymalloc("GlassTile", (idgen_tile->NumPart + 1) * sizeof(struct ic_part_data));
+    /* The tile is a glass in the whole box, which is then scaled down.*/
+    setup_glass(idgen_tile, tilepm, 0, seed, 1, ICP);
+
+    memset(tile, 0, 3 * NumTile * sizeof(double));
+    int i, k;
+    for(i = 0; i < idgen_tile->NumPart; i++) {
+        const uint64_t id = idgen_create_id_from_index(idgen_tile, i) - 1;
+        for(k = 0; k < 3; k++)
+            tile[3 * id + k] = ICP[i].Pos[k] / All.BoxSize;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, tile, 3 * NumTile, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    myfree(ICP);
+    petapm_destroy(tilepm);
+
+    BigFile bf;
+    if(0 != big_file_mpi_create(&bf, fname, MPI_COMM_WORLD))
+        endrun(0, "Failed to create glass tile %s: %s\n", fname, big_file_get_error_message());
+    size_t dims[2] = {ThisTask == 0 ? NumTile : 0, 3};
+    _bigfile_utils_create_block_from_c_array(&bf, tile, "Position", "f8", dims, 3 * sizeof(double), MPI_COMM_WORLD);
+    big_file_mpi_close(&bf, MPI_COMM_WORLD);
+    message(0, "Saved glass tile with %d^3 particles to %s\n", Ntile, fname);
+}
+
+/* Fill ICP with a glass made by replicating a tile of GlassTileNgrid^3 particles periodically.
+ * The tile is read from GlassTileFile-<GlassTileNgrid>-<n>, where n counts the glasses made
+ * in this run so that the CDM and gas glasses differ. If it does not exist it is made and saved,
+ * so later runs only pay for reading it. Each grid particle takes the position of the tile particle
+ * with the same index modulo the tile, so particles stay close to their grid position.*/
+static int
+setup_glass_tiled(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mass, struct ic_part_data * ICP)
+{
+    static int ntiles = 0;
+    const int Ntile = All2.GlassTileNgrid;
+    if(idgen->Ngrid % Ntile != 0)
+        endrun(0, "Glass tile size %d does not divide the grid %d\n", Ntile, idgen->Ngrid);
+
+    const int64_t NumTile = (int64_t) Ntile * Ntile * Ntile;
+    double * tile = (double *) mymalloc("GlassTilePos", 3 * NumTile * sizeof(double));
+    char * fname = fastpm_strdup_printf("%s-%d-%d", All2.GlassTileFile, Ntile, ntiles);
+    ntiles++;
+    if(read_glass_tile(fname, Ntile, tile)) {
+        message(0, "Making glass tile %s\n", fname);
+        make_glass_tile(fname, pm, Ntile, seed, tile);
+    }
+    else
+        message(0, "Read glass tile %s\n", fname);
+    myfree(fname);
+
+    const double tilesize = idgen->BoxSize * Ntile / idgen->Ngrid;
+    memset(ICP, 0, idgen->NumPart*sizeof(struct ic_part_data));
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < idgen->NumPart; i ++) {
+        const uint64_t id = idgen_create_id_from_index(idgen, i) - 1;
+        const int64_t x[3] = {id / ((uint64_t) idgen->Ngrid * idgen->Ngrid), (id / idgen->Ngrid) % idgen->Ngrid, id % idgen->Ngrid};
+        const int64_t t = ((x[0] % Ntile) * Ntile + x[1] % Ntile) * Ntile + x[2] % Ntile;
+        int k;
+        for(k = 0; k < 3; k++)
+            ICP[i].Pos[k] = (tile[3 * t + k] + x[k] / Ntile) * tilesize + shift;
+        ICP[i].Mass = mass;
+    }
+    myfree(tile);
+    return idgen->NumPart;
+}
+
 void glass_evolve(PetaPM * pm, int nsteps, char * pkoutname, struct ic_part_data * ICP, const int NumPart)
 {
     int i;
@@ -76,9 +210,17 @@ void glass_evolve(PetaPM * pm, int nsteps, char * pkoutname, struct ic_part_data
     double t_f = 0;
 
     /*Allocate memory for a power spectrum*/
-    powerspectrum_alloc(pm->ps, All.Nmesh, All.NumThreads, 0, All.BoxSize*All.UnitLength_in_cm);
+    powerspectrum_alloc(pm->ps, pm->Nmesh, All.NumThreads, 0, All.BoxSize*All.UnitLength_in_cm);
+
+    if(All2.GlassShortRange)
+        gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_ERFC, GLASS_ASMTH);
 
-    glass_force(pm, t_x, ICP, NumPart);
+    /* Mean interparticle spacing, for the adaptive step*/
+    int64_t NumPartTot = NumPart;
+    MPI_Allreduce(MPI_IN_PLACE, &NumPartTot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    const double spacing = All.BoxSize / cbrt(NumPartTot);
+
+    double maxforce = glass_force(pm, t_x, ICP, NumPart);
 
     /* Our pick of the units ensures there is an oscillation period of 2 * M_PI.
      *
@@ -88,9 +230,14 @@ void glass_evolve(PetaPM * pm, int nsteps, char * pkoutname, struct ic_part_data
      * 12 + 1 = 13, the first time phase is M_PI / 2, a close encounter to the minimum.
      *
      * */
-    for(step = 0; step < nsteps; step++) {
+    const double t_end = nsteps * M_PI / 2;
+    while(t_x < t_end * (1 - 1e-6)) {
         /* leap-frog, K D D F K */
         double dt = M_PI / 2; /* step size */
+        /* Limit the step so that no particle moves more than a fraction of the spacing under its force*/
+        if(All2.GlassShortRange && maxforce > 0)
+            dt = fmax(fmin(dt, sqrt(2 * GLASS_STEP_ACC * spacing / maxforce)), GLASS_MIN_STEP * M_PI / 2);
+        dt = fmin(dt, t_end - t_x);
         double hdt = 0.5 * dt; /* half a step */
         int d;
         /*
@@ -117,7 +264,7 @@ void glass_evolve(PetaPM * pm, int nsteps, char * pkoutname, struct ic_part_data
         }
         t_v += dt;
 
-        glass_force(pm, t_x, ICP, NumPart);
+        maxforce = glass_force(pm, t_x, ICP, NumPart);
         t_f = t_x;
 
         /* Kick */
@@ -136,6 +283,7 @@ void glass_evolve(PetaPM * pm, int nsteps, char * pkoutname, struct ic_part_data
         if(ThisTask == 0) {
             powerspectrum_save(pm->ps, All.OutputDir, pkoutname, t_f, 1.0);
         }
+        step++;
     }
 
     /*We are done with the power spectrum, free it*/
@@ -175,9 +323,9 @@ struct ic_prep_data
 /*Global to pass the particle data to the readout functions*/
 static struct ic_part_data * curICP;
 
-/* Computes the gravitational force on the PM grid
- * and saves the total matter power spectrum.*/
-static void glass_force(PetaPM * pm, double t_f, struct ic_part_data * ICP, const int NumPart) {
+/* Computes the gravitational force on the PM grid, plus the short-range force if enabled,
+ * and saves the total matter power spectrum. Returns the largest force on any particle.*/
+static double glass_force(PetaPM * pm, double t_f, struct ic_part_data * ICP, const int NumPart) {
 
     PetaPMParticleStruct pstruct = {
         ICP,
@@ -209,6 +357,220 @@ static void glass_force(PetaPM * pm, double t_f, struct ic_part_data * ICP, cons
 
     powerspectrum_sum(pm->ps);
     walltime_measure("/LongRange");
+
+    if(All2.GlassShortRange)
+        glass_short_range_force(pm, ICP, NumPart);
+
+    double maxforce2 = 0;
+    #pragma omp parallel for reduction(max: maxforce2)
+    for(i = 0; i < NumPart; i++) {
+        const double f2 = ICP[i].Disp[0] * ICP[i].Disp[0] + ICP[i].Disp[1] * ICP[i].Disp[1] + ICP[i].Disp[2] * ICP[i].Disp[2];
+        if(f2 > maxforce2)
+            maxforce2 = f2;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &maxforce2, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    return sqrt(maxforce2);
+}
+
+/* A particle, or a periodic image of one, within the short-range cutoff of another rank*/
+struct glass_ghost
+{
+    double Pos[3];
+    double Mass;
+};
+
+/* Does the point lie in the box, given as min[3], max[3], grown by rcut?*/
+static int
+glass_in_box(const double pos[3], const double box[6], const double rcut)
+{
+    int k;
+    for(k = 0; k < 3; k++)
+        if(pos[k] < box[k] - rcut || pos[k] > box[3 + k] + rcut)
+            return 0;
+    return 1;
+}
+
+/* Add the short-range part of the inverted gravity, the complement of the smoothed mesh force,
+ * from all particles within GLASS_RCUT * GLASS_ASMTH cells. Particles, and their periodic images,
+ * near the bounding box of another rank are sent there as ghosts. The pairs are then found on a
+ * grid of cells of size rcut covering the local particles and the ghosts.*/
+static void
+glass_short_range_force(PetaPM * pm, struct ic_part_data * ICP, const int NumPart)
+{
+    int NTask, t, i, k;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    const double cellsize = All.BoxSize / pm->Nmesh;
+    const double rcut = GLASS_RCUT * GLASS_ASMTH * cellsize;
+
+    /* Bounding box of the local particles. An empty rank has an inverted box which contains nothing.*/
+    double * boxes = (double *) mymalloc("GlassBoxes", 6 * NTask * sizeof(double));
+    double mybox[6] = {DBL_MAX, DBL_MAX, DBL_MAX, -DBL_MAX, -DBL_MAX, -DBL_MAX};
+    double totmass = 0;
+    for(i = 0; i < NumPart; i++) {
+        for(k = 0; k < 3; k++) {
+            mybox[k] = fmin(mybox[k], ICP[i].Pos[k]);
+            mybox[3 + k] = fmax(mybox[3 + k], ICP[i].Pos[k]);
+        }
+        totmass += ICP[i].Mass;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &totmass, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allgather(mybox, 6, MPI_DOUBLE, boxes, 6, MPI_DOUBLE, MPI_COMM_WORLD);
+
+    /* The ranks and periodic shifts whose grown box overlaps ours: only these can receive ghosts.*/
+    int * cand = (int *) mymalloc("GlassCand", 27 * NTask * 2 * sizeof(int));
+    int ncand = 0;
+    for(t = 0; t < NTask; t++) {
+        int s;
+        for(s = 0; s < 27; s++) {
+            if(t == ThisTask && s == 13)
+                continue;
+            double shifted[6];
+            for(k = 0; k < 3; k++) {
+                const double shift = ((s / (k == 0 ? 9 : (k == 1 ? 3 : 1))) % 3 - 1) * All.BoxSize;
+                shifted[k] = mybox[k] + shift;
+                shifted[3 + k] = mybox[3 + k] + shift;
+            }
+            int overlap = NumPart > 0;
+            for(k = 0; k < 3; k++)
+                if(shifted[3 + k] < boxes[6 * t + k] - rcut || shifted[k] > boxes[6 * t + 3 + k] + rcut)
+                    overlap = 0;
+            if(overlap) {
+                cand[2 * ncand] = t;
+                cand[2 * ncand + 1] = s;
+                ncand++;
+            }
+        }
+    }
+
+    int * sendcount = (int *) mymalloc("GlassSendCount", 4 * NTask * sizeof(int));
+    int * recvcount = sendcount + NTask;
+    int * senddispl = sendcount + 2 * NTask;
+    int * recvdispl = sendcount + 3 * NTask;
+    memset(sendcount, 0, NTask * sizeof(int));
+    /* Count and then fill the ghosts, in rank order*/
+    int pass;
+    struct glass_ghost * sendbuf = NULL;
+    for(pass = 0; pass < 2; pass++) {
+        int * fill = NULL;
+        if(pass == 1) {
+            senddispl[0] = 0;
+            for(t = 1; t < NTask; t++)
+                senddispl[t] = senddispl[t-1] + sendcount[t-1];
+            const int64_t nsend = senddispl[NTask-1] + sendcount[NTask-1];
+            sendbuf = (struct glass_ghost *) mymalloc("GlassSend", (nsend + 1) * sizeof(struct glass_ghost));
+            fill = (int *) mymalloc("GlassFill", NTask * sizeof(int));
+            memcpy(fill, senddispl, NTask * sizeof(int));
+        }
+        for(i = 0; i < NumPart; i++) {
+            int c;
+            for(c = 0; c < ncand; c++) {
+                const int dest = cand[2 * c], s = cand[2 * c + 1];
+                double pos[3];
+                for(k = 0; k < 3; k++)
+                    pos[k] = ICP[i].Pos[k] + ((s / (k == 0 ? 9 : (k == 1 ? 3 : 1))) % 3 - 1) * All.BoxSize;
+                if(!glass_in_box(pos, &boxes[6 * dest], rcut))
+                    continue;
+                if(pass == 0)
+                    sendcount[dest]++;
+                else {
+                    memcpy(sendbuf[fill[dest]].Pos, pos, sizeof(pos));
+                    sendbuf[fill[dest]].Mass = ICP[i].Mass;
+                    fill[dest]++;
+                }
+            }
+        }
+        if(pass == 1)
+            myfree(fill);
+    }
+    MPI_Alltoall(sendcount, 1, MPI_INT, recvcount, 1, MPI_INT, MPI_COMM_WORLD);
+    recvdispl[0] = 0;
+    for(t = 1; t < NTask; t++)
+        recvdispl[t] = recvdispl[t-1] + recvcount[t-1];
+    const int nghost = recvdispl[NTask-1] + recvcount[NTask-1];
+
+    /* Local particles first, then the ghosts*/
+    const int ntot = NumPart + nghost;
+    struct glass_ghost * all = (struct glass_ghost *) mymalloc("GlassAll", (ntot + 1) * sizeof(struct glass_ghost));
+    for(i = 0; i < NumPart; i++) {
+        memcpy(all[i].Pos, ICP[i].Pos, sizeof(ICP[i].Pos));
+        all[i].Mass = ICP[i].Mass;
+    }
+    MPI_Datatype MPI_GHOST;
+    MPI_Type_contiguous(sizeof(struct glass_ghost), MPI_BYTE, &MPI_GHOST);
+    MPI_Type_commit(&MPI_GHOST);
+    MPI_Alltoallv(sendbuf, sendcount, senddispl, MPI_GHOST, all + NumPart, recvcount, recvdispl, MPI_GHOST, MPI_COMM_WORLD);
+    MPI_Type_free(&MPI_GHOST);
+
+    /* Linked list of the particles in each cell of a grid over the grown local box*/
+    int ncell[3];
+    for(k = 0; k < 3; k++) {
+        ncell[k] = NumPart > 0 ? floor((mybox[3 + k] - mybox[k] + 2 * rcut) / rcut) : 1;
+        ncell[k] = DMAX(1, DMIN(ncell[k], 1024));
+    }
+    const double cellwidth[3] = {
+        NumPart > 0 ? (mybox[3] - mybox[0] + 2 * rcut) / ncell[0] : 1,
+        NumPart > 0 ? (mybox[4] - mybox[1] + 2 * rcut) / ncell[1] : 1,
+        NumPart > 0 ? (mybox[5] - mybox[2] + 2 * rcut) / ncell[2] : 1,
+    };
+    const int64_t totcell = (int64_t) ncell[0] * ncell[1] * ncell[2];
+    int * head = (int *) mymalloc("GlassHead", totcell * sizeof(int));
+    int * next = (int *) mymalloc("GlassNext", (ntot + 1) * sizeof(int));
+    for(i = 0; i < totcell; i++)
+        head[i] = -1;
+    for(i = ntot - 1; i >= 0; i--) {
+        int64_t cell = 0;
+        for(k = 0; k < 3; k++) {
+            int c = floor((all[i].Pos[k] - mybox[k] + rcut) / cellwidth[k]);
+            c = DMAX(0, DMIN(c, ncell[k] - 1));
+            cell = cell * ncell[k] + c;
+        }
+        next[i] = head[cell];
+        head[cell] = i;
+    }
+
+    /* Each particle displaces the others by L^3 / (4 pi Mtot) m / r^2, the inverted gravity
+     * of the mesh force, times the short-range window.*/
+    const double forcefac = All.BoxSize * All.BoxSize * All.BoxSize / (4 * M_PI * totmass);
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++) {
+        int c[3], d[3];
+        for(k = 0; k < 3; k++)
+            c[k] = DMAX(0, DMIN((int) floor((all[i].Pos[k] - mybox[k] + rcut) / cellwidth[k]), ncell[k] - 1));
+        double acc[3] = {0};
+        for(d[0] = DMAX(c[0] - 1, 0); d[0] <= DMIN(c[0] + 1, ncell[0] - 1); d[0]++)
+        for(d[1] = DMAX(c[1] - 1, 0); d[1] <= DMIN(c[1] + 1, ncell[1] - 1); d[1]++)
+        for(d[2] = DMAX(c[2] - 1, 0); d[2] <= DMIN(c[2] + 1, ncell[2] - 1); d[2]++) {
+            int j;
+            for(j = head[((int64_t) d[0] * ncell[1] + d[1]) * ncell[2] + d[2]]; j >= 0; j = next[j]) {
+                if(j == i)
+                    continue;
+                double dx[3], r2 = 0;
+                for(k = 0; k < 3; k++) {
+                    dx[k] = all[i].Pos[k] - all[j].Pos[k];
+                    r2 += dx[k] * dx[k];
+                }
+                if(r2 == 0 || r2 >= rcut * rcut)
+                    continue;
+                const double r = sqrt(r2);
+                double fac = forcefac * all[j].Mass / (r2 * r), pot = 0;
+                if(grav_apply_short_range_window(r, &fac, &pot, cellsize))
+                    continue;
+                for(k = 0; k < 3; k++)
+                    acc[k] += dx[k] * fac;
+            }
+        }
+        for(k = 0; k < 3; k++)
+            ICP[i].Disp[k] += acc[k];
+    }
+
+    myfree(next);
+    myfree(head);
+    myfree(all);
+    myfree(sendbuf);
+    myfree(sendcount);
+    myfree(cand);
+    myfree(boxes);
+    walltime_measure("/ShortRange");
 }
 
 static double pot_factor;
@@ -254,8 +616,8 @@ _prepare(PetaPM * pm, void * userdata, int * Nregions)
     pot_factor /= totmass;
 
     for(k = 0; k < 3; k ++) {
-        regions[r].offset[k] = floor(min[k] / All.BoxSize * All.Nmesh - 1);
-        regions[r].size[k] = ceil(max[k] / All.BoxSize * All.Nmesh + 2);
+        regions[r].offset[k] = floor(min[k] / All.BoxSize * pm->Nmesh - 1);
+        regions[r].size[k] = ceil(max[k] / All.BoxSize * pm->Nmesh + 2);
         regions[r].size[k] -= regions[r].offset[k];
     }
 
@@ -279,7 +641,7 @@ _prepare(PetaPM * pm, void * userdata, int * Nregions)
  *
  *********************/
 
-static void potential_transfer(PetaPM *pm, int64_t k2, int kpos[3], pfft_complex *value) {
+static void potential_transfer(PetaPM *pm, int64_t k2, int kpos[3], PetaPMComplex *value) {
 
     double f = 1.0;
     const double smth = 1.0 / k2;
@@ -295,7 +657,10 @@ static void potential_transfer(PetaPM *pm, int64_t k2, int kpos[3], pfft_complex
      * second decovolution is correcting readout
      * I don't understand the second yet!
      * */
-    const double fac = pot_factor * smth * f * f;
+    double fac = pot_factor * smth * f * f;
+    /* With the short-range force the mesh only carries the long-range part*/
+    if(All2.GlassShortRange)
+        fac *= exp(-k2 * pow(2 * M_PI * GLASS_ASMTH / pm->Nmesh, 2));
 
     /*Compute the power spectrum*/
     powerspectrum_add_mode(pm->ps, k2, kpos, value, f, pm->Nmesh);
@@ -323,7 +688,7 @@ static double diff_kernel(double w) {
     return 1 / 6.0 * (8 * sin (w) - sin (2 * w));
 }
 
-static void force_transfer(PetaPM *pm, int k, pfft_complex * value) {
+static void force_transfer(PetaPM *pm, int k, PetaPMComplex * value) {
     double tmp0;
     double tmp1;
     /*
@@ -331,27 +696,27 @@ static void force_transfer(PetaPM *pm, int k, pfft_complex * value) {
      *
      * filter is   i K(w)
      * */
-    double fac = -1 * diff_kernel (k * (2 * M_PI / All.Nmesh)) * (All.Nmesh / All.BoxSize);
+    double fac = -1 * diff_kernel (k * (2 * M_PI / pm->Nmesh)) * (pm->Nmesh / All.BoxSize);
     tmp0 = - value[0][1] * fac;
     tmp1 = value[0][0] * fac;
     value[0][0] = tmp0;
     value[0][1] = tmp1;
 }
-static void force_x_transfer(PetaPM *pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void force_x_transfer(PetaPM *pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     force_transfer(pm, kpos[0], value);
 }
-static void force_y_transfer(PetaPM *pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void force_y_transfer(PetaPM *pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     force_transfer(pm, kpos[1], value);
 }
-static void force_z_transfer(PetaPM *pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void force_z_transfer(PetaPM *pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     force_transfer(pm, kpos[2], value);
 }
-static void readout_force_x(PetaPM *pm, int i, double * mesh, double weight) {
+static void readout_force_x(PetaPM *pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Disp[0] += weight * mesh[0];
 }
-static void readout_force_y(PetaPM *pm, int i, double * mesh, double weight) {
+static void readout_force_y(PetaPM *pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Disp[1] += weight * mesh[0];
 }
-static void readout_force_z(PetaPM *pm, int i, double * mesh, double weight) {
+static void readout_force_z(PetaPM *pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Disp[2] += weight * mesh[0];
 }
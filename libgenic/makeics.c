@@ -0,0 +1,341 @@
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <mpi.h>
+#include <omp.h>
+
+#include <bigfile-mpi.h>
+#include "allvars.h"
+#include "proto.h"
+#include "thermal.h"
+#include "philox.h"
+#include <libgadget/petapm.h>
+#include <libgadget/utils.h>
+#include <libgadget/partmanager.h>
+
+#define GLASS_SEED_HASH(seed) ((seed) * 9999721L)
+/* Stream of the counter-based generator used for the thermal velocities*/
+#define PHILOX_STREAM_THERMAL 0x74686d6c
+
+/* Add thermal velocities to NumPart particles from grid index start.
+ * The random number generator is reseeded at the start of each pencil along z,
+ * or with CounterRNG keyed by the particle ID, so the velocities do not depend on how the particles are split up.*/
+static void
+add_thermal_velocities(IDGenerator * idgen, struct thermalvel * therm, int seed, struct ic_part_data * ICP, const int start, const int NumPart)
+{
+    int i;
+    if(All2.CounterRNG) {
+        /* Each particle draws its velocity from the counter-based generator keyed by its ID*/
+        #pragma omp parallel for
+        for(i = 0; i < NumPart; i++) {
+            const uint64_t id = idgen_create_id_from_index(idgen, start + i);
+            double u[4];
+            philox_uniform((uint32_t) seed, PHILOX_STREAM_THERMAL, id, u);
+            add_thermal_speeds_uniform(therm, u, ICP[i].Vel);
+        }
+        return;
+    }
+    unsigned int * seedtable = init_rng(seed, idgen->Ngrid);
+    gsl_rng * g_rng = gsl_rng_alloc(gsl_rng_ranlxd1);
+    /*Just in case*/
+    gsl_rng_set(g_rng, seedtable[0]);
+    for(i = 0; i < NumPart; i++) {
+         /*Find the slab, and reseed if it has zero z rank*/
+         if((start + i) % idgen->Ngrid == 0) {
+              uint64_t id = idgen_create_id_from_index(idgen, start + i);
+              /*Seed the random number table with x,y index.*/
+              gsl_rng_set(g_rng, seedtable[id / idgen->Ngrid]);
+         }
+         add_thermal_speeds(therm, g_rng, ICP[i].Vel);
+    }
+    gsl_rng_free(g_rng);
+    myfree(seedtable);
+}
+
+/* Write a chunk of particles to bf, if not NULL, and pass it to sink, if not NULL.
+ * Returns the offset of the next chunk in the file.*/
+static int64_t
+emit_particle_chunk(IDGenerator * idgen, const int ptype, BigFile * bf, genic_particle_sink sink, void * userdata,
+        const uint64_t FirstID, struct ic_part_data * ICP, const int start, const int NumPart, const int64_t offset)
+{
+    if(sink)
+        sink(idgen, ptype, FirstID, ICP, start, NumPart, userdata);
+    if(bf)
+        return write_particle_chunk(idgen, ptype, bf, FirstID, ICP, start, NumPart, offset);
+    return offset;
+}
+
+/* A particle type made on a grid by make_grid_particles*/
+struct GridSpecies {
+    IDGenerator * idgen;
+    int ptype;
+    double shift;
+    double mass;
+    uint64_t FirstID;
+    /* Thermal velocities to add, or NULL*/
+    struct thermalvel * therm;
+    int seed;
+};
+
+/* Make the grid particles of nspecies (at most 2) types which share the transfer function Type, in NumChunks slabs
+ * of the local Lagrangian grid, writing each slab before making the next, so that only one slab of particles
+ * is in memory. The slabs of all the types are displaced together, so the gaussian field and the displacement
+ * FFTs are computed once for all of them. The FFTs are repeated for every slab: more chunks trade time for memory.*/
+static void
+make_grid_particles(PetaPM * pm, enum TransferType Type, struct GridSpecies * species, const int nspecies,
+        BigFile * bf, genic_particle_sink sink, void * userdata, const int NumChunks)
+{
+    /* Chunks are whole x planes, so that the thermal velocity pencils are not split*/
+    int chunkplanes[2], plane[2];
+    int64_t offset[2] = {0};
+    int total = 0;
+    int s;
+    for(s = 0; s < nspecies; s++) {
+        IDGenerator * idgen = species[s].idgen;
+        plane[s] = idgen->size[1] * idgen->size[2];
+        chunkplanes[s] = (idgen->size[0] + NumChunks - 1) / NumChunks;
+        total += chunkplanes[s] * plane[s];
+        if(bf)
+            create_particle_blocks(bf, species[s].ptype, (int64_t) idgen->Ngrid * idgen->Ngrid * idgen->Ngrid);
+    }
+    struct ic_part_data * ICP = (struct ic_part_data *) mymalloc("PartTable", DMAX(total, 1) * sizeof(struct ic_part_data));
+
+    int c;
+    for(c = 0; c < NumChunks; c++) {
+        int start[2], NumPart[2];
+        int NumPartAll = 0;
+        for(s = 0; s < nspecies; s++) {
+            IDGenerator * idgen = species[s].idgen;
+            start[s] = DMIN(c * chunkplanes[s], idgen->size[0]) * plane[s];
+            NumPart[s] = DMIN((c + 1) * chunkplanes[s], idgen->size[0]) * plane[s] - start[s];
+            if(NumChunks > 1)
+                message(0, "Making chunk %d of %d for type %d\n", c + 1, NumChunks, species[s].ptype);
+            setup_grid_chunk(idgen, species[s].shift, species[s].mass, ICP + NumPartAll, start[s], NumPart[s]);
+            NumPartAll += NumPart[s];
+        }
+
+        /*Write initial positions into ICP struct*/
+        int j, k;
+        for(j = 0; j < NumPartAll; j++)
+            for(k = 0; k < 3; k++)
+                ICP[j].PrePos[k] = ICP[j].Pos[k];
+
+        displacement_fields(pm, Type, ICP, NumPartAll);
+
+        struct ic_part_data * sICP = ICP;
+        for(s = 0; s < nspecies; s++) {
+            if(species[s].therm)
+                add_thermal_velocities(species[s].idgen, species[s].therm, species[s].seed, sICP, start[s], NumPart[s]);
+
+            offset[s] = emit_particle_chunk(species[s].idgen, species[s].ptype, bf, sink, userdata, species[s].FirstID, sICP, start[s], NumPart[s], offset[s]);
+            sICP += NumPart[s];
+        }
+    }
+    myfree(ICP);
+}
+
+/* Set up the thermal velocities of the neutrino particles. Returns the fraction of the neutrino mass in particles.*/
+static double
+init_nu_thermalvel(struct thermalvel * nu_therm)
+{
+    const double kBMNu = 3*All.CP.ONu.kBtnu / (All.CP.MNu[0]+All.CP.MNu[1]+All.CP.MNu[2]);
+    double v_th = NU_V0(All.TimeIC, kBMNu, All.UnitVelocity_in_cm_per_s);
+    if(!All.IO.UsePeculiarVelocity)
+        v_th /= sqrt(All.TimeIC);
+    return init_thermalvel(nu_therm, v_th, All2.Max_nuvel/v_th, 0);
+}
+
+double
+genic_particle_totals(int64_t * NTotal)
+{
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++)
+        NTotal[ptype] = 0;
+    NTotal[1] = (int64_t) All2.Ngrid*All2.Ngrid*All2.Ngrid;
+    NTotal[0] = (int64_t) All2.ProduceGas*All2.NgridGas*All2.NgridGas*All2.NgridGas;
+    NTotal[2] = (int64_t) All2.NGridNu*All2.NGridNu*All2.NGridNu;
+    if(NTotal[2] == 0)
+        return 0;
+    struct thermalvel nu_therm;
+    const double total_nufrac = init_nu_thermalvel(&nu_therm);
+    message(0,"F-D velocity scale: %g. Max particle vel: %g. Fraction of mass in particles: %g\n",
+            nu_therm.m_vamp*sqrt(All.TimeIC), All2.Max_nuvel*sqrt(All.TimeIC), total_nufrac);
+    return total_nufrac;
+}
+
+void
+genic_count_particles(int * NLocal)
+{
+    PetaPM pm[1];
+    petapm_init(pm, All.BoxSize, All.Asmth, All.Nmesh, All.G, MPI_COMM_WORLD);
+
+    int ptype;
+    for(ptype = 0; ptype < 6; ptype++)
+        NLocal[ptype] = 0;
+    IDGenerator idgen[1];
+    idgen_init(idgen, pm, All2.Ngrid, All.BoxSize);
+    NLocal[1] = idgen->NumPart;
+    if(All2.ProduceGas) {
+        idgen_init(idgen, pm, All2.NgridGas, All.BoxSize);
+        NLocal[0] = idgen->NumPart;
+    }
+    if(All2.NGridNu > 0) {
+        idgen_init(idgen, pm, All2.NGridNu, All.BoxSize);
+        NLocal[2] = idgen->NumPart;
+    }
+    petapm_destroy(pm);
+}
+
+void
+genic_make_particles(BigFile * bf, genic_particle_sink sink, void * userdata)
+{
+  int64_t TotNumPart = (int64_t) All2.Ngrid*All2.Ngrid*All2.Ngrid;
+  int64_t TotNumPartGas = (int64_t) All2.ProduceGas*All2.NgridGas*All2.NgridGas*All2.NgridGas;
+
+  /*Initialise particle spacings*/
+  const double meanspacing = All.BoxSize / DMAX(All2.Ngrid, All2.NgridGas);
+  const double shift_gas = -All2.ProduceGas * 0.5 * (All.CP.Omega0 - All.CP.OmegaBaryon) / All.CP.Omega0 * meanspacing;
+  double shift_dm = All2.ProduceGas * 0.5 * All.CP.OmegaBaryon / All.CP.Omega0 * meanspacing;
+  double shift_nu = 0;
+  if(!All2.ProduceGas && All2.NGridNu > 0) {
+      double OmegaNu = get_omega_nu(&All.CP.ONu, 1);
+      shift_nu = -0.5 * (All.CP.Omega0 - OmegaNu) / All.CP.Omega0 * meanspacing;
+      shift_dm = 0.5 * OmegaNu / All.CP.Omega0 * meanspacing;
+  }
+
+  /*Use 'total' (CDM + baryon) transfer function
+   * unless DifferentTransferFunctions are on.
+   */
+  enum TransferType DMType = DELTA_CB, GasType = DELTA_CB, NuType = DELTA_NU;
+  if(All2.ProduceGas && All2.PowerP.DifferentTransferFunctions) {
+      DMType = DELTA_CDM;
+      GasType = DELTA_BAR;
+  }
+  PetaPM pm[1];
+
+  petapm_init(pm, All.BoxSize, All.Asmth, All.Nmesh, All.G, MPI_COMM_WORLD);
+  petapm_init_batch(pm, All2.PMBatchTransforms);
+  if(All2.PMOffload)
+      petapm_init_offload(pm);
+
+  /*First compute and write CDM*/
+  double mass[6] = {0};
+  /*Can neglect neutrinos since this only matters for the glass force.*/
+  compute_mass(mass, TotNumPart, TotNumPartGas, 0, 0);
+  /*Not used*/
+  IDGenerator idgen_cdm[1];
+  IDGenerator idgen_gas[1];
+
+  idgen_init(idgen_cdm, pm, All2.Ngrid, All.BoxSize);
+  idgen_init(idgen_gas, pm, All2.NgridGas, All.BoxSize);
+
+  int NumPartCDM = idgen_cdm->NumPart;
+  int NumPartGas = idgen_gas->NumPart;
+
+  /*Add a thermal velocity to WDM particles*/
+  struct thermalvel WDM;
+  if(All2.WDM_therm_mass > 0){
+      double v_th = WDM_V0(All.TimeIC, All2.WDM_therm_mass, All.CP.Omega0 - All.CP.OmegaBaryon - get_omega_nu(&All.CP.ONu, 1), All.CP.HubbleParam, All.UnitVelocity_in_cm_per_s);
+      if(!All.IO.UsePeculiarVelocity)
+         v_th /= sqrt(All.TimeIC);
+      init_thermalvel(&WDM, v_th, 10000/v_th, 0);
+  }
+
+  /* Grid ICs are made and written one slab at a time. CDM and gas with the same transfer function
+   * are displaced together, so the FFTs are done once for both.*/
+  if(!All2.MakeGlassCDM && !(All2.ProduceGas && All2.MakeGlassGas)) {
+      struct GridSpecies species[2] = {
+          {idgen_cdm, 1, All2.ProduceGas * shift_dm, mass[1], 0, All2.WDM_therm_mass > 0 ? &WDM : NULL, All2.Seed+1},
+          {idgen_gas, 0, shift_gas, mass[0], TotNumPart, NULL, 0},
+      };
+      if(All2.ProduceGas && DMType == GasType)
+          make_grid_particles(pm, DMType, species, 2, bf, sink, userdata, All2.NumChunks);
+      else {
+          make_grid_particles(pm, DMType, species, 1, bf, sink, userdata, All2.NumChunks);
+          if(All2.ProduceGas)
+              make_grid_particles(pm, GasType, species + 1, 1, bf, sink, userdata, All2.NumChunks);
+      }
+  }
+  else {
+      /*Space for both CDM and baryons*/
+      struct ic_part_data * ICP = (struct ic_part_data *) mymalloc("PartTable", (NumPartCDM + All2.ProduceGas * NumPartGas)*sizeof(struct ic_part_data));
+
+      /* The glass may be made on its own, coarser, mesh*/
+      PetaPM glasspm[1];
+      PetaPM * gpm = pm;
+      if(All2.GlassNmesh > 0 && All2.GlassNmesh != All.Nmesh) {
+          petapm_init(glasspm, All.BoxSize, All.Asmth, All2.GlassNmesh, All.G, MPI_COMM_WORLD);
+          gpm = glasspm;
+      }
+
+      /* If we have incoherent glass files, we need to store both the particle tables
+       * to ensure that there are no close particle pairs*/
+      /*Make the table for the CDM*/
+      if(!All2.MakeGlassCDM) {
+          setup_grid(idgen_cdm, All2.ProduceGas * shift_dm, mass[1], ICP);
+      } else {
+          setup_glass(idgen_cdm, gpm, 0, GLASS_SEED_HASH(All2.Seed), mass[1], ICP);
+      }
+
+      /*Make the table for the baryons if we need, using the second half of the memory.*/
+      if(All2.ProduceGas) {
+        if(!All2.MakeGlassGas) {
+            setup_grid(idgen_gas, shift_gas, mass[0], ICP+NumPartCDM);
+        } else {
+            setup_glass(idgen_gas, gpm, 0, GLASS_SEED_HASH(All2.Seed + 1), mass[0], ICP+NumPartCDM);
+        }
+        /*Do coherent glass evolution to avoid close pairs*/
+        if(All2.MakeGlassGas || All2.MakeGlassCDM)
+            glass_evolve(gpm, 14, "powerspectrum-glass-tot", ICP, NumPartCDM+NumPartGas);
+      }
+      if(gpm != pm)
+          petapm_destroy(gpm);
+
+      /*Write initial positions into ICP struct (for CDM and gas)*/
+      int j,k;
+      for(j=0; j<NumPartCDM+NumPartGas; j++)
+          for(k=0; k<3; k++)
+              ICP[j].PrePos[k] = ICP[j].Pos[k];
+
+      /* With one transfer function, displace CDM and gas together*/
+      const int together = All2.ProduceGas && DMType == GasType;
+      if(together)
+          displacement_fields(pm, DMType, ICP, NumPartCDM + NumPartGas);
+
+      if(NumPartCDM > 0) {
+        if(!together)
+            displacement_fields(pm, DMType, ICP, NumPartCDM);
+
+        if(All2.WDM_therm_mass > 0)
+            add_thermal_velocities(idgen_cdm, &WDM, All2.Seed+1, ICP, 0, NumPartCDM);
+
+        if(bf)
+            write_particle_data(idgen_cdm, 1, bf, 0, ICP);
+        if(sink)
+            sink(idgen_cdm, 1, 0, ICP, 0, NumPartCDM, userdata);
+      }
+
+      /*Now make the gas if required*/
+      if(All2.ProduceGas) {
+        if(!together)
+            displacement_fields(pm, GasType, ICP+NumPartCDM, NumPartGas);
+        if(bf)
+            write_particle_data(idgen_gas, 0, bf, TotNumPart, ICP+NumPartCDM);
+        if(sink)
+            sink(idgen_gas, 0, TotNumPart, ICP+NumPartCDM, 0, NumPartGas, userdata);
+      }
+      myfree(ICP);
+  }
+
+  /*Now add random velocity neutrino particles*/
+  if(All2.NGridNu > 0) {
+      struct thermalvel nu_therm;
+      init_nu_thermalvel(&nu_therm);
+      IDGenerator idgen_nu[1];
+      idgen_init(idgen_nu, pm, All2.NGridNu, All.BoxSize);
+      struct GridSpecies nu = {idgen_nu, 2, shift_nu, mass[2], TotNumPart+TotNumPartGas, &nu_therm, All2.Seed+2};
+      make_grid_particles(pm, NuType, &nu, 1, bf, sink, userdata, All2.NumChunks);
+  }
+
+  petapm_destroy(pm);
+}
@@ -31,6 +31,14 @@ create_parameters()
     param_declare_int(ps, "Seed", REQUIRED, 0, "Random number generator seed used for the phases of the Gaussian random field.");
     param_declare_int(ps, "MakeGlassGas", OPTIONAL, -1, "Generate Glass IC for gas instead of Grid IC.");
     param_declare_int(ps, "MakeGlassCDM", OPTIONAL, 0, "Generate Glass IC for CDM instead of Grid IC.");
+    param_declare_int(ps, "GlassShortRange", OPTIONAL, 0, "If 1, glasses are made with a smoothed mesh force plus a short-range pair force and an adaptive step, so a coarser GlassNmesh can be used.");
+    param_declare_int(ps, "GlassNmesh", OPTIONAL, 0, "Size of the FFT grid used for the glass force. 0 uses Nmesh. With GlassShortRange, Ngrid / 2 is usually enough.");
+    param_declare_string(ps, "GlassTileFile", OPTIONAL, "", "If set with GlassTileNgrid, glasses are made by replicating a glass tile read from this file, with the tile size and glass number appended. A missing tile is made and saved there for later runs.");
+    param_declare_int(ps, "GlassTileNgrid", OPTIONAL, 0, "Particles per side of a glass tile. Must divide Ngrid and NgridGas.");
+    param_declare_int(ps, "NumChunks", OPTIONAL, 1, "Make and write the grid particles of each type in this many slabs, to bound memory use. Each slab repeats the displacement FFTs. Ignored for glass ICs.");
+    param_declare_int(ps, "LPTOrder", OPTIONAL, 1, "Order of Lagrangian perturbation theory for the CDM and baryon displacements: 1 is the Zel'dovich approximation, 2 adds the second order (2LPT) displacements and velocities, for nine more FFTs. 2 needs NumChunks = 1.");
+    param_declare_int(ps, "PMBatchTransforms", OPTIONAL, 0, "If > 1, transform this many displacement fields to real space with one batched FFT. Needs memory for that many meshes at once.");
+    param_declare_int(ps, "PMOffload", OPTIONAL, 0, "If 1, interpolate the displacements to the particles on an accelerator with OpenMP target offload. Requires compiling with PM_OFFLOAD.");
 
     param_declare_int(ps, "UnitaryAmplitude", OPTIONAL, 0, "If non-zero, generate unitary gaussians where |g| == 1.0.");
     param_declare_int(ps, "WhichSpectrum", OPTIONAL, 2, "Type of spectrum, 2 for file ");
@@ -46,12 +54,14 @@ create_parameters()
 
     param_declare_int(ps, "DifferentTransferFunctions", OPTIONAL, 1, "Use species specific transfer functions for baryon and CDM.");
     param_declare_int(ps, "ScaleDepVelocity", OPTIONAL, -1, "Use scale dependent velocity transfer functions instead of the scale-independent Zel'dovich approximation. Enabled by default iff DifferentTransferFunctions = 1");
+    param_declare_double(ps, "ScaleDepVelocityTol", OPTIONAL, 0, "With ScaleDepVelocity, if the velocity growth rate f(k) varies by less than this relative amount over the scales of the mesh, use a single growth rate and derive the velocities from the displacements, saving three FFTs. 0 always uses the velocity transfer functions.");
     param_declare_string(ps, "FileWithTransferFunction", OPTIONAL, "", "File containing CLASS formatted transfer functions with extra metric transfer functions=y.");
     param_declare_double(ps, "MaxMemSizePerNode", OPTIONAL, 0.6, "Maximum memory per node, in fraction of total memory, or MB if > 1.");
     param_declare_double(ps, "CMBTemperature", OPTIONAL, 2.7255, "CMB temperature in K");
     param_declare_double(ps, "RadiationOn", OPTIONAL, 1, "Include radiation in the background.");
     param_declare_int(ps, "UsePeculiarVelocity", OPTIONAL, 1, "Snapshots will save peculiar velocities to the Velocity field. If 0, then v/sqrt(a) will be used in the ICs to match Gadget-2, but snapshots will save v * a.");
     param_declare_int(ps, "InvertPhase", OPTIONAL, 0, "Flip phase for paired simulation");
+    param_declare_int(ps, "CounterRNG", OPTIONAL, 0, "If 1, draw the Gaussian modes and thermal velocities from a counter-based (Philox) generator keyed by the mode or particle ID. The modes are then made in parallel and do not depend on the number of ranks or threads, but differ from N-GenIC.");
     param_declare_int(ps,    "ShowBacktrace", OPTIONAL, 1, "Print a backtrace on crash. Hangs on stampede.");
 
     param_declare_double(ps, "PrimordialAmp", OPTIONAL, 2.215e-9, "Ignored, but used by external CLASS script to set powr spectrum amplitude.");
@@ -115,6 +125,7 @@ void read_parameterfile(char *fname)
 
     All2.ProduceGas = param_get_int(ps, "ProduceGas");
     All2.InvertPhase = param_get_int(ps, "InvertPhase");
+    All2.CounterRNG = param_get_int(ps, "CounterRNG");
     /*Unit system*/
     All.UnitVelocity_in_cm_per_s = param_get_double(ps, "UnitVelocity_in_cm_per_s");
     All.UnitLength_in_cm = param_get_double(ps, "UnitLength_in_cm");
@@ -140,6 +151,7 @@ void read_parameterfile(char *fname)
     if(All2.PowerP.ScaleDepVelocity < 0) {
         All2.PowerP.ScaleDepVelocity = All2.PowerP.DifferentTransferFunctions;
     }
+    All2.PowerP.ScaleDepVelocityTol = param_get_double(ps, "ScaleDepVelocityTol");
     All2.PowerP.WhichSpectrum = param_get_int(ps, "WhichSpectrum");
     All2.PowerP.PrimordialIndex = param_get_double(ps, "PrimordialIndex");
     All2.PowerP.PrimordialRunning = param_get_double(ps, "PrimordialRunning");
@@ -173,6 +185,21 @@ void read_parameterfile(char *fname)
             All2.MakeGlassGas = 0;
     }
     All2.MakeGlassCDM = param_get_int(ps, "MakeGlassCDM");
+    All2.GlassShortRange = param_get_int(ps, "GlassShortRange");
+    All2.GlassNmesh = param_get_int(ps, "GlassNmesh");
+    param_get_string2(ps, "GlassTileFile", All2.GlassTileFile, sizeof(All2.GlassTileFile));
+    All2.GlassTileNgrid = param_get_int(ps, "GlassTileNgrid");
+    All2.NumChunks = param_get_int(ps, "NumChunks");
+    if(All2.NumChunks < 1)
+        endrun(0, "NumChunks = %d must be at least 1\n", All2.NumChunks);
+    All2.LPTOrder = param_get_int(ps, "LPTOrder");
+    if(All2.LPTOrder < 1 || All2.LPTOrder > 2)
+        endrun(0, "LPTOrder = %d is not supported: use 1 or 2\n", All2.LPTOrder);
+    /* The second order source is painted from all the particles of a type at once*/
+    if(All2.LPTOrder > 1 && All2.NumChunks > 1)
+        endrun(0, "LPTOrder = %d needs NumChunks = 1, not %d\n", All2.LPTOrder, All2.NumChunks);
+    All2.PMBatchTransforms = param_get_int(ps, "PMBatchTransforms");
+    All2.PMOffload = param_get_int(ps, "PMOffload");
 
     int64_t NumPartPerFile = param_get_int(ps, "NumPartPerFile");
 
@@ -0,0 +1,52 @@
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <stdint.h>
+
+/* Counter-based random numbers: the Philox4x32-10 generator of Salmon et al 2011,
+ * "Parallel random numbers: as easy as 1, 2, 3". Each call maps a 128-bit counter
+ * and a 64-bit key to four independent 32-bit random numbers, with no state,
+ * so a random number can be drawn for any mode or particle in any order on any thread.*/
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+static inline void
+philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4])
+{
+    uint32_t c[4] = {counter[0], counter[1], counter[2], counter[3]};
+    uint32_t k[2] = {key[0], key[1]};
+    int r;
+    for(r = 0; r < 10; r++) {
+        const uint64_t p0 = (uint64_t) PHILOX_M0 * c[0];
+        const uint64_t p1 = (uint64_t) PHILOX_M1 * c[2];
+        c[0] = (uint32_t) (p1 >> 32) ^ c[1] ^ k[0];
+        c[1] = (uint32_t) p1;
+        c[2] = (uint32_t) (p0 >> 32) ^ c[3] ^ k[1];
+        c[3] = (uint32_t) p0;
+        k[0] += PHILOX_W0;
+        k[1] += PHILOX_W1;
+    }
+    out[0] = c[0];
+    out[1] = c[1];
+    out[2] = c[2];
+    out[3] = c[3];
+}
+
+/* Four uniform doubles in the open interval (0, 1) for a given seed, stream and index.
+ * The stream separates different uses of the same seed, eg, the modes and the thermal velocities.*/
+static inline void
+philox_uniform(const uint64_t seed, const uint32_t stream, const uint64_t index, double u[4])
+{
+    const uint32_t counter[4] = {(uint32_t) index, (uint32_t) (index >> 32), stream, 0};
+    const uint32_t key[2] = {(uint32_t) seed, (uint32_t) (seed >> 32)};
+    uint32_t out[4];
+    philox4x32(counter, key, out);
+    int i;
+    for(i = 0; i < 4; i++)
+        u[i] = (out[i] + 0.5) / 4294967296.;
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <gsl/gsl_rng.h>
 #include <libgadget/petapm.h>
 #include <libgadget/utils.h>
+#include "philox.h"
 
 /*
  * The following functions are from fastpm/libfastpm/initialcondition.c.
@@ -197,4 +198,66 @@ pmic_fill_gaussian_gadget(PMDesc * pm, double * delta_k, int seed, int setUnitar
     fwrite(pm->canvas, sizeof(pm->canvas[0]), pm->ORegion.total * 2, fopen(fn, "w"));
 */
 }
+
+/* Stream of the counter-based generator used for the modes*/
+#define PHILOX_STREAM_MODES 0x67656e69
+
+/* Fill delta_k with a counter-based generator. Each mode draws its amplitude and phase
+ * from the Philox generator keyed by the seed, with the mode's integer coordinates as the counter,
+ * so the field does not depend on the number of ranks or threads, and any part of it can be remade alone.
+ * On the k = 0 and k = Nmesh/2 planes the mode with the smaller (i, j) index is drawn and its
+ * conjugate partner takes the complex conjugate, so the field is real.
+ * This is not the same field as the N-GenIC compatible pmic_fill_gaussian_gadget.*/
+static void
+pmic_fill_gaussian_philox(PMDesc * pm, double * delta_k, int seed, int setUnitaryAmplitude, int setInvertPhase)
+{
+    const int64_t N0 = pm->Nmesh[0], N1 = pm->Nmesh[1], N2 = pm->Nmesh[2];
+    ptrdiff_t irel0;
+    #pragma omp parallel for
+    for(irel0 = 0; irel0 < pm->ORegion.size[0]; irel0 ++) {
+        const int64_t i = pm->ORegion.start[0] + irel0;
+        const int64_t ci = (N0 - i) % N0;
+        ptrdiff_t irel1, irel2;
+        for(irel1 = 0; irel1 < pm->ORegion.size[1]; irel1 ++) {
+            const int64_t j = pm->ORegion.start[1] + irel1;
+            const int64_t cj = (N1 - j) % N1;
+            for(irel2 = 0; irel2 < pm->ORegion.size[2]; irel2 ++) {
+                const int64_t k = pm->ORegion.start[2] + irel2;
+                const ptrdiff_t ip = pm->ORegion.strides[0] * irel0 + pm->ORegion.strides[1] * irel1 + pm->ORegion.strides[2] * irel2;
+                double * mode = delta_k + 2 * ip;
+                /* On the planes where the r2c transform stores both a mode and its conjugate,
+                 * draw from the lower of the two.*/
+                int use_conj = 0;
+                int64_t di = i, dj = j;
+                if((k == 0 || 2 * k == N2) && ci * N1 + cj < i * N1 + j) {
+                    use_conj = 1;
+                    di = ci;
+                    dj = cj;
+                }
+                double u[4];
+                philox_uniform((uint32_t) seed, PHILOX_STREAM_MODES, (di * N1 + dj) * (N2 / 2 + 1) + k, u);
+
+                /* we want two numbers that are of std ~ 1/sqrt(2) */
+                double ampl = sqrt(- log(u[0]));
+                if (setUnitaryAmplitude) ampl = 1.0; /* cos and sin gives 1/sqrt(2)*/
+                double phase = u[1] * 2 * M_PI;
+                if (setInvertPhase)
+                    phase += M_PI; /*invert phase*/
+
+                mode[0] = ampl * cos(phase);
+                mode[1] = ampl * sin(phase);
+                if(use_conj)
+                    mode[1] *= -1;
+                /* The mode is self conjugate, thus imaginary mode must be zero */
+                if(ci == i && cj == j && (k == 0 || 2 * k == N2))
+                    mode[1] = 0;
+                /* the mean is zero */
+                if(i == 0 && j == 0 && k == 0) {
+                    mode[0] = 0;
+                    mode[1] = 0;
+                }
+            }
+        }
+    }
+}
 #endif
@@ -161,7 +161,7 @@ void parse_power(int i, double k, char * line, struct table *out_tab, int * Inpu
     char * retval;
     if((*InputInLog10) == 0) {
         if(k < 0) {
-            message(1, "some input k is negative, guessing the file is in log10 units\n");
+            message(0, "some input k is negative, guessing the file is in log10 units\n");
             *InputInLog10 = 1;
         }
         else
@@ -238,61 +238,33 @@ void parse_transfer(int i, double k, char * line, struct table *out_tab, int * I
 
 void read_power_table(int ThisTask, const char * inputfile, const int ncols, struct table * out_tab, const double InitTime, _parse_fn parse_line)
 {
-    FILE *fd = NULL;
     int j;
     int InputInLog10 = 0;
 
-    if(ThisTask == 0) {
-        if(!(fd = fopen(inputfile, "r")))
-            endrun(1, "can't read input spectrum in file '%s' on task %d\n", inputfile, ThisTask);
-
-        out_tab->Nentry = 0;
-        do
-        {
-            char buffer[1024];
-            char * retval = fgets(buffer, 1024, fd);
-            /*Happens on end of file*/
-            if(!retval)
-                break;
-            retval = strtok(buffer, " \t");
-            if(!retval || retval[0] == '#')
-                continue;
-            out_tab->Nentry++;
-        }
-        while(1);
-        rewind(fd);
-    }
-    MPI_Bcast(&(out_tab->Nentry), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    /* Only rank 0 reads the file: every rank parses the broadcast copy.*/
+    char * content = MPIU_file_get_content(inputfile, 0, MPI_COMM_WORLD);
+    if(!content)
+        endrun(0, "can't read input spectrum in file '%s'\n", inputfile);
+
+    char ** lines = fastpm_strsplit_table(content, &out_tab->Nentry);
 
     if(out_tab->Nentry < 2)
-        endrun(1, "Input spectrum too short\n");
+        endrun(0, "Input spectrum too short\n");
     out_tab->logk = mymalloc("Powertable", (ncols+1)*out_tab->Nentry * sizeof(double));
     for(j=0; j<ncols; j++)
         out_tab->logD[j] = out_tab->logk + (j+1)*out_tab->Nentry;
 
-    if(ThisTask == 0)
+    int i;
+    for(i = 0; i < out_tab->Nentry; i++)
     {
-        int i = 0;
-        do
-        {
-            char buffer[1024];
-            char * line = fgets(buffer, 1024, fd);
-            /*Happens on end of file*/
-            if(!line)
-                break;
-            char * retval = strtok(line, " \t");
-            if(!retval || retval[0] == '#')
-                continue;
-            double k = atof(retval);
-            parse_line(i, k, line, out_tab, &InputInLog10, InitTime);
-            i++;
-        }
-        while(1);
-
-        fclose(fd);
+        char * line = lines[i];
+        char * retval = strtok(line, " \t");
+        double k = atof(retval);
+        parse_line(i, k, line, out_tab, &InputInLog10, InitTime);
     }
+    ta_free(lines);
+    ta_free(content);
 
-    MPI_Bcast(out_tab->logk, (ncols+1)*out_tab->Nentry, MPI_DOUBLE, 0, MPI_COMM_WORLD);
     for(j=0; j<ncols; j++) {
         out_tab->mat_intp[j] = gsl_interp_alloc(gsl_interp_cspline,out_tab->Nentry);
         out_tab->mat_intp_acc[j] = gsl_interp_accel_alloc();
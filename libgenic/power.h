@@ -9,6 +9,9 @@ struct power_params
     int WhichSpectrum;
     int DifferentTransferFunctions;
     int ScaleDepVelocity;
+    /* If the velocity growth rate varies by less than this relative amount over the mesh scales,
+     * derive the velocities from the displacements with a single growth rate. 0 disables.*/
+    double ScaleDepVelocityTol;
     char * FileWithTransferFunction;
     char * FileWithInputSpectrum;
     double Sigma8;
@@ -29,6 +29,9 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
 /* Fill ICP with NumPart particles spaced on a regular 3D grid, whose structure is stored in the IDGenerator. */
 int setup_grid(IDGenerator * idgen, double shift, double mass, struct ic_part_data * ICP);
 
+/* As setup_grid, but only for the NumPart grid points from index start.*/
+int setup_grid_chunk(IDGenerator * idgen, double shift, double mass, struct ic_part_data * ICP, int start, int NumPart);
+
 /* Fill ICP with NumPart particles spaced out as a Lagrangian glass, calling glass_evolve
  * to move the particles with reversed gravity. */
 int setup_glass(IDGenerator * idgen, PetaPM * pm, double shift, int seed, double mass, struct ic_part_data * ICP);
@@ -50,6 +53,35 @@ write_particle_data(IDGenerator * idgen,
                     const uint64_t FirstID,
                     struct ic_part_data * curICP);
 
+/* Create the empty particle blocks of a type, to be filled by write_particle_chunk.*/
+void create_particle_blocks(BigFile * bf, const int Type, const int64_t TotNumPart);
+
+/* Write NumPart particles from each rank, whose first index in the IDGenerator is start,
+ * to the blocks of a type at offset. Returns the offset of the next chunk.*/
+int64_t
+write_particle_chunk(IDGenerator * idgen,
+                    const int Type,
+                    BigFile * bf,
+                    const uint64_t FirstID,
+                    struct ic_part_data * curICP,
+                    const int start,
+                    const int NumPart,
+                    const int64_t offset);
+
+/* Receives each chunk of NumPart particles of a type as it is made, whose first index in the IDGenerator is start.*/
+typedef void (*genic_particle_sink)(IDGenerator * idgen, const int ptype, const uint64_t FirstID, struct ic_part_data * ICP, const int start, const int NumPart, void * userdata);
+
+/* Fill NTotal with the total number of particles of each type in the ICs.
+ * Returns the fraction of the neutrino mass in particles.*/
+double genic_particle_totals(int64_t * NTotal);
+
+/* Fill NLocal with the number of particles of each type genic_make_particles makes on this rank.*/
+void genic_count_particles(int * NLocal);
+
+/* Make the particles of the ICs, once the cosmology and power spectrum are initialised.
+ * Each type is written to bf, if not NULL, and passed a chunk at a time to sink, if not NULL. Collective.*/
+void genic_make_particles(BigFile * bf, genic_particle_sink sink, void * userdata);
+
 /*Read a parameter file*/
 void  read_parameterfile(char *fname);
 #endif
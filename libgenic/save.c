@@ -45,41 +45,111 @@ void _bigfile_utils_create_block_from_c_array(BigFile * bf, void * baseptr, char
     }
 }
 
-static void saveblock(BigFile * bf, void * baseptr, int ptype, char * bname, char * dtype, int items_per_particle, const int NumPart, ptrdiff_t elsize) {
+/* Write NumPart elements from each rank to an existing block, starting at offset.
+ * Ranks write in rank order, as for a freshly created block.*/
+static void
+saveblock_at(BigFile * bf, void * baseptr, int ptype, char * bname, char * dtype, int items_per_particle, const int NumPart, ptrdiff_t elsize, int64_t offset, MPI_Comm comm)
+{
+    BigBlock block;
+    BigArray array;
+    BigBlockPtr ptr;
     size_t dims[2];
+    ptrdiff_t strides[2];
     char name[128];
     snprintf(name, 128, "%d/%s", ptype, bname);
 
     dims[0] = NumPart;
     dims[1] = items_per_particle;
-    _bigfile_utils_create_block_from_c_array(bf, baseptr, name, dtype, dims, elsize, MPI_COMM_WORLD);
+    strides[1] = dtype_itemsize(dtype);
+    strides[0] = elsize;
+
+    big_array_init(&array, baseptr, dtype, 2, dims, strides);
+
+    if(0 != big_file_mpi_open_block(bf, &block, name, comm)) {
+        endrun(0, "%s:%s\n", big_file_get_error_message(), name);
+    }
+
+    if(0 != big_block_seek(&block, &ptr, offset)) {
+        endrun(0, "Failed to seek:%s\n", big_file_get_error_message());
+    }
+
+    if(0 != big_block_mpi_write(&block, &ptr, &array, All.IO.NumWriters, comm)) {
+        endrun(0, "Failed to write :%s\n", big_file_get_error_message());
+    }
+
+    if(0 != big_block_mpi_close(&block, comm)) {
+        endrun(0, "%s:%s\n", big_file_get_error_message(), name);
+    }
 }
 
+static void
+createblock(BigFile * bf, int ptype, char * bname, char * dtype, int items_per_particle, int64_t TotNumPart, MPI_Comm comm)
+{
+    BigBlock block;
+    char name[128];
+    snprintf(name, 128, "%d/%s", ptype, bname);
+    if(0 != big_file_mpi_create_block(bf, &block, name, dtype, items_per_particle, All2.NumFiles, TotNumPart, comm)) {
+        endrun(0, "%s:%s\n", big_file_get_error_message(), name);
+    }
+    if(0 != big_block_mpi_close(&block, comm)) {
+        endrun(0, "%s:%s\n", big_file_get_error_message(), name);
+    }
+}
 
 void
-write_particle_data(IDGenerator * idgen,
+create_particle_blocks(BigFile * bf, const int Type, const int64_t TotNumPart)
+{
+    createblock(bf, Type, "PrePosition", "f8", 3, TotNumPart, MPI_COMM_WORLD);
+    createblock(bf, Type, "ICDensity", "f4", 1, TotNumPart, MPI_COMM_WORLD);
+    createblock(bf, Type, "Position", "f8", 3, TotNumPart, MPI_COMM_WORLD);
+    createblock(bf, Type, "Velocity", "f4", 3, TotNumPart, MPI_COMM_WORLD);
+    createblock(bf, Type, "ID", "u8", 1, TotNumPart, MPI_COMM_WORLD);
+}
+
+int64_t
+write_particle_chunk(IDGenerator * idgen,
                     const int Type,
                     BigFile * bf,
                     const uint64_t FirstID,
-                    struct ic_part_data * curICP)
+                    struct ic_part_data * curICP,
+                    const int start,
+                    const int NumPart,
+                    const int64_t offset)
 {
     /* Write particles */
-    saveblock(bf, &curICP[0].PrePos, Type, "PrePosition", "f8", 3, idgen->NumPart, sizeof(curICP[0]));        
-    saveblock(bf, &curICP[0].Density, Type, "ICDensity", "f4", 1, idgen->NumPart, sizeof(curICP[0]));
-    saveblock(bf, &curICP[0].Pos, Type, "Position", "f8", 3, idgen->NumPart, sizeof(curICP[0]));
-    saveblock(bf, &curICP[0].Vel, Type, "Velocity", "f4", 3, idgen->NumPart, sizeof(curICP[0]));
+    saveblock_at(bf, &curICP[0].PrePos, Type, "PrePosition", "f8", 3, NumPart, sizeof(curICP[0]), offset, MPI_COMM_WORLD);
+    saveblock_at(bf, &curICP[0].Density, Type, "ICDensity", "f4", 1, NumPart, sizeof(curICP[0]), offset, MPI_COMM_WORLD);
+    saveblock_at(bf, &curICP[0].Pos, Type, "Position", "f8", 3, NumPart, sizeof(curICP[0]), offset, MPI_COMM_WORLD);
+    saveblock_at(bf, &curICP[0].Vel, Type, "Velocity", "f4", 3, NumPart, sizeof(curICP[0]), offset, MPI_COMM_WORLD);
     /*Generate and write IDs*/
-    uint64_t * ids = mymalloc("IDs", idgen->NumPart * sizeof(uint64_t));
-    memset(ids, 0, idgen->NumPart * sizeof(uint64_t));
+    uint64_t * ids = mymalloc("IDs", NumPart * sizeof(uint64_t));
+    memset(ids, 0, NumPart * sizeof(uint64_t));
     int i;
     #pragma omp parallel for
-    for(i = 0; i < idgen->NumPart; i++)
+    for(i = 0; i < NumPart; i++)
     {
-        ids[i] = idgen_create_id_from_index(idgen, i) + FirstID;
+        ids[i] = idgen_create_id_from_index(idgen, start + i) + FirstID;
     }
-    saveblock(bf, ids, Type, "ID", "u8", 1, idgen->NumPart, sizeof(uint64_t));
+    saveblock_at(bf, ids, Type, "ID", "u8", 1, NumPart, sizeof(uint64_t), offset, MPI_COMM_WORLD);
     myfree(ids);
     walltime_measure("/Write");
+
+    int64_t TotChunk, NumChunk = NumPart;
+    MPI_Allreduce(&NumChunk, &TotChunk, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    return offset + TotChunk;
+}
+
+void
+write_particle_data(IDGenerator * idgen,
+                    const int Type,
+                    BigFile * bf,
+                    const uint64_t FirstID,
+                    struct ic_part_data * curICP)
+{
+    int64_t TotNumPart, NumPart = idgen->NumPart;
+    MPI_Allreduce(&NumPart, &TotNumPart, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    create_particle_blocks(bf, Type, TotNumPart);
+    write_particle_chunk(idgen, Type, bf, FirstID, curICP, 0, idgen->NumPart, 0);
 }
 
 /*Compute the mass array from the cosmology and the total number of particles.*/
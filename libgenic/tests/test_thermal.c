@@ -12,6 +12,7 @@
 #include "stub.h"
 #include <libgadget/config.h>
 #include <libgenic/thermal.h>
+#include <libgenic/philox.h>
 
 /*Check that the neutrino velocity NU_V0 is sensible*/
 static void
@@ -69,10 +70,45 @@ test_thermal_vel(void ** state)
     assert_true( max < MAX_FERMI_DIRAC*100);
 }
 
+/*Check the counter-based generator against the Random123 known answers,
+ * and that thermal velocities drawn from it have the right mean*/
+static void
+test_philox_thermal_vel(void ** state)
+{
+    uint32_t out[4];
+    const uint32_t zero[4] = {0, 0, 0, 0};
+    philox4x32(zero, zero, out);
+    assert_int_equal(out[0], 0x6627e8d5);
+    assert_int_equal(out[3], 0x9b00dbd8);
+    const uint32_t ctr[4] = {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344};
+    const uint32_t key[2] = {0xa4093822, 0x299f31d0};
+    philox4x32(ctr, key, out);
+    assert_int_equal(out[0], 0xd16cfe09);
+    assert_int_equal(out[1], 0x94fdcceb);
+    assert_int_equal(out[2], 0x5001e420);
+    assert_int_equal(out[3], 0x24126ea1);
+
+    struct thermalvel nu_vels;
+    init_thermalvel(&nu_vels, 100, 5000/100, 0);
+    double mean = 0;
+    int64_t id, MaxID = 100000;
+    for(id = 0; id < MaxID; id++) {
+        double u[4];
+        float Vel[3] = {0};
+        philox_uniform(42, 1, id, u);
+        assert_true(u[0] > 0 && u[0] < 1);
+        add_thermal_speeds_uniform(&nu_vels, u, Vel);
+        mean += sqrt(Vel[0]*Vel[0]+Vel[1]*Vel[1]+Vel[2]*Vel[2]);
+    }
+    mean /= MaxID;
+    assert_true(fabs(mean - 3*pow(M_PI,4)/90./1.202057*(7./8)/(3/4.)*100) < 1);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_mean_velocity),
-        cmocka_unit_test(test_thermal_vel)
+        cmocka_unit_test(test_thermal_vel),
+        cmocka_unit_test(test_philox_thermal_vel)
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -103,20 +103,38 @@ init_rng(int Seed, int Nmesh)
     return seedtable;
 }
 
-/* Add a randomly generated thermal speed in v_amp*(min_fd, max_fd) to a 3-velocity.
- * The particle Id is used as a seed for the RNG.*/
-void
-add_thermal_speeds(struct thermalvel * thermals, gsl_rng *g_rng, float Vel[])
+/* Add a thermal speed to a 3-velocity, from three uniform random numbers in [0, 1):
+ * the first picks the speed, the others the direction.
+ * The interpolation accelerator may be NULL, which is needed for thread safety.*/
+static void
+add_thermal_speed_acc(struct thermalvel * thermals, const double u[3], gsl_interp_accel * acc, float Vel[])
 {
-    const double p = gsl_rng_uniform (g_rng);
     /*m_vamp multiples by the dimensional factor to get a velocity again.*/
-    const double v = thermals->m_vamp * gsl_interp_eval(thermals->fd_intp,thermals->fermi_dirac_cumprob, thermals->fermi_dirac_vel, p, thermals->fd_intp_acc);
+    const double v = thermals->m_vamp * gsl_interp_eval(thermals->fd_intp,thermals->fermi_dirac_cumprob, thermals->fermi_dirac_vel, u[0], acc);
 
     /*Random phase*/
-    const double phi = 2 * M_PI * gsl_rng_uniform (g_rng);
-    const double theta = acos(2 * gsl_rng_uniform (g_rng) - 1);
+    const double phi = 2 * M_PI * u[1];
+    const double theta = acos(2 * u[2] - 1);
 
     Vel[0] += v * sin(theta) * cos(phi);
     Vel[1] += v * sin(theta) * sin(phi);
     Vel[2] += v * cos(theta);
 }
+
+/* Add a randomly generated thermal speed in v_amp*(min_fd, max_fd) to a 3-velocity.
+ * The particle Id is used as a seed for the RNG.*/
+void
+add_thermal_speeds(struct thermalvel * thermals, gsl_rng *g_rng, float Vel[])
+{
+    double u[3];
+    int i;
+    for(i = 0; i < 3; i++)
+        u[i] = gsl_rng_uniform (g_rng);
+    add_thermal_speed_acc(thermals, u, thermals->fd_intp_acc, Vel);
+}
+
+void
+add_thermal_speeds_uniform(struct thermalvel * thermals, const double u[3], float Vel[])
+{
+    add_thermal_speed_acc(thermals, u, NULL, Vel);
+}
@@ -27,6 +27,10 @@ init_thermalvel(struct thermalvel * thermals, const double v_amp, double max_fd,
 void
 add_thermal_speeds(struct thermalvel * thermals, gsl_rng *g_rng, float Vel[]);
 
+/*As add_thermal_speeds, but from three given uniform random numbers. Thread safe.*/
+void
+add_thermal_speeds_uniform(struct thermalvel * thermals, const double u[3], float Vel[]);
+
 /*Amplitude of the random velocity for neutrinos*/
 double
 NU_V0(const double Time, const double kBTNubyMNu, const double UnitVelocity_in_cm_per_s);
@@ -16,21 +16,39 @@
 #include <libgadget/utils.h>
 
 #define MESH2K(i) petapm_mesh_to_k(i)
-static void density_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void vel_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void vel_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void vel_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void disp_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void disp_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void disp_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
-static void readout_density(PetaPM * pm, int i, double * mesh, double weight);
-static void readout_vel_x(PetaPM * pm, int i, double * mesh, double weight);
-static void readout_vel_y(PetaPM * pm, int i, double * mesh, double weight);
-static void readout_vel_z(PetaPM * pm, int i, double * mesh, double weight);
-static void readout_disp_x(PetaPM * pm, int i, double * mesh, double weight);
-static void readout_disp_y(PetaPM * pm, int i, double * mesh, double weight);
-static void readout_disp_z(PetaPM * pm, int i, double * mesh, double weight);
-static void gaussian_fill(int Nmesh, PetaPMRegion * region, pfft_complex * rho_k, int UnitaryAmplitude, int InvertPhase);
+static void density_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void vel_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void vel_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void vel_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void disp_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void disp_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void disp_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void readout_density(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_vel_x(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_vel_y(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_vel_z(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_disp_x(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_disp_y(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_disp_z(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void phi_xx_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void phi_yy_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void phi_zz_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void phi_xy_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void phi_xz_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void phi_yz_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void disp2_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void disp2_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void disp2_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value);
+static void readout_phi_xx(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_phi_yy(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_phi_zz(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_phi_xy(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_phi_xz(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_phi_yz(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_disp2_x(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_disp2_y(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void readout_disp2_z(PetaPM * pm, int i, PetaPMReal * mesh, double weight);
+static void gaussian_fill(int Nmesh, PetaPMRegion * region, PetaPMComplex * rho_k, int UnitaryAmplitude, int InvertPhase);
 
 static inline double periodic_wrap(double x)
 {
@@ -90,45 +108,50 @@ idgen_create_pos_from_index(IDGenerator * idgen, int index, double pos[3])
 int
 setup_grid(IDGenerator * idgen, double shift, double mass, struct ic_part_data * ICP)
 {
-    memset(ICP, 0, idgen->NumPart*sizeof(struct ic_part_data));
+    return setup_grid_chunk(idgen, shift, mass, ICP, 0, idgen->NumPart);
+}
+
+int
+setup_grid_chunk(IDGenerator * idgen, double shift, double mass, struct ic_part_data * ICP, int start, int NumPart)
+{
+    memset(ICP, 0, NumPart*sizeof(struct ic_part_data));
 
     int i;
     #pragma omp parallel for
-    for(i = 0; i < idgen->NumPart; i ++) {
-        idgen_create_pos_from_index(idgen, i, &ICP[i].Pos[0]);
+    for(i = 0; i < NumPart; i ++) {
+        idgen_create_pos_from_index(idgen, start + i, &ICP[i].Pos[0]);
         ICP[i].Pos[0] += shift;
         ICP[i].Pos[1] += shift;
         ICP[i].Pos[2] +=  shift;
         ICP[i].Mass = mass;
     }
-    return idgen->NumPart;
+    return NumPart;
 }
 
-struct ic_prep_data
-{
-    struct ic_part_data * curICP;
-    int NumPart;
-};
-
+/* Find the mesh region covered by the particles in a PetaPMParticleStruct, passed as userdata.*/
 static PetaPMRegion * makeregion(PetaPM * pm, void * userdata, int * Nregions) {
     PetaPMRegion * regions = mymalloc2("Regions", sizeof(PetaPMRegion));
-    struct ic_prep_data * icprep = (struct ic_prep_data *) userdata;
-    int NumPart = icprep->NumPart;
-    struct ic_part_data * ICP = icprep->curICP;
+    PetaPMParticleStruct * pstruct = (PetaPMParticleStruct *) userdata;
+    int NumPart = pstruct->NumPart;
     int k;
     int r = 0;
     int i;
     double min[3] = {All.BoxSize, All.BoxSize, All.BoxSize};
     double max[3] = {0, 0, 0.};
+    /* A rank with no particles in this chunk still takes part in the FFTs, with a minimal region.*/
+    if(NumPart == 0)
+        min[0] = min[1] = min[2] = 0;
 
     for(i = 0; i < NumPart; i ++) {
+        char * part = (char *) pstruct->Parts + i * pstruct->elsize;
+        double * Pos = (double *) (part + pstruct->offset_pos);
         for(k = 0; k < 3; k ++) {
-            if(min[k] > ICP[i].Pos[k])
-                min[k] = ICP[i].Pos[k];
-            if(max[k] < ICP[i].Pos[k])
-                max[k] = ICP[i].Pos[k];
+            if(min[k] > Pos[k])
+                min[k] = Pos[k];
+            if(max[k] < Pos[k])
+                max[k] = Pos[k];
         }
-        ICP[i].RegionInd = 0;
+        *(int *) (part + pstruct->offset_regionind) = 0;
     }
 
     for(k = 0; k < 3; k ++) {
@@ -145,9 +168,112 @@ static PetaPMRegion * makeregion(PetaPM * pm, void * userdata, int * Nregions) {
 
 /*Global to pass type to *_transfer functions*/
 static enum TransferType ptype;
+
+/* The velocity transfer is the displacement transfer with DeltaSpec replaced by dlogGrowth,
+ * so their ratio is the growth rate f(k). If f(k) is constant to within tol over the
+ * wavenumbers on the mesh, return its mean, so the velocities can be copied from the
+ * displacements. Otherwise return 0.*/
+static double
+single_growth_rate(enum TransferType Type, const double tol)
+{
+    const int nsample = 256;
+    const double kmin = 2 * M_PI / All.BoxSize;
+    const double kmax = sqrt(3) * M_PI * All.Nmesh / All.BoxSize;
+    double fmin = 0, fmax = 0, fsum = 0;
+    int i, n = 0;
+    for(i = 0; i < nsample; i++) {
+        const double kmag = kmin * pow(kmax / kmin, i / (nsample - 1.));
+        const double delta = DeltaSpec(kmag, Type);
+        if(delta == 0)
+            continue;
+        const double f = dlogGrowth(kmag, Type) / delta;
+        if(n == 0 || f < fmin)
+            fmin = f;
+        if(n == 0 || f > fmax)
+            fmax = f;
+        fsum += f;
+        n++;
+    }
+    if(n == 0)
+        return 0;
+    const double fmean = fsum / n;
+    message(0, "Type = %d velocity growth rate varies from %g to %g over the mesh\n", Type, fmin, fmax);
+    if(fmean <= 0 || fmax - fmin > tol * fmean)
+        return 0;
+    return fmean;
+}
 /*Global to pass the particle data to the readout functions*/
 static struct ic_part_data * curICP;
 
+/* Per particle data for the second order displacements: the Lagrangian position,
+ * the second derivatives of the first order potential, phi_ij, in the order xx, yy, zz, xy, xz, yz,
+ * the second order source term, painted as a mass, and the second order displacement.*/
+struct lpt_part
+{
+    double Pos[3];
+    float PhiIJ[6];
+    float Source;
+    int RegionInd;
+    float Disp2[3];
+};
+static struct lpt_part * curLPT;
+/* Converts the transform of the painted source to the second order displacement*/
+static double disp2_norm;
+
+/* Second order Lagrangian displacements. The first order potential satisfies nabla^2 phi = delta
+ * and the second order potential nabla^2 phi2 = sum_{i<j} (phi_ii phi_jj - phi_ij^2).
+ * The second order displacement is - 3/7 Omega(a)^{-1/143} grad phi2, and its velocity
+ * grows as 2 Omega(a)^{6/11}. The phi_ij are read out at the Lagrangian positions with the first order fields,
+ * the source is painted back to the mesh from there, and one more forward transform gives phi2.
+ * This needs all particles of the type in memory at once.*/
+static void
+second_order_displacements(PetaPM * pm, struct lpt_part * lpt, const int NumPart)
+{
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < NumPart; i++) {
+        const float * phi = lpt[i].PhiIJ;
+        lpt[i].Source = phi[0] * phi[1] + phi[0] * phi[2] + phi[1] * phi[2]
+                    - phi[3] * phi[3] - phi[4] * phi[4] - phi[5] * phi[5];
+        memset(lpt[i].Disp2, 0, sizeof(lpt[i].Disp2));
+    }
+
+    PetaPMParticleStruct pstruct = {
+        lpt,
+        sizeof(lpt[0]),
+        ((char*) &lpt[0].Pos[0]) - (char*) lpt,
+        ((char*) &lpt[0].Source) - (char*) lpt,
+        ((char*) &lpt[0].RegionInd) - (char*) lpt,
+        NULL,
+        NumPart,
+    };
+
+    PetaPMFunctions functions[] = {
+        {"Disp2X", disp2_x_transfer, readout_disp2_x},
+        {"Disp2Y", disp2_y_transfer, readout_disp2_y},
+        {"Disp2Z", disp2_z_transfer, readout_disp2_z},
+        {NULL, NULL, NULL },
+    };
+    PetaPMGlobalFunctions global_functions = {0};
+
+    /* The painted source sums over the particles in each cell, so dividing by the total number of
+     * particles makes it the mean source per cell and normalises the backward transform.*/
+    int64_t NumPartTot = NumPart;
+    MPI_Allreduce(MPI_IN_PLACE, &NumPartTot, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    const double hubble_a = hubble_function(&All.CP, All.TimeIC) / All.CP.Hubble;
+    const double Omega_a = All.CP.Omega0 / (pow(All.TimeIC, 3) * hubble_a * hubble_a);
+    disp2_norm = 3. / 7 * pow(Omega_a, -1./143) / NumPartTot;
+
+    curLPT = lpt;
+    PetaPMRegion * regions = petapm_force_init(pm, makeregion, &pstruct, &pstruct);
+    PetaPMComplex * rho_k = petapm_force_r2c(pm, &global_functions);
+    petapm_force_c2r(pm, rho_k, regions, functions);
+    myfree(rho_k);
+    myfree(regions);
+    petapm_force_finish(pm);
+    walltime_measure("/Disp/LPT2");
+}
+
 void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_data * dispICP, const int NumPart) {
 
     /*MUST set this before doing force.*/
@@ -172,23 +298,33 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
         curICP[i].Density = 0;
     }
 
+    /* Second order displacements for the matter. Neutrinos free-stream, so stay first order.*/
+    const int lpt2 = All2.LPTOrder > 1 && Type != DELTA_NU;
+    struct lpt_part * lpt = NULL;
+    if(lpt2) {
+        lpt = (struct lpt_part *) mymalloc("LPTPart", (NumPart + 1) * sizeof(struct lpt_part));
+        #pragma omp parallel for
+        for(i = 0; i < NumPart; i++) {
+            memset(&lpt[i], 0, sizeof(lpt[i]));
+            memcpy(lpt[i].Pos, curICP[i].Pos, sizeof(lpt[i].Pos));
+        }
+        curLPT = lpt;
+    }
 
     /* This reads out the displacements into P.Disp and the velocities into P.Vel.
      * Disp is used to avoid changing the particle positions mid-way through.
      * Note that for the velocities we do NOT just use the velocity transfer functions.
      * The reason is because of the gauge: velocity transfer is in synchronous gauge for CLASS,
      * newtonian gauge for CAMB. But we want N-body gauge, which we get by taking the time derivative
-     * of the synchronous gauge density perturbations. See arxiv:1505.04756*/
-    PetaPMFunctions functions[] = {
+     * of the synchronous gauge density perturbations. See arxiv:1505.04756
+     * For second order LPT the phi_ij follow, so that all the first pass transforms are batched together.*/
+    PetaPMFunctions functions[14] = {
         {"Density", density_transfer, readout_density},
         {"DispX", disp_x_transfer, readout_disp_x},
         {"DispY", disp_y_transfer, readout_disp_y},
         {"DispZ", disp_z_transfer, readout_disp_z},
-        {"VelX", vel_x_transfer, readout_vel_x},
-        {"VelY", vel_y_transfer, readout_vel_y},
-        {"VelZ", vel_z_transfer, readout_vel_z},
-        {NULL, NULL, NULL },
     };
+    int nfunc = 4;
 
     /*Set up the velocity pre-factors*/
     const double hubble_a = hubble_function(&All.CP, All.TimeIC);
@@ -201,21 +337,55 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
     } else {
         vel_prefac /= sqrt(All.TimeIC);	/* converts to Gadget velocity */
     }
+    /* The second order growth rate is 2 Omega(a)^{6/11}*/
+    const double Omega_a = All.CP.Omega0 / (pow(All.TimeIC, 3) * pow(hubble_a / All.CP.Hubble, 2));
+    const double vel2_prefac = vel_prefac * 2 * pow(Omega_a, 6./11);
 
+    /* Copy the displacements to the velocities, rather than doing the velocity transfers?*/
+    int vel_from_disp = 0;
     if(!All2.PowerP.ScaleDepVelocity) {
         vel_prefac *= F_Omega(&All.CP, All.TimeIC);
-        /* If different transfer functions are disabled, we can copy displacements to velocities
-         * and we don't need the extra transfers.*/
-        functions[4].name = NULL;
+        vel_from_disp = 1;
     }
+    else if(All2.PowerP.ScaleDepVelocityTol > 0) {
+        const double growth = single_growth_rate(ptype, All2.PowerP.ScaleDepVelocityTol);
+        if(growth > 0) {
+            message(0, "Using a single velocity growth rate %g for type %d\n", growth, ptype);
+            vel_prefac *= growth;
+            vel_from_disp = 1;
+        }
+    }
+    /* If the growth is scale independent, we can copy displacements to velocities
+     * and we don't need the extra transfers.*/
+    if(!vel_from_disp) {
+        PetaPMFunctions vel[3] = {
+            {"VelX", vel_x_transfer, readout_vel_x},
+            {"VelY", vel_y_transfer, readout_vel_y},
+            {"VelZ", vel_z_transfer, readout_vel_z},
+        };
+        memcpy(&functions[nfunc], vel, sizeof(vel));
+        nfunc += 3;
+    }
+    if(lpt2) {
+        PetaPMFunctions phi[6] = {
+            {"PhiXX", phi_xx_transfer, readout_phi_xx},
+            {"PhiYY", phi_yy_transfer, readout_phi_yy},
+            {"PhiZZ", phi_zz_transfer, readout_phi_zz},
+            {"PhiXY", phi_xy_transfer, readout_phi_xy},
+            {"PhiXZ", phi_xz_transfer, readout_phi_xz},
+            {"PhiYZ", phi_yz_transfer, readout_phi_yz},
+        };
+        memcpy(&functions[nfunc], phi, sizeof(phi));
+        nfunc += 6;
+    }
+    functions[nfunc].name = NULL;
 
-    struct ic_prep_data icprep = {dispICP, NumPart};
     PetaPMRegion * regions = petapm_force_init(pm,
            makeregion,
-           &pstruct, &icprep);
+           &pstruct, &pstruct);
 
     /*This allocates the memory*/
-    pfft_complex * rho_k = petapm_alloc_rhok(pm);
+    PetaPMComplex * rho_k = petapm_alloc_rhok(pm);
 
     gaussian_fill(pm->Nmesh, petapm_get_fourier_region(pm),
 		  rho_k, All2.UnitaryAmplitude, All2.InvertPhase);
@@ -226,6 +396,9 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
     myfree(regions);
     petapm_force_finish(pm);
 
+    if(lpt2)
+        second_order_displacements(pm, lpt, NumPart);
+
     double maxdisp = 0, maxvel = 0;
 
     #pragma omp parallel for reduction(max:maxdisp, maxvel)
@@ -235,21 +408,27 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
         double absv = 0;
         for(k = 0; k < 3; k++)
         {
+            /*Copy displacements to velocities if not done already*/
+            if(vel_from_disp)
+                curICP[i].Vel[k] = curICP[i].Disp[k];
+            curICP[i].Vel[k] *= vel_prefac;
+            if(lpt2) {
+                curICP[i].Disp[k] += lpt[i].Disp2[k];
+                curICP[i].Vel[k] += vel2_prefac * lpt[i].Disp2[k];
+            }
             double dis = curICP[i].Disp[k];
             if(dis > maxdisp)
                 maxdisp = dis;
             /*Copy displacements to positions.*/
             curICP[i].Pos[k] += curICP[i].Disp[k];
-            /*Copy displacements to velocities if not done already*/
-            if(!All2.PowerP.ScaleDepVelocity)
-                curICP[i].Vel[k] = curICP[i].Disp[k];
-            curICP[i].Vel[k] *= vel_prefac;
             absv += curICP[i].Vel[k] * curICP[i].Vel[k];
             curICP[i].Pos[k] = periodic_wrap(curICP[i].Pos[k]);
         }
         if(absv > maxvel)
             maxvel = absv;
     }
+    if(lpt2)
+        myfree(lpt);
     MPI_Allreduce(MPI_IN_PLACE, &maxdisp, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
     message(0, "Type = %d max disp = %g in units of cell sep %g \n", ptype, maxdisp, maxdisp / (All.BoxSize / All.Nmesh) );
 
@@ -271,7 +450,7 @@ void displacement_fields(PetaPM * pm, enum TransferType Type, struct ic_part_dat
  *
  *********************/
 
-static void density_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void density_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     if(k2) {
         /* density is smoothed in k space by a gaussian kernel of 1 mesh grid */
         double r2 = 1.0 / All.Nmesh;
@@ -286,7 +465,7 @@ static void density_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex
     }
 }
 
-static void disp_transfer(PetaPM * pm, int64_t k2, int kaxis, pfft_complex * value, int include_growth) {
+static void disp_transfer(PetaPM * pm, int64_t k2, int kaxis, PetaPMComplex * value, int include_growth) {
     if(k2) {
         double fac = 1./ (2 * M_PI) / sqrt(All.BoxSize) * kaxis / k2;
         /*
@@ -310,54 +489,135 @@ static void disp_transfer(PetaPM * pm, int64_t k2, int kaxis, pfft_complex * val
     }
 }
 
-static void vel_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void vel_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     disp_transfer(pm, k2, kpos[0], value, 1);
 }
-static void vel_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void vel_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     disp_transfer(pm, k2, kpos[1], value, 1);
 }
-static void vel_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void vel_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     disp_transfer(pm, k2, kpos[2], value, 1);
 }
 
-static void disp_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void disp_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     disp_transfer(pm, k2, kpos[0], value, 0);
 }
-static void disp_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void disp_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     disp_transfer(pm, k2, kpos[1], value, 0);
 }
-static void disp_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value) {
+static void disp_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
     disp_transfer(pm, k2, kpos[2], value, 0);
 }
 
+/* Second derivative phi_ij of the first order potential: k_i k_j delta / k^2.*/
+static void phi_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value, int i, int j) {
+    if(k2) {
+        double kmag = sqrt(k2) * 2 * M_PI / All.BoxSize;
+        double fac = (double) kpos[i] * kpos[j] / k2;
+        fac *= DeltaSpec(kmag, ptype) / sqrt(All.BoxSize * All.BoxSize * All.BoxSize);
+        value[0][0] *= fac;
+        value[0][1] *= fac;
+    }
+}
+static void phi_xx_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
+    phi_transfer(pm, k2, kpos, value, 0, 0);
+}
+static void phi_yy_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
+    phi_transfer(pm, k2, kpos, value, 1, 1);
+}
+static void phi_zz_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
+    phi_transfer(pm, k2, kpos, value, 2, 2);
+}
+static void phi_xy_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
+    phi_transfer(pm, k2, kpos, value, 0, 1);
+}
+static void phi_xz_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
+    phi_transfer(pm, k2, kpos, value, 0, 2);
+}
+static void phi_yz_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
+    phi_transfer(pm, k2, kpos, value, 1, 2);
+}
+
+/* Second order displacement from the transform of the painted source: 3/7 Omega^{-1/143} i k S / k^2.*/
+static void disp2_transfer(PetaPM * pm, int64_t k2, int kaxis, PetaPMComplex * value) {
+    if(k2) {
+        double fac = All.BoxSize / (2 * M_PI) * kaxis / k2 * disp2_norm;
+        double tmp = value[0][0];
+        value[0][0] = - value[0][1] * fac;
+        value[0][1] = tmp * fac;
+    }
+    else {
+        value[0][0] = 0;
+        value[0][1] = 0;
+    }
+}
+
+static void disp2_x_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
+    disp2_transfer(pm, k2, kpos[0], value);
+}
+static void disp2_y_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
+    disp2_transfer(pm, k2, kpos[1], value);
+}
+static void disp2_z_transfer(PetaPM * pm, int64_t k2, int kpos[3], PetaPMComplex * value) {
+    disp2_transfer(pm, k2, kpos[2], value);
+}
+
 /**************
  * functions iterating over particle / mesh pairs
  ***************/
-static void readout_density(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_density(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Density += weight * mesh[0];
 }
-static void readout_vel_x(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_vel_x(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Vel[0] += weight * mesh[0];
 }
-static void readout_vel_y(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_vel_y(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Vel[1] += weight * mesh[0];
 }
-static void readout_vel_z(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_vel_z(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Vel[2] += weight * mesh[0];
 }
 
-static void readout_disp_x(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_disp_x(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Disp[0] += weight * mesh[0];
 }
-static void readout_disp_y(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_disp_y(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Disp[1] += weight * mesh[0];
 }
-static void readout_disp_z(PetaPM * pm, int i, double * mesh, double weight) {
+static void readout_disp_z(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
     curICP[i].Disp[2] += weight * mesh[0];
 }
 
+static void readout_phi_xx(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    curLPT[i].PhiIJ[0] += weight * mesh[0];
+}
+static void readout_phi_yy(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    curLPT[i].PhiIJ[1] += weight * mesh[0];
+}
+static void readout_phi_zz(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    curLPT[i].PhiIJ[2] += weight * mesh[0];
+}
+static void readout_phi_xy(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    curLPT[i].PhiIJ[3] += weight * mesh[0];
+}
+static void readout_phi_xz(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    curLPT[i].PhiIJ[4] += weight * mesh[0];
+}
+static void readout_phi_yz(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    curLPT[i].PhiIJ[5] += weight * mesh[0];
+}
+static void readout_disp2_x(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    curLPT[i].Disp2[0] += weight * mesh[0];
+}
+static void readout_disp2_y(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    curLPT[i].Disp2[1] += weight * mesh[0];
+}
+static void readout_disp2_z(PetaPM * pm, int i, PetaPMReal * mesh, double weight) {
+    curLPT[i].Disp2[2] += weight * mesh[0];
+}
+
 static void
-gaussian_fill(int Nmesh, PetaPMRegion * region, pfft_complex * rho_k, int setUnitaryAmplitude, int setInvertPhase)
+gaussian_fill(int Nmesh, PetaPMRegion * region, PetaPMComplex * rho_k, int setUnitaryAmplitude, int setInvertPhase)
 {
     /* fastpm deals with strides properly; petapm not. So we translate it here. */
     PMDesc pm[1];
@@ -377,7 +637,10 @@ gaussian_fill(int Nmesh, PetaPMRegion * region, pfft_complex * rho_k, int setUni
     pm->ORegion.strides[2] = region->strides[1];
 
     pm->ORegion.total = region->totalsize;
-    pmic_fill_gaussian_gadget(pm, (double*) rho_k, All2.Seed, setUnitaryAmplitude, setInvertPhase);
+    if(All2.CounterRNG)
+        pmic_fill_gaussian_philox(pm, (double*) rho_k, All2.Seed, setUnitaryAmplitude, setInvertPhase);
+    else
+        pmic_fill_gaussian_gadget(pm, (double*) rho_k, All2.Seed, setUnitaryAmplitude, setInvertPhase);
 
 #if 0
     /* dump the gaussian field for debugging
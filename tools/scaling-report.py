@@ -0,0 +1,112 @@
+"""Summarise a set of scaling runs made by benchmarks/scaling.sh.
+
+Each run directory holds the cpu.txt and treewalk.csv written by MP-Gadget.
+The report lists, for each run, the wall time of the whole run and of the
+top level timers in cpu.txt, and the total time in each treewalk, with the
+parallel efficiency relative to the run with the fewest ranks.
+For weak scaling the efficiency is t_0 / t, for strong scaling it is t_0 N_0 / (t N).
+If matplotlib is available the efficiency curves are also plotted."""
+
+import argparse
+import re
+
+def parse_cpu(fname):
+    """Read the last step of a cpu.txt. Returns the number of ranks, threads,
+    elapsed time and a dictionary of the cumulative mean time of the top level timers."""
+    step = None
+    with open(fname) as fd:
+        lines = fd.readlines()
+    for i, line in enumerate(lines):
+        if line.startswith("Step "):
+            step = i
+    if step is None:
+        raise IOError("No steps in %s" % fname)
+    header = re.match(r"Step (\d+), Time: (\S+), MPIs: (\d+) Threads: (\d+) Elapsed: (\S+)", lines[step])
+    nstep, ranks, threads, elapsed = int(header.group(1)), int(header.group(3)), int(header.group(4)), float(header.group(5))
+    timers = {}
+    for line in lines[step+1:]:
+        if line.startswith("Step "):
+            break
+        #Top level timers are indented by one space.
+        if not line.startswith(" ") or line.startswith("  "):
+            continue
+        fields = line.split()
+        try:
+            timers[fields[0]] = float(fields[1])
+        except (IndexError, ValueError):
+            continue
+    return {"steps": nstep, "ranks": ranks, "threads": threads, "elapsed": elapsed, "timers": timers}
+
+def parse_treewalk(fname):
+    """Sum the mean wall time of each treewalk over all steps in a treewalk.csv."""
+    totals = {}
+    try:
+        with open(fname) as fd:
+            for line in fd:
+                if line.startswith("#"):
+                    continue
+                fields = [f.strip() for f in line.split(",")]
+                #step, time, label, nwork, interactions/work, exports/work, iterations, min, mean, max, ...
+                totals[fields[2]] = totals.get(fields[2], 0) + float(fields[8])
+    except IOError:
+        pass
+    return totals
+
+def efficiency(times, ranks, mode):
+    """Parallel efficiency relative to the first entry."""
+    if mode == "weak":
+        return [times[0] / t for t in times]
+    return [times[0] * ranks[0] / (t * n) for t, n in zip(times, ranks)]
+
+def report(rundirs, mode, output=None):
+    """Print the scaling table and optionally write it, and a plot, to output.txt and output.png."""
+    runs = []
+    for rundir in rundirs:
+        run = parse_cpu(rundir + "/cpu.txt")
+        run["treewalk"] = parse_treewalk(rundir + "/treewalk.csv")
+        run["dir"] = rundir
+        runs.append(run)
+    runs.sort(key=lambda r: r["ranks"] * r["threads"])
+    cores = [r["ranks"] * r["threads"] for r in runs]
+    timers = sorted(set.union(*[set(r["timers"]) for r in runs]))
+    walks = sorted(set.union(*[set(r["treewalk"]) for r in runs]))
+
+    curves = {"Total": [r["elapsed"] for r in runs]}
+    for t in timers:
+        curves[t] = [r["timers"].get(t, float('nan')) for r in runs]
+    for w in walks:
+        curves["treewalk:" + w] = [r["treewalk"].get(w, float('nan')) for r in runs]
+
+    out = ["# %s scaling: wall time (s) and efficiency" % mode,
+           "%-28s" % "# ranks x threads" + "".join(["%20s" % ("%d x %d" % (r["ranks"], r["threads"])) for r in runs])]
+    for name, times in curves.items():
+        eff = efficiency(times, cores, mode)
+        out.append("%-28s" % name + "".join(["%12.2f (%4.2f)" % (t, e) for t, e in zip(times, eff)]))
+    print("\n".join(out))
+
+    if output is None:
+        return curves
+    with open(output + ".txt", "w") as fd:
+        fd.write("\n".join(out) + "\n")
+    try:
+        import matplotlib
+        matplotlib.use("Agg")
+        import matplotlib.pyplot as plt
+    except ImportError:
+        return curves
+    for name in ["Total"] + timers:
+        plt.semilogx(cores, efficiency(curves[name], cores, mode), "o-", label=name)
+    plt.xlabel("Cores")
+    plt.ylabel("%s scaling efficiency" % mode)
+    plt.ylim(0, 1.2)
+    plt.legend(loc="lower left", fontsize="small")
+    plt.savefig(output + ".png")
+    return curves
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("rundirs", nargs="+", help="Output directories of the scaling runs")
+    parser.add_argument("--mode", choices=["weak", "strong"], default="weak", help="Type of scaling")
+    parser.add_argument("--output", default=None, help="Write the report to OUTPUT.txt and the plot to OUTPUT.png")
+    args = parser.parse_args()
+    report(args.rundirs, args.mode, args.output)